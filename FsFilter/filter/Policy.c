@@ -0,0 +1,743 @@
+﻿/*++
+
+Module Name:
+
+    Policy.c
+
+Abstract:
+
+    This module decides whether a file name falls under a protected
+    folder and whether a process image is on the list of processes
+    allowed to change protected files.  The process list is compiled
+    into an FF_PROCESS_TABLE as it is parsed, so that a check costs one
+    walk over the end of the image path however long the list.  The
+    protected extensions are kept in a collision free hash table, see
+    PolicySetExtensions, and the policy rules that can overrule both
+    lists in a table indexed by operation, see PolicySetRules.
+
+    The lists are built and locked by fsFilter.c, or by fanFilter.c in
+    the Linux backend; the routines here only walk them.  They take names
+    rather than callback data and query nothing themselves; the callbacks
+    look the names up.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+#include <wchar.h>
+
+#include "minispy.h"
+#include "Policy.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, PolicyMatchProcess)
+#pragma alloc_text(PAGE, PolicySetExtensions)
+#pragma alloc_text(PAGE, PolicySetRules)
+#pragma alloc_text(PAGE, PolicyEvaluateRules)
+#endif
+
+//
+//  Characters outside ASCII are left to _wcsnicmp.
+//
+
+#define PolicyMayEqual(Char, Folded) \
+	((Char) >= 0x80 || (Folded) >= 0x80 || PolicyFoldAscii(Char) == (Folded))
+
+
+BOOLEAN
+RtlFindSubString(__in const PUNICODE_STRING String, __in const UNICODE_STRING *SubString)
+/*++
+
+Routine Description:
+This routine looks to see if SubString is a substring of String, ignoring
+case as _wcsnicmp does.  A position is only compared in full when its
+first and last characters could match those of SubString, which for
+ASCII names rules out nearly every position at the cost of two
+character tests.  _wcsnicmp stops at a NUL, so if SubString holds one
+the character tested in place of the last is the first NUL.
+
+Arguments:
+String - the string to search in
+SubString - the substring to find in String
+
+Return Value:
+Returns TRUE if the substring is found in string and FALSE
+otherwise.
+
+--*/
+{
+	USHORT index;
+	USHORT length = SubString->Length/2;
+	USHORT lastIndex;
+	WCHAR first;
+	WCHAR last;
+
+	if (length == 0) {
+
+		return TRUE;
+	}
+
+	for (lastIndex = 0; lastIndex < length - 1 && SubString->Buffer[lastIndex] != UNICODE_NULL; lastIndex++) {
+	}
+
+	first = PolicyFoldAscii(SubString->Buffer[0]);
+	last = PolicyFoldAscii(SubString->Buffer[lastIndex]);
+
+	for (index = 0; index + length <= String->Length/2; index++) {
+
+		if (!PolicyMayEqual(String->Buffer[index], first) ||
+		    !PolicyMayEqual(String->Buffer[index + lastIndex], last)) {
+
+			continue;
+		}
+
+		if (_wcsnicmp(&String->Buffer[index], SubString->Buffer, length) == 0) {
+
+			//
+			// SubString is found in String, so return TRUE.
+			//
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+BOOLEAN
+PolicyMatchFolder(__in PFF_LIST_CONTEXT Folders, __in PUNICODE_STRING FileName)
+/*++
+
+Routine Description:
+Checks whether a file name contains any of the protected folder names.
+
+Arguments:
+Folders - the protected folders
+FileName - the normalized name of the file
+
+Return Value:
+TRUE if the file is protected.
+
+--*/
+{
+	while (Folders) {
+
+		if (RtlFindSubString(FileName, &Folders->item)) {
+
+			return TRUE;
+		}
+
+		Folders = Folders->head;
+	}
+
+	return FALSE;
+}
+
+
+//
+//  The hash of a name taken from its last character back, so that the
+//  hash of every suffix of an image path comes from the one before it.
+//
+
+#define PolicyHashStep(Hash, Char) ((Hash) * 31 + (Char))
+
+static
+BOOLEAN
+PolicyIsWildcard(__in WCHAR Char)
+{
+	return (BOOLEAN)(Char == L'*' || Char == L'?' ||
+	                 Char == DOS_STAR || Char == DOS_QM || Char == DOS_DOT);
+}
+
+
+VOID
+PolicyClearProcesses(__out PFF_PROCESS_TABLE Processes)
+/*++
+
+Routine Description:
+Empties the table.  The entries themselves are left to the list.
+
+Arguments:
+Processes - the table
+
+Return Value:
+None.
+
+--*/
+{
+	RtlZeroMemory(Processes, sizeof(FF_PROCESS_TABLE));
+}
+
+
+VOID
+PolicyAddProcess(__inout PFF_PROCESS_TABLE Processes, __inout PFF_LIST_CONTEXT Process)
+/*++
+
+Routine Description:
+Adds an allowed process expression to the table, hashed by the name
+after its leading "*" if that name has no wildcards, otherwise with the
+expressions that have.
+
+Arguments:
+Processes - the table
+Process - the expression, which stays on its list
+
+Return Value:
+None.
+
+--*/
+{
+	USHORT length = Process->item.Length / sizeof(WCHAR);
+	USHORT index;
+	ULONG hash = 0;
+
+	if (length < 2 || length - 1 > FF_PROCESS_MAX_SUFFIX ||
+	    Process->item.Buffer[0] != L'*') {
+
+		goto PolicyAddProcess_Wildcard;
+	}
+
+	for (index = length - 1; index > 0; index--) {
+
+		if (PolicyIsWildcard(Process->item.Buffer[index])) {
+
+			goto PolicyAddProcess_Wildcard;
+		}
+
+		hash = PolicyHashStep(hash, Process->item.Buffer[index]);
+	}
+
+	length--;
+
+	Process->hash = hash;
+	Process->next = Processes->buckets[hash % FF_PROCESS_BUCKETS];
+	Processes->buckets[hash % FF_PROCESS_BUCKETS] = Process;
+
+	Processes->lengths[length / 32] |= 1 << (length % 32);
+
+	if (length > Processes->maxLength) {
+
+		Processes->maxLength = length;
+	}
+
+	return;
+
+PolicyAddProcess_Wildcard:
+
+	Process->next = Processes->wildcards;
+	Processes->wildcards = Process;
+}
+
+
+BOOLEAN
+PolicyMatchProcess(__in PFF_PROCESS_TABLE Processes, __in PUNICODE_STRING ImageName)
+/*++
+
+Routine Description:
+Checks whether a process image matches any of the allowed process
+expressions.  The names are looked up by suffix in a single walk back
+from the end of the image path, stopping at the first match; only the
+expressions with wildcards of their own are tried one by one.
+
+Arguments:
+Processes - the allowed processes
+ImageName - the full image name of the process
+
+Return Value:
+TRUE if the process may change protected files.
+
+--*/
+{
+	PFF_LIST_CONTEXT process;
+	USHORT imageLength = ImageName->Length / sizeof(WCHAR);
+	USHORT length;
+	ULONG hash = 0;
+
+	PAGED_CODE();
+
+	for (length = 1; length <= Processes->maxLength && length <= imageLength; length++) {
+
+		hash = PolicyHashStep(hash, ImageName->Buffer[imageLength - length]);
+
+		if (!(Processes->lengths[length / 32] & (1 << (length % 32)))) {
+
+			continue;
+		}
+
+		for (process = Processes->buckets[hash % FF_PROCESS_BUCKETS]; process; process = process->next) {
+
+			//
+			//  The name follows the "*", and matches exactly, as
+			//  FsRtlIsNameInExpression does when not ignoring case.
+			//
+
+			if (process->hash == hash &&
+			    process->item.Length == (length + 1) * sizeof(WCHAR) &&
+			    RtlEqualMemory(&process->item.Buffer[1],
+			                   &ImageName->Buffer[imageLength - length],
+			                   length * sizeof(WCHAR))) {
+
+				return TRUE;
+			}
+		}
+	}
+
+	for (process = Processes->wildcards; process; process = process->next) {
+
+		if (FsRtlIsNameInExpression(&process->item, ImageName, FALSE, NULL)) {
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+//
+//  The extensions are hashed case folded, FNV-1a from the seed.  The low
+//  bits of FNV-1a depend only on the low bits of each character, so the
+//  high half is folded in before taking the slot; otherwise characters
+//  a multiple of FF_EXTENSION_SLOTS apart would share a slot under every
+//  seed.
+//
+
+#define PolicyExtensionStep(Hash, Char) (((Hash) ^ (Char)) * 16777619)
+
+#define FF_EXTENSION_SEEDS      4096
+
+static
+ULONG
+PolicyExtensionSlot(__in ULONG Seed, __in PFF_EXTENSION Extension)
+{
+	ULONG hash = Seed;
+	USHORT index;
+
+	for (index = 0; index < Extension->length; index++) {
+
+		hash = PolicyExtensionStep(hash, Extension->name[index]);
+	}
+
+	return (hash ^ (hash >> 16)) % FF_EXTENSION_SLOTS;
+}
+
+
+NTSTATUS
+PolicySetExtensions(__out PFF_EXTENSION_TABLE Extensions, __in PUNICODE_STRING List)
+/*++
+
+Routine Description:
+Replaces the protected extensions with those of a list, one to a line,
+with or without the leading dot.  Blank lines and repeats are skipped.
+The extensions are folded to upper case and a seed is searched for under
+which no two of them share a slot; with at most FF_EXTENSION_MAX of them
+in FF_EXTENSION_SLOTS slots a handful of seeds is usually enough.
+
+Arguments:
+Extensions - the table, left empty on failure
+List - the extensions
+
+Return Value:
+STATUS_SUCCESS, STATUS_INVALID_PARAMETER if there are too many
+extensions or one is too long, or STATUS_UNSUCCESSFUL if no seed was
+found.
+
+--*/
+{
+	USHORT chars = List->Length / sizeof(WCHAR);
+	USHORT index = 0;
+	USHORT start;
+	USHORT length;
+	ULONG extension;
+	ULONG seed;
+	ULONG slot;
+	FF_EXTENSION folded;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(Extensions, sizeof(FF_EXTENSION_TABLE));
+
+	while (index < chars) {
+
+		start = index;
+
+		while (index < chars && List->Buffer[index] != L'\n' && List->Buffer[index] != UNICODE_NULL) {
+
+			index++;
+		}
+
+		length = index - start;
+		index++;
+
+		while (length > 0 && (List->Buffer[start + length - 1] == L'\r' || List->Buffer[start + length - 1] == L' ')) {
+
+			length--;
+		}
+
+		if (length > 0 && List->Buffer[start] == L'.') {
+
+			start++;
+			length--;
+		}
+
+		if (length == 0) {
+
+			continue;
+		}
+
+		if (length > FF_EXTENSION_CHARS) {
+
+			RtlZeroMemory(Extensions, sizeof(FF_EXTENSION_TABLE));
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		folded.length = length;
+
+		for (extension = 0; extension < length; extension++) {
+
+			folded.name[extension] = RtlUpcaseUnicodeChar(List->Buffer[start + extension]);
+		}
+
+		for (extension = 0; extension < Extensions->count; extension++) {
+
+			if (Extensions->extensions[extension].length == length &&
+			    RtlEqualMemory(Extensions->extensions[extension].name, folded.name, length * sizeof(WCHAR))) {
+
+				break;
+			}
+		}
+
+		if (extension < Extensions->count) {
+
+			continue;
+		}
+
+		if (Extensions->count == FF_EXTENSION_MAX) {
+
+			RtlZeroMemory(Extensions, sizeof(FF_EXTENSION_TABLE));
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		Extensions->extensions[Extensions->count++] = folded;
+	}
+
+	for (seed = 1; seed <= FF_EXTENSION_SEEDS; seed++) {
+
+		RtlZeroMemory(Extensions->slots, sizeof(Extensions->slots));
+
+		for (extension = 0; extension < Extensions->count; extension++) {
+
+			slot = PolicyExtensionSlot(seed, &Extensions->extensions[extension]);
+
+			if (Extensions->slots[slot] != 0) {
+
+				break;
+			}
+
+			Extensions->slots[slot] = (UCHAR)(extension + 1);
+		}
+
+		if (extension == Extensions->count) {
+
+			Extensions->seed = seed;
+			return STATUS_SUCCESS;
+		}
+	}
+
+	RtlZeroMemory(Extensions, sizeof(FF_EXTENSION_TABLE));
+	return STATUS_UNSUCCESSFUL;
+}
+
+
+BOOLEAN
+PolicyMatchExtension(__in PFF_EXTENSION_TABLE Extensions, __in PUNICODE_STRING Extension)
+/*++
+
+Routine Description:
+Checks whether a final extension, as FltParseFileNameInformation leaves
+it without the dot, is one of the protected extensions, ignoring case.
+
+Arguments:
+Extensions - the protected extensions
+Extension - the extension of the name
+
+Return Value:
+TRUE if the file is of a protected extension.
+
+--*/
+{
+	FF_EXTENSION folded;
+	USHORT index;
+	UCHAR slot;
+
+	folded.length = Extension->Length / sizeof(WCHAR);
+
+	if (Extensions->count == 0 || folded.length == 0 || folded.length > FF_EXTENSION_CHARS) {
+
+		return FALSE;
+	}
+
+	for (index = 0; index < folded.length; index++) {
+
+		folded.name[index] = RtlUpcaseUnicodeChar(Extension->Buffer[index]);
+	}
+
+	slot = Extensions->slots[PolicyExtensionSlot(Extensions->seed, &folded)];
+
+	return (BOOLEAN)(slot != 0 &&
+	                 Extensions->extensions[slot - 1].length == folded.length &&
+	                 RtlEqualMemory(Extensions->extensions[slot - 1].name,
+	                                folded.name,
+	                                folded.length * sizeof(WCHAR)));
+}
+
+
+static
+BOOLEAN
+PolicyRuleString(__in PUCHAR Strings, __in ULONG StringsLength, __in USHORT Offset, __out PUNICODE_STRING String)
+/*++
+
+Routine Description:
+Checks that a rule's string lies within the strings and is NULL
+terminated there, and describes it.
+
+Arguments:
+Strings - the strings of the rules
+StringsLength - their size in bytes
+Offset - the byte offset of the string, or RULE_ANY
+String - receives the string, empty for RULE_ANY
+
+Return Value:
+FALSE if the string is not valid.
+
+--*/
+{
+	PWCHAR buffer;
+	ULONG length;
+
+	RtlZeroMemory(String, sizeof(UNICODE_STRING));
+
+	if (Offset == RULE_ANY) {
+
+		return TRUE;
+	}
+
+	if ((Offset % sizeof(WCHAR)) != 0 || Offset >= StringsLength) {
+
+		return FALSE;
+	}
+
+	buffer = (PWCHAR)&Strings[Offset];
+
+	for (length = 0; Offset + (length + 1) * sizeof(WCHAR) <= StringsLength; length++) {
+
+		if (buffer[length] == UNICODE_NULL) {
+
+			if (length == 0) {
+
+				return FALSE;
+			}
+
+			String->Buffer = buffer;
+			String->Length = String->MaximumLength = (USHORT)(length * sizeof(WCHAR));
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+NTSTATUS
+PolicySetRules(__out PFF_RULE_TABLE Rules, __in PPOLICY_RULES Source)
+/*++
+
+Routine Description:
+Builds the rule table from rules sent by minispy, checking every verdict,
+operation, string and SID, and lists the rules of each operation.
+
+Arguments:
+Rules - the table, left empty on failure
+Source - the rules, already copied out of the caller's buffer; the
+table keeps a copy of their strings
+
+Return Value:
+STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+
+--*/
+{
+	PPOLICY_RULE source;
+	PFF_RULE rule;
+	PSID sid;
+	ULONG user;
+	ULONG index;
+	ULONG operation;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(Rules, sizeof(FF_RULE_TABLE));
+
+	if (Source->Count > RULE_MAX || Source->StringsLength > RULE_MAX_STRINGS) {
+
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	RtlCopyMemory(Rules->strings, Source->Strings, Source->StringsLength);
+
+	for (index = 0; index < Source->Count; index++) {
+
+		source = &Source->Rules[index];
+		rule = &Rules->rules[index];
+
+		if ((source->Verdict != RULE_ALLOW && source->Verdict != RULE_DENY) ||
+		    (source->Operations & ~RULE_OP_ALL) != 0 ||
+		    !PolicyRuleString(Rules->strings, Source->StringsLength, source->Path, &rule->path) ||
+		    !PolicyRuleString(Rules->strings, Source->StringsLength, source->Extension, &rule->extension) ||
+		    !PolicyRuleString(Rules->strings, Source->StringsLength, source->Process, &rule->process)) {
+
+			goto PolicySetRules_Invalid;
+		}
+
+		rule->verdict = source->Verdict;
+
+		if (source->User != RULE_ANY) {
+
+			user = source->User;																//与StringsLength同为ULONG比较
+
+			if ((user % sizeof(ULONG)) != 0 ||
+			    user + (ULONG)FIELD_OFFSET(SID, SubAuthority) > Source->StringsLength) {
+
+				goto PolicySetRules_Invalid;
+			}
+
+			sid = (PSID)&Rules->strings[user];													//SID头在范围内才取地址
+
+			if (user + RtlLengthRequiredSid(((PISID)sid)->SubAuthorityCount) > Source->StringsLength ||
+			    !RtlValidSid(sid)) {
+
+				goto PolicySetRules_Invalid;
+			}
+
+			rule->user = sid;
+		}
+
+		for (operation = 0; operation < RULE_OPS; operation++) {
+
+			if (source->Operations & (1 << operation)) {
+
+				Rules->operationRules[operation][Rules->operationCount[operation]++] = (UCHAR)index;
+			}
+		}
+	}
+
+	Rules->count = Source->Count;
+	return STATUS_SUCCESS;
+
+PolicySetRules_Invalid:
+
+	RtlZeroMemory(Rules, sizeof(FF_RULE_TABLE));
+	return STATUS_INVALID_PARAMETER;
+}
+
+
+USHORT
+PolicyEvaluateRules(__in PFF_RULE_TABLE Rules, __inout PFF_RULE_SUBJECT Subject)
+/*++
+
+Routine Description:
+Finds the first rule that applies to an operation.  Only the rules of
+that operation are looked at, and of each only as many predicates as
+it takes to rule it out, cheapest first.  The image name is asked for
+at most once.
+
+Arguments:
+Rules - the rules
+Subject - the operation, the file and a way to learn about the process
+
+Return Value:
+RULE_ALLOW or RULE_DENY from the rule, or RULE_NONE if no rule applies
+or a rule's user cannot be told.
+
+--*/
+{
+	PFF_RULE rule;
+	PUNICODE_STRING image = NULL;
+	UNICODE_STRING tail;
+	BOOLEAN imageAsked = FALSE;
+	ULONG operation;
+	ULONG index;
+
+	PAGED_CODE();
+
+	if (Rules->count == 0 || Subject->operation == 0) {
+
+		return RULE_NONE;
+	}
+
+	for (operation = 0; !(Subject->operation & (1 << operation)); operation++) {
+	}
+
+	for (index = 0; index < Rules->operationCount[operation]; index++) {
+
+		rule = &Rules->rules[Rules->operationRules[operation][index]];
+
+		if (rule->extension.Length &&
+		    (Subject->extension == NULL || !RtlEqualUnicodeString(&rule->extension, Subject->extension, TRUE))) {
+
+			continue;
+		}
+
+		if (rule->path.Length && !RtlFindSubString(Subject->name, &rule->path)) {
+
+			continue;
+		}
+
+		if (rule->process.Length) {
+
+			if (!imageAsked) {
+
+				image = Subject->image(Subject);
+				imageAsked = TRUE;
+			}
+
+			if (image == NULL || image->Length < rule->process.Length) {
+
+				continue;
+			}
+
+			tail.Buffer = (PWCHAR)((PUCHAR)image->Buffer + image->Length - rule->process.Length);
+			tail.Length = tail.MaximumLength = rule->process.Length;
+
+			if (!RtlEqualUnicodeString(&rule->process, &tail, TRUE)) {
+
+				continue;
+			}
+		}
+
+		if (rule->user) {
+
+			switch (Subject->member(Subject, rule->user)) {
+
+			case FF_RULE_NOT_MEMBER:
+				continue;
+
+			case FF_RULE_UNKNOWN:
+
+				//
+				// Going on could let a later rule decide what this one
+				// would have, so the rules do not decide at all.
+				//
+
+				return RULE_NONE;
+			}
+		}
+
+		return rule->verdict;
+	}
+
+	return RULE_NONE;
+}
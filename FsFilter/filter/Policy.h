@@ -0,0 +1,160 @@
+﻿#ifndef __FSPOLICY_H__
+#define __FSPOLICY_H__
+
+//
+//  The protection policy: which files are protected and which processes
+//  may change them.  Matching only looks at the names it is given and
+//  queries nothing itself.  It is kernel code, using the Rtl and FsRtl
+//  string routines; the Linux backend builds it against the stand-ins
+//  in ../linux/shim/fltKernel.h.  See Policy.c.
+//
+
+//
+//  ASCII case folding, the only folding cheap enough to do on every
+//  character.  Anything that stands in for a folder match must fold
+//  names this way and no further, or it could merge names the match
+//  tells apart.
+//
+
+#define PolicyFoldAscii(Char) \
+	(((Char) >= L'A' && (Char) <= L'Z') ? (WCHAR)((Char) + (L'a' - L'A')) : (Char))
+
+typedef struct _FF_LIST_CONTEXT FF_LIST_CONTEXT, *PFF_LIST_CONTEXT;
+struct _FF_LIST_CONTEXT {
+	//
+	FF_LIST_CONTEXT* head;
+	//
+	//  Chains the entry in an FF_PROCESS_TABLE bucket, with the hash of
+	//  the name it ends in.  Both go before item, whose buffer follows
+	//  the structure.
+	//
+	FF_LIST_CONTEXT* next;
+	ULONG hash;
+	UNICODE_STRING item;
+};
+
+//
+//  The allowed processes compiled for matching.  An expression that is
+//  "*" and a plain name matches every image path ending in that name, so
+//  those are hashed by name, and one walk back from the end of an image
+//  path, hashing as it goes, looks up each suffix whose length some name
+//  has.  Expressions with wildcards of their own are kept apart and
+//  matched by FsRtlIsNameInExpression.
+//
+//  The table only links entries of the list; the list still owns them.
+//
+
+#define FF_PROCESS_BUCKETS      64
+#define FF_PROCESS_MAX_SUFFIX   MAX_PATH
+
+typedef struct _FF_PROCESS_TABLE {
+	PFF_LIST_CONTEXT buckets[FF_PROCESS_BUCKETS];
+	PFF_LIST_CONTEXT wildcards;
+	//
+	//  Bit n is set when some name is n characters long.
+	//
+	ULONG lengths[(FF_PROCESS_MAX_SUFFIX + 32) / 32];
+	USHORT maxLength;
+} FF_PROCESS_TABLE, *PFF_PROCESS_TABLE;
+
+//
+//  The protected extensions, kept case folded and hashed without
+//  collisions: PolicySetExtensions looks for a seed under which every
+//  extension lands in a slot of its own, so a lookup hashes the final
+//  extension of a name once and compares it with at most one entry.
+//
+
+#define FF_EXTENSION_MAX        64
+#define FF_EXTENSION_CHARS      16
+#define FF_EXTENSION_SLOTS      1024
+
+typedef struct _FF_EXTENSION {
+	USHORT length;
+	WCHAR name[FF_EXTENSION_CHARS];
+} FF_EXTENSION, *PFF_EXTENSION;
+
+typedef struct _FF_EXTENSION_TABLE {
+	ULONG seed;
+	ULONG count;
+	//
+	//  One more than the index of the extension hashed to each slot, 0
+	//  for none.
+	//
+	UCHAR slots[FF_EXTENSION_SLOTS];
+	FF_EXTENSION extensions[FF_EXTENSION_MAX];
+} FF_EXTENSION_TABLE, *PFF_EXTENSION_TABLE;
+
+//
+//  The policy rules of SetMiniSpyRules, see miniSpy.h, which must be
+//  included first.  Each rule's strings point into the table's own copy
+//  of POLICY_RULES.Strings, and the rules of each operation are listed in
+//  order so an operation looks at no rule that cannot apply to it.
+//
+//  A rule's predicates are tried cheapest first: the extension and path
+//  compare names already in hand, the process needs the image name
+//  queried and the user the process token.  Those two are asked of the
+//  FF_RULE_SUBJECT, only when a rule gets that far, and only once.
+//
+
+typedef struct _FF_RULE {
+	USHORT verdict;
+	UNICODE_STRING path;
+	UNICODE_STRING extension;
+	UNICODE_STRING process;
+	PVOID user;
+} FF_RULE, *PFF_RULE;
+
+typedef struct _FF_RULE_TABLE {
+	ULONG count;
+	UCHAR operationCount[RULE_OPS];
+	UCHAR operationRules[RULE_OPS][RULE_MAX];
+	FF_RULE rules[RULE_MAX];
+	UCHAR strings[RULE_MAX_STRINGS];
+} FF_RULE_TABLE, *PFF_RULE_TABLE;
+
+typedef struct _FF_RULE_SUBJECT FF_RULE_SUBJECT, *PFF_RULE_SUBJECT;
+
+typedef PUNICODE_STRING (*PFF_RULE_IMAGE)(__inout PFF_RULE_SUBJECT Subject);
+typedef USHORT (*PFF_RULE_MEMBER)(__inout PFF_RULE_SUBJECT Subject, __in PVOID Sid);
+
+//
+//  What a PFF_RULE_MEMBER returns.  FF_RULE_UNKNOWN when the token cannot
+//  be had, which stops the evaluation with RULE_NONE.
+//
+
+#define FF_RULE_NOT_MEMBER	0
+#define FF_RULE_MEMBER		1
+#define FF_RULE_UNKNOWN		2
+
+struct _FF_RULE_SUBJECT {
+	//
+	//  One RULE_OP_* bit, and the file's normalized name and extension.
+	//
+	ULONG operation;
+	PUNICODE_STRING name;
+	PUNICODE_STRING extension;
+	//
+	//  The process image name, NULL if it cannot be had, and whether the
+	//  process runs as or in a group with a SID, if that can be told.
+	//
+	PFF_RULE_IMAGE image;
+	PFF_RULE_MEMBER member;
+	PVOID context;
+};
+
+/*************************************************************************
+    Prototypes
+*************************************************************************/
+
+BOOLEAN RtlFindSubString(__in const PUNICODE_STRING String, __in const UNICODE_STRING *SubString);
+BOOLEAN PolicyMatchFolder(__in PFF_LIST_CONTEXT Folders, __in PUNICODE_STRING FileName);
+VOID PolicyClearProcesses(__out PFF_PROCESS_TABLE Processes);
+VOID PolicyAddProcess(__inout PFF_PROCESS_TABLE Processes, __inout PFF_LIST_CONTEXT Process);
+BOOLEAN PolicyMatchProcess(__in PFF_PROCESS_TABLE Processes, __in PUNICODE_STRING ImageName);
+NTSTATUS PolicySetExtensions(__out PFF_EXTENSION_TABLE Extensions, __in PUNICODE_STRING List);
+BOOLEAN PolicyMatchExtension(__in PFF_EXTENSION_TABLE Extensions, __in PUNICODE_STRING Extension);
+NTSTATUS PolicySetRules(__out PFF_RULE_TABLE Rules, __in PPOLICY_RULES Source);
+USHORT PolicyEvaluateRules(__in PFF_RULE_TABLE Rules, __inout PFF_RULE_SUBJECT Subject);
+
+
+#endif  //__FSPOLICY_H__
@@ -9,6 +9,7 @@
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, GetProcessImageName)
+#pragma alloc_text(PAGE, GetProcessTokenSids)
 #endif
 
 
@@ -244,6 +245,10 @@ GetSID(__deref_out PUNICODE_STRING sidString, PACCESS_STATE AccessState)
 	tokenuser_user.Sid = sid;
 
 	sidStringBuffer = ExAllocatePoolWithTag(NonPagedPool, 128, 'dis_');
+	if (sidStringBuffer == NULL) {
+		RtlInitEmptyUnicodeString(sidString, NULL, 0);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
 	RtlInitEmptyUnicodeString(sidString, sidStringBuffer, 128);
 
 	Token = PsReferencePrimaryToken(PsGetCurrentProcess());
@@ -358,4 +363,37 @@ GetSID(__deref_out PUNICODE_STRING sidString, PACCESS_STATE AccessState)
 		return STATUS_FAIL_CHECK;
 	}
 	return STATUS_SUCCESS;
-}
\ No newline at end of file
+}
+
+
+NTSTATUS
+GetProcessTokenSids(__deref_out PTOKEN_USER *User, __deref_out PTOKEN_GROUPS *Groups)
+{
+	PACCESS_TOKEN token;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	*User = NULL;
+	*Groups = NULL;
+
+	//
+	// 当前进程的用户和组，调用者用ExFreePool释放
+	//
+
+	token = PsReferencePrimaryToken(PsGetCurrentProcess());
+
+	status = SeQueryInformationToken(token, TokenUser, (PVOID *)User);
+	if (NT_SUCCESS(status))
+	{
+		status = SeQueryInformationToken(token, TokenGroups, (PVOID *)Groups);
+		if (!NT_SUCCESS(status))
+		{
+			ExFreePool(*User);
+			*User = NULL;
+		}
+	}
+
+	PsDereferencePrimaryToken(token);
+	return status;
+}
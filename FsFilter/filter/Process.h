@@ -8,6 +8,7 @@
 NTSTATUS GetCurrentProcessName();
 NTSTATUS GetSID(__deref_out PUNICODE_STRING sidString, PACCESS_STATE AccessState);
 NTSTATUS GetProcessImageName(HANDLE processId, PUNICODE_STRING ProcessImageName);
+NTSTATUS GetProcessTokenSids(__deref_out PTOKEN_USER *User, __deref_out PTOKEN_GROUPS *Groups);
 
 
 #endif  //__MSPROCESS_H__
\ No newline at end of file
@@ -29,6 +29,7 @@ Environment:
 #include "mspyKern.h"
 #include "swapBuffers.h"
 #include "Process.h"
+#include "Policy.h"
 #include "fsFilter.h"
 
 #include <wchar.h>
@@ -53,6 +54,10 @@ Environment:
 #pragma alloc_text(PAGE, InstanceTeardownComplete)
 #pragma alloc_text(PAGE, IsOpenProccess)
 #pragma alloc_text(PAGE, IsProtectionFileByProtectedDirName)
+#pragma alloc_text(PAGE, SetProtectionExtensions)
+#pragma alloc_text(PAGE, SetProtectionRules)
+#pragma alloc_text(PAGE, EvaluateRules)
+#pragma alloc_text(PAGE, IsProtectedOperation)
 #endif
 
 
@@ -67,7 +72,6 @@ ULONG_PTR OperationStatusCtx = 1;
 #define PROTECTIONDIRNAME L"ProtectedDir"
 #define OPENPROCCESS L"OpenProccess"
 const UNICODE_STRING DEFAULTPROTECTIONDIRNAME = RTL_CONSTANT_STRING(L"\\EncryptionMinifilterDir\\");
-const UNICODE_STRING ProtectedFilExt = RTL_CONSTANT_STRING(L".txt");
 const UNICODE_STRING DEFAULTOPENPROCCESS = RTL_CONSTANT_STRING(L"a.exe");
 UNICODE_STRING ProtectedDirName;
 UNICODE_STRING registryPath;
@@ -84,6 +88,8 @@ Pool Tags
 #define EXE_TAG				'exe_'
 #define P_DIR_TAG			'RID_'
 #define P_PRC_TAG			'CRP_'
+#define EXT_TAG				'TXE_'
+#define RULE_TAG			'LUR_'
 #define REG_TAG				'GER_'
 #define DBG_TAG				'gbd_'
 
@@ -140,17 +146,68 @@ typedef struct _PRE_2_POST_CONTEXT {
 
 
 
-typedef struct _FF_LIST_CONTEXT FF_LIST_CONTEXT, *PFF_LIST_CONTEXT;
-struct _FF_LIST_CONTEXT {
-	//
-	FF_LIST_CONTEXT* head;
-	UNICODE_STRING item;
-};
-
 PFF_LIST_CONTEXT ff_exe_list = NULL;
+FF_PROCESS_TABLE ff_exe_table;														//ff_exe_list编译成的匹配表
 KSPIN_LOCK ff_exe_list_Lock;
 PFF_LIST_CONTEXT ff_fld_list = NULL;
 KSPIN_LOCK ff_fld_list_Lock;
+BOOLEAN ff_fld_by_dir = TRUE;														//保护目录都以\结尾，父目录的判定即文件的判定
+
+C_ASSERT(FF_EXTENSION_MAX == EXTENSION_MAX && FF_EXTENSION_CHARS == EXTENSION_MAX_CHARS);
+
+ERESOURCE ff_policy_lock;															//读者共享持有；换表时独占，取得时读者都已退出
+
+//
+//  A rule table as it is published: built whole in its own allocation
+//  and swapped in under ff_policy_lock, so readers never see it change.
+//
+
+typedef struct _FF_RULE_POLICY {
+	ULONG operations;																//有规则的操作
+	FF_RULE_TABLE table;
+} FF_RULE_POLICY, *PFF_RULE_POLICY;
+
+//
+//  The protected extensions and how they combine with the protected
+//  folders, published together the same way.
+//
+
+typedef struct _FF_EXTENSION_POLICY {
+	LONG mode;																		//扩展名与保护目录的组合方式
+	FF_EXTENSION_TABLE table;														//受保护的扩展名
+} FF_EXTENSION_POLICY, *PFF_EXTENSION_POLICY;
+
+PFF_EXTENSION_POLICY ff_ext_policy = NULL;											//EXTENSION_OFF时为NULL
+PFF_RULE_POLICY ff_rule_policy = NULL;												//策略规则，先于保护目录判定；没有规则时为NULL
+ULONG ff_rule_operations = 0;														//ff_rule_policy的operations，不加锁先看一眼
+
+//
+//  What the rules need to learn about the process, asked for only when a
+//  rule gets that far.
+//
+
+typedef struct _RULE_SUBJECT_CONTEXT {
+	WCHAR imageBuffer[(sizeof(UNICODE_STRING) + MAX_PATH*2)/sizeof(WCHAR)];
+	BOOLEAN tokenAsked;
+	PTOKEN_USER user;
+	PTOKEN_GROUPS groups;
+} RULE_SUBJECT_CONTEXT, *PRULE_SUBJECT_CONTEXT;
+
+//
+//  A create with one of these dispositions destroys what the file held.
+//
+
+#define IS_OVERWRITE_DISPOSITION(_disposition) \
+	((_disposition) == FILE_SUPERSEDE || (_disposition) == FILE_OVERWRITE || (_disposition) == FILE_OVERWRITE_IF)
+
+//
+//  A create that asks for any of these is RULE_OP_CREATE, otherwise it
+//  only reads.
+//
+
+#define CREATE_WRITE_ACCESS \
+	(FILE_WRITE_DATA | FILE_APPEND_DATA | FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA | \
+	 DELETE | WRITE_DAC | WRITE_OWNER | GENERIC_WRITE | GENERIC_ALL | MAXIMUM_ALLOWED)
 
 IsInSetting = FALSE;
 
@@ -200,6 +257,16 @@ CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
       PreOperationNoPostOperation,
       NULL },                               //post operations not supported
 
+	{ IRP_MJ_CLEANUP,
+      0,
+      PreOperationNoPostOperation,
+      NULL },                               //post operations not supported
+
+	{ IRP_MJ_CLOSE,
+      0,
+      PreOperationNoPostOperation,
+      NULL },                               //post operations not supported
+
 #if 0 // TODO - List all of the requests to filter.
 
     { IRP_MJ_CREATE_NAMED_PIPE,
@@ -482,6 +549,7 @@ ParseOpenProcess(PUNICODE_STRING openprocess)
 		tmp = ff_exe_list;
 		ff_exe_list = newBuffer;
 		newBuffer->head = tmp;
+		PolicyAddProcess(&ff_exe_table, newBuffer);
 		if(!pnextline) 
 		{
 			KeReleaseSpinLock(&ff_exe_list_Lock, oldIrql);
@@ -523,6 +591,7 @@ ParseProtectionDir(PUNICODE_STRING dirs){
 		newBuffer->item.Length = llen * 2;
 		RtlCopyMemory(newBuffer->item.Buffer, pline, llen * 2);
 		newBuffer->item.Buffer[newBuffer->item.Length] = UNICODE_NULL;
+		if (pline[llen - 1] != L'\\') ff_fld_by_dir = FALSE;							//可能匹配到文件名本身，不能按父目录缓存
 
 		tmp = ff_fld_list;
 		ff_fld_list = newBuffer;
@@ -1009,6 +1078,8 @@ Return Value:
 
 	if(openProccess.Buffer == NULL) return STATUS_UNSUCCESSFUL;
 
+	ExInitializeResourceLite(&ff_policy_lock);
+
     PT_DBG_PRINT( PTDBG_TRACE_ROUTINES,
                   ("!DriverEntry: Entered\n") );
 
@@ -1039,6 +1110,11 @@ Return Value:
         }
     }
 
+    if (!NT_SUCCESS( status )) {
+
+        ExDeleteResourceLite( &ff_policy_lock );
+    }
+
     return status;
 }
 
@@ -1054,6 +1130,7 @@ void Clean_Fld_List()
 		ExFreeToNPagedLookasideList(&FolderContextList, ff_fld_list);
 		ff_fld_list = tmp;
 	}
+	ff_fld_by_dir = TRUE;
 
     KeReleaseSpinLock(&ff_fld_list_Lock, oldIrql);
 }
@@ -1066,6 +1143,8 @@ void Clean_Exe_List()
 
 	KeAcquireSpinLock(&ff_exe_list_Lock, &oldIrql);
 
+	PolicyClearProcesses(&ff_exe_table);
+
 	while (ff_exe_list){
 		tmp = ff_exe_list->head;
 		ExFreeToNPagedLookasideList(&ExeContextList, ff_exe_list);
@@ -1112,6 +1191,10 @@ Return Value:
 	// Clean_Exe_List();
 	// Clean_Fld_List();
 
+	if (ff_ext_policy != NULL) ExFreePoolWithTag(ff_ext_policy, EXT_TAG);
+	if (ff_rule_policy != NULL) ExFreePoolWithTag(ff_rule_policy, RULE_TAG);
+	ExDeleteResourceLite(&ff_policy_lock);
+
 	// //  Delete lookaside list
 	 ExDeleteNPagedLookasideList(&Pre2PostContextList);
 	 ExDeleteNPagedLookasideList(&ExeContextList);
@@ -1174,6 +1257,15 @@ Return Value:
 
 
     PT_DBG_PRINT( PTDBG_TRACE_ROUTINES,	("!PreOperation: Entered\n") );
+
+	//
+	//  Any other operation ends a run of coalesced writes on this handle.
+	//
+
+	if (IRP_MJ_WRITE != iopb->MajorFunction) {
+		SpyCoalesceFlush(FltObjects->FileObject);
+	}
+
 	//DbgPrint("\n MN=0x%08x IRP=0x%08x \n", iopb->MajorFunction, iopb->MinorFunction);
 
 	if (IRP_MJ_CREATE == iopb->MajorFunction) {
@@ -1380,7 +1472,6 @@ Return Value:
 {
 	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
     //UNREFERENCED_PARAMETER( Data );
-    UNREFERENCED_PARAMETER( FltObjects );
     UNREFERENCED_PARAMETER( CompletionContext );
 
 
@@ -1388,6 +1479,14 @@ Return Value:
 	{
 		WriteDriverParameters();
 	}
+	else if(IRP_MJ_CLEANUP == iopb->MajorFunction)
+	{
+		SpyCoalesceFlush(FltObjects->FileObject);					//句柄关闭，送出合并的写记录
+	}
+	else if(IRP_MJ_CLOSE == iopb->MajorFunction)
+	{
+		SpyBurstForget(FltObjects->FileObject);
+	}
 
     PT_DBG_PRINT( PTDBG_TRACE_ROUTINES,
                   ("!PreOperationNoPostOperation: Entered\n") );
@@ -1451,68 +1550,17 @@ Return Value:
 }
 
 
-BOOLEAN
-RtlFindSubString(__in const PUNICODE_STRING String, __in const UNICODE_STRING *SubString)
-/*++
-
-Routine Description:
-This routine looks to see if SubString is a substring of String.
-
-Arguments:
-String - the string to search in
-SubString - the substring to find in String
-
-Return Value:
-Returns TRUE if the substring is found in string and FALSE
-otherwise.
-
---*/
+BOOLEAN IsProtectionFileByProtectedFilExt(PFLT_FILE_NAME_INFORMATION NameInfos, PFF_EXTENSION_TABLE Extensions)
 {
-	USHORT index;
-	//KSPIN_LOCK compareLock;
-	KIRQL oldIrql;
-	BOOLEAN ret = FALSE;
-
-    //KeAcquireSpinLock(&compareLock, &oldIrql);
-
-	//
-	// First, check to see if the strings are equal.
-	//
-
-	//if (RtlEqualUnicodeString(String, SubString, TRUE)) { ret = TRUE; goto __Finally; }
-
-	//
-	// String and SubString aren't equal, so now see if SubString
-	// is in String any where.
-	//
-	//if(TRUE == FsRtlIsNameInExpression(&SubString, &String, FALSE, NULL))
-
-	for (index = 0; index + SubString->Length/2 <= String->Length/2; index++) {
-
-		if (_wcsnicmp(&String->Buffer[index], SubString->Buffer, SubString->Length/2) == 0) {
+	BOOLEAN bProtect = FALSE;
 
-			//
-			// SubString is found in String, so return TRUE.
-			//
-			ret = TRUE;
-			break;
-		}
+	if (!FlagOn(NameInfos->NamesParsed, FLTFL_FILE_NAME_PARSED_EXTENSION))
+	{
+		FltParseFileNameInformation(NameInfos);										//有的调用者没有解析名称
 	}
 
-//__Finally:
-
-   // KeReleaseSpinLock(&compareLock, oldIrql);
-
-	return ret;
-} 
-
-
-BOOLEAN IsProtectionFileByProtectedFilExt(PFLT_FILE_NAME_INFORMATION NameInfos)
-{
-	BOOLEAN bProtect = FALSE;
-
-	// 判断
-	if (TRUE == RtlFindSubString(&NameInfos->Name, &ProtectedFilExt))
+	// 判断最后一个扩展名，不区分大小写
+	if (TRUE == PolicyMatchExtension(Extensions, &NameInfos->Extension))
 	{
 		bProtect = TRUE;
 	}
@@ -1527,7 +1575,6 @@ BOOLEAN IsOpenProccess()
 	FILE_ID ProcessId;
 	PUNICODE_STRING ProcessImageName;
 	PUNICODE_STRING sidString;
-	PFF_LIST_CONTEXT tmpExeList;
 	WCHAR strBuffer[(sizeof(UNICODE_STRING) + MAX_PATH*2)/sizeof(WCHAR)];
 
 	PAGED_CODE();
@@ -1544,17 +1591,7 @@ BOOLEAN IsOpenProccess()
 
 	//KeAcquireSpinLock(&ff_exe_list_Lock, &oldIrql);
 	
-	tmpExeList = ff_exe_list;
-	while(tmpExeList){
-
-		// 判断
-		if (TRUE == FsRtlIsNameInExpression(&tmpExeList->item, ProcessImageName, FALSE, NULL))
-		{
-			//GetProcessUsername();
-			ret = TRUE;
-		}
-		tmpExeList = tmpExeList->head;
-	}
+	ret = PolicyMatchProcess(&ff_exe_table, ProcessImageName);					//匹配放在Policy.c，不依赖过滤管理器
 
 	//KeReleaseSpinLock(&ff_exe_list_Lock, oldIrql);
 
@@ -1564,7 +1601,8 @@ BOOLEAN IsOpenProccess()
 BOOLEAN IsProtectionFileByProtectedDirName(PFLT_FILE_NAME_INFORMATION NameInfos)
 {
 	BOOLEAN bProtect = FALSE;
-	PFF_LIST_CONTEXT tmpFldList;
+	UNICODE_STRING directory;
+	LONG generation;
 
 	//KIRQL oldIrql;
 
@@ -1574,15 +1612,33 @@ BOOLEAN IsProtectionFileByProtectedDirName(PFLT_FILE_NAME_INFORMATION NameInfos)
 
 	//KeAcquireSpinLock(&ff_fld_list_Lock, &oldIrql);
 
-	tmpFldList = ff_fld_list;
-	while (tmpFldList){
-
-		// 判断
-		if (TRUE == RtlFindSubString(&(NameInfos->Name), &tmpFldList->item))
+	directory.Length = 0;
+	if (ff_fld_by_dir)
+	{
+		if (!FlagOn(NameInfos->NamesParsed, FLTFL_FILE_NAME_PARSED_PARENT_DIR))
 		{
-			bProtect = TRUE;
+			FltParseFileNameInformation(NameInfos);
 		}
-		tmpFldList = tmpFldList->head;
+		if (NameInfos->ParentDir.Length > 0)											//卷名加父目录，以\结尾
+		{
+			directory.Buffer = NameInfos->Name.Buffer;
+			directory.Length = (USHORT)((PUCHAR)NameInfos->ParentDir.Buffer + NameInfos->ParentDir.Length - (PUCHAR)NameInfos->Name.Buffer);
+			directory.MaximumLength = directory.Length;
+		}
+	}
+
+	generation = SpyDirectoryGeneration();
+
+	if (directory.Length > 0 && SpyDirectoryLookup(&directory, generation, &bProtect))	//同一目录下的文件不再逐个匹配保护目录
+	{
+		return bProtect;
+	}
+
+	bProtect = PolicyMatchFolder(ff_fld_list, &NameInfos->Name);
+
+	if (directory.Length > 0)
+	{
+		SpyDirectoryRemember(&directory, generation, bProtect);
 	}
 
 	//KeReleaseSpinLock(&ff_fld_list_Lock, oldIrql);
@@ -1598,10 +1654,153 @@ BOOLEAN IsProtectionFile(PFLT_FILE_NAME_INFORMATION NameInfos)
 
 	bProtect = IsProtectionFileByProtectedDirName(NameInfos);
 
+	if (ff_ext_policy == NULL) return bProtect;										//没有设扩展名，不加锁
+
+	FltAcquireResourceShared(&ff_policy_lock);
+	if (ff_ext_policy != NULL)
+	{
+		switch (ff_ext_policy->mode)														//按扩展名与保护目录组合保护
+		{
+		case EXTENSION_AND:
+			bProtect = bProtect && IsProtectionFileByProtectedFilExt(NameInfos, &ff_ext_policy->table);
+			break;
+		case EXTENSION_OR:
+			bProtect = bProtect || IsProtectionFileByProtectedFilExt(NameInfos, &ff_ext_policy->table);
+			break;
+		}
+	}
+	FltReleaseResource(&ff_policy_lock);
+
 	return bProtect;
 }
 
 
+PUNICODE_STRING RuleSubjectImage(PFF_RULE_SUBJECT Subject)
+{
+	PRULE_SUBJECT_CONTEXT context = Subject->context;
+	PUNICODE_STRING image = (PUNICODE_STRING)context->imageBuffer;
+
+	image->MaximumLength = sizeof(UNICODE_STRING) + MAX_PATH*2;
+	image->Length = 0;
+
+	if (!NT_SUCCESS(GetProcessImageName(PsGetCurrentProcessId(), image)))
+	{
+		return NULL;
+	}
+
+	return image;
+}
+
+
+USHORT RuleSubjectMember(PFF_RULE_SUBJECT Subject, PVOID Sid)
+{
+	PRULE_SUBJECT_CONTEXT context = Subject->context;
+	ULONG index;
+
+	if (!context->tokenAsked)
+	{
+		context->tokenAsked = TRUE;
+		if (KeGetCurrentIrql() == PASSIVE_LEVEL)											//APC_LEVEL下不能查询令牌
+		{
+			GetProcessTokenSids(&context->user, &context->groups);
+		}
+	}
+
+	if (context->user == NULL)
+	{
+		return FF_RULE_UNKNOWN;																//不知道是谁，交给保护目录判定
+	}
+
+	if (RtlEqualSid(Sid, context->user->User.Sid))
+	{
+		return FF_RULE_MEMBER;
+	}
+
+	for (index = 0; index < context->groups->GroupCount; index++)
+	{
+		if (FlagOn(context->groups->Groups[index].Attributes, SE_GROUP_ENABLED) &&
+			RtlEqualSid(Sid, context->groups->Groups[index].Sid))
+		{
+			return FF_RULE_MEMBER;
+		}
+	}
+
+	return FF_RULE_NOT_MEMBER;
+}
+
+
+USHORT EvaluateRules(PFLT_FILE_NAME_INFORMATION NameInfos, ULONG Operation)
+{
+	RULE_SUBJECT_CONTEXT context;
+	FF_RULE_SUBJECT subject;
+	USHORT verdict;
+
+	PAGED_CODE();
+
+	if (!FlagOn(ff_rule_operations, Operation)) return RULE_NONE;						//没有该操作的规则，不花任何代价
+
+	if (!FlagOn(NameInfos->NamesParsed, FLTFL_FILE_NAME_PARSED_EXTENSION))
+	{
+		FltParseFileNameInformation(NameInfos);
+	}
+
+	context.tokenAsked = FALSE;
+	context.user = NULL;
+	context.groups = NULL;
+
+	subject.operation = Operation;
+	subject.name = &NameInfos->Name;
+	subject.extension = &NameInfos->Extension;
+	subject.image = RuleSubjectImage;
+	subject.member = RuleSubjectMember;
+	subject.context = &context;
+
+	FltAcquireResourceShared(&ff_policy_lock);
+	if (ff_rule_policy != NULL && FlagOn(ff_rule_policy->operations, Operation))
+	{
+		verdict = PolicyEvaluateRules(&ff_rule_policy->table, &subject);					//规则解释放在Policy.c
+	}
+	else
+	{
+		verdict = RULE_NONE;
+	}
+	FltReleaseResource(&ff_policy_lock);
+
+	if (context.user) ExFreePool(context.user);
+	if (context.groups) ExFreePool(context.groups);
+
+	return verdict;
+}
+
+
+BOOLEAN IsProtectedOperation(PFLT_FILE_NAME_INFORMATION NameInfos, ULONG Operation, PBOOLEAN Allowed)
+{
+	PAGED_CODE();
+
+	//
+	// 规则优先：拒绝的规则使文件受保护，允许的规则放行；没有规则适用时按保护目录和放行进程判定
+	//
+
+	switch (EvaluateRules(NameInfos, Operation))
+	{
+	case RULE_ALLOW:
+		*Allowed = TRUE;
+		return IsProtectionFile(NameInfos);
+	case RULE_DENY:
+		*Allowed = FALSE;
+		return TRUE;
+	}
+
+	if (!IsProtectionFile(NameInfos))
+	{
+		return FALSE;
+	}
+
+	*Allowed = IsOpenProccess();
+	return TRUE;
+}
+
+
 FLT_PREOP_CALLBACK_STATUS
 PreReadBuffers(
 	__inout PFLT_CALLBACK_DATA Data,
@@ -1733,6 +1932,7 @@ FLT_PREOP_COMPLETE -
 	//PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
 	NTSTATUS status;
 	PFLT_FILE_NAME_INFORMATION FileNameInformation = NULL;
+	BOOLEAN openProcess = FALSE;
 
 	// if (iopb->IrpFlags & IRP_PAGING_IO) DbgPrint("\n PreRead IRP : 0x%08x ops IRP_PAGING_IO", iopb->IrpFlags);
 	// else { DbgPrint("\n NOT IRP_PAGING_IO"); return FLT_PREOP_SUCCESS_NO_CALLBACK; }	
@@ -1743,17 +1943,18 @@ FLT_PREOP_COMPLETE -
 	if (NT_SUCCESS(status)) {
 		status = FltParseFileNameInformation(FileNameInformation);
 		if (NT_SUCCESS(status)) {
-			if (TRUE == IsProtectionFile(FileNameInformation))																//禁止出现对应名称的文件Rename。								
+			if (TRUE == IsProtectedOperation(FileNameInformation, RULE_OP_WRITE, &openProcess))								//规则优先，其次保护目录
 			{
-				if(IsOpenProccess())
+				if(openProcess && SpyBurstWrite(Data, FltObjects, &FileNameInformation->Name))			//每个文件对象只计一次覆写，与写记录合并无关
 				{
 					FltReleaseFileNameInformation(FileNameInformation);
-					return SpyPreOperationCallback(Data, FltObjects, CompletionContext);
+					return SpyPreOperationCallback(Data, FltObjects, CompletionContext);					//写完成后才并入该句柄的写记录
 				}
 				else
 				{
 					Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 					Data->IoStatus.Information = 0;
+					SpyLogDenial(Data, FltObjects, &FileNameInformation->Name);										//拒绝记录走高优先级通道
 					FltReleaseFileNameInformation(FileNameInformation);
 					return FLT_PREOP_COMPLETE;
 				}
@@ -1865,21 +2066,32 @@ Return Value:
 	ULONG CreateOptions = Data->Iopb->Parameters.Create.Options;
 	//status = SwapPostReadBuffers(Data, FltObjects, CompletionContext,Flags);
 
+	if (CompletionContext == NULL)																	//覆盖创建，只看是否成功
+	{
+		if (!NT_SUCCESS(Data->IoStatus.Status)) SpyBurstForget(FltObjects->FileObject);			//没有打开就不会有IRP_MJ_CLOSE
+		return FLT_POSTOP_FINISHED_PROCESSING;
+	}
+
 	status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInformation);
 	if (NT_SUCCESS(status)) {
 		status = FltParseFileNameInformation(FileNameInformation);
+		FltReleaseFileNameInformation(FileNameInformation);
 		if (NT_SUCCESS(status)) {
-			if (IsOpenProccess())
+			if (IsOpenProccess() && (CreateOptions & FILE_DELETE_ON_CLOSE))
 			{
-				FltReleaseFileNameInformation(FileNameInformation);
-				if (CreateOptions & FILE_DELETE_ON_CLOSE)
-				{
-					status = SpyPostOperationCallback(Data, FltObjects, CompletionContext, Flags);
-					return status;
-				}
+				status = SpyPostOperationCallback(Data, FltObjects, CompletionContext, Flags);
+				return status;
+			}
+			if (CompletionContext != NULL)
+			{
+				SpyFreeRecord(CompletionContext);												//不需要记录的操作，释放预操作分配的记录
 			}
+			return FLT_POSTOP_FINISHED_PROCESSING;
 		}
-		FltReleaseFileNameInformation(FileNameInformation);
+	}
+	if (CompletionContext != NULL)
+	{
+		SpyDiscardRecord(CompletionContext);												//名称查询失败，记为丢失
 	}
 	return FLT_POSTOP_FINISHED_PROCESSING;
 }
@@ -1911,15 +2123,23 @@ Return Value:
 	status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInformation);
 	if (NT_SUCCESS(status)) {
 		status = FltParseFileNameInformation(FileNameInformation);
+		FltReleaseFileNameInformation(FileNameInformation);
 		if (NT_SUCCESS(status)) {
 			if(IsOpenProccess())
 			{
-				FltReleaseFileNameInformation(FileNameInformation);
 				status = SpyPostOperationCallback(Data, FltObjects, CompletionContext, Flags);
 				return status;
 			}
+			if (CompletionContext != NULL)
+			{
+				SpyFreeRecord(CompletionContext);												//不需要记录的操作，释放预操作分配的记录
+			}
+			return FLT_POSTOP_FINISHED_PROCESSING;
 		}
-		FltReleaseFileNameInformation(FileNameInformation);
+	}
+	if (CompletionContext != NULL)
+	{
+		SpyDiscardRecord(CompletionContext);												//名称查询失败，记为丢失
 	}
 	return FLT_POSTOP_FINISHED_PROCESSING;
 }
@@ -1950,17 +2170,25 @@ Return Value:
 	status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInformation);
 	if (NT_SUCCESS(status)) {
 		status = FltParseFileNameInformation(FileNameInformation);
+		FltReleaseFileNameInformation(FileNameInformation);
 		if (NT_SUCCESS(status)) {
 			if(IsOpenProccess())
 			{
 				status = SpyPostOperationCallback(Data, FltObjects, CompletionContext, Flags);
-				FltReleaseFileNameInformation(FileNameInformation);
 				return status;
 			}
+			if (CompletionContext != NULL)
+			{
+				SpyFreeRecord(CompletionContext);												//不需要记录的操作，释放预操作分配的记录
+			}
+			return FLT_POSTOP_FINISHED_PROCESSING;
 		}
-		FltReleaseFileNameInformation(FileNameInformation);
 	}
-	return FLT_POSTOP_FINISHED_PROCESSING;	
+	if (CompletionContext != NULL)
+	{
+		SpyDiscardRecord(CompletionContext);												//名称查询失败，记为丢失
+	}
+	return FLT_POSTOP_FINISHED_PROCESSING;
 }
 
 FLT_POSTOP_CALLBACK_STATUS
@@ -2023,6 +2251,8 @@ PreCreate(
 	ULONG CreatePosition;
 	ULONG CreateOptions;
 	ULONG Position;
+	ULONG Operation;
+	BOOLEAN allowed = FALSE;
 	PFLT_FILE_NAME_INFORMATION NameInfo;
 
 
@@ -2047,6 +2277,14 @@ PreCreate(
 	CreateOptions = Data->Iopb->Parameters.Create.Options;
 	CreatePosition = (CreateOptions >> 24) & 0xFF;
 
+	if (CreateOptions & FILE_DELETE_ON_CLOSE)
+		Operation = RULE_OP_DELETE;
+	else if (CreatePosition != FILE_OPEN ||
+			 FlagOn(Data->Iopb->Parameters.Create.SecurityContext->DesiredAccess, CREATE_WRITE_ACCESS))
+		Operation = RULE_OP_CREATE;
+	else
+		Operation = RULE_OP_READ;															//只读打开
+
 	//if (Position & FILE_DIRECTORY_FILE)
 	//	return FLT_PREOP_SUCCESS_NO_CALLBACK;								//如果发现是文件夹选项直接返回
 
@@ -2060,15 +2298,23 @@ PreCreate(
 		return FLT_PREOP_SUCCESS_NO_CALLBACK;
 	}
 
-	if (TRUE == IsProtectionFile(NameInfo))																//禁止出现对应名称的文件Rename。								
+	if (TRUE == IsProtectedOperation(NameInfo, Operation, &allowed))										//规则优先，其次保护目录
 	{
-		if(IsOpenProccess())
+		if(allowed &&
+		   ((CreateOptions & FILE_DELETE_ON_CLOSE) ? SpyBurstOperation(Data, FltObjects, &NameInfo->Name, BURST_DELETE) :	//突发删除超限的进程被拒绝
+			IS_OVERWRITE_DISPOSITION(CreatePosition) ? SpyBurstWrite(Data, FltObjects, &NameInfo->Name) :					//覆盖创建计为覆写，之后的写不再计
+			TRUE))
 		{
 			FltReleaseFileNameInformation(NameInfo);
 			if (CreateOptions & FILE_DELETE_ON_CLOSE)
 			{
 				return SpyPreOperationCallback(Data, FltObjects, CompletionContext);
 			}
+			if (IS_OVERWRITE_DISPOSITION(CreatePosition))
+			{
+				*CompletionContext = NULL;																	//打开失败时在PostCreate里忘掉这个文件对象
+				return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+			}
 			return FLT_PREOP_SUCCESS_NO_CALLBACK;
 		}
 		else
@@ -2076,6 +2322,7 @@ PreCreate(
 			//FltCancelFileOpen(Data->Iopb->TargetFileObject,FltObjects->Instance);
 			Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 			Data->IoStatus.Information = 0;
+			SpyLogDenial(Data, FltObjects, &NameInfo->Name);
 			FltReleaseFileNameInformation(NameInfo);
 			return FLT_PREOP_COMPLETE;
 		}
@@ -2100,6 +2347,7 @@ PreCreate(
 				Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 				Data->IoStatus.Information = 0;
 				//IoCompleteRequest(Data, IO_NO_INCREMENT);
+				SpyLogDenial(Data, FltObjects, &NameInfo->Name);
 				FltReleaseFileNameInformation(NameInfo);
 				return FLT_PREOP_COMPLETE;
 			}
@@ -2122,6 +2370,7 @@ FLT_PREOP_CALLBACK_STATUS PreReNameFile(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_O
 	NTSTATUS status;
 	PFILE_RENAME_INFORMATION pReNameInfo;
 	PFLT_FILE_NAME_INFORMATION NameInfo;
+	BOOLEAN allowed = FALSE;
 
 	pReNameInfo = (PFILE_RENAME_INFORMATION)Data->Iopb->Parameters.SetFileInformation.InfoBuffer;
 
@@ -2139,9 +2388,9 @@ FLT_PREOP_CALLBACK_STATUS PreReNameFile(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_O
 		return FLT_PREOP_SUCCESS_NO_CALLBACK;
 	}
 
-	if (TRUE == IsProtectionFile(NameInfo))																//禁止出现对应名称的文件Rename。								
+	if (TRUE == IsProtectedOperation(NameInfo, RULE_OP_RENAME, &allowed))									//禁止出现对应名称的文件Rename。								
 	{
-		if(IsOpenProccess())
+		if(allowed && SpyBurstOperation(Data, FltObjects, &NameInfo->Name, BURST_RENAME))		//突发重命名超限的进程被拒绝
 		{
 			FltReleaseFileNameInformation(NameInfo);
 			return SpyPreOperationCallback(Data, FltObjects, CompletionContext);
@@ -2150,6 +2399,7 @@ FLT_PREOP_CALLBACK_STATUS PreReNameFile(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_O
 		{
 			Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 			Data->IoStatus.Information = 0;
+			SpyLogDenial(Data, FltObjects, &NameInfo->Name);
 			FltReleaseFileNameInformation(NameInfo);
 			return FLT_PREOP_COMPLETE;
 		}
@@ -2167,6 +2417,7 @@ FLT_PREOP_CALLBACK_STATUS PreDeleteFile(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_O
 {
 	NTSTATUS status;
 	BOOLEAN isDir;
+	BOOLEAN allowed = FALSE;
 	PFLT_FILE_NAME_INFORMATION NameInfo;
 
 	status = FltIsDirectory(FltObjects->FileObject, FltObjects->Instance, &isDir);
@@ -2195,9 +2446,9 @@ FLT_PREOP_CALLBACK_STATUS PreDeleteFile(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_O
 		return FLT_PREOP_SUCCESS_NO_CALLBACK;
 	}
 
-	if (TRUE == IsProtectionFile(NameInfo))																//禁止出现对应名称的文件Rename。								
+	if (TRUE == IsProtectedOperation(NameInfo, RULE_OP_DELETE, &allowed))									//禁止出现对应名称的文件Rename。								
 	{
-		if(IsOpenProccess())
+		if(allowed && SpyBurstOperation(Data, FltObjects, &NameInfo->Name, BURST_DELETE))		//突发删除超限的进程被拒绝
 		{
 			FltReleaseFileNameInformation(NameInfo);
 			return SpyPreOperationCallback(Data, FltObjects, CompletionContext);
@@ -2206,6 +2457,7 @@ FLT_PREOP_CALLBACK_STATUS PreDeleteFile(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_O
 		{
 			Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 			Data->IoStatus.Information = 0;
+			SpyLogDenial(Data, FltObjects, &NameInfo->Name);
 			FltReleaseFileNameInformation(NameInfo);
 			return FLT_PREOP_COMPLETE;
 		}
@@ -2228,6 +2480,7 @@ PreSetInformation(
 {
 	PFLT_FILE_NAME_INFORMATION NameInfo;
 	NTSTATUS status;
+	BOOLEAN allowed = FALSE;
 
 	if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileRenameInformation)						//重命名操作
 		return PreReNameFile(Data, FltObjects, CompletionContext);
@@ -2244,9 +2497,9 @@ PreSetInformation(
 		return FLT_PREOP_SUCCESS_NO_CALLBACK;
 	}
 
-	if (TRUE == IsProtectionFile(NameInfo))																//禁止出现对应名称的文件Rename。								
+	if (TRUE == IsProtectedOperation(NameInfo, RULE_OP_INFO, &allowed))									//禁止出现对应名称的文件Rename。								
 	{
-		if (IsOpenProccess())
+		if (allowed)
 		{
 			//FltReleaseFileNameInformation(NameInfo);
 			//return SpyPreOperationCallback(Data, FltObjects, CompletionContext);
@@ -2255,6 +2508,7 @@ PreSetInformation(
 		{
 			Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 			Data->IoStatus.Information = 0;
+			SpyLogDenial(Data, FltObjects, &NameInfo->Name);
 			FltReleaseFileNameInformation(NameInfo);
 			return FLT_PREOP_COMPLETE;
 		}
@@ -2372,6 +2626,7 @@ VOID SetProtectionFolder(PUNICODE_STRING dir)
 	Clean_Fld_List();
 	ParseProtectionDir(dir);
 	IsInSetting = FALSE;
+	SpyDirectoryForget();																	//目录判定也全部作废
 	return;
 }
 
@@ -2403,3 +2658,121 @@ IOCTL_SHUTDOWN_NOREBOOT:
 	return;
 }
 
+NTSTATUS SetProtectionExtensions(PLONG mode, PUNICODE_STRING extensions, PULONG count)
+{
+	PFF_EXTENSION_POLICY policy = NULL;
+	PFF_EXTENSION_POLICY old;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	//
+	// 扩展名和组合方式在新表里一起建好再换上去，失败时保留原来的
+	//
+
+	if (*mode != EXTENSION_OFF && *mode != EXTENSION_AND && *mode != EXTENSION_OR)
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+	else
+	{
+		policy = ExAllocatePoolWithTag(PagedPool, sizeof(FF_EXTENSION_POLICY), EXT_TAG);
+		if (policy == NULL) {
+			LOG_PRINT(LOGFL_ERRORS, 
+				("fsFilter!ExAllocatePoolWithTag-extensions: Failed to allocate  memory\n"));
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		} else {
+			status = PolicySetExtensions(&policy->table, extensions);
+		}
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		if (policy != NULL) ExFreePoolWithTag(policy, EXT_TAG);
+
+		FltAcquireResourceShared(&ff_policy_lock);
+		*mode = (ff_ext_policy != NULL) ? ff_ext_policy->mode : EXTENSION_OFF;
+		*count = (ff_ext_policy != NULL) ? ff_ext_policy->table.count : 0;
+		FltReleaseResource(&ff_policy_lock);
+		return status;
+	}
+
+	policy->mode = *mode;
+	*count = policy->table.count;
+
+	if (*mode == EXTENSION_OFF)
+	{
+		ExFreePoolWithTag(policy, EXT_TAG);													//不用扩展名，保护目录单独判定
+		policy = NULL;
+	}
+
+	FltAcquireResourceExclusive(&ff_policy_lock);
+	old = ff_ext_policy;
+	ff_ext_policy = policy;
+	FltReleaseResource(&ff_policy_lock);
+
+	if (old != NULL) ExFreePoolWithTag(old, EXT_TAG);										//独占取得过，没有读者还在用旧表
+
+	KdPrint(("!Protected extensions set to %lu, mode %ld\n", *count, *mode));
+
+	return status;
+}
+
+NTSTATUS SetProtectionRules(PPOLICY_RULES rules, PULONG count)
+{
+	PFF_RULE_POLICY policy;
+	PFF_RULE_POLICY old;
+	NTSTATUS status;
+	ULONG index;
+
+	PAGED_CODE();
+
+	//
+	// 在新表里建好再换上去，失败时保留原来的规则
+	//
+
+	policy = ExAllocatePoolWithTag(PagedPool, sizeof(FF_RULE_POLICY), RULE_TAG);
+	if (policy == NULL) {
+			LOG_PRINT(LOGFL_ERRORS, 
+				("fsFilter!ExAllocatePoolWithTag-rules: Failed to allocate  memory\n"));
+			status = STATUS_INSUFFICIENT_RESOURCES;
+	} else {
+			status = PolicySetRules(&policy->table, rules);
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		if (policy != NULL) ExFreePoolWithTag(policy, RULE_TAG);
+
+		FltAcquireResourceShared(&ff_policy_lock);
+		*count = (ff_rule_policy != NULL) ? ff_rule_policy->table.count : 0;
+		FltReleaseResource(&ff_policy_lock);
+		return status;
+	}
+
+	policy->operations = 0;
+	for (index = 0; index < RULE_OPS; index++)
+	{
+		if (policy->table.operationCount[index] != 0) policy->operations |= 1 << index;
+	}
+
+	*count = policy->table.count;
+
+	if (policy->table.count == 0)
+	{
+		ExFreePoolWithTag(policy, RULE_TAG);													//清空规则
+		policy = NULL;
+	}
+
+	FltAcquireResourceExclusive(&ff_policy_lock);
+	old = ff_rule_policy;
+	ff_rule_policy = policy;
+	ff_rule_operations = (policy != NULL) ? policy->operations : 0;
+	FltReleaseResource(&ff_policy_lock);
+
+	if (old != NULL) ExFreePoolWithTag(old, RULE_TAG);										//独占取得过，没有读者还在用旧表
+
+	KdPrint(("!Policy rules set to %lu\n", *count));
+
+	return status;
+}
@@ -15,6 +15,10 @@ PUNICODE_STRING GetOpenProccess();
 
 VOID SetOpenProccess(PUNICODE_STRING proc);
 
+NTSTATUS SetProtectionExtensions(PLONG mode, PUNICODE_STRING extensions, PULONG count);
+
+NTSTATUS SetProtectionRules(PPOLICY_RULES rules, PULONG count);
+
 DRIVER_INITIALIZE DriverEntry;
 NTSTATUS
 DriverEntry (
@@ -189,3 +193,5 @@ PreSetInformation(
 
 BOOLEAN IsOpenProccess();
 BOOLEAN IsProtectionFileByProtectedDirName(PFLT_FILE_NAME_INFORMATION NameInfos);
+USHORT EvaluateRules(PFLT_FILE_NAME_INFORMATION NameInfos, ULONG Operation);
+BOOLEAN IsProtectedOperation(PFLT_FILE_NAME_INFORMATION NameInfos, ULONG Operation, PBOOLEAN Allowed);
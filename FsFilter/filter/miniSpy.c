@@ -54,12 +54,6 @@ extern PFLT_FILTER gFilterHandle;
     #pragma alloc_text(PAGE, SpyMessage)
 #endif
 
-//
-//  Memory allocation tag
-//
-
-#define SPY_TAG		'ypSM'
-
 
 #define SetFlagInterlocked(_ptrFlags,_flagToSet) \
     ((VOID)InterlockedOr(((volatile LONG *)(_ptrFlags)),_flagToSet))
@@ -375,6 +369,7 @@ Return Value:
     OBJECT_ATTRIBUTES oa;
     UNICODE_STRING uniString;
     NTSTATUS status = STATUS_SUCCESS;
+    ULONG i;
 
     try {
 
@@ -382,24 +377,40 @@ Return Value:
         // Initialize global data structures.
         //
 
-        MiniSpyData.LogSequenceNumber = 0;
         MiniSpyData.MaxRecordsToAllocate = DEFAULT_MAX_RECORDS_TO_ALLOCATE;
+        MiniSpyData.QuotaFloor = DEFAULT_RECORD_QUOTA_FLOOR;
+        MiniSpyData.QuotaCeiling = DEFAULT_RECORD_QUOTA_CEILING;
+        MiniSpyData.PriorityRecords = DEFAULT_PRIORITY_RECORDS;
         MiniSpyData.RecordsAllocated = 0;
         MiniSpyData.DebugFlags = SPY_DEBUG_PARSE_NAMES;
         MiniSpyData.NameQueryMethod = DEFAULT_NAME_QUERY_METHOD;
+        MiniSpyData.CoalesceMaxWrites = DEFAULT_WRITE_COALESCE_LIMIT;
+        MiniSpyData.CoalesceIdleTime = DEFAULT_WRITE_COALESCE_IDLE;
+        MiniSpyData.ProcessBudget = DEFAULT_PROCESS_RECORD_BUDGET;
+        MiniSpyData.ProcessSampleRate = DEFAULT_PROCESS_SAMPLE_RATE;
+        MiniSpyData.SampleWindow = DEFAULT_PROCESS_SAMPLE_WINDOW;
+        MiniSpyData.BurstThreshold[BURST_RENAME] = DEFAULT_BURST_THRESHOLD;
+        MiniSpyData.BurstThreshold[BURST_DELETE] = DEFAULT_BURST_THRESHOLD;
+        MiniSpyData.BurstThreshold[BURST_WRITE] = DEFAULT_BURST_THRESHOLD;
+        MiniSpyData.BurstWindow = DEFAULT_BURST_WINDOW;
+        MiniSpyData.BurstBlock = DEFAULT_BURST_BLOCK;
 
         MiniSpyData.DriverObject = DriverObject;
 
-        InitializeListHead( &MiniSpyData.OutputBufferList );
+        for (i = 0; i < LOG_QUEUES; i++) {
+
+            KeInitializeSpinLock( &MiniSpyData.LogQueues[i].Lock );
+            InitializeListHead( &MiniSpyData.LogQueues[i].List );
+            MiniSpyData.LogQueues[i].SequenceNumber = 0;
+        }
+
         KeInitializeSpinLock( &MiniSpyData.OutputBufferLock );
 
-        ExInitializeNPagedLookasideList( &MiniSpyData.FreeBufferList,
-                                         NULL,
-                                         NULL,
-                                         0,
-                                         RECORD_SIZE,
-                                         SPY_TAG,
-                                         0 );
+        SpyReaderInitialize();
+
+        SpyLossInitialize();
+
+        SpyInitializeBuffers();
 
 #if MINISPY_VISTA
 
@@ -422,6 +433,13 @@ Return Value:
 
         SpyReadDriverParameters(RegistryPath);
 
+        SpyPriorityInitialize();
+        SpyQuotaInitialize();
+        SpyCoalesceInitialize();
+        SpySampleInitialize();
+        SpyBurstInitialize();
+        SpySubscribeInitialize();
+
 #ifdef __SPY_BUFFERS_STANDALONE_C	
 
         //
@@ -463,7 +481,7 @@ Return Value:
                                              SpyConnect,
                                              SpyDisconnect,
                                              SpyMessage,
-                                             1 );
+                                             SPY_MAX_READERS );
 
         FltFreeSecurityDescriptor( sd );
 
@@ -493,7 +511,11 @@ Return Value:
              }
 #endif // __SPY_BUFFERS_STANDALONE_C	
 
-             ExDeleteNPagedLookasideList( &MiniSpyData.FreeBufferList );
+             SpyCoalesceShutdown();
+             SpyQuotaShutdown();
+             SpySubscribeShutdown();
+             SpyPriorityShutdown();
+             SpyDeleteBuffers();
         }
     }
 
@@ -520,25 +542,36 @@ Arguments
     ClientPort - This is the pointer to the client port that
         will be used to send messages from the filter.
     ServerPortCookie - unused
-    ConnectionContext - unused
-    SizeofContext   - unused
-    ConnectionCookie - unused
+    ConnectionContext - Optional MINISPY_CONNECT
+    SizeofContext   - Size of ConnectionContext in bytes
+    ConnectionCookie - Receives the connection's reader, see mspyReader.c
 
 Return Value
 
     STATUS_SUCCESS - to accept the connection
+    STATUS_CONNECTION_COUNT_LIMIT - if every reader slot is taken
 --*/
 {
+    PSPY_READER reader;
+    ULONG subscriberId = 0;
 
     PAGED_CODE();
 
     UNREFERENCED_PARAMETER( ServerPortCookie );
-    UNREFERENCED_PARAMETER( ConnectionContext );
-    UNREFERENCED_PARAMETER( SizeOfContext);
-    UNREFERENCED_PARAMETER( ConnectionCookie );
 
-    ASSERT( MiniSpyData.ClientPort == NULL );
-    MiniSpyData.ClientPort = ClientPort;
+    if (ConnectionContext != NULL && SizeOfContext >= sizeof( MINISPY_CONNECT )) {
+
+        subscriberId = ((PMINISPY_CONNECT)ConnectionContext)->SubscriberId;
+    }
+
+    reader = SpyReaderConnect( ClientPort, subscriberId );
+
+    if (reader == NULL) {
+
+        return STATUS_CONNECTION_COUNT_LIMIT;
+    }
+
+    *ConnectionCookie = reader;
     return STATUS_SUCCESS;
 }
 
@@ -555,7 +588,7 @@ Routine Description
 
 Arguments
 
-    ConnectionCookie - unused
+    ConnectionCookie - The connection's reader
 
 Return value
 
@@ -565,13 +598,11 @@ Return value
 
     PAGED_CODE();
 
-    UNREFERENCED_PARAMETER( ConnectionCookie );
-
     //
-    //  Close our handle
+    //  Let go of the reader's records and close our handle
     //
 
-    FltCloseClientPort( MiniSpyData.Filter, &MiniSpyData.ClientPort );
+    SpyReaderDisconnect( (PSPY_READER)ConnectionCookie );
 }
 
 NTSTATUS
@@ -616,8 +647,17 @@ Return Value:
 
 #endif // __SPY_BUFFERS_STANDALONE_C	 
 
+    //
+    //  Send up any coalesced writes before the output list is emptied.
+    //
+
+    SpyCoalesceShutdown();
+    SpyQuotaShutdown();
+    SpySubscribeShutdown();
+
     SpyEmptyOutputBufferList();
-    ExDeleteNPagedLookasideList( &MiniSpyData.FreeBufferList );
+    SpyPriorityShutdown();
+    SpyDeleteBuffers();
 
     return STATUS_SUCCESS;
 }
@@ -670,7 +710,7 @@ Routine Description:
 
 Arguments:
 
-    ConnectionCookie - unused
+    ConnectionCookie - The connection's reader
 
     OperationCode - An identifier describing what type of message this
         is.  These codes are defined by the MiniFilter.
@@ -690,13 +730,12 @@ Return Value:
 
 --*/
 {
+    PSPY_READER reader = (PSPY_READER)ConnectionCookie;
     MINISPY_COMMAND command;
     NTSTATUS status;
 
     PAGED_CODE();
 
-    UNREFERENCED_PARAMETER( ConnectionCookie );
-
     //
     //                      **** PLEASE READ ****
     //
@@ -733,6 +772,40 @@ Return Value:
 
         switch (command) {
 
+            case AckMiniSpyLog:
+                {
+                    MINISPY_ACK ack;
+
+                    if (InputBufferSize < FIELD_OFFSET(COMMAND_MESSAGE,Data) + sizeof( MINISPY_ACK )) {
+
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    try {
+
+                        RtlCopyMemory( &ack, ((PCOMMAND_MESSAGE) InputBuffer)->Data, sizeof( MINISPY_ACK ) );
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        return GetExceptionCode();
+                    }
+
+                    SpyReaderAcknowledge( reader, &ack );
+
+                    if ((OutputBuffer == NULL) || (OutputBufferSize == 0)) {
+
+                        *ReturnOutputBufferLength = 0;
+                        status = STATUS_SUCCESS;
+                        break;
+                    }
+                }
+
+                //
+                //  Carry on and return the next batch, so acknowledging the
+                //  last one costs no extra call.
+                //
+
             case GetMiniSpyLog:
 
                 //
@@ -784,7 +857,8 @@ Return Value:
                 //  Get the log record.
                 //
 
-                status = SpyGetLog( OutputBuffer,
+                status = SpyGetLog( reader,
+                                    OutputBuffer,
                                     OutputBufferSize,
                                     ReturnOutputBufferLength );
                 break;
@@ -1006,6 +1080,433 @@ Return Value:
                 }
                 break;
 
+                case SetMiniSpyRecordQuota:
+                {
+                    PLOG_RECORD pLogRecord;
+                    RECORD_QUOTA quota;
+                    NTSTATUS setStatus;
+                    WCHAR state[64];
+                    size_t stateLength;
+
+                    if (!IS_ALIGNED(OutputBuffer,sizeof(ULONG)) ||
+                        (InputBufferSize < FIELD_OFFSET(COMMAND_MESSAGE,Data) + sizeof( RECORD_QUOTA ))) {
+
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    try {
+
+                        RtlCopyMemory( &quota, ((PCOMMAND_MESSAGE) InputBuffer)->Data, sizeof( RECORD_QUOTA ) );
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        return GetExceptionCode();
+                    }
+
+                    setStatus = SpyQuotaSet( quota.Floor, quota.Ceiling );
+
+                    //
+                    //  Reply with the quota now in force.
+                    //
+
+                    RtlStringCbPrintfW( state,
+                                        sizeof( state ),
+                                        L"quota %d [%d-%d], %d in use",
+                                        MiniSpyData.MaxRecordsToAllocate,
+                                        MiniSpyData.QuotaFloor,
+                                        MiniSpyData.QuotaCeiling,
+                                        MiniSpyData.RecordsAllocated );
+                    RtlStringCbLengthW( state, sizeof( state ), &stateLength );
+
+                    pLogRecord = (PLOG_RECORD)OutputBuffer;
+
+                    try {
+
+                        pLogRecord->Length =  sizeof( LOG_RECORD ) + ROUND_TO_SIZE( stateLength + sizeof( UNICODE_NULL ), sizeof( PVOID ) );
+
+                        if ((OutputBufferSize < pLogRecord->Length ) || (OutputBuffer == NULL)) {
+
+                            status = STATUS_INVALID_PARAMETER;
+                            break;
+                        }
+
+                        RtlCopyMemory( pLogRecord->Name, state, stateLength + sizeof( UNICODE_NULL ) );
+                        pLogRecord->Reserved = NT_SUCCESS( setStatus ) ? 0 : (ULONG)-1;
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        return GetExceptionCode();
+                    }
+
+                    *ReturnOutputBufferLength = pLogRecord->Length;
+                    status = STATUS_SUCCESS;
+                }
+                break;
+
+            case SetMiniSpyBurst:
+                {
+                    PLOG_RECORD pLogRecord;
+                    BURST_SETTINGS settings;
+                    NTSTATUS setStatus;
+                    WCHAR state[128];
+                    size_t stateLength;
+
+                    if (!IS_ALIGNED(OutputBuffer,sizeof(ULONG)) ||
+                        (InputBufferSize < FIELD_OFFSET(COMMAND_MESSAGE,Data) + sizeof( BURST_SETTINGS ))) {
+
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    try {
+
+                        RtlCopyMemory( &settings, ((PCOMMAND_MESSAGE) InputBuffer)->Data, sizeof( BURST_SETTINGS ) );
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        return GetExceptionCode();
+                    }
+
+                    setStatus = SpyBurstSet( &settings );
+
+                    //
+                    //  Reply with the thresholds now in force.
+                    //
+
+                    RtlStringCbPrintfW( state,
+                                        sizeof( state ),
+                                        L"%d renames, %d deletes, %d overwrites in %d ms%s",
+                                        MiniSpyData.BurstThreshold[BURST_RENAME],
+                                        MiniSpyData.BurstThreshold[BURST_DELETE],
+                                        MiniSpyData.BurstThreshold[BURST_WRITE],
+                                        MiniSpyData.BurstWindow,
+                                        (MiniSpyData.BurstBlock != 0) ? L", then blocked" : L"" );
+                    RtlStringCbLengthW( state, sizeof( state ), &stateLength );
+
+                    pLogRecord = (PLOG_RECORD)OutputBuffer;
+
+                    try {
+
+                        pLogRecord->Length =  sizeof( LOG_RECORD ) + ROUND_TO_SIZE( stateLength + sizeof( UNICODE_NULL ), sizeof( PVOID ) );
+
+                        if ((OutputBufferSize < pLogRecord->Length ) || (OutputBuffer == NULL)) {
+
+                            status = STATUS_INVALID_PARAMETER;
+                            break;
+                        }
+
+                        RtlCopyMemory( pLogRecord->Name, state, stateLength + sizeof( UNICODE_NULL ) );
+                        pLogRecord->Reserved = NT_SUCCESS( setStatus ) ? 0 : (ULONG)-1;
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        return GetExceptionCode();
+                    }
+
+                    *ReturnOutputBufferLength = pLogRecord->Length;
+                    status = STATUS_SUCCESS;
+                }
+                break;
+
+            case SetMiniSpyExtensions:
+                {
+                    PLOG_RECORD pLogRecord;
+                    UNICODE_STRING extensions;
+                    LONG mode;
+                    ULONG count;
+                    ULONG listLength;
+                    NTSTATUS setStatus;
+                    WCHAR state[96];
+                    size_t stateLength;
+
+                    if (!IS_ALIGNED(OutputBuffer,sizeof(ULONG)) ||
+                        (InputBufferSize < FIELD_OFFSET(COMMAND_MESSAGE,Data) + FIELD_OFFSET(EXTENSION_SETTINGS,Extensions))) {
+
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    listLength = InputBufferSize - FIELD_OFFSET(COMMAND_MESSAGE,Data) - FIELD_OFFSET(EXTENSION_SETTINGS,Extensions);
+
+                    if (listLength > EXTENSION_MAX_LENGTH) {
+
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    listLength &= ~1;
+
+                    //
+                    //  Take the list out of the user buffer before parsing
+                    //  it.
+                    //
+
+                    extensions.Buffer = ExAllocatePoolWithTag( PagedPool, listLength + sizeof( UNICODE_NULL ), SPY_TAG );
+
+                    if (extensions.Buffer == NULL) {
+
+                        status = STATUS_INSUFFICIENT_RESOURCES;
+                        break;
+                    }
+
+                    try {
+
+                        mode = ((PEXTENSION_SETTINGS)((PCOMMAND_MESSAGE) InputBuffer)->Data)->Mode;
+                        RtlCopyMemory( extensions.Buffer,
+                                       ((PEXTENSION_SETTINGS)((PCOMMAND_MESSAGE) InputBuffer)->Data)->Extensions,
+                                       listLength );
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        ExFreePoolWithTag( extensions.Buffer, SPY_TAG );
+                        return GetExceptionCode();
+                    }
+
+                    extensions.Length = (USHORT)listLength;
+                    extensions.MaximumLength = (USHORT)(listLength + sizeof( UNICODE_NULL ));
+
+                    //
+                    //  The mode and count come back as now in force, for
+                    //  the reply, whether or not the setting took.
+                    //
+
+                    setStatus = SetProtectionExtensions( &mode, &extensions, &count );
+
+                    ExFreePoolWithTag( extensions.Buffer, SPY_TAG );
+
+                    RtlStringCbPrintfW( state,
+                                        sizeof( state ),
+                                        L"%lu extensions, %s",
+                                        count,
+                                        (mode == EXTENSION_AND) ? L"in the protected folders" :
+                                        (mode == EXTENSION_OR) ? L"anywhere, besides the protected folders" :
+                                                                 L"unused, the protected folders alone decide" );
+                    RtlStringCbLengthW( state, sizeof( state ), &stateLength );
+
+                    pLogRecord = (PLOG_RECORD)OutputBuffer;
+
+                    try {
+
+                        pLogRecord->Length =  sizeof( LOG_RECORD ) + ROUND_TO_SIZE( stateLength + sizeof( UNICODE_NULL ), sizeof( PVOID ) );
+
+                        if ((OutputBufferSize < pLogRecord->Length ) || (OutputBuffer == NULL)) {
+
+                            status = STATUS_INVALID_PARAMETER;
+                            break;
+                        }
+
+                        RtlCopyMemory( pLogRecord->Name, state, stateLength + sizeof( UNICODE_NULL ) );
+                        pLogRecord->Reserved = NT_SUCCESS( setStatus ) ? 0 : (ULONG)-1;
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        return GetExceptionCode();
+                    }
+
+                    *ReturnOutputBufferLength = pLogRecord->Length;
+                    status = STATUS_SUCCESS;
+                }
+                break;
+
+            case SetMiniSpyRules:
+                {
+                    PLOG_RECORD pLogRecord;
+                    PPOLICY_RULES rules;
+                    ULONG count;
+                    NTSTATUS setStatus;
+                    WCHAR state[32];
+                    size_t stateLength;
+
+                    if (!IS_ALIGNED(OutputBuffer,sizeof(ULONG)) ||
+                        (InputBufferSize < FIELD_OFFSET(COMMAND_MESSAGE,Data) + sizeof( POLICY_RULES ))) {
+
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    //
+                    //  The rules are too big for the stack.
+                    //
+
+                    rules = ExAllocatePoolWithTag( PagedPool, sizeof( POLICY_RULES ), SPY_TAG );
+
+                    if (rules == NULL) {
+
+                        status = STATUS_INSUFFICIENT_RESOURCES;
+                        break;
+                    }
+
+                    try {
+
+                        RtlCopyMemory( rules, ((PCOMMAND_MESSAGE) InputBuffer)->Data, sizeof( POLICY_RULES ) );
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        ExFreePoolWithTag( rules, SPY_TAG );
+                        return GetExceptionCode();
+                    }
+
+                    setStatus = SetProtectionRules( rules, &count );
+
+                    ExFreePoolWithTag( rules, SPY_TAG );
+
+                    //
+                    //  Reply with the number of rules now in force.
+                    //
+
+                    RtlStringCbPrintfW( state, sizeof( state ), L"%lu rules", count );
+                    RtlStringCbLengthW( state, sizeof( state ), &stateLength );
+
+                    pLogRecord = (PLOG_RECORD)OutputBuffer;
+
+                    try {
+
+                        pLogRecord->Length =  sizeof( LOG_RECORD ) + ROUND_TO_SIZE( stateLength + sizeof( UNICODE_NULL ), sizeof( PVOID ) );
+
+                        if ((OutputBufferSize < pLogRecord->Length ) || (OutputBuffer == NULL)) {
+
+                            status = STATUS_INVALID_PARAMETER;
+                            break;
+                        }
+
+                        RtlCopyMemory( pLogRecord->Name, state, stateLength + sizeof( UNICODE_NULL ) );
+                        pLogRecord->Reserved = NT_SUCCESS( setStatus ) ? 0 : (ULONG)-1;
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        return GetExceptionCode();
+                    }
+
+                    *ReturnOutputBufferLength = pLogRecord->Length;
+                    status = STATUS_SUCCESS;
+                }
+                break;
+
+            case GetMiniSpyLossStats:
+                {
+                    PLOG_RECORD pLogRecord;
+                    WCHAR stats[512];
+                    size_t statsLength;
+
+                    if (!IS_ALIGNED(OutputBuffer,sizeof(ULONG))) {
+
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    SpyLossFormatStats( stats, sizeof( stats ) );
+                    RtlStringCbLengthW( stats, sizeof( stats ), &statsLength );
+                    SpyReaderFormatStats( (PWCHAR)Add2Ptr( stats, statsLength ), sizeof( stats ) - statsLength );
+                    RtlStringCbLengthW( stats, sizeof( stats ), &statsLength );
+
+                    pLogRecord = (PLOG_RECORD)OutputBuffer;
+
+                    try {
+
+                        pLogRecord->Length =  sizeof( LOG_RECORD ) + ROUND_TO_SIZE( statsLength + sizeof( UNICODE_NULL ), sizeof( PVOID ) );
+
+                        if ((OutputBufferSize < pLogRecord->Length ) || (OutputBuffer == NULL)) {
+
+                            status = STATUS_INVALID_PARAMETER;
+                            break;
+                        }
+
+                        RtlCopyMemory( pLogRecord->Name, stats, statsLength + sizeof( UNICODE_NULL ) );
+                        pLogRecord->Reserved = 0;
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        return GetExceptionCode();
+                    }
+
+                    *ReturnOutputBufferLength = pLogRecord->Length;
+                    status = STATUS_SUCCESS;
+                }
+                break;
+
+            case SetMiniSpySubscription:
+                {
+                    PLOG_RECORD pLogRecord;
+                    PSUBSCRIPTION subscription;
+                    ULONG subscriptionLength;
+                    NTSTATUS setStatus;
+                    WCHAR state[128];
+                    size_t stateLength;
+
+                    if (!IS_ALIGNED(OutputBuffer,sizeof(ULONG)) ||
+                        (InputBufferSize < FIELD_OFFSET(COMMAND_MESSAGE,Data) + FIELD_OFFSET(SUBSCRIPTION,Strings))) {
+
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    //
+                    //  Capture the whole subscription, strings included,
+                    //  before looking at any of it.
+                    //
+
+                    subscriptionLength = InputBufferSize - FIELD_OFFSET(COMMAND_MESSAGE,Data);
+
+                    if (subscriptionLength > SUBSCRIBE_MAX_LENGTH) {
+
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    subscription = ExAllocatePoolWithTag( PagedPool, subscriptionLength, SPY_TAG );
+
+                    if (subscription == NULL) {
+
+                        status = STATUS_INSUFFICIENT_RESOURCES;
+                        break;
+                    }
+
+                    try {
+
+                        RtlCopyMemory( subscription, ((PCOMMAND_MESSAGE) InputBuffer)->Data, subscriptionLength );
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        ExFreePoolWithTag( subscription, SPY_TAG );
+                        return GetExceptionCode();
+                    }
+
+                    setStatus = SpySubscribeSet( reader, subscription, subscriptionLength );
+                    ExFreePoolWithTag( subscription, SPY_TAG );
+
+                    //
+                    //  Reply with the subscription now in force.
+                    //
+
+                    SpySubscribeFormat( reader, state, sizeof( state ) );
+                    RtlStringCbLengthW( state, sizeof( state ), &stateLength );
+
+                    pLogRecord = (PLOG_RECORD)OutputBuffer;
+
+                    try {
+
+                        pLogRecord->Length =  sizeof( LOG_RECORD ) + ROUND_TO_SIZE( stateLength + sizeof( UNICODE_NULL ), sizeof( PVOID ) );
+
+                        if ((OutputBufferSize < pLogRecord->Length ) || (OutputBuffer == NULL)) {
+
+                            status = STATUS_INVALID_PARAMETER;
+                            break;
+                        }
+
+                        RtlCopyMemory( pLogRecord->Name, state, stateLength + sizeof( UNICODE_NULL ) );
+                        pLogRecord->Reserved = NT_SUCCESS( setStatus ) ? 0 : (ULONG)-1;
+
+                    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+                        return GetExceptionCode();
+                    }
+
+                    *ReturnOutputBufferLength = pLogRecord->Length;
+                    status = STATUS_SUCCESS;
+                }
+                break;
+
             default:
                 status = STATUS_INVALID_PARAMETER;
                 break;
@@ -1063,7 +1564,29 @@ Return Value:
     PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
     //UNICODE_STRING defaultName;
     PUNICODE_STRING nameToUse;
+    SPY_IDENTITY identity;
     NTSTATUS status;
+    ULONG readers;
+
+    //
+    //  Operations no reader has subscribed to are not logged.
+    //
+
+    readers = SpySubscribeOperation( Data );
+
+    if (readers == 0) {
+
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    //
+    //  Processes over their record budget are only sampled.
+    //
+
+    if (!SpySampleOperation()) {
+
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
  
     //
     //  We got a log record, if there is a file object, get its name.
@@ -1119,19 +1642,42 @@ Return Value:
     }
     else
     {
+        //
+        //  Without a name the operation cannot be logged, but it was seen
+        //  and must not go missing without a word.
+        //
+
+        SpyLossRecord( LOSS_DISCARDED, Data->Iopb->MajorFunction );
+
         status = FLT_PREOP_SUCCESS_NO_CALLBACK;
         return status;
     }
     
 
     //
-    //  Try and get a log record
+    //  Try and get a log record big enough for the file name and the names
+    //  of the process and user
     //
 
-    recordList = SpyNewRecord();
+    SpyQueryIdentity( &identity );
+
+    readers = SpySubscribeMatch( nameToUse, &identity, readers );
+
+    if (readers == 0) {
+
+        FltReleaseFileNameInformation( nameInfo );
+        SpyReleaseIdentity( &identity );
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    recordList = SpyNewRecord( Data->Iopb->MajorFunction,
+                               SPY_NAME_SPACE( nameToUse->Length ) +
+                                    SpyIdentityNameSpace( &identity ) );
     
     if (recordList) {
 
+        recordList->Readers = readers;
+
         //
         //  Store the name
         //
@@ -1152,7 +1698,7 @@ Return Value:
         //  Set all of the operation information into the record
         //
 
-        SpyLogPreOperationData( Data, FltObjects, recordList );
+        SpyLogPreOperationData( Data, FltObjects, &identity, recordList );
 
         //
         //  Pass the record to our completions routine and return that
@@ -1178,8 +1724,18 @@ Return Value:
             *CompletionContext = recordList;
             returnStatus = FLT_PREOP_SUCCESS_WITH_CALLBACK;
         }
+
+    } else {
+
+        //
+        //  The loss has been accounted for, just release the name.
+        //
+
+        FltReleaseFileNameInformation( nameInfo );
     }
 
+    SpyReleaseIdentity( &identity );
+
     return returnStatus;
 }
 
@@ -1238,7 +1794,7 @@ Return Value:
 
     if (FlagOn(Flags,FLTFL_POST_OPERATION_DRAINING)) {
 
-        SpyFreeRecord( recordList );
+        SpyDiscardRecord( recordList );
         return FLT_POSTOP_FINISHED_PROCESSING;
     }
 
@@ -1248,6 +1804,16 @@ Return Value:
 
     SpyLogPostOperationData( Data, recordList );
 
+    //
+    //  Only now is a delete told from a delete pending.
+    //
+
+    if (!SpySubscribeDisposition( recordList )) {
+
+        SpyFreeRecord( recordList );
+        return FLT_POSTOP_FINISHED_PROCESSING;
+    }
+
     //
     //  Log reparse tag information if specified.
     //
@@ -1255,7 +1821,10 @@ Return Value:
     tagData = Data->TagData;
     if (tagData) {
 
-        reparseRecordList = SpyNewRecord();
+        copyLength = FLT_TAG_DATA_BUFFER_HEADER_SIZE + tagData->TagDataLength;
+
+        reparseRecordList = SpyNewRecord( Data->Iopb->MajorFunction,
+                                          ROUND_TO_SIZE( copyLength, sizeof( PVOID ) ) );
 
         if (reparseRecordList) {
 
@@ -1269,11 +1838,9 @@ Return Value:
 
             reparseLogRecord = &reparseRecordList->LogRecord;
 
-            copyLength = FLT_TAG_DATA_BUFFER_HEADER_SIZE + tagData->TagDataLength;
-
-            if(copyLength > MAX_NAME_SPACE) {
+            if(copyLength > REMAINING_NAME_SPACE( reparseRecordList )) {
 
-                copyLength = MAX_NAME_SPACE;
+                copyLength = REMAINING_NAME_SPACE( reparseRecordList );
             }
 
             //
@@ -1292,10 +1859,15 @@ Return Value:
     }
 
     //
-    //  Send the logged information to the user service.
+    //  Send the logged information to the user service.  Successful writes
+    //  are held back so that a run of them is logged as one record.
     //
 
-    SpyLog( recordList );
+    if (Data->Iopb->MajorFunction != IRP_MJ_WRITE ||
+        !SpyCoalesceHold( Data, FltObjects, recordList )) {
+
+        SpyLog( recordList );
+    }
 
     if (reparseRecordList) {
 
@@ -1535,7 +2107,7 @@ ENLIST_IN_TRANSACTION:
     //  Log a record that a new transaction has started.
     //
 
-    recordList = SpyNewRecord();
+    recordList = SpyNewRecord( IRP_MJ_TRANSACTION_NOTIFY, 0 );
 
     if (recordList) {
 
@@ -1571,7 +2143,7 @@ SpyKtmNotificationCallback (
     //  Try and get a log record
     //
 
-    recordList = SpyNewRecord();
+    recordList = SpyNewRecord( IRP_MJ_TRANSACTION_NOTIFY, 0 );
 
     if (recordList) {
 
@@ -0,0 +1,710 @@
+﻿/*++
+
+Module Name:
+
+    mspyBurst.c
+
+Abstract:
+
+    This module watches for a process renaming, deleting or overwriting
+    many files in protected folders in a short time, the way ransomware
+    does, and reports it the moment it happens instead of leaving it to
+    be found in the log, which may already have lost the records.
+
+    Every process that changes a protected folder gets an entry in a
+    small table, with a sliding window counter for each kind of change.
+    The window is cut into SPY_BURST_SLOTS slices; each counter of a
+    slice carries the slice's number next to its count, so a counter left
+    over from an earlier slice is started again by the first operation to
+    find it, and a window's total is the sum of the counters whose slice
+    is recent enough.  Entries are claimed and counters bumped with
+    interlocked operations, so counting takes no lock and never waits.
+
+    When a count reaches its threshold a RECORD_TYPE_BURST record is sent
+    up on the priority lane, at most once per window per process and
+    kind, and with BurstBlock set the process is denied any further change
+    to protected folders until the thresholds are set again.
+
+    An overwrite is counted once per file object: on a create that
+    supersedes or overwrites the file, or else on the first write.  A
+    small table remembers the file objects already counted until they
+    are closed.  Later writes on them only check whether the process is
+    blocked.
+
+    Processes are told apart by their creation time as well as their id,
+    which is reused.  An entry goes back to the pool once its process has
+    counted nothing for a whole window, unless the process is blocked.
+    When all the entries a process may use are busy it is not counted;
+    counts are exact otherwise, but for the one operation that may land
+    in an entry being taken over.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+//#include <dontuse.h>
+#include <suppress.h>
+
+#include "mspyKern.h"
+
+NTKERNELAPI
+LONGLONG
+PsGetProcessCreateTimeQuadPart (
+    __in PEPROCESS Process
+    );
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, SpyBurstInitialize)
+    #pragma alloc_text(PAGE, SpyBurstSet)
+#endif
+
+static const UCHAR SpyBurstKindNames[BURST_KINDS] = { 'R', 'D', 'W' };
+
+#define SpyBurstHandles(_fo) \
+    (&MiniSpyData.BurstFileObjects[((ULONG_PTR)(_fo) >> 4) & (SPY_BURST_HANDLES - SPY_BURST_HANDLE_PROBES)])
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+ULONG
+SpyBurstSlice (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Works out the slice the current time falls in.  Slice numbers wrap,
+    so they are only ever compared by difference.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    The slice number.
+
+--*/
+{
+    ULONGLONG length = (10000 * (ULONGLONG)MiniSpyData.BurstWindow) / SPY_BURST_SLOTS;
+
+    return (ULONG)(KeQueryInterruptTime() / length);
+}
+
+
+static
+LONGLONG
+SpyBurstKey (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Works out the key of the current process.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    The key, never 0.
+
+--*/
+{
+    LONGLONG key;
+
+    //
+    //  The create time is multiplied out first: XORed in as it is, two
+    //  processes created a few ticks apart could have the same key.
+    //
+
+    key = (LONGLONG)((ULONGLONG)PsGetProcessCreateTimeQuadPart( PsGetCurrentProcess() ) * 0x9E3779B97F4A7C15ULL) ^
+          (LONGLONG)(ULONG_PTR)PsGetCurrentProcessId();
+
+    return (key != 0) ? key : 1;
+}
+
+
+static
+PSPY_BURST_ENTRY
+SpyBurstFind (
+    __in LONGLONG Key,
+    __in ULONG Slice,
+    __in BOOLEAN Claim
+    )
+/*++
+
+Routine Description:
+
+    Finds the entry of a process among the SPY_BURST_PROBES it may use,
+    and takes a free or idle one for it if it has none.  A thread that
+    loses an entry to another looks again, as the other may have been of
+    the same process.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Key - The process, see SpyBurstKey.
+
+    Slice - The current slice.
+
+    Claim - FALSE to only look.
+
+Return Value:
+
+    The entry, or NULL.
+
+--*/
+{
+    PSPY_BURST_ENTRY entry;
+    PSPY_BURST_ENTRY candidate;
+    LONGLONG candidateKey;
+    LONG candidateSlice;
+    ULONG attempts = 0;
+    ULONG start;
+    ULONG i;
+
+    start = (ULONG)(((ULONGLONG)Key * 0x9E3779B97F4A7C15ULL) >> 32);
+
+SpyBurstFind_Retry:
+
+    candidate = NULL;
+    candidateKey = 0;
+    candidateSlice = 0;
+
+    for (i = 0; i < SPY_BURST_PROBES; i++) {
+
+        entry = &MiniSpyData.BurstEntries[(start + i) % SPY_BURST_ENTRIES];
+
+        if (entry->Key == Key) {
+
+            return entry;
+        }
+
+        if (candidate == NULL &&
+            (entry->Key == 0 ||
+             (entry->Blocked == 0 && Slice - (ULONG)entry->LastSlice >= SPY_BURST_SLOTS))) {
+
+            candidate = entry;
+            candidateKey = entry->Key;
+            candidateSlice = entry->LastSlice;
+        }
+    }
+
+    if (!Claim || candidate == NULL) {
+
+        return NULL;
+    }
+
+    //
+    //  The entry is marked used in this slice before its key changes, so
+    //  no one who sees the new key can take the entry as idle.  The old
+    //  counters are all outside the window, so they need not be cleared.
+    //
+
+    if (InterlockedCompareExchange( &candidate->LastSlice, (LONG)Slice, candidateSlice ) != candidateSlice ||
+        InterlockedCompareExchange64( &candidate->Key, Key, candidateKey ) != candidateKey) {
+
+        if (++attempts < SPY_BURST_PROBES) {
+
+            goto SpyBurstFind_Retry;
+        }
+
+        return NULL;
+    }
+
+    candidate->ProcessId = (FILE_ID)PsGetCurrentProcessId();
+    RtlZeroMemory( (PVOID)candidate->Alerted, sizeof( candidate->Alerted ) );
+
+    return candidate;
+}
+
+
+static
+LONG
+SpyBurstCount (
+    __inout PSPY_BURST_ENTRY Entry,
+    __in ULONG Kind,
+    __in ULONG Slice
+    )
+/*++
+
+Routine Description:
+
+    Counts an operation in the current slice and adds up the window.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Entry - The process's entry.
+
+    Kind - BURST_RENAME, BURST_DELETE or BURST_WRITE.
+
+    Slice - The current slice.
+
+Return Value:
+
+    The operations of that kind in the window, this one included.
+
+--*/
+{
+    __volatile LONGLONG *counter = &Entry->Slots[Kind][Slice % SPY_BURST_SLOTS];
+    ULONGLONG value;
+    ULONGLONG newValue;
+    LONG total = 0;
+    ULONG i;
+
+    do {
+
+        value = (ULONGLONG)*counter;
+
+        if ((ULONG)(value >> 32) == Slice) {
+
+            newValue = value + 1;
+
+        } else {
+
+            newValue = ((ULONGLONG)Slice << 32) | 1;
+        }
+
+    } while (InterlockedCompareExchange64( counter,
+                                           (LONGLONG)newValue,
+                                           (LONGLONG)value ) != (LONGLONG)value);
+
+    Entry->LastSlice = (LONG)Slice;
+
+    for (i = 0; i < SPY_BURST_SLOTS; i++) {
+
+        value = (ULONGLONG)Entry->Slots[Kind][i];
+
+        if (Slice - (ULONG)(value >> 32) < SPY_BURST_SLOTS) {
+
+            total += (LONG)(ULONG)value;
+        }
+    }
+
+    return total;
+}
+
+
+static
+VOID
+SpyBurstAlert (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PUNICODE_STRING FileName,
+    __in ULONG Kind,
+    __in LONG Count,
+    __in BOOLEAN Blocked
+    )
+/*++
+
+Routine Description:
+
+    Reports a process that went over a threshold on the priority lane.
+    The record looks like one for the operation that tipped it over.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Data - The operation.
+
+    FltObjects - Objects related to the operation.
+
+    FileName - The name of the file it was aimed at.
+
+    Kind - The kind of operation that went over its threshold.
+
+    Count - How many there were in the window.
+
+    Blocked - Whether the process is now blocked.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_LIST recordList;
+    SPY_IDENTITY identity;
+
+    SpyQueryIdentity( &identity );
+
+    recordList = SpyPriorityNewRecord( Data->Iopb->MajorFunction,
+                                       SPY_NAME_SPACE( FileName->Length ) +
+                                            SpyIdentityNameSpace( &identity ) );
+
+    if (recordList == NULL) {
+
+        SpyReleaseIdentity( &identity );
+        return;
+    }
+
+    SpySetRecordName( &recordList->LogRecord, FileName );
+    SpyLogPreOperationData( Data, FltObjects, &identity, recordList );
+    SpyReleaseIdentity( &identity );
+
+    recordList->LogRecord.RecordType |= RECORD_TYPE_BURST;
+    recordList->LogRecord.Data.CompletionTime = recordList->LogRecord.Data.OriginatingTime;
+    recordList->LogRecord.Data.Reserved[0] = Blocked ? 'b' : 'B';
+    recordList->LogRecord.Data.Reserved[1] = SpyBurstKindNames[Kind];
+    recordList->LogRecord.Data.Aggregate.Count = (ULONG)Count;
+
+    SpyLogPriority( recordList );
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyBurstInitialize (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Clears the table and checks the settings read from the registry.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    RtlZeroMemory( MiniSpyData.BurstEntries, sizeof( MiniSpyData.BurstEntries ) );
+    MiniSpyData.BurstBlocked = 0;
+
+    if (MiniSpyData.BurstWindow < SPY_BURST_SLOTS) {
+
+        MiniSpyData.BurstWindow = DEFAULT_BURST_WINDOW;
+    }
+
+    for (i = 0; i < BURST_KINDS; i++) {
+
+        if (MiniSpyData.BurstThreshold[i] < 0) {
+
+            MiniSpyData.BurstThreshold[i] = 0;
+        }
+    }
+}
+
+
+NTSTATUS
+SpyBurstSet (
+    __in PBURST_SETTINGS Settings
+    )
+/*++
+
+Routine Description:
+
+    Changes the thresholds at run time.  Every count starts again and
+    blocked processes are let go.
+
+Arguments:
+
+    Settings - The new thresholds, window and blocking.
+
+Return Value:
+
+    STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (Settings->Window < SPY_BURST_SLOTS) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < BURST_KINDS; i++) {
+
+        if (Settings->Threshold[i] < 0) {
+
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    //
+    //  Turn counting off while the table is cleared, so no slice of the
+    //  old window length is counted in the new one.
+    //
+
+    for (i = 0; i < BURST_KINDS; i++) {
+
+        InterlockedExchange( &MiniSpyData.BurstThreshold[i], 0 );
+    }
+
+    InterlockedExchange( &MiniSpyData.BurstBlocked, 0 );
+    RtlZeroMemory( MiniSpyData.BurstEntries, sizeof( MiniSpyData.BurstEntries ) );
+
+    MiniSpyData.BurstWindow = Settings->Window;
+    MiniSpyData.BurstBlock = Settings->Block;
+
+    for (i = 0; i < BURST_KINDS; i++) {
+
+        InterlockedExchange( &MiniSpyData.BurstThreshold[i], Settings->Threshold[i] );
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+BOOLEAN
+SpyBurstOperation (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PUNICODE_STRING FileName,
+    __in ULONG Kind
+    )
+/*++
+
+Routine Description:
+
+    Counts a change to a protected folder against the current process,
+    and reports the process if that takes it over its threshold.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Data - The operation.
+
+    FltObjects - Objects related to the operation.
+
+    FileName - The name of the file it is aimed at.
+
+    Kind - BURST_RENAME, BURST_DELETE or BURST_WRITE.
+
+Return Value:
+
+    FALSE if the process is blocked and the operation must be denied.
+
+--*/
+{
+    PSPY_BURST_ENTRY entry;
+    LONG threshold = MiniSpyData.BurstThreshold[Kind];
+    LONG count;
+    LONG alerted;
+    ULONG slice;
+    BOOLEAN blocked;
+
+    if (threshold == 0) {
+
+        return !SpyBurstBlocked();
+    }
+
+    slice = SpyBurstSlice();
+    entry = SpyBurstFind( SpyBurstKey(), slice, TRUE );
+
+    if (entry == NULL) {
+
+        return TRUE;
+    }
+
+    if (entry->Blocked != 0) {
+
+        return FALSE;
+    }
+
+    count = SpyBurstCount( entry, Kind, slice );
+
+    if (count < threshold) {
+
+        return TRUE;
+    }
+
+    //
+    //  Alerted is one past the slice of the last alert, so 0 is never.
+    //  Only the thread that moves it reports.
+    //
+
+    alerted = entry->Alerted[Kind];
+
+    if ((alerted != 0 && slice + 1 - (ULONG)alerted < SPY_BURST_SLOTS) ||
+        InterlockedCompareExchange( &entry->Alerted[Kind], (LONG)(slice + 1), alerted ) != alerted) {
+
+        return TRUE;
+    }
+
+    blocked = (BOOLEAN)(MiniSpyData.BurstBlock != 0 &&
+                        InterlockedExchange( &entry->Blocked, 1 ) == 0);
+
+    if (blocked) {
+
+        InterlockedIncrement( &MiniSpyData.BurstBlocked );
+    }
+
+    SpyBurstAlert( Data, FltObjects, FileName, Kind, count, blocked );
+
+    return !blocked;
+}
+
+
+BOOLEAN
+SpyBurstWrite (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PUNICODE_STRING FileName
+    )
+/*++
+
+Routine Description:
+
+    Counts an overwrite of a protected file as BURST_WRITE, unless its
+    file object has been counted already.  When every entry of the file
+    object's group is in use one of them is taken over, and that file
+    object counts again if it is written later.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Data - The create or write.
+
+    FltObjects - Objects related to the operation.
+
+    FileName - The name of the file it is aimed at.
+
+Return Value:
+
+    FALSE if the process is blocked and the operation must be denied.
+
+--*/
+{
+    PFILE_OBJECT __volatile *handles = SpyBurstHandles( FltObjects->FileObject );
+    PFILE_OBJECT previous;
+    ULONG i;
+
+    for (i = 0; i < SPY_BURST_HANDLE_PROBES; i++) {
+
+        if (handles[i] == FltObjects->FileObject) {
+
+            return !SpyBurstBlocked();
+        }
+    }
+
+    for (i = 0; i < SPY_BURST_HANDLE_PROBES; i++) {
+
+        previous = InterlockedCompareExchangePointer( (PVOID *)&handles[i],
+                                                      FltObjects->FileObject,
+                                                      NULL );
+
+        if (previous == NULL) {
+
+            break;
+        }
+
+        if (previous == FltObjects->FileObject) {
+
+            return !SpyBurstBlocked();
+        }
+    }
+
+    if (i == SPY_BURST_HANDLE_PROBES) {
+
+        InterlockedExchangePointer( (PVOID *)&handles[((ULONG_PTR)FltObjects->FileObject >> 12) % SPY_BURST_HANDLE_PROBES],
+                                    FltObjects->FileObject );
+    }
+
+    return SpyBurstOperation( Data, FltObjects, FileName, BURST_WRITE );
+}
+
+
+VOID
+SpyBurstForget (
+    __in PFILE_OBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    Forgets that a file object's overwrite was counted, before its
+    address can be reused.
+
+    NOTE:  This code must be NON-PAGED because it is called on the
+           paging path.
+
+Arguments:
+
+    FileObject - The file object being closed, or whose create failed.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFILE_OBJECT __volatile *handles = SpyBurstHandles( FileObject );
+    ULONG i;
+
+    for (i = 0; i < SPY_BURST_HANDLE_PROBES; i++) {
+
+        InterlockedCompareExchangePointer( (PVOID *)&handles[i], NULL, FileObject );
+    }
+}
+
+
+BOOLEAN
+SpyBurstBlocked (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Checks whether the current process is blocked, without counting
+    anything.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    TRUE if the process may not change protected folders.
+
+--*/
+{
+    PSPY_BURST_ENTRY entry;
+
+    if (MiniSpyData.BurstBlocked == 0) {
+
+        return FALSE;
+    }
+
+    entry = SpyBurstFind( SpyBurstKey(), SpyBurstSlice(), FALSE );
+
+    return (BOOLEAN)(entry != NULL && entry->Blocked != 0);
+}
@@ -0,0 +1,505 @@
+﻿/*++
+
+Module Name:
+
+    mspyCoalesce.c
+
+Abstract:
+
+    This module folds runs of WRITE operations on the same stream handle
+    into a single RECORD_TYPE_AGGREGATE log record.
+
+    The first logged write on a file object is held back in a slot instead
+    of being queued for user mode.  Further writes on that file object only
+    update the held record (count, bytes, offset range and completion
+    time), and their own records are freed.  A write is folded once it has
+    completed, by the bytes it actually transferred, so one that fails is
+    logged on its own.  The held record is
+    sent up when
+
+        - the handle is cleaned up,
+        - a different operation is seen on the same file object,
+        - another file object hashes to the same slot,
+        - the write count or byte total reaches its limit, or
+        - no write has been folded into it for the idle interval.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+//#include <dontuse.h>
+#include <suppress.h>
+
+#include "mspyKern.h"
+
+//
+//  Upper bound on the bytes folded into one record.  The count limit comes
+//  from the registry, this one keeps a single large copy from hiding behind
+//  one record for too long.
+//
+
+#define SPY_COALESCE_MAX_BYTES      (16 * 1024 * 1024)
+
+#define SpyCoalesceSlot(_fo) \
+    (&MiniSpyData.CoalesceSlots[((ULONG_PTR)(_fo) >> 4) & (SPY_COALESCE_SLOTS - 1)])
+
+KDEFERRED_ROUTINE SpyCoalesceTimerDpc;
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+BOOLEAN
+SpyGetWriteRange (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PFILE_OBJECT FileObject,
+    __out PLONGLONG StartOffset,
+    __out PLONGLONG EndOffset
+    )
+/*++
+
+Routine Description:
+
+    Works out the byte range a completed write covered, from the bytes it
+    transferred rather than the bytes it asked for.  A write to the current
+    file position has already moved the file object's position past what
+    it wrote, so the range ends there.  Appending writes have no known
+    offset and only contribute to the byte count.
+
+Return Value:
+
+    TRUE if the range is known.
+
+--*/
+{
+    LARGE_INTEGER offset = Data->Iopb->Parameters.Write.ByteOffset;
+    LONGLONG written = (LONGLONG)Data->IoStatus.Information;
+
+    if (offset.HighPart == -1) {
+
+        if (offset.LowPart != FILE_USE_FILE_POINTER_POSITION) {
+
+            return FALSE;
+        }
+
+        *EndOffset = FileObject->CurrentByteOffset.QuadPart;
+        *StartOffset = *EndOffset - written;
+
+        return TRUE;
+    }
+
+    *StartOffset = offset.QuadPart;
+    *EndOffset = offset.QuadPart + written;
+
+    return TRUE;
+}
+
+
+static
+BOOLEAN
+SpyFoldWrite (
+    __inout PRECORD_AGGREGATE Aggregate,
+    __in ULONG Count,
+    __in LONGLONG TotalBytes,
+    __in LONGLONG StartOffset,
+    __in LONGLONG EndOffset
+    )
+/*++
+
+Routine Description:
+
+    Adds writes to an aggregate.  An empty range (StartOffset equal to
+    EndOffset) leaves the offset range untouched.
+
+    NOTE:  Called with the coalesce lock held.
+
+Return Value:
+
+    TRUE if the aggregate has reached one of its limits and must be flushed.
+
+--*/
+{
+    if (StartOffset != EndOffset) {
+
+        if (Aggregate->StartOffset == Aggregate->EndOffset) {
+
+            Aggregate->StartOffset = StartOffset;
+            Aggregate->EndOffset = EndOffset;
+
+        } else {
+
+            if (StartOffset < Aggregate->StartOffset) {
+
+                Aggregate->StartOffset = StartOffset;
+            }
+
+            if (EndOffset > Aggregate->EndOffset) {
+
+                Aggregate->EndOffset = EndOffset;
+            }
+        }
+    }
+
+    Aggregate->Count += Count;
+    Aggregate->TotalBytes += TotalBytes;
+
+    return (BOOLEAN)(Aggregate->Count >= (ULONG)MiniSpyData.CoalesceMaxWrites ||
+                     Aggregate->TotalBytes >= SPY_COALESCE_MAX_BYTES);
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyCoalesceInitialize (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Sets up the coalescing slots and starts the idle timer.  Coalescing is
+    left off when the WriteCoalesceLimit registry value is 0 or 1.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LARGE_INTEGER dueTime;
+
+    KeInitializeSpinLock( &MiniSpyData.CoalesceLock );
+    RtlZeroMemory( MiniSpyData.CoalesceSlots, sizeof( MiniSpyData.CoalesceSlots ) );
+
+    KeInitializeTimer( &MiniSpyData.CoalesceTimer );
+    KeInitializeDpc( &MiniSpyData.CoalesceDpc, SpyCoalesceTimerDpc, NULL );
+
+    if (MiniSpyData.CoalesceMaxWrites <= 1) {
+
+        return;
+    }
+
+    if (MiniSpyData.CoalesceIdleTime <= 0) {
+
+        MiniSpyData.CoalesceIdleTime = DEFAULT_WRITE_COALESCE_IDLE;
+    }
+
+    dueTime.QuadPart = -10000 * (LONGLONG)MiniSpyData.CoalesceIdleTime;
+
+    KeSetTimerEx( &MiniSpyData.CoalesceTimer,
+                  dueTime,
+                  MiniSpyData.CoalesceIdleTime,
+                  &MiniSpyData.CoalesceDpc );
+}
+
+
+VOID
+SpyCoalesceShutdown (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Stops the idle timer and sends up every held record.  Writes that
+    complete after this point are logged one record each.  Coalescing is
+    turned off under the lock, so no write can be parked once the slots
+    have been emptied.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_LIST flushRecords[SPY_COALESCE_SLOTS];
+    ULONG count = 0;
+    ULONG i;
+    KIRQL oldIrql;
+
+    KeCancelTimer( &MiniSpyData.CoalesceTimer );
+    KeFlushQueuedDpcs();
+
+    KeAcquireSpinLock( &MiniSpyData.CoalesceLock, &oldIrql );
+
+    MiniSpyData.CoalesceMaxWrites = 0;
+
+    for (i = 0; i < SPY_COALESCE_SLOTS; i++) {
+
+        if (MiniSpyData.CoalesceSlots[i].Record != NULL) {
+
+            flushRecords[count++] = MiniSpyData.CoalesceSlots[i].Record;
+            MiniSpyData.CoalesceSlots[i].Record = NULL;
+            MiniSpyData.CoalesceSlots[i].FileObject = NULL;
+        }
+    }
+
+    KeReleaseSpinLock( &MiniSpyData.CoalesceLock, oldIrql );
+
+    for (i = 0; i < count; i++) {
+
+        SpyLog( flushRecords[i] );
+    }
+}
+
+
+BOOLEAN
+SpyCoalesceHold (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __inout PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    Called instead of SpyLog for a completed write.  The record is turned
+    into an aggregate and parked in the file object's slot, or folded into
+    the record already parked there.
+
+    Failed writes are not coalesced so that they stay visible on their own.
+    A write counts for the bytes in Data->IoStatus.Information, which may
+    be fewer than it asked for.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+Arguments:
+
+    Data - The write operation.
+
+    FltObjects - Objects related to the write.
+
+    RecordList - The completed record for this write.
+
+Return Value:
+
+    TRUE if the record was taken over and must not be logged by the caller.
+
+--*/
+{
+    PFILE_OBJECT fileObject = FltObjects->FileObject;
+    PSPY_COALESCE_SLOT slot;
+    PRECORD_AGGREGATE aggregate = &RecordList->LogRecord.Data.Aggregate;
+    PRECORD_LIST flushRecord = NULL;
+    PRECORD_LIST freeRecord = NULL;
+    LONGLONG startOffset = 0;
+    LONGLONG endOffset = 0;
+    KIRQL oldIrql;
+
+    if (MiniSpyData.CoalesceMaxWrites <= 1 ||
+        fileObject == NULL ||
+        !NT_SUCCESS( Data->IoStatus.Status )) {
+
+        return FALSE;
+    }
+
+    SpyGetWriteRange( Data, fileObject, &startOffset, &endOffset );
+
+    RecordList->LogRecord.RecordType |= RECORD_TYPE_AGGREGATE;
+    SpyFoldWrite( aggregate,
+                  1,
+                  (LONGLONG)Data->IoStatus.Information,
+                  startOffset,
+                  endOffset );
+
+    slot = SpyCoalesceSlot( fileObject );
+
+    KeAcquireSpinLock( &MiniSpyData.CoalesceLock, &oldIrql );
+
+    if (MiniSpyData.CoalesceMaxWrites <= 1) {
+
+        //
+        //  Shut down since the check above; the record goes up alone.
+        //
+
+        KeReleaseSpinLock( &MiniSpyData.CoalesceLock, oldIrql );
+        return FALSE;
+    }
+
+    if (slot->FileObject == fileObject) {
+
+        //
+        //  Another write on this handle got here first, fold into its
+        //  record and drop ours.
+        //
+
+        slot->Record->LogRecord.Data.CompletionTime = RecordList->LogRecord.Data.CompletionTime;
+
+        if (SpyFoldWrite( &slot->Record->LogRecord.Data.Aggregate,
+                          aggregate->Count,
+                          aggregate->TotalBytes,
+                          aggregate->StartOffset,
+                          aggregate->EndOffset )) {
+
+            flushRecord = slot->Record;
+            slot->Record = NULL;
+            slot->FileObject = NULL;
+        }
+
+        freeRecord = RecordList;
+
+    } else {
+
+        //
+        //  Evict whatever another handle left in this slot.
+        //
+
+        flushRecord = slot->Record;
+        slot->Record = RecordList;
+        slot->FileObject = fileObject;
+    }
+
+    KeReleaseSpinLock( &MiniSpyData.CoalesceLock, oldIrql );
+
+    if (flushRecord != NULL) {
+
+        SpyLog( flushRecord );
+    }
+
+    if (freeRecord != NULL) {
+
+        SpyFreeRecord( freeRecord );
+    }
+
+    return TRUE;
+}
+
+
+VOID
+SpyCoalesceFlush (
+    __in_opt PFILE_OBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    Sends up the record held for the given file object, if any.  This is
+    called on cleanup and whenever an operation other than a write is seen
+    on the file object, so the aggregate is logged ahead of it.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    FileObject - The file object whose writes should be flushed.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_COALESCE_SLOT slot;
+    PRECORD_LIST flushRecord = NULL;
+    KIRQL oldIrql;
+
+    if (FileObject == NULL) {
+
+        return;
+    }
+
+    slot = SpyCoalesceSlot( FileObject );
+
+    //
+    //  Cheap unlocked check, almost every operation finds nothing to do.
+    //
+
+    if (slot->FileObject != FileObject) {
+
+        return;
+    }
+
+    KeAcquireSpinLock( &MiniSpyData.CoalesceLock, &oldIrql );
+
+    if (slot->FileObject == FileObject) {
+
+        flushRecord = slot->Record;
+        slot->Record = NULL;
+        slot->FileObject = NULL;
+    }
+
+    KeReleaseSpinLock( &MiniSpyData.CoalesceLock, oldIrql );
+
+    if (flushRecord != NULL) {
+
+        SpyLog( flushRecord );
+    }
+}
+
+
+VOID
+SpyCoalesceTimerDpc (
+    __in struct _KDPC *Dpc,
+    __in_opt PVOID DeferredContext,
+    __in_opt PVOID SystemArgument1,
+    __in_opt PVOID SystemArgument2
+    )
+/*++
+
+Routine Description:
+
+    Periodic timer routine.  Sends up every held record that has not had a
+    write folded into it for the idle interval.
+
+Arguments:
+
+    Unused.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_LIST flushRecords[SPY_COALESCE_SLOTS];
+    LARGE_INTEGER now;
+    LONGLONG idle;
+    ULONG count = 0;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER( Dpc );
+    UNREFERENCED_PARAMETER( DeferredContext );
+    UNREFERENCED_PARAMETER( SystemArgument1 );
+    UNREFERENCED_PARAMETER( SystemArgument2 );
+
+    KeQuerySystemTime( &now );
+    idle = 10000 * (LONGLONG)MiniSpyData.CoalesceIdleTime;
+
+    KeAcquireSpinLockAtDpcLevel( &MiniSpyData.CoalesceLock );
+
+    for (i = 0; i < SPY_COALESCE_SLOTS; i++) {
+
+        PSPY_COALESCE_SLOT slot = &MiniSpyData.CoalesceSlots[i];
+
+        if (slot->Record != NULL &&
+            now.QuadPart - slot->Record->LogRecord.Data.CompletionTime.QuadPart >= idle) {
+
+            flushRecords[count++] = slot->Record;
+            slot->Record = NULL;
+            slot->FileObject = NULL;
+        }
+    }
+
+    KeReleaseSpinLockFromDpcLevel( &MiniSpyData.CoalesceLock );
+
+    for (i = 0; i < count; i++) {
+
+        SpyLog( flushRecords[i] );
+    }
+}
@@ -0,0 +1,339 @@
+﻿/*++
+
+Module Name:
+
+    mspyDirectory.c
+
+Abstract:
+
+    This module remembers whether parent directories are inside a
+    protected folder.  A create has no file object to key a verdict on
+    yet, so no cache of what a handle was found to be can help it.  Most
+    creates probe files in a handful of directories, though, and when
+    every protected folder ends in a backslash a file is protected exactly
+    when its parent directory is.  That holds because such a folder can
+    only match up to a backslash, and the last backslash of a name ends
+    its parent directory.  A create can then skip the folder match and
+    take the verdict its directory already got.
+
+    The cache is a table of SPY_DIRECTORY_ENTRIES entries keyed by the
+    volume and parent directory, folded with PolicyFoldAscii.  The folder
+    match folds ASCII case alone, and two directories the key folded
+    together could otherwise get different verdicts from it.  A directory
+    may sit in any of SPY_DIRECTORY_PROBES entries starting where its hash
+    points.
+    Lookups take no lock: each entry carries a sequence count that is odd
+    while it is being written.  A reader that sees the count change under
+    it ignores what it read.  A writer that cannot claim an entry does not
+    wait; it simply does not keep its verdict.  Directories too long for
+    an entry are not cached.
+
+    Each entry is tagged with the generation the protected folders had
+    when its verdict was worked out.  Setting new folders bumps the
+    generation, which invalidates every entry at once without touching
+    any of them.  A verdict worked out across the bump is tagged with the
+    old generation and is never found.
+
+    A verdict depends only on the text of the directory's name, so a
+    rename cannot make one wrong.  The entries of a renamed directory are
+    left to be taken over like any other entry no longer hit.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+//#include <dontuse.h>
+#include <suppress.h>
+
+#include "mspyKern.h"
+#include "Policy.h"
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, SpyDirectoryLookup)
+    #pragma alloc_text(PAGE, SpyDirectoryRemember)
+    #pragma alloc_text(PAGE, SpyDirectoryForget)
+#endif
+
+#define SpyDirectoryEntry(_hash, _probe) \
+    (&MiniSpyData.DirectoryEntries[((_hash) + (_probe)) & (SPY_DIRECTORY_ENTRIES - 1)])
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+ULONG
+SpyDirectoryHash (
+    __in PCUNICODE_STRING Directory
+    )
+/*++
+
+Routine Description:
+
+    Hashes a directory name folded as the key is, FNV-1a.
+
+Arguments:
+
+    Directory - The volume and parent directory of a file.
+
+Return Value:
+
+    The hash.
+
+--*/
+{
+    ULONG hash = 2166136261;
+    USHORT i;
+
+    for (i = 0; i < Directory->Length / sizeof( WCHAR ); i++) {
+
+        hash = (hash ^ PolicyFoldAscii( Directory->Buffer[i] )) * 16777619;
+    }
+
+    return hash;
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+LONG
+SpyDirectoryGeneration (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Returns the current generation of the cache.  It is read before the
+    folders are matched and handed to SpyDirectoryLookup and
+    SpyDirectoryRemember.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    The generation.
+
+--*/
+{
+    return InterlockedCompareExchange( &MiniSpyData.DirectoryGeneration, 0, 0 );
+}
+
+
+BOOLEAN
+SpyDirectoryLookup (
+    __in PCUNICODE_STRING Directory,
+    __in LONG Generation,
+    __out PBOOLEAN Protected
+    )
+/*++
+
+Routine Description:
+
+    Looks for the verdict on a directory.
+
+Arguments:
+
+    Directory - The volume and parent directory of a file, ending in a
+        backslash.
+
+    Generation - What SpyDirectoryGeneration returned.
+
+    Protected - Receives whether the directory is in a protected folder.
+
+Return Value:
+
+    TRUE if the verdict was found.
+
+--*/
+{
+    PSPY_DIRECTORY_ENTRY entry;
+    ULONG hash;
+    ULONG i;
+    USHORT j;
+    LONG sequence;
+    BOOLEAN protect;
+    BOOLEAN match;
+
+    PAGED_CODE();
+
+    if (Directory->Length == 0 || Directory->Length > SPY_DIRECTORY_CHARS * sizeof( WCHAR )) {
+
+        return FALSE;
+    }
+
+    hash = SpyDirectoryHash( Directory );
+
+    for (i = 0; i < SPY_DIRECTORY_PROBES; i++) {
+
+        entry = SpyDirectoryEntry( hash, i );
+
+        sequence = entry->Sequence;
+
+        if (sequence & 1) {
+
+            continue;
+        }
+
+        KeMemoryBarrier();
+
+        if (entry->Hash != hash ||
+            entry->Generation != Generation ||
+            entry->Length != Directory->Length) {
+
+            continue;
+        }
+
+        match = TRUE;
+
+        for (j = 0; j < Directory->Length / sizeof( WCHAR ); j++) {
+
+            if (entry->Name[j] != PolicyFoldAscii( Directory->Buffer[j] )) {
+
+                match = FALSE;
+                break;
+            }
+        }
+
+        protect = entry->Protected;
+
+        //
+        //  What was read only counts if no writer had the entry meanwhile.
+        //
+
+        KeMemoryBarrier();
+
+        if (match && entry->Sequence == sequence) {
+
+            *Protected = protect;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+VOID
+SpyDirectoryRemember (
+    __in PCUNICODE_STRING Directory,
+    __in LONG Generation,
+    __in BOOLEAN Protected
+    )
+/*++
+
+Routine Description:
+
+    Records the verdict on a directory.  The directory's own entry is
+    written again if it has one in this generation, so two creates that
+    both missed it do not leave it in two entries.  Otherwise an unused
+    entry or one of an older generation is taken if there is one among
+    the directory's probes, or else one picked by the hash is replaced.
+
+Arguments:
+
+    Directory - The volume and parent directory of a file, ending in a
+        backslash.
+
+    Generation - What SpyDirectoryGeneration returned before the folders
+        were matched.
+
+    Protected - Whether the directory is in a protected folder.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PSPY_DIRECTORY_ENTRY entry;
+    PSPY_DIRECTORY_ENTRY victim = NULL;
+    ULONG hash;
+    ULONG i;
+    USHORT j;
+    LONG sequence;
+
+    PAGED_CODE();
+
+    if (Directory->Length == 0 || Directory->Length > SPY_DIRECTORY_CHARS * sizeof( WCHAR )) {
+
+        return;
+    }
+
+    hash = SpyDirectoryHash( Directory );
+
+    for (i = 0; i < SPY_DIRECTORY_PROBES; i++) {
+
+        entry = SpyDirectoryEntry( hash, i );
+
+        if (entry->Hash == hash &&
+            entry->Generation == Generation &&
+            entry->Length == Directory->Length) {
+
+            victim = entry;
+            break;
+        }
+
+        if (victim == NULL && (entry->Length == 0 || entry->Generation != Generation)) {
+
+            victim = entry;
+        }
+    }
+
+    if (victim == NULL) {
+
+        victim = SpyDirectoryEntry( hash, (hash >> 24) % SPY_DIRECTORY_PROBES );
+    }
+
+    sequence = victim->Sequence;
+
+    if ((sequence & 1) ||
+        InterlockedCompareExchange( &victim->Sequence, sequence + 1, sequence ) != sequence) {
+
+        return;
+    }
+
+    victim->Hash = hash;
+    victim->Generation = Generation;
+    victim->Length = Directory->Length;
+    victim->Protected = Protected;
+
+    for (j = 0; j < Directory->Length / sizeof( WCHAR ); j++) {
+
+        victim->Name[j] = PolicyFoldAscii( Directory->Buffer[j] );
+    }
+
+    InterlockedIncrement( &victim->Sequence );
+}
+
+
+VOID
+SpyDirectoryForget (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Forgets the verdicts on all directories.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+    PAGED_CODE();
+
+    InterlockedIncrement( &MiniSpyData.DirectoryGeneration );
+}
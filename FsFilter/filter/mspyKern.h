@@ -20,6 +20,7 @@ Environment:
 #define __MSPYKERN_H__
 
 #include "minispy.h"
+#include "conf.h"
 
 
 #ifndef __SPY_BUFFERS_STANDALONE_C		
@@ -116,6 +117,322 @@ typedef NTSTATUS
 //      Global variables
 //---------------------------------------------------------------------------
 
+//
+//  A write record held back for coalescing.  FileObject is only used as a
+//  key and is never dereferenced.
+//
+
+#define SPY_COALESCE_SLOTS  64
+
+typedef struct _SPY_COALESCE_SLOT {
+
+    PFILE_OBJECT FileObject;
+    PRECORD_LIST Record;
+
+} SPY_COALESCE_SLOT, *PSPY_COALESCE_SLOT;
+
+//
+//  One parent directory of the create path verdict cache, see
+//  mspyDirectory.c.  Sequence is odd while the entry is being written;
+//  Name is ASCII case folded and Length is 0 in an unused entry.
+//
+
+#define SPY_DIRECTORY_ENTRIES   256
+#define SPY_DIRECTORY_PROBES    4
+#define SPY_DIRECTORY_CHARS     120
+
+typedef struct _SPY_DIRECTORY_ENTRY {
+
+    __volatile LONG Sequence;
+    LONG Generation;
+    ULONG Hash;
+    USHORT Length;
+    BOOLEAN Protected;
+    WCHAR Name[SPY_DIRECTORY_CHARS];
+
+} SPY_DIRECTORY_ENTRY, *PSPY_DIRECTORY_ENTRY;
+
+//
+//  One counter of the per-process heavy-hitter table.  Count - Error is the
+//  exact number of operations seen since the process took the counter.
+//
+
+#define SPY_SAMPLE_ENTRIES  32
+
+typedef struct _SPY_SAMPLE_ENTRY {
+
+    FILE_ID ProcessId;
+    ULONG Count;
+    ULONG Error;
+    ULONG Suppressed;
+
+} SPY_SAMPLE_ENTRY, *PSPY_SAMPLE_ENTRY;
+
+//
+//  One process of the burst detector, see mspyBurst.c.  Each counter of
+//  Slots holds a slice number in its high half and the operations counted
+//  in that slice in its low half; the window is the last SPY_BURST_SLOTS
+//  slices.  Key is 0 while the entry is free.
+//
+
+#define SPY_BURST_ENTRIES   64
+#define SPY_BURST_PROBES    8
+#define SPY_BURST_SLOTS     8
+
+typedef struct _SPY_BURST_ENTRY {
+
+    __volatile LONGLONG Key;
+    FILE_ID ProcessId;
+
+    __volatile LONG LastSlice;
+    __volatile LONG Blocked;
+    __volatile LONG Alerted[BURST_KINDS];
+
+    __volatile LONGLONG Slots[BURST_KINDS][SPY_BURST_SLOTS];
+
+} SPY_BURST_ENTRY, *PSPY_BURST_ENTRY;
+
+//
+//  The file objects whose overwrite has already been counted, in groups
+//  of SPY_BURST_HANDLE_PROBES picked by the file object.
+//
+
+#define SPY_BURST_HANDLES       256
+#define SPY_BURST_HANDLE_PROBES 4
+
+//
+//  Records are allocated from SPY_RECORD_CLASSES size classes, the
+//  smallest SPY_MIN_RECORD_SIZE bytes and each one twice the size of the
+//  one before, up to MAX_RECORD_SIZE.  Every class has a lookaside list
+//  per processor (modulo SPY_RECORD_CPUS) so that processors do not
+//  contend on one list head, and a set of them per NUMA node (modulo
+//  SPY_RECORD_NODES): a buffer is allocated from its node's lists and
+//  freed back to them, wherever it is freed, so the pool a list refills
+//  from and the buffers it hands out are always local to the node.
+//
+
+#define SPY_MIN_RECORD_SIZE     256
+#define SPY_RECORD_CLASSES      6
+#define SPY_RECORD_CPUS         16
+#define SPY_RECORD_NODES        4
+
+#define SPY_RECORD_CLASS_SIZE(SizeClass) \
+    ((ULONG)SPY_MIN_RECORD_SIZE << (SizeClass))
+
+C_ASSERT( SPY_RECORD_CLASS_SIZE( SPY_RECORD_CLASSES - 1 ) == MAX_RECORD_SIZE );
+
+//
+//  Bytes a name of Length bytes takes up in a record once it is terminated
+//  and padded by SpySetRecordName.
+//
+
+#define SPY_NAME_SPACE(Length) \
+    ROUND_TO_SIZE( (ULONG)(Length) + sizeof( UNICODE_NULL ), sizeof( PVOID ) )
+
+//
+//  The names that say who issued an operation.  They are looked up before
+//  the operation's record is allocated so that the record can be sized to
+//  hold them.  ProcessImageName points at the start of ProcessBuffer,
+//  which is laid out the way ZwQueryInformationProcess returns it.
+//
+
+typedef struct _SPY_IDENTITY {
+
+    PUNICODE_STRING ProcessImageName;
+    UNICODE_STRING Sid;
+
+    WCHAR ProcessBuffer[(sizeof(UNICODE_STRING) + MAX_PATH*2)/sizeof(WCHAR)];
+
+} SPY_IDENTITY, *PSPY_IDENTITY;
+
+//
+//  The records one processor has queued for user mode.  SequenceNumber
+//  and Gaps are protected by Lock, so logging touches no cache line that
+//  another processor writes.  Gaps holds the ranges of this queue's
+//  sequence lost but not yet reported; once it is full the last entry's
+//  Count may exceed its range, see mspyLoss.c.
+//
+
+#define SPY_LOSS_GAPS   8
+
+typedef struct DECLSPEC_ALIGN(64) _SPY_LOG_QUEUE {
+
+    KSPIN_LOCK Lock;
+    LIST_ENTRY List;
+
+    ULONG SequenceNumber;
+
+    ULONG GapCount;
+    RECORD_GAP Gaps[SPY_LOSS_GAPS];
+
+} SPY_LOG_QUEUE, *PSPY_LOG_QUEUE;
+
+#define SpyCurrentLogQueue() \
+    (&MiniSpyData.LogQueues[KeGetCurrentProcessorNumber() % LOG_QUEUES])
+
+//
+//  Loss counters for one processor, cache aligned so that processors
+//  dropping records at the same time do not share a line.
+//
+
+#define SPY_LOSS_CPUS   32
+
+typedef struct DECLSPEC_ALIGN(64) _SPY_LOSS_COUNTERS {
+
+    __volatile LONG Reason[LOSS_REASONS];
+    __volatile LONG Major[LOSS_MAJOR_SLOTS];
+
+} SPY_LOSS_COUNTERS, *PSPY_LOSS_COUNTERS;
+
+//
+//  A subscription compiled for SpySubscribeOperation and SpySubscribeMatch.
+//  Prefixes and Processes point into the same allocation and hold the
+//  strings upcased.  MinPrefixLength is the length in bytes of the
+//  shortest prefix, so shorter names are turned away without comparing.
+//  The subscription is freed when the last reference is dropped.
+//
+
+typedef struct _SPY_SUBSCRIPTION {
+
+    __volatile LONG References;
+
+    ULONG Operations[SUBSCRIBE_OPERATION_WORDS];
+    ULONG Dispositions;
+
+    USHORT PrefixCount;
+    USHORT ProcessCount;
+    USHORT MinPrefixLength;
+
+    PUNICODE_STRING Prefixes;
+    PUNICODE_STRING Processes;
+
+} SPY_SUBSCRIPTION, *PSPY_SUBSCRIPTION;
+
+//
+//  Readers of the log, one per connection to the server port, see
+//  mspyReader.c.
+//
+
+#define SPY_MAX_READERS         MINISPY_MAX_CONNECTIONS
+
+//
+//  RECORD_LIST.Readers bits.  A queued record is kept until none is left.
+//  The low bits are the readers still to be sent the record.  UNCLAIMED
+//  marks a record queued while nobody was connected, which the first
+//  reader to come along takes.  The HOLD bits are the readers copying
+//  the record out at the moment, the RETAIN bits the acknowledging
+//  readers that were sent the record and have not acknowledged it.
+//
+
+#define SPY_READER_ALL          ((1 << SPY_MAX_READERS) - 1)
+#define SPY_READER_UNCLAIMED    (1 << SPY_MAX_READERS)
+#define SPY_READER_HOLD(Bits)   ((Bits) << 8)
+#define SPY_READER_RETAIN(Bits) ((Bits) << 16)
+#define SPY_READER_KEEP         (SPY_READER_ALL |                       \
+                                 SPY_READER_UNCLAIMED |                 \
+                                 SPY_READER_HOLD( SPY_READER_ALL ) |    \
+                                 SPY_READER_RETAIN( SPY_READER_ALL ))
+
+//
+//  How many numbers of a reader's sequence a record takes up: a gap record
+//  takes the numbers it accounts for as well as its own.
+//
+
+#define SPY_RECORD_NUMBERS(RecordList)                                      \
+    (FlagOn( (RecordList)->LogRecord.RecordType, RECORD_TYPE_GAP ) ?        \
+        ((PRECORD_GAP)(RecordList)->LogRecord.Name)->Count + 1 :            \
+        1)
+
+//
+//  The lanes a reader keeps a cursor in: the processor queues, then the
+//  priority lane.
+//
+
+#define SPY_PRIORITY_LANE       LOG_QUEUES
+#define SPY_READER_LANES        (LOG_QUEUES + 1)
+
+//
+//  How many of a lagging reader's records are taken from each queue when
+//  room has to be made for new ones.
+//
+
+#define SPY_READER_EVICT_BATCH  64
+
+//
+//  A reader slot is Connected while its consumer is, and Detached while an
+//  acknowledging consumer is away and its records are kept for it.
+//  Closing covers the time its records are being let go.
+//
+
+typedef enum _SPY_READER_STATE {
+
+    SpyReaderUnused = 0,
+    SpyReaderConnected,
+    SpyReaderDetached,
+    SpyReaderClosing
+
+} SPY_READER_STATE;
+
+typedef struct _SPY_READER {
+
+    //
+    //  The slot's state and connection, protected by ReaderLock, and its
+    //  RECORD_LIST.Readers bit.
+    //
+
+    SPY_READER_STATE State;
+    PFLT_PORT ClientPort;
+    ULONG Bit;
+
+    //
+    //  Acknowledged delivery, see MINISPY_CONNECT.  SubscriberId is 0 for
+    //  a reader that does not acknowledge.  Acked is the last number
+    //  acknowledged on each lane, protected by the lane's lock; Retained
+    //  is how many records are kept waiting for acknowledgement.
+    //
+
+    ULONG SubscriberId;
+    ULONG Acked[SPY_READER_LANES];
+    __volatile LONG Retained;
+
+    //
+    //  The reader's subscription, NULL when it wants every record.  The
+    //  completion path only reads Dispositions, a copy of the
+    //  subscription's.
+    //
+
+    PSPY_SUBSCRIPTION Subscription;
+    __volatile ULONG Dispositions;
+
+    //
+    //  The reader's cursor in each lane, protected by the lane's lock.
+    //  Position is the last entry the reader has been past, or the list
+    //  head.  Sequence is the last number the reader was sent on the lane.
+    //
+
+    PLIST_ENTRY Position[SPY_READER_LANES];
+    ULONG Sequence[SPY_READER_LANES];
+
+    //
+    //  Records taken away from the reader, by queue, that it has yet to
+    //  be sent a gap record for.
+    //
+
+    ULONG Dropped[LOG_QUEUES];
+
+    ULONG NextLogQueue;
+
+    //
+    //  Records queued for the reader and not yet sent, records sent and
+    //  records taken away.
+    //
+
+    __volatile LONG Pending;
+    __volatile LONG Delivered;
+    __volatile LONG Lagged;
+
+} SPY_READER, *PSPY_READER;
+
 typedef struct _MINISPY_DATA {
 
     //
@@ -138,23 +455,48 @@ typedef struct _MINISPY_DATA {
     PFLT_PORT ServerPort;
 
     //
-    //  Client connection port: only one connection is allowed at a time.,
+    //  Client connections, up to SPY_MAX_READERS at a time.  ReaderMask
+    //  has the bit of every connected or detached reader.  ReaderLock
+    //  protects the readers' State and Subscription.  SubscribedReaders
+    //  has the bit of every reader with a subscription.
     //
 
-    PFLT_PORT ClientPort;
+    KSPIN_LOCK ReaderLock;
+    SPY_READER Readers[SPY_MAX_READERS];
+    __volatile LONG ReaderMask;
+    __volatile LONG SubscribedReaders;
 
     //
-    //  List of buffers with data to send to user mode.
+    //  Buffers with data to send to user mode, queued on the logging
+    //  processor's queue.  Every record is queued once, for all the
+    //  readers that want it; SpyGetLog takes one record from each queue in
+    //  turn, starting at the reader's NextLogQueue.
+    //
+
+    SPY_LOG_QUEUE LogQueues[LOG_QUEUES];
+
+    //
+    //  High priority lane, see mspyPriority.c.  PriorityList is protected
+    //  by OutputBufferLock and sent up before the processor queues.  Its
+    //  records come from PriorityReserve first and are numbered from
+    //  PrioritySequenceNumber.
     //
 
     KSPIN_LOCK OutputBufferLock;
-    LIST_ENTRY OutputBufferList;
+    LIST_ENTRY PriorityList;
+    __volatile LONG PrioritySequenceNumber;
+
+    KSPIN_LOCK PriorityLock;
+    LIST_ENTRY PriorityFreeList;
+    PUCHAR PriorityReserve;
+    LONG PriorityRecords;
 
     //
-    //  Lookaside list used for allocating buffers.
+    //  Lookaside lists used for allocating buffers, by node, processor and
+    //  size class.
     //
 
-    NPAGED_LOOKASIDE_LIST FreeBufferList;
+    NPAGED_LOOKASIDE_LIST FreeBufferLists[SPY_RECORD_NODES][SPY_RECORD_CPUS][SPY_RECORD_CLASSES];
 
     //
     //  Variables used to throttle how many records buffer we can use
@@ -164,26 +506,31 @@ typedef struct _MINISPY_DATA {
     __volatile LONG RecordsAllocated;
 
     //
-    //  static buffer used for sending an "out-of-memory" message
-    //  to user mode.
+    //  Quota controller state.  MaxRecordsToAllocate is kept between
+    //  QuotaFloor and QuotaCeiling by a timer, see mspyQuota.c.
     //
 
-    __volatile LONG StaticBufferInUse;
+    LONG QuotaFloor;
+    LONG QuotaCeiling;
 
-    //
-    //  We need to make sure this buffer aligns on a PVOID boundary because
-    //  minispy casts this buffer to a RECORD_LIST structure.
-    //  That can cause alignment faults unless the structure starts on the
-    //  proper PVOID boundary
-    //
+    __volatile LONG RecordsDrained;
+    LONG QuotaLastDrained;
+    LONG DrainRate;
+
+    KTIMER QuotaTimer;
+    KDPC QuotaDpc;
 
-    PVOID OutOfMemoryBuffer[RECORD_SIZE/sizeof( PVOID )];
+    PKEVENT LowMemoryEvent;
+    HANDLE LowMemoryEventHandle;
 
     //
-    //  Variable and lock for maintaining LogRecord sequence numbers.
+    //  Loss accounting, see mspyLoss.c.  GapCount is the number of gaps
+    //  pending in all of the log queues.
     //
 
-    __volatile LONG LogSequenceNumber;
+    SPY_LOSS_COUNTERS LossCounters[SPY_LOSS_CPUS];
+
+    __volatile LONG GapCount;
 
     //
     //  The name query method to use.  By default, it is set to
@@ -199,6 +546,61 @@ typedef struct _MINISPY_DATA {
 
     ULONG DebugFlags;
 
+    //
+    //  Write coalescing.  CoalesceMaxWrites is the most writes folded into
+    //  one record (0 or 1 turns coalescing off) and CoalesceIdleTime is how
+    //  long, in milliseconds, a record is held without a new write.
+    //
+
+    KSPIN_LOCK CoalesceLock;
+    SPY_COALESCE_SLOT CoalesceSlots[SPY_COALESCE_SLOTS];
+
+    KTIMER CoalesceTimer;
+    KDPC CoalesceDpc;
+
+    LONG CoalesceMaxWrites;
+    LONG CoalesceIdleTime;
+
+    //
+    //  Per-process sampling.  ProcessBudget is how many records a process
+    //  may produce per SampleWindow milliseconds before it is sampled (0
+    //  turns sampling off); past that only one in ProcessSampleRate
+    //  operations is logged, none if it is 0.
+    //
+
+    KSPIN_LOCK SampleLock;
+    SPY_SAMPLE_ENTRY SampleEntries[SPY_SAMPLE_ENTRIES];
+    LARGE_INTEGER SampleWindowStart;
+
+    LONG ProcessBudget;
+    LONG ProcessSampleRate;
+    LONG SampleWindow;
+
+    //
+    //  Burst detection, see mspyBurst.c.  BurstBlocked is how many
+    //  processes are blocked, so the write path need not look when none
+    //  is.
+    //
+
+    SPY_BURST_ENTRY BurstEntries[SPY_BURST_ENTRIES];
+
+    LONG BurstThreshold[BURST_KINDS];
+    LONG BurstWindow;
+    LONG BurstBlock;
+
+    __volatile LONG BurstBlocked;
+
+    PFILE_OBJECT __volatile BurstFileObjects[SPY_BURST_HANDLES];
+
+    //
+    //  Parent directories known to be inside or outside the protected
+    //  folders, see mspyDirectory.c.
+    //
+
+    SPY_DIRECTORY_ENTRY DirectoryEntries[SPY_DIRECTORY_ENTRIES];
+
+    __volatile LONG DirectoryGeneration;
+
 #if MINISPY_VISTA
 
     //
@@ -240,12 +642,53 @@ typedef struct _MINISPY_TRANSACTION_CONTEXT {
 
 extern MINISPY_DATA MiniSpyData;
 
+//
+//  Memory allocation tag
+//
+
+#define SPY_TAG		'ypSM'
+
 #define DEFAULT_MAX_RECORDS_TO_ALLOCATE     500
 #define MAX_RECORDS_TO_ALLOCATE             L"MaxRecords"
 
+#define DEFAULT_RECORD_QUOTA_FLOOR          100
+#define RECORD_QUOTA_FLOOR                  L"RecordQuotaFloor"
+
+#define DEFAULT_RECORD_QUOTA_CEILING        8192
+#define RECORD_QUOTA_CEILING                L"RecordQuotaCeiling"
+
+#define DEFAULT_PRIORITY_RECORDS            64
+#define PRIORITY_RECORDS                    L"PriorityRecords"
+
 #define DEFAULT_NAME_QUERY_METHOD           FLT_FILE_NAME_QUERY_ALWAYS_ALLOW_CACHE_LOOKUP
 #define NAME_QUERY_METHOD                   L"NameQueryMethod"
 
+#define DEFAULT_WRITE_COALESCE_LIMIT        64
+#define WRITE_COALESCE_LIMIT                L"WriteCoalesceLimit"
+
+#define DEFAULT_WRITE_COALESCE_IDLE         1000
+#define WRITE_COALESCE_IDLE                 L"WriteCoalesceIdle"
+
+#define DEFAULT_PROCESS_RECORD_BUDGET       0
+#define PROCESS_RECORD_BUDGET               L"ProcessRecordBudget"
+
+#define DEFAULT_PROCESS_SAMPLE_RATE         16
+#define PROCESS_SAMPLE_RATE                 L"ProcessSampleRate"
+
+#define DEFAULT_PROCESS_SAMPLE_WINDOW       1000
+#define PROCESS_SAMPLE_WINDOW               L"ProcessSampleWindow"
+
+#define DEFAULT_BURST_THRESHOLD             100
+#define BURST_RENAME_THRESHOLD              L"BurstRenameThreshold"
+#define BURST_DELETE_THRESHOLD              L"BurstDeleteThreshold"
+#define BURST_WRITE_THRESHOLD               L"BurstWriteThreshold"
+
+#define DEFAULT_BURST_WINDOW                10000
+#define BURST_WINDOW                        L"BurstWindow"
+
+#define DEFAULT_BURST_BLOCK                 0
+#define BURST_BLOCK                         L"BurstBlock"
+
 //
 //  DebugFlag values
 //
@@ -305,8 +748,19 @@ SpyReadDriverParameters (
 //  Memory allocation routines
 //---------------------------------------------------------------------------
 
+VOID
+SpyInitializeBuffers (
+    VOID
+    );
+
+VOID
+SpyDeleteBuffers (
+    VOID
+    );
+
 PRECORD_LIST
 SpyAllocateBuffer (
+    __in ULONG Size,
     __out PULONG RecordType
     );
 
@@ -320,7 +774,8 @@ SpyFreeBuffer (
 //---------------------------------------------------------------------------
 PRECORD_LIST
 SpyNewRecord (
-    VOID
+    __in UCHAR MajorFunction,
+    __in ULONG NameSpace
     );
 
 VOID
@@ -334,10 +789,26 @@ SpySetRecordName (
     __in PUNICODE_STRING Name
     );
 
+VOID
+SpyQueryIdentity (
+    __out PSPY_IDENTITY Identity
+    );
+
+ULONG
+SpyIdentityNameSpace (
+    __in PSPY_IDENTITY Identity
+    );
+
+VOID
+SpyReleaseIdentity (
+    __inout PSPY_IDENTITY Identity
+    );
+
 VOID
 SpyLogPreOperationData (
     __in PFLT_CALLBACK_DATA Data,
     __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PSPY_IDENTITY Identity,
     __inout PRECORD_LIST RecordList
     );
 
@@ -361,6 +832,7 @@ SpyLog (
 
 NTSTATUS
 SpyGetLog (
+    __in PSPY_READER Reader,
     __out_bcount_part(OutputBufferLength,*ReturnOutputBufferLength) PUCHAR OutputBuffer,
     __in ULONG OutputBufferLength,
     __out PULONG ReturnOutputBufferLength
@@ -371,9 +843,313 @@ SpyEmptyOutputBufferList (
     VOID
     );
 
+//---------------------------------------------------------------------------
+//  Priority lane routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyPriorityInitialize (
+    VOID
+    );
+
+VOID
+SpyPriorityShutdown (
+    VOID
+    );
+
+PRECORD_LIST
+SpyPriorityNewRecord (
+    __in UCHAR MajorFunction,
+    __in ULONG NameSpace
+    );
+
+BOOLEAN
+SpyPriorityFreeRecord (
+    __in PRECORD_LIST Record
+    );
+
+VOID
+SpyLogPriority (
+    __in PRECORD_LIST RecordList
+    );
+
+VOID
+SpyLogDenial (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PUNICODE_STRING FileName
+    );
+
+//---------------------------------------------------------------------------
+//  Loss accounting routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyLossInitialize (
+    VOID
+    );
+
+VOID
+SpyLossRecord (
+    __in ULONG Reason,
+    __in UCHAR MajorFunction
+    );
+
+VOID
+SpyDiscardRecord (
+    __in PRECORD_LIST Record
+    );
+
+VOID
+SpyLossFlush (
+    VOID
+    );
+
+VOID
+SpyLossFormatStats (
+    __out_bcount(BufferSize) PWCHAR Buffer,
+    __in size_t BufferSize
+    );
+
+//---------------------------------------------------------------------------
+//  Write coalescing routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyCoalesceInitialize (
+    VOID
+    );
+
+VOID
+SpyCoalesceShutdown (
+    VOID
+    );
+
+BOOLEAN
+SpyCoalesceHold (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __inout PRECORD_LIST RecordList
+    );
+
+VOID
+SpyCoalesceFlush (
+    __in_opt PFILE_OBJECT FileObject
+    );
+
+//---------------------------------------------------------------------------
+//  Record quota routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyQuotaInitialize (
+    VOID
+    );
+
+VOID
+SpyQuotaShutdown (
+    VOID
+    );
+
+NTSTATUS
+SpyQuotaSet (
+    __in LONG Floor,
+    __in LONG Ceiling
+    );
+
+//---------------------------------------------------------------------------
+//  Per-process sampling routines
+//---------------------------------------------------------------------------
+
+VOID
+SpySampleInitialize (
+    VOID
+    );
+
+BOOLEAN
+SpySampleOperation (
+    VOID
+    );
+
+//---------------------------------------------------------------------------
+//  Burst detection routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyBurstInitialize (
+    VOID
+    );
+
+NTSTATUS
+SpyBurstSet (
+    __in PBURST_SETTINGS Settings
+    );
+
+BOOLEAN
+SpyBurstOperation (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PUNICODE_STRING FileName,
+    __in ULONG Kind
+    );
+
+BOOLEAN
+SpyBurstWrite (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PUNICODE_STRING FileName
+    );
+
+VOID
+SpyBurstForget (
+    __in PFILE_OBJECT FileObject
+    );
+
+BOOLEAN
+SpyBurstBlocked (
+    VOID
+    );
+
+//---------------------------------------------------------------------------
+//  Directory verdict cache routines
+//---------------------------------------------------------------------------
+
+LONG
+SpyDirectoryGeneration (
+    VOID
+    );
+
+BOOLEAN
+SpyDirectoryLookup (
+    __in PCUNICODE_STRING Directory,
+    __in LONG Generation,
+    __out PBOOLEAN Protected
+    );
+
+VOID
+SpyDirectoryRemember (
+    __in PCUNICODE_STRING Directory,
+    __in LONG Generation,
+    __in BOOLEAN Protected
+    );
+
+VOID
+SpyDirectoryForget (
+    VOID
+    );
+
+//---------------------------------------------------------------------------
+//  Subscription routines
+//---------------------------------------------------------------------------
+
+VOID
+SpySubscribeInitialize (
+    VOID
+    );
+
+VOID
+SpySubscribeShutdown (
+    VOID
+    );
+
+VOID
+SpySubscribeClear (
+    __inout PSPY_READER Reader
+    );
+
+NTSTATUS
+SpySubscribeSet (
+    __inout PSPY_READER Reader,
+    __in_bcount(Length) PSUBSCRIPTION Subscription,
+    __in ULONG Length
+    );
+
+VOID
+SpySubscribeFormat (
+    __in PSPY_READER Reader,
+    __out_bcount(BufferSize) PWCHAR Buffer,
+    __in size_t BufferSize
+    );
+
+ULONG
+SpySubscribeOperation (
+    __in PFLT_CALLBACK_DATA Data
+    );
+
+ULONG
+SpySubscribeMatch (
+    __in PUNICODE_STRING Name,
+    __in PSPY_IDENTITY Identity,
+    __in ULONG Readers
+    );
+
+BOOLEAN
+SpySubscribeDisposition (
+    __inout PRECORD_LIST RecordList
+    );
+
+//---------------------------------------------------------------------------
+//  Reader routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyReaderInitialize (
+    VOID
+    );
+
+PSPY_READER
+SpyReaderConnect (
+    __in PFLT_PORT ClientPort,
+    __in ULONG SubscriberId
+    );
+
+VOID
+SpyReaderDisconnect (
+    __inout PSPY_READER Reader
+    );
+
+PLIST_ENTRY
+SpyReaderLane (
+    __in ULONG Lane,
+    __deref_out PKSPIN_LOCK *Lock
+    );
+
+BOOLEAN
+SpyReaderClaim (
+    __inout PRECORD_LIST RecordList
+    );
+
+ULONG
+SpyReaderTrim (
+    __in ULONG Lane,
+    __inout PLIST_ENTRY FreeList
+    );
+
+VOID
+SpyReaderFree (
+    __inout PLIST_ENTRY FreeList
+    );
+
+VOID
+SpyReaderAcknowledge (
+    __inout PSPY_READER Reader,
+    __in PMINISPY_ACK Ack
+    );
+
+BOOLEAN
+SpyReaderEvict (
+    VOID
+    );
+
+VOID
+SpyReaderFormatStats (
+    __out_bcount(BufferSize) PWCHAR Buffer,
+    __in size_t BufferSize
+    );
+
 VOID
 SpyDeleteTxfContext (
-    __inout PFLT_CONTEXT  Context,
+    __inout PMINISPY_TRANSACTION_CONTEXT  Context,
     __in FLT_CONTEXT_TYPE  ContextType
     );
 
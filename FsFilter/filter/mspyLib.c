@@ -33,11 +33,12 @@ Environment:
 
 #ifdef ALLOC_PRAGMA
     #pragma alloc_text(INIT, SpyReadDriverParameters)
+    #pragma alloc_text(INIT, SpyInitializeBuffers)
+    #pragma alloc_text(PAGE, SpyDeleteBuffers)
+    #pragma alloc_text(PAGE, SpyQueryIdentity)
+    #pragma alloc_text(PAGE, SpyReleaseIdentity)
 #endif
 
-
-#define SID_TAG		'dis_'
-
 UCHAR TxNotificationToMinorCode (
     __in ULONG TxNotification
     )
@@ -103,17 +104,102 @@ Return Value:
 //                    Log Record allocation routines
 //---------------------------------------------------------------------------
 
+VOID
+SpyInitializeBuffers (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Initializes the lookaside list of every node, processor and size class.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG node;
+    ULONG cpu;
+    ULONG sizeClass;
+
+    for (node = 0; node < SPY_RECORD_NODES; node++) {
+
+        for (cpu = 0; cpu < SPY_RECORD_CPUS; cpu++) {
+
+            for (sizeClass = 0; sizeClass < SPY_RECORD_CLASSES; sizeClass++) {
+
+                ExInitializeNPagedLookasideList( &MiniSpyData.FreeBufferLists[node][cpu][sizeClass],
+                                                 NULL,
+                                                 NULL,
+                                                 0,
+                                                 SPY_RECORD_CLASS_SIZE( sizeClass ),
+                                                 SPY_TAG,
+                                                 0 );
+            }
+        }
+    }
+}
+
+
+VOID
+SpyDeleteBuffers (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Deletes the lookaside lists.  Every buffer must have been freed.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG node;
+    ULONG cpu;
+    ULONG sizeClass;
+
+    PAGED_CODE();
+
+    for (node = 0; node < SPY_RECORD_NODES; node++) {
+
+        for (cpu = 0; cpu < SPY_RECORD_CPUS; cpu++) {
+
+            for (sizeClass = 0; sizeClass < SPY_RECORD_CLASSES; sizeClass++) {
+
+                ExDeleteNPagedLookasideList( &MiniSpyData.FreeBufferLists[node][cpu][sizeClass] );
+            }
+        }
+    }
+}
+
+
 PRECORD_LIST
 SpyAllocateBuffer (
+    __in ULONG Size,
     __out PULONG RecordType
     )
 /*++
 
 Routine Description:
 
-    Allocates a new buffer from the MiniSpyData.FreeBufferList if there is
-    enough memory to do so and we have not exceed our maximum buffer
-    count.
+    Allocates a new buffer of at least Size bytes from the current
+    processor's lookaside list, on the current node, for the smallest size
+    class that holds it, if there is enough memory to do so and we have
+    not exceed our maximum buffer count.  A request larger than MAX_RECORD_SIZE gets a buffer of
+    MAX_RECORD_SIZE bytes.
 
     NOTE:  Because there is no interlock between testing if we have exceeded
            the record allocation limit and actually increment the in use
@@ -126,6 +212,8 @@ Routine Description:
 
 Arguments:
 
+    Size - The number of bytes needed, including the RECORD_LIST.
+
     RecordType - Receives information on what type of record was allocated.
 
 Return Value:
@@ -134,8 +222,16 @@ Return Value:
 
 --*/
 {
-    PVOID newBuffer;
+    PRECORD_LIST newBuffer;
     ULONG newRecordType = RECORD_TYPE_NORMAL;
+    ULONG sizeClass = 0;
+    ULONG node;
+
+    while (sizeClass < SPY_RECORD_CLASSES - 1 &&
+           SPY_RECORD_CLASS_SIZE( sizeClass ) < Size) {
+
+        sizeClass++;
+    }
 
     //
     //  See if we have room to allocate more buffers
@@ -145,9 +241,18 @@ Return Value:
 
         InterlockedIncrement( &MiniSpyData.RecordsAllocated );
 
-        newBuffer = ExAllocateFromNPagedLookasideList( &MiniSpyData.FreeBufferList );
+        node = KeGetCurrentNodeNumber() % SPY_RECORD_NODES;
+
+        newBuffer = ExAllocateFromNPagedLookasideList(
+                        &MiniSpyData.FreeBufferLists[node][KeGetCurrentProcessorNumber() % SPY_RECORD_CPUS][sizeClass] );
+
+        if (newBuffer != NULL) {
+
+            newBuffer->Size = SPY_RECORD_CLASS_SIZE( sizeClass );
+            newBuffer->SizeClass = sizeClass;
+            newBuffer->Node = node;
 
-        if (newBuffer == NULL) {
+        } else {
 
             //
             //  We failed to allocate the memory.  Decrement our global count
@@ -183,7 +288,11 @@ SpyFreeBuffer (
 
 Routine Description:
 
-    Free an allocate buffer.
+    Free an allocate buffer to the current processor's lookaside list for
+    its size class, among the lists of the node it was allocated on.  The
+    consumer usually runs on another node than the operation that logged
+    the record, and a buffer freed to the consumer's node would be handed
+    out there, remote from the memory it lives in.
 
     NOTE:  This code must be NON-PAGED because it can be called on the
            paging path or at DPC level.
@@ -202,8 +311,15 @@ Return Value:
     //  Free the memory, update the counter
     //
 
+    ULONG sizeClass = ((PRECORD_LIST)Buffer)->SizeClass;
+    ULONG node = ((PRECORD_LIST)Buffer)->Node;
+
+    ASSERT( sizeClass < SPY_RECORD_CLASSES );
+    ASSERT( node < SPY_RECORD_NODES );
+
     InterlockedDecrement( &MiniSpyData.RecordsAllocated );
-    ExFreeToNPagedLookasideList( &MiniSpyData.FreeBufferList, Buffer );
+    ExFreeToNPagedLookasideList( &MiniSpyData.FreeBufferLists[node][KeGetCurrentProcessorNumber() % SPY_RECORD_CPUS][sizeClass],
+                                 Buffer );
 }
 
 
@@ -213,21 +329,35 @@ Return Value:
 
 PRECORD_LIST
 SpyNewRecord (
-    VOID
+    __in UCHAR MajorFunction,
+    __in ULONG NameSpace
     )
 /*++
 
 Routine Description:
 
-    Allocates a new RECORD_LIST structure if there is enough memory to do so. A
-    sequence number is updated for each request for a new record.
+    Allocates a new RECORD_LIST structure if there is enough memory to do so.
+    The record is sized to hold NameSpace bytes of names.
+    The sequence number is assigned when the record is queued by SpyLog.
+
+    If the record quota has run out, a lagging reader may be made to give
+    up records to make room, see mspyReader.c.  If no record can be
+    allocated the operation is accounted for as lost, see mspyLoss.c.
+    Gaps left by earlier failures are reported first whenever an
+    allocation succeeds.
+
+    The record is meant for every reader until the caller says otherwise.
 
     NOTE:  This code must be NON-PAGED because it can be called on the
            paging path or at DPC level.
 
 Arguments:
 
-    None
+    MajorFunction - The operation the record is for, used to account for
+        it if it cannot be logged.
+
+    NameSpace - The space the names to be stored in the record take up,
+        the sum of SPY_NAME_SPACE of each of them.
 
 Return Value:
 
@@ -237,42 +367,51 @@ Return Value:
 {
     PRECORD_LIST newRecord;
     ULONG initialRecordType;
+    ULONG size;
 
     //
-    //  Allocate the buffer
+    //  Allocate the buffer, leaving room for the terminating NULL
     //
 
-    newRecord = SpyAllocateBuffer( &initialRecordType );
+    size = sizeof( RECORD_LIST ) +
+           NameSpace +
+           ROUND_TO_SIZE( sizeof( UNICODE_NULL ), sizeof( PVOID ) );
+
+    newRecord = SpyAllocateBuffer( size, &initialRecordType );
+
+    if (newRecord == NULL &&
+        FlagOn( initialRecordType, RECORD_TYPE_FLAG_EXCEED_MEMORY_ALLOWANCE ) &&
+        SpyReaderEvict()) {
+
+        newRecord = SpyAllocateBuffer( size, &initialRecordType );
+    }
 
     if (newRecord == NULL) {
 
-        //
-        //  We could not allocate a record, see if the static buffer is
-        //  in use.  If not, we will use it
-        //
+        SpyLossRecord( FlagOn( initialRecordType, RECORD_TYPE_FLAG_OUT_OF_MEMORY ) ?
+                            LOSS_OUT_OF_MEMORY :
+                            LOSS_OVER_QUOTA,
+                       MajorFunction );
 
-        if (!InterlockedExchange( &MiniSpyData.StaticBufferInUse, TRUE )) {
+        return NULL;
+    }
 
-            newRecord = (PRECORD_LIST)MiniSpyData.OutOfMemoryBuffer;
-            initialRecordType |= RECORD_TYPE_FLAG_STATIC;
-        }
+    if (MiniSpyData.GapCount != 0) {
+
+        SpyLossFlush();
     }
 
     //
-    //  If we got a record (doesn't matter if it is static or not), init it
+    // Init the new record
     //
 
-    if (newRecord != NULL) {
-
-        //
-        // Init the new record
-        //
-
-        newRecord->LogRecord.RecordType = initialRecordType;
-        newRecord->LogRecord.Length = sizeof(LOG_RECORD);
-        newRecord->LogRecord.SequenceNumber = InterlockedIncrement( &MiniSpyData.LogSequenceNumber );
-        RtlZeroMemory( &newRecord->LogRecord.Data, sizeof( RECORD_DATA ) );
-    }
+    newRecord->Readers = SPY_READER_ALL;
+    newRecord->LogRecord.RecordType = initialRecordType;
+    newRecord->LogRecord.Length = sizeof(LOG_RECORD);
+    newRecord->LogRecord.SequenceNumber = 0;
+    newRecord->LogRecord.Processor = 0;
+    newRecord->LogRecord.Spare = 0;
+    RtlZeroMemory( &newRecord->LogRecord.Data, sizeof( RECORD_DATA ) );
 
     return( newRecord );
 }
@@ -301,16 +440,7 @@ Return Value:
 
 --*/
 {
-    if (FlagOn(Record->LogRecord.RecordType,RECORD_TYPE_FLAG_STATIC)) {
-
-        //
-        // This was our static buffer, mark it available.
-        //
-
-        ASSERT(MiniSpyData.StaticBufferInUse);
-        MiniSpyData.StaticBufferInUse = FALSE;
-
-    } else {
+    if (!SpyPriorityFreeRecord( Record )) {
 
         SpyFreeBuffer( Record );
     }
@@ -326,7 +456,8 @@ SpySetRecordName (
 
 Routine Description:
 
-    Sets the given file name in the LogRecord.
+    Sets the given file name in the LogRecord.  The name is cut short if
+    the record has no room for all of it.
 
     NOTE:  This code must be NON-PAGED because it can be called on the
            paging path.
@@ -345,19 +476,24 @@ Return Value:
 {
     ULONG i=0;
     ULONG nameCopyLength;
+    ULONG remaining;
     PCHAR copyPointer = (PCHAR)LogRecord->Name;
     copyPointer += LogRecord->Length - sizeof(LOG_RECORD);
 
+    remaining = REMAINING_NAME_SPACE( CONTAINING_RECORD( LogRecord, RECORD_LIST, LogRecord ) );
 
-    if (NULL != Name) {
+    if (NULL != Name && remaining >= sizeof( PVOID ) + sizeof( UNICODE_NULL )) {
 
         //
-        //  Need space for NULL termination
+        //  Need space for the separator, the padding and the NULL
+        //  termination written after the name
         //
 
-        if (Name->Length > (MAX_NAME_SPACE - sizeof( UNICODE_NULL ))) {
+        remaining -= sizeof( PVOID ) + sizeof( UNICODE_NULL );
 
-            nameCopyLength = MAX_NAME_SPACE - sizeof( UNICODE_NULL );
+        if (Name->Length > remaining) {
+
+            nameCopyLength = remaining;
 
         } else {
 
@@ -411,10 +547,110 @@ Return Value:
     }
 }
 
+VOID
+SpyQueryIdentity (
+    __out PSPY_IDENTITY Identity
+    )
+/*++
+
+Routine Description:
+
+    Looks up the image name of the current process and the SID of its
+    user.  A name that cannot be found is left empty.  SpyReleaseIdentity
+    must be called once the names are no longer needed.
+
+Arguments:
+
+    Identity - Receives the names.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    Identity->ProcessImageName = (PUNICODE_STRING)Identity->ProcessBuffer;
+    Identity->ProcessImageName->MaximumLength = sizeof(UNICODE_STRING) + MAX_PATH*2;
+    Identity->ProcessImageName->Length = 0;
+
+    GetProcessImageName( PsGetCurrentProcessId(), Identity->ProcessImageName );
+
+    if (GetSID( &Identity->Sid, NULL ) != STATUS_SUCCESS) {
+
+        Identity->Sid.Length = 0;
+    }
+}
+
+
+ULONG
+SpyIdentityNameSpace (
+    __in PSPY_IDENTITY Identity
+    )
+/*++
+
+Routine Description:
+
+    Returns the space the names in Identity take up in a record, see
+    SpyNewRecord.
+
+Arguments:
+
+    Identity - Names returned by SpyQueryIdentity.
+
+Return Value:
+
+    The space in bytes.
+
+--*/
+{
+    ULONG nameSpace = SPY_NAME_SPACE( Identity->ProcessImageName->Length );
+
+    if (Identity->Sid.Length != 0) {
+
+        nameSpace += SPY_NAME_SPACE( Identity->Sid.Length );
+    }
+
+    return nameSpace;
+}
+
+
+VOID
+SpyReleaseIdentity (
+    __inout PSPY_IDENTITY Identity
+    )
+/*++
+
+Routine Description:
+
+    Frees the SID string allocated by SpyQueryIdentity.
+
+Arguments:
+
+    Identity - Names returned by SpyQueryIdentity.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (Identity->Sid.Buffer != NULL) {
+
+        ExFreePool( Identity->Sid.Buffer );
+        Identity->Sid.Buffer = NULL;
+    }
+}
+
+
 VOID
 SpyLogPreOperationData (
     __in PFLT_CALLBACK_DATA Data,
     __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PSPY_IDENTITY Identity,
     __inout PRECORD_LIST RecordList
     )
 /*++
@@ -433,6 +669,8 @@ Arguments:
 
     FltObjects - Pointer to the io objects involved in this operation.
 
+    Identity - Who issued the operation, from SpyQueryIdentity.
+
     RecordList - Where we want to save the data
 
 Return Value:
@@ -445,14 +683,8 @@ Return Value:
     //WCHAR* Name = RecordList->LogRecord.Name;
     PDEVICE_OBJECT devObj;
     NTSTATUS status;
-    PUNICODE_STRING ProcessImageName;
-    WCHAR strBuffer[(sizeof(UNICODE_STRING) + MAX_PATH*2)/sizeof(WCHAR)];
     //PEPROCESS *PEprocess = NULL;
 
-	PACCESS_STATE AccessState;
-	WCHAR* sidbuf;
-	UNICODE_STRING sidString;
-
     status = FltGetDeviceObject(FltObjects->Volume,&devObj);
     if (NT_SUCCESS(status)) {
 
@@ -477,12 +709,7 @@ Return Value:
     recordData->Transaction     = (FILE_ID)FltObjects->Transaction;
     recordData->ProcessId       = (FILE_ID)PsGetCurrentProcessId();
 
-    ProcessImageName = (PUNICODE_STRING)strBuffer;
-    ProcessImageName->MaximumLength  = sizeof(UNICODE_STRING) + MAX_PATH*2;
-    ProcessImageName->Length = 0;
-
-    GetProcessImageName((HANDLE)recordData->ProcessId, ProcessImageName);
-    SpySetRecordName( &(RecordList->LogRecord), ProcessImageName );
+    SpySetRecordName( &(RecordList->LogRecord), Identity->ProcessImageName );
 
 	//if (Data->Iopb->MajorFunction == IRP_MJ_CREATE){
 		//Token = SeQuerySubjectContextToken((&(Data->Iopb->Parameters.Create.SecurityContext->AccessState->SubjectSecurityContext)));
@@ -497,15 +724,9 @@ Return Value:
 		// }
 
 		//AccessState = Data->Iopb->Parameters.Create.SecurityContext->AccessState;
-		AccessState = NULL;
-		sidbuf = ExAllocatePoolWithTag(NonPagedPool, 128, SID_TAG);
-		RtlInitUnicodeString(&sidString, sidbuf);
-
-		if (GetSID(&sidString, AccessState) == STATUS_SUCCESS){
-			SpySetRecordName(&(RecordList->LogRecord), &sidString);
+		if (Identity->Sid.Length != 0){
+			SpySetRecordName(&(RecordList->LogRecord), &Identity->Sid);
 		}
-
-		ExFreePool(sidString.Buffer);
 	//}
 
     // status = PsLookupProcessByProcessId(recordData->ProcessId, PEprocess);
@@ -570,7 +791,7 @@ Return Value:
 
     //recordData->Status = Data->IoStatus.Status;
     //recordData->Information = Data->IoStatus.Information;
-    //KeQuerySystemTime( &recordData->CompletionTime );
+    KeQuerySystemTime( &recordData->CompletionTime );
 	if (Data->Iopb->Parameters.Create.Options & FILE_DELETE_ON_CLOSE)
 	{
 		RecordList->LogRecord.Data.Reserved[0] = 'D';
@@ -663,15 +884,18 @@ SpyLog (
 
 Routine Description:
 
-    This routine inserts the given log record into the list to be sent
-    to the user mode application.
+    This routine inserts the given log record into the current
+    processor's queue of records to be sent to the user mode application.
+    The sequence number is assigned under the queue lock so that each
+    queue's records are queued in sequence order.  A record no connected
+    reader wants is freed instead.
 
     NOTE:  This code must be NON-PAGED because it can be called on the
            paging path or at DPC level and uses a spin-lock
 
 Arguments:
 
-    RecordList - The record to append to the MiniSpyData.OutputBufferList
+    RecordList - The record to append to the MiniSpyData.LogQueues
 
 Return Value:
 
@@ -681,144 +905,489 @@ Return Value:
 
 --*/
 {
+    PSPY_LOG_QUEUE queue = SpyCurrentLogQueue();
     KIRQL oldIrql;
 
-    KeAcquireSpinLock(&MiniSpyData.OutputBufferLock, &oldIrql);
-    InsertTailList(&MiniSpyData.OutputBufferList, &RecordList->List);
-    KeReleaseSpinLock(&MiniSpyData.OutputBufferLock, oldIrql);
+    KeAcquireSpinLock(&queue->Lock, &oldIrql);
+
+    if (!SpyReaderClaim( RecordList )) {
+
+        KeReleaseSpinLock(&queue->Lock, oldIrql);
+        SpyFreeRecord( RecordList );
+        return;
+    }
+
+    RecordList->LogRecord.SequenceNumber = ++queue->SequenceNumber;
+    RecordList->LogRecord.Processor = (ULONG)(queue - MiniSpyData.LogQueues);
+    InsertTailList(&queue->List, &RecordList->List);
+    KeReleaseSpinLock(&queue->Lock, oldIrql);
 }
 
 
-NTSTATUS
-SpyGetLog (
-    __out_bcount_part(OutputBufferLength,*ReturnOutputBufferLength) PUCHAR OutputBuffer,
-    __in ULONG OutputBufferLength,
-    __out PULONG ReturnOutputBufferLength
+static
+PRECORD_LIST
+SpyNextRecord (
+    __inout PSPY_READER Reader,
+    __inout PULONG NextQueue,
+    __out PULONG Lane,
+    __out PKIRQL OldIrql
     )
 /*++
 
 Routine Description:
-    This function fills OutputBuffer with as many LOG_RECORDs as possible.
-    The LOG_RECORDs are variable sizes and are tightly packed in the
-    OutputBuffer.
+
+    Finds the next record to send a reader: the first one past its cursor
+    on the priority lane that it is in, else the first one on the first
+    queue from *NextQueue on that has one.  The cursor is moved past the
+    records the reader is not in.
 
     NOTE:  This code must be NON-PAGED because it uses a spin-lock.
 
 Arguments:
-    OutputBuffer - The user's buffer to fill with the log data we have
-        collected
 
-    OutputBufferLength - The size in bytes of OutputBuffer
+    Reader - The reader.
 
-    ReturnOutputBufferLength - The amount of data actually written into the
-        OutputBuffer.
+    NextQueue - The queue to look at first, advanced past the one the
+        record was found on.
 
-Return Value:
-    STATUS_SUCCESS if some records were able to be written to the OutputBuffer.
+    Lane - Receives the lane the record was found on, whose lock is still
+        held.
 
-    STATUS_NO_MORE_ENTRIES if we have no data to return.
+    OldIrql - Receives the IRQL to release the lock to.
 
-    STATUS_BUFFER_TOO_SMALL if the OutputBuffer is too small to
-        hold even one record and we have data to return.
+Return Value:
+
+    The record, still queued, or NULL if there are none, in which case no
+    lock is held.
 
 --*/
 {
-    PLIST_ENTRY pList;
-    ULONG bytesWritten = 0;
-    PLOG_RECORD pLogRecord;
-    NTSTATUS status = STATUS_NO_MORE_ENTRIES;
     PRECORD_LIST pRecordList;
-    KIRQL oldIrql;
-    BOOLEAN recordsAvailable = FALSE;
+    PLIST_ENTRY list;
+    PLIST_ENTRY entry;
+    PKSPIN_LOCK lock;
+    ULONG wanted = Reader->Bit | SPY_READER_UNCLAIMED;
+    ULONG lane;
+    ULONG i;
 
-    KeAcquireSpinLock( &MiniSpyData.OutputBufferLock, &oldIrql );
+    for (i = 0; i <= LOG_QUEUES; i++) {
 
-    while (!IsListEmpty( &MiniSpyData.OutputBufferList ) && (OutputBufferLength > 0)) {
+        lane = (i == 0) ? SPY_PRIORITY_LANE : (*NextQueue + i - 1) % LOG_QUEUES;
+        list = SpyReaderLane( lane, &lock );
 
-        //
-        //  Mark we have records
-        //
+        if (IsListEmpty( list )) {
 
-        recordsAvailable = TRUE;
+            continue;
+        }
 
-        //
-        //  Get the next available record
-        //
+        KeAcquireSpinLock( lock, OldIrql );
 
-        pList = RemoveHeadList( &MiniSpyData.OutputBufferList );
+        for (entry = Reader->Position[lane]->Flink; entry != list; entry = entry->Flink) {
 
-        pRecordList = CONTAINING_RECORD( pList, RECORD_LIST, List );
+            pRecordList = CONTAINING_RECORD( entry, RECORD_LIST, List );
 
-        pLogRecord = &pRecordList->LogRecord;
+            if (FlagOn( pRecordList->Readers, wanted )) {
 
-        //
-        //  If no filename was set then make it into a NULL file name.
-        //
+                if (lane != SPY_PRIORITY_LANE) {
 
-        if (REMAINING_NAME_SPACE( pLogRecord ) == MAX_NAME_SPACE) {
+                    *NextQueue = (lane + 1) % LOG_QUEUES;
+                }
 
-            //
-            //  We don't have a name, so return an empty string.
-            //  We have to always start a new log record on a PVOID aligned boundary.
-            //
+                *Lane = lane;
+                return pRecordList;
+            }
 
-            pLogRecord->Length += ROUND_TO_SIZE( sizeof( UNICODE_NULL ), sizeof( PVOID ) );
-            pLogRecord->Name[0] = UNICODE_NULL;
+            Reader->Position[lane] = entry;
         }
 
-        //
-        //  Put it back if we've run out of room.
-        //
+        KeReleaseSpinLock( lock, *OldIrql );
+    }
 
-        if (OutputBufferLength < pLogRecord->Length) {
+    return NULL;
+}
 
-            InsertHeadList( &MiniSpyData.OutputBufferList, pList );
-            break;
-        }
 
-        KeReleaseSpinLock( &MiniSpyData.OutputBufferLock, oldIrql );
+static
+NTSTATUS
+SpySendDropped (
+    __inout PSPY_READER Reader,
+    __in ULONG Queue,
+    __out_bcount_part(OutputBufferLength,*RecordLength) PUCHAR OutputBuffer,
+    __in ULONG OutputBufferLength,
+    __out PULONG RecordLength
+    )
+/*++
 
-        //
-        //  The lock is released, return the data, adjust pointers.
-        //  Protect access to raw user-mode OutputBuffer with an exception handler
-        //
+Routine Description:
 
-        try {
-            RtlCopyMemory( OutputBuffer, pLogRecord, pLogRecord->Length );
-        } except( EXCEPTION_EXECUTE_HANDLER ) {
+    Tells a reader about the records of a queue it was made to give up,
+    with a gap record numbered in its own sequence for the queue.
 
-            //
-            //  Put the record back in
-            //
+    NOTE:  This code must be NON-PAGED because it uses a spin-lock.
 
-            KeAcquireSpinLock( &MiniSpyData.OutputBufferLock, &oldIrql );
-            InsertHeadList( &MiniSpyData.OutputBufferList, pList );
-            KeReleaseSpinLock( &MiniSpyData.OutputBufferLock, oldIrql );
+Arguments:
 
-            return GetExceptionCode();
+    Reader - The reader.
 
-        }
+    Queue - The queue.
 
-        bytesWritten += pLogRecord->Length;
+    OutputBuffer - The user's buffer to write the gap record to.
 
-        OutputBufferLength -= pLogRecord->Length;
+    OutputBufferLength - The size in bytes of OutputBuffer.
 
-        OutputBuffer += pLogRecord->Length;
+    RecordLength - Receives the size of the record written, 0 if the
+        reader gave up nothing.
 
-        SpyFreeRecord( pRecordList );
+Return Value:
 
-        //
-        //  Relock the list
-        //
+    STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL if the record does not fit or
+    the exception raised writing it.
 
-        KeAcquireSpinLock( &MiniSpyData.OutputBufferLock, &oldIrql );
-    }
+--*/
+{
+    PSPY_LOG_QUEUE queue = &MiniSpyData.LogQueues[Queue];
+    PLOG_RECORD pLogRecord;
+    PRECORD_GAP gap;
+    LARGE_INTEGER now;
+    ULONG length = sizeof( LOG_RECORD ) + ROUND_TO_SIZE( sizeof( RECORD_GAP ), sizeof( PVOID ) );
+    ULONG dropped;
+    ULONG first;
+    KIRQL oldIrql;
 
-    KeReleaseSpinLock( &MiniSpyData.OutputBufferLock, oldIrql );
+    *RecordLength = 0;
+
+    KeQuerySystemTime( &now );
+
+    KeAcquireSpinLock( &queue->Lock, &oldIrql );
+
+    dropped = Reader->Dropped[Queue];
+
+    if (dropped == 0) {
+
+        KeReleaseSpinLock( &queue->Lock, oldIrql );
+        return STATUS_SUCCESS;
+    }
+
+    if (OutputBufferLength < length) {
+
+        KeReleaseSpinLock( &queue->Lock, oldIrql );
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Reader->Dropped[Queue] = 0;
+    first = Reader->Sequence[Queue] + 1;
+    Reader->Sequence[Queue] += dropped + 1;
+
+    KeReleaseSpinLock( &queue->Lock, oldIrql );
+
+    try {
+
+        pLogRecord = (PLOG_RECORD)OutputBuffer;
+        RtlZeroMemory( pLogRecord, length );
+
+        pLogRecord->Length = length;
+        pLogRecord->SequenceNumber = first + dropped;
+        pLogRecord->RecordType = RECORD_TYPE_GAP;
+        pLogRecord->Processor = Queue;
+        pLogRecord->Data.OriginatingTime = now;
+
+        gap = (PRECORD_GAP)pLogRecord->Name;
+        gap->FirstSequence = first;
+        gap->LastSequence = first + dropped - 1;
+        gap->Count = dropped;
+        gap->Reason[LOSS_LAGGING] = dropped;
+
+    } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+        //
+        //  Keep the loss for the next call.  The numbers given out stay
+        //  given out unless nothing was numbered since.
+        //
+
+        KeAcquireSpinLock( &queue->Lock, &oldIrql );
+
+        Reader->Dropped[Queue] += dropped;
+
+        if (Reader->Sequence[Queue] == first + dropped) {
+
+            Reader->Sequence[Queue] = first - 1;
+        }
+
+        KeReleaseSpinLock( &queue->Lock, oldIrql );
+
+        return GetExceptionCode();
+    }
+
+    *RecordLength = length;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+SpyGetLog (
+    __in PSPY_READER Reader,
+    __out_bcount_part(OutputBufferLength,*ReturnOutputBufferLength) PUCHAR OutputBuffer,
+    __in ULONG OutputBufferLength,
+    __out PULONG ReturnOutputBufferLength
+    )
+/*++
+
+Routine Description:
+    This function fills OutputBuffer with as many LOG_RECORDs for a reader
+    as possible.  The LOG_RECORDs are variable sizes and are tightly packed
+    in the OutputBuffer.  Gap records for the records the reader was made
+    to give up come first, then the records on the priority lane, then one
+    record from each processor queue in turn.
+
+    Records stay queued until every reader they are meant for has been
+    sent them, and an acknowledging reader has acknowledged them.  The
+    copy sent up is renumbered in the reader's own sequence for the lane.
+    An acknowledging reader is sent nothing more while ACK_WINDOW records
+    wait for its acknowledgement.
+
+    NOTE:  This code must be NON-PAGED because it uses a spin-lock.
+
+Arguments:
+    Reader - The reader to send records to.
+
+    OutputBuffer - The user's buffer to fill with the log data we have
+        collected
+
+    OutputBufferLength - The size in bytes of OutputBuffer
+
+    ReturnOutputBufferLength - The amount of data actually written into the
+        OutputBuffer.
+
+Return Value:
+    STATUS_SUCCESS if some records were able to be written to the OutputBuffer.
+
+    STATUS_NO_MORE_ENTRIES if we have no data to return.
+
+    STATUS_BUFFER_TOO_SMALL if the OutputBuffer is too small to
+        hold even one record and we have data to return.
+
+--*/
+{
+    PKSPIN_LOCK lock;
+    LIST_ENTRY freeList;
+    ULONG lane;
+    ULONG bytesWritten = 0;
+    ULONG recordLength;
+    PLOG_RECORD pLogRecord;
+    NTSTATUS status = STATUS_NO_MORE_ENTRIES;
+    PRECORD_LIST pRecordList;
+    ULONG nextQueue = Reader->NextLogQueue;
+    ULONG taken;
+    ULONG sequence;
+    ULONG gapFirst;
+    ULONG gapCount;
+    ULONG i;
+    KIRQL oldIrql;
+    BOOLEAN recordsAvailable = FALSE;
+
+    //
+    //  Gaps may still be pending if nothing could be allocated since they
+    //  were recorded.  The last fetch freed records, so try again here
+    //  rather than wait for the next operation.
+    //
+
+    if (MiniSpyData.GapCount != 0) {
+
+        SpyLossFlush();
+    }
+
+    for (i = 0; i < LOG_QUEUES && OutputBufferLength > 0; i++) {
+
+        if (Reader->Dropped[i] == 0) {
+
+            continue;
+        }
+
+        status = SpySendDropped( Reader, i, OutputBuffer, OutputBufferLength, &recordLength );
+
+        if (status == STATUS_BUFFER_TOO_SMALL) {
+
+            recordsAvailable = TRUE;
+            OutputBufferLength = 0;
+            break;
+        }
+
+        if (!NT_SUCCESS( status )) {
+
+            return status;
+        }
+
+        bytesWritten += recordLength;
+        OutputBufferLength -= recordLength;
+        OutputBuffer += recordLength;
+    }
+
+    status = STATUS_NO_MORE_ENTRIES;
+
+    InitializeListHead( &freeList );
+
+    while (OutputBufferLength > 0) {
+
+        if (Reader->SubscriberId != 0 && Reader->Retained >= ACK_WINDOW) {
+
+            break;
+        }
+
+        //
+        //  Get the next record for this reader, priority lane first
+        //
+
+        pRecordList = SpyNextRecord( Reader, &nextQueue, &lane, &oldIrql );
+
+        if (pRecordList == NULL) {
+
+            break;
+        }
+
+        SpyReaderLane( lane, &lock );
+
+        //
+        //  Mark we have records
+        //
+
+        recordsAvailable = TRUE;
+
+        pLogRecord = &pRecordList->LogRecord;
+
+        //
+        //  If no filename was set then make it into a NULL file name.
+        //
+
+        if (pLogRecord->Length == sizeof( LOG_RECORD )) {
+
+            //
+            //  We don't have a name, so return an empty string.
+            //  We have to always start a new log record on a PVOID aligned boundary.
+            //
+
+            pLogRecord->Length += ROUND_TO_SIZE( sizeof( UNICODE_NULL ), sizeof( PVOID ) );
+            pLogRecord->Name[0] = UNICODE_NULL;
+        }
+
+        //
+        //  Leave it for the next call if we've run out of room.
+        //
+
+        if (OutputBufferLength < pLogRecord->Length) {
+
+            KeReleaseSpinLock( lock, oldIrql );
+            break;
+        }
+
+        //
+        //  Take the record for this reader and number it.  A gap record
+        //  takes the numbers it accounts for as well.  The hold keeps the
+        //  record queued while it is copied without the lock, the retain
+        //  bit until an acknowledging reader acknowledges it.
+        //
+
+        taken = pRecordList->Readers & (Reader->Bit | SPY_READER_UNCLAIMED);
+        ClearFlag( pRecordList->Readers, taken );
+        SetFlag( pRecordList->Readers, SPY_READER_HOLD( Reader->Bit ) );
+
+        if (Reader->SubscriberId != 0) {
+
+            SetFlag( pRecordList->Readers, SPY_READER_RETAIN( Reader->Bit ) );
+            InterlockedIncrement( &Reader->Retained );
+        }
+
+        if (FlagOn( taken, Reader->Bit )) {
+
+            InterlockedDecrement( &Reader->Pending );
+        }
+
+        Reader->Position[lane] = &pRecordList->List;
+
+        gapFirst = Reader->Sequence[lane] + 1;
+        gapCount = SPY_RECORD_NUMBERS( pRecordList ) - 1;
+
+        Reader->Sequence[lane] += gapCount + 1;
+        sequence = Reader->Sequence[lane];
+
+        KeReleaseSpinLock( lock, oldIrql );
+
+        //
+        //  The lock is released, return the data, adjust pointers.
+        //  Protect access to raw user-mode OutputBuffer with an exception handler
+        //
+
+        try {
+
+            RtlCopyMemory( OutputBuffer, pLogRecord, pLogRecord->Length );
+            ((PLOG_RECORD)OutputBuffer)->SequenceNumber = sequence;
+
+            if (gapCount != 0) {
+
+                ((PRECORD_GAP)((PLOG_RECORD)OutputBuffer)->Name)->FirstSequence = gapFirst;
+                ((PRECORD_GAP)((PLOG_RECORD)OutputBuffer)->Name)->LastSequence = gapFirst + gapCount - 1;
+            }
+
+        } except( EXCEPTION_EXECUTE_HANDLER ) {
+
+            //
+            //  Put the record back for this reader
+            //
+
+            KeAcquireSpinLock( lock, &oldIrql );
+
+            ClearFlag( pRecordList->Readers, SPY_READER_HOLD( Reader->Bit ) );
+            SetFlag( pRecordList->Readers, taken );
+
+            if (Reader->SubscriberId != 0) {
+
+                ClearFlag( pRecordList->Readers, SPY_READER_RETAIN( Reader->Bit ) );
+                InterlockedDecrement( &Reader->Retained );
+            }
+
+            if (FlagOn( taken, Reader->Bit )) {
+
+                InterlockedIncrement( &Reader->Pending );
+            }
+
+            Reader->Position[lane] = pRecordList->List.Blink;
+
+            if (Reader->Sequence[lane] == sequence) {
+
+                Reader->Sequence[lane] = gapFirst - 1;
+            }
+
+            KeReleaseSpinLock( lock, oldIrql );
+
+            return GetExceptionCode();
+
+        }
+
+        bytesWritten += pLogRecord->Length;
+
+        InterlockedIncrement( &Reader->Delivered );
+
+        OutputBufferLength -= pLogRecord->Length;
+
+        OutputBuffer += pLogRecord->Length;
+
+        //
+        //  Free the record if this reader was the last to want it.
+        //
+
+        KeAcquireSpinLock( lock, &oldIrql );
+        ClearFlag( pRecordList->Readers, SPY_READER_HOLD( Reader->Bit ) );
+        InterlockedExchangeAdd( &MiniSpyData.RecordsDrained, SpyReaderTrim( lane, &freeList ) );
+        KeReleaseSpinLock( lock, oldIrql );
+
+        SpyReaderFree( &freeList );
+    }
+
+    Reader->NextLogQueue = nextQueue;
 
     //
-    //  Set proper status
-    //
+    //  Set proper status
+    //
 
     if ((bytesWritten == 0) && recordsAvailable) {
 
@@ -853,9 +1422,9 @@ SpyEmptyOutputBufferList (
 
 Routine Description:
 
-    This routine frees all the remaining log records in the OutputBufferList
-    that are not going to get sent up to the user mode application since
-    MiniSpy is shutting down.
+    This routine frees all the remaining log records in the log queues
+    and PriorityList that are not going to get sent up to the user mode
+    application since MiniSpy is shutting down.
 
     NOTE:  This code must be NON-PAGED because it uses a spin-lock
 
@@ -871,13 +1440,36 @@ Return Value:
 {
     PLIST_ENTRY pList;
     PRECORD_LIST pRecordList;
+    PSPY_LOG_QUEUE queue;
+    ULONG i;
     KIRQL oldIrql;
 
+    for (i = 0; i < LOG_QUEUES; i++) {
+
+        queue = &MiniSpyData.LogQueues[i];
+
+        KeAcquireSpinLock( &queue->Lock, &oldIrql );
+
+        while (!IsListEmpty( &queue->List )) {
+
+            pList = RemoveHeadList( &queue->List );
+            KeReleaseSpinLock( &queue->Lock, oldIrql );
+
+            pRecordList = CONTAINING_RECORD( pList, RECORD_LIST, List );
+
+            SpyFreeRecord( pRecordList );
+
+            KeAcquireSpinLock( &queue->Lock, &oldIrql );
+        }
+
+        KeReleaseSpinLock( &queue->Lock, oldIrql );
+    }
+
     KeAcquireSpinLock( &MiniSpyData.OutputBufferLock, &oldIrql );
 
-    while (!IsListEmpty( &MiniSpyData.OutputBufferList )) {
+    while (!IsListEmpty( &MiniSpyData.PriorityList )) {
 
-        pList = RemoveHeadList( &MiniSpyData.OutputBufferList );
+        pList = RemoveHeadList( &MiniSpyData.PriorityList );
         KeReleaseSpinLock( &MiniSpyData.OutputBufferLock, oldIrql );
 
         pRecordList = CONTAINING_RECORD( pList, RECORD_LIST, List );
@@ -908,7 +1500,20 @@ Routine Description:
 
     This processes the following registry keys:
     hklm\system\CurrentControlSet\Services\Minispy\MaxRecords
+    hklm\system\CurrentControlSet\Services\Minispy\RecordQuotaFloor
+    hklm\system\CurrentControlSet\Services\Minispy\RecordQuotaCeiling
     hklm\system\CurrentControlSet\Services\Minispy\NameQueryMethod
+    hklm\system\CurrentControlSet\Services\Minispy\WriteCoalesceLimit
+    hklm\system\CurrentControlSet\Services\Minispy\WriteCoalesceIdle
+    hklm\system\CurrentControlSet\Services\Minispy\ProcessRecordBudget
+    hklm\system\CurrentControlSet\Services\Minispy\ProcessSampleRate
+    hklm\system\CurrentControlSet\Services\Minispy\ProcessSampleWindow
+    hklm\system\CurrentControlSet\Services\Minispy\BurstRenameThreshold
+    hklm\system\CurrentControlSet\Services\Minispy\BurstDeleteThreshold
+    hklm\system\CurrentControlSet\Services\Minispy\BurstWriteThreshold
+    hklm\system\CurrentControlSet\Services\Minispy\BurstWindow
+    hklm\system\CurrentControlSet\Services\Minispy\BurstBlock
+    hklm\system\CurrentControlSet\Services\Minispy\PriorityRecords
 
 
 Arguments:
@@ -969,6 +1574,66 @@ Return Value:
         MiniSpyData.MaxRecordsToAllocate = *((PLONG)&(pValuePartialInfo->Data));
     }
 
+    //
+    // Read the RecordQuotaFloor entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, RECORD_QUOTA_FLOOR );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.QuotaFloor = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the RecordQuotaCeiling entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, RECORD_QUOTA_CEILING );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.QuotaCeiling = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the PriorityRecords entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, PRIORITY_RECORDS );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.PriorityRecords = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
     //
     // Read the NameQueryMethod entry from the registry
     //
@@ -989,6 +1654,206 @@ Return Value:
         MiniSpyData.NameQueryMethod = *((PLONG)&(pValuePartialInfo->Data));
     }
 
+    //
+    // Read the WriteCoalesceLimit entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, WRITE_COALESCE_LIMIT );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.CoalesceMaxWrites = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the WriteCoalesceIdle entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, WRITE_COALESCE_IDLE );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.CoalesceIdleTime = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the ProcessRecordBudget entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, PROCESS_RECORD_BUDGET );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.ProcessBudget = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the ProcessSampleRate entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, PROCESS_SAMPLE_RATE );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.ProcessSampleRate = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the ProcessSampleWindow entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, PROCESS_SAMPLE_WINDOW );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.SampleWindow = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the BurstRenameThreshold entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, BURST_RENAME_THRESHOLD );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.BurstThreshold[BURST_RENAME] = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the BurstDeleteThreshold entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, BURST_DELETE_THRESHOLD );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.BurstThreshold[BURST_DELETE] = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the BurstWriteThreshold entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, BURST_WRITE_THRESHOLD );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.BurstThreshold[BURST_WRITE] = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the BurstWindow entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, BURST_WINDOW );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.BurstWindow = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
+    //
+    // Read the BurstBlock entry from the registry
+    //
+
+    RtlInitUnicodeString( &valueName, BURST_BLOCK );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+        ASSERT( pValuePartialInfo->Type == REG_DWORD );
+        MiniSpyData.BurstBlock = *((PLONG)&(pValuePartialInfo->Data));
+    }
+
     ZwClose(driverRegKey);
 }
 
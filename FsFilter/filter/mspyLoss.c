@@ -0,0 +1,356 @@
+﻿/*++
+
+Module Name:
+
+    mspyLoss.c
+
+Abstract:
+
+    This module accounts for every operation that was seen but could not
+    be sent to user mode.
+
+    A record that cannot be allocated, or is dropped before it is queued,
+    still takes a sequence number from the current processor's log queue.
+    The loss is counted per processor by reason and IRP major function,
+    and the number is added to the queue's short list of pending gaps.  As
+    soon as a record can be allocated again the pending gaps are queued as
+    RECORD_TYPE_GAP records on the queue they belong to, so user mode
+    learns exactly which sequence numbers it will never see and why.
+
+    Contiguous losses extend the last pending range.  If more than
+    SPY_LOSS_GAPS separate ranges pile up, further losses are only added
+    to the last one's Count.  The range a gap record carries in its queue
+    is never shown to user mode: each reader renumbers the records it
+    takes, and gives a gap record the Count numbers just before its own,
+    so every gap record a consumer sees is one exact, contiguous run.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+//#include <dontuse.h>
+#include <suppress.h>
+#include <Ntstrsafe.h>
+
+#include "mspyKern.h"
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, SpyLossInitialize)
+    #pragma alloc_text(PAGE, SpyLossFormatStats)
+#endif
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyLossInitialize (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Clears the loss counters and the pending gaps.  The log queues must
+    already be initialized.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    RtlZeroMemory( MiniSpyData.LossCounters, sizeof( MiniSpyData.LossCounters ) );
+
+    for (i = 0; i < LOG_QUEUES; i++) {
+
+        MiniSpyData.LogQueues[i].GapCount = 0;
+    }
+
+    MiniSpyData.GapCount = 0;
+}
+
+
+VOID
+SpyLossRecord (
+    __in ULONG Reason,
+    __in UCHAR MajorFunction
+    )
+/*++
+
+Routine Description:
+
+    Accounts for one operation that will not reach user mode.  A sequence
+    number is consumed for it and added to the pending gaps.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+Arguments:
+
+    Reason - One of the LOSS_XXX values.
+
+    MajorFunction - The operation that was not logged.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_LOSS_COUNTERS counters;
+    PSPY_LOG_QUEUE queue;
+    PRECORD_GAP gap;
+    ULONG sequence;
+    KIRQL oldIrql;
+
+    ASSERT( Reason < LOSS_REASONS );
+
+    counters = &MiniSpyData.LossCounters[KeGetCurrentProcessorNumber() % SPY_LOSS_CPUS];
+
+    InterlockedIncrement( &counters->Reason[Reason] );
+    InterlockedIncrement( &counters->Major[MajorFunction < LOSS_MAJOR_SLOTS - 1 ?
+                                           MajorFunction :
+                                           LOSS_MAJOR_SLOTS - 1] );
+
+    queue = SpyCurrentLogQueue();
+
+    KeAcquireSpinLock( &queue->Lock, &oldIrql );
+
+    sequence = ++queue->SequenceNumber;
+
+    gap = (queue->GapCount != 0) ? &queue->Gaps[queue->GapCount - 1] : NULL;
+
+    if (gap == NULL ||
+        (sequence != gap->LastSequence + 1 && queue->GapCount < SPY_LOSS_GAPS)) {
+
+        gap = &queue->Gaps[queue->GapCount++];
+        InterlockedIncrement( &MiniSpyData.GapCount );
+        RtlZeroMemory( gap, sizeof( RECORD_GAP ) );
+        gap->FirstSequence = sequence;
+        gap->LastSequence = sequence;
+
+    } else if (sequence == gap->LastSequence + 1) {
+
+        gap->LastSequence = sequence;
+    }
+
+    gap->Count++;
+    gap->Reason[Reason]++;
+
+    KeReleaseSpinLock( &queue->Lock, oldIrql );
+}
+
+
+VOID
+SpyDiscardRecord (
+    __in PRECORD_LIST Record
+    )
+/*++
+
+Routine Description:
+
+    Frees a record that was built for an operation but will not be
+    logged, and accounts for it as lost.  Records of operations that are
+    simply not of interest are freed with SpyFreeRecord instead.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+Arguments:
+
+    Record - The record to drop.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    SpyLossRecord( LOSS_DISCARDED, Record->LogRecord.Data.CallbackMajorId );
+    SpyFreeRecord( Record );
+}
+
+
+VOID
+SpyLossFlush (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Queues a RECORD_TYPE_GAP record for every pending gap, on the queue
+    whose numbers it accounts for.  Gap records are allocated straight
+    from the record buffers, so failing to get one is not itself a loss:
+    the gap simply stays pending for the next call.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_LOG_QUEUE queue;
+    PRECORD_LIST recordList;
+    ULONG recordType;
+    ULONG i;
+    KIRQL oldIrql;
+
+    for (i = 0; i < LOG_QUEUES && MiniSpyData.GapCount != 0; i++) {
+
+        queue = &MiniSpyData.LogQueues[i];
+
+        while (queue->GapCount != 0) {
+
+            recordList = SpyAllocateBuffer( sizeof( RECORD_LIST ) +
+                                                ROUND_TO_SIZE( sizeof( RECORD_GAP ), sizeof( PVOID ) ),
+                                            &recordType );
+
+            if (recordList == NULL) {
+
+                return;
+            }
+
+            recordList->Readers = SPY_READER_ALL;
+            recordList->LogRecord.RecordType = RECORD_TYPE_GAP;
+            recordList->LogRecord.Length = sizeof( LOG_RECORD ) +
+                                           ROUND_TO_SIZE( sizeof( RECORD_GAP ), sizeof( PVOID ) );
+            recordList->LogRecord.Processor = i;
+            RtlZeroMemory( &recordList->LogRecord.Data, sizeof( RECORD_DATA ) );
+            KeQuerySystemTime( &recordList->LogRecord.Data.OriginatingTime );
+
+            //
+            //  Take the gap and queue its record under the same lock, so
+            //  the record is numbered after every number it accounts for.
+            //
+
+            KeAcquireSpinLock( &queue->Lock, &oldIrql );
+
+            if (queue->GapCount == 0) {
+
+                KeReleaseSpinLock( &queue->Lock, oldIrql );
+                SpyFreeBuffer( recordList );
+                break;
+            }
+
+            //
+            //  Every reader is told of the gap; some reader always takes
+            //  a record meant for all of them.
+            //
+
+            SpyReaderClaim( recordList );
+
+            RtlCopyMemory( recordList->LogRecord.Name, &queue->Gaps[0], sizeof( RECORD_GAP ) );
+            queue->GapCount--;
+            RtlMoveMemory( &queue->Gaps[0],
+                           &queue->Gaps[1],
+                           queue->GapCount * sizeof( RECORD_GAP ) );
+
+            recordList->LogRecord.SequenceNumber = ++queue->SequenceNumber;
+            InsertTailList( &queue->List, &recordList->List );
+
+            KeReleaseSpinLock( &queue->Lock, oldIrql );
+
+            InterlockedDecrement( &MiniSpyData.GapCount );
+        }
+    }
+}
+
+
+VOID
+SpyLossFormatStats (
+    __out_bcount(BufferSize) PWCHAR Buffer,
+    __in size_t BufferSize
+    )
+/*++
+
+Routine Description:
+
+    Sums the per processor loss counters into a line of text, listing
+    only the major functions that lost anything.
+
+Arguments:
+
+    Buffer - Receives the NULL terminated text.
+
+    BufferSize - Size of Buffer in bytes.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG reason[LOSS_REASONS];
+    ULONG major[LOSS_MAJOR_SLOTS];
+    PWCHAR end = Buffer;
+    size_t remaining = BufferSize;
+    ULONG cpu;
+    ULONG i;
+
+    PAGED_CODE();
+
+    RtlZeroMemory( reason, sizeof( reason ) );
+    RtlZeroMemory( major, sizeof( major ) );
+
+    for (cpu = 0; cpu < SPY_LOSS_CPUS; cpu++) {
+
+        for (i = 0; i < LOSS_REASONS; i++) {
+
+            reason[i] += MiniSpyData.LossCounters[cpu].Reason[i];
+        }
+
+        for (i = 0; i < LOSS_MAJOR_SLOTS; i++) {
+
+            major[i] += MiniSpyData.LossCounters[cpu].Major[i];
+        }
+    }
+
+    RtlStringCbPrintfExW( end,
+                          remaining,
+                          &end,
+                          &remaining,
+                          0,
+                          L"lost %lu (memory %lu, quota %lu, discarded %lu), %lu gaps pending",
+                          reason[LOSS_OUT_OF_MEMORY] + reason[LOSS_OVER_QUOTA] + reason[LOSS_DISCARDED],
+                          reason[LOSS_OUT_OF_MEMORY],
+                          reason[LOSS_OVER_QUOTA],
+                          reason[LOSS_DISCARDED],
+                          MiniSpyData.GapCount );
+
+    for (i = 0; i < LOSS_MAJOR_SLOTS; i++) {
+
+        if (major[i] == 0) {
+
+            continue;
+        }
+
+        if (i < LOSS_MAJOR_SLOTS - 1) {
+
+            RtlStringCbPrintfExW( end, remaining, &end, &remaining, 0, L", 0x%02x %lu", i, major[i] );
+
+        } else {
+
+            RtlStringCbPrintfExW( end, remaining, &end, &remaining, 0, L", other %lu", major[i] );
+        }
+    }
+}
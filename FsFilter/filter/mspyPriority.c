@@ -0,0 +1,404 @@
+﻿/*++
+
+Module Name:
+
+    mspyPriority.c
+
+Abstract:
+
+    This module implements the high priority lane of the log.
+
+    Denials and other policy violations must not be lost behind a flood of
+    audit records, so they do not share the audit path:
+
+        - their records come from a reserve of PriorityRecords buffers set
+          aside at load time, outside of MaxRecordsToAllocate; only once
+          the reserve is used up do they fall back to the record quota,
+        - they are queued on PriorityList, which SpyGetLog sends each
+          reader ahead of the processor queues, and
+        - they are numbered from their own sequence and carry
+          RECORD_TYPE_FLAG_PRIORITY, so the audit lane's numbering and gap
+          reporting are unaffected.
+
+    A denial that finds neither a reserve record nor room in the quota is
+    accounted for like any other lost record, in the audit lane's
+    numbering.
+
+    PriorityList is protected by OutputBufferLock, the free reserve by
+    PriorityLock.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+//#include <dontuse.h>
+#include <suppress.h>
+
+#include "mspyKern.h"
+
+#define SPY_PRIORITY_TAG    'rpSM'
+
+//
+//  Every reserve record is the same size, which holds a denial's file,
+//  process and user names in all but unusual cases.  Longer names are cut
+//  short rather than the denial waiting for a bigger record.
+//
+
+#define SPY_PRIORITY_RECORD_CLASS   2
+#define SPY_PRIORITY_RECORD_SIZE    SPY_RECORD_CLASS_SIZE( SPY_PRIORITY_RECORD_CLASS )
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, SpyPriorityInitialize)
+    #pragma alloc_text(PAGE, SpyPriorityShutdown)
+#endif
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+UCHAR
+SpyDeniedAccess (
+    __in PFLT_CALLBACK_DATA Data
+    )
+/*++
+
+Routine Description:
+
+    Works out what the denied operation tried to do.
+
+Arguments:
+
+    Data - The operation that was denied.
+
+Return Value:
+
+    'D' delete, 'R' rename, 'W' write, 'C' create or open, 'S' any other
+    change of file information.
+
+--*/
+{
+    switch (Data->Iopb->MajorFunction) {
+
+        case IRP_MJ_CREATE:
+            return FlagOn( Data->Iopb->Parameters.Create.Options, FILE_DELETE_ON_CLOSE ) ? 'D' : 'C';
+
+        case IRP_MJ_WRITE:
+            return 'W';
+
+        case IRP_MJ_SET_INFORMATION:
+
+            switch (Data->Iopb->Parameters.SetFileInformation.FileInformationClass) {
+
+                case FileRenameInformation:
+                    return 'R';
+
+                case FileDispositionInformation:
+                    return 'D';
+
+                default:
+                    return 'S';
+            }
+
+        default:
+            return 'S';
+    }
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyPriorityInitialize (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Sets up the priority list and carves the reserve into records.  If
+    the reserve cannot be allocated priority records simply come out of
+    the record quota.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_LIST record;
+    LONG i;
+
+    PAGED_CODE();
+
+    InitializeListHead( &MiniSpyData.PriorityList );
+    InitializeListHead( &MiniSpyData.PriorityFreeList );
+    KeInitializeSpinLock( &MiniSpyData.PriorityLock );
+
+    MiniSpyData.PrioritySequenceNumber = 0;
+    MiniSpyData.PriorityReserve = NULL;
+
+    if (MiniSpyData.PriorityRecords <= 0) {
+
+        MiniSpyData.PriorityRecords = 0;
+        return;
+    }
+
+    MiniSpyData.PriorityReserve = ExAllocatePoolWithTag( NonPagedPool,
+                                                         MiniSpyData.PriorityRecords * SPY_PRIORITY_RECORD_SIZE,
+                                                         SPY_PRIORITY_TAG );
+
+    if (MiniSpyData.PriorityReserve == NULL) {
+
+        MiniSpyData.PriorityRecords = 0;
+        return;
+    }
+
+    for (i = 0; i < MiniSpyData.PriorityRecords; i++) {
+
+        record = (PRECORD_LIST)(MiniSpyData.PriorityReserve + i * SPY_PRIORITY_RECORD_SIZE);
+        record->Size = SPY_PRIORITY_RECORD_SIZE;
+        record->SizeClass = SPY_PRIORITY_RECORD_CLASS;
+        InsertTailList( &MiniSpyData.PriorityFreeList, &record->List );
+    }
+}
+
+
+VOID
+SpyPriorityShutdown (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Frees the reserve.  Must be called after SpyEmptyOutputBufferList so
+    that no reserve record is still queued.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (MiniSpyData.PriorityReserve != NULL) {
+
+        ExFreePoolWithTag( MiniSpyData.PriorityReserve, SPY_PRIORITY_TAG );
+        MiniSpyData.PriorityReserve = NULL;
+        MiniSpyData.PriorityRecords = 0;
+    }
+}
+
+
+PRECORD_LIST
+SpyPriorityNewRecord (
+    __in UCHAR MajorFunction,
+    __in ULONG NameSpace
+    )
+/*++
+
+Routine Description:
+
+    Allocates a record for the priority lane, from the reserve if it has
+    any left and from the record quota otherwise.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+Arguments:
+
+    MajorFunction - The operation the record is for.
+
+    NameSpace - The space the names to be stored take up, see SpyNewRecord.
+
+Return Value:
+
+    Pointer to the RECORD_LIST allocated, or NULL if no memory is available.
+
+--*/
+{
+    PRECORD_LIST newRecord = NULL;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock( &MiniSpyData.PriorityLock, &oldIrql );
+
+    if (!IsListEmpty( &MiniSpyData.PriorityFreeList )) {
+
+        newRecord = CONTAINING_RECORD( RemoveHeadList( &MiniSpyData.PriorityFreeList ),
+                                       RECORD_LIST,
+                                       List );
+    }
+
+    KeReleaseSpinLock( &MiniSpyData.PriorityLock, oldIrql );
+
+    if (newRecord == NULL) {
+
+        return SpyNewRecord( MajorFunction, NameSpace );
+    }
+
+    newRecord->Readers = SPY_READER_ALL;
+    newRecord->LogRecord.RecordType = RECORD_TYPE_NORMAL;
+    newRecord->LogRecord.Length = sizeof(LOG_RECORD);
+    newRecord->LogRecord.SequenceNumber = 0;
+    newRecord->LogRecord.Processor = 0;
+    newRecord->LogRecord.Spare = 0;
+    RtlZeroMemory( &newRecord->LogRecord.Data, sizeof( RECORD_DATA ) );
+
+    return newRecord;
+}
+
+
+BOOLEAN
+SpyPriorityFreeRecord (
+    __in PRECORD_LIST Record
+    )
+/*++
+
+Routine Description:
+
+    Puts a record back in the reserve if that is where it came from.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+Arguments:
+
+    Record - The record being freed.
+
+Return Value:
+
+    TRUE if the record belonged to the reserve, FALSE if the caller still
+    has to free it.
+
+--*/
+{
+    PUCHAR address = (PUCHAR)Record;
+    KIRQL oldIrql;
+
+    if (MiniSpyData.PriorityReserve == NULL ||
+        address < MiniSpyData.PriorityReserve ||
+        address >= MiniSpyData.PriorityReserve + MiniSpyData.PriorityRecords * SPY_PRIORITY_RECORD_SIZE) {
+
+        return FALSE;
+    }
+
+    KeAcquireSpinLock( &MiniSpyData.PriorityLock, &oldIrql );
+    InsertTailList( &MiniSpyData.PriorityFreeList, &Record->List );
+    KeReleaseSpinLock( &MiniSpyData.PriorityLock, oldIrql );
+
+    return TRUE;
+}
+
+
+VOID
+SpyLogPriority (
+    __in PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    Queues a record on the priority lane.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level and uses a spin-lock
+
+Arguments:
+
+    RecordList - The record to send up ahead of the audit records.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    KIRQL oldIrql;
+
+    RecordList->LogRecord.RecordType |= RECORD_TYPE_FLAG_PRIORITY;
+
+    KeAcquireSpinLock( &MiniSpyData.OutputBufferLock, &oldIrql );
+
+    if (!SpyReaderClaim( RecordList )) {
+
+        KeReleaseSpinLock( &MiniSpyData.OutputBufferLock, oldIrql );
+        SpyFreeRecord( RecordList );
+        return;
+    }
+
+    RecordList->LogRecord.SequenceNumber = (ULONG)InterlockedIncrement( &MiniSpyData.PrioritySequenceNumber );
+    InsertTailList( &MiniSpyData.PriorityList, &RecordList->List );
+    KeReleaseSpinLock( &MiniSpyData.OutputBufferLock, oldIrql );
+}
+
+
+VOID
+SpyLogDenial (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PUNICODE_STRING FileName
+    )
+/*++
+
+Routine Description:
+
+    Logs an operation the policy refused.  The record looks like any other
+    operation record, with 'A' as its access type and what the operation
+    tried to do in RECORD_DATA.Reserved[1].
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Data - The operation being completed with STATUS_ACCESS_DENIED.
+
+    FltObjects - Objects related to the operation.
+
+    FileName - The name of the file it was aimed at.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_LIST recordList;
+    SPY_IDENTITY identity;
+
+    SpyQueryIdentity( &identity );
+
+    recordList = SpyPriorityNewRecord( Data->Iopb->MajorFunction,
+                                       SPY_NAME_SPACE( FileName->Length ) +
+                                            SpyIdentityNameSpace( &identity ) );
+
+    if (recordList == NULL) {
+
+        SpyReleaseIdentity( &identity );
+        return;
+    }
+
+    SpySetRecordName( &recordList->LogRecord, FileName );
+    SpyLogPreOperationData( Data, FltObjects, &identity, recordList );
+    SpyReleaseIdentity( &identity );
+
+    recordList->LogRecord.Data.CompletionTime = recordList->LogRecord.Data.OriginatingTime;
+    recordList->LogRecord.Data.Reserved[0] = 'A';
+    recordList->LogRecord.Data.Reserved[1] = SpyDeniedAccess( Data );
+
+    SpyLogPriority( recordList );
+}
@@ -0,0 +1,361 @@
+﻿/*++
+
+Module Name:
+
+    mspyQuota.c
+
+Abstract:
+
+    This module sizes MaxRecordsToAllocate at run time instead of leaving
+    it at the value read from the registry.
+
+    Every SPY_QUOTA_INTERVAL milliseconds a timer DPC looks at
+
+        - the drain rate, how many records user mode fetched since the
+          last tick (smoothed),
+        - the backlog age, how old the oldest record at the head of a
+          log queue is, and
+        - memory pressure, the state of the LowNonPagedPoolCondition event,
+
+    and moves the quota inside [QuotaFloor, QuotaCeiling]:
+
+        - under memory pressure it drops straight to the floor,
+        - if the backlog is older than SPY_QUOTA_MAX_BACKLOG_AGE the
+          consumer is not keeping up and more records would only queue, so
+          it shrinks by a quarter,
+        - if the quota is nearly used up while the consumer is keeping up
+          it grows by a quarter,
+        - otherwise it moves half way towards enough records to cover
+          SPY_QUOTA_HORIZON of draining, which hands idle memory back.
+
+    Setting the floor equal to the ceiling gives a fixed quota.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+//#include <dontuse.h>
+#include <suppress.h>
+
+#include "mspyKern.h"
+
+//
+//  Controller tuning, all times in milliseconds.
+//
+
+#define SPY_QUOTA_INTERVAL              250
+#define SPY_QUOTA_HORIZON               2000
+#define SPY_QUOTA_MAX_BACKLOG_AGE       2000
+
+KDEFERRED_ROUTINE SpyQuotaTimerDpc;
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, SpyQuotaInitialize)
+    #pragma alloc_text(PAGE, SpyQuotaShutdown)
+    #pragma alloc_text(PAGE, SpyQuotaSet)
+#endif
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+VOID
+SpyQuotaClamp (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Makes the bounds consistent and pulls the quota inside them.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (MiniSpyData.QuotaFloor <= 0) {
+
+        MiniSpyData.QuotaFloor = 1;
+    }
+
+    if (MiniSpyData.QuotaCeiling < MiniSpyData.QuotaFloor) {
+
+        MiniSpyData.QuotaCeiling = MiniSpyData.QuotaFloor;
+    }
+
+    if (MiniSpyData.MaxRecordsToAllocate < MiniSpyData.QuotaFloor) {
+
+        MiniSpyData.MaxRecordsToAllocate = MiniSpyData.QuotaFloor;
+
+    } else if (MiniSpyData.MaxRecordsToAllocate > MiniSpyData.QuotaCeiling) {
+
+        MiniSpyData.MaxRecordsToAllocate = MiniSpyData.QuotaCeiling;
+    }
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyQuotaInitialize (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Opens the low memory event and starts the controller.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UNICODE_STRING eventName;
+    LARGE_INTEGER dueTime;
+
+    PAGED_CODE();
+
+    SpyQuotaClamp();
+
+    MiniSpyData.RecordsDrained = 0;
+    MiniSpyData.QuotaLastDrained = 0;
+    MiniSpyData.DrainRate = 0;
+
+    RtlInitUnicodeString( &eventName, L"\\KernelObjects\\LowNonPagedPoolCondition" );
+
+    MiniSpyData.LowMemoryEvent = IoCreateNotificationEvent( &eventName,
+                                                            &MiniSpyData.LowMemoryEventHandle );
+
+    KeInitializeTimer( &MiniSpyData.QuotaTimer );
+    KeInitializeDpc( &MiniSpyData.QuotaDpc, SpyQuotaTimerDpc, NULL );
+
+    if (MiniSpyData.QuotaFloor == MiniSpyData.QuotaCeiling) {
+
+        return;
+    }
+
+    dueTime.QuadPart = -10000 * (LONGLONG)SPY_QUOTA_INTERVAL;
+
+    KeSetTimerEx( &MiniSpyData.QuotaTimer,
+                  dueTime,
+                  SPY_QUOTA_INTERVAL,
+                  &MiniSpyData.QuotaDpc );
+}
+
+
+VOID
+SpyQuotaShutdown (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Stops the controller and closes the low memory event.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    KeCancelTimer( &MiniSpyData.QuotaTimer );
+    KeFlushQueuedDpcs();
+
+    if (MiniSpyData.LowMemoryEventHandle != NULL) {
+
+        ZwClose( MiniSpyData.LowMemoryEventHandle );
+        MiniSpyData.LowMemoryEventHandle = NULL;
+        MiniSpyData.LowMemoryEvent = NULL;
+    }
+}
+
+
+NTSTATUS
+SpyQuotaSet (
+    __in LONG Floor,
+    __in LONG Ceiling
+    )
+/*++
+
+Routine Description:
+
+    Changes the quota bounds at run time.  The controller is started or
+    stopped depending on whether the bounds leave it any room.
+
+Arguments:
+
+    Floor - Smallest quota, must be at least 1.
+
+    Ceiling - Largest quota, must be at least Floor.
+
+Return Value:
+
+    STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+
+--*/
+{
+    LARGE_INTEGER dueTime;
+
+    PAGED_CODE();
+
+    if (Floor <= 0 || Ceiling < Floor) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeCancelTimer( &MiniSpyData.QuotaTimer );
+    KeFlushQueuedDpcs();
+
+    MiniSpyData.QuotaFloor = Floor;
+    MiniSpyData.QuotaCeiling = Ceiling;
+    SpyQuotaClamp();
+
+    if (Floor != Ceiling) {
+
+        dueTime.QuadPart = -10000 * (LONGLONG)SPY_QUOTA_INTERVAL;
+
+        KeSetTimerEx( &MiniSpyData.QuotaTimer,
+                      dueTime,
+                      SPY_QUOTA_INTERVAL,
+                      &MiniSpyData.QuotaDpc );
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+SpyQuotaTimerDpc (
+    __in struct _KDPC *Dpc,
+    __in_opt PVOID DeferredContext,
+    __in_opt PVOID SystemArgument1,
+    __in_opt PVOID SystemArgument2
+    )
+/*++
+
+Routine Description:
+
+    One step of the controller, see the module description.
+
+Arguments:
+
+    Unused.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_LOG_QUEUE queue;
+    PRECORD_LIST oldest;
+    LARGE_INTEGER now;
+    LONGLONG backlogAge = 0;
+    LONGLONG age;
+    ULONG i;
+    LONG drained;
+    LONG rate;
+    LONG quota;
+    LONG target;
+
+    UNREFERENCED_PARAMETER( Dpc );
+    UNREFERENCED_PARAMETER( DeferredContext );
+    UNREFERENCED_PARAMETER( SystemArgument1 );
+    UNREFERENCED_PARAMETER( SystemArgument2 );
+
+    //
+    //  Drain rate in records per second, smoothed over a few ticks.
+    //
+
+    drained = MiniSpyData.RecordsDrained;
+    rate = (drained - MiniSpyData.QuotaLastDrained) * (1000 / SPY_QUOTA_INTERVAL);
+    MiniSpyData.QuotaLastDrained = drained;
+    MiniSpyData.DrainRate = (MiniSpyData.DrainRate * 3 + rate) / 4;
+
+    //
+    //  Age of the oldest record still waiting for user mode.
+    //
+
+    KeQuerySystemTime( &now );
+
+    for (i = 0; i < LOG_QUEUES; i++) {
+
+        queue = &MiniSpyData.LogQueues[i];
+
+        if (IsListEmpty( &queue->List )) {
+
+            continue;
+        }
+
+        KeAcquireSpinLockAtDpcLevel( &queue->Lock );
+
+        if (!IsListEmpty( &queue->List )) {
+
+            oldest = CONTAINING_RECORD( queue->List.Flink, RECORD_LIST, List );
+            age = (now.QuadPart - oldest->LogRecord.Data.OriginatingTime.QuadPart) / 10000;
+
+            if (age > backlogAge) {
+
+                backlogAge = age;
+            }
+        }
+
+        KeReleaseSpinLockFromDpcLevel( &queue->Lock );
+    }
+
+    quota = MiniSpyData.MaxRecordsToAllocate;
+
+    if (MiniSpyData.LowMemoryEvent != NULL &&
+        KeReadStateEvent( MiniSpyData.LowMemoryEvent )) {
+
+        quota = MiniSpyData.QuotaFloor;
+
+    } else if (backlogAge > SPY_QUOTA_MAX_BACKLOG_AGE) {
+
+        quota -= quota / 4;
+
+    } else if (MiniSpyData.RecordsAllocated >= quota - quota / 8) {
+
+        quota += quota / 4 + 1;
+
+    } else {
+
+        target = (LONG)(((LONGLONG)MiniSpyData.DrainRate * SPY_QUOTA_HORIZON) / 1000);
+        quota = (quota + target) / 2;
+    }
+
+    if (quota < MiniSpyData.QuotaFloor) {
+
+        quota = MiniSpyData.QuotaFloor;
+
+    } else if (quota > MiniSpyData.QuotaCeiling) {
+
+        quota = MiniSpyData.QuotaCeiling;
+    }
+
+    MiniSpyData.MaxRecordsToAllocate = quota;
+}
@@ -0,0 +1,848 @@
+﻿/*++
+
+Module Name:
+
+    mspyReader.c
+
+Abstract:
+
+    This module lets several consumers read the log at once.
+
+    Every connection to the server port is a reader with a slot in
+    MiniSpyData.Readers.  A record is queued once, whoever wants it, and
+    carries in RECORD_LIST.Readers the bit of every reader still to be
+    sent it:
+
+        - the bits are worked out from the readers' subscriptions before
+          the record is built and are cut down to the connected readers
+          when it is queued (SpyReaderClaim),
+        - each reader keeps a cursor of its own in every lane and skips
+          the records that do not carry its bit; sending a record clears
+          the bit (see SpyGetLog),
+        - a record is freed once it reaches the head of its lane with no
+          bit left (SpyReaderTrim).
+
+    Each reader numbers the records it is sent in sequences of its own, so
+    what it sees has the same shape as when it was the only consumer: a
+    record another reader wants leaves no hole, and a gap record accounts
+    for every number it did lose.
+
+    A reader that falls behind holds on to records the others are done
+    with.  When the record quota runs out with more than one reader
+    connected, the reader with the most records pending is made to give up
+    its oldest ones (SpyReaderEvict).  They are lost to that reader only,
+    which is told so with a LOSS_LAGGING gap record.  The priority lane is
+    never evicted.
+
+    Records queued while nobody is connected are marked
+    SPY_READER_UNCLAIMED and go to the first reader to come along.
+
+    A consumer that connects with a SubscriberId acknowledges what it has
+    processed (SpyReaderAcknowledge).  Sending it a record swaps its bit
+    for its RETAIN bit, which keeps the record queued until acknowledged.
+    When such a consumer disconnects its slot is only Detached: its bit
+    stays in ReaderMask, so records keep being queued for it, and a
+    connection with the same SubscriberId takes the slot over, is sent the
+    retained records again and carries on.  Acknowledging readers are
+    never made to give up records; a detached one is let go instead when
+    room has to be made.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+//#include <dontuse.h>
+#include <suppress.h>
+#include <Ntstrsafe.h>
+
+#include "mspyKern.h"
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, SpyReaderInitialize)
+    #pragma alloc_text(PAGE, SpyReaderFormatStats)
+#endif
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+SpyReaderInitialize (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Starts out with every reader slot free.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    KeInitializeSpinLock( &MiniSpyData.ReaderLock );
+    RtlZeroMemory( MiniSpyData.Readers, sizeof( MiniSpyData.Readers ) );
+
+    for (i = 0; i < SPY_MAX_READERS; i++) {
+
+        MiniSpyData.Readers[i].Bit = 1 << i;
+    }
+
+    MiniSpyData.ReaderMask = 0;
+}
+
+
+PSPY_READER
+SpyReaderConnect (
+    __in PFLT_PORT ClientPort,
+    __in ULONG SubscriberId
+    )
+/*++
+
+Routine Description:
+
+    Gives a new connection a reader slot: the detached slot of the same
+    subscriber if there is one, else a free one.
+
+    NOTE:  This code must be NON-PAGED because it uses a spin-lock.
+
+Arguments:
+
+    ClientPort - The connection's port.
+
+    SubscriberId - The consumer's durable id, 0 if it does not
+        acknowledge records.
+
+Return Value:
+
+    The reader, or NULL if every slot is taken.
+
+--*/
+{
+    PSPY_READER reader = NULL;
+    PRECORD_LIST recordList;
+    PLIST_ENTRY lane;
+    PLIST_ENTRY entry;
+    PKSPIN_LOCK lock;
+    KIRQL oldIrql;
+    BOOLEAN resume = FALSE;
+    ULONG i;
+
+    KeAcquireSpinLock( &MiniSpyData.ReaderLock, &oldIrql );
+
+    for (i = 0; SubscriberId != 0 && i < SPY_MAX_READERS; i++) {
+
+        if (MiniSpyData.Readers[i].State == SpyReaderDetached &&
+            MiniSpyData.Readers[i].SubscriberId == SubscriberId) {
+
+            reader = &MiniSpyData.Readers[i];
+            resume = TRUE;
+            break;
+        }
+    }
+
+    for (i = 0; reader == NULL && i < SPY_MAX_READERS; i++) {
+
+        if (MiniSpyData.Readers[i].State == SpyReaderUnused) {
+
+            reader = &MiniSpyData.Readers[i];
+        }
+    }
+
+    if (reader != NULL) {
+
+        reader->State = SpyReaderConnected;
+        reader->ClientPort = ClientPort;
+    }
+
+    KeReleaseSpinLock( &MiniSpyData.ReaderLock, oldIrql );
+
+    if (reader == NULL) {
+
+        return NULL;
+    }
+
+    if (resume) {
+
+        //
+        //  Everything sent and not acknowledged is to be sent again, from
+        //  the head of every lane and numbered from the last number
+        //  acknowledged.
+        //
+
+        for (i = 0; i < SPY_READER_LANES; i++) {
+
+            lane = SpyReaderLane( i, &lock );
+
+            KeAcquireSpinLock( lock, &oldIrql );
+
+            for (entry = lane->Flink; entry != lane; entry = entry->Flink) {
+
+                recordList = CONTAINING_RECORD( entry, RECORD_LIST, List );
+
+                if (FlagOn( recordList->Readers, SPY_READER_RETAIN( reader->Bit ) )) {
+
+                    ClearFlag( recordList->Readers, SPY_READER_RETAIN( reader->Bit ) );
+                    SetFlag( recordList->Readers, reader->Bit );
+                    InterlockedIncrement( &reader->Pending );
+                }
+            }
+
+            reader->Position[i] = lane;
+            reader->Sequence[i] = reader->Acked[i];
+
+            KeReleaseSpinLock( lock, oldIrql );
+        }
+
+        reader->Retained = 0;
+        reader->NextLogQueue = 0;
+
+        return reader;
+    }
+
+    //
+    //  Start at the head of every lane, so the records queued while
+    //  nobody was connected are picked up.  Nothing queued carries the
+    //  reader's bit yet.
+    //
+
+    for (i = 0; i < SPY_READER_LANES; i++) {
+
+        lane = SpyReaderLane( i, &lock );
+
+        KeAcquireSpinLock( lock, &oldIrql );
+        reader->Position[i] = lane;
+        reader->Sequence[i] = 0;
+        reader->Acked[i] = 0;
+        KeReleaseSpinLock( lock, oldIrql );
+    }
+
+    RtlZeroMemory( reader->Dropped, sizeof( reader->Dropped ) );
+    reader->SubscriberId = SubscriberId;
+    reader->NextLogQueue = 0;
+    reader->Pending = 0;
+    reader->Retained = 0;
+    reader->Delivered = 0;
+    reader->Lagged = 0;
+
+    InterlockedOr( &MiniSpyData.ReaderMask, reader->Bit );
+
+    return reader;
+}
+
+
+static
+BOOLEAN
+SpyReaderRelease (
+    __inout PSPY_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Takes a reader that is Closing out of every queued record, frees the
+    records nobody else wants and frees its slot.
+
+    NOTE:  This code must be NON-PAGED because it can be called at DPC
+           level.
+
+Arguments:
+
+    Reader - The reader being let go.
+
+Return Value:
+
+    TRUE if any record was freed.
+
+--*/
+{
+    LIST_ENTRY freeList;
+    PLIST_ENTRY lane;
+    PLIST_ENTRY entry;
+    PKSPIN_LOCK lock;
+    KIRQL oldIrql;
+    BOOLEAN freed;
+    ULONG i;
+
+    ASSERT( Reader->State == SpyReaderClosing );
+
+    //
+    //  Records queued from now on no longer get the reader's bit, see
+    //  SpyReaderClaim.  Those already queued have it cleared here.
+    //
+
+    InterlockedAnd( &MiniSpyData.ReaderMask, ~(LONG)Reader->Bit );
+
+    InitializeListHead( &freeList );
+
+    for (i = 0; i < SPY_READER_LANES; i++) {
+
+        lane = SpyReaderLane( i, &lock );
+
+        KeAcquireSpinLock( lock, &oldIrql );
+
+        for (entry = lane->Flink; entry != lane; entry = entry->Flink) {
+
+            ClearFlag( CONTAINING_RECORD( entry, RECORD_LIST, List )->Readers,
+                       Reader->Bit | SPY_READER_RETAIN( Reader->Bit ) );
+        }
+
+        SpyReaderTrim( i, &freeList );
+        Reader->Position[i] = lane;
+
+        KeReleaseSpinLock( lock, oldIrql );
+    }
+
+    freed = (BOOLEAN)!IsListEmpty( &freeList );
+    SpyReaderFree( &freeList );
+
+    Reader->Pending = 0;
+    Reader->Retained = 0;
+    Reader->SubscriberId = 0;
+
+    SpySubscribeClear( Reader );
+
+    KeAcquireSpinLock( &MiniSpyData.ReaderLock, &oldIrql );
+    Reader->State = SpyReaderUnused;
+    KeReleaseSpinLock( &MiniSpyData.ReaderLock, oldIrql );
+
+    return freed;
+}
+
+
+VOID
+SpyReaderDisconnect (
+    __inout PSPY_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Closes a reader's connection.  An acknowledging reader is detached and
+    its records are kept for it; any other is let go.
+
+    NOTE:  This code must be NON-PAGED because it uses a spin-lock.
+
+Arguments:
+
+    Reader - The reader going away.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    BOOLEAN detach = (BOOLEAN)(Reader->SubscriberId != 0);
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock( &MiniSpyData.ReaderLock, &oldIrql );
+    Reader->State = detach ? SpyReaderDetached : SpyReaderClosing;
+    KeReleaseSpinLock( &MiniSpyData.ReaderLock, oldIrql );
+
+    FltCloseClientPort( MiniSpyData.Filter, &Reader->ClientPort );
+
+    if (!detach) {
+
+        SpyReaderRelease( Reader );
+    }
+}
+
+
+PLIST_ENTRY
+SpyReaderLane (
+    __in ULONG Lane,
+    __deref_out PKSPIN_LOCK *Lock
+    )
+/*++
+
+Routine Description:
+
+    Looks up a lane's list and lock.
+
+Arguments:
+
+    Lane - A processor queue, or SPY_PRIORITY_LANE.
+
+    Lock - Receives the lock that protects the list.
+
+Return Value:
+
+    The list.
+
+--*/
+{
+    ASSERT( Lane < SPY_READER_LANES );
+
+    if (Lane == SPY_PRIORITY_LANE) {
+
+        *Lock = &MiniSpyData.OutputBufferLock;
+        return &MiniSpyData.PriorityList;
+    }
+
+    *Lock = &MiniSpyData.LogQueues[Lane].Lock;
+    return &MiniSpyData.LogQueues[Lane].List;
+}
+
+
+BOOLEAN
+SpyReaderClaim (
+    __inout PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    Cuts a record's readers down to those connected, as it is queued.
+    Must be called with the lock of the lane it is queued on held, so
+    that a reader disconnecting either sees the record or is not in it.
+
+    NOTE:  This code must be NON-PAGED because it is called at DPC level.
+
+Arguments:
+
+    RecordList - The record being queued.
+
+Return Value:
+
+    FALSE if no connected reader wants the record.
+
+--*/
+{
+    ULONG mask = (ULONG)MiniSpyData.ReaderMask;
+    ULONG readers;
+    ULONG i;
+
+    if (mask == 0) {
+
+        RecordList->Readers = SPY_READER_UNCLAIMED;
+        return TRUE;
+    }
+
+    readers = RecordList->Readers & mask;
+    RecordList->Readers = readers;
+
+    for (i = 0; i < SPY_MAX_READERS; i++) {
+
+        if (FlagOn( readers, MiniSpyData.Readers[i].Bit )) {
+
+            InterlockedIncrement( &MiniSpyData.Readers[i].Pending );
+        }
+    }
+
+    return (BOOLEAN)(readers != 0);
+}
+
+
+ULONG
+SpyReaderTrim (
+    __in ULONG Lane,
+    __inout PLIST_ENTRY FreeList
+    )
+/*++
+
+Routine Description:
+
+    Takes the records at the head of a lane that no reader wants any more
+    off it.  Must be called with the lane's lock held; the records are
+    moved to FreeList for SpyReaderFree to free once it is dropped.
+
+    NOTE:  This code must be NON-PAGED because it is called at DPC level.
+
+Arguments:
+
+    Lane - The lane.
+
+    FreeList - Receives the records.
+
+Return Value:
+
+    The number of records taken off.
+
+--*/
+{
+    PLIST_ENTRY lane;
+    PLIST_ENTRY entry;
+    PKSPIN_LOCK lock;
+    ULONG count = 0;
+    ULONG i;
+
+    lane = SpyReaderLane( Lane, &lock );
+
+    while (!IsListEmpty( lane )) {
+
+        entry = lane->Flink;
+
+        if (FlagOn( CONTAINING_RECORD( entry, RECORD_LIST, List )->Readers, SPY_READER_KEEP )) {
+
+            break;
+        }
+
+        RemoveHeadList( lane );
+
+        //
+        //  A reader that was past this record is past everything before
+        //  it too, so it carries on from the head.
+        //
+
+        for (i = 0; i < SPY_MAX_READERS; i++) {
+
+            if (MiniSpyData.Readers[i].Position[Lane] == entry) {
+
+                MiniSpyData.Readers[i].Position[Lane] = lane;
+            }
+        }
+
+        InsertTailList( FreeList, entry );
+        count++;
+    }
+
+    return count;
+}
+
+
+VOID
+SpyReaderFree (
+    __inout PLIST_ENTRY FreeList
+    )
+/*++
+
+Routine Description:
+
+    Frees the records SpyReaderTrim took off the lanes.
+
+    NOTE:  This code must be NON-PAGED because it can be called at DPC
+           level.
+
+Arguments:
+
+    FreeList - The records.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    while (!IsListEmpty( FreeList )) {
+
+        SpyFreeRecord( CONTAINING_RECORD( RemoveHeadList( FreeList ), RECORD_LIST, List ) );
+    }
+}
+
+
+VOID
+SpyReaderAcknowledge (
+    __inout PSPY_READER Reader,
+    __in PMINISPY_ACK Ack
+    )
+/*++
+
+Routine Description:
+
+    Lets go of the records an acknowledging reader has processed: on each
+    lane, the retained records numbered up to the sequence number it
+    acknowledged.  Retained records are walked in the order they were
+    sent, so their numbers are worked out again from the last number
+    acknowledged.
+
+    NOTE:  This code must be NON-PAGED because it uses a spin-lock.
+
+Arguments:
+
+    Reader - The reader.
+
+    Ack - The last sequence number the consumer processed on each lane.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_LIST recordList;
+    LIST_ENTRY freeList;
+    PLIST_ENTRY lane;
+    PLIST_ENTRY entry;
+    PKSPIN_LOCK lock;
+    ULONG retain = SPY_READER_RETAIN( Reader->Bit );
+    ULONG acked;
+    ULONG next;
+    LONG released;
+    KIRQL oldIrql;
+    ULONG i;
+
+    if (Reader->SubscriberId == 0) {
+
+        return;
+    }
+
+    InitializeListHead( &freeList );
+
+    for (i = 0; i < SPY_READER_LANES; i++) {
+
+        if ((LONG)(Ack->Sequence[i] - Reader->Acked[i]) <= 0) {
+
+            continue;
+        }
+
+        lane = SpyReaderLane( i, &lock );
+        released = 0;
+
+        KeAcquireSpinLock( lock, &oldIrql );
+
+        acked = Reader->Acked[i];
+
+        for (entry = lane->Flink; entry != lane; entry = entry->Flink) {
+
+            recordList = CONTAINING_RECORD( entry, RECORD_LIST, List );
+
+            if (!FlagOn( recordList->Readers, retain )) {
+
+                continue;
+            }
+
+            next = acked + SPY_RECORD_NUMBERS( recordList );
+
+            if ((LONG)(next - Ack->Sequence[i]) > 0) {
+
+                break;
+            }
+
+            ClearFlag( recordList->Readers, retain );
+            acked = next;
+            released++;
+        }
+
+        Reader->Acked[i] = acked;
+        InterlockedExchangeAdd( &MiniSpyData.RecordsDrained, SpyReaderTrim( i, &freeList ) );
+
+        KeReleaseSpinLock( lock, oldIrql );
+
+        InterlockedExchangeAdd( &Reader->Retained, -released );
+    }
+
+    SpyReaderFree( &freeList );
+}
+
+
+BOOLEAN
+SpyReaderEvict (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Makes room when the record quota has run out.  A detached reader is
+    let go first.  Failing that, up to SPY_READER_EVICT_BATCH of the
+    oldest records of each queue are taken away from the reader with the
+    most records pending, among those that do not acknowledge.  Nothing
+    is taken while only one reader is connected: losing the new record
+    instead costs it the same.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    TRUE if any record was freed.
+
+--*/
+{
+    PSPY_READER reader = NULL;
+    PSPY_LOG_QUEUE queue;
+    PRECORD_LIST recordList;
+    PLIST_ENTRY entry;
+    LIST_ENTRY freeList;
+    ULONG mask = (ULONG)MiniSpyData.ReaderMask;
+    LONG most = SPY_READER_EVICT_BATCH;
+    ULONG taken;
+    ULONG dropped;
+    ULONG i;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock( &MiniSpyData.ReaderLock, &oldIrql );
+
+    for (i = 0; i < SPY_MAX_READERS; i++) {
+
+        if (MiniSpyData.Readers[i].State == SpyReaderDetached) {
+
+            reader = &MiniSpyData.Readers[i];
+            reader->State = SpyReaderClosing;
+            break;
+        }
+    }
+
+    KeReleaseSpinLock( &MiniSpyData.ReaderLock, oldIrql );
+
+    if (reader != NULL) {
+
+        return SpyReaderRelease( reader );
+    }
+
+    if ((mask & (mask - 1)) == 0) {
+
+        return FALSE;
+    }
+
+    for (i = 0; i < SPY_MAX_READERS; i++) {
+
+        if (FlagOn( mask, MiniSpyData.Readers[i].Bit ) &&
+            MiniSpyData.Readers[i].SubscriberId == 0 &&
+            MiniSpyData.Readers[i].Pending > most) {
+
+            reader = &MiniSpyData.Readers[i];
+            most = reader->Pending;
+        }
+    }
+
+    if (reader == NULL) {
+
+        return FALSE;
+    }
+
+    InitializeListHead( &freeList );
+
+    for (i = 0; i < LOG_QUEUES; i++) {
+
+        queue = &MiniSpyData.LogQueues[i];
+
+        if (IsListEmpty( &queue->List )) {
+
+            continue;
+        }
+
+        taken = 0;
+        dropped = 0;
+
+        KeAcquireSpinLock( &queue->Lock, &oldIrql );
+
+        for (entry = reader->Position[i]->Flink;
+             entry != &queue->List && taken < SPY_READER_EVICT_BATCH;
+             entry = entry->Flink) {
+
+            recordList = CONTAINING_RECORD( entry, RECORD_LIST, List );
+
+            //
+            //  A gap record taken away is not a record lost itself, but
+            //  the records it accounts for are.
+            //
+
+            if (FlagOn( recordList->Readers, reader->Bit )) {
+
+                ClearFlag( recordList->Readers, reader->Bit );
+                dropped += FlagOn( recordList->LogRecord.RecordType, RECORD_TYPE_GAP ) ?
+                                ((PRECORD_GAP)recordList->LogRecord.Name)->Count :
+                                1;
+                taken++;
+            }
+        }
+
+        reader->Dropped[i] += dropped;
+        SpyReaderTrim( i, &freeList );
+
+        KeReleaseSpinLock( &queue->Lock, oldIrql );
+
+        InterlockedExchangeAdd( &reader->Pending, -(LONG)taken );
+        InterlockedExchangeAdd( &reader->Lagged, taken );
+    }
+
+    if (IsListEmpty( &freeList )) {
+
+        return FALSE;
+    }
+
+    SpyReaderFree( &freeList );
+
+    return TRUE;
+}
+
+
+VOID
+SpyReaderFormatStats (
+    __out_bcount(BufferSize) PWCHAR Buffer,
+    __in size_t BufferSize
+    )
+/*++
+
+Routine Description:
+
+    Describes each connected reader's backlog and losses in text.
+
+Arguments:
+
+    Buffer - Receives the NULL terminated text.
+
+    BufferSize - Size of Buffer in bytes.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_READER reader;
+    PWCHAR end = Buffer;
+    size_t remaining = BufferSize;
+    ULONG mask = (ULONG)MiniSpyData.ReaderMask;
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (BufferSize >= sizeof( WCHAR )) {
+
+        *Buffer = UNICODE_NULL;
+    }
+
+    for (i = 0; i < SPY_MAX_READERS; i++) {
+
+        reader = &MiniSpyData.Readers[i];
+
+        if (!FlagOn( mask, reader->Bit )) {
+
+            continue;
+        }
+
+        RtlStringCbPrintfExW( end,
+                              remaining,
+                              &end,
+                              &remaining,
+                              0,
+                              L"; reader %lu%s: %ld pending, %ld sent, %ld lagged",
+                              i,
+                              (reader->State == SpyReaderDetached) ? L" (detached)" : L"",
+                              reader->Pending,
+                              reader->Delivered,
+                              reader->Lagged );
+
+        if (reader->SubscriberId != 0) {
+
+            RtlStringCbPrintfExW( end,
+                                  remaining,
+                                  &end,
+                                  &remaining,
+                                  0,
+                                  L", subscriber %lu with %ld unacknowledged",
+                                  reader->SubscriberId,
+                                  reader->Retained );
+        }
+    }
+}
@@ -0,0 +1,279 @@
+﻿/*++
+
+Module Name:
+
+    mspySample.c
+
+Abstract:
+
+    This module keeps a single process from using up the record quota.
+
+    The number of operations each process issues in the current window is
+    tracked with a Space-Saving heavy-hitter table of SPY_SAMPLE_ENTRIES
+    counters.  A tracked counter is exact from the moment its process was
+    inserted; Error holds the count it inherited from the entry it evicted,
+    so Count - Error is a guaranteed lower bound on the process's real
+    count.  Only that lower bound is compared against the budget, which
+    means a process is never throttled on an over-estimate.
+
+    Once a process is over budget only every ProcessSampleRate'th
+    operation is logged (none if the rate is 0).  At the end of the window,
+    or when its counter is evicted, a RECORD_TYPE_SUMMARY record is sent
+    up with the exact number of operations seen and suppressed.
+
+    Windows are rolled lazily by the next operation to arrive, so the
+    summary for a process that has gone quiet is sent when any process
+    next does I/O.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+//#include <dontuse.h>
+#include <suppress.h>
+
+#include "mspyKern.h"
+#include "Process.h"
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+VOID
+SpySampleSummary (
+    __in PSPY_SAMPLE_ENTRY Entry,
+    __in PLARGE_INTEGER WindowStart,
+    __in PLARGE_INTEGER WindowEnd
+    )
+/*++
+
+Routine Description:
+
+    Logs a RECORD_TYPE_SUMMARY record for a throttled process.
+
+    NOTE:  Must not be called with the sample lock held.
+
+Arguments:
+
+    Entry - Snapshot of the process's counter.
+
+    WindowStart - When counting started for this process.
+
+    WindowEnd - When counting stopped.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_LIST recordList;
+    PRECORD_DATA recordData;
+    PUNICODE_STRING processImageName;
+    WCHAR strBuffer[(sizeof(UNICODE_STRING) + MAX_PATH*2)/sizeof(WCHAR)];
+
+    processImageName = (PUNICODE_STRING)strBuffer;
+    processImageName->MaximumLength = sizeof(UNICODE_STRING) + MAX_PATH*2;
+    processImageName->Length = 0;
+
+    if (KeGetCurrentIrql() == PASSIVE_LEVEL) {
+
+        GetProcessImageName( (HANDLE)Entry->ProcessId, processImageName );
+    }
+
+    recordList = SpyNewRecord( (UCHAR)IRP_MJ_OPERATION_END,
+                               SPY_NAME_SPACE( processImageName->Length ) );
+
+    if (recordList == NULL) {
+
+        return;
+    }
+
+    recordList->LogRecord.RecordType |= RECORD_TYPE_SUMMARY;
+
+    recordData = &recordList->LogRecord.Data;
+    recordData->ProcessId = Entry->ProcessId;
+    recordData->OriginatingTime = *WindowStart;
+    recordData->CompletionTime = *WindowEnd;
+    recordData->Aggregate.Count = Entry->Count - Entry->Error;
+    recordData->Aggregate.Suppressed = Entry->Suppressed;
+
+    SpySetRecordName( &recordList->LogRecord, processImageName );
+
+    SpyLog( recordList );
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+SpySampleInitialize (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Clears the heavy-hitter table and starts the first window.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    KeInitializeSpinLock( &MiniSpyData.SampleLock );
+    RtlZeroMemory( MiniSpyData.SampleEntries, sizeof( MiniSpyData.SampleEntries ) );
+
+    if (MiniSpyData.SampleWindow <= 0) {
+
+        MiniSpyData.SampleWindow = DEFAULT_PROCESS_SAMPLE_WINDOW;
+    }
+
+    KeQuerySystemTime( &MiniSpyData.SampleWindowStart );
+}
+
+
+BOOLEAN
+SpySampleOperation (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Counts an operation against the current process and decides whether it
+    should be logged.  Called before a record is allocated so that
+    suppressed operations cost no record at all.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    TRUE if the operation should be logged.
+
+--*/
+{
+    SPY_SAMPLE_ENTRY summaries[SPY_SAMPLE_ENTRIES + 1];
+    PSPY_SAMPLE_ENTRY entry = NULL;
+    PSPY_SAMPLE_ENTRY minEntry;
+    LARGE_INTEGER windowStart;
+    LARGE_INTEGER now;
+    FILE_ID processId;
+    ULONG summaryCount = 0;
+    ULONG exact;
+    ULONG i;
+    LONG budget = MiniSpyData.ProcessBudget;
+    LONG rate = MiniSpyData.ProcessSampleRate;
+    BOOLEAN logIt = TRUE;
+    KIRQL oldIrql;
+
+    if (budget <= 0) {
+
+        return TRUE;
+    }
+
+    processId = (FILE_ID)PsGetCurrentProcessId();
+    KeQuerySystemTime( &now );
+
+    KeAcquireSpinLock( &MiniSpyData.SampleLock, &oldIrql );
+
+    windowStart = MiniSpyData.SampleWindowStart;
+
+    //
+    //  Roll the window: report every process that had operations
+    //  suppressed and start counting from zero.
+    //
+
+    if (now.QuadPart - windowStart.QuadPart >= 10000 * (LONGLONG)MiniSpyData.SampleWindow) {
+
+        for (i = 0; i < SPY_SAMPLE_ENTRIES; i++) {
+
+            if (MiniSpyData.SampleEntries[i].Suppressed != 0) {
+
+                summaries[summaryCount++] = MiniSpyData.SampleEntries[i];
+            }
+        }
+
+        RtlZeroMemory( MiniSpyData.SampleEntries, sizeof( MiniSpyData.SampleEntries ) );
+        MiniSpyData.SampleWindowStart = now;
+    }
+
+    //
+    //  Find the process's counter, remembering the smallest one in case
+    //  it has none.
+    //
+
+    minEntry = &MiniSpyData.SampleEntries[0];
+
+    for (i = 0; i < SPY_SAMPLE_ENTRIES; i++) {
+
+        if (MiniSpyData.SampleEntries[i].Count != 0 &&
+            MiniSpyData.SampleEntries[i].ProcessId == processId) {
+
+            entry = &MiniSpyData.SampleEntries[i];
+            break;
+        }
+
+        if (MiniSpyData.SampleEntries[i].Count < minEntry->Count) {
+
+            minEntry = &MiniSpyData.SampleEntries[i];
+        }
+    }
+
+    if (entry == NULL) {
+
+        //
+        //  Take over the smallest counter.  Its count becomes our error
+        //  bound; if it was throttling a process, report that process now
+        //  so its numbers stay exact.
+        //
+
+        entry = minEntry;
+
+        if (entry->Suppressed != 0) {
+
+            summaries[summaryCount++] = *entry;
+        }
+
+        entry->ProcessId = processId;
+        entry->Error = entry->Count;
+        entry->Suppressed = 0;
+    }
+
+    entry->Count++;
+
+    exact = entry->Count - entry->Error;
+
+    if (exact > (ULONG)budget) {
+
+        if (rate <= 0 || ((exact - (ULONG)budget) % (ULONG)rate) != 0) {
+
+            entry->Suppressed++;
+            logIt = FALSE;
+        }
+    }
+
+    KeReleaseSpinLock( &MiniSpyData.SampleLock, oldIrql );
+
+    for (i = 0; i < summaryCount; i++) {
+
+        SpySampleSummary( &summaries[i], &windowStart, &now );
+    }
+
+    return logIt;
+}
@@ -0,0 +1,869 @@
+﻿/*++
+
+Module Name:
+
+    mspySubscribe.c
+
+Abstract:
+
+    This module decides, before a record is built, which readers want it.
+
+    Each reader uploads a SUBSCRIPTION with SetMiniSpySubscription.  It is
+    compiled into a SPY_SUBSCRIPTION that is checked in three steps, each
+    as early as the information it needs is known:
+
+        - SpySubscribeOperation, before the file name is queried, checks
+          the major function and the access types the operation can end
+          up with,
+        - SpySubscribeMatch, once the name and the process are known and
+          before the record is allocated, checks the path prefixes and the
+          process names,
+        - SpySubscribeDisposition, on completion, checks the access type
+          actually logged, which only then tells a delete from a delete
+          pending.
+
+    Every step narrows down a mask of reader bits, which ends up in
+    RECORD_LIST.Readers.  A reader without a subscription keeps its bit
+    throughout, and the record is only built while some bit is left.
+
+    A reader's subscription is reference counted so that it can be
+    replaced while operations are being checked against it.  While no
+    reader has a subscription the checks return at once without taking
+    the lock.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+//#include <dontuse.h>
+#include <suppress.h>
+#include <Ntstrsafe.h>
+
+#include "mspyKern.h"
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, SpySubscribeInitialize)
+    #pragma alloc_text(PAGE, SpySubscribeShutdown)
+    #pragma alloc_text(PAGE, SpySubscribeSet)
+    #pragma alloc_text(PAGE, SpySubscribeFormat)
+#endif
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+PSPY_SUBSCRIPTION
+SpySubscribeReference (
+    __in PSPY_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Takes a reference on a reader's subscription.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Reader - The reader.
+
+Return Value:
+
+    The subscription, or NULL if the reader wants every record.
+
+--*/
+{
+    PSPY_SUBSCRIPTION subscription;
+    KIRQL oldIrql;
+
+    if (Reader->Subscription == NULL) {
+
+        return NULL;
+    }
+
+    KeAcquireSpinLock( &MiniSpyData.ReaderLock, &oldIrql );
+
+    subscription = Reader->Subscription;
+
+    if (subscription != NULL) {
+
+        InterlockedIncrement( &subscription->References );
+    }
+
+    KeReleaseSpinLock( &MiniSpyData.ReaderLock, oldIrql );
+
+    return subscription;
+}
+
+
+static
+VOID
+SpySubscribeDereference (
+    __in_opt PSPY_SUBSCRIPTION Subscription
+    )
+/*++
+
+Routine Description:
+
+    Drops a reference on a subscription and frees it with the last one.
+
+Arguments:
+
+    Subscription - The subscription, may be NULL.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Subscription != NULL &&
+        InterlockedDecrement( &Subscription->References ) == 0) {
+
+        ExFreePoolWithTag( Subscription, SPY_TAG );
+    }
+}
+
+
+static
+ULONG
+SpySubscribeDispositionBit (
+    __in UCHAR AccessType
+    )
+/*++
+
+Routine Description:
+
+    Maps an access type from RECORD_DATA.Reserved[0] to its
+    SUBSCRIBE_DISPOSITION_XXX bit.
+
+Arguments:
+
+    AccessType - The access type.
+
+Return Value:
+
+    The disposition bit.
+
+--*/
+{
+    switch (AccessType) {
+
+        case 'D':
+            return SUBSCRIBE_DISPOSITION_DELETE;
+
+        case 'd':
+            return SUBSCRIBE_DISPOSITION_DELETE_PENDING;
+
+        case 'R':
+            return SUBSCRIBE_DISPOSITION_RENAME;
+
+        case 'W':
+            return SUBSCRIBE_DISPOSITION_WRITE;
+
+        default:
+            return SUBSCRIBE_DISPOSITION_OTHER;
+    }
+}
+
+
+static
+ULONG
+SpySubscribeDispositions (
+    __in PFLT_CALLBACK_DATA Data
+    )
+/*++
+
+Routine Description:
+
+    Works out the access types an operation can be logged with, by the
+    same tests SpyLogPostOperationData applies on completion.  Only the
+    outcome of a disposition change is not known yet.
+
+Arguments:
+
+    Data - The operation.
+
+Return Value:
+
+    The SUBSCRIBE_DISPOSITION_XXX bits the operation may end up with.
+
+--*/
+{
+    if (Data->Iopb->Parameters.Create.Options & FILE_DELETE_ON_CLOSE) {
+
+        return SUBSCRIBE_DISPOSITION_DELETE;
+
+    } else if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileDispositionInformation) {
+
+        return SUBSCRIBE_DISPOSITION_DELETE | SUBSCRIBE_DISPOSITION_DELETE_PENDING;
+
+    } else if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileRenameInformation) {
+
+        return SUBSCRIBE_DISPOSITION_RENAME;
+
+    } else if (Data->Iopb->MajorFunction == IRP_MJ_WRITE) {
+
+        return SUBSCRIBE_DISPOSITION_WRITE;
+    }
+
+    return SUBSCRIBE_DISPOSITION_OTHER;
+}
+
+
+static
+BOOLEAN
+SpySubscribeEqual (
+    __in PUNICODE_STRING Upcased,
+    __in_ecount(Upcased->Length/sizeof(WCHAR)) PWCHAR Name
+    )
+/*++
+
+Routine Description:
+
+    Compares Upcased->Length bytes of Name with an upcased string,
+    without regard to case.
+
+Arguments:
+
+    Upcased - The subscription string.
+
+    Name - The characters to compare it with.
+
+Return Value:
+
+    TRUE if they are the same.
+
+--*/
+{
+    USHORT i;
+
+    for (i = 0; i < Upcased->Length / sizeof( WCHAR ); i++) {
+
+        if (Upcased->Buffer[i] != Name[i] &&
+            Upcased->Buffer[i] != RtlUpcaseUnicodeChar( Name[i] )) {
+
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+static
+BOOLEAN
+SpySubscribeWants (
+    __in PSPY_SUBSCRIPTION Subscription,
+    __in PUNICODE_STRING Name,
+    __in PSPY_IDENTITY Identity
+    )
+/*++
+
+Routine Description:
+
+    Checks an operation's file name and process against a subscription.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Subscription - The subscription.
+
+    Name - The normalized file name.
+
+    Identity - Who issued the operation.
+
+Return Value:
+
+    TRUE if the subscription wants a record of the operation.
+
+--*/
+{
+    PUNICODE_STRING image;
+    PUNICODE_STRING string;
+    UNICODE_STRING component;
+    BOOLEAN wanted = TRUE;
+    USHORT i;
+
+    //
+    //  The name must start with a prefix and carry on, if at all, with a
+    //  new path component.
+    //
+
+    if (Subscription->PrefixCount != 0) {
+
+        wanted = FALSE;
+
+        for (i = 0;
+             Name->Length >= Subscription->MinPrefixLength && i < Subscription->PrefixCount;
+             i++) {
+
+            string = &Subscription->Prefixes[i];
+
+            if (Name->Length >= string->Length &&
+                (Name->Length == string->Length ||
+                 string->Buffer[string->Length / sizeof( WCHAR ) - 1] == L'\\' ||
+                 Name->Buffer[string->Length / sizeof( WCHAR )] == L'\\') &&
+                SpySubscribeEqual( string, Name->Buffer )) {
+
+                wanted = TRUE;
+                break;
+            }
+        }
+    }
+
+    if (!wanted || Subscription->ProcessCount == 0) {
+
+        return wanted;
+    }
+
+    image = Identity->ProcessImageName;
+
+    //
+    //  The last component of the image name.
+    //
+
+    component.Buffer = image->Buffer + image->Length / sizeof( WCHAR );
+
+    while (component.Buffer > image->Buffer && component.Buffer[-1] != L'\\') {
+
+        component.Buffer--;
+    }
+
+    component.Length = (USHORT)(image->Length -
+                                (component.Buffer - image->Buffer) * sizeof( WCHAR ));
+
+    for (i = 0; i < Subscription->ProcessCount; i++) {
+
+        string = &Subscription->Processes[i];
+
+        if (string->Length == component.Length &&
+            SpySubscribeEqual( string, component.Buffer )) {
+
+            return TRUE;
+        }
+
+        if (string->Length == image->Length &&
+            SpySubscribeEqual( string, image->Buffer )) {
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+SpySubscribeInitialize (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Starts out with every reader wanting every record.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    for (i = 0; i < SPY_MAX_READERS; i++) {
+
+        MiniSpyData.Readers[i].Subscription = NULL;
+        MiniSpyData.Readers[i].Dispositions = SUBSCRIBE_DISPOSITION_ALL;
+    }
+
+    MiniSpyData.SubscribedReaders = 0;
+}
+
+
+VOID
+SpySubscribeShutdown (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Drops every reader's subscription.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    for (i = 0; i < SPY_MAX_READERS; i++) {
+
+        SpySubscribeClear( &MiniSpyData.Readers[i] );
+    }
+}
+
+
+VOID
+SpySubscribeClear (
+    __inout PSPY_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Drops a reader's subscription.  Operations still being checked
+    against it keep it until they are done.
+
+    NOTE:  This code must be NON-PAGED because it is called at DPC level
+           when a detached reader is let go.
+
+Arguments:
+
+    Reader - The reader.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_SUBSCRIPTION subscription;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock( &MiniSpyData.ReaderLock, &oldIrql );
+
+    subscription = Reader->Subscription;
+    Reader->Subscription = NULL;
+    Reader->Dispositions = SUBSCRIBE_DISPOSITION_ALL;
+    MiniSpyData.SubscribedReaders &= ~Reader->Bit;
+
+    KeReleaseSpinLock( &MiniSpyData.ReaderLock, oldIrql );
+
+    SpySubscribeDereference( subscription );
+}
+
+
+NTSTATUS
+SpySubscribeSet (
+    __inout PSPY_READER Reader,
+    __in_bcount(Length) PSUBSCRIPTION Subscription,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Compiles a subscription uploaded by a reader and puts it in force for
+    that reader.  A subscription that wants every operation and access
+    type and names no prefix or process puts the reader back to being
+    sent everything.
+
+Arguments:
+
+    Reader - The reader.
+
+    Subscription - A captured copy of the reader's SUBSCRIPTION.
+
+    Length - The size of Subscription in bytes.
+
+Return Value:
+
+    STATUS_SUCCESS, STATUS_INVALID_PARAMETER if the subscription is
+    malformed or STATUS_INSUFFICIENT_RESOURCES.
+
+--*/
+{
+    PSPY_SUBSCRIPTION compiled = NULL;
+    PSPY_SUBSCRIPTION previous;
+    UNICODE_STRING string;
+    PUNICODE_STRING strings;
+    PWCHAR next;
+    PWCHAR end;
+    ULONG count;
+    ULONG stringBytes = 0;
+    ULONG i;
+    BOOLEAN everything;
+    KIRQL oldIrql;
+
+    PAGED_CODE();
+
+    if (Length < FIELD_OFFSET( SUBSCRIPTION, Strings ) ||
+        FlagOn( Subscription->Dispositions, ~SUBSCRIBE_DISPOSITION_ALL )) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    count = (ULONG)Subscription->PrefixCount + Subscription->ProcessCount;
+
+    if (count > SUBSCRIBE_MAX_STRINGS) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    //  Every string must be NULL terminated within the buffer, not empty
+    //  and no longer than a UNICODE_STRING can hold.
+    //
+
+    next = Subscription->Strings;
+    end = (PWCHAR)Add2Ptr( Subscription, Length & ~(sizeof( WCHAR ) - 1) );
+
+    for (i = 0; i < count; i++) {
+
+        string.Buffer = next;
+
+        while (next < end && *next != UNICODE_NULL) {
+
+            next++;
+        }
+
+        if (next == end ||
+            next == string.Buffer ||
+            (ULONG)(next - string.Buffer) > MAXUSHORT / sizeof( WCHAR )) {
+
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        stringBytes += (ULONG)(next - string.Buffer) * sizeof( WCHAR );
+        next++;
+    }
+
+    everything = (BOOLEAN)(count == 0 &&
+                           Subscription->Dispositions == SUBSCRIBE_DISPOSITION_ALL);
+
+    for (i = 0; everything && i < SUBSCRIBE_OPERATION_WORDS; i++) {
+
+        everything = (BOOLEAN)(Subscription->Operations[i] == MAXULONG);
+    }
+
+    if (!everything) {
+
+        compiled = ExAllocatePoolWithTag( NonPagedPool,
+                                          sizeof( SPY_SUBSCRIPTION ) +
+                                              count * sizeof( UNICODE_STRING ) +
+                                              stringBytes,
+                                          SPY_TAG );
+
+        if (compiled == NULL) {
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        compiled->References = 1;
+        RtlCopyMemory( compiled->Operations,
+                       Subscription->Operations,
+                       sizeof( compiled->Operations ) );
+        compiled->Dispositions = Subscription->Dispositions;
+        compiled->PrefixCount = Subscription->PrefixCount;
+        compiled->ProcessCount = Subscription->ProcessCount;
+        compiled->MinPrefixLength = MAXUSHORT;
+
+        strings = (PUNICODE_STRING)(compiled + 1);
+        compiled->Prefixes = strings;
+        compiled->Processes = strings + compiled->PrefixCount;
+
+        //
+        //  Upcase the strings into the space after the UNICODE_STRINGs.
+        //
+
+        next = Subscription->Strings;
+        string.Buffer = (PWCHAR)(strings + count);
+
+        for (i = 0; i < count; i++) {
+
+            RtlInitUnicodeString( &strings[i], next );
+            next += strings[i].Length / sizeof( WCHAR ) + 1;
+
+            string.Length = 0;
+            string.MaximumLength = strings[i].Length;
+            RtlUpcaseUnicodeString( &string, &strings[i], FALSE );
+
+            strings[i] = string;
+            string.Buffer += string.Length / sizeof( WCHAR );
+
+            if (i < compiled->PrefixCount &&
+                strings[i].Length < compiled->MinPrefixLength) {
+
+                compiled->MinPrefixLength = strings[i].Length;
+            }
+        }
+    }
+
+    KeAcquireSpinLock( &MiniSpyData.ReaderLock, &oldIrql );
+
+    previous = Reader->Subscription;
+    Reader->Subscription = compiled;
+
+    if (compiled != NULL) {
+
+        Reader->Dispositions = compiled->Dispositions;
+        MiniSpyData.SubscribedReaders |= Reader->Bit;
+
+    } else {
+
+        Reader->Dispositions = SUBSCRIBE_DISPOSITION_ALL;
+        MiniSpyData.SubscribedReaders &= ~Reader->Bit;
+    }
+
+    KeReleaseSpinLock( &MiniSpyData.ReaderLock, oldIrql );
+
+    SpySubscribeDereference( previous );
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+SpySubscribeFormat (
+    __in PSPY_READER Reader,
+    __out_bcount(BufferSize) PWCHAR Buffer,
+    __in size_t BufferSize
+    )
+/*++
+
+Routine Description:
+
+    Describes a reader's subscription in a line of text.
+
+Arguments:
+
+    Reader - The reader.
+
+    Buffer - Receives the NULL terminated text.
+
+    BufferSize - Size of Buffer in bytes.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_SUBSCRIPTION subscription;
+    ULONG operations = 0;
+    ULONG bits;
+    ULONG i;
+
+    PAGED_CODE();
+
+    subscription = SpySubscribeReference( Reader );
+
+    if (subscription == NULL) {
+
+        RtlStringCbCopyW( Buffer, BufferSize, L"all records" );
+        return;
+    }
+
+    for (i = 0; i < SUBSCRIBE_OPERATION_WORDS; i++) {
+
+        for (bits = subscription->Operations[i]; bits != 0; bits &= bits - 1) {
+
+            operations++;
+        }
+    }
+
+    RtlStringCbPrintfW( Buffer,
+                        BufferSize,
+                        L"%lu operations, dispositions 0x%02lX, %u prefixes, %u processes",
+                        operations,
+                        subscription->Dispositions,
+                        subscription->PrefixCount,
+                        subscription->ProcessCount );
+
+    SpySubscribeDereference( subscription );
+}
+
+
+ULONG
+SpySubscribeOperation (
+    __in PFLT_CALLBACK_DATA Data
+    )
+/*++
+
+Routine Description:
+
+    Checks an operation's major function and possible access types
+    against the readers' subscriptions before anything is spent on it.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Data - The operation.
+
+Return Value:
+
+    The bits of the readers that may want a record of the operation, 0 if
+    none does.
+
+--*/
+{
+    PSPY_SUBSCRIPTION subscription;
+    ULONG subscribed = (ULONG)MiniSpyData.SubscribedReaders;
+    ULONG readers;
+    ULONG dispositions;
+    ULONG i;
+
+    if (subscribed == 0) {
+
+        return SPY_READER_ALL;
+    }
+
+    readers = SPY_READER_ALL & ~subscribed;
+    dispositions = SpySubscribeDispositions( Data );
+
+    for (i = 0; i < SPY_MAX_READERS; i++) {
+
+        if (!FlagOn( subscribed, MiniSpyData.Readers[i].Bit )) {
+
+            continue;
+        }
+
+        subscription = SpySubscribeReference( &MiniSpyData.Readers[i] );
+
+        if (subscription == NULL ||
+            (SubscribedOperation( subscription, Data->Iopb->MajorFunction ) &&
+             FlagOn( subscription->Dispositions, dispositions ))) {
+
+            SetFlag( readers, MiniSpyData.Readers[i].Bit );
+        }
+
+        SpySubscribeDereference( subscription );
+    }
+
+    return readers;
+}
+
+
+ULONG
+SpySubscribeMatch (
+    __in PUNICODE_STRING Name,
+    __in PSPY_IDENTITY Identity,
+    __in ULONG Readers
+    )
+/*++
+
+Routine Description:
+
+    Checks an operation's file name and process against the
+    subscriptions of the readers that may want it, before its record is
+    allocated.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Name - The normalized file name.
+
+    Identity - Who issued the operation.
+
+    Readers - The readers SpySubscribeOperation returned.
+
+Return Value:
+
+    The bits of the readers that want a record of the operation, 0 if
+    none does.
+
+--*/
+{
+    PSPY_SUBSCRIPTION subscription;
+    ULONG subscribed = Readers & (ULONG)MiniSpyData.SubscribedReaders;
+    ULONG i;
+
+    for (i = 0; subscribed != 0 && i < SPY_MAX_READERS; i++) {
+
+        if (!FlagOn( subscribed, MiniSpyData.Readers[i].Bit )) {
+
+            continue;
+        }
+
+        subscription = SpySubscribeReference( &MiniSpyData.Readers[i] );
+
+        if (subscription != NULL &&
+            !SpySubscribeWants( subscription, Name, Identity )) {
+
+            ClearFlag( Readers, MiniSpyData.Readers[i].Bit );
+        }
+
+        SpySubscribeDereference( subscription );
+    }
+
+    return Readers;
+}
+
+
+BOOLEAN
+SpySubscribeDisposition (
+    __inout PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    Checks the access type a completed operation was logged with, and
+    takes the readers that do not want it out of the record.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+Arguments:
+
+    RecordList - The completed record.
+
+Return Value:
+
+    FALSE if no reader wants the record.
+
+--*/
+{
+    ULONG subscribed = (ULONG)MiniSpyData.SubscribedReaders;
+    ULONG disposition;
+    ULONG i;
+
+    if (subscribed == 0) {
+
+        return TRUE;
+    }
+
+    disposition = SpySubscribeDispositionBit( RecordList->LogRecord.Data.Reserved[0] );
+
+    for (i = 0; i < SPY_MAX_READERS; i++) {
+
+        if (FlagOn( subscribed, MiniSpyData.Readers[i].Bit ) &&
+            !FlagOn( MiniSpyData.Readers[i].Dispositions, disposition )) {
+
+            ClearFlag( RecordList->Readers, MiniSpyData.Readers[i].Bit );
+        }
+    }
+
+    return (BOOLEAN)(RecordList->Readers != 0);
+}
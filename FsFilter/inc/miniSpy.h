@@ -77,10 +77,12 @@ typedef __int64 FILE_ID;
 typedef __success(return >= 0) LONG NTSTATUS;
 
 //
-//  The maximum size of a record that can be passed from the filter
+//  The maximum size of a record that can be passed from the filter.  Each
+//  record is only as large as the names it carries need, so a buffer of
+//  MAX_RECORD_SIZE bytes always has room for at least one record.
 //
 
-#define RECORD_SIZE     512
+#define MAX_RECORD_SIZE     8192
 
 //
 //  This defines the type of record buffer this is along with certain flags.
@@ -88,12 +90,116 @@ typedef __success(return >= 0) LONG NTSTATUS;
 
 #define RECORD_TYPE_NORMAL                       0x00000000
 #define RECORD_TYPE_FILETAG                      0x00000004
+#define RECORD_TYPE_AGGREGATE                    0x00000008
+#define RECORD_TYPE_SUMMARY                      0x00000010
+#define RECORD_TYPE_GAP                          0x00000020
+#define RECORD_TYPE_BURST                        0x00000040
 
-#define RECORD_TYPE_FLAG_STATIC                  0x80000000
+#define RECORD_TYPE_FLAG_PRIORITY                0x40000000
 #define RECORD_TYPE_FLAG_EXCEED_MEMORY_ALLOWANCE 0x20000000
 #define RECORD_TYPE_FLAG_OUT_OF_MEMORY           0x10000000
 #define RECORD_TYPE_FLAG_MASK                    0xffff0000
 
+//
+//  Summary carried by a RECORD_TYPE_AGGREGATE record.  Such a record stands
+//  for Count operations of the same kind on the same stream handle, the
+//  first at RECORD_DATA.OriginatingTime and the last at
+//  RECORD_DATA.CompletionTime.
+//
+//  A RECORD_TYPE_SUMMARY record reports a process that went over its
+//  record budget: Count is the number of operations it issued between
+//  OriginatingTime and CompletionTime and Suppressed how many of those
+//  were not logged.  Its name holds only the process image name.
+//  A RECORD_TYPE_BURST record reports a process that went over one of its
+//  burst thresholds, see BURST_SETTINGS: Count is the number of operations
+//  of that kind it made in the window ending at CompletionTime.
+//
+//  It is all zero for any other record.
+//
+
+typedef struct _RECORD_AGGREGATE {
+
+    ULONG Count;
+    ULONG Suppressed;
+
+    LONGLONG TotalBytes;
+
+    LONGLONG StartOffset;   // Lowest byte offset touched
+    LONGLONG EndOffset;     // One past the highest byte offset touched
+
+} RECORD_AGGREGATE, *PRECORD_AGGREGATE;
+
+//
+//  The filter queues records per processor, modulo LOG_QUEUES, and each
+//  queue numbers its records from a sequence of its own.  A record's
+//  (Processor, SequenceNumber) pair is unique and every queue's records
+//  arrive in sequence order, but records from different queues arrive
+//  interleaved in no particular order; merge on OriginatingTime to put
+//  them back in time order.
+//
+//  Up to MINISPY_MAX_CONNECTIONS consumers may be connected at once.  Each
+//  is sent the records it subscribed to and numbers them in its own
+//  sequences, so a record another consumer wants leaves no hole in them.
+//
+
+#define LOG_QUEUES              32
+
+#define MINISPY_MAX_CONNECTIONS 4
+
+//
+//  Records flagged RECORD_TYPE_FLAG_PRIORITY come from the filter's high
+//  priority lane.  They are sent up ahead of all other records and are
+//  numbered from a sequence of their own, which has no gaps.  Their
+//  Processor is 0.
+//
+
+//
+//  Why a sequence number was lost.
+//
+//  LOSS_OUT_OF_MEMORY - the record could not be allocated from pool.
+//  LOSS_OVER_QUOTA    - the record quota was used up.
+//  LOSS_DISCARDED     - the record was built but dropped before it was
+//                       queued, because the instance was being torn down
+//                       or the operation's name could not be queried.
+//  LOSS_LAGGING       - the record was queued, but this consumer fell so
+//                       far behind the others that it was taken away to
+//                       make room.  Only the lagging consumer loses it.
+//
+
+#define LOSS_OUT_OF_MEMORY      0
+#define LOSS_OVER_QUOTA         1
+#define LOSS_DISCARDED          2
+#define LOSS_LAGGING            3
+#define LOSS_REASONS            4
+
+//
+//  Loss counters are kept per IRP major function, IRP_MJ_CREATE through
+//  IRP_MJ_PNP, plus one slot for everything else (fast I/O and FsFilter
+//  callbacks, transaction notifications).
+//
+
+#define LOSS_MAJOR_SLOTS        0x1d
+
+//
+//  Every sequence number the filter hands out ends up either on a record
+//  that reaches user mode or in a RECORD_TYPE_GAP record, whose name space
+//  holds one RECORD_GAP.  A gap record is sent on the queue whose numbers
+//  it accounts for and stands for one contiguous run of lost numbers:
+//  exactly FirstSequence through LastSequence (inclusive), which are the
+//  Count numbers just before the gap record's own.  So the only jump in a
+//  queue's sequence numbers the filter explains is the one a gap record
+//  makes, and it is exactly Count wide.
+//
+
+typedef struct _RECORD_GAP {
+
+    ULONG FirstSequence;
+    ULONG LastSequence;
+    ULONG Count;
+    ULONG Reason[LOSS_REASONS];
+
+} RECORD_GAP, *PRECORD_GAP;
+
 //
 //  The fixed data received for RECORD_TYPE_NORMAL
 //
@@ -101,7 +207,7 @@ typedef __success(return >= 0) LONG NTSTATUS;
 typedef struct _RECORD_DATA {
 
     LARGE_INTEGER OriginatingTime;
-    //LARGE_INTEGER CompletionTime;
+    LARGE_INTEGER CompletionTime;
 
     //FILE_ID DeviceObject;
     //FILE_ID FileObject;
@@ -120,6 +226,18 @@ typedef struct _RECORD_DATA {
     UCHAR CallbackMajorId;
     UCHAR CallbackMinorId;
     UCHAR Reserved[2];      // Alignment on IA64
+                            //  [0] is the access type: 'D', 'd', 'R', 'W',
+                            //  or 'A' for an operation that was denied, in
+                            //  which case [1] says what it tried to do:
+                            //  'D', 'R', 'W', 'C' (create) or 'S' (set
+                            //  information).  Denials are sent on the
+                            //  priority lane, see RECORD_TYPE_FLAG_PRIORITY.
+                            //  A burst alert has 'B' in [0] and the kind
+                            //  of operation in [1], 'R', 'D' or 'W', and
+                            //  'b' instead of 'B' if the process is now
+                            //  blocked.  See RECORD_TYPE_BURST.
+
+    RECORD_AGGREGATE Aggregate;
 
     //PVOID Arg1;
     //PVOID Arg2;
@@ -146,6 +264,9 @@ typedef struct _LOG_RECORD {
     ULONG RecordType;       // The type of log record this is.
     ULONG Reserved;         // For alignment on IA64    Used as here be a retcode.
 
+    ULONG Processor;        // The queue SequenceNumber is from, see LOG_QUEUES
+    ULONG Spare;            // For alignment
+
     RECORD_DATA Data;
     WCHAR Name[];           //  This is a null terminated string
 
@@ -161,6 +282,11 @@ typedef struct _RECORD_LIST {
 
     LIST_ENTRY List;
 
+    ULONG Size;             // Bytes allocated for the whole RECORD_LIST
+    ULONG SizeClass;        // Which free list the buffer goes back to
+    ULONG Readers;          // Consumers yet to be sent the record
+    ULONG Node;             // The NUMA node whose lists it came from
+
     //
     // Must always be last item.  See MAX_LOG_RECORD_LENGTH macro below.
     // Must be aligned on PVOID boundary in this structure. This is because the
@@ -183,10 +309,259 @@ typedef enum _MINISPY_COMMAND {
     GetMiniSpyVersion,
     GetMiniSpyProtectionFolder,
     SetMiniSpyProtectionFolder,
-    SetMiniSpyOpenProccess
+    SetMiniSpyOpenProccess,
+    SetMiniSpyRecordQuota,
+    GetMiniSpyLossStats,
+    SetMiniSpySubscription,
+    AckMiniSpyLog,
+    SetMiniSpyBurst,
+    SetMiniSpyExtensions,
+    SetMiniSpyRules
 
 } MINISPY_COMMAND;
 
+//
+//  Data for SetMiniSpyRecordQuota: the bounds the filter may move its
+//  record quota between.  Setting both to the same value fixes the quota.
+//
+
+typedef struct _RECORD_QUOTA {
+
+    LONG Floor;
+    LONG Ceiling;
+
+} RECORD_QUOTA, *PRECORD_QUOTA;
+
+//
+//  Data for SetMiniSpyBurst: how many renames, deletes and overwrites a
+//  process may make in protected folders within Window milliseconds.  A
+//  process that goes over a threshold is reported at once on the priority
+//  lane with a RECORD_TYPE_BURST record and, if Block is not 0, is denied
+//  any further change to protected folders.  A threshold of 0 turns that
+//  kind off.  Writes are counted once per handle, as coalesced, so
+//  Threshold[BURST_WRITE] is about files overwritten.
+//
+//  Setting the thresholds starts every count afresh and lets blocked
+//  processes go.
+//
+
+#define BURST_RENAME            0
+#define BURST_DELETE            1
+#define BURST_WRITE             2
+#define BURST_KINDS             3
+
+typedef struct _BURST_SETTINGS {
+
+    LONG Threshold[BURST_KINDS];
+    LONG Window;
+    LONG Block;
+
+} BURST_SETTINGS, *PBURST_SETTINGS;
+
+//
+//  Data for SetMiniSpyExtensions: how the protected extensions combine with
+//  the protected folders, then the extensions, NULL terminated and one to
+//  a line, with or without the dot.  Only the final extension of a name
+//  counts, so "a.txt.bak" is a .bak file, and case is ignored.  There may
+//  be up to EXTENSION_MAX extensions of up to EXTENSION_MAX_CHARS
+//  characters, and the list may take up to EXTENSION_MAX_LENGTH bytes;
+//  a longer one is refused.  The reply says what is now in force.
+//
+//  EXTENSION_OFF leaves the folders alone to decide, EXTENSION_AND protects
+//  files of the extensions in the protected folders, and EXTENSION_OR
+//  protects files of the extensions wherever they are as well as all
+//  files in the protected folders.  Until set, the folders alone decide.
+//
+
+#define EXTENSION_OFF           0
+#define EXTENSION_AND           1
+#define EXTENSION_OR            2
+
+#define EXTENSION_MAX           64
+#define EXTENSION_MAX_CHARS     16
+#define EXTENSION_MAX_LENGTH    4096
+
+typedef struct _EXTENSION_SETTINGS {
+
+    LONG Mode;
+    WCHAR Extensions[1];
+
+} EXTENSION_SETTINGS, *PEXTENSION_SETTINGS;
+
+//
+//  Data for SetMiniSpyRules: the policy rules, as minispy /o compiles them
+//  from text.  A rule applies to the operations in Operations and, for
+//  each of Path, Extension, Process and User that is not RULE_ANY, only
+//  when the operation matches it too:
+//
+//      Path        the normalized file name contains it, ignoring case,
+//                  as for the protected folders
+//      Extension   the final extension of the name, ignoring case
+//      Process     the process image name ends with it, ignoring case
+//      User        the process token's user or one of its enabled
+//                  groups is this SID
+//
+//  Path, Extension and Process are byte offsets in Strings of NULL
+//  terminated strings, User of a binary SID.  The first rule that applies
+//  to an operation decides it.  An operation no rule applies to is left
+//  to the protected folders and allowed processes as before.  Allowed
+//  operations on protected files still count towards the burst
+//  thresholds.  No rules, the default, leaves it all to the folders.
+//
+//  The token cannot be queried for operations that arrive at APC_LEVEL,
+//  as paging writes and some creates do.  When evaluation reaches a rule
+//  with a User there, the rules cannot decide the operation and it is
+//  left to the folders and allowed processes, as if no rule applied.
+//  Rules after that one are not tried, since the one with the User
+//  might have come first.
+//
+//  RULE_OP_READ is opening a file without asking for write or delete
+//  access, RULE_OP_CREATE opening it for writing, creating or
+//  overwriting it.  Reads themselves are never checked.  RULE_OP_INFO is
+//  setting information other than a rename or a delete.
+//
+//  The reply is the number of rules now in force.
+//
+
+#define RULE_NONE               0
+#define RULE_ALLOW              1
+#define RULE_DENY               2
+
+#define RULE_OP_READ            0x0001
+#define RULE_OP_CREATE          0x0002
+#define RULE_OP_WRITE           0x0004
+#define RULE_OP_RENAME          0x0008
+#define RULE_OP_DELETE          0x0010
+#define RULE_OP_INFO            0x0020
+#define RULE_OPS                6
+#define RULE_OP_ALL             ((1 << RULE_OPS) - 1)
+
+#define RULE_ANY                0xFFFF
+
+#define RULE_MAX                64
+#define RULE_MAX_STRINGS        8192
+
+typedef struct _POLICY_RULE {
+
+    USHORT Verdict;
+    USHORT Operations;
+
+    USHORT Path;
+    USHORT Extension;
+    USHORT Process;
+    USHORT User;
+
+} POLICY_RULE, *PPOLICY_RULE;
+
+typedef struct _POLICY_RULES {
+
+    ULONG Count;
+    ULONG StringsLength;
+
+    POLICY_RULE Rules[RULE_MAX];
+    UCHAR Strings[RULE_MAX_STRINGS];
+
+} POLICY_RULES, *PPOLICY_RULES;
+
+//
+//  Data for SetMiniSpySubscription: the records the consumer wants.  Each
+//  connection has a subscription of its own.  The filter does not build a
+//  record for an operation no consumer wants, so it costs neither memory
+//  nor a trip to user mode.
+//
+//  Operations has one bit per CallbackMajorId.  Dispositions takes the
+//  SUBSCRIBE_DISPOSITION_* bits for the access types in
+//  RECORD_DATA.Reserved[0].  Strings holds PrefixCount path prefixes and
+//  then ProcessCount process image names, each NULL terminated.  A record
+//  must match the operations, the dispositions and, when they are not
+//  empty, the prefixes and the processes.
+//
+//  A prefix matches a normalized file name that starts with it at a path
+//  component boundary.  A process name with no backslash matches the last
+//  component of the image name, otherwise the whole image name.  Both
+//  are compared without regard to case.
+//
+//  A subscription, its strings included, may take up to
+//  SUBSCRIBE_MAX_LENGTH bytes; a longer one is refused.
+//
+//  Denials, summaries and gap records are always sent.
+//
+
+#define SUBSCRIBE_DISPOSITION_OTHER             0x01    //  No access type
+#define SUBSCRIBE_DISPOSITION_DELETE            0x02    //  'D'
+#define SUBSCRIBE_DISPOSITION_DELETE_PENDING    0x04    //  'd'
+#define SUBSCRIBE_DISPOSITION_RENAME            0x08    //  'R'
+#define SUBSCRIBE_DISPOSITION_WRITE             0x10    //  'W'
+#define SUBSCRIBE_DISPOSITION_ALL               0x1F
+
+#define SUBSCRIBE_OPERATION_WORDS               (256 / 32)
+#define SUBSCRIBE_MAX_STRINGS                   64
+#define SUBSCRIBE_MAX_LENGTH                    16384
+
+#pragma warning(push)
+#pragma warning(disable:4200) // disable warnings for structures with zero length arrays.
+
+typedef struct _SUBSCRIPTION {
+
+    ULONG Operations[SUBSCRIBE_OPERATION_WORDS];
+    ULONG Dispositions;
+
+    USHORT PrefixCount;
+    USHORT ProcessCount;
+
+    WCHAR Strings[];
+
+} SUBSCRIPTION, *PSUBSCRIPTION;
+
+#pragma warning(pop)
+
+#define SubscribeOperation(Subscription,MajorId) \
+    ((Subscription)->Operations[(UCHAR)(MajorId) / 32] |= 1UL << ((UCHAR)(MajorId) % 32))
+
+#define SubscribedOperation(Subscription,MajorId) \
+    (((Subscription)->Operations[(UCHAR)(MajorId) / 32] & (1UL << ((UCHAR)(MajorId) % 32))) != 0)
+
+//
+//  Connection context.  A consumer that connects with a SubscriberId
+//  other than 0 acknowledges the records it has processed.  The filter
+//  keeps every record it sent such a consumer until it is acknowledged,
+//  and keeps collecting records for the consumer while it is
+//  disconnected.  A consumer reconnecting with the same SubscriberId
+//  carries on after the last record it acknowledged: the records it was
+//  sent but did not acknowledge come again, with the same sequence
+//  numbers.
+//
+//  What is kept counts against the record quota.  A consumer that is
+//  away when the quota runs out is forgotten, and its next connection
+//  starts afresh; so does every consumer when the filter unloads.
+//
+
+typedef struct _MINISPY_CONNECT {
+
+    ULONG SubscriberId;
+
+} MINISPY_CONNECT, *PMINISPY_CONNECT;
+
+//
+//  Data for AckMiniSpyLog: the last sequence number processed on each
+//  queue, and on the priority lane in the last entry.  A number that is
+//  not past the last one acknowledged leaves its lane alone.
+//
+//  AckMiniSpyLog then returns records just as GetMiniSpyLog does, so
+//  acknowledging a batch costs no extra call.  A consumer that has
+//  ACK_WINDOW records outstanding is sent no more until it acknowledges
+//  some.
+//
+
+#define ACK_LANES               (LOG_QUEUES + 1)
+#define ACK_WINDOW              4096
+
+typedef struct _MINISPY_ACK {
+
+    ULONG Sequence[ACK_LANES];
+
+} MINISPY_ACK, *PMINISPY_ACK;
+
 //
 //  Defines the command structure between the utility and the filter.
 //
@@ -204,22 +579,23 @@ typedef struct _COMMAND_MESSAGE {
 
 //
 //  The maximum number of BYTES that can be used to store the file name in the
-//  RECORD_LIST structure
+//  largest RECORD_LIST structure
 //
 
-#define MAX_NAME_SPACE ROUND_TO_SIZE( (RECORD_SIZE - sizeof(RECORD_LIST)), sizeof( PVOID ))
+#define MAX_NAME_SPACE ROUND_TO_SIZE( (MAX_RECORD_SIZE - sizeof(RECORD_LIST)), sizeof( PVOID ))
 
 //
 //  Returns the number of BYTES unused in the RECORD_LIST structure.  Note that
-//  LogRecord->Length already contains the size of LOG_RECORD which is why we
-//  have to remove it.
+//  LogRecord.Length already contains the size of LOG_RECORD, which is part of
+//  the RECORD_LIST.
 //
 
-#define REMAINING_NAME_SPACE(LogRecord) \
-    (ASSERT((LogRecord)->Length >= sizeof(LOG_RECORD)), \
-     (USHORT)(MAX_NAME_SPACE - ((LogRecord)->Length - sizeof(LOG_RECORD))))
+#define REMAINING_NAME_SPACE(RecordList) \
+    (ASSERT((RecordList)->LogRecord.Length >= sizeof(LOG_RECORD)), \
+     (ULONG)((RecordList)->Size - FIELD_OFFSET( RECORD_LIST, LogRecord ) - \
+             (RecordList)->LogRecord.Length))
 
-#define MAX_LOG_RECORD_LENGTH  (RECORD_SIZE - FIELD_OFFSET( RECORD_LIST, LogRecord ))
+#define MAX_LOG_RECORD_LENGTH  (MAX_RECORD_SIZE - FIELD_OFFSET( RECORD_LIST, LogRecord ))
 
 
 //
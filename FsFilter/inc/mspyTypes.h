@@ -0,0 +1,90 @@
+/*++
+
+Module Name:
+
+    mspyTypes.h
+
+Abstract:
+
+    The Windows base types and annotations that minispy.h and the
+    portable user mode modules are written in, for builds that do not
+    have the Windows headers.  On Windows this only includes windows.h.
+
+    WCHAR is 16 bits wide, as in the records the filter sends, whatever
+    the width of the compiler's wchar_t.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYTYPES_H__
+#define __MSPYTYPES_H__
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+#else
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define __in
+#define __out
+#define __inout
+#define __in_opt
+#define __out_opt
+#define __deref_out
+#define __in_bcount(x)
+#define __out_bcount(x)
+#define __in_ecount(x)
+#define __out_ecount(x)
+#define __inout_ecount(x)
+#define __inout_bcount(x)
+#define __success(x)
+
+#define CONST               const
+#define VOID                void
+
+#define __cdecl
+
+#define __int64             long long
+
+typedef void *PVOID;
+typedef char CHAR, *PCHAR, *PSTR;
+typedef const char *PCSTR;
+typedef uint8_t UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN;
+typedef uint16_t USHORT, *PUSHORT;
+typedef uint16_t WCHAR, *PWCHAR;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG, *PLONGLONG;
+typedef uint64_t ULONGLONG, *PULONGLONG;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+#define TRUE                1
+#define FALSE               0
+
+#define UNICODE_NULL        ((WCHAR)0)
+
+#define MAXLONGLONG         0x7FFFFFFFFFFFFFFFLL
+
+#define FIELD_OFFSET(type, field)   ((LONG)offsetof(type, field))
+
+#endif // _WIN32
+
+#endif //__MSPYTYPES_H__
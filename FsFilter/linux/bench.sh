@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+#   Measures the open, write and read rounds a second of fanBench on a
+#   tmpfs directory with no fanFilter, with fanFilter and the files not
+#   protected, and with them protected and fanBench allowed; then again
+#   with the reads checked.  Needs root, for fanotify.
+#
+#   THREADS and DURATION set the load, 4 threads for 3 seconds by default.
+#
+
+set -e
+
+cd "$(dirname "$0")"
+
+THREADS=${THREADS:-4}
+DURATION=${DURATION:-3}
+BASE=$(mktemp -d /dev/shm/fanbench.XXXXXX)
+PROTECTED=$BASE/EncryptionMinifilterDir
+FILTER=
+
+mkdir "$PROTECTED"
+echo "$(pwd)/fanBench" > "$BASE/processes"
+
+cleanup() {
+    [ -n "$FILTER" ] && kill "$FILTER" 2>/dev/null && wait "$FILTER" 2>/dev/null
+    rm -rf "$BASE"
+}
+
+trap cleanup EXIT
+
+start() {
+    ./fanFilter -q -p "$BASE/processes" -o /dev/null "$@" /dev/shm &
+    FILTER=$!
+    sleep 0.5
+}
+
+stop() {
+    kill "$FILTER"
+    wait "$FILTER" || true
+    FILTER=
+}
+
+run() {
+    printf '%-34s %-9s %10s\n' "$1" "$3" "$(./fanBench "$2" "$THREADS" "$DURATION" $3)"
+}
+
+printf '%-34s %-9s %10s\n' "setup" "operation" "per second"
+
+run "no fanFilter" "$BASE" write
+run "no fanFilter" "$BASE" read
+run "no fanFilter" "$BASE" "read 8"
+
+echo secret > "$PROTECTED/secret"
+
+start
+run "fanFilter, not protected" "$BASE" write
+run "fanFilter, not protected" "$BASE" read
+run "fanFilter, protected, allowed" "$PROTECTED" write
+run "fanFilter, protected, allowed" "$PROTECTED" read
+
+if cat "$PROTECTED/secret" >/dev/null 2>&1; then
+    echo "FAILED: a process that is not allowed opened a protected file"
+    exit 1
+fi
+stop
+
+start -r
+run "fanFilter -r, not protected" "$BASE" read
+run "fanFilter -r, not protected" "$BASE" "read 8"
+run "fanFilter -r, protected, allowed" "$PROTECTED" "read 8"
+stop
@@ -0,0 +1,171 @@
+/*++
+
+Module Name:
+
+    fanBench.c
+
+Abstract:
+
+    Measures what answering permission events costs the processes that
+    wait on them.  Each thread opens a file of its own in a directory,
+    writes or reads it and closes it again, for a number of seconds, and
+    the total of those rounds a second is printed.  bench.sh runs it with
+    and without fanFilter.
+
+    Usage: fanBench directory threads seconds write|read [reads]
+
+    Each round of "read" makes that many reads of one byte, 1 by default,
+    so that with fanFilter -r there is a read to check for every open and
+    more.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *Directory;
+static int Writing;
+static int Reads = 1;
+static atomic_int Stop;
+static atomic_ullong Rounds;
+
+static void *
+BenchThread (
+    void *Context
+    )
+{
+    char path[4096];
+    char buffer[4096];
+    unsigned long long rounds = 0;
+    int fd;
+    int read;
+
+    snprintf( path, sizeof(path), "%s/bench%ld.dat", Directory, (long)(intptr_t) Context );
+    memset( buffer, 'x', sizeof(buffer) );
+
+    fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+
+    if (fd < 0 || write( fd, buffer, sizeof(buffer) ) != sizeof(buffer)) {
+
+        perror( path );
+        exit( 1 );
+    }
+
+    close( fd );
+
+    while (!atomic_load_explicit( &Stop, memory_order_relaxed )) {
+
+        fd = open( path, Writing ? O_WRONLY : O_RDONLY );
+
+        if (fd < 0) {
+
+            perror( path );
+            exit( 1 );
+        }
+
+        if (Writing) {
+
+            if (pwrite( fd, buffer, sizeof(buffer), 0 ) != sizeof(buffer)) {
+
+                perror( path );
+                exit( 1 );
+            }
+
+        } else {
+
+            for (read = 0; read < Reads; read++) {
+
+                if (pread( fd, buffer, 1, read % sizeof(buffer) ) != 1) {
+
+                    perror( path );
+                    exit( 1 );
+                }
+            }
+        }
+
+        close( fd );
+        rounds++;
+    }
+
+    atomic_fetch_add( &Rounds, rounds );
+
+    return NULL;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    pthread_t *threads;
+    struct timespec start;
+    struct timespec end;
+    double elapsed;
+    long count;
+    long index;
+    int seconds;
+
+    if (argc < 5 || argc > 6) {
+
+        fprintf( stderr, "Usage: fanBench directory threads seconds write|read [reads]\n" );
+        return 2;
+    }
+
+    Directory = argv[1];
+    count = atol( argv[2] );
+    seconds = atoi( argv[3] );
+    Writing = (strcmp( argv[4], "write" ) == 0);
+
+    if (argc == 6) {
+
+        Reads = atoi( argv[5] );
+    }
+
+    if (count <= 0 || seconds <= 0 || Reads <= 0) {
+
+        fprintf( stderr, "fanBench: bad arguments\n" );
+        return 2;
+    }
+
+    threads = calloc( count, sizeof(pthread_t) );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    for (index = 0; index < count; index++) {
+
+        pthread_create( &threads[index], NULL, BenchThread, (void *)(intptr_t) index );
+    }
+
+    sleep( seconds );
+    atomic_store( &Stop, 1 );
+
+    for (index = 0; index < count; index++) {
+
+        pthread_join( threads[index], NULL );
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &end );
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf( "%.0f\n", atomic_load( &Rounds ) / elapsed );
+
+    free( threads );
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*++
+
+Module Name:
+
+    fanCat.c
+
+Abstract:
+
+    Prints the records fanFilter writes, one to a line, decoded with the
+    same ../userdll/mspyDecode.c minispy decodes the driver's replies
+    with.  It reads the frames from a file or pipe, or standard input.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mspyDecode.h"
+
+#define FAN_EPOCH_DIFFERENCE        116444736000000000LL
+
+static
+ULONG
+FanFormatTime (
+    __in CONST LARGE_INTEGER *Time,
+    __out_bcount(BufferLength) CHAR *Buffer,
+    __in ULONG BufferLength
+    )
+{
+    struct tm local;
+    time_t seconds;
+    LONGLONG units = Time->QuadPart - FAN_EPOCH_DIFFERENCE;
+    size_t length;
+
+    seconds = (time_t)(units / 10000000);
+    localtime_r( &seconds, &local );
+
+    length = strftime( Buffer, BufferLength, "%H:%M:%S", &local );
+    length += snprintf( Buffer + length,
+                        BufferLength - length,
+                        ":%03d",
+                        (int)((units / 10000) % 1000) );
+
+    return (ULONG) length;
+}
+
+static CONST MSPY_DECODE_HOOKS FanHooks = { NULL, FanFormatTime, NULL };
+
+static
+VOID
+FanPrintView (
+    __in CONST MSPY_STRING_VIEW *View
+    )
+{
+    fwrite( View->Buffer, 1, View->Length, stdout );
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    FILE *input = stdin;
+    PUCHAR frame;
+    MSPY_BATCH batch;
+    PMSPY_BATCH_RECORD record;
+    ULONG length;
+    ULONG index;
+
+    if (argc > 2) {
+
+        fprintf( stderr, "Usage: fanCat [records]\n" );
+        return 2;
+    }
+
+    if (argc == 2 && strcmp( argv[1], "-" ) != 0) {
+
+        input = fopen( argv[1], "rb" );
+
+        if (input == NULL) {
+
+            perror( argv[1] );
+            return 1;
+        }
+    }
+
+    frame = malloc( 2 * MAX_RECORD_SIZE );
+    memset( &batch, 0, sizeof(batch) );
+
+    if (frame == NULL) {
+
+        return 1;
+    }
+
+    while (fread( &length, sizeof(length), 1, input ) == 1) {
+
+        if (length > 2 * MAX_RECORD_SIZE || fread( frame, 1, length, input ) != length) {
+
+            fprintf( stderr, "fanCat: bad frame\n" );
+            return 1;
+        }
+
+        if (!MspyDecodeBatch( frame, length, MSPY_FIELD_ALL, MspyEncodingUtf8, &FanHooks, &batch )) {
+
+            fprintf( stderr, "fanCat: out of memory\n" );
+            return 1;
+        }
+
+        for (index = 0; index < batch.Count; index++) {
+
+            record = &batch.Records[index];
+
+            printf( "%c%u:%u\t",
+                    (record->RecordType & RECORD_TYPE_FLAG_PRIORITY) ? 'P' : 'N',
+                    record->Processor,
+                    record->SequenceNumber );
+            FanPrintView( &record->Time );
+            printf( "\t%c%c\t%u\t%llu\t",
+                    record->AccessType ? record->AccessType : '-',
+                    record->DeniedAccess ? record->DeniedAccess : ' ',
+                    record->CallbackMajorId,
+                    (unsigned long long) record->ProcessId );
+            FanPrintView( &record->FileName );
+            putchar( '\t' );
+            FanPrintView( &record->Process );
+            putchar( '\t' );
+            FanPrintView( &record->User );
+            putchar( '\n' );
+        }
+
+        fflush( stdout );
+    }
+
+    MspyResetBatch( &batch );
+    free( frame );
+
+    return 0;
+}
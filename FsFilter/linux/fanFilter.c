@@ -0,0 +1,1306 @@
+/*++
+
+Module Name:
+
+    fanFilter.c
+
+Abstract:
+
+    This is the main module of fanFilter, the Linux backend of the
+    protection policy.  It loads the policy, sets up the fanotify groups
+    and their marks and starts the threads that answer the permission
+    events (fanRespond.c) and log the notifications (fanNotify.c).  It
+    then waits for signals: SIGHUP loads the policy again, SIGINT and
+    SIGTERM stop it.
+
+    The policy is read from text files, one entry to a line, in UTF-8:
+
+        -f  the protected folders, matched anywhere in a file's path as
+            the driver matches its ProtectedDir entries.  By default
+            "/EncryptionMinifilterDir/".
+        -p  the allowed processes.  Each is matched, with "*" put in
+            front as the driver's OpenProccess entries are, against the
+            path of the process executable.  By default there are none.
+        -e  the protected extensions, as SetMiniSpyExtensions takes them,
+            combined with the folders as -x says: "and" (the default once
+            there are extensions) or "or".
+
+    The policy rules of SetMiniSpyRules are not enforced here: their user
+    predicate names a Windows SID, which no Linux process has.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+#include "fanFilter.h"
+
+FAN_DATA FanData;
+
+//
+//  The policy files, kept to load them again on SIGHUP.
+//
+
+typedef struct _FAN_OPTIONS {
+
+    CONST CHAR *Folders;
+    CONST CHAR *Processes;
+    CONST CHAR *Extensions;
+    LONG ExtensionMode;
+
+} FAN_OPTIONS, *PFAN_OPTIONS;
+
+static FAN_OPTIONS FanOptions;
+
+//
+//  WCHAR is UTF-16 here but wchar_t is not, so there are no L"" strings.
+//
+
+static CONST WCHAR FanProcessPrefix = '*';
+
+static CONST WCHAR FanDefaultFolder[] = {
+    '/', 'E', 'n', 'c', 'r', 'y', 'p', 't', 'i', 'o', 'n',
+    'M', 'i', 'n', 'i', 'f', 'i', 'l', 't', 'e', 'r',
+    'D', 'i', 'r', '/'
+};
+
+static
+VOID
+FanUsage (
+    VOID
+    )
+{
+    fprintf( stderr,
+             "Usage: fanFilter [-f folders] [-p processes] [-e extensions] [-x and|or]\n"
+             "                 [-o records] [-t responders] [-r] [-q] [path ...]\n"
+             "\n"
+             "    -f  file of protected folders, one to a line\n"
+             "    -p  file of processes allowed to open protected files\n"
+             "    -e  file of protected extensions\n"
+             "    -x  how the extensions combine with the folders\n"
+             "    -o  where to write the records, \"-\" for stdout; none are built otherwise\n"
+             "    -t  how many threads answer permission events, 0 for the reader alone\n"
+             "    -r  check reads as well as opens\n"
+             "    -q  print no summary on exit\n"
+             "    path  file systems to watch, \"/\" by default\n" );
+}
+
+/*************************************************************************
+    Names
+*************************************************************************/
+
+ULONG
+FanWiden (
+    __in CONST CHAR *Source,
+    __in size_t Length,
+    __out_ecount(DestCount) PWCHAR Dest,
+    __in ULONG DestCount
+    )
+/*++
+
+Routine Description:
+
+    Converts UTF-8 to UTF-16, as the names the driver sees are.  A byte
+    that does not start a valid sequence becomes U+FFFD, and the result
+    is cut short rather than split a surrogate pair.
+
+Arguments:
+
+    Source - the UTF-8 string
+    Length - its length in bytes
+    Dest - receives the UTF-16 string, not terminated
+    DestCount - the room in Dest, in characters
+
+Return Value:
+
+    The number of characters written.
+
+--*/
+{
+    CONST UCHAR *source = (CONST UCHAR *) Source;
+    CONST UCHAR *end = source + Length;
+    ULONG count = 0;
+    ULONG code;
+    ULONG trail;
+    ULONG minimum;
+
+    while (source < end && count < DestCount) {
+
+        code = *source++;
+
+        if (code < 0x80) {
+
+            Dest[count++] = (WCHAR) code;
+            continue;
+        }
+
+        if (code >= 0xC2 && code < 0xE0) {
+
+            trail = 1;
+            minimum = 0x80;
+            code &= 0x1F;
+
+        } else if (code >= 0xE0 && code < 0xF0) {
+
+            trail = 2;
+            minimum = 0x800;
+            code &= 0x0F;
+
+        } else if (code >= 0xF0 && code < 0xF5) {
+
+            trail = 3;
+            minimum = 0x10000;
+            code &= 0x07;
+
+        } else {
+
+            Dest[count++] = 0xFFFD;
+            continue;
+        }
+
+        if ((ULONG)(end - source) < trail) {
+
+            Dest[count++] = 0xFFFD;
+            break;
+        }
+
+        for (; trail > 0; trail--, source++) {
+
+            if ((*source & 0xC0) != 0x80) {
+
+                break;
+            }
+
+            code = (code << 6) | (*source & 0x3F);
+        }
+
+        if (trail > 0 || code < minimum || code > 0x10FFFF ||
+            (code >= 0xD800 && code <= 0xDFFF)) {
+
+            Dest[count++] = 0xFFFD;
+            continue;
+        }
+
+        if (code < 0x10000) {
+
+            Dest[count++] = (WCHAR) code;
+            continue;
+        }
+
+        if (DestCount - count < 2) {
+
+            break;
+        }
+
+        code -= 0x10000;
+        Dest[count++] = (WCHAR)(0xD800 + (code >> 10));
+        Dest[count++] = (WCHAR)(0xDC00 + (code & 0x3FF));
+    }
+
+    return count;
+}
+
+
+BOOLEAN
+FanQueryName (
+    __in CONST CHAR *Link,
+    __out PUNICODE_STRING Name,
+    __in ULONG MaximumCount
+    )
+/*++
+
+Routine Description:
+
+    Reads a symbolic link under /proc, /proc/self/fd/N for the name of an
+    open file or /proc/PID/exe for a process image, into a UNICODE_STRING.
+
+Arguments:
+
+    Link - the link
+    Name - receives the name, in a buffer the caller supplies
+    MaximumCount - the room in that buffer, in characters
+
+Return Value:
+
+    TRUE if the link could be read.
+
+--*/
+{
+    CHAR target[PATH_MAX];
+    ssize_t length;
+
+    Name->Length = 0;
+
+    length = readlink( Link, target, sizeof(target) );
+
+    if (length <= 0) {
+
+        return FALSE;
+    }
+
+    if (MaximumCount > MAXUSHORT / sizeof(WCHAR)) {
+
+        MaximumCount = MAXUSHORT / sizeof(WCHAR);
+    }
+
+    Name->MaximumLength = (USHORT)(MaximumCount * sizeof(WCHAR));
+    Name->Length = (USHORT)(FanWiden( target, length, Name->Buffer, MaximumCount ) * sizeof(WCHAR));
+
+    return TRUE;
+}
+
+
+static
+VOID
+FanNameExtension (
+    __in PUNICODE_STRING FileName,
+    __out PUNICODE_STRING Extension
+    )
+/*++
+
+Routine Description:
+
+    Finds the final extension of a file name, after the last dot of its
+    last component and without it, as FltParseFileNameInformation does.
+
+Arguments:
+
+    FileName - the name
+    Extension - receives the extension, pointing into FileName, empty if
+        there is none
+
+Return Value:
+
+    None.
+
+--*/
+{
+    USHORT index = FileName->Length / sizeof(WCHAR);
+
+    Extension->Length = 0;
+    Extension->MaximumLength = 0;
+    Extension->Buffer = NULL;
+
+    while (index > 0) {
+
+        index--;
+
+        if (FileName->Buffer[index] == L'/') {
+
+            return;
+        }
+
+        if (FileName->Buffer[index] == L'.') {
+
+            Extension->Buffer = &FileName->Buffer[index + 1];
+            Extension->Length = FileName->Length - (index + 1) * sizeof(WCHAR);
+            Extension->MaximumLength = Extension->Length;
+            return;
+        }
+    }
+}
+
+
+BOOLEAN
+FanProtectedFile (
+    __in PFAN_POLICY Policy,
+    __in PUNICODE_STRING FileName
+    )
+/*++
+
+Routine Description:
+
+    Decides whether a file is protected, as IsProtectionFile does in the
+    driver: its name contains a protected folder, combined as set with
+    whether its final extension is a protected one.
+
+Arguments:
+
+    Policy - the policy, held shared
+    FileName - the full path of the file
+
+Return Value:
+
+    TRUE if the file is protected.
+
+--*/
+{
+    UNICODE_STRING extension;
+    BOOLEAN protect;
+
+    protect = PolicyMatchFolder( Policy->Folders, FileName );
+
+    if ((Policy->ExtensionMode == EXTENSION_AND && protect) ||
+        (Policy->ExtensionMode == EXTENSION_OR && !protect)) {
+
+        FanNameExtension( FileName, &extension );
+        protect = PolicyMatchExtension( &Policy->Extensions, &extension );
+    }
+
+    return protect;
+}
+
+
+BOOLEAN
+FanAllowedProcess (
+    __in PFAN_POLICY Policy,
+    __in pid_t Pid,
+    __out PUNICODE_STRING ImageName,
+    __in ULONG MaximumCount
+    )
+/*++
+
+Routine Description:
+
+    Decides whether a process may open protected files, as IsOpenProccess
+    does in the driver, by the path of its executable.
+
+Arguments:
+
+    Policy - the policy, held shared
+    Pid - the process
+    ImageName - receives the path of the executable, empty if the process
+        is gone, in a buffer the caller supplies
+    MaximumCount - the room in that buffer, in characters
+
+Return Value:
+
+    TRUE if the process is allowed.  A process whose image cannot be had
+    is not.
+
+--*/
+{
+    CHAR link[32];
+
+    snprintf( link, sizeof(link), "/proc/%d/exe", (int) Pid );
+
+    if (!FanQueryName( link, ImageName, MaximumCount )) {
+
+        return FALSE;
+    }
+
+    return PolicyMatchProcess( &Policy->ProcessTable, ImageName );
+}
+
+/*************************************************************************
+    The policy
+*************************************************************************/
+
+static
+PWCHAR
+FanReadText (
+    __in CONST CHAR *Path,
+    __out PULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Reads a whole UTF-8 text file into UTF-16.
+
+Arguments:
+
+    Path - the file
+    Count - receives the length of the text, in characters
+
+Return Value:
+
+    The text, to be freed, or NULL with the error reported.
+
+--*/
+{
+    FILE *file;
+    CHAR *bytes = NULL;
+    PWCHAR text = NULL;
+    size_t length = 0;
+    size_t room = 0;
+    size_t got;
+
+    file = fopen( Path, "r" );
+
+    if (file == NULL) {
+
+        fprintf( stderr, "fanFilter: cannot open %s: %s\n", Path, strerror( errno ) );
+        return NULL;
+    }
+
+    do {
+
+        if (length == room) {
+
+            room = room ? room * 2 : 4096;
+            bytes = realloc( bytes, room );
+
+            if (bytes == NULL) {
+
+                goto FanReadText_Cleanup;
+            }
+        }
+
+        got = fread( bytes + length, 1, room - length, file );
+        length += got;
+
+    } while (got > 0);
+
+    if (ferror( file ) || length > MAXUSHORT / sizeof(WCHAR)) {
+
+        fprintf( stderr, "fanFilter: cannot read %s\n", Path );
+        goto FanReadText_Cleanup;
+    }
+
+    text = malloc( (length + 1) * sizeof(WCHAR) );
+
+    if (text != NULL) {
+
+        *Count = FanWiden( bytes, length, text, (ULONG) length );
+    }
+
+FanReadText_Cleanup:
+
+    free( bytes );
+    fclose( file );
+
+    return text;
+}
+
+
+static
+PFF_LIST_CONTEXT
+FanNewEntry (
+    __in_opt CONST WCHAR *Prefix,
+    __in CONST WCHAR *Item,
+    __in ULONG Count
+    )
+{
+    PFF_LIST_CONTEXT entry;
+    ULONG prefix = (Prefix != NULL) ? 1 : 0;
+
+    entry = calloc( 1, sizeof(FF_LIST_CONTEXT) + (prefix + Count + 1) * sizeof(WCHAR) );
+
+    if (entry == NULL) {
+
+        return NULL;
+    }
+
+    entry->item.Buffer = (PWCH)(entry + 1);
+    entry->item.Length = (USHORT)((prefix + Count) * sizeof(WCHAR));
+    entry->item.MaximumLength = entry->item.Length + sizeof(WCHAR);
+
+    if (Prefix != NULL) {
+
+        entry->item.Buffer[0] = *Prefix;
+    }
+
+    memcpy( entry->item.Buffer + prefix, Item, Count * sizeof(WCHAR) );
+
+    return entry;
+}
+
+
+static
+BOOLEAN
+FanReadList (
+    __in CONST CHAR *Path,
+    __in_opt CONST WCHAR *Prefix,
+    __out PFF_LIST_CONTEXT *List
+    )
+/*++
+
+Routine Description:
+
+    Reads a file of entries, one to a line, into a list linked by head as
+    the driver's are.  Blank lines are skipped and trailing spaces and
+    carriage returns dropped.
+
+Arguments:
+
+    Path - the file
+    Prefix - a character to put in front of each entry, or NULL
+    List - receives the list
+
+Return Value:
+
+    TRUE if the file was read.
+
+--*/
+{
+    PWCHAR text;
+    PFF_LIST_CONTEXT entry;
+    ULONG count;
+    ULONG index = 0;
+    ULONG start;
+    ULONG length;
+
+    *List = NULL;
+
+    text = FanReadText( Path, &count );
+
+    if (text == NULL) {
+
+        return FALSE;
+    }
+
+    while (index < count) {
+
+        start = index;
+
+        while (index < count && text[index] != L'\n') {
+
+            index++;
+        }
+
+        length = index - start;
+        index++;
+
+        while (length > 0 && (text[start + length - 1] == L'\r' || text[start + length - 1] == L' ')) {
+
+            length--;
+        }
+
+        if (length == 0) {
+
+            continue;
+        }
+
+        entry = FanNewEntry( Prefix, &text[start], length );
+
+        if (entry == NULL) {
+
+            free( text );
+            return FALSE;
+        }
+
+        entry->head = *List;
+        *List = entry;
+    }
+
+    free( text );
+
+    return TRUE;
+}
+
+
+static
+VOID
+FanFreeList (
+    __in PFF_LIST_CONTEXT List
+    )
+{
+    PFF_LIST_CONTEXT next;
+
+    for (; List != NULL; List = next) {
+
+        next = List->head;
+        free( List );
+    }
+}
+
+
+static
+VOID
+FanFreePolicy (
+    __in_opt PFAN_POLICY Policy
+    )
+{
+    if (Policy != NULL) {
+
+        FanFreeList( Policy->Folders );
+        FanFreeList( Policy->Processes );
+        free( Policy );
+    }
+}
+
+
+static
+PFAN_POLICY
+FanLoadPolicy (
+    __in PFAN_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Builds a policy from the policy files.  Nothing is changed if one of
+    them cannot be read, as a failed SetMiniSpyExtensions leaves the old
+    extensions in force in the driver.
+
+Arguments:
+
+    Options - the files
+
+Return Value:
+
+    The policy, or NULL with the error reported.
+
+--*/
+{
+    PFAN_POLICY policy;
+    PFF_LIST_CONTEXT process;
+    UNICODE_STRING list;
+    PWCHAR text;
+    ULONG count;
+    NTSTATUS status;
+
+    policy = calloc( 1, sizeof(FAN_POLICY) );
+
+    if (policy == NULL) {
+
+        return NULL;
+    }
+
+    if (Options->Folders != NULL) {
+
+        if (!FanReadList( Options->Folders, NULL, &policy->Folders )) {
+
+            goto FanLoadPolicy_Error;
+        }
+
+    } else {
+
+        policy->Folders = FanNewEntry( NULL,
+                                       FanDefaultFolder,
+                                       sizeof(FanDefaultFolder) / sizeof(WCHAR) );
+
+        if (policy->Folders == NULL) {
+
+            goto FanLoadPolicy_Error;
+        }
+    }
+
+    PolicyClearProcesses( &policy->ProcessTable );
+
+    if (Options->Processes != NULL) {
+
+        if (!FanReadList( Options->Processes, &FanProcessPrefix, &policy->Processes )) {
+
+            goto FanLoadPolicy_Error;
+        }
+
+        for (process = policy->Processes; process != NULL; process = process->head) {
+
+            PolicyAddProcess( &policy->ProcessTable, process );
+        }
+    }
+
+    policy->ExtensionMode = EXTENSION_OFF;
+
+    if (Options->Extensions != NULL) {
+
+        text = FanReadText( Options->Extensions, &count );
+
+        if (text == NULL) {
+
+            goto FanLoadPolicy_Error;
+        }
+
+        list.Buffer = text;
+        list.Length = (USHORT)(count * sizeof(WCHAR));
+        list.MaximumLength = list.Length;
+
+        status = PolicySetExtensions( &policy->Extensions, &list );
+
+        free( text );
+
+        if (!NT_SUCCESS( status )) {
+
+            fprintf( stderr,
+                     "fanFilter: %s: at most %d extensions of up to %d characters\n",
+                     Options->Extensions,
+                     EXTENSION_MAX,
+                     EXTENSION_MAX_CHARS );
+            goto FanLoadPolicy_Error;
+        }
+
+        policy->ExtensionMode = Options->ExtensionMode;
+    }
+
+    return policy;
+
+FanLoadPolicy_Error:
+
+    FanFreePolicy( policy );
+
+    return NULL;
+}
+
+
+static
+VOID
+FanSetPolicy (
+    __in PFAN_POLICY Policy
+    )
+/*++
+
+Routine Description:
+
+    Puts a new policy in force.  The pointer is swapped with the lock held
+    exclusive, as the driver swaps its extension policy, so no decision
+    sees half of each; the old policy is freed once no one can hold it.
+    What the verdict cache remembers was decided under the old policy, so
+    it is forgotten.
+
+Arguments:
+
+    Policy - the new policy
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PFAN_POLICY old;
+
+    pthread_rwlock_wrlock( &FanData.PolicyLock );
+    old = FanData.Policy;
+    FanData.Policy = Policy;
+    FanVerdictForget();
+    pthread_rwlock_unlock( &FanData.PolicyLock );
+
+    FanFreePolicy( old );
+}
+
+/*************************************************************************
+    Setting up
+*************************************************************************/
+
+static
+BOOLEAN
+FanAddWatch (
+    __in CONST CHAR *Path,
+    __in ULONGLONG PermissionMask
+    )
+/*++
+
+Routine Description:
+
+    Marks the file system a path is on for the permission events and, if
+    the kernel reports them, the notifications, and keeps it open to
+    resolve the file handles the notifications carry.
+
+Arguments:
+
+    Path - any path on the file system
+    PermissionMask - the permission events to ask for
+
+Return Value:
+
+    TRUE if the permission events could be asked for.
+
+--*/
+{
+    struct statfs fileSystem;
+    ULONGLONG mask;
+    int fd;
+
+    if (FanData.WatchCount == FAN_MAX_WATCHES) {
+
+        fprintf( stderr, "fanFilter: at most %d paths can be watched\n", FAN_MAX_WATCHES );
+        return FALSE;
+    }
+
+    if (fanotify_mark( FanData.PermissionFd,
+                       FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                       PermissionMask,
+                       AT_FDCWD,
+                       Path ) != 0) {
+
+        fprintf( stderr, "fanFilter: cannot watch %s: %s\n", Path, strerror( errno ) );
+        return FALSE;
+    }
+
+    if (FanData.NotifyFd < 0) {
+
+        return TRUE;
+    }
+
+    fd = open( Path, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+
+    if (fd < 0 || fstatfs( fd, &fileSystem ) != 0) {
+
+        fprintf( stderr, "fanFilter: cannot open %s: %s\n", Path, strerror( errno ) );
+        return FALSE;
+    }
+
+    //
+    //  FAN_RENAME reports both names of a rename in one event.  Before
+    //  5.17 there are only the two halves.
+    //
+
+    mask = FAN_MODIFY | FAN_DELETE | FAN_ONDIR;
+
+    if (fanotify_mark( FanData.NotifyFd,
+                       FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                       mask | FAN_RENAME,
+                       AT_FDCWD,
+                       Path ) != 0 &&
+        fanotify_mark( FanData.NotifyFd,
+                       FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                       mask | FAN_MOVED_FROM | FAN_MOVED_TO,
+                       AT_FDCWD,
+                       Path ) != 0) {
+
+        fprintf( stderr,
+                 "fanFilter: no notifications for %s: %s\n",
+                 Path,
+                 strerror( errno ) );
+        close( fd );
+        return TRUE;
+    }
+
+    FanData.WatchFds[FanData.WatchCount] = fd;
+    memcpy( &FanData.WatchFsids[FanData.WatchCount],
+            &fileSystem.f_fsid,
+            sizeof(FanData.WatchFsids[0]) );
+    FanData.WatchCount++;
+
+    return TRUE;
+}
+
+
+static
+PVOID
+FanReader (
+    __in PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Reads the permission events, as many as fit in one read, and hands
+    them to the responders all at once.  Events fanFilter causes itself,
+    reading its policy files, are allowed here; they must not wait on the
+    queue, whose responders may be waiting for the policy.
+
+    With no responders the reader answers the events itself.  On a single
+    processor that saves handing each one over to another thread while
+    the process that caused it waits.
+
+Arguments:
+
+    Context - the descriptor that is signalled to stop
+
+Return Value:
+
+    NULL.
+
+--*/
+{
+    int stopFd = (int)(intptr_t) Context;
+    struct fanotify_event_metadata *metadata;
+    struct pollfd fds[2];
+    PFAN_RESPONDER responder = NULL;
+    LARGE_INTEGER time;
+    PVOID buffer;
+    FAN_EVENT events[FAN_READ_SIZE / FAN_EVENT_METADATA_LEN];
+    ULONG count;
+    ssize_t length;
+
+    buffer = malloc( FAN_READ_SIZE );
+
+    if (buffer == NULL) {
+
+        fprintf( stderr, "fanFilter: out of memory\n" );
+        abort();
+    }
+
+    if (FanData.Responders == 0) {
+
+        responder = FanNewResponder();
+    }
+
+    fds[0].fd = FanData.PermissionFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stopFd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+
+        //
+        //  Records are written out whenever there is nothing to read.
+        //
+
+        if (responder != NULL) {
+
+            FanFlushRecords( &responder->Records );
+        }
+
+        if (poll( fds, 2, -1 ) < 0) {
+
+            if (errno == EINTR) {
+
+                continue;
+            }
+
+            break;
+        }
+
+        if (fds[1].revents != 0) {
+
+            break;
+        }
+
+        length = read( FanData.PermissionFd, buffer, FAN_READ_SIZE );
+
+        if (length < 0) {
+
+            if (errno == EAGAIN || errno == EINTR) {
+
+                continue;
+            }
+
+            fprintf( stderr, "fanFilter: reading events: %s\n", strerror( errno ) );
+            break;
+        }
+
+        time = FanSystemTime();
+        count = 0;
+
+        for (metadata = buffer;
+             FAN_EVENT_OK( metadata, length );
+             metadata = FAN_EVENT_NEXT( metadata, length )) {
+
+            if (metadata->vers != FANOTIFY_METADATA_VERSION) {
+
+                fprintf( stderr, "fanFilter: fanotify metadata version mismatch\n" );
+                goto FanReader_Exit;
+            }
+
+            if (metadata->fd < 0) {
+
+                continue;
+            }
+
+            if (metadata->pid == FanData.Self) {
+
+                FanRespond( metadata->fd, TRUE );
+                continue;
+            }
+
+            events[count].Fd = metadata->fd;
+            events[count].Pid = metadata->pid;
+            events[count].Mask = metadata->mask;
+            events[count].Time = time;
+            count++;
+        }
+
+        if (count == 0) {
+
+            continue;
+        }
+
+        if (responder != NULL) {
+
+            FanAnswerEvents( responder, events, count );
+
+        } else {
+
+            FanQueueEvents( events, count );
+        }
+    }
+
+FanReader_Exit:
+
+    if (responder != NULL) {
+
+        FanFlushRecords( &responder->Records );
+        free( responder );
+    }
+
+    free( buffer );
+
+    return NULL;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    CONST CHAR *output = NULL;
+    ULONGLONG permissionMask = FAN_OPEN_PERM;
+    pthread_t reader;
+    pthread_t notifier;
+    pthread_t responders[FAN_MAX_RESPONDERS];
+    PFAN_POLICY policy;
+    BOOLEAN quiet = FALSE;
+    sigset_t signals;
+    ULONG index;
+    int stopFd;
+    int option;
+    int received;
+    long processors;
+
+    FanOptions.ExtensionMode = EXTENSION_AND;
+
+    //
+    //  One processor is left to the reader.
+    //
+
+    processors = sysconf( _SC_NPROCESSORS_ONLN );
+    FanData.Responders = (processors > 1) ? (ULONG)(processors - 1) : 0;
+
+    while ((option = getopt( argc, argv, "f:p:e:x:o:t:rqh" )) != -1) {
+
+        switch (option) {
+
+        case 'f':
+            FanOptions.Folders = optarg;
+            break;
+
+        case 'p':
+            FanOptions.Processes = optarg;
+            break;
+
+        case 'e':
+            FanOptions.Extensions = optarg;
+            break;
+
+        case 'x':
+            if (strcmp( optarg, "and" ) == 0) {
+
+                FanOptions.ExtensionMode = EXTENSION_AND;
+
+            } else if (strcmp( optarg, "or" ) == 0) {
+
+                FanOptions.ExtensionMode = EXTENSION_OR;
+
+            } else {
+
+                FanUsage();
+                return 2;
+            }
+            break;
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case 't':
+            FanData.Responders = (ULONG) strtoul( optarg, NULL, 10 );
+            break;
+
+        case 'r':
+            FanData.CheckReads = TRUE;
+            break;
+
+        case 'q':
+            quiet = TRUE;
+            break;
+
+        default:
+            FanUsage();
+            return 2;
+        }
+    }
+
+    if (FanData.Responders > FAN_MAX_RESPONDERS) {
+
+        fprintf( stderr, "fanFilter: at most %d responders\n", FAN_MAX_RESPONDERS );
+        return 2;
+    }
+
+    //
+    //  The case folding in fanShim.c goes by the locale.  It is set up,
+    //  like everything else that opens files, before any mark is placed.
+    //
+
+    if (setlocale( LC_CTYPE, "" ) == NULL) {
+
+        setlocale( LC_CTYPE, "C.UTF-8" );
+    }
+
+    FanData.Self = getpid();
+    FanData.OutputFd = -1;
+    FanData.NotifyFd = -1;
+    pthread_rwlock_init( &FanData.PolicyLock, NULL );
+    pthread_mutex_init( &FanData.QueueLock, NULL );
+    pthread_cond_init( &FanData.QueueNotEmpty, NULL );
+    pthread_cond_init( &FanData.QueueNotFull, NULL );
+    pthread_mutex_init( &FanData.OutputLock, NULL );
+
+    for (index = 0; index < FAN_VERDICT_LOCKS; index++) {
+
+        pthread_mutex_init( &FanData.VerdictLocks[index], NULL );
+    }
+
+    policy = FanLoadPolicy( &FanOptions );
+
+    if (policy == NULL) {
+
+        return 1;
+    }
+
+    FanSetPolicy( policy );
+
+    if (output != NULL) {
+
+        FanData.OutputFd = (strcmp( output, "-" ) == 0) ?
+                           STDOUT_FILENO :
+                           open( output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+
+        if (FanData.OutputFd < 0) {
+
+            fprintf( stderr, "fanFilter: cannot open %s: %s\n", output, strerror( errno ) );
+            return 1;
+        }
+    }
+
+    //
+    //  SIGPIPE is left to the write that meets a closed pipe, which then
+    //  stops the records.  The others are taken by sigwait below.
+    //
+
+    signal( SIGPIPE, SIG_IGN );
+
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGHUP );
+    sigaddset( &signals, SIGINT );
+    sigaddset( &signals, SIGTERM );
+    pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+    FanData.PermissionFd = fanotify_init( FAN_CLASS_CONTENT | FAN_CLOEXEC | FAN_NONBLOCK,
+                                          O_RDONLY | O_LARGEFILE | O_CLOEXEC );
+
+    if (FanData.PermissionFd < 0) {
+
+        fprintf( stderr, "fanFilter: fanotify_init: %s\n", strerror( errno ) );
+        return 1;
+    }
+
+    FanData.NotifyFd = fanotify_init( FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                                      FAN_CLOEXEC | FAN_NONBLOCK,
+                                      O_RDONLY | O_CLOEXEC );
+
+    if (FanData.NotifyFd < 0) {
+
+        fprintf( stderr,
+                 "fanFilter: no write, delete or rename notifications: %s\n",
+                 strerror( errno ) );
+    }
+
+    if (FanData.CheckReads) {
+
+        permissionMask |= FAN_ACCESS_PERM;
+    }
+
+    if (optind == argc) {
+
+        if (!FanAddWatch( "/", permissionMask )) {
+
+            return 1;
+        }
+    }
+
+    for (; optind < argc; optind++) {
+
+        if (!FanAddWatch( argv[optind], permissionMask )) {
+
+            return 1;
+        }
+    }
+
+    if (FanData.WatchCount == 0 && FanData.NotifyFd >= 0) {
+
+        close( FanData.NotifyFd );
+        FanData.NotifyFd = -1;
+    }
+
+    stopFd = eventfd( 0, EFD_CLOEXEC );
+
+    if (stopFd < 0) {
+
+        fprintf( stderr, "fanFilter: eventfd: %s\n", strerror( errno ) );
+        return 1;
+    }
+
+    for (index = 0; index < FanData.Responders; index++) {
+
+        pthread_create( &responders[index], NULL, FanResponder, (PVOID)(uintptr_t) index );
+    }
+
+    pthread_create( &reader, NULL, FanReader, (PVOID)(intptr_t) stopFd );
+
+    if (FanData.NotifyFd >= 0) {
+
+        pthread_create( &notifier, NULL, FanNotifier, (PVOID)(intptr_t) stopFd );
+    }
+
+    for (;;) {
+
+        if (sigwait( &signals, &received ) != 0) {
+
+            continue;
+        }
+
+        if (received != SIGHUP) {
+
+            break;
+        }
+
+        policy = FanLoadPolicy( &FanOptions );
+
+        if (policy != NULL) {
+
+            FanSetPolicy( policy );
+            fprintf( stderr, "fanFilter: policy reloaded\n" );
+        }
+    }
+
+    //
+    //  The reader stops first so that the responders can empty the queue;
+    //  any event still in the kernel is allowed when the group is closed.
+    //
+
+    eventfd_write( stopFd, 1 );
+    pthread_join( reader, NULL );
+
+    if (FanData.NotifyFd >= 0) {
+
+        pthread_join( notifier, NULL );
+    }
+
+    FanStopResponders();
+
+    for (index = 0; index < FanData.Responders; index++) {
+
+        pthread_join( responders[index], NULL );
+    }
+
+    close( FanData.PermissionFd );
+
+    if (!quiet) {
+
+        fprintf( stderr,
+                 "fanFilter: %llu events, %llu denied, %llu verdict cache hits, %llu notifications\n",
+                 (unsigned long long) FanData.Events,
+                 (unsigned long long) FanData.Denied,
+                 (unsigned long long) FanData.VerdictHits,
+                 (unsigned long long) FanData.Notifications );
+    }
+
+    FanFreePolicy( FanData.Policy );
+
+    return 0;
+}
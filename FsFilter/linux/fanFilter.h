@@ -0,0 +1,377 @@
+/*++
+
+Module Name:
+
+    fanFilter.h
+
+Abstract:
+
+    Header file which contains the structures, type definitions, constants,
+    global variables and function prototypes of fanFilter, the Linux
+    backend of the protection policy.
+
+    fanFilter enforces the policy the driver does, with the driver's own
+    matching in ../filter/Policy.c: a file whose name contains one of the
+    protected folders (and, as set, is or is not of a protected extension)
+    may only be opened by the allowed processes.  It sees the opens as
+    fanotify permission events and answers each one, allowing or denying
+    it.  Reads of files already open can be checked the same way.
+
+    Renames, deletes and writes cannot be refused through fanotify: there
+    are no permission events for them.  They are only seen afterwards, as
+    notifications, and logged when they touch a protected file.  A process
+    that is not allowed still cannot write a protected file, since it
+    cannot open it, but it can rename or delete one.
+
+    What is logged goes out as the driver's LOG_RECORDs, in frames each
+    laid out as a GetMiniSpyLog reply, to a file or pipe that fanCat or
+    anything else built on ../userdll/mspyDecode.c can read.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+#ifndef __FANFILTER_H__
+#define __FANFILTER_H__
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "fltKernel.h"
+#include "minispy.h"
+#include "Policy.h"
+
+//
+//  Records go out in frames of a ULONG byte count followed by that many
+//  bytes of packed LOG_RECORDs, exactly as one GetMiniSpyLog reply holds
+//  them.  A frame is never longer than FAN_REPLY_SIZE, the reply buffer
+//  minispy uses.
+//
+
+#define FAN_REPLY_SIZE              (2 * MAX_RECORD_SIZE)
+
+//
+//  Permission events waiting for a responder.  The reader stops reading
+//  while the queue is full, so the rest wait in the kernel's.
+//
+
+#define FAN_QUEUE_SIZE              4096
+
+//
+//  How many events the reader reads, and a responder takes, at once.
+//
+
+#define FAN_READ_SIZE               (64 * 1024)
+#define FAN_TAKE_EVENTS             64
+
+#define FAN_MAX_RESPONDERS          64
+#define FAN_NAME_CHARS              PATH_MAX
+#define FAN_MAX_WATCHES             16
+
+//
+//  The per file verdict cache, see fanVerdict.c.
+//
+
+#define FAN_VERDICT_SLOTS           4096
+#define FAN_VERDICT_LOCKS           64
+
+//
+//  The policy in force.  It is only ever replaced whole, see FanSetPolicy.
+//
+
+typedef struct _FAN_POLICY {
+
+    PFF_LIST_CONTEXT Folders;
+
+    PFF_LIST_CONTEXT Processes;
+    FF_PROCESS_TABLE ProcessTable;
+
+    //
+    //  EXTENSION_OFF, EXTENSION_AND or EXTENSION_OR, see minispy.h.
+    //
+
+    LONG ExtensionMode;
+    FF_EXTENSION_TABLE Extensions;
+
+} FAN_POLICY, *PFAN_POLICY;
+
+//
+//  A permission event on its way to a responder.
+//
+
+typedef struct _FAN_EVENT {
+
+    int Fd;
+    pid_t Pid;
+    ULONGLONG Mask;
+    LARGE_INTEGER Time;
+
+} FAN_EVENT, *PFAN_EVENT;
+
+//
+//  The records a thread has built and not yet written.  The only normal
+//  records are those of the notifications, all logged by one thread, so
+//  there is one queue, numbered from its own sequence as each processor's
+//  is in the driver.  Denials go on the priority lane.
+//
+
+typedef struct _FAN_RECORDS {
+
+    ULONG Processor;
+    ULONG Sequence;
+    ULONG Used;
+
+    PVOID Buffer[FAN_REPLY_SIZE / sizeof(PVOID)];
+
+} FAN_RECORDS, *PFAN_RECORDS;
+
+//
+//  What a thread needs to answer permission events: its records and
+//  room for the names it looks up.
+//
+
+typedef struct _FAN_RESPONDER {
+
+    FAN_RECORDS Records;
+
+    UNICODE_STRING FileName;
+    UNICODE_STRING ImageName;
+
+    WCHAR FileNameBuffer[FAN_NAME_CHARS];
+    WCHAR ImageNameBuffer[FAN_NAME_CHARS];
+
+} FAN_RESPONDER, *PFAN_RESPONDER;
+
+typedef struct _FAN_VERDICT {
+
+    dev_t Device;
+    ino_t Inode;
+    LONG Generation;
+
+} FAN_VERDICT, *PFAN_VERDICT;
+
+//
+//  Global state, as MiniSpyData is the driver's.
+//
+
+typedef struct _FAN_DATA {
+
+    //
+    //  The fanotify groups: permission events, and the notifications
+    //  of writes, deletes and renames, -1 if the kernel cannot report
+    //  those with names.
+    //
+
+    int PermissionFd;
+    int NotifyFd;
+
+    //
+    //  The watched file systems, opened to resolve the file handles the
+    //  notifications carry.
+    //
+
+    ULONG WatchCount;
+    int WatchFds[FAN_MAX_WATCHES];
+    ULONGLONG WatchFsids[FAN_MAX_WATCHES];
+
+    BOOLEAN CheckReads;
+    pid_t Self;
+
+    //
+    //  The policy, held shared while it is looked at and exclusive while
+    //  it is replaced.
+    //
+
+    pthread_rwlock_t PolicyLock;
+    PFAN_POLICY Policy;
+
+    //
+    //  Permission events between the reader and the responders.
+    //
+
+    pthread_mutex_t QueueLock;
+    pthread_cond_t QueueNotEmpty;
+    pthread_cond_t QueueNotFull;
+    ULONG QueueHead;
+    ULONG QueueCount;
+    BOOLEAN Stopping;
+    FAN_EVENT Queue[FAN_QUEUE_SIZE];
+
+    //
+    //  0 if the reader answers the events itself.
+    //
+
+    ULONG Responders;
+
+    //
+    //  Where the records go, -1 if nowhere, in which case none are built.
+    //  It goes back to -1 if a write fails.  Priority records, denials,
+    //  are numbered from a sequence of their own as in the driver.
+    //
+
+    atomic_int OutputFd;
+    pthread_mutex_t OutputLock;
+    atomic_uint PrioritySequence;
+
+    //
+    //  The per file verdict cache, see fanVerdict.c.
+    //
+
+    atomic_int VerdictGeneration;
+    pthread_mutex_t VerdictLocks[FAN_VERDICT_LOCKS];
+    FAN_VERDICT Verdicts[FAN_VERDICT_SLOTS];
+
+    //
+    //  Counts for the summary printed on exit.
+    //
+
+    atomic_ullong Events;
+    atomic_ullong Denied;
+    atomic_ullong VerdictHits;
+    atomic_ullong Notifications;
+
+} FAN_DATA, *PFAN_DATA;
+
+extern FAN_DATA FanData;
+
+/*************************************************************************
+    Prototypes
+*************************************************************************/
+
+//
+//  fanFilter.c
+//
+
+ULONG
+FanWiden (
+    __in CONST CHAR *Source,
+    __in size_t Length,
+    __out_ecount(DestCount) PWCHAR Dest,
+    __in ULONG DestCount
+    );
+
+BOOLEAN
+FanQueryName (
+    __in CONST CHAR *Link,
+    __out PUNICODE_STRING Name,
+    __in ULONG MaximumCount
+    );
+
+BOOLEAN
+FanProtectedFile (
+    __in PFAN_POLICY Policy,
+    __in PUNICODE_STRING FileName
+    );
+
+BOOLEAN
+FanAllowedProcess (
+    __in PFAN_POLICY Policy,
+    __in pid_t Pid,
+    __out PUNICODE_STRING ImageName,
+    __in ULONG MaximumCount
+    );
+
+//
+//  fanRespond.c
+//
+
+VOID
+FanQueueEvents (
+    __in_ecount(Count) PFAN_EVENT Events,
+    __in ULONG Count
+    );
+
+VOID
+FanRespond (
+    __in int Fd,
+    __in BOOLEAN Allow
+    );
+
+PFAN_RESPONDER
+FanNewResponder (
+    VOID
+    );
+
+VOID
+FanAnswerEvents (
+    __inout PFAN_RESPONDER Responder,
+    __in_ecount(Count) PFAN_EVENT Events,
+    __in ULONG Count
+    );
+
+PVOID
+FanResponder (
+    __in PVOID Context
+    );
+
+VOID
+FanStopResponders (
+    VOID
+    );
+
+//
+//  fanNotify.c
+//
+
+PVOID
+FanNotifier (
+    __in PVOID Context
+    );
+
+//
+//  fanVerdict.c
+//
+
+LONG
+FanVerdictGeneration (
+    VOID
+    );
+
+BOOLEAN
+FanVerdictUnprotected (
+    __in dev_t Device,
+    __in ino_t Inode
+    );
+
+VOID
+FanVerdictRemember (
+    __in dev_t Device,
+    __in ino_t Inode,
+    __in LONG Generation
+    );
+
+VOID
+FanVerdictForget (
+    VOID
+    );
+
+//
+//  fanRecord.c
+//
+
+VOID
+FanLogOperation (
+    __inout PFAN_RECORDS Records,
+    __in UCHAR MajorId,
+    __in CHAR Access,
+    __in CHAR Denied,
+    __in pid_t Pid,
+    __in LARGE_INTEGER Time,
+    __in PUNICODE_STRING FileName,
+    __in_opt PUNICODE_STRING ImageName
+    );
+
+VOID
+FanFlushRecords (
+    __inout PFAN_RECORDS Records
+    );
+
+LARGE_INTEGER
+FanSystemTime (
+    VOID
+    );
+
+#endif //__FANFILTER_H__
@@ -0,0 +1,1693 @@
+/*++
+
+Module Name:
+
+    fanLoad.c
+
+Abstract:
+
+    The workload generator of minispy's /y on the driver built on
+    fanShim.c, so that what the filter costs an operation can be measured
+    on Linux, from one build to the next, without a Windows machine.
+
+    It runs either one of /y's synthetic mixes - office, build and churn,
+    see mspyLoad.h - or a recorded trace: a minispy capture, written by
+    /z or by fanLoad --capture, whose records are turned back into the
+    operations that caused them and issued again, by processes with the
+    same images and users, paced as they were recorded or as fast as
+    they will go.
+
+    Each thread issues its operations through the simulated filter
+    manager and times every one with the monotonic clock.  A consumer
+    thread reads the log meanwhile as minispy does, GetMiniSpyLog then
+    AckMiniSpyLog, walking each batch through ReplayBatch, and counts
+    the records and those the gap records say were lost.
+
+    The report gives the count, the rate and the 50th, 99th and 99.9th
+    percentiles of each kind of operation, and the records a second, in
+    the form /y prints.  With --json the same figures are written in the
+    format Google Benchmark writes, one benchmark to a percentile, so
+    mspyBenchCompare.py can compare two runs.
+
+    Usage: fanLoad [--mix=office|build|churn] [--files=n] [--threads=n]
+                   [--size=bytes] [--dir=path] [--capture=file]
+                   [--json=file]
+           fanLoad --trace=file [--speed=x | --fast] [--threads=n]
+                   [--size=bytes] [--capture=file] [--json=file]
+
+    --dir is relative to the volume, \protected by default; \public is
+    there too and is not protected.  A trace's operations are spread over
+    the threads by process, so each process's operations keep their
+    order.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fanSim.h"
+#include "mspyDecode.h"
+#include "mspyReplay.h"
+
+DRIVER_INITIALIZE DriverEntry;
+
+#define LOAD_SERVICE_KEY        "\\Registry\\Machine\\System\\CurrentControlSet\\Services\\fsFilter"
+
+//
+//  The processes.  The synthetic mixes run as LOAD_WORKER, whose image
+//  is allowed into the protected folder; a trace's processes are given
+//  ids from LOAD_FIRST_TRACED up.
+//
+
+#define LOAD_WORKER             100
+#define LOAD_CONSUMER           300
+#define LOAD_FIRST_TRACED       1000
+
+#define LOAD_MAX_THREADS        64
+#define LOAD_WRITE_SIZE         4096
+#define LOAD_LOG_SIZE           (1024 * 1024)
+#define LOAD_MAX_RECORDS        (16 * 1024)
+#define LOAD_MAX_NAME           512
+
+//
+//  Times are kept in histograms of nanoseconds, four buckets to each
+//  power of two as in mspyLoad.c.  Times of 2^37 ns, over two minutes,
+//  or more all go in the last bucket.
+//
+
+#define LOAD_BUCKETS            144
+
+typedef enum _LOAD_MIX {
+
+    LoadMixOffice = 0,
+    LoadMixBuild,
+    LoadMixChurn,
+    LoadMixTrace,
+    LoadMixes
+
+} LOAD_MIX;
+
+//
+//  LoadDenied times an operation the trace recorded as denied, which is
+//  expected to be denied again; one that is not counts as failed.
+//
+
+typedef enum _LOAD_OPERATION {
+
+    LoadCreate = 0,
+    LoadWrite,
+    LoadRename,
+    LoadDelete,
+    LoadDenied,
+    LoadOperations
+
+} LOAD_OPERATION;
+
+typedef struct _LOAD_SETTINGS {
+
+    CHAR Directory[LOAD_MAX_NAME - 64];
+    LOAD_MIX Mix;
+    ULONG Files;                //  Per thread
+    ULONG Threads;
+    ULONG Size;                 //  Of each file, in bytes
+
+    PCSTR TraceFile;
+    double Speed;               //  0 for as fast as possible
+
+    PCSTR CaptureFile;
+    PCSTR JsonFile;
+
+} LOAD_SETTINGS, *PLOAD_SETTINGS;
+
+typedef struct _LOAD_THREAD {
+
+    PLOAD_SETTINGS Settings;
+    ULONG Index;
+    pthread_t Thread;
+
+    ULONGLONG Count[LoadOperations];
+    ULONG Failed[LoadOperations];
+    ULONGLONG Longest[LoadOperations];
+    ULONG Histogram[LoadOperations][LOAD_BUCKETS];
+
+} LOAD_THREAD, *PLOAD_THREAD;
+
+//
+//  A process of the trace, and one operation it did.  Time is the
+//  record's OriginatingTime, in 100ns units.
+//
+
+typedef struct _LOAD_PROCESS {
+
+    ULONGLONG TracedId;
+    CHAR Image[LOAD_MAX_NAME];
+
+} LOAD_PROCESS, *PLOAD_PROCESS;
+
+typedef struct _LOAD_STEP {
+
+    LONGLONG Time;
+    ULONG Process;
+    UCHAR MajorId;
+    CHAR AccessType;
+    CHAR DeniedAccess;
+    PSTR FileName;
+
+} LOAD_STEP, *PLOAD_STEP;
+
+typedef struct _LOAD_TRACE {
+
+    PLOAD_STEP Steps;
+    ULONG Count;
+    ULONG Capacity;
+
+    PLOAD_PROCESS Processes;
+    ULONG ProcessCount;
+
+    //
+    //  Records that are not operations (gaps, burst alerts) or are not on
+    //  the volume.
+    //
+
+    ULONG Skipped;
+
+} LOAD_TRACE, *PLOAD_TRACE;
+
+typedef struct _LOAD_READER {
+
+    PFLT_PORT Port;
+    FILE *Capture;
+    volatile BOOLEAN Stop;
+    pthread_t Thread;
+
+    LOG_SEQUENCE Sequence;
+    ULONGLONG Records;
+    ULONGLONG Lost;
+
+} LOAD_READER, *PLOAD_READER;
+
+static const PCSTR LoadMixNames[LoadMixes] = { "office", "build", "churn", "trace" };
+
+static const PCSTR LoadOperationNames[LoadOperations] = { "create", "write", "rename", "delete", "denied" };
+
+static LOAD_TRACE Trace;
+
+//
+//  The monotonic clock when the threads started.
+//
+
+static LONGLONG RunStart;
+
+//---------------------------------------------------------------------------
+//  Timing
+//---------------------------------------------------------------------------
+
+static LONGLONG
+LoadNow (
+    VOID
+    )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (LONGLONG) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+static ULONG
+LoadBucket (
+    __in ULONGLONG Time
+    )
+/*++
+
+Routine Description:
+
+    Works out the histogram bucket of a time.  Times under 4 ns have a
+    bucket each; above that each power of two is split in four.
+
+--*/
+{
+    ULONG high;
+
+    if (Time < 4) {
+
+        return (ULONG) Time;
+    }
+
+    if ((Time >> 37) != 0) {
+
+        return LOAD_BUCKETS - 1;
+    }
+
+    high = 63 - __builtin_clzll( Time );
+
+    return 4 + (high - 2) * 4 + (ULONG)((Time >> (high - 2)) & 3);
+}
+
+
+static ULONGLONG
+LoadPercentile (
+    __in_ecount(LOAD_BUCKETS) PULONGLONG Histogram,
+    __in ULONGLONG Count,
+    __in ULONG PerMille,
+    __in ULONGLONG Longest
+    )
+/*++
+
+Routine Description:
+
+    Finds the time under which PerMille thousandths of the operations
+    took: the top of the bucket the percentile falls in, in ns.  Count
+    may not be 0.
+
+--*/
+{
+    ULONGLONG rank = (Count * PerMille + 999) / 1000;
+    ULONGLONG seen = 0;
+    ULONG high;
+    ULONG b;
+
+    for (b = 0; b < LOAD_BUCKETS - 1; b++) {
+
+        seen += Histogram[b];
+
+        if (seen >= rank) {
+
+            if (b < 4) {
+
+                return b;
+            }
+
+            high = (b - 4) / 4 + 2;
+
+            return min( (ULONGLONG)(5 + (b - 4) % 4) << (high - 2), Longest );
+        }
+    }
+
+    return Longest;
+}
+
+
+static VOID
+LoadCount (
+    __inout PLOAD_THREAD Thread,
+    __in LOAD_OPERATION Operation,
+    __in LONGLONG Start,
+    __in BOOLEAN Succeeded
+    )
+/*++
+
+Routine Description:
+
+    Counts an operation that started at Start and has just ended.
+
+--*/
+{
+    ULONGLONG elapsed = (ULONGLONG)(LoadNow() - Start);
+
+    if (!Succeeded) {
+
+        Thread->Failed[Operation]++;
+        return;
+    }
+
+    Thread->Count[Operation]++;
+    Thread->Histogram[Operation][LoadBucket( elapsed )]++;
+
+    if (elapsed > Thread->Longest[Operation]) {
+
+        Thread->Longest[Operation] = elapsed;
+    }
+}
+
+//---------------------------------------------------------------------------
+//  Operations
+//---------------------------------------------------------------------------
+
+static BOOLEAN
+LoadCreateFile (
+    __inout PLOAD_THREAD Thread,
+    __in PCSTR Name,
+    __in ULONG Disposition,
+    __in_bcount(Size) PUCHAR Buffer,
+    __in ULONG Size
+    )
+/*++
+
+Routine Description:
+
+    Opens or creates a file, timed as a create, writes Size bytes to it
+    in LOAD_WRITE_SIZE pieces, each timed as a write, and closes it.
+    Disposition is FILE_OPEN_IF or FILE_OVERWRITE_IF, which are what
+    OPEN_ALWAYS and CREATE_ALWAYS come to.
+
+Return Value:
+
+    TRUE if the file could be created.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+    ULONG_PTR length;
+    ULONG written;
+    LONGLONG start;
+    NTSTATUS status;
+
+    start = LoadNow();
+
+    status = FanSimCreateFile( Name,
+                               FILE_GENERIC_WRITE,
+                               Disposition,
+                               FILE_NON_DIRECTORY_FILE,
+                               &fileObject,
+                               NULL );
+
+    LoadCount( Thread, LoadCreate, start, NT_SUCCESS( status ) );
+
+    if (!NT_SUCCESS( status )) {
+
+        return FALSE;
+    }
+
+    for (written = 0; written < Size; written += (ULONG) length) {
+
+        length = 0;
+        start = LoadNow();
+
+        status = FanSimWrite( fileObject,
+                              FAN_SIM_CURRENT_OFFSET,
+                              Buffer,
+                              min( Size - written, LOAD_WRITE_SIZE ),
+                              &length );
+
+        LoadCount( Thread, LoadWrite, start, NT_SUCCESS( status ) );
+
+        if (!NT_SUCCESS( status ) || length == 0) {
+
+            break;
+        }
+    }
+
+    FanSimCloseFile( fileObject );
+    return TRUE;
+}
+
+
+static BOOLEAN
+LoadRenameFile (
+    __inout PLOAD_THREAD Thread,
+    __in PCSTR Name,
+    __in PCSTR NewName
+    )
+/*++
+
+Routine Description:
+
+    Renames a file over NewName as MoveFileEx with MOVEFILE_REPLACE_EXISTING
+    does: opens it for DELETE, renames it and closes it, all timed as one
+    rename.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+    LONGLONG start;
+    NTSTATUS status;
+
+    start = LoadNow();
+
+    status = FanSimCreateFile( Name, DELETE, FILE_OPEN, FILE_NON_DIRECTORY_FILE, &fileObject, NULL );
+
+    if (NT_SUCCESS( status )) {
+
+        status = FanSimRename( fileObject, NewName, TRUE );
+        FanSimCloseFile( fileObject );
+    }
+
+    LoadCount( Thread, LoadRename, start, NT_SUCCESS( status ) );
+
+    return NT_SUCCESS( status );
+}
+
+
+static BOOLEAN
+LoadDeleteFile (
+    __inout PLOAD_THREAD Thread,
+    __in PCSTR Name
+    )
+/*++
+
+Routine Description:
+
+    Deletes a file as DeleteFile does, timed as one delete.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+    LONGLONG start;
+    NTSTATUS status;
+
+    start = LoadNow();
+
+    status = FanSimCreateFile( Name, DELETE, FILE_OPEN, FILE_NON_DIRECTORY_FILE, &fileObject, NULL );
+
+    if (NT_SUCCESS( status )) {
+
+        status = FanSimDelete( fileObject );
+        FanSimCloseFile( fileObject );
+    }
+
+    LoadCount( Thread, LoadDelete, start, NT_SUCCESS( status ) );
+
+    return NT_SUCCESS( status );
+}
+
+
+static VOID
+LoadEnsureFile (
+    __in PCSTR Name
+    )
+/*++
+
+Routine Description:
+
+    Creates Name if it is not there, untimed, so a traced rename or
+    delete has something to work on.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+
+    if (NT_SUCCESS( FanSimCreateFile( Name,
+                                      FILE_GENERIC_WRITE,
+                                      FILE_OPEN_IF,
+                                      FILE_NON_DIRECTORY_FILE,
+                                      &fileObject,
+                                      NULL ) )) {
+
+        FanSimCloseFile( fileObject );
+    }
+}
+
+
+static VOID
+LoadDeny (
+    __inout PLOAD_THREAD Thread,
+    __in PLOAD_STEP Step
+    )
+/*++
+
+Routine Description:
+
+    Tries again what a traced denial tried.  A denied rename is a file
+    from \public renamed to the recorded name; a denied create, write,
+    delete or set information is an open of the recorded name for that
+    access.  A write denied on a handle opened before the driver loaded
+    cannot be had again, so it is tried as an open for writing, which
+    the same check refuses.
+
+--*/
+{
+    CHAR source[LOAD_MAX_NAME];
+    PFILE_OBJECT fileObject = NULL;
+    ACCESS_MASK access;
+    LONGLONG start;
+    NTSTATUS status;
+
+    if (Step->DeniedAccess == 'R') {
+
+        snprintf( source, sizeof(source), "\\public\\fanload-%u.tmp", Step->Process );
+        LoadEnsureFile( source );
+
+        start = LoadNow();
+
+        status = FanSimCreateFile( source, DELETE, FILE_OPEN, FILE_NON_DIRECTORY_FILE, &fileObject, NULL );
+
+        if (NT_SUCCESS( status )) {
+
+            status = FanSimRename( fileObject, Step->FileName, TRUE );
+            FanSimCloseFile( fileObject );
+        }
+
+    } else {
+
+        access = (Step->DeniedAccess == 'C' || Step->DeniedAccess == 'W') ? FILE_GENERIC_WRITE : DELETE;
+
+        start = LoadNow();
+
+        status = FanSimCreateFile( Step->FileName,
+                                   access,
+                                   Step->DeniedAccess == 'C' ? FILE_OPEN_IF : FILE_OPEN,
+                                   FILE_NON_DIRECTORY_FILE,
+                                   &fileObject,
+                                   NULL );
+
+        if (NT_SUCCESS( status )) {
+
+            FanSimCloseFile( fileObject );
+        }
+    }
+
+    LoadCount( Thread, LoadDenied, start, status == STATUS_ACCESS_DENIED );
+}
+
+//---------------------------------------------------------------------------
+//  The threads
+//---------------------------------------------------------------------------
+
+static VOID
+LoadRunMix (
+    __inout PLOAD_THREAD Thread
+    )
+/*++
+
+Routine Description:
+
+    Runs a synthetic mix for one thread, as mspyLoad.c's LoadThread does.
+
+--*/
+{
+    PLOAD_SETTINGS settings = Thread->Settings;
+    UCHAR buffer[LOAD_WRITE_SIZE];
+    CHAR name[LOAD_MAX_NAME];
+    CHAR other[LOAD_MAX_NAME];
+    ULONG i;
+
+    memset( buffer, 'y', sizeof(buffer) );
+
+    for (i = 0; i < settings->Files; i++) {
+
+        snprintf( name, sizeof(name), "%s\\fanload-%u-%u.dat", settings->Directory, Thread->Index, i );
+        snprintf( other, sizeof(other), "%s\\fanload-%u-%u.tmp", settings->Directory, Thread->Index, i );
+
+        switch (settings->Mix) {
+
+        case LoadMixOffice:
+
+            if (LoadCreateFile( Thread, name, FILE_OPEN_IF, buffer, settings->Size ) &&
+                LoadCreateFile( Thread, other, FILE_OVERWRITE_IF, buffer, settings->Size )) {
+
+                if (!LoadRenameFile( Thread, other, name )) {
+
+                    LoadDeleteFile( Thread, other );
+                }
+            }
+            break;
+
+        case LoadMixBuild:
+
+            LoadCreateFile( Thread, name, FILE_OVERWRITE_IF, buffer, settings->Size );
+            break;
+
+        case LoadMixChurn:
+
+            if (LoadCreateFile( Thread, name, FILE_OVERWRITE_IF, buffer, min( settings->Size, LOAD_WRITE_SIZE ) )) {
+
+                LoadDeleteFile( Thread, LoadRenameFile( Thread, name, other ) ? other : name );
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    //
+    //  Clean up after the office and build workloads; churn has deleted
+    //  its files already.
+    //
+
+    if (settings->Mix != LoadMixChurn) {
+
+        for (i = 0; i < settings->Files; i++) {
+
+            snprintf( name, sizeof(name), "%s\\fanload-%u-%u.dat", settings->Directory, Thread->Index, i );
+            LoadDeleteFile( Thread, name );
+        }
+    }
+}
+
+
+static VOID
+LoadRunTrace (
+    __inout PLOAD_THREAD Thread
+    )
+/*++
+
+Routine Description:
+
+    Issues this thread's share of the trace: the steps of every process
+    whose index comes to this thread, in the order they were recorded,
+    each as the process that did it and no sooner than it came, at
+    Speed, after the first step of the trace.
+
+--*/
+{
+    PLOAD_SETTINGS settings = Thread->Settings;
+    UCHAR buffer[LOAD_WRITE_SIZE];
+    CHAR other[LOAD_MAX_NAME];
+    struct timespec due;
+    PLOAD_STEP step;
+    LONGLONG when;
+    ULONG process = MAXULONG;
+    ULONG i;
+
+    memset( buffer, 'y', sizeof(buffer) );
+
+    for (i = 0; i < Trace.Count; i++) {
+
+        step = &Trace.Steps[i];
+
+        if (step->Process % settings->Threads != Thread->Index) {
+
+            continue;
+        }
+
+        if (step->Process != process) {
+
+            process = step->Process;
+            FanSimSetProcess( LOAD_FIRST_TRACED + process );
+        }
+
+        if (settings->Speed > 0) {
+
+            when = RunStart + (LONGLONG)((step->Time - Trace.Steps[0].Time) * 100 / settings->Speed);
+            due.tv_sec = when / 1000000000LL;
+            due.tv_nsec = when % 1000000000LL;
+
+            while (clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL ) != 0) {
+            }
+        }
+
+        if (step->AccessType == 'A') {
+
+            LoadDeny( Thread, step );
+
+        } else if (step->MajorId == IRP_MJ_WRITE) {
+
+            //
+            //  A write may be logged as 'D', see fanSim.c, so writes go by
+            //  the operation.
+            //
+
+            LoadCreateFile( Thread, step->FileName, FILE_OPEN_IF, buffer, settings->Size );
+
+        } else if (step->AccessType == 'R') {
+
+            snprintf( other, sizeof(other), "%s~", step->FileName );
+            LoadEnsureFile( step->FileName );
+            LoadRenameFile( Thread, step->FileName, other );
+
+        } else if (step->AccessType == 'D' || step->AccessType == 'd') {
+
+            LoadEnsureFile( step->FileName );
+            LoadDeleteFile( Thread, step->FileName );
+        }
+    }
+}
+
+
+static PVOID
+LoadThread (
+    __in PVOID Parameter
+    )
+{
+    PLOAD_THREAD thread = Parameter;
+
+    FanSimSetProcessor( thread->Index );
+
+    if (thread->Settings->Mix == LoadMixTrace) {
+
+        LoadRunTrace( thread );
+
+    } else {
+
+        FanSimSetProcess( LOAD_WORKER );
+        LoadRunMix( thread );
+    }
+
+    return NULL;
+}
+
+//---------------------------------------------------------------------------
+//  The consumer
+//---------------------------------------------------------------------------
+
+static VOID
+LoadTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    PLOAD_READER consumer = Context;
+
+    if ((LogRecord->RecordType & ~RECORD_TYPE_FLAG_MASK) == RECORD_TYPE_GAP) {
+
+        consumer->Lost += ((PRECORD_GAP) LogRecord->Name)->Count;
+    }
+}
+
+
+static PVOID
+LoadConsume (
+    __in PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Reads the log as minispy does until told to stop and the log has
+    stayed empty for a while, so records the coalescer held back are
+    counted too.
+
+--*/
+{
+    PLOAD_READER consumer = Parameter;
+    UCHAR message[FIELD_OFFSET(COMMAND_MESSAGE, Data) + sizeof(MINISPY_ACK)];
+    PCOMMAND_MESSAGE command = (PCOMMAND_MESSAGE) message;
+    PVOID buffer;
+    ULONG returned = 0;
+    ULONG used;
+    ULONG idle = 0;
+    NTSTATUS status;
+
+    buffer = aligned_alloc( sizeof(PVOID), LOAD_LOG_SIZE );
+
+    FanSimSetProcess( LOAD_CONSUMER );
+
+    memset( message, 0, sizeof(message) );
+    command->Command = GetMiniSpyLog;
+
+    status = FanSimSendMessage( consumer->Port,
+                                command,
+                                FIELD_OFFSET(COMMAND_MESSAGE, Data),
+                                buffer,
+                                LOAD_LOG_SIZE,
+                                &returned );
+
+    for (;;) {
+
+        if (status == STATUS_NO_MORE_ENTRIES || (NT_SUCCESS( status ) && returned == 0)) {
+
+            if (consumer->Stop && ++idle == 10) {
+
+                break;
+            }
+
+            usleep( 1000 );
+
+            command->Command = GetMiniSpyLog;
+
+            status = FanSimSendMessage( consumer->Port,
+                                        command,
+                                        FIELD_OFFSET(COMMAND_MESSAGE, Data),
+                                        buffer,
+                                        LOAD_LOG_SIZE,
+                                        &returned );
+            continue;
+        }
+
+        if (!NT_SUCCESS( status )) {
+
+            fprintf( stderr, "fanLoad: reading the log: %08x\n", (unsigned) status );
+            break;
+        }
+
+        idle = 0;
+
+        if (consumer->Capture != NULL) {
+
+            CaptureWriteBatch( consumer->Capture, LoadNow(), buffer, returned );
+        }
+
+        consumer->Records += ReplayBatch( &consumer->Sequence,
+                                          buffer,
+                                          returned,
+                                          LoadTakeRecord,
+                                          consumer,
+                                          &used );
+
+        command->Command = AckMiniSpyLog;
+        memcpy( ((PMINISPY_ACK) command->Data)->Sequence,
+                consumer->Sequence.Received,
+                sizeof(consumer->Sequence.Received) );
+
+        status = FanSimSendMessage( consumer->Port,
+                                    command,
+                                    sizeof(message),
+                                    buffer,
+                                    LOAD_LOG_SIZE,
+                                    &returned );
+    }
+
+    SequenceReport( &consumer->Sequence );
+
+    free( buffer );
+    return NULL;
+}
+
+//---------------------------------------------------------------------------
+//  Traces
+//---------------------------------------------------------------------------
+
+static PCSTR
+LoadVolumePath (
+    __in PMSPY_STRING_VIEW View,
+    __out_bcount(Length) PSTR Path,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Copies a logged name to Path relative to the volume, without the
+    device name or drive letter in front of it.
+
+Return Value:
+
+    Path, or NULL if the name is not on the volume.
+
+--*/
+{
+    PCSTR name = View->Buffer;
+    ULONG nameLength = View->Length;
+    ULONG prefix = 0;
+
+    if (nameLength >= sizeof(FAN_SIM_VOLUME_NAME) - 1 &&
+        strncasecmp( name, FAN_SIM_VOLUME_NAME, sizeof(FAN_SIM_VOLUME_NAME) - 1 ) == 0) {
+
+        prefix = sizeof(FAN_SIM_VOLUME_NAME) - 1;
+
+    } else if (nameLength >= sizeof(FAN_SIM_DOS_NAME) - 1 &&
+               strncasecmp( name, FAN_SIM_DOS_NAME, sizeof(FAN_SIM_DOS_NAME) - 1 ) == 0) {
+
+        prefix = sizeof(FAN_SIM_DOS_NAME) - 1;
+    }
+
+    if (nameLength <= prefix || name[prefix] != '\\' ||
+        strncmp( name + prefix, "\\Device\\", 8 ) == 0 ||
+        nameLength - prefix >= Length - 1) {
+
+        return NULL;
+    }
+
+    memcpy( Path, name + prefix, nameLength - prefix );
+    Path[nameLength - prefix] = '\0';
+
+    return Path;
+}
+
+
+static ULONG
+LoadTraceProcess (
+    __in PMSPY_BATCH_RECORD Record,
+    __in PCSTR User
+    )
+/*++
+
+Routine Description:
+
+    Finds the trace's process that logged Record, adding it to the
+    simulated system the first time it is seen.
+
+--*/
+{
+    PLOAD_PROCESS process;
+    CHAR image[LOAD_MAX_NAME];
+    ULONG i;
+
+    for (i = 0; i < Trace.ProcessCount; i++) {
+
+        if (Trace.Processes[i].TracedId == Record->ProcessId) {
+
+            return i;
+        }
+    }
+
+    if (LoadVolumePath( &Record->Process, image, sizeof(image) ) == NULL) {
+
+        snprintf( image, sizeof(image), "\\Windows\\traced-%llu.exe", (unsigned long long) Record->ProcessId );
+    }
+
+    Trace.Processes = realloc( Trace.Processes, (Trace.ProcessCount + 1) * sizeof(LOAD_PROCESS) );
+    process = &Trace.Processes[Trace.ProcessCount];
+
+    process->TracedId = Record->ProcessId;
+    strcpy( process->Image, image );
+
+    FanSimAddProcess( LOAD_FIRST_TRACED + Trace.ProcessCount, image, User );
+
+    return Trace.ProcessCount++;
+}
+
+
+static VOID
+LoadTraceRecord (
+    __in PMSPY_BATCH_RECORD Record
+    )
+{
+    CHAR name[LOAD_MAX_NAME];
+    CHAR user[128] = "S-1-5-21-1-1001";
+    PLOAD_STEP step;
+
+    if (Record->Gap != NULL ||
+        Record->AccessType == 0 ||
+        Record->AccessType == 'B' ||
+        Record->AccessType == 'b' ||
+        LoadVolumePath( &Record->FileName, name, sizeof(name) ) == NULL) {
+
+        Trace.Skipped++;
+        return;
+    }
+
+    if (Record->User.Length > 0 && Record->User.Length < sizeof(user)) {
+
+        memcpy( user, Record->User.Buffer, Record->User.Length );
+        user[Record->User.Length] = '\0';
+    }
+
+    if (Trace.Count == Trace.Capacity) {
+
+        Trace.Capacity = max( Trace.Capacity * 2, 1024 );
+        Trace.Steps = realloc( Trace.Steps, Trace.Capacity * sizeof(LOAD_STEP) );
+    }
+
+    step = &Trace.Steps[Trace.Count++];
+
+    step->Time = Record->OriginatingTime.QuadPart;
+    step->Process = LoadTraceProcess( Record, user );
+    step->MajorId = Record->CallbackMajorId;
+    step->AccessType = Record->AccessType;
+    step->DeniedAccess = Record->DeniedAccess;
+    step->FileName = strdup( name );
+}
+
+
+static int
+LoadCompareSteps (
+    const void *Left,
+    const void *Right
+    )
+{
+    const LOAD_STEP *left = Left;
+    const LOAD_STEP *right = Right;
+
+    return (left->Time > right->Time) - (left->Time < right->Time);
+}
+
+
+static BOOLEAN
+LoadReadTrace (
+    __in PCSTR FileName
+    )
+/*++
+
+Routine Description:
+
+    Reads a capture into Trace, ordered by when the operations started:
+    the filter's queues each send their records in order, but not in
+    order with one another.
+
+--*/
+{
+    CAPTURE_FILE_HEADER header;
+    CAPTURE_BATCH_HEADER batchHeader;
+    MSPY_BATCH batch;
+    PVOID buffer;
+    FILE *file;
+    ULONG i;
+
+    file = fopen( FileName, "rb" );
+
+    if (file == NULL) {
+
+        perror( FileName );
+        return FALSE;
+    }
+
+    if (!CaptureReadHeader( file, &header )) {
+
+        fprintf( stderr, "fanLoad: %s is not a capture\n", FileName );
+        fclose( file );
+        return FALSE;
+    }
+
+    buffer = aligned_alloc( sizeof(PVOID), LOAD_LOG_SIZE );
+    memset( &batch, 0, sizeof(batch) );
+
+    while (CaptureReadBatch( file, &batchHeader, buffer, LOAD_LOG_SIZE )) {
+
+        if (!MspyDecodeBatch( buffer,
+                              batchHeader.Length,
+                              MSPY_FIELD_FILE_NAME | MSPY_FIELD_PROCESS | MSPY_FIELD_USER,
+                              MspyEncodingUtf8,
+                              NULL,
+                              &batch )) {
+
+            continue;
+        }
+
+        for (i = 0; i < batch.Count; i++) {
+
+            LoadTraceRecord( &batch.Records[i] );
+        }
+    }
+
+    MspyResetBatch( &batch );
+    free( buffer );
+    fclose( file );
+
+    qsort( Trace.Steps, Trace.Count, sizeof(LOAD_STEP), LoadCompareSteps );
+
+    return TRUE;
+}
+
+
+static VOID
+LoadFreeTrace (
+    VOID
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Trace.Count; i++) {
+
+        free( Trace.Steps[i].FileName );
+    }
+
+    free( Trace.Steps );
+    free( Trace.Processes );
+    memset( &Trace, 0, sizeof(Trace) );
+}
+
+//---------------------------------------------------------------------------
+//  The volume
+//---------------------------------------------------------------------------
+
+static VOID
+LoadCreateDirectories (
+    __in PCSTR Name,
+    __in BOOLEAN Last
+    )
+/*++
+
+Routine Description:
+
+    Creates the directories on the way to Name, and Name itself if Last.
+
+--*/
+{
+    CHAR path[LOAD_MAX_NAME];
+    PFILE_OBJECT fileObject;
+    PCHAR separator;
+
+    snprintf( path, sizeof(path), "%s", Name );
+
+    for (separator = strchr( path + 1, '\\' ); ; separator = strchr( separator + 1, '\\' )) {
+
+        if (separator == NULL && !Last) {
+
+            break;
+        }
+
+        if (separator != NULL) {
+
+            *separator = '\0';
+        }
+
+        if (NT_SUCCESS( FanSimCreateFile( path,
+                                          FILE_LIST_DIRECTORY,
+                                          FILE_OPEN_IF,
+                                          FILE_DIRECTORY_FILE,
+                                          &fileObject,
+                                          NULL ) )) {
+
+            FanSimCloseFile( fileObject );
+        }
+
+        if (separator == NULL) {
+
+            break;
+        }
+
+        *separator = '\\';
+    }
+}
+
+
+static VOID
+LoadPrepareVolume (
+    __in PLOAD_SETTINGS Settings
+    )
+/*++
+
+Routine Description:
+
+    Lays the volume out as the system process, before the driver loads:
+    the protected and public folders, the workload's directory and, for a
+    trace, every directory and file the trace names, so opens find them.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+    ULONG i;
+
+    FanSimSetProcess( FAN_SIM_SYSTEM_PROCESS );
+
+    LoadCreateDirectories( "\\protected", TRUE );
+    LoadCreateDirectories( "\\public", TRUE );
+
+    if (Settings->Mix != LoadMixTrace) {
+
+        LoadCreateDirectories( Settings->Directory, TRUE );
+        return;
+    }
+
+    for (i = 0; i < Trace.Count; i++) {
+
+        LoadCreateDirectories( Trace.Steps[i].FileName, FALSE );
+
+        if (NT_SUCCESS( FanSimCreateFile( Trace.Steps[i].FileName,
+                                          FILE_GENERIC_WRITE,
+                                          FILE_OPEN_IF,
+                                          FILE_NON_DIRECTORY_FILE,
+                                          &fileObject,
+                                          NULL ) )) {
+
+            FanSimCloseFile( fileObject );
+        }
+    }
+}
+
+//---------------------------------------------------------------------------
+//  The report
+//---------------------------------------------------------------------------
+
+static VOID
+LoadSum (
+    __in PLOAD_SETTINGS Settings,
+    __in_ecount(Settings->Threads) PLOAD_THREAD Threads,
+    __in ULONG Operation,
+    __out_ecount(LOAD_BUCKETS) PULONGLONG Histogram,
+    __out PULONGLONG Count,
+    __out PULONGLONG Longest,
+    __out PULONG Failed
+    )
+{
+    ULONG t;
+    ULONG b;
+
+    memset( Histogram, 0, LOAD_BUCKETS * sizeof(ULONGLONG) );
+    *Count = 0;
+    *Longest = 0;
+    *Failed = 0;
+
+    for (t = 0; t < Settings->Threads; t++) {
+
+        *Count += Threads[t].Count[Operation];
+        *Failed += Threads[t].Failed[Operation];
+        *Longest = max( *Longest, Threads[t].Longest[Operation] );
+
+        for (b = 0; b < LOAD_BUCKETS; b++) {
+
+            Histogram[b] += Threads[t].Histogram[Operation][b];
+        }
+    }
+}
+
+
+static VOID
+LoadReport (
+    __in PLOAD_SETTINGS Settings,
+    __in_ecount(Settings->Threads) PLOAD_THREAD Threads,
+    __in LONGLONG Elapsed,
+    __in PLOAD_READER Consumer
+    )
+/*++
+
+Routine Description:
+
+    Prints what the threads counted, in the form mspyLoad.c's LoadReport
+    prints it.
+
+--*/
+{
+    ULONGLONG histogram[LOAD_BUCKETS];
+    ULONGLONG count;
+    ULONGLONG longest;
+    ULONG failed;
+    double seconds = Elapsed / 1e9;
+    ULONG op;
+
+    if (Settings->Mix == LoadMixTrace) {
+
+        printf( "    Trace %s, %u operations by %u processes on %u threads, ",
+                Settings->TraceFile, Trace.Count, Trace.ProcessCount, Settings->Threads );
+
+        if (Settings->Speed > 0) {
+
+            printf( "%gx, %.3f s\n", Settings->Speed, seconds );
+
+        } else {
+
+            printf( "as fast as possible, %.3f s\n", seconds );
+        }
+
+    } else {
+
+        printf( "    Workload %s, %u files of %u KB on each of %u threads, %.3f s\n",
+                LoadMixNames[Settings->Mix],
+                Settings->Files,
+                Settings->Size / 1024,
+                Settings->Threads,
+                seconds );
+    }
+
+    printf( "    operation      count      ops/s   p50 us   p99 us p99.9 us  max us  failed\n" );
+
+    for (op = 0; op < LoadOperations; op++) {
+
+        LoadSum( Settings, Threads, op, histogram, &count, &longest, &failed );
+
+        if (count == 0 && failed == 0) {
+
+            continue;
+        }
+
+        if (count == 0) {
+
+            printf( "    %-9s %10llu %10s %8s %8s %8s %7s %7u\n",
+                    LoadOperationNames[op], (unsigned long long) count, "-", "-", "-", "-", "-", failed );
+            continue;
+        }
+
+        printf( "    %-9s %10llu %10.0f %8.1f %8.1f %8.1f %7.0f %7u\n",
+                LoadOperationNames[op],
+                (unsigned long long) count,
+                count / seconds,
+                LoadPercentile( histogram, count, 500, longest ) / 1e3,
+                LoadPercentile( histogram, count, 990, longest ) / 1e3,
+                LoadPercentile( histogram, count, 999, longest ) / 1e3,
+                longest / 1e3,
+                failed );
+    }
+
+    printf( "    records   %10llu %10.0f   lost %llu\n",
+            (unsigned long long) Consumer->Records,
+            Consumer->Records / seconds,
+            (unsigned long long) Consumer->Lost );
+}
+
+
+static VOID
+LoadJsonEntry (
+    __in FILE *File,
+    __in PCSTR Mix,
+    __in PCSTR Name,
+    __in ULONGLONG Iterations,
+    __in double Time,
+    __in double ItemsPerSecond,
+    __in BOOLEAN First
+    )
+{
+    fprintf( File,
+             "%s"
+             "    {\n"
+             "      \"name\": \"%s/%s\",\n"
+             "      \"run_type\": \"iteration\",\n"
+             "      \"iterations\": %llu,\n"
+             "      \"real_time\": %.3f,\n"
+             "      \"cpu_time\": %.3f,\n"
+             "      \"time_unit\": \"ns\",\n"
+             "      \"items_per_second\": %.1f\n"
+             "    }",
+             First ? "" : ",\n",
+             Mix,
+             Name,
+             (unsigned long long) Iterations,
+             Time,
+             Time,
+             ItemsPerSecond );
+}
+
+
+static BOOLEAN
+LoadWriteJson (
+    __in PLOAD_SETTINGS Settings,
+    __in_ecount(Settings->Threads) PLOAD_THREAD Threads,
+    __in LONGLONG Elapsed,
+    __in PLOAD_READER Consumer,
+    __in PCSTR Executable
+    )
+/*++
+
+Routine Description:
+
+    Writes the report as Google Benchmark writes its JSON: each
+    percentile of each operation is a benchmark whose time is the
+    percentile, and "records" is one whose time is that of a record.
+
+--*/
+{
+    static const ULONG perMille[] = { 500, 990, 999 };
+    static const PCSTR percentiles[] = { "p50", "p99", "p99.9" };
+    ULONGLONG histogram[LOAD_BUCKETS];
+    ULONGLONG count;
+    ULONGLONG longest;
+    ULONG failed;
+    CHAR name[64];
+    CHAR date[64];
+    CHAR host[256] = "";
+    time_t now = time( NULL );
+    struct tm local;
+    double seconds = Elapsed / 1e9;
+    PCSTR mix = LoadMixNames[Settings->Mix];
+    BOOLEAN first = TRUE;
+    FILE *file;
+    ULONG op;
+    ULONG p;
+
+    file = fopen( Settings->JsonFile, "w" );
+
+    if (file == NULL) {
+
+        perror( Settings->JsonFile );
+        return FALSE;
+    }
+
+    localtime_r( &now, &local );
+    strftime( date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &local );
+    gethostname( host, sizeof(host) - 1 );
+
+    fprintf( file, "{\n  \"context\": {\n" );
+    fprintf( file, "    \"date\": \"%s\",\n", date );
+    fprintf( file, "    \"host_name\": \"%s\",\n", host );
+    fprintf( file, "    \"executable\": \"%s\",\n", Executable );
+    fprintf( file, "    \"num_cpus\": %ld,\n", sysconf( _SC_NPROCESSORS_ONLN ) );
+    fprintf( file, "    \"pinned_cpu\": -1,\n" );
+    fprintf( file, "    \"threads\": %u,\n", Settings->Threads );
+#ifdef __OPTIMIZE__
+    fprintf( file, "    \"library_build_type\": \"release\"\n" );
+#else
+    fprintf( file, "    \"library_build_type\": \"debug\"\n" );
+#endif
+    fprintf( file, "  },\n  \"benchmarks\": [\n" );
+
+    for (op = 0; op < LoadOperations; op++) {
+
+        LoadSum( Settings, Threads, op, histogram, &count, &longest, &failed );
+
+        if (count == 0) {
+
+            continue;
+        }
+
+        for (p = 0; p < sizeof(perMille) / sizeof(perMille[0]); p++) {
+
+            snprintf( name, sizeof(name), "%s/%s", LoadOperationNames[op], percentiles[p] );
+
+            LoadJsonEntry( file,
+                           mix,
+                           name,
+                           count,
+                           (double) LoadPercentile( histogram, count, perMille[p], longest ),
+                           count / seconds,
+                           first );
+            first = FALSE;
+        }
+    }
+
+    if (Consumer->Records != 0) {
+
+        LoadJsonEntry( file,
+                       mix,
+                       "records",
+                       Consumer->Records,
+                       Elapsed / (double) Consumer->Records,
+                       Consumer->Records / seconds,
+                       first );
+    }
+
+    fprintf( file, "\n  ]\n}\n" );
+
+    return fclose( file ) == 0;
+}
+
+//---------------------------------------------------------------------------
+//  Main
+//---------------------------------------------------------------------------
+
+static BOOLEAN
+LoadStart (
+    __in PLOAD_SETTINGS Settings,
+    __out PLOAD_READER Consumer
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver, protecting \protected for images named a.exe with
+    room for many more records than the default 500, connects minispy's
+    consumer and starts it reading.
+
+--*/
+{
+    MINISPY_CONNECT connect;
+    LONGLONG started;
+
+    memset( Consumer, 0, sizeof(*Consumer) );
+    memset( &connect, 0, sizeof(connect) );
+
+    FanSimAddProcess( LOAD_WORKER, "\\Program Files\\App\\a.exe", "S-1-5-21-1-1001" );
+    FanSimAddProcess( LOAD_CONSUMER, "\\Windows\\minispy.exe", "S-1-5-21-1-500" );
+
+    FanSimSetRegistryString( LOAD_SERVICE_KEY, "ProtectedDir", FAN_SIM_VOLUME_NAME "\\protected\\" );
+    FanSimSetRegistryString( LOAD_SERVICE_KEY, "OpenProccess", "a.exe" );
+    FanSimSetRegistryDword( LOAD_SERVICE_KEY, "MaxRecords", LOAD_MAX_RECORDS );
+
+    LoadPrepareVolume( Settings );
+
+    if (!NT_SUCCESS( FanSimLoad( DriverEntry, LOAD_SERVICE_KEY ) )) {
+
+        fprintf( stderr, "fanLoad: the driver did not load\n" );
+        return FALSE;
+    }
+
+    FanSimSetProcess( LOAD_CONSUMER );
+
+    if (!NT_SUCCESS( FanSimConnect( "\\MiniSpyPort", &connect, sizeof(connect), &Consumer->Port ) )) {
+
+        fprintf( stderr, "fanLoad: could not connect to the driver\n" );
+        return FALSE;
+    }
+
+    if (Settings->CaptureFile != NULL) {
+
+        Consumer->Capture = fopen( Settings->CaptureFile, "wb" );
+
+        //
+        //  The monotonic clock in ns times the batches; the capture
+        //  starts at the system time, in 100ns units since 1601.
+        //
+
+        started = ((LONGLONG) time( NULL ) + 11644473600LL) * 10000000LL;
+
+        if (Consumer->Capture == NULL ||
+            !CaptureWriteHeader( Consumer->Capture, 1000000000LL, started )) {
+
+            perror( Settings->CaptureFile );
+            return FALSE;
+        }
+    }
+
+    SequenceReset( &Consumer->Sequence );
+
+    return pthread_create( &Consumer->Thread, NULL, LoadConsume, Consumer ) == 0;
+}
+
+
+static VOID
+LoadStop (
+    __inout PLOAD_READER Consumer
+    )
+{
+    Consumer->Stop = TRUE;
+    pthread_join( Consumer->Thread, NULL );
+
+    if (Consumer->Capture != NULL) {
+
+        fclose( Consumer->Capture );
+    }
+
+    FanSimSetProcess( LOAD_CONSUMER );
+    FanSimDisconnect( Consumer->Port );
+
+    FanSimSetProcess( FAN_SIM_SYSTEM_PROCESS );
+    FanSimUnload();
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    LOAD_SETTINGS settings;
+    LOAD_READER consumer;
+    PLOAD_THREAD threads;
+    LONGLONG elapsed;
+    BOOLEAN valid = TRUE;
+    PCSTR value;
+    ULONG i;
+
+    memset( &settings, 0, sizeof(settings) );
+    strcpy( settings.Directory, "\\protected" );
+    settings.Mix = LoadMixOffice;
+    settings.Files = 1000;
+    settings.Threads = 4;
+    settings.Size = 64 * 1024;
+    settings.Speed = 1;
+
+    for (i = 1; i < (ULONG) argc && valid; i += 1) {
+
+        value = strchr( argv[i], '=' );
+        value = value ? value + 1 : "";
+
+        if (strncmp( argv[i], "--mix=", 6 ) == 0) {
+
+            for (settings.Mix = 0; settings.Mix < LoadMixTrace; settings.Mix++) {
+
+                if (strcmp( value, LoadMixNames[settings.Mix] ) == 0) {
+
+                    break;
+                }
+            }
+
+            valid = settings.Mix < LoadMixTrace;
+
+        } else if (strncmp( argv[i], "--files=", 8 ) == 0) {
+
+            settings.Files = (ULONG) strtoul( value, NULL, 10 );
+            valid = settings.Files > 0;
+
+        } else if (strncmp( argv[i], "--threads=", 10 ) == 0) {
+
+            settings.Threads = (ULONG) strtoul( value, NULL, 10 );
+            valid = settings.Threads > 0 && settings.Threads <= LOAD_MAX_THREADS;
+
+        } else if (strncmp( argv[i], "--size=", 7 ) == 0) {
+
+            settings.Size = (ULONG) strtoul( value, NULL, 10 );
+
+        } else if (strncmp( argv[i], "--dir=", 6 ) == 0) {
+
+            valid = value[0] == '\\' && strlen( value ) < sizeof(settings.Directory);
+
+            if (valid) {
+
+                strcpy( settings.Directory, value );
+            }
+
+        } else if (strncmp( argv[i], "--trace=", 8 ) == 0) {
+
+            settings.TraceFile = value;
+
+        } else if (strncmp( argv[i], "--speed=", 8 ) == 0) {
+
+            settings.Speed = atof( value );
+            valid = settings.Speed > 0;
+
+        } else if (strcmp( argv[i], "--fast" ) == 0) {
+
+            settings.Speed = 0;
+
+        } else if (strncmp( argv[i], "--capture=", 10 ) == 0) {
+
+            settings.CaptureFile = value;
+
+        } else if (strncmp( argv[i], "--json=", 7 ) == 0) {
+
+            settings.JsonFile = value;
+
+        } else {
+
+            valid = FALSE;
+        }
+    }
+
+    if (!valid) {
+
+        fprintf( stderr,
+                 "usage: fanLoad [--mix=office|build|churn] [--files=n] [--threads=n] [--size=bytes]\n"
+                 "               [--dir=path] [--capture=file] [--json=file]\n"
+                 "       fanLoad --trace=file [--speed=x | --fast] [--threads=n] [--size=bytes]\n"
+                 "               [--capture=file] [--json=file]\n" );
+        return 2;
+    }
+
+    if (settings.TraceFile != NULL) {
+
+        settings.Mix = LoadMixTrace;
+
+        if (!LoadReadTrace( settings.TraceFile )) {
+
+            return 1;
+        }
+
+        if (Trace.Count == 0) {
+
+            fprintf( stderr, "fanLoad: %s has no operations to replay\n", settings.TraceFile );
+            return 1;
+        }
+    }
+
+    if (!LoadStart( &settings, &consumer )) {
+
+        return 1;
+    }
+
+    threads = calloc( settings.Threads, sizeof(LOAD_THREAD) );
+
+    RunStart = LoadNow();
+
+    for (i = 0; i < settings.Threads; i++) {
+
+        threads[i].Settings = &settings;
+        threads[i].Index = i;
+
+        pthread_create( &threads[i].Thread, NULL, LoadThread, &threads[i] );
+    }
+
+    for (i = 0; i < settings.Threads; i++) {
+
+        pthread_join( threads[i].Thread, NULL );
+    }
+
+    elapsed = LoadNow() - RunStart;
+
+    LoadStop( &consumer );
+
+    LoadReport( &settings, threads, elapsed, &consumer );
+
+    if (settings.JsonFile != NULL &&
+        !LoadWriteJson( &settings, threads, elapsed, &consumer, argv[0] )) {
+
+        return 1;
+    }
+
+    free( threads );
+    LoadFreeTrace();
+
+    return 0;
+}
@@ -0,0 +1,400 @@
+/*++
+
+Module Name:
+
+    fanNotify.c
+
+Abstract:
+
+    This module logs the writes, deletes and renames of protected files.
+
+    fanotify has no permission events for these, so they cannot be
+    refused; they are only reported once done, with the directory as a
+    file handle and the name in it.  A process that is not allowed cannot
+    write a protected file, since it cannot open it, but it can delete or
+    rename one, and that is logged like anything else.
+
+    The records are those the driver logs for the same operations: 'W'
+    on IRP_MJ_WRITE, 'D' and 'R' on IRP_MJ_SET_INFORMATION.  The kernel
+    merges writes to a file that follow one another, so there is one 'W'
+    for them where the driver would have logged each.  The process image
+    is read once the notification is, and is left empty if the process
+    has exited by then; the record still has its id.
+
+    A rename may move a file into a protected folder, so each one, and
+    each lost notification, forgets the verdict cache.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+
+#include "fanFilter.h"
+
+//
+//  What the notifier needs to resolve and log an event.
+//
+
+typedef struct _FAN_NOTIFIER {
+
+    FAN_RECORDS Records;
+
+    UNICODE_STRING FileName;
+    UNICODE_STRING OtherName;
+    UNICODE_STRING ImageName;
+
+    WCHAR FileNameBuffer[FAN_NAME_CHARS];
+    WCHAR OtherNameBuffer[FAN_NAME_CHARS];
+    WCHAR ImageNameBuffer[FAN_NAME_CHARS];
+
+} FAN_NOTIFIER, *PFAN_NOTIFIER;
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+static
+BOOLEAN
+FanResolveName (
+    __in struct fanotify_event_info_fid *Info,
+    __out PUNICODE_STRING Name
+    )
+/*++
+
+Routine Description:
+
+    Turns the directory handle and name of a notification into a path.
+
+Arguments:
+
+    Info - the directory and name
+    Name - receives the path, in a buffer of FAN_NAME_CHARS
+
+Return Value:
+
+    TRUE if the directory could still be found.
+
+--*/
+{
+    struct file_handle *handle = (struct file_handle *) Info->handle;
+    CONST CHAR *name = (CONST CHAR *) handle->f_handle + handle->handle_bytes;
+    CHAR link[32];
+    ULONG index;
+    ULONG count;
+    int fd;
+
+    Name->Length = 0;
+
+    for (index = 0; index < FanData.WatchCount; index++) {
+
+        if (memcmp( &FanData.WatchFsids[index], &Info->fsid, sizeof(Info->fsid) ) == 0) {
+
+            break;
+        }
+    }
+
+    if (index == FanData.WatchCount) {
+
+        return FALSE;
+    }
+
+    fd = open_by_handle_at( FanData.WatchFds[index], handle, O_PATH | O_CLOEXEC );
+
+    if (fd < 0) {
+
+        return FALSE;
+    }
+
+    snprintf( link, sizeof(link), "/proc/self/fd/%d", fd );
+
+    if (!FanQueryName( link, Name, FAN_NAME_CHARS - 1 )) {
+
+        close( fd );
+        return FALSE;
+    }
+
+    close( fd );
+
+    if (strcmp( name, "." ) == 0) {
+
+        return TRUE;
+    }
+
+    count = Name->Length / sizeof(WCHAR);
+
+    if (count == 0 || Name->Buffer[count - 1] != L'/') {
+
+        Name->Buffer[count++] = L'/';
+    }
+
+    count += FanWiden( name, strlen( name ), Name->Buffer + count, FAN_NAME_CHARS - count );
+    Name->Length = (USHORT)(count * sizeof(WCHAR));
+
+    return TRUE;
+}
+
+
+static
+VOID
+FanLogNotification (
+    __inout PFAN_NOTIFIER Notifier,
+    __in struct fanotify_event_metadata *Metadata,
+    __in LARGE_INTEGER Time
+    )
+/*++
+
+Routine Description:
+
+    Logs a notification if it touches a protected file.  A rename is
+    logged under its old name if that is protected and its new one if
+    not.
+
+Arguments:
+
+    Notifier - the notifier's state
+    Metadata - the notification
+    Time - when it was read
+
+Return Value:
+
+    None.
+
+--*/
+{
+    struct fanotify_event_info_header *info;
+    struct fanotify_event_info_fid *name = NULL;
+    struct fanotify_event_info_fid *oldName = NULL;
+    struct fanotify_event_info_fid *newName = NULL;
+    PUNICODE_STRING fileName = NULL;
+    ULONG offset;
+    UCHAR majorId;
+    CHAR access;
+
+    if (Metadata->mask & (FAN_RENAME | FAN_MOVED_FROM | FAN_MOVED_TO)) {
+
+        FanVerdictForget();
+    }
+
+    //
+    //  Nothing else is done unless there is somewhere to log to.
+    //
+
+    if (Metadata->pid == FanData.Self || atomic_load( &FanData.OutputFd ) < 0) {
+
+        return;
+    }
+
+    for (offset = sizeof(*Metadata);
+         offset + sizeof(*info) <= Metadata->event_len;
+         offset += info->len) {
+
+        info = (struct fanotify_event_info_header *) Add2Ptr( Metadata, offset );
+
+        if (info->len < sizeof(*info) || offset + info->len > Metadata->event_len) {
+
+            return;
+        }
+
+        switch (info->info_type) {
+
+        case FAN_EVENT_INFO_TYPE_DFID_NAME:
+            name = (struct fanotify_event_info_fid *) info;
+            break;
+
+        case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+            oldName = (struct fanotify_event_info_fid *) info;
+            break;
+
+        case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+            newName = (struct fanotify_event_info_fid *) info;
+            break;
+        }
+    }
+
+    if (Metadata->mask & FAN_RENAME) {
+
+        name = oldName;
+
+    } else {
+
+        newName = NULL;
+    }
+
+    pthread_rwlock_rdlock( &FanData.PolicyLock );
+
+    if (name != NULL &&
+        FanResolveName( name, &Notifier->FileName ) &&
+        FanProtectedFile( FanData.Policy, &Notifier->FileName )) {
+
+        fileName = &Notifier->FileName;
+
+    } else if (newName != NULL &&
+               FanResolveName( newName, &Notifier->OtherName ) &&
+               FanProtectedFile( FanData.Policy, &Notifier->OtherName )) {
+
+        fileName = &Notifier->OtherName;
+    }
+
+    if (fileName == NULL) {
+
+        pthread_rwlock_unlock( &FanData.PolicyLock );
+        return;
+    }
+
+    //
+    //  Only the image name is wanted.  Whether the process is allowed is
+    //  left to whoever reads the record, since the operation is done.
+    //
+
+    (VOID) FanAllowedProcess( FanData.Policy,
+                              Metadata->pid,
+                              &Notifier->ImageName,
+                              FAN_NAME_CHARS );
+
+    pthread_rwlock_unlock( &FanData.PolicyLock );
+
+    if (Metadata->mask & FAN_MODIFY) {
+
+        majorId = IRP_MJ_WRITE;
+        access = 'W';
+
+    } else if (Metadata->mask & FAN_DELETE) {
+
+        majorId = IRP_MJ_SET_INFORMATION;
+        access = 'D';
+
+    } else {
+
+        majorId = IRP_MJ_SET_INFORMATION;
+        access = 'R';
+    }
+
+    FanLogOperation( &Notifier->Records,
+                     majorId,
+                     access,
+                     0,
+                     Metadata->pid,
+                     Time,
+                     fileName,
+                     &Notifier->ImageName );
+}
+
+
+PVOID
+FanNotifier (
+    __in PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    The notifier thread: reads the notifications and logs them until told
+    to stop, writing out its records whenever it has nothing to read.
+
+Arguments:
+
+    Context - the descriptor that is signalled to stop
+
+Return Value:
+
+    NULL.
+
+--*/
+{
+    int stopFd = (int)(intptr_t) Context;
+    struct fanotify_event_metadata *metadata;
+    struct pollfd fds[2];
+    PFAN_NOTIFIER notifier;
+    PVOID buffer;
+    LARGE_INTEGER time;
+    ssize_t length;
+
+    notifier = calloc( 1, sizeof(FAN_NOTIFIER) );
+    buffer = malloc( FAN_READ_SIZE );
+
+    if (notifier == NULL || buffer == NULL) {
+
+        fprintf( stderr, "fanFilter: out of memory\n" );
+        abort();
+    }
+
+    notifier->FileName.Buffer = notifier->FileNameBuffer;
+    notifier->OtherName.Buffer = notifier->OtherNameBuffer;
+    notifier->ImageName.Buffer = notifier->ImageNameBuffer;
+
+    fds[0].fd = FanData.NotifyFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stopFd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+
+        FanFlushRecords( &notifier->Records );
+
+        if (poll( fds, 2, -1 ) < 0) {
+
+            if (errno == EINTR) {
+
+                continue;
+            }
+
+            break;
+        }
+
+        if (fds[1].revents != 0) {
+
+            break;
+        }
+
+        length = read( FanData.NotifyFd, buffer, FAN_READ_SIZE );
+
+        if (length < 0) {
+
+            if (errno == EAGAIN || errno == EINTR) {
+
+                continue;
+            }
+
+            fprintf( stderr, "fanFilter: reading notifications: %s\n", strerror( errno ) );
+            break;
+        }
+
+        time = FanSystemTime();
+
+        for (metadata = buffer;
+             FAN_EVENT_OK( metadata, length );
+             metadata = FAN_EVENT_NEXT( metadata, length )) {
+
+            atomic_fetch_add( &FanData.Notifications, 1 );
+
+            if (metadata->mask & FAN_Q_OVERFLOW) {
+
+                FanVerdictForget();
+                continue;
+            }
+
+            FanLogNotification( notifier, metadata, time );
+        }
+    }
+
+    FanFlushRecords( &notifier->Records );
+
+    free( buffer );
+    free( notifier );
+
+    return NULL;
+}
@@ -0,0 +1,373 @@
+/*++
+
+Module Name:
+
+    fanRecord.c
+
+Abstract:
+
+    This module builds the LOG_RECORDs fanFilter logs and writes them out.
+
+    A record is laid out as the driver lays it out: RECORD_DATA, then the
+    file name, the process image and the user, each ended by '\n' and
+    padded with spaces to pointer alignment as SpySetRecordName pads them.
+    The user is a SID string, S-1-22-1-UID, which is how Samba and Windows
+    name a Unix user.  Records are packed into a buffer of FAN_REPLY_SIZE
+    bytes, the size of minispy's reply buffer, and the buffer is written
+    out as one frame when it is full, when a denial is put in it or when
+    its thread has nothing else to do.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "fanFilter.h"
+
+//
+//  Seconds from 1601, where a FILETIME starts, to 1970, in 100ns units.
+//
+
+#define FAN_EPOCH_DIFFERENCE        116444736000000000LL
+
+#define FAN_SID_CHARS               32
+
+#define FanLineSpace(_length) \
+    ROUND_TO_SIZE( (_length) + sizeof( UNICODE_NULL ), sizeof( PVOID ) )
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+LARGE_INTEGER
+FanSystemTime (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Returns the time as KeQuerySystemTime does: 100ns units since 1601,
+    UTC.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    The time.
+
+--*/
+{
+    struct timespec now;
+    LARGE_INTEGER time;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+
+    time.QuadPart = (LONGLONG) now.tv_sec * 10000000 + now.tv_nsec / 100 +
+                    FAN_EPOCH_DIFFERENCE;
+
+    return time;
+}
+
+
+static
+VOID
+FanSetRecordName (
+    __inout PLOG_RECORD LogRecord,
+    __in PUNICODE_STRING Name
+    )
+/*++
+
+Routine Description:
+
+    Appends a name line to a record as SpySetRecordName does, cut short
+    if the record has no room for all of it.
+
+Arguments:
+
+    LogRecord - the record
+    Name - the name
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PCHAR copyPointer = (PCHAR) LogRecord + LogRecord->Length;
+    ULONG remaining = MAX_LOG_RECORD_LENGTH - LogRecord->Length;
+    ULONG nameCopyLength;
+    ULONG padded;
+
+    if (remaining < sizeof( PVOID ) + sizeof( UNICODE_NULL )) {
+
+        return;
+    }
+
+    remaining -= sizeof( PVOID ) + sizeof( UNICODE_NULL );
+
+    nameCopyLength = (Name->Length > remaining) ? remaining : Name->Length;
+    nameCopyLength &= ~(sizeof( WCHAR ) - 1);
+
+    memcpy( copyPointer, Name->Buffer, nameCopyLength );
+    copyPointer += nameCopyLength;
+
+    *((PWCHAR) copyPointer) = L'\n';
+    copyPointer += sizeof( WCHAR );
+    nameCopyLength += sizeof( WCHAR );
+
+    for (padded = nameCopyLength;
+         padded < ROUND_TO_SIZE( nameCopyLength, sizeof( PVOID ) );
+         padded += sizeof( WCHAR )) {
+
+        *((PWCHAR) copyPointer) = L' ';
+        copyPointer += sizeof( WCHAR );
+    }
+
+    LogRecord->Length += padded;
+}
+
+
+static
+VOID
+FanQueryUser (
+    __in pid_t Pid,
+    __out PUNICODE_STRING User
+    )
+/*++
+
+Routine Description:
+
+    Names the user a process runs as by a SID string, S-1-22-1-UID.
+
+Arguments:
+
+    Pid - the process
+    User - receives the SID string, in a buffer of FAN_SID_CHARS the
+        caller supplies, empty if the process is gone
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CHAR path[32];
+    CHAR sid[FAN_SID_CHARS];
+    struct stat process;
+    int length;
+
+    User->Length = 0;
+
+    snprintf( path, sizeof(path), "/proc/%d", (int) Pid );
+
+    if (stat( path, &process ) != 0) {
+
+        return;
+    }
+
+    length = snprintf( sid, sizeof(sid), "S-1-22-1-%u", (unsigned) process.st_uid );
+
+    User->Length = (USHORT)(FanWiden( sid, length, User->Buffer, FAN_SID_CHARS ) * sizeof(WCHAR));
+}
+
+
+VOID
+FanLogOperation (
+    __inout PFAN_RECORDS Records,
+    __in UCHAR MajorId,
+    __in CHAR Access,
+    __in CHAR Denied,
+    __in pid_t Pid,
+    __in LARGE_INTEGER Time,
+    __in PUNICODE_STRING FileName,
+    __in_opt PUNICODE_STRING ImageName
+    )
+/*++
+
+Routine Description:
+
+    Logs an operation on a protected file.  A denial, with 'A' as its
+    access type and what was tried in Reserved[1], goes on the priority
+    lane as SpyLogDenial sends it, and is written out at once.
+
+Arguments:
+
+    Records - the calling thread's records
+    MajorId - the IRP major function the driver would have seen
+    Access - the access type, see RECORD_DATA.Reserved
+    Denied - what a denied operation tried to do, 0 for any other
+    Pid - the process
+    Time - when the operation was seen
+    FileName - the path of the file
+    ImageName - the path of the process executable, if known
+
+Return Value:
+
+    None.
+
+--*/
+{
+    WCHAR sidBuffer[FAN_SID_CHARS];
+    UNICODE_STRING user;
+    UNICODE_STRING noImage = { 0 };
+    PLOG_RECORD logRecord;
+    ULONG length;
+
+    if (atomic_load( &FanData.OutputFd ) < 0) {
+
+        return;
+    }
+
+    if (ImageName == NULL) {
+
+        ImageName = &noImage;
+    }
+
+    user.Buffer = sidBuffer;
+    user.MaximumLength = sizeof(sidBuffer);
+    FanQueryUser( Pid, &user );
+
+    length = sizeof(LOG_RECORD) +
+             FanLineSpace( FileName->Length ) +
+             FanLineSpace( ImageName->Length ) +
+             FanLineSpace( user.Length );
+
+    if (length > MAX_LOG_RECORD_LENGTH) {
+
+        length = MAX_LOG_RECORD_LENGTH;
+    }
+
+    if (Records->Used + length > sizeof(Records->Buffer)) {
+
+        FanFlushRecords( Records );
+    }
+
+    logRecord = (PLOG_RECORD) Add2Ptr( Records->Buffer, Records->Used );
+
+    memset( logRecord, 0, sizeof(LOG_RECORD) );
+    logRecord->Length = sizeof(LOG_RECORD);
+
+    if (Access == 'A') {
+
+        logRecord->RecordType = RECORD_TYPE_NORMAL | RECORD_TYPE_FLAG_PRIORITY;
+        logRecord->SequenceNumber = atomic_fetch_add( &FanData.PrioritySequence, 1 );
+        logRecord->Processor = 0;
+
+    } else {
+
+        logRecord->RecordType = RECORD_TYPE_NORMAL;
+        logRecord->SequenceNumber = Records->Sequence++;
+        logRecord->Processor = Records->Processor;
+    }
+
+    logRecord->Data.OriginatingTime = Time;
+    logRecord->Data.CompletionTime = Time;
+    logRecord->Data.ProcessId = (FILE_ID) Pid;
+    logRecord->Data.CallbackMajorId = MajorId;
+    logRecord->Data.Reserved[0] = Access;
+    logRecord->Data.Reserved[1] = Denied;
+
+    FanSetRecordName( logRecord, FileName );
+    FanSetRecordName( logRecord, ImageName );
+    FanSetRecordName( logRecord, &user );
+
+    Records->Used += logRecord->Length;
+
+    if (Access == 'A') {
+
+        FanFlushRecords( Records );
+    }
+}
+
+
+VOID
+FanFlushRecords (
+    __inout PFAN_RECORDS Records
+    )
+/*++
+
+Routine Description:
+
+    Writes out the records a thread has built as one frame.  If the write
+    fails, as it does once the reader of a pipe has gone, no more records
+    are built.
+
+Arguments:
+
+    Records - the thread's records
+
+Return Value:
+
+    None.
+
+--*/
+{
+    struct iovec frame[2];
+    ULONG length = Records->Used;
+    ssize_t written;
+    int fd;
+
+    if (length == 0) {
+
+        return;
+    }
+
+    Records->Used = 0;
+
+    frame[0].iov_base = &length;
+    frame[0].iov_len = sizeof(length);
+    frame[1].iov_base = Records->Buffer;
+    frame[1].iov_len = length;
+
+    pthread_mutex_lock( &FanData.OutputLock );
+
+    fd = atomic_load( &FanData.OutputFd );
+
+    while (fd >= 0 && (frame[0].iov_len > 0 || frame[1].iov_len > 0)) {
+
+        written = writev( fd,
+                          frame[0].iov_len ? &frame[0] : &frame[1],
+                          frame[0].iov_len ? 2 : 1 );
+
+        if (written < 0) {
+
+            if (errno == EINTR) {
+
+                continue;
+            }
+
+            fprintf( stderr, "fanFilter: writing records: %s\n", strerror( errno ) );
+            atomic_store( &FanData.OutputFd, -1 );
+            break;
+        }
+
+        if ((size_t) written >= frame[0].iov_len) {
+
+            written -= frame[0].iov_len;
+            frame[0].iov_len = 0;
+            frame[1].iov_base = (PCHAR) frame[1].iov_base + written;
+            frame[1].iov_len -= written;
+
+        } else {
+
+            frame[0].iov_base = (PCHAR) frame[0].iov_base + written;
+            frame[0].iov_len -= written;
+        }
+    }
+
+    pthread_mutex_unlock( &FanData.OutputLock );
+}
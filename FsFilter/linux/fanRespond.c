@@ -0,0 +1,436 @@
+/*++
+
+Module Name:
+
+    fanRespond.c
+
+Abstract:
+
+    This module answers the permission events.
+
+    The reader in fanFilter.c queues the events it reads in one go, and
+    FanData.Responders threads take them off the queue, up to
+    FAN_TAKE_EVENTS at a time, so the queue's lock is taken once a batch
+    on either side rather than once an event.  The process that opened
+    or is reading the file waits until its event is answered; the others
+    do not wait on it, since each event is answered on its own.
+
+    An open is decided as PreCreate decides it in the driver: a protected
+    file may only be opened by an allowed process.  Reads, when they are
+    checked at all, are decided the same way, but a read of a file known
+    not to be protected is let through at once, see fanVerdict.c.
+    Denials are logged.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+
+#include "fanFilter.h"
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+FanQueueEvents (
+    __in_ecount(Count) PFAN_EVENT Events,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Queues the permission events the reader read, waiting for room.
+
+Arguments:
+
+    Events - the events
+    Count - how many
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG index;
+
+    pthread_mutex_lock( &FanData.QueueLock );
+
+    for (index = 0; index < Count; index++) {
+
+        while (FanData.QueueCount == FAN_QUEUE_SIZE) {
+
+            pthread_cond_broadcast( &FanData.QueueNotEmpty );
+            pthread_cond_wait( &FanData.QueueNotFull, &FanData.QueueLock );
+        }
+
+        FanData.Queue[(FanData.QueueHead + FanData.QueueCount) % FAN_QUEUE_SIZE] = Events[index];
+        FanData.QueueCount++;
+    }
+
+    if (Count > 1) {
+
+        pthread_cond_broadcast( &FanData.QueueNotEmpty );
+
+    } else {
+
+        pthread_cond_signal( &FanData.QueueNotEmpty );
+    }
+
+    pthread_mutex_unlock( &FanData.QueueLock );
+}
+
+
+static
+ULONG
+FanTakeEvents (
+    __out_ecount(FAN_TAKE_EVENTS) PFAN_EVENT Events,
+    __inout PFAN_RECORDS Records
+    )
+/*++
+
+Routine Description:
+
+    Takes up to FAN_TAKE_EVENTS events off the queue, leaving some for the
+    other responders if there are few.  Before waiting for more, the
+    records built so far are written out.
+
+Arguments:
+
+    Events - receives the events
+    Records - the calling responder's records
+
+Return Value:
+
+    How many events were taken, 0 once the responders are to stop and the
+    queue is empty.
+
+--*/
+{
+    ULONG count;
+    ULONG index;
+
+    pthread_mutex_lock( &FanData.QueueLock );
+
+    while (FanData.QueueCount == 0 && !FanData.Stopping) {
+
+        if (Records->Used > 0) {
+
+            pthread_mutex_unlock( &FanData.QueueLock );
+            FanFlushRecords( Records );
+            pthread_mutex_lock( &FanData.QueueLock );
+            continue;
+        }
+
+        pthread_cond_wait( &FanData.QueueNotEmpty, &FanData.QueueLock );
+    }
+
+    count = (FanData.QueueCount + FanData.Responders - 1) / FanData.Responders;
+
+    if (count > FAN_TAKE_EVENTS) {
+
+        count = FAN_TAKE_EVENTS;
+    }
+
+    for (index = 0; index < count; index++) {
+
+        Events[index] = FanData.Queue[FanData.QueueHead];
+        FanData.QueueHead = (FanData.QueueHead + 1) % FAN_QUEUE_SIZE;
+    }
+
+    FanData.QueueCount -= count;
+
+    if (count > 0) {
+
+        pthread_cond_signal( &FanData.QueueNotFull );
+    }
+
+    pthread_mutex_unlock( &FanData.QueueLock );
+
+    return count;
+}
+
+
+VOID
+FanRespond (
+    __in int Fd,
+    __in BOOLEAN Allow
+    )
+/*++
+
+Routine Description:
+
+    Answers a permission event and closes its descriptor.
+
+Arguments:
+
+    Fd - the descriptor of the event
+    Allow - whether the operation may go on
+
+Return Value:
+
+    None.
+
+--*/
+{
+    struct fanotify_response response;
+
+    response.fd = Fd;
+    response.response = Allow ? FAN_ALLOW : FAN_DENY;
+
+    if (write( FanData.PermissionFd, &response, sizeof(response) ) != sizeof(response)) {
+
+        fprintf( stderr, "fanFilter: answering event: %m\n" );
+    }
+
+    close( Fd );
+}
+
+
+static
+BOOLEAN
+FanDecide (
+    __inout PFAN_RESPONDER Responder,
+    __in PFAN_EVENT Event
+    )
+/*++
+
+Routine Description:
+
+    Decides a permission event.
+
+Arguments:
+
+    Responder - the calling thread's records and name buffers
+    Event - the event
+
+Return Value:
+
+    TRUE if the operation may go on.
+
+--*/
+{
+    PUNICODE_STRING fileName = &Responder->FileName;
+    PUNICODE_STRING imageName = &Responder->ImageName;
+    BOOLEAN read = (BOOLEAN)((Event->Mask & FAN_ACCESS_PERM) != 0);
+    BOOLEAN protect;
+    BOOLEAN allow;
+    struct stat file = { 0 };
+    CHAR link[32];
+    LONG generation = 0;
+
+    //
+    //  Without the reads to check, nothing could use a verdict, so the
+    //  file is not even looked at.
+    //
+
+    if (FanData.CheckReads) {
+
+        if (fstat( Event->Fd, &file ) != 0) {
+
+            file.st_ino = 0;
+
+        } else if (read && FanVerdictUnprotected( file.st_dev, file.st_ino )) {
+
+            atomic_fetch_add( &FanData.VerdictHits, 1 );
+            return TRUE;
+        }
+
+        generation = FanVerdictGeneration();
+    }
+
+    snprintf( link, sizeof(link), "/proc/self/fd/%d", Event->Fd );
+
+    if (!FanQueryName( link, fileName, FAN_NAME_CHARS )) {
+
+        return TRUE;
+    }
+
+    pthread_rwlock_rdlock( &FanData.PolicyLock );
+
+    protect = FanProtectedFile( FanData.Policy, fileName );
+
+    if (!protect) {
+
+        pthread_rwlock_unlock( &FanData.PolicyLock );
+
+        if (FanData.CheckReads && file.st_ino != 0) {
+
+            FanVerdictRemember( file.st_dev, file.st_ino, generation );
+        }
+
+        return TRUE;
+    }
+
+    allow = FanAllowedProcess( FanData.Policy, Event->Pid, imageName, FAN_NAME_CHARS );
+
+    pthread_rwlock_unlock( &FanData.PolicyLock );
+
+    if (!allow) {
+
+        atomic_fetch_add( &FanData.Denied, 1 );
+
+        FanLogOperation( &Responder->Records,
+                         read ? IRP_MJ_READ : IRP_MJ_CREATE,
+                         'A',
+                         read ? 'S' : 'C',
+                         Event->Pid,
+                         Event->Time,
+                         fileName,
+                         imageName );
+    }
+
+    return allow;
+}
+
+
+PFAN_RESPONDER
+FanNewResponder (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Sets up what a thread needs to answer permission events.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    The responder, to be freed.  fanFilter cannot go on without it.
+
+--*/
+{
+    PFAN_RESPONDER responder;
+
+    responder = calloc( 1, sizeof(FAN_RESPONDER) );
+
+    if (responder == NULL) {
+
+        fprintf( stderr, "fanFilter: out of memory\n" );
+        abort();
+    }
+
+    responder->FileName.Buffer = responder->FileNameBuffer;
+    responder->ImageName.Buffer = responder->ImageNameBuffer;
+
+    return responder;
+}
+
+
+VOID
+FanAnswerEvents (
+    __inout PFAN_RESPONDER Responder,
+    __in_ecount(Count) PFAN_EVENT Events,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Decides and answers permission events.
+
+Arguments:
+
+    Responder - the calling thread's records and name buffers
+    Events - the events
+    Count - how many
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG index;
+
+    atomic_fetch_add( &FanData.Events, Count );
+
+    for (index = 0; index < Count; index++) {
+
+        FanRespond( Events[index].Fd, FanDecide( Responder, &Events[index] ) );
+    }
+}
+
+
+PVOID
+FanResponder (
+    __in PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    A responder thread: takes events off the queue and answers them until
+    told to stop.
+
+Arguments:
+
+    Context - the responder's index
+
+Return Value:
+
+    NULL.
+
+--*/
+{
+    FAN_EVENT events[FAN_TAKE_EVENTS];
+    PFAN_RESPONDER responder;
+    ULONG count;
+
+    (VOID) Context;
+
+    responder = FanNewResponder();
+
+    while ((count = FanTakeEvents( events, &responder->Records )) > 0) {
+
+        FanAnswerEvents( responder, events, count );
+    }
+
+    FanFlushRecords( &responder->Records );
+    free( responder );
+
+    return NULL;
+}
+
+
+VOID
+FanStopResponders (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Tells the responders to stop once the queue is empty.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    pthread_mutex_lock( &FanData.QueueLock );
+    FanData.Stopping = TRUE;
+    pthread_cond_broadcast( &FanData.QueueNotEmpty );
+    pthread_mutex_unlock( &FanData.QueueLock );
+}
@@ -0,0 +1,7913 @@
+/*++
+
+Module Name:
+
+    fanShim.c
+
+Abstract:
+
+    This module implements the kernel and filter manager routines declared
+    in shim/fltKernel.h and shim/Ntstrsafe.h.
+
+    fanFilter only links the string and SID routines ../filter/Policy.c
+    calls.  fanSim links the rest as well and runs the whole driver on
+    them, as fanSim.h describes: pool, lookaside lists, spin locks and
+    resources, timers, processes and tokens, the registry, devices and
+    the one volume, the filter manager's callback dispatch, names and
+    contexts, and communication ports.
+
+    Where the kernel would bug check on a misuse - a spin lock taken
+    twice, pool freed twice or paged pool touched at DISPATCH_LEVEL -
+    these routines fail an assertion instead.  Where the driver may leak
+    without the kernel noticing - pool, references and handles - they keep
+    count, and FanSimReportLeaks tells.
+
+    Case is folded by the C library's towupper, which follows the locale
+    the program sets up; the kernel folds with its own upcase table, so
+    the two can differ outside the characters both know.
+
+    Nothing here uses L"" literals, which are 16 or 32 bits wide depending
+    on the build; names the routines look for are compared as ASCII.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <wctype.h>
+
+#include "fltKernel.h"
+#include "Ntstrsafe.h"
+#include "fanSim.h"
+
+//
+//  Pool tags of the allocations made here on the driver's behalf.
+//
+
+#define FAN_STRING_TAG              'grtS'
+#define FAN_TOKEN_TAG               'oTeS'
+#define FAN_NAME_TAG                'nfMF'
+#define FAN_MDL_TAG                 ' ldM'
+#define FAN_SECURITY_TAG            'dSlF'
+
+//
+//  What a thread of the simulation is: the IRQL it runs at, the processor
+//  and process it runs as (NULL being the system process) and the
+//  operations it is in the middle of, innermost first.
+//
+
+struct _FAN_OPERATION;
+
+typedef struct _FAN_THREAD_STATE {
+
+    KIRQL Irql;
+    ULONG Processor;
+    PEPROCESS Process;
+    struct _FAN_OPERATION *Operation;
+
+} FAN_THREAD_STATE;
+
+static __thread FAN_THREAD_STATE FanThread;
+
+static pthread_once_t FanOnce = PTHREAD_ONCE_INIT;
+
+static
+VOID
+FanInitialize (
+    VOID
+    );
+
+#define FanEnsureInitialized()      pthread_once( &FanOnce, FanInitialize )
+
+//
+//  Characters in the driver's strings, compared and copied as ASCII.
+//
+
+static
+BOOLEAN
+FanEqualAscii (
+    __in PCWCH String,
+    __in SIZE_T Count,
+    __in PCSTR Ascii,
+    __in BOOLEAN CaseInSensitive
+    )
+{
+    SIZE_T index;
+
+    for (index = 0; index < Count; index++) {
+
+        if (Ascii[index] == ANSI_NULL) {
+
+            return FALSE;
+        }
+
+        if (String[index] != (WCHAR)(UCHAR) Ascii[index] &&
+            !(CaseInSensitive &&
+              RtlUpcaseUnicodeChar( String[index] ) ==
+              RtlUpcaseUnicodeChar( (WCHAR)(UCHAR) Ascii[index] ))) {
+
+            return FALSE;
+        }
+    }
+
+    return (BOOLEAN)(Ascii[Count] == ANSI_NULL);
+}
+
+
+static
+SIZE_T
+FanWidenAscii (
+    __out_ecount(Count) PWCH Destination,
+    __in SIZE_T Count,
+    __in PCSTR Ascii
+    )
+/*++
+
+Routine Description:
+
+    Copies an ASCII string into a buffer of Count characters, truncated
+    as needed and NUL terminated.
+
+Return Value:
+
+    The number of characters copied, not counting the NUL.
+
+--*/
+{
+    SIZE_T index;
+
+    for (index = 0; index + 1 < Count && Ascii[index] != ANSI_NULL; index++) {
+
+        Destination[index] = (WCHAR)(UCHAR) Ascii[index];
+    }
+
+    if (Count > 0) {
+
+        Destination[index] = UNICODE_NULL;
+    }
+
+    return index;
+}
+
+
+static
+PWCH
+FanDuplicateAscii (
+    __in PCSTR Ascii,
+    __out_opt PUSHORT Length
+    )
+{
+    SIZE_T count = strlen( Ascii );
+    PWCH string = malloc( (count + 1) * sizeof(WCHAR) );
+
+    if (string != NULL) {
+
+        FanWidenAscii( string, count + 1, Ascii );
+    }
+
+    if (Length != NULL) {
+
+        *Length = (USHORT)(count * sizeof(WCHAR));
+    }
+
+    return string;
+}
+
+//---------------------------------------------------------------------------
+//  Debugging
+//---------------------------------------------------------------------------
+
+
+VOID
+FanAssertFailed (
+    __in PCSTR Expression,
+    __in PCSTR File,
+    __in ULONG Line
+    )
+{
+    fprintf( stderr,
+             "fanSim: assertion failed: %s, %s line %lu\n",
+             Expression,
+             File,
+             (unsigned long) Line );
+
+    abort();
+}
+
+
+ULONG
+DbgPrint (
+    __in PCSTR Format,
+    ...
+    )
+/*++
+
+Routine Description:
+
+    The driver's debug output goes nowhere.  Its formats mix narrow and
+    wide strings, %s with %ws and %wZ, which the C library would misread.
+
+--*/
+{
+    UNREFERENCED_PARAMETER( Format );
+
+    return STATUS_SUCCESS;
+}
+
+//---------------------------------------------------------------------------
+//  Strings
+//---------------------------------------------------------------------------
+
+
+SIZE_T
+RtlCompareMemory (
+    __in CONST VOID *Source1,
+    __in CONST VOID *Source2,
+    __in SIZE_T Length
+    )
+{
+    CONST UCHAR *source1 = Source1;
+    CONST UCHAR *source2 = Source2;
+    SIZE_T index;
+
+    for (index = 0; index < Length && source1[index] == source2[index]; index++) {
+    }
+
+    return index;
+}
+
+
+size_t
+FanWcslen (
+    __in CONST WCHAR *String
+    )
+{
+    CONST WCHAR *end;
+
+    for (end = String; *end != UNICODE_NULL; end++) {
+    }
+
+    return (size_t)(end - String);
+}
+
+
+WCHAR *
+FanWcschr (
+    __in CONST WCHAR *String,
+    __in WCHAR Character
+    )
+{
+    for (;; String++) {
+
+        if (*String == Character) {
+
+            return (WCHAR *) String;
+        }
+
+        if (*String == UNICODE_NULL) {
+
+            return NULL;
+        }
+    }
+}
+
+
+VOID
+RtlInitUnicodeString (
+    __out PUNICODE_STRING DestinationString,
+    __in_opt PCWSTR SourceString
+    )
+{
+    SIZE_T length;
+
+    if (SourceString == NULL) {
+
+        DestinationString->Length = DestinationString->MaximumLength = 0;
+        DestinationString->Buffer = NULL;
+        return;
+    }
+
+    length = FanWcslen( SourceString ) * sizeof(WCHAR);
+
+    if (length > MAXUSHORT - sizeof(WCHAR)) {
+
+        length = MAXUSHORT - sizeof(WCHAR) - 1;
+    }
+
+    DestinationString->Length = (USHORT) length;
+    DestinationString->MaximumLength = (USHORT)(length + sizeof(WCHAR));
+    DestinationString->Buffer = (PWCH) SourceString;
+}
+
+
+VOID
+RtlCopyUnicodeString (
+    __inout PUNICODE_STRING DestinationString,
+    __in_opt PCUNICODE_STRING SourceString
+    )
+{
+    USHORT length;
+
+    if (SourceString == NULL) {
+
+        DestinationString->Length = 0;
+        return;
+    }
+
+    length = min( DestinationString->MaximumLength, SourceString->Length );
+
+    RtlMoveMemory( DestinationString->Buffer, SourceString->Buffer, length );
+    DestinationString->Length = length;
+
+    if (length + sizeof(WCHAR) <= DestinationString->MaximumLength) {
+
+        DestinationString->Buffer[length / sizeof(WCHAR)] = UNICODE_NULL;
+    }
+}
+
+
+static
+NTSTATUS
+FanAppendCharacters (
+    __inout PUNICODE_STRING Destination,
+    __in_ecount(Count) PCWCH Source,
+    __in SIZE_T Count
+    )
+{
+    SIZE_T length = Count * sizeof(WCHAR);
+
+    if (Destination->Length + length > Destination->MaximumLength) {
+
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    RtlMoveMemory( Add2Ptr( Destination->Buffer, Destination->Length ), Source, length );
+    Destination->Length = (USHORT)(Destination->Length + length);
+
+    if (Destination->Length + sizeof(WCHAR) <= Destination->MaximumLength) {
+
+        Destination->Buffer[Destination->Length / sizeof(WCHAR)] = UNICODE_NULL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+RtlAppendUnicodeToString (
+    __inout PUNICODE_STRING Destination,
+    __in_opt PCWSTR Source
+    )
+{
+    if (Source == NULL) {
+
+        return STATUS_SUCCESS;
+    }
+
+    return FanAppendCharacters( Destination, Source, FanWcslen( Source ) );
+}
+
+
+NTSTATUS
+RtlAppendUnicodeStringToString (
+    __inout PUNICODE_STRING Destination,
+    __in PCUNICODE_STRING Source
+    )
+{
+    return FanAppendCharacters( Destination,
+                                Source->Buffer,
+                                Source->Length / sizeof(WCHAR) );
+}
+
+
+WCHAR
+RtlUpcaseUnicodeChar (
+    __in WCHAR SourceCharacter
+    )
+{
+    wint_t upper;
+
+    if (SourceCharacter < 0x80) {
+
+        return (SourceCharacter >= 'a' && SourceCharacter <= 'z') ?
+               (WCHAR)(SourceCharacter - ('a' - 'A')) : SourceCharacter;
+    }
+
+    if (SourceCharacter >= 0xD800 && SourceCharacter <= 0xDFFF) {
+
+        return SourceCharacter;
+    }
+
+    upper = towupper( (wint_t) SourceCharacter );
+
+    return (upper <= 0xFFFF) ? (WCHAR) upper : SourceCharacter;
+}
+
+
+LONG
+RtlCompareUnicodeString (
+    __in PCUNICODE_STRING String1,
+    __in PCUNICODE_STRING String2,
+    __in BOOLEAN CaseInSensitive
+    )
+{
+    USHORT count = min( String1->Length, String2->Length ) / sizeof(WCHAR);
+    USHORT index;
+    WCHAR char1;
+    WCHAR char2;
+
+    for (index = 0; index < count; index++) {
+
+        char1 = String1->Buffer[index];
+        char2 = String2->Buffer[index];
+
+        if (CaseInSensitive) {
+
+            char1 = RtlUpcaseUnicodeChar( char1 );
+            char2 = RtlUpcaseUnicodeChar( char2 );
+        }
+
+        if (char1 != char2) {
+
+            return (LONG) char1 - (LONG) char2;
+        }
+    }
+
+    return (LONG) String1->Length - (LONG) String2->Length;
+}
+
+
+BOOLEAN
+RtlEqualUnicodeString (
+    __in CONST UNICODE_STRING *String1,
+    __in CONST UNICODE_STRING *String2,
+    __in BOOLEAN CaseInSensitive
+    )
+{
+    USHORT index;
+
+    if (String1->Length != String2->Length) {
+
+        return FALSE;
+    }
+
+    if (!CaseInSensitive) {
+
+        return RtlEqualMemory( String1->Buffer, String2->Buffer, String1->Length );
+    }
+
+    for (index = 0; index < String1->Length / sizeof(WCHAR); index++) {
+
+        if (RtlUpcaseUnicodeChar( String1->Buffer[index] ) !=
+            RtlUpcaseUnicodeChar( String2->Buffer[index] )) {
+
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+BOOLEAN
+RtlPrefixUnicodeString (
+    __in PCUNICODE_STRING String1,
+    __in PCUNICODE_STRING String2,
+    __in BOOLEAN CaseInSensitive
+    )
+{
+    UNICODE_STRING prefix;
+
+    if (String1->Length > String2->Length) {
+
+        return FALSE;
+    }
+
+    prefix.Length = prefix.MaximumLength = String1->Length;
+    prefix.Buffer = String2->Buffer;
+
+    return RtlEqualUnicodeString( String1, &prefix, CaseInSensitive );
+}
+
+
+NTSTATUS
+RtlUpcaseUnicodeString (
+    __inout PUNICODE_STRING DestinationString,
+    __in PCUNICODE_STRING SourceString,
+    __in BOOLEAN AllocateDestinationString
+    )
+{
+    USHORT index;
+
+    if (AllocateDestinationString) {
+
+        DestinationString->MaximumLength = SourceString->Length;
+        DestinationString->Buffer = ExAllocatePoolWithTag( PagedPool,
+                                                           SourceString->Length,
+                                                           FAN_STRING_TAG );
+
+        if (DestinationString->Buffer == NULL) {
+
+            return STATUS_NO_MEMORY;
+        }
+
+    } else if (DestinationString->MaximumLength < SourceString->Length) {
+
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    for (index = 0; index < SourceString->Length / sizeof(WCHAR); index++) {
+
+        DestinationString->Buffer[index] = RtlUpcaseUnicodeChar( SourceString->Buffer[index] );
+    }
+
+    DestinationString->Length = SourceString->Length;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+RtlFreeUnicodeString (
+    __inout PUNICODE_STRING UnicodeString
+    )
+{
+    if (UnicodeString->Buffer != NULL) {
+
+        ExFreePoolWithTag( UnicodeString->Buffer, 0 );
+    }
+
+    UnicodeString->Length = UnicodeString->MaximumLength = 0;
+    UnicodeString->Buffer = NULL;
+}
+
+
+int
+_wcsnicmp (
+    __in CONST WCHAR *String1,
+    __in CONST WCHAR *String2,
+    __in size_t Count
+    )
+{
+    WCHAR char1;
+    WCHAR char2;
+
+    for (; Count > 0; Count--, String1++, String2++) {
+
+        char1 = RtlUpcaseUnicodeChar( *String1 );
+        char2 = RtlUpcaseUnicodeChar( *String2 );
+
+        if (char1 != char2) {
+
+            return (int) char1 - (int) char2;
+        }
+
+        if (char1 == UNICODE_NULL) {
+
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+static
+BOOLEAN
+FanMatchExpression (
+    __in CONST WCHAR *Expression,
+    __in ULONG ExpressionCount,
+    __in CONST WCHAR *Name,
+    __in ULONG NameCount,
+    __in BOOLEAN IgnoreCase
+    )
+/*++
+
+Routine Description:
+
+    Matches a name against an expression the way FsRtlIsNameInExpression
+    does: '*' is any run of characters, '?' any one, DOS_STAR any run up
+    to the name's last '.', DOS_QM any one but a '.' or none at a '.' or
+    the end, and DOS_DOT a '.' or the end of the name.
+
+Return Value:
+
+    TRUE if the whole name matches.
+
+--*/
+{
+    WCHAR expression;
+    ULONG skip;
+    ULONG limit;
+
+    while (ExpressionCount > 0) {
+
+        expression = *Expression;
+
+        if (expression == '*' || expression == DOS_STAR) {
+
+            while (ExpressionCount > 0 && *Expression == expression) {
+
+                Expression++;
+                ExpressionCount--;
+            }
+
+            limit = NameCount;
+
+            if (expression == DOS_STAR) {
+
+                for (limit = NameCount; limit > 0 && Name[limit - 1] != '.'; limit--) {
+                }
+
+                limit = (limit > 0) ? limit - 1 : NameCount;
+            }
+
+            if (ExpressionCount == 0) {
+
+                return (BOOLEAN)(limit == NameCount);
+            }
+
+            for (skip = 0; skip <= limit; skip++) {
+
+                if (FanMatchExpression( Expression,
+                                        ExpressionCount,
+                                        Name + skip,
+                                        NameCount - skip,
+                                        IgnoreCase )) {
+
+                    return TRUE;
+                }
+            }
+
+            return FALSE;
+        }
+
+        Expression++;
+        ExpressionCount--;
+
+        if (expression == DOS_QM) {
+
+            if (NameCount > 0 && *Name != '.') {
+
+                Name++;
+                NameCount--;
+            }
+
+            continue;
+        }
+
+        if (expression == DOS_DOT) {
+
+            if (NameCount > 0) {
+
+                if (*Name != '.') {
+
+                    return FALSE;
+                }
+
+                Name++;
+                NameCount--;
+            }
+
+            continue;
+        }
+
+        if (NameCount == 0) {
+
+            return FALSE;
+        }
+
+        if (expression != '?' &&
+            expression != *Name &&
+            !(IgnoreCase && RtlUpcaseUnicodeChar( expression ) == RtlUpcaseUnicodeChar( *Name ))) {
+
+            return FALSE;
+        }
+
+        Name++;
+        NameCount--;
+    }
+
+    return (BOOLEAN)(NameCount == 0);
+}
+
+
+BOOLEAN
+FsRtlIsNameInExpression (
+    __in PUNICODE_STRING Expression,
+    __in PUNICODE_STRING Name,
+    __in BOOLEAN IgnoreCase,
+    __in_opt PWCH UpcaseTable
+    )
+{
+    (VOID) UpcaseTable;
+
+    return FanMatchExpression( Expression->Buffer,
+                               Expression->Length / sizeof(WCHAR),
+                               Name->Buffer,
+                               Name->Length / sizeof(WCHAR),
+                               IgnoreCase );
+}
+
+//---------------------------------------------------------------------------
+//  Security identifiers
+//---------------------------------------------------------------------------
+
+
+ULONG
+RtlLengthRequiredSid (
+    __in ULONG SubAuthorityCount
+    )
+{
+    return FIELD_OFFSET(SID, SubAuthority) + SubAuthorityCount * sizeof(ULONG);
+}
+
+
+ULONG
+RtlLengthSid (
+    __in PSID Sid
+    )
+{
+    return RtlLengthRequiredSid( ((PISID) Sid)->SubAuthorityCount );
+}
+
+
+BOOLEAN
+RtlValidSid (
+    __in PSID Sid
+    )
+{
+    PISID sid = Sid;
+
+    return (BOOLEAN)(sid->Revision == SID_REVISION &&
+                     sid->SubAuthorityCount <= SID_MAX_SUB_AUTHORITIES);
+}
+
+
+BOOLEAN
+RtlEqualSid (
+    __in PSID Sid1,
+    __in PSID Sid2
+    )
+{
+    ULONG length = RtlLengthSid( Sid1 );
+
+    return (BOOLEAN)(length == RtlLengthSid( Sid2 ) &&
+                     RtlEqualMemory( Sid1, Sid2, length ));
+}
+
+
+NTSTATUS
+RtlConvertSidToUnicodeString (
+    __inout PUNICODE_STRING UnicodeString,
+    __in PSID Sid,
+    __in BOOLEAN AllocateDestinationString
+    )
+/*++
+
+Routine Description:
+
+    Formats a SID as S-1-5-21-..., the identifier authority in decimal
+    unless it needs more than 32 bits, when it is in hex.
+
+--*/
+{
+    PISID sid = Sid;
+    PUCHAR authority = sid->IdentifierAuthority.Value;
+    CHAR text[16 + 20 + SID_MAX_SUB_AUTHORITIES * 11];
+    int length;
+    ULONG index;
+
+    if (!RtlValidSid( Sid )) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    length = snprintf( text, sizeof(text), "S-%u-", sid->Revision );
+
+    if (authority[0] != 0 || authority[1] != 0) {
+
+        length += snprintf( text + length,
+                            sizeof(text) - length,
+                            "0x%02X%02X%02X%02X%02X%02X",
+                            authority[0], authority[1], authority[2],
+                            authority[3], authority[4], authority[5] );
+
+    } else {
+
+        length += snprintf( text + length,
+                            sizeof(text) - length,
+                            "%lu",
+                            ((unsigned long) authority[2] << 24) |
+                            ((unsigned long) authority[3] << 16) |
+                            ((unsigned long) authority[4] << 8) |
+                            (unsigned long) authority[5] );
+    }
+
+    for (index = 0; index < sid->SubAuthorityCount; index++) {
+
+        length += snprintf( text + length,
+                            sizeof(text) - length,
+                            "-%lu",
+                            (unsigned long) sid->SubAuthority[index] );
+    }
+
+    if (AllocateDestinationString) {
+
+        UnicodeString->MaximumLength = (USHORT)((length + 1) * sizeof(WCHAR));
+        UnicodeString->Buffer = ExAllocatePoolWithTag( PagedPool,
+                                                       UnicodeString->MaximumLength,
+                                                       FAN_STRING_TAG );
+
+        if (UnicodeString->Buffer == NULL) {
+
+            return STATUS_NO_MEMORY;
+        }
+
+    } else if (UnicodeString->MaximumLength < (length + 1) * sizeof(WCHAR)) {
+
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    FanWidenAscii( UnicodeString->Buffer, length + 1, text );
+    UnicodeString->Length = (USHORT)(length * sizeof(WCHAR));
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+BOOLEAN
+FanParseSid (
+    __in PCSTR Text,
+    __out_bcount(RtlLengthRequiredSid(SID_MAX_SUB_AUTHORITIES)) PISID Sid
+    )
+/*++
+
+Routine Description:
+
+    Reads a SID in the form RtlConvertSidToUnicodeString writes it.
+
+--*/
+{
+    unsigned long long authority;
+    unsigned long value;
+    char *end;
+    int index;
+
+    if (Text[0] != 'S' || Text[1] != '-') {
+
+        return FALSE;
+    }
+
+    value = strtoul( Text + 2, &end, 10 );
+
+    if (value != SID_REVISION || *end != '-') {
+
+        return FALSE;
+    }
+
+    authority = strtoull( end + 1, &end, 0 );
+
+    if (authority >> 48 != 0) {
+
+        return FALSE;
+    }
+
+    Sid->Revision = SID_REVISION;
+    Sid->SubAuthorityCount = 0;
+
+    for (index = 5; index >= 0; index--, authority >>= 8) {
+
+        Sid->IdentifierAuthority.Value[index] = (UCHAR) authority;
+    }
+
+    while (*end == '-') {
+
+        if (Sid->SubAuthorityCount == SID_MAX_SUB_AUTHORITIES) {
+
+            return FALSE;
+        }
+
+        Sid->SubAuthority[Sid->SubAuthorityCount++] = (ULONG) strtoul( end + 1, &end, 10 );
+    }
+
+    return (BOOLEAN)(*end == ANSI_NULL);
+}
+
+//---------------------------------------------------------------------------
+//  Bounded strings
+//---------------------------------------------------------------------------
+
+//
+//  Where FanFormat writes: a buffer of Capacity characters besides the
+//  NUL, and whether it had to leave any out.
+//
+
+typedef struct _FAN_FORMAT_OUTPUT {
+
+    PWCH Buffer;
+    SIZE_T Capacity;
+    SIZE_T Length;
+    BOOLEAN Truncated;
+
+} FAN_FORMAT_OUTPUT, *PFAN_FORMAT_OUTPUT;
+
+
+static
+VOID
+FanPut (
+    __inout PFAN_FORMAT_OUTPUT Output,
+    __in WCHAR Character,
+    __in SIZE_T Count
+    )
+{
+    for (; Count > 0; Count--) {
+
+        if (Output->Length < Output->Capacity) {
+
+            Output->Buffer[Output->Length++] = Character;
+
+        } else {
+
+            Output->Truncated = TRUE;
+        }
+    }
+}
+
+
+static
+VOID
+FanFormatNumber (
+    __inout PFAN_FORMAT_OUTPUT Output,
+    __in ULONGLONG Value,
+    __in ULONG Base,
+    __in BOOLEAN Upper,
+    __in PCSTR Prefix,
+    __in LONG Width,
+    __in LONG Precision,
+    __in BOOLEAN LeftJustify,
+    __in BOOLEAN ZeroPad
+    )
+{
+    CONST CHAR *digits = Upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    CHAR text[24];
+    LONG count = 0;
+    LONG zeros;
+    LONG pad;
+    LONG prefix = (LONG) strlen( Prefix );
+
+    while (Value != 0 || (count == 0 && Precision != 0)) {
+
+        text[count++] = digits[Value % Base];
+        Value /= Base;
+    }
+
+    zeros = (Precision > count) ? Precision - count : 0;
+    pad = Width - count - zeros - prefix;
+
+    if (pad > 0 && ZeroPad && !LeftJustify && Precision < 0) {
+
+        zeros += pad;
+        pad = 0;
+    }
+
+    if (pad > 0 && !LeftJustify) {
+
+        FanPut( Output, ' ', pad );
+    }
+
+    for (; *Prefix != ANSI_NULL; Prefix++) {
+
+        FanPut( Output, (WCHAR) *Prefix, 1 );
+    }
+
+    FanPut( Output, '0', zeros );
+
+    while (count > 0) {
+
+        FanPut( Output, (WCHAR) text[--count], 1 );
+    }
+
+    if (pad > 0 && LeftJustify) {
+
+        FanPut( Output, ' ', pad );
+    }
+}
+
+
+static
+VOID
+FanFormatString (
+    __inout PFAN_FORMAT_OUTPUT Output,
+    __in_opt CONST VOID *String,
+    __in BOOLEAN Wide,
+    __in LONG Count,
+    __in LONG Width,
+    __in LONG Precision,
+    __in BOOLEAN LeftJustify
+    )
+/*++
+
+Routine Description:
+
+    Writes a narrow or wide string, Count characters of it or, if Count is
+    negative, up to its NUL, and no more than Precision if that is set.
+
+--*/
+{
+    CONST WCHAR *wide = String;
+    CONST CHAR *narrow = String;
+    LONG length;
+    LONG index;
+
+    if (String == NULL) {
+
+        narrow = "(null)";
+        Wide = FALSE;
+        Count = -1;
+    }
+
+    if (Count < 0) {
+
+        for (Count = 0;
+             Wide ? wide[Count] != UNICODE_NULL : narrow[Count] != ANSI_NULL;
+             Count++) {
+
+            if (Precision >= 0 && Count >= Precision) {
+
+                break;
+            }
+        }
+    }
+
+    length = (Precision >= 0 && Precision < Count) ? Precision : Count;
+
+    if (!LeftJustify && Width > length) {
+
+        FanPut( Output, ' ', Width - length );
+    }
+
+    for (index = 0; index < length; index++) {
+
+        FanPut( Output, Wide ? wide[index] : (WCHAR)(UCHAR) narrow[index], 1 );
+    }
+
+    if (LeftJustify && Width > length) {
+
+        FanPut( Output, ' ', Width - length );
+    }
+}
+
+
+static
+VOID
+FanFormat (
+    __inout PFAN_FORMAT_OUTPUT Output,
+    __in PCWSTR Format,
+    __in va_list Arguments
+    )
+/*++
+
+Routine Description:
+
+    Formats as the kernel's wide printf routines do.  A specification is
+
+        %[flags][width][.precision][size]type
+
+    with the flags '-', '0', '+', ' ' and '#'; a width and precision that
+    may be '*'; the sizes h, l (32 bits, as on Windows), ll, I64, I32, I
+    (a pointer's width), w and z; and the types d, i, u, x, X, o, c, C, s,
+    S, p and Z.  In the wide routines %s and %c are wide, %S and %C narrow,
+    and h or w make either what they say; %Z is an ANSI_STRING and %wZ a
+    UNICODE_STRING.
+
+--*/
+{
+    va_list arguments;
+    BOOLEAN leftJustify;
+    BOOLEAN zeroPad;
+    BOOLEAN plus;
+    BOOLEAN space;
+    BOOLEAN alternate;
+    LONG width;
+    LONG precision;
+    ULONG size;
+    BOOLEAN narrowSize;
+    BOOLEAN wideSize;
+    LONGLONG signedValue;
+    ULONGLONG value;
+    WCHAR type;
+    PCUNICODE_STRING unicodeString;
+    PANSI_STRING ansiString;
+
+    va_copy( arguments, Arguments );
+
+    for (; *Format != UNICODE_NULL; Format++) {
+
+        if (*Format != '%') {
+
+            FanPut( Output, *Format, 1 );
+            continue;
+        }
+
+        Format++;
+
+        leftJustify = zeroPad = plus = space = alternate = FALSE;
+
+        for (;; Format++) {
+
+            if (*Format == '-') {
+
+                leftJustify = TRUE;
+
+            } else if (*Format == '0') {
+
+                zeroPad = TRUE;
+
+            } else if (*Format == '+') {
+
+                plus = TRUE;
+
+            } else if (*Format == ' ') {
+
+                space = TRUE;
+
+            } else if (*Format == '#') {
+
+                alternate = TRUE;
+
+            } else {
+
+                break;
+            }
+        }
+
+        width = 0;
+
+        if (*Format == '*') {
+
+            width = va_arg( arguments, int );
+            Format++;
+
+            if (width < 0) {
+
+                leftJustify = TRUE;
+                width = -width;
+            }
+
+        } else {
+
+            for (; *Format >= '0' && *Format <= '9'; Format++) {
+
+                width = width * 10 + (*Format - '0');
+            }
+        }
+
+        precision = -1;
+
+        if (*Format == '.') {
+
+            Format++;
+            precision = 0;
+
+            if (*Format == '*') {
+
+                precision = va_arg( arguments, int );
+                Format++;
+
+            } else {
+
+                for (; *Format >= '0' && *Format <= '9'; Format++) {
+
+                    precision = precision * 10 + (*Format - '0');
+                }
+            }
+        }
+
+        //
+        //  Sizes are in bytes; 0 is an int's.
+        //
+
+        size = 0;
+        narrowSize = wideSize = FALSE;
+
+        if (*Format == 'h') {
+
+            narrowSize = TRUE;
+            size = sizeof(SHORT);
+            Format++;
+
+        } else if (*Format == 'l' && Format[1] == 'l') {
+
+            size = sizeof(LONGLONG);
+            Format += 2;
+
+        } else if (*Format == 'l') {
+
+            wideSize = TRUE;
+            size = sizeof(LONG);
+            Format++;
+
+        } else if (*Format == 'w') {
+
+            wideSize = TRUE;
+            Format++;
+
+        } else if (*Format == 'z') {
+
+            size = sizeof(SIZE_T);
+            Format++;
+
+        } else if (*Format == 'I' && Format[1] == '6' && Format[2] == '4') {
+
+            size = sizeof(LONGLONG);
+            Format += 3;
+
+        } else if (*Format == 'I' && Format[1] == '3' && Format[2] == '2') {
+
+            size = sizeof(LONG);
+            Format += 3;
+
+        } else if (*Format == 'I') {
+
+            size = sizeof(PVOID);
+            Format++;
+        }
+
+        type = *Format;
+
+        switch (type) {
+
+        case 'd':
+        case 'i':
+
+            if (size == sizeof(LONGLONG)) {
+
+                signedValue = va_arg( arguments, long long );
+
+            } else if (size == sizeof(PVOID) && sizeof(PVOID) != sizeof(int)) {
+
+                signedValue = va_arg( arguments, intptr_t );
+
+            } else {
+
+                signedValue = va_arg( arguments, int );
+
+                if (size == sizeof(SHORT)) {
+
+                    signedValue = (SHORT) signedValue;
+                }
+            }
+
+            value = (signedValue < 0) ? 0 - (ULONGLONG) signedValue : (ULONGLONG) signedValue;
+
+            FanFormatNumber( Output,
+                             value,
+                             10,
+                             FALSE,
+                             (signedValue < 0) ? "-" : plus ? "+" : space ? " " : "",
+                             width,
+                             precision,
+                             leftJustify,
+                             zeroPad );
+            break;
+
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+
+            if (size == sizeof(LONGLONG)) {
+
+                value = va_arg( arguments, unsigned long long );
+
+            } else if (size == sizeof(PVOID) && sizeof(PVOID) != sizeof(int)) {
+
+                value = va_arg( arguments, uintptr_t );
+
+            } else {
+
+                value = va_arg( arguments, unsigned int );
+
+                if (size == sizeof(SHORT)) {
+
+                    value = (USHORT) value;
+                }
+            }
+
+            FanFormatNumber( Output,
+                             value,
+                             (type == 'u') ? 10 : (type == 'o') ? 8 : 16,
+                             (BOOLEAN)(type == 'X'),
+                             (!alternate || value == 0) ? "" :
+                             (type == 'x') ? "0x" : (type == 'X') ? "0X" :
+                             (type == 'o') ? "0" : "",
+                             width,
+                             precision,
+                             leftJustify,
+                             zeroPad );
+            break;
+
+        case 'p':
+
+            FanFormatNumber( Output,
+                             (ULONG_PTR) va_arg( arguments, void * ),
+                             16,
+                             TRUE,
+                             "",
+                             (LONG)(sizeof(PVOID) * 2),
+                             -1,
+                             FALSE,
+                             TRUE );
+            break;
+
+        case 'c':
+        case 'C':
+
+            value = (ULONGLONG) va_arg( arguments, int );
+
+            if (narrowSize || (type == 'C' && !wideSize)) {
+
+                value = (UCHAR) value;
+            }
+
+            if (!leftJustify && width > 1) {
+
+                FanPut( Output, ' ', width - 1 );
+            }
+
+            FanPut( Output, (WCHAR) value, 1 );
+
+            if (leftJustify && width > 1) {
+
+                FanPut( Output, ' ', width - 1 );
+            }
+
+            break;
+
+        case 's':
+        case 'S':
+
+            FanFormatString( Output,
+                             va_arg( arguments, void * ),
+                             (BOOLEAN)(type == 's' ? !narrowSize : wideSize),
+                             -1,
+                             width,
+                             precision,
+                             leftJustify );
+            break;
+
+        case 'Z':
+
+            if (wideSize) {
+
+                unicodeString = va_arg( arguments, PCUNICODE_STRING );
+
+                FanFormatString( Output,
+                                 unicodeString ? unicodeString->Buffer : NULL,
+                                 TRUE,
+                                 unicodeString ? (LONG)(unicodeString->Length / sizeof(WCHAR)) : -1,
+                                 width,
+                                 precision,
+                                 leftJustify );
+
+            } else {
+
+                ansiString = va_arg( arguments, PANSI_STRING );
+
+                FanFormatString( Output,
+                                 ansiString ? ansiString->Buffer : NULL,
+                                 FALSE,
+                                 ansiString ? ansiString->Length : -1,
+                                 width,
+                                 precision,
+                                 leftJustify );
+            }
+
+            break;
+
+        case '%':
+
+            FanPut( Output, '%', 1 );
+            break;
+
+        default:
+
+            //
+            //  An unknown type ends the formatting rather than misread the
+            //  arguments that follow.
+            //
+
+            Output->Truncated = TRUE;
+            va_end( arguments );
+            return;
+        }
+    }
+
+    va_end( arguments );
+}
+
+
+static
+NTSTATUS
+FanPrintf (
+    __out_bcount(cbDest) NTSTRSAFE_PWSTR pszDest,
+    __in size_t cbDest,
+    __deref_opt_out NTSTRSAFE_PWSTR *ppszDestEnd,
+    __out_opt size_t *pcbRemaining,
+    __in ULONG dwFlags,
+    __in NTSTRSAFE_PCWSTR pszFormat,
+    __in va_list argList
+    )
+{
+    FAN_FORMAT_OUTPUT output;
+    size_t cchDest = cbDest / sizeof(WCHAR);
+    NTSTATUS status;
+
+    if (cchDest == 0 || cchDest > NTSTRSAFE_MAX_CCH ||
+        (dwFlags & ~(0xFF | STRSAFE_IGNORE_NULLS | STRSAFE_FILL_BEHIND_NULL |
+                     STRSAFE_NULL_ON_FAILURE | STRSAFE_NO_TRUNCATION)) != 0) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    output.Buffer = pszDest;
+    output.Capacity = cchDest - 1;
+    output.Length = 0;
+    output.Truncated = FALSE;
+
+    if (pszFormat != NULL) {
+
+        FanFormat( &output, pszFormat, argList );
+
+    } else if (!FlagOn( dwFlags, STRSAFE_IGNORE_NULLS )) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    pszDest[output.Length] = UNICODE_NULL;
+    status = output.Truncated ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+
+    if (!NT_SUCCESS( status ) &&
+        FlagOn( dwFlags, STRSAFE_NULL_ON_FAILURE | STRSAFE_NO_TRUNCATION )) {
+
+        output.Length = 0;
+        pszDest[0] = UNICODE_NULL;
+    }
+
+    if (FlagOn( dwFlags, STRSAFE_FILL_BEHIND_NULL ) && output.Length + 1 < cchDest) {
+
+        RtlFillMemory( pszDest + output.Length + 1,
+                       (cchDest - output.Length - 1) * sizeof(WCHAR),
+                       (UCHAR) dwFlags );
+    }
+
+    if (ppszDestEnd != NULL) {
+
+        *ppszDestEnd = pszDest + output.Length;
+    }
+
+    if (pcbRemaining != NULL) {
+
+        *pcbRemaining = (cchDest - output.Length) * sizeof(WCHAR) + cbDest % sizeof(WCHAR);
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+RtlStringCbVPrintfW (
+    __out_bcount(cbDest) NTSTRSAFE_PWSTR pszDest,
+    __in size_t cbDest,
+    __in NTSTRSAFE_PCWSTR pszFormat,
+    __in va_list argList
+    )
+{
+    return FanPrintf( pszDest, cbDest, NULL, NULL, 0, pszFormat, argList );
+}
+
+
+NTSTATUS
+RtlStringCbPrintfW (
+    __out_bcount(cbDest) NTSTRSAFE_PWSTR pszDest,
+    __in size_t cbDest,
+    __in NTSTRSAFE_PCWSTR pszFormat,
+    ...
+    )
+{
+    va_list argList;
+    NTSTATUS status;
+
+    va_start( argList, pszFormat );
+    status = FanPrintf( pszDest, cbDest, NULL, NULL, 0, pszFormat, argList );
+    va_end( argList );
+
+    return status;
+}
+
+
+NTSTATUS
+RtlStringCbPrintfExW (
+    __out_bcount(cbDest) NTSTRSAFE_PWSTR pszDest,
+    __in size_t cbDest,
+    __deref_opt_out NTSTRSAFE_PWSTR *ppszDestEnd,
+    __out_opt size_t *pcbRemaining,
+    __in ULONG dwFlags,
+    __in NTSTRSAFE_PCWSTR pszFormat,
+    ...
+    )
+{
+    va_list argList;
+    NTSTATUS status;
+
+    va_start( argList, pszFormat );
+    status = FanPrintf( pszDest, cbDest, ppszDestEnd, pcbRemaining, dwFlags, pszFormat, argList );
+    va_end( argList );
+
+    return status;
+}
+
+
+NTSTATUS
+RtlStringCbCopyW (
+    __out_bcount(cbDest) NTSTRSAFE_PWSTR pszDest,
+    __in size_t cbDest,
+    __in NTSTRSAFE_PCWSTR pszSrc
+    )
+{
+    size_t cchDest = cbDest / sizeof(WCHAR);
+    size_t index;
+
+    if (cchDest == 0 || cchDest > NTSTRSAFE_MAX_CCH) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (index = 0; index + 1 < cchDest && pszSrc[index] != UNICODE_NULL; index++) {
+
+        pszDest[index] = pszSrc[index];
+    }
+
+    pszDest[index] = UNICODE_NULL;
+
+    return (pszSrc[index] == UNICODE_NULL) ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
+
+
+NTSTATUS
+RtlStringCbLengthW (
+    __in NTSTRSAFE_PCWSTR psz,
+    __in size_t cbMax,
+    __out_opt size_t *pcbLength
+    )
+{
+    size_t cchMax = cbMax / sizeof(WCHAR);
+    size_t index;
+
+    if (pcbLength != NULL) {
+
+        *pcbLength = 0;
+    }
+
+    if (psz == NULL || cchMax == 0 || cchMax > NTSTRSAFE_MAX_CCH) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (index = 0; index < cchMax && psz[index] != UNICODE_NULL; index++) {
+    }
+
+    if (index == cchMax) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (pcbLength != NULL) {
+
+        *pcbLength = index * sizeof(WCHAR);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//---------------------------------------------------------------------------
+//  Processors, IRQL and synchronization
+//---------------------------------------------------------------------------
+
+
+KIRQL
+KeGetCurrentIrql (
+    VOID
+    )
+{
+    return FanThread.Irql;
+}
+
+
+ULONG
+KeGetCurrentProcessorNumber (
+    VOID
+    )
+{
+    return FanThread.Processor;
+}
+
+
+static ULONG FanProcessorsPerNode;
+
+
+USHORT
+KeGetCurrentNodeNumber (
+    VOID
+    )
+{
+    return (USHORT)(FanProcessorsPerNode != 0 ? FanThread.Processor / FanProcessorsPerNode : 0);
+}
+
+
+VOID
+FanSimSetNodeSize (
+    __in ULONG ProcessorsPerNode
+    )
+{
+    FanProcessorsPerNode = ProcessorsPerNode;
+}
+
+
+VOID
+FanSimSetProcessor (
+    __in ULONG Processor
+    )
+{
+    FanThread.Processor = Processor;
+}
+
+//
+//  A spin lock holds the address of its owner's thread state, so that
+//  taking one twice or releasing one not held is caught.  Waiters yield
+//  rather than spin, as the simulation may have more threads than
+//  processors.
+//
+
+
+static
+VOID
+FanAcquireSpinLock (
+    __inout PKSPIN_LOCK SpinLock
+    )
+{
+    ULONG_PTR self = (ULONG_PTR) &FanThread;
+
+    ASSERT( __atomic_load_n( SpinLock, __ATOMIC_RELAXED ) != self );
+
+    while (!__sync_bool_compare_and_swap( SpinLock, 0, self )) {
+
+        sched_yield();
+    }
+}
+
+
+static
+VOID
+FanReleaseSpinLock (
+    __inout PKSPIN_LOCK SpinLock
+    )
+{
+    ASSERT( __atomic_load_n( SpinLock, __ATOMIC_RELAXED ) == (ULONG_PTR) &FanThread );
+
+    __atomic_store_n( SpinLock, 0, __ATOMIC_RELEASE );
+}
+
+
+VOID
+KeInitializeSpinLock (
+    __out PKSPIN_LOCK SpinLock
+    )
+{
+    *SpinLock = 0;
+}
+
+
+VOID
+KeAcquireSpinLockRaiseToDpc (
+    __inout PKSPIN_LOCK SpinLock,
+    __out PKIRQL OldIrql
+    )
+{
+    ASSERT( FanThread.Irql <= DISPATCH_LEVEL );
+
+    *OldIrql = FanThread.Irql;
+    FanThread.Irql = DISPATCH_LEVEL;
+
+    FanAcquireSpinLock( SpinLock );
+}
+
+
+VOID
+KeReleaseSpinLock (
+    __inout PKSPIN_LOCK SpinLock,
+    __in KIRQL NewIrql
+    )
+{
+    ASSERT( FanThread.Irql == DISPATCH_LEVEL );
+
+    FanReleaseSpinLock( SpinLock );
+
+    FanThread.Irql = NewIrql;
+}
+
+
+VOID
+KeAcquireSpinLockAtDpcLevel (
+    __inout PKSPIN_LOCK SpinLock
+    )
+{
+    ASSERT( FanThread.Irql >= DISPATCH_LEVEL );
+
+    FanAcquireSpinLock( SpinLock );
+}
+
+
+VOID
+KeReleaseSpinLockFromDpcLevel (
+    __inout PKSPIN_LOCK SpinLock
+    )
+{
+    ASSERT( FanThread.Irql >= DISPATCH_LEVEL );
+
+    FanReleaseSpinLock( SpinLock );
+}
+
+//
+//  A resource is a reader-preferring read-write lock, so that a thread
+//  holding it shared may take it shared again, as it may an ERESOURCE.
+//
+
+static LONG FanResourcesInUse;
+
+
+NTSTATUS
+ExInitializeResourceLite (
+    __out PERESOURCE Resource
+    )
+{
+    pthread_rwlock_t *lock = malloc( sizeof(pthread_rwlock_t) );
+
+    if (lock == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    pthread_rwlock_init( lock, NULL );
+
+    Resource->Lock = lock;
+    InterlockedIncrement( &FanResourcesInUse );
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+ExDeleteResourceLite (
+    __inout PERESOURCE Resource
+    )
+{
+    ASSERT( Resource->Lock != NULL );
+
+    pthread_rwlock_destroy( Resource->Lock );
+    free( Resource->Lock );
+
+    Resource->Lock = NULL;
+    InterlockedDecrement( &FanResourcesInUse );
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+FltAcquireResourceShared (
+    __inout PERESOURCE Resource
+    )
+{
+    ASSERT( FanThread.Irql <= APC_LEVEL );
+
+    pthread_rwlock_rdlock( Resource->Lock );
+}
+
+
+VOID
+FltAcquireResourceExclusive (
+    __inout PERESOURCE Resource
+    )
+{
+    ASSERT( FanThread.Irql <= APC_LEVEL );
+
+    pthread_rwlock_wrlock( Resource->Lock );
+}
+
+
+VOID
+FltReleaseResource (
+    __inout PERESOURCE Resource
+    )
+{
+    pthread_rwlock_unlock( Resource->Lock );
+}
+
+//---------------------------------------------------------------------------
+//  Time
+//---------------------------------------------------------------------------
+
+//
+//  100ns intervals between 1601, where system time starts, and 1970.
+//
+
+#define FAN_EPOCH_DIFFERENCE        116444736000000000LL
+
+
+VOID
+KeQuerySystemTime (
+    __out PLARGE_INTEGER CurrentTime
+    )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+
+    CurrentTime->QuadPart = (LONGLONG) now.tv_sec * 10000000 +
+                            now.tv_nsec / 100 +
+                            FAN_EPOCH_DIFFERENCE;
+}
+
+
+ULONGLONG
+KeQueryInterruptTime (
+    VOID
+    )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (ULONGLONG) now.tv_sec * 10000000 + (ULONGLONG) now.tv_nsec / 100;
+}
+
+
+LARGE_INTEGER
+KeQueryPerformanceCounter (
+    __out_opt PLARGE_INTEGER PerformanceFrequency
+    )
+{
+    struct timespec now;
+    LARGE_INTEGER counter;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    if (PerformanceFrequency != NULL) {
+
+        PerformanceFrequency->QuadPart = 1000000000;
+    }
+
+    counter.QuadPart = (LONGLONG) now.tv_sec * 1000000000 + now.tv_nsec;
+
+    return counter;
+}
+
+//---------------------------------------------------------------------------
+//  Timers and DPCs
+//---------------------------------------------------------------------------
+
+//
+//  Timers are kept in the order they are due, in interrupt time, and one
+//  thread runs their DPCs.  It runs them at DISPATCH_LEVEL on processor 0
+//  without FanTimerLock held, so that a DPC may set or cancel timers, and
+//  KeFlushQueuedDpcs waits for the one running, if any.
+//
+
+static pthread_mutex_t FanTimerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t FanTimerWake;
+static pthread_cond_t FanTimerIdle = PTHREAD_COND_INITIALIZER;
+static LIST_ENTRY FanTimerList = { &FanTimerList, &FanTimerList };
+static pthread_t FanTimerThread;
+static BOOLEAN FanTimerThreadStarted;
+static BOOLEAN FanTimerStop;
+static PKDPC FanTimerRunning;
+
+
+static
+VOID
+FanInsertTimer (
+    __inout PKTIMER Timer
+    )
+{
+    PLIST_ENTRY entry;
+
+    for (entry = FanTimerList.Flink; entry != &FanTimerList; entry = entry->Flink) {
+
+        if (CONTAINING_RECORD( entry, KTIMER, TimerListEntry )->DueTime > Timer->DueTime) {
+
+            break;
+        }
+    }
+
+    InsertTailList( entry, &Timer->TimerListEntry );
+    Timer->Inserted = TRUE;
+}
+
+
+static
+PVOID
+FanTimerMain (
+    __in PVOID Context
+    )
+{
+    struct timespec due;
+    PKTIMER timer;
+    PKDPC dpc;
+    ULONGLONG now;
+
+    UNREFERENCED_PARAMETER( Context );
+
+    FanThread.Irql = PASSIVE_LEVEL;
+    FanThread.Processor = 0;
+
+    pthread_mutex_lock( &FanTimerLock );
+
+    while (!FanTimerStop) {
+
+        if (IsListEmpty( &FanTimerList )) {
+
+            pthread_cond_wait( &FanTimerWake, &FanTimerLock );
+            continue;
+        }
+
+        timer = CONTAINING_RECORD( FanTimerList.Flink, KTIMER, TimerListEntry );
+        now = KeQueryInterruptTime();
+
+        if (timer->DueTime > now) {
+
+            due.tv_sec = (time_t)(timer->DueTime / 10000000);
+            due.tv_nsec = (long)(timer->DueTime % 10000000) * 100;
+
+            pthread_cond_timedwait( &FanTimerWake, &FanTimerLock, &due );
+            continue;
+        }
+
+        RemoveEntryList( &timer->TimerListEntry );
+        timer->Inserted = FALSE;
+        dpc = timer->Dpc;
+
+        if (timer->Period > 0) {
+
+            timer->DueTime = max( timer->DueTime + (ULONGLONG) timer->Period * 10000, now );
+            FanInsertTimer( timer );
+        }
+
+        if (dpc == NULL) {
+
+            continue;
+        }
+
+        FanTimerRunning = dpc;
+        pthread_mutex_unlock( &FanTimerLock );
+
+        FanThread.Irql = DISPATCH_LEVEL;
+        dpc->DeferredRoutine( dpc, dpc->DeferredContext, NULL, NULL );
+        ASSERT( FanThread.Irql == DISPATCH_LEVEL );
+        FanThread.Irql = PASSIVE_LEVEL;
+
+        pthread_mutex_lock( &FanTimerLock );
+        FanTimerRunning = NULL;
+        pthread_cond_broadcast( &FanTimerIdle );
+    }
+
+    pthread_mutex_unlock( &FanTimerLock );
+
+    return NULL;
+}
+
+
+static
+VOID
+FanStopTimers (
+    VOID
+    )
+{
+    pthread_mutex_lock( &FanTimerLock );
+
+    if (!FanTimerThreadStarted) {
+
+        pthread_mutex_unlock( &FanTimerLock );
+        return;
+    }
+
+    FanTimerStop = TRUE;
+    pthread_cond_signal( &FanTimerWake );
+    pthread_mutex_unlock( &FanTimerLock );
+
+    pthread_join( FanTimerThread, NULL );
+
+    FanTimerThreadStarted = FALSE;
+    FanTimerStop = FALSE;
+}
+
+
+VOID
+KeInitializeDpc (
+    __out PRKDPC Dpc,
+    __in PKDEFERRED_ROUTINE DeferredRoutine,
+    __in_opt PVOID DeferredContext
+    )
+{
+    Dpc->DeferredRoutine = DeferredRoutine;
+    Dpc->DeferredContext = DeferredContext;
+}
+
+
+VOID
+KeInitializeTimer (
+    __out PKTIMER Timer
+    )
+{
+    InitializeListHead( &Timer->TimerListEntry );
+    Timer->DueTime = 0;
+    Timer->Period = 0;
+    Timer->Inserted = FALSE;
+    Timer->Dpc = NULL;
+}
+
+
+BOOLEAN
+KeSetTimerEx (
+    __inout PKTIMER Timer,
+    __in LARGE_INTEGER DueTime,
+    __in LONG Period,
+    __in_opt PKDPC Dpc
+    )
+/*++
+
+Routine Description:
+
+    Sets a timer due DueTime from now, if that is negative, or at the
+    system time DueTime, and then every Period milliseconds if that is
+    not 0.
+
+Return Value:
+
+    TRUE if the timer was already set.
+
+--*/
+{
+    BOOLEAN inserted;
+    LARGE_INTEGER systemTime;
+    ULONGLONG now;
+
+    FanEnsureInitialized();
+
+    now = KeQueryInterruptTime();
+
+    pthread_mutex_lock( &FanTimerLock );
+
+    inserted = Timer->Inserted;
+
+    if (inserted) {
+
+        RemoveEntryList( &Timer->TimerListEntry );
+    }
+
+    if (DueTime.QuadPart < 0) {
+
+        Timer->DueTime = now + (ULONGLONG)(-DueTime.QuadPart);
+
+    } else {
+
+        KeQuerySystemTime( &systemTime );
+
+        Timer->DueTime = (DueTime.QuadPart > systemTime.QuadPart) ?
+                         now + (ULONGLONG)(DueTime.QuadPart - systemTime.QuadPart) :
+                         now;
+    }
+
+    Timer->Period = Period;
+    Timer->Dpc = Dpc;
+
+    FanInsertTimer( Timer );
+
+    if (!FanTimerThreadStarted) {
+
+        FanTimerThreadStarted =
+            (BOOLEAN)(pthread_create( &FanTimerThread, NULL, FanTimerMain, NULL ) == 0);
+
+        ASSERT( FanTimerThreadStarted );
+    }
+
+    pthread_cond_signal( &FanTimerWake );
+    pthread_mutex_unlock( &FanTimerLock );
+
+    return inserted;
+}
+
+
+BOOLEAN
+KeCancelTimer (
+    __inout PKTIMER Timer
+    )
+{
+    BOOLEAN inserted;
+
+    pthread_mutex_lock( &FanTimerLock );
+
+    inserted = Timer->Inserted;
+
+    if (inserted) {
+
+        RemoveEntryList( &Timer->TimerListEntry );
+        Timer->Inserted = FALSE;
+    }
+
+    pthread_mutex_unlock( &FanTimerLock );
+
+    return inserted;
+}
+
+
+VOID
+KeFlushQueuedDpcs (
+    VOID
+    )
+{
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    pthread_mutex_lock( &FanTimerLock );
+
+    while (FanTimerRunning != NULL &&
+           !(FanTimerThreadStarted && pthread_equal( pthread_self(), FanTimerThread ))) {
+
+        pthread_cond_wait( &FanTimerIdle, &FanTimerLock );
+    }
+
+    pthread_mutex_unlock( &FanTimerLock );
+}
+
+//---------------------------------------------------------------------------
+//  Pool
+//---------------------------------------------------------------------------
+
+//
+//  Each allocation is headed by its size and tag and kept on a list, so
+//  that what is still allocated can be told by tag.  Node is the NUMA
+//  node it was allocated on, as the kernel allocates nonpaged pool from
+//  the current processor's node.
+//
+
+#define FAN_POOL_MAGIC              'looP'
+
+typedef struct DECLSPEC_ALIGN(16) _FAN_POOL_HEADER {
+
+    LIST_ENTRY Links;
+    SIZE_T Size;
+    ULONG Tag;
+    ULONG Magic;
+    ULONG Node;
+
+} FAN_POOL_HEADER, *PFAN_POOL_HEADER;
+
+static pthread_mutex_t FanPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY FanPoolList = { &FanPoolList, &FanPoolList };
+static FAN_SIM_POOL_STATISTICS FanPoolStatistics;
+static ULONG FanPoolFailEvery;
+static ULONG FanPoolFailTag;
+static ULONG FanPoolCountdown;
+
+
+PVOID
+ExAllocatePoolWithTag (
+    __in POOL_TYPE PoolType,
+    __in SIZE_T NumberOfBytes,
+    __in ULONG Tag
+    )
+{
+    PFAN_POOL_HEADER header;
+
+    if ((PoolType & ~NonPagedPoolNx) == PagedPool ||
+        (PoolType & ~NonPagedPoolNx) == PagedPoolCacheAligned) {
+
+        ASSERT( FanThread.Irql <= APC_LEVEL );
+
+    } else {
+
+        ASSERT( FanThread.Irql <= DISPATCH_LEVEL );
+    }
+
+    pthread_mutex_lock( &FanPoolLock );
+
+    if (FanPoolFailEvery != 0 &&
+        (FanPoolFailTag == 0 || FanPoolFailTag == Tag) &&
+        --FanPoolCountdown == 0) {
+
+        FanPoolCountdown = FanPoolFailEvery;
+        FanPoolStatistics.Failed += 1;
+
+        pthread_mutex_unlock( &FanPoolLock );
+        return NULL;
+    }
+
+    pthread_mutex_unlock( &FanPoolLock );
+
+    header = malloc( sizeof(FAN_POOL_HEADER) + NumberOfBytes );
+
+    if (header == NULL) {
+
+        return NULL;
+    }
+
+    header->Size = NumberOfBytes;
+    header->Tag = Tag;
+    header->Magic = FAN_POOL_MAGIC;
+    header->Node = KeGetCurrentNodeNumber();
+
+    pthread_mutex_lock( &FanPoolLock );
+
+    InsertTailList( &FanPoolList, &header->Links );
+
+    FanPoolStatistics.Allocations += 1;
+    FanPoolStatistics.AllocationsInUse += 1;
+    FanPoolStatistics.BytesInUse += NumberOfBytes;
+
+    FanPoolStatistics.PeakAllocationsInUse = max( FanPoolStatistics.PeakAllocationsInUse,
+                                                  FanPoolStatistics.AllocationsInUse );
+    FanPoolStatistics.PeakBytesInUse = max( FanPoolStatistics.PeakBytesInUse,
+                                            FanPoolStatistics.BytesInUse );
+
+    pthread_mutex_unlock( &FanPoolLock );
+
+    return header + 1;
+}
+
+
+VOID
+ExFreePoolWithTag (
+    __in PVOID P,
+    __in ULONG Tag
+    )
+/*++
+
+Routine Description:
+
+    Frees pool.  The kernel bug checks on a tag that does not match the
+    allocation's; here it is counted, and FanSimReportLeaks reports it.
+    Tag 0 matches any.
+
+--*/
+{
+    PFAN_POOL_HEADER header;
+
+    ASSERT( P != NULL );
+    ASSERT( FanThread.Irql <= DISPATCH_LEVEL );
+
+    header = (PFAN_POOL_HEADER) P - 1;
+
+    ASSERT( header->Magic == FAN_POOL_MAGIC );
+
+    pthread_mutex_lock( &FanPoolLock );
+
+    if (Tag != 0 && Tag != header->Tag) {
+
+        FanPoolStatistics.TagMismatches += 1;
+    }
+
+    RemoveEntryList( &header->Links );
+
+    FanPoolStatistics.Frees += 1;
+    FanPoolStatistics.AllocationsInUse -= 1;
+    FanPoolStatistics.BytesInUse -= header->Size;
+
+    pthread_mutex_unlock( &FanPoolLock );
+
+    header->Magic = 0;
+    free( header );
+}
+
+
+VOID
+FanSimFailPoolAllocations (
+    __in ULONG Every
+    )
+{
+    pthread_mutex_lock( &FanPoolLock );
+
+    FanPoolFailEvery = Every;
+    FanPoolCountdown = Every;
+
+    pthread_mutex_unlock( &FanPoolLock );
+}
+
+
+VOID
+FanSimFailPoolTag (
+    __in ULONG Tag
+    )
+{
+    pthread_mutex_lock( &FanPoolLock );
+
+    FanPoolFailTag = Tag;
+
+    pthread_mutex_unlock( &FanPoolLock );
+}
+
+
+VOID
+FanSimPoolStatistics (
+    __out PFAN_SIM_POOL_STATISTICS Statistics
+    )
+{
+    pthread_mutex_lock( &FanPoolLock );
+
+    *Statistics = FanPoolStatistics;
+
+    pthread_mutex_unlock( &FanPoolLock );
+}
+
+
+ULONG
+FanSimPoolInUse (
+    __in ULONG Tag
+    )
+{
+    PLIST_ENTRY entry;
+    ULONG allocations = 0;
+
+    pthread_mutex_lock( &FanPoolLock );
+
+    for (entry = FanPoolList.Flink; entry != &FanPoolList; entry = entry->Flink) {
+
+        if (CONTAINING_RECORD( entry, FAN_POOL_HEADER, Links )->Tag == Tag) {
+
+            allocations++;
+        }
+    }
+
+    pthread_mutex_unlock( &FanPoolLock );
+
+    return allocations;
+}
+
+//---------------------------------------------------------------------------
+//  Lookaside lists
+//---------------------------------------------------------------------------
+
+//
+//  The depth the kernel gives a list that asks for none.
+//
+
+#define FAN_LOOKASIDE_DEPTH         256
+
+
+VOID
+ExInitializeNPagedLookasideList (
+    __out PNPAGED_LOOKASIDE_LIST Lookaside,
+    __in_opt PALLOCATE_FUNCTION Allocate,
+    __in_opt PFREE_FUNCTION Free,
+    __in ULONG Flags,
+    __in SIZE_T Size,
+    __in ULONG Tag,
+    __in USHORT Depth
+    )
+{
+    UNREFERENCED_PARAMETER( Flags );
+
+    ASSERT( Size >= sizeof(SINGLE_LIST_ENTRY) );
+
+    RtlZeroMemory( Lookaside, sizeof(NPAGED_LOOKASIDE_LIST) );
+
+    KeInitializeSpinLock( &Lookaside->Lock );
+    Lookaside->Depth = (Depth != 0) ? Depth : FAN_LOOKASIDE_DEPTH;
+    Lookaside->Type = NonPagedPool;
+    Lookaside->Tag = Tag;
+    Lookaside->Size = (ULONG) Size;
+    Lookaside->Allocate = Allocate;
+    Lookaside->Free = Free;
+}
+
+
+PVOID
+ExAllocateFromNPagedLookasideList (
+    __inout PNPAGED_LOOKASIDE_LIST Lookaside
+    )
+{
+    PSINGLE_LIST_ENTRY entry;
+
+    FanAcquireSpinLock( &Lookaside->Lock );
+
+    Lookaside->TotalAllocates += 1;
+    entry = Lookaside->ListHead.Next;
+
+    if (entry != NULL) {
+
+        Lookaside->ListHead.Next = entry->Next;
+        Lookaside->CurrentDepth -= 1;
+
+    } else {
+
+        Lookaside->AllocateMisses += 1;
+    }
+
+    FanReleaseSpinLock( &Lookaside->Lock );
+
+    if (entry != NULL) {
+
+        if (Lookaside->Allocate == NULL &&
+            ((PFAN_POOL_HEADER) entry - 1)->Node != KeGetCurrentNodeNumber()) {
+
+            __atomic_add_fetch( &FanPoolStatistics.RemoteAllocations, 1, __ATOMIC_RELAXED );
+        }
+
+        return entry;
+    }
+
+    return (Lookaside->Allocate != NULL) ?
+           Lookaside->Allocate( Lookaside->Type, Lookaside->Size, Lookaside->Tag ) :
+           ExAllocatePoolWithTag( Lookaside->Type, Lookaside->Size, Lookaside->Tag );
+}
+
+
+static
+VOID
+FanFreeLookasideEntry (
+    __in PNPAGED_LOOKASIDE_LIST Lookaside,
+    __in PVOID Entry
+    )
+{
+    if (Lookaside->Free != NULL) {
+
+        Lookaside->Free( Entry );
+
+    } else {
+
+        ExFreePoolWithTag( Entry, Lookaside->Tag );
+    }
+}
+
+
+VOID
+ExFreeToNPagedLookasideList (
+    __inout PNPAGED_LOOKASIDE_LIST Lookaside,
+    __in PVOID Entry
+    )
+{
+    PSINGLE_LIST_ENTRY entry = Entry;
+
+    FanAcquireSpinLock( &Lookaside->Lock );
+
+    Lookaside->TotalFrees += 1;
+
+    if (Lookaside->CurrentDepth < Lookaside->Depth) {
+
+        entry->Next = Lookaside->ListHead.Next;
+        Lookaside->ListHead.Next = entry;
+        Lookaside->CurrentDepth += 1;
+        entry = NULL;
+
+    } else {
+
+        Lookaside->FreeMisses += 1;
+    }
+
+    FanReleaseSpinLock( &Lookaside->Lock );
+
+    if (entry != NULL) {
+
+        FanFreeLookasideEntry( Lookaside, entry );
+    }
+}
+
+
+VOID
+ExDeleteNPagedLookasideList (
+    __inout PNPAGED_LOOKASIDE_LIST Lookaside
+    )
+{
+    PSINGLE_LIST_ENTRY entry;
+
+    while ((entry = Lookaside->ListHead.Next) != NULL) {
+
+        Lookaside->ListHead.Next = entry->Next;
+        FanFreeLookasideEntry( Lookaside, entry );
+    }
+
+    Lookaside->CurrentDepth = 0;
+}
+
+//---------------------------------------------------------------------------
+//  Objects and handles
+//---------------------------------------------------------------------------
+
+//
+//  Every object the driver may reference or hold a handle to starts with
+//  a FAN_OBJECT, and a handle is the object's address.  Permanent objects
+//  hold a reference of their own; a temporary one, a key or file opened
+//  by handle, goes away with its last.
+//
+
+typedef enum _FAN_OBJECT_TYPE {
+
+    FanProcessObject = 1,
+    FanThreadObject,
+    FanTokenObject,
+    FanDeviceObject,
+    FanDriverObject,
+    FanEventObject,
+    FanKeyObject,
+    FanFileObject
+
+} FAN_OBJECT_TYPE;
+
+typedef struct _FAN_OBJECT {
+
+    LONG PointerCount;
+    FAN_OBJECT_TYPE Type;
+    BOOLEAN Temporary;
+
+} FAN_OBJECT, *PFAN_OBJECT;
+
+static LONG FanKeyHandles;
+
+static
+VOID
+FanDeleteFileObject (
+    __in PFAN_OBJECT Object
+    );
+
+
+static
+VOID
+FanReferenceObject (
+    __in PVOID Object
+    )
+{
+    PFAN_OBJECT object = Object;
+
+    ASSERT( object->PointerCount > 0 );
+
+    InterlockedIncrement( &object->PointerCount );
+}
+
+
+VOID
+ObfDereferenceObject (
+    __in PVOID Object
+    )
+{
+    PFAN_OBJECT object = Object;
+    LONG count;
+
+    count = InterlockedDecrement( &object->PointerCount );
+
+    ASSERT( count >= 0 );
+    ASSERT( count > 0 || object->Temporary );
+
+    if (count > 0) {
+
+        return;
+    }
+
+    if (object->Type == FanKeyObject) {
+
+        InterlockedDecrement( &FanKeyHandles );
+        free( object );
+
+    } else if (object->Type == FanFileObject) {
+
+        FanDeleteFileObject( object );
+    }
+}
+
+
+NTSTATUS
+ObOpenObjectByPointer (
+    __in PVOID Object,
+    __in ULONG HandleAttributes,
+    __in_opt PACCESS_STATE PassedAccessState,
+    __in ACCESS_MASK DesiredAccess,
+    __in_opt POBJECT_TYPE ObjectType,
+    __in KPROCESSOR_MODE AccessMode,
+    __out PHANDLE Handle
+    )
+{
+    UNREFERENCED_PARAMETER( HandleAttributes );
+    UNREFERENCED_PARAMETER( PassedAccessState );
+    UNREFERENCED_PARAMETER( DesiredAccess );
+    UNREFERENCED_PARAMETER( ObjectType );
+    UNREFERENCED_PARAMETER( AccessMode );
+
+    FanReferenceObject( Object );
+    *Handle = Object;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+ZwClose (
+    __in HANDLE Handle
+    )
+{
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    if (Handle == NULL) {
+
+        return STATUS_INVALID_HANDLE;
+    }
+
+    if (Handle != NtCurrentProcess()) {
+
+        ObDereferenceObject( Handle );
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//---------------------------------------------------------------------------
+//  Processes, threads and tokens
+//---------------------------------------------------------------------------
+
+#define FAN_SID_SIZE                (FIELD_OFFSET(SID, SubAuthority) + \
+                                     SID_MAX_SUB_AUTHORITIES * sizeof(ULONG))
+
+#define FAN_MAX_GROUPS              8
+
+typedef struct _FAN_TOKEN {
+
+    FAN_OBJECT Header;
+
+    LUID AuthenticationId;
+
+    ULONG GroupCount;
+    ULONG GroupAttributes[FAN_MAX_GROUPS];
+    ULONG Groups[FAN_MAX_GROUPS][FAN_SID_SIZE / sizeof(ULONG)];
+    ULONG User[FAN_SID_SIZE / sizeof(ULONG)];
+
+} FAN_TOKEN, *PFAN_TOKEN;
+
+//
+//  A process has one thread, which every thread of the simulation running
+//  as the process is.
+//
+
+struct _KTHREAD {
+
+    FAN_OBJECT Header;
+    PEPROCESS Process;
+    ULONG ThreadId;
+};
+
+struct _KPROCESS {
+
+    FAN_OBJECT Header;
+    LIST_ENTRY Links;
+
+    ULONG ProcessId;
+    LONGLONG CreateTime;
+
+    //
+    //  The image's file name, as PsGetProcessImageFileName returns it, and
+    //  its full name on the volume, as ZwQueryInformationProcess does.
+    //
+
+    UCHAR ImageFileName[16];
+    USHORT ImageNameLength;
+    WCHAR ImageName[MAX_PATH];
+
+    PFAN_TOKEN Token;
+    struct _KTHREAD Thread;
+};
+
+static pthread_mutex_t FanProcessLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY FanProcessList = { &FanProcessList, &FanProcessList };
+static PEPROCESS FanSystemProcess;
+
+
+static
+PEPROCESS
+FanCurrentProcess (
+    VOID
+    )
+{
+    FanEnsureInitialized();
+
+    return (FanThread.Process != NULL) ? FanThread.Process : FanSystemProcess;
+}
+
+
+static
+PEPROCESS
+FanFindProcess (
+    __in ULONG ProcessId
+    )
+{
+    PLIST_ENTRY entry;
+    PEPROCESS process;
+
+    for (entry = FanProcessList.Flink; entry != &FanProcessList; entry = entry->Flink) {
+
+        process = CONTAINING_RECORD( entry, struct _KPROCESS, Links );
+
+        if (process->ProcessId == ProcessId) {
+
+            return process;
+        }
+    }
+
+    return NULL;
+}
+
+
+static
+PEPROCESS
+FanProcessFromHandle (
+    __in HANDLE ProcessHandle
+    )
+{
+    PEPROCESS process;
+
+    if (ProcessHandle == NtCurrentProcess()) {
+
+        return FanCurrentProcess();
+    }
+
+    process = ProcessHandle;
+
+    ASSERT( process->Header.Type == FanProcessObject );
+
+    return process;
+}
+
+
+static
+NTSTATUS
+FanAddProcess (
+    __in ULONG ProcessId,
+    __in PCSTR ImageName,
+    __in PCSTR UserSid
+    )
+/*++
+
+Routine Description:
+
+    Starts a process running ImageName, a name on the volume such as
+    "\Program Files\a.exe", as the user UserSid, such as "S-1-5-21-1-1001".
+    Its token has the user, Everyone and BUILTIN\Users.
+
+Return Value:
+
+    STATUS_OBJECT_NAME_COLLISION if there is a process ProcessId already.
+
+--*/
+{
+    static CONST PCSTR defaultGroups[] = { "S-1-1-0", "S-1-5-32-545" };
+    LARGE_INTEGER now;
+    PEPROCESS process;
+    PCSTR fileName;
+    SIZE_T index;
+    SIZE_T length;
+
+    process = calloc( 1, sizeof(struct _KPROCESS) );
+
+    if (process == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    process->Token = calloc( 1, sizeof(FAN_TOKEN) );
+
+    if (process->Token == NULL) {
+
+        free( process );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (!FanParseSid( UserSid, (PISID) process->Token->User )) {
+
+        free( process->Token );
+        free( process );
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    process->Header.PointerCount = 1;
+    process->Header.Type = FanProcessObject;
+    process->ProcessId = ProcessId;
+
+    KeQuerySystemTime( &now );
+    process->CreateTime = now.QuadPart;
+
+    fileName = strrchr( ImageName, '\\' );
+    fileName = (fileName != NULL) ? fileName + 1 : ImageName;
+    strncpy( (char *) process->ImageFileName, fileName, sizeof(process->ImageFileName) - 1 );
+
+    length = FanWidenAscii( process->ImageName, MAX_PATH, FAN_SIM_VOLUME_NAME );
+    length += FanWidenAscii( process->ImageName + length, MAX_PATH - length, ImageName );
+    process->ImageNameLength = (USHORT)(length * sizeof(WCHAR));
+
+    process->Token->Header.PointerCount = 1;
+    process->Token->Header.Type = FanTokenObject;
+    process->Token->AuthenticationId.LowPart = (ProcessId == FAN_SIM_SYSTEM_PROCESS) ?
+                                               0x3e7 : 0x10000 + ProcessId;
+
+    for (index = 0; index < sizeof(defaultGroups) / sizeof(defaultGroups[0]); index++) {
+
+        FanParseSid( defaultGroups[index], (PISID) process->Token->Groups[index] );
+        process->Token->GroupAttributes[index] = SE_GROUP_MANDATORY |
+                                                 SE_GROUP_ENABLED_BY_DEFAULT |
+                                                 SE_GROUP_ENABLED;
+        process->Token->GroupCount += 1;
+    }
+
+    process->Thread.Header.PointerCount = 1;
+    process->Thread.Header.Type = FanThreadObject;
+    process->Thread.Process = process;
+    process->Thread.ThreadId = ProcessId + 4;
+
+    pthread_mutex_lock( &FanProcessLock );
+
+    if (FanFindProcess( ProcessId ) != NULL) {
+
+        pthread_mutex_unlock( &FanProcessLock );
+
+        free( process->Token );
+        free( process );
+        return STATUS_OBJECT_NAME_COLLISION;
+    }
+
+    InsertTailList( &FanProcessList, &process->Links );
+
+    pthread_mutex_unlock( &FanProcessLock );
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+FanSimAddProcess (
+    __in ULONG ProcessId,
+    __in PCSTR ImageName,
+    __in PCSTR UserSid
+    )
+{
+    FanEnsureInitialized();
+
+    return FanAddProcess( ProcessId, ImageName, UserSid );
+}
+
+
+NTSTATUS
+FanSimAddGroup (
+    __in ULONG ProcessId,
+    __in PCSTR GroupSid,
+    __in ULONG Attributes
+    )
+{
+    PEPROCESS process;
+    PFAN_TOKEN token;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    FanEnsureInitialized();
+
+    pthread_mutex_lock( &FanProcessLock );
+
+    process = FanFindProcess( ProcessId );
+
+    if (process == NULL) {
+
+        status = STATUS_INVALID_CID;
+
+    } else if (process->Token->GroupCount == FAN_MAX_GROUPS) {
+
+        status = STATUS_INSUFFICIENT_RESOURCES;
+
+    } else {
+
+        token = process->Token;
+
+        if (FanParseSid( GroupSid, (PISID) token->Groups[token->GroupCount] )) {
+
+            token->GroupAttributes[token->GroupCount++] = Attributes;
+
+        } else {
+
+            status = STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    pthread_mutex_unlock( &FanProcessLock );
+
+    return status;
+}
+
+
+NTSTATUS
+FanSimSetProcess (
+    __in ULONG ProcessId
+    )
+{
+    PEPROCESS process;
+
+    FanEnsureInitialized();
+
+    pthread_mutex_lock( &FanProcessLock );
+    process = FanFindProcess( ProcessId );
+    pthread_mutex_unlock( &FanProcessLock );
+
+    if (process == NULL) {
+
+        return STATUS_INVALID_CID;
+    }
+
+    FanThread.Process = (process != FanSystemProcess) ? process : NULL;
+
+    return STATUS_SUCCESS;
+}
+
+
+PEPROCESS
+PsGetCurrentProcess (
+    VOID
+    )
+{
+    return FanCurrentProcess();
+}
+
+
+HANDLE
+PsGetCurrentProcessId (
+    VOID
+    )
+{
+    return (HANDLE)(ULONG_PTR) FanCurrentProcess()->ProcessId;
+}
+
+
+HANDLE
+PsGetCurrentThreadId (
+    VOID
+    )
+{
+    return (HANDLE)(ULONG_PTR) FanCurrentProcess()->Thread.ThreadId;
+}
+
+
+HANDLE
+PsGetProcessId (
+    __in PEPROCESS Process
+    )
+{
+    return (HANDLE)(ULONG_PTR) Process->ProcessId;
+}
+
+
+UCHAR *
+PsGetProcessImageFileName (
+    __in PEPROCESS Process
+    )
+{
+    return Process->ImageFileName;
+}
+
+
+LONGLONG
+PsGetProcessCreateTimeQuadPart (
+    __in PEPROCESS Process
+    )
+{
+    return Process->CreateTime;
+}
+
+
+NTSTATUS
+PsLookupProcessByProcessId (
+    __in HANDLE ProcessId,
+    __out PEPROCESS *Process
+    )
+{
+    PEPROCESS process;
+
+    FanEnsureInitialized();
+
+    pthread_mutex_lock( &FanProcessLock );
+
+    process = FanFindProcess( (ULONG)(ULONG_PTR) ProcessId );
+
+    if (process != NULL) {
+
+        FanReferenceObject( process );
+    }
+
+    pthread_mutex_unlock( &FanProcessLock );
+
+    *Process = process;
+
+    return (process != NULL) ? STATUS_SUCCESS : STATUS_INVALID_CID;
+}
+
+
+PEPROCESS
+IoThreadToProcess (
+    __in PETHREAD Thread
+    )
+{
+    return Thread->Process;
+}
+
+
+PACCESS_TOKEN
+PsReferencePrimaryToken (
+    __inout PEPROCESS Process
+    )
+{
+    FanReferenceObject( Process->Token );
+
+    return Process->Token;
+}
+
+
+VOID
+PsDereferencePrimaryToken (
+    __in PACCESS_TOKEN PrimaryToken
+    )
+{
+    ObDereferenceObject( PrimaryToken );
+}
+
+
+static
+NTSTATUS
+FanQueryToken (
+    __in PFAN_TOKEN Token,
+    __in TOKEN_INFORMATION_CLASS TokenInformationClass,
+    __out_bcount_part_opt(Length,*ResultLength) PVOID TokenInformation,
+    __in ULONG Length,
+    __out PULONG ResultLength
+    )
+/*++
+
+Routine Description:
+
+    Fills in the user, owner or groups of a token, with the SIDs after
+    the structure, as ZwQueryInformationToken does.
+
+Return Value:
+
+    STATUS_BUFFER_TOO_SMALL, with the length needed in ResultLength, if
+    Length is short of it.
+
+--*/
+{
+    PTOKEN_GROUPS groups;
+    PTOKEN_USER user;
+    PTOKEN_OWNER owner;
+    PUCHAR sid;
+    ULONG required;
+    ULONG index;
+
+    switch (TokenInformationClass) {
+
+    case TokenUser:
+    case TokenOwner:
+
+        required = (ULONG) ALIGN_UP_BY( (TokenInformationClass == TokenUser) ?
+                                        sizeof(TOKEN_USER) : sizeof(TOKEN_OWNER),
+                                        sizeof(ULONG) ) +
+                   RtlLengthSid( Token->User );
+        break;
+
+    case TokenGroups:
+
+        required = FIELD_OFFSET(TOKEN_GROUPS, Groups) +
+                   Token->GroupCount * sizeof(SID_AND_ATTRIBUTES);
+
+        for (index = 0; index < Token->GroupCount; index++) {
+
+            required += RtlLengthSid( Token->Groups[index] );
+        }
+
+        break;
+
+    default:
+
+        return STATUS_INVALID_INFO_CLASS;
+    }
+
+    *ResultLength = required;
+
+    if (Length < required || TokenInformation == NULL) {
+
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    switch (TokenInformationClass) {
+
+    case TokenUser:
+
+        user = TokenInformation;
+        sid = Add2Ptr( user, ALIGN_UP_BY( sizeof(TOKEN_USER), sizeof(ULONG) ) );
+
+        user->User.Sid = sid;
+        user->User.Attributes = 0;
+        RtlCopyMemory( sid, Token->User, RtlLengthSid( Token->User ) );
+        break;
+
+    case TokenOwner:
+
+        owner = TokenInformation;
+        sid = Add2Ptr( owner, ALIGN_UP_BY( sizeof(TOKEN_OWNER), sizeof(ULONG) ) );
+
+        owner->Owner = sid;
+        RtlCopyMemory( sid, Token->User, RtlLengthSid( Token->User ) );
+        break;
+
+    default:
+
+        groups = TokenInformation;
+        sid = (PUCHAR) &groups->Groups[Token->GroupCount];
+
+        groups->GroupCount = Token->GroupCount;
+
+        for (index = 0; index < Token->GroupCount; index++) {
+
+            groups->Groups[index].Sid = sid;
+            groups->Groups[index].Attributes = Token->GroupAttributes[index];
+
+            RtlCopyMemory( sid, Token->Groups[index], RtlLengthSid( Token->Groups[index] ) );
+            sid += RtlLengthSid( Token->Groups[index] );
+        }
+
+        break;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+SeQueryInformationToken (
+    __in PACCESS_TOKEN Token,
+    __in TOKEN_INFORMATION_CLASS TokenInformationClass,
+    __deref_out PVOID *TokenInformation
+    )
+{
+    NTSTATUS status;
+    ULONG length = 0;
+    PVOID information;
+
+    *TokenInformation = NULL;
+
+    status = FanQueryToken( Token, TokenInformationClass, NULL, 0, &length );
+
+    if (status != STATUS_BUFFER_TOO_SMALL) {
+
+        return status;
+    }
+
+    information = ExAllocatePoolWithTag( PagedPool, length, FAN_TOKEN_TAG );
+
+    if (information == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = FanQueryToken( Token, TokenInformationClass, information, length, &length );
+
+    ASSERT( NT_SUCCESS( status ) );
+
+    *TokenInformation = information;
+
+    return status;
+}
+
+
+NTSTATUS
+SeQueryAuthenticationIdToken (
+    __in PACCESS_TOKEN Token,
+    __out PLUID AuthenticationId
+    )
+{
+    *AuthenticationId = ((PFAN_TOKEN) Token)->AuthenticationId;
+
+    return STATUS_SUCCESS;
+}
+
+
+PACCESS_TOKEN
+SeQuerySubjectContextToken (
+    __in PSECURITY_SUBJECT_CONTEXT SubjectContext
+    )
+{
+    return (SubjectContext->ClientToken != NULL) ?
+           SubjectContext->ClientToken : SubjectContext->PrimaryToken;
+}
+
+
+NTSTATUS
+ZwOpenProcessTokenEx (
+    __in HANDLE ProcessHandle,
+    __in ACCESS_MASK DesiredAccess,
+    __in ULONG HandleAttributes,
+    __out PHANDLE TokenHandle
+    )
+{
+    PEPROCESS process;
+
+    UNREFERENCED_PARAMETER( DesiredAccess );
+    UNREFERENCED_PARAMETER( HandleAttributes );
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    if (ProcessHandle == NULL) {
+
+        return STATUS_INVALID_HANDLE;
+    }
+
+    process = FanProcessFromHandle( ProcessHandle );
+
+    FanReferenceObject( process->Token );
+    *TokenHandle = process->Token;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+ZwQueryInformationToken (
+    __in HANDLE TokenHandle,
+    __in TOKEN_INFORMATION_CLASS TokenInformationClass,
+    __out_bcount_part_opt(Length,*ResultLength) PVOID TokenInformation,
+    __in ULONG Length,
+    __out PULONG ResultLength
+    )
+{
+    PFAN_TOKEN token = TokenHandle;
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    if (token == NULL) {
+
+        return STATUS_INVALID_HANDLE;
+    }
+
+    ASSERT( token->Header.Type == FanTokenObject );
+
+    return FanQueryToken( token, TokenInformationClass, TokenInformation, Length, ResultLength );
+}
+
+
+static
+NTSTATUS
+FanQueryInformationProcess (
+    __in HANDLE ProcessHandle,
+    __in PROCESSINFOCLASS ProcessInformationClass,
+    __out_bcount(ProcessInformationLength) PVOID ProcessInformation,
+    __in ULONG ProcessInformationLength,
+    __out_opt PULONG ReturnLength
+    )
+/*++
+
+Routine Description:
+
+    ZwQueryInformationProcess, which the kernel does not export by name
+    and the driver finds with MmGetSystemRoutineAddress.  Only the image
+    file name is known: a UNICODE_STRING followed by the name.
+
+--*/
+{
+    PUNICODE_STRING name = ProcessInformation;
+    PEPROCESS process;
+    ULONG required;
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    if (ProcessHandle == NULL) {
+
+        return STATUS_INVALID_HANDLE;
+    }
+
+    if (ProcessInformationClass != ProcessImageFileName) {
+
+        return STATUS_INVALID_INFO_CLASS;
+    }
+
+    process = FanProcessFromHandle( ProcessHandle );
+    required = sizeof(UNICODE_STRING) + process->ImageNameLength + sizeof(WCHAR);
+
+    if (ReturnLength != NULL) {
+
+        *ReturnLength = required;
+    }
+
+    if (ProcessInformationLength < required) {
+
+        return STATUS_INFO_LENGTH_MISMATCH;
+    }
+
+    name->Length = process->ImageNameLength;
+    name->MaximumLength = process->ImageNameLength + sizeof(WCHAR);
+    name->Buffer = (PWCH)(name + 1);
+
+    RtlCopyMemory( name->Buffer, process->ImageName, process->ImageNameLength );
+    name->Buffer[process->ImageNameLength / sizeof(WCHAR)] = UNICODE_NULL;
+
+    return STATUS_SUCCESS;
+}
+
+
+PVOID
+MmGetSystemRoutineAddress (
+    __in PUNICODE_STRING SystemRoutineName
+    )
+{
+    if (FanEqualAscii( SystemRoutineName->Buffer,
+                       SystemRoutineName->Length / sizeof(WCHAR),
+                       "ZwQueryInformationProcess",
+                       FALSE )) {
+
+        return (PVOID) FanQueryInformationProcess;
+    }
+
+    return NULL;
+}
+
+
+BOOLEAN
+IoIs32bitProcess (
+    __in_opt PVOID Irp
+    )
+{
+    UNREFERENCED_PARAMETER( Irp );
+
+    return FALSE;
+}
+
+//---------------------------------------------------------------------------
+//  Registry
+//---------------------------------------------------------------------------
+
+typedef struct _FAN_REGISTRY_VALUE {
+
+    LIST_ENTRY Links;
+    PWCH Name;
+    USHORT NameLength;
+    ULONG Type;
+    ULONG DataLength;
+    PUCHAR Data;
+
+} FAN_REGISTRY_VALUE, *PFAN_REGISTRY_VALUE;
+
+typedef struct _FAN_REGISTRY_KEY {
+
+    LIST_ENTRY Links;
+    PWCH Name;
+    USHORT NameLength;
+    LIST_ENTRY Values;
+
+} FAN_REGISTRY_KEY, *PFAN_REGISTRY_KEY;
+
+typedef struct _FAN_KEY_HANDLE {
+
+    FAN_OBJECT Header;
+    PFAN_REGISTRY_KEY Key;
+
+} FAN_KEY_HANDLE, *PFAN_KEY_HANDLE;
+
+static pthread_mutex_t FanRegistryLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY FanRegistryKeys = { &FanRegistryKeys, &FanRegistryKeys };
+
+
+static
+BOOLEAN
+FanEqualName (
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Name1,
+    __in USHORT Length1,
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Name2,
+    __in USHORT Length2
+    )
+{
+    UNICODE_STRING name1 = { Length1, Length1, (PWCH) Name1 };
+    UNICODE_STRING name2 = { Length2, Length2, (PWCH) Name2 };
+
+    return RtlEqualUnicodeString( &name1, &name2, TRUE );
+}
+
+
+static
+PFAN_REGISTRY_KEY
+FanFindKey (
+    __in PCWCH Name,
+    __in USHORT NameLength,
+    __in BOOLEAN Create
+    )
+{
+    PLIST_ENTRY entry;
+    PFAN_REGISTRY_KEY key;
+
+    for (entry = FanRegistryKeys.Flink; entry != &FanRegistryKeys; entry = entry->Flink) {
+
+        key = CONTAINING_RECORD( entry, FAN_REGISTRY_KEY, Links );
+
+        if (FanEqualName( key->Name, key->NameLength, Name, NameLength )) {
+
+            return key;
+        }
+    }
+
+    if (!Create) {
+
+        return NULL;
+    }
+
+    key = calloc( 1, sizeof(FAN_REGISTRY_KEY) );
+
+    if (key == NULL || (key->Name = malloc( NameLength + sizeof(WCHAR) )) == NULL) {
+
+        free( key );
+        return NULL;
+    }
+
+    RtlCopyMemory( key->Name, Name, NameLength );
+    key->NameLength = NameLength;
+    InitializeListHead( &key->Values );
+    InsertTailList( &FanRegistryKeys, &key->Links );
+
+    return key;
+}
+
+
+static
+PFAN_REGISTRY_VALUE
+FanFindValue (
+    __in PFAN_REGISTRY_KEY Key,
+    __in PCWCH Name,
+    __in USHORT NameLength
+    )
+{
+    PLIST_ENTRY entry;
+    PFAN_REGISTRY_VALUE value;
+
+    for (entry = Key->Values.Flink; entry != &Key->Values; entry = entry->Flink) {
+
+        value = CONTAINING_RECORD( entry, FAN_REGISTRY_VALUE, Links );
+
+        if (FanEqualName( value->Name, value->NameLength, Name, NameLength )) {
+
+            return value;
+        }
+    }
+
+    return NULL;
+}
+
+
+static
+NTSTATUS
+FanSetValue (
+    __in PFAN_REGISTRY_KEY Key,
+    __in PCWCH Name,
+    __in USHORT NameLength,
+    __in ULONG Type,
+    __in_bcount(DataLength) CONST VOID *Data,
+    __in ULONG DataLength
+    )
+{
+    PFAN_REGISTRY_VALUE value;
+    PUCHAR data;
+
+    data = malloc( DataLength + 1 );
+
+    if (data == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory( data, Data, DataLength );
+
+    value = FanFindValue( Key, Name, NameLength );
+
+    if (value == NULL) {
+
+        value = calloc( 1, sizeof(FAN_REGISTRY_VALUE) );
+
+        if (value == NULL || (value->Name = malloc( NameLength + sizeof(WCHAR) )) == NULL) {
+
+            free( value );
+            free( data );
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlCopyMemory( value->Name, Name, NameLength );
+        value->NameLength = NameLength;
+        InsertTailList( &Key->Values, &value->Links );
+    }
+
+    free( value->Data );
+
+    value->Type = Type;
+    value->DataLength = DataLength;
+    value->Data = data;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+FanSimSetRegistryValue (
+    __in PCSTR KeyName,
+    __in PCSTR ValueName,
+    __in ULONG Type,
+    __in_bcount(DataLength) CONST VOID *Data,
+    __in ULONG DataLength
+    )
+{
+    PFAN_REGISTRY_KEY key;
+    USHORT keyLength;
+    USHORT nameLength;
+    PWCH keyName = FanDuplicateAscii( KeyName, &keyLength );
+    PWCH valueName = FanDuplicateAscii( ValueName, &nameLength );
+
+    ASSERT( keyName != NULL && valueName != NULL );
+
+    pthread_mutex_lock( &FanRegistryLock );
+
+    key = FanFindKey( keyName, keyLength, TRUE );
+
+    ASSERT( key != NULL );
+
+    FanSetValue( key, valueName, nameLength, Type, Data, DataLength );
+
+    pthread_mutex_unlock( &FanRegistryLock );
+
+    free( keyName );
+    free( valueName );
+}
+
+
+VOID
+FanSimSetRegistryString (
+    __in PCSTR KeyName,
+    __in PCSTR ValueName,
+    __in PCSTR Value
+    )
+{
+    USHORT length;
+    PWCH value = FanDuplicateAscii( Value, &length );
+
+    ASSERT( value != NULL );
+
+    FanSimSetRegistryValue( KeyName, ValueName, REG_SZ, value, length + sizeof(WCHAR) );
+
+    free( value );
+}
+
+
+VOID
+FanSimSetRegistryDword (
+    __in PCSTR KeyName,
+    __in PCSTR ValueName,
+    __in ULONG Value
+    )
+{
+    FanSimSetRegistryValue( KeyName, ValueName, REG_DWORD, &Value, sizeof(Value) );
+}
+
+
+static
+PFAN_REGISTRY_KEY
+FanKeyFromHandle (
+    __in HANDLE KeyHandle
+    )
+{
+    PFAN_KEY_HANDLE handle = KeyHandle;
+
+    ASSERT( handle->Header.Type == FanKeyObject );
+
+    return handle->Key;
+}
+
+
+NTSTATUS
+ZwOpenKey (
+    __out PHANDLE KeyHandle,
+    __in ACCESS_MASK DesiredAccess,
+    __in POBJECT_ATTRIBUTES ObjectAttributes
+    )
+{
+    PFAN_REGISTRY_KEY key;
+    PFAN_KEY_HANDLE handle;
+
+    UNREFERENCED_PARAMETER( DesiredAccess );
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    *KeyHandle = NULL;
+
+    if (ObjectAttributes->RootDirectory != NULL || ObjectAttributes->ObjectName == NULL) {
+
+        return STATUS_OBJECT_NAME_INVALID;
+    }
+
+    pthread_mutex_lock( &FanRegistryLock );
+
+    key = FanFindKey( ObjectAttributes->ObjectName->Buffer,
+                      ObjectAttributes->ObjectName->Length,
+                      FALSE );
+
+    pthread_mutex_unlock( &FanRegistryLock );
+
+    if (key == NULL) {
+
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    handle = calloc( 1, sizeof(FAN_KEY_HANDLE) );
+
+    if (handle == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    handle->Header.PointerCount = 1;
+    handle->Header.Type = FanKeyObject;
+    handle->Header.Temporary = TRUE;
+    handle->Key = key;
+
+    InterlockedIncrement( &FanKeyHandles );
+    *KeyHandle = handle;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+ZwQueryValueKey (
+    __in HANDLE KeyHandle,
+    __in PUNICODE_STRING ValueName,
+    __in KEY_VALUE_INFORMATION_CLASS KeyValueInformationClass,
+    __out_bcount_opt(Length) PVOID KeyValueInformation,
+    __in ULONG Length,
+    __out PULONG ResultLength
+    )
+/*++
+
+Routine Description:
+
+    Returns a value's partial information, the only class known.
+
+Return Value:
+
+    STATUS_BUFFER_TOO_SMALL if Length is short of the structure's header,
+    STATUS_BUFFER_OVERFLOW if it is short of the data, which is copied as
+    far as it fits.  ResultLength is the length needed either way.
+
+--*/
+{
+    PKEY_VALUE_PARTIAL_INFORMATION information = KeyValueInformation;
+    PFAN_REGISTRY_KEY key = FanKeyFromHandle( KeyHandle );
+    PFAN_REGISTRY_VALUE value;
+    ULONG header = FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data);
+    NTSTATUS status;
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    if (KeyValueInformationClass != KeyValuePartialInformation) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    pthread_mutex_lock( &FanRegistryLock );
+
+    value = FanFindValue( key, ValueName->Buffer, ValueName->Length );
+
+    if (value == NULL) {
+
+        status = STATUS_OBJECT_NAME_NOT_FOUND;
+
+    } else {
+
+        *ResultLength = header + value->DataLength;
+
+        if (Length < header) {
+
+            status = STATUS_BUFFER_TOO_SMALL;
+
+        } else {
+
+            information->TitleIndex = 0;
+            information->Type = value->Type;
+            information->DataLength = value->DataLength;
+
+            RtlCopyMemory( information->Data,
+                           value->Data,
+                           min( Length - header, value->DataLength ) );
+
+            status = (Length - header < value->DataLength) ?
+                     STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+        }
+    }
+
+    pthread_mutex_unlock( &FanRegistryLock );
+
+    return status;
+}
+
+
+NTSTATUS
+ZwSetValueKey (
+    __in HANDLE KeyHandle,
+    __in PUNICODE_STRING ValueName,
+    __in_opt ULONG TitleIndex,
+    __in ULONG Type,
+    __in_bcount_opt(DataSize) PVOID Data,
+    __in ULONG DataSize
+    )
+{
+    PFAN_REGISTRY_KEY key = FanKeyFromHandle( KeyHandle );
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER( TitleIndex );
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    pthread_mutex_lock( &FanRegistryLock );
+
+    status = FanSetValue( key, ValueName->Buffer, ValueName->Length, Type, Data, DataSize );
+
+    pthread_mutex_unlock( &FanRegistryLock );
+
+    return status;
+}
+
+//---------------------------------------------------------------------------
+//  Named events
+//---------------------------------------------------------------------------
+
+typedef struct _FAN_EVENT {
+
+    FAN_OBJECT Header;
+    LIST_ENTRY Links;
+    PWCH Name;
+    USHORT NameLength;
+    KEVENT Event;
+
+} FAN_EVENT, *PFAN_EVENT;
+
+static pthread_mutex_t FanEventLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY FanEventList = { &FanEventList, &FanEventList };
+
+
+static
+PFAN_EVENT
+FanFindEvent (
+    __in PCWCH Name,
+    __in USHORT NameLength
+    )
+{
+    PLIST_ENTRY entry;
+    PFAN_EVENT event;
+
+    for (entry = FanEventList.Flink; entry != &FanEventList; entry = entry->Flink) {
+
+        event = CONTAINING_RECORD( entry, FAN_EVENT, Links );
+
+        if (FanEqualName( event->Name, event->NameLength, Name, NameLength )) {
+
+            return event;
+        }
+    }
+
+    event = calloc( 1, sizeof(FAN_EVENT) );
+
+    if (event == NULL || (event->Name = malloc( NameLength + sizeof(WCHAR) )) == NULL) {
+
+        free( event );
+        return NULL;
+    }
+
+    event->Header.PointerCount = 1;
+    event->Header.Type = FanEventObject;
+    RtlCopyMemory( event->Name, Name, NameLength );
+    event->NameLength = NameLength;
+    InsertTailList( &FanEventList, &event->Links );
+
+    return event;
+}
+
+
+PKEVENT
+IoCreateNotificationEvent (
+    __in PUNICODE_STRING EventName,
+    __out PHANDLE EventHandle
+    )
+{
+    PFAN_EVENT event;
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    pthread_mutex_lock( &FanEventLock );
+
+    event = FanFindEvent( EventName->Buffer, EventName->Length );
+
+    if (event != NULL) {
+
+        FanReferenceObject( event );
+    }
+
+    pthread_mutex_unlock( &FanEventLock );
+
+    *EventHandle = event;
+
+    return (event != NULL) ? &event->Event : NULL;
+}
+
+
+LONG
+KeReadStateEvent (
+    __in PRKEVENT Event
+    )
+{
+    return __atomic_load_n( &Event->SignalState, __ATOMIC_ACQUIRE );
+}
+
+
+VOID
+FanSimSetLowMemory (
+    __in BOOLEAN LowMemory
+    )
+/*++
+
+Routine Description:
+
+    Signals or resets \KernelObjects\LowNonPagedPoolCondition, as the
+    memory manager does when nonpaged pool runs low and recovers.
+
+--*/
+{
+    PFAN_EVENT event;
+    USHORT length;
+    PWCH name = FanDuplicateAscii( "\\KernelObjects\\LowNonPagedPoolCondition", &length );
+
+    ASSERT( name != NULL );
+
+    pthread_mutex_lock( &FanEventLock );
+
+    event = FanFindEvent( name, length );
+
+    ASSERT( event != NULL );
+
+    __atomic_store_n( &event->Event.SignalState, LowMemory ? 1 : 0, __ATOMIC_RELEASE );
+
+    pthread_mutex_unlock( &FanEventLock );
+
+    free( name );
+}
+
+//---------------------------------------------------------------------------
+//  Devices and the driver
+//---------------------------------------------------------------------------
+
+struct _DEVICE_OBJECT {
+
+    FAN_OBJECT Header;
+    DEVICE_TYPE DeviceType;
+};
+
+struct _DRIVER_OBJECT {
+
+    FAN_OBJECT Header;
+};
+
+//
+//  The volume's file system device and the disk under it.
+//
+
+static struct _DEVICE_OBJECT FanVolumeDevice = {
+    { 1, FanDeviceObject, FALSE }, FILE_DEVICE_DISK_FILE_SYSTEM
+};
+
+static struct _DEVICE_OBJECT FanDiskDevice = {
+    { 1, FanDeviceObject, FALSE }, FILE_DEVICE_DISK
+};
+
+static struct _DRIVER_OBJECT FanDriver = {
+    { 1, FanDriverObject, FALSE }
+};
+
+
+NTSTATUS
+RtlVolumeDeviceToDosName (
+    __in PVOID VolumeDeviceObject,
+    __out PUNICODE_STRING DosName
+    )
+{
+    SIZE_T count = strlen( FAN_SIM_DOS_NAME );
+
+    ASSERT( VolumeDeviceObject == &FanDiskDevice || VolumeDeviceObject == &FanVolumeDevice );
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    DosName->Buffer = ExAllocatePool( PagedPool, (count + 1) * sizeof(WCHAR) );
+
+    if (DosName->Buffer == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    FanWidenAscii( DosName->Buffer, count + 1, FAN_SIM_DOS_NAME );
+    DosName->Length = (USHORT)(count * sizeof(WCHAR));
+    DosName->MaximumLength = (USHORT)((count + 1) * sizeof(WCHAR));
+
+    return STATUS_SUCCESS;
+}
+
+//---------------------------------------------------------------------------
+//  Filter manager: the filter, its instance and the volume
+//---------------------------------------------------------------------------
+
+//
+//  One filter may register, and its one instance attaches to the volume
+//  when it starts filtering.  Operations in flight hold Rundown shared;
+//  FltUnregisterFilter takes it exclusive, so it waits for them to drain
+//  before the instance is torn down.
+//
+
+struct _FLT_FILTER {
+
+    CONST FLT_REGISTRATION *Registration;
+    PFLT_PRE_OPERATION_CALLBACK PreOperation[IRP_MJ_MAXIMUM_FUNCTION + 1];
+    PFLT_POST_OPERATION_CALLBACK PostOperation[IRP_MJ_MAXIMUM_FUNCTION + 1];
+
+    BOOLEAN Registered;
+    BOOLEAN Attached;
+
+    pthread_rwlock_t Rundown;
+};
+
+struct _FLT_VOLUME {
+
+    pthread_mutex_t ContextLock;
+    PFLT_CONTEXT Context;
+};
+
+struct _FLT_INSTANCE {
+
+    PFLT_VOLUME Volume;
+};
+
+static struct _FLT_FILTER FanFilter = {
+    .Rundown = PTHREAD_RWLOCK_INITIALIZER
+};
+
+static struct _FLT_VOLUME FanVolume = {
+    .ContextLock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static struct _FLT_INSTANCE FanInstance = {
+    &FanVolume
+};
+
+//
+//  The volume's name, \Device\HarddiskVolume1, as the names the filter
+//  manager hands out start.
+//
+
+static WCHAR FanVolumeName[sizeof(FAN_SIM_VOLUME_NAME)];
+static USHORT FanVolumeNameLength;
+
+
+static
+VOID
+FanRelatedObjects (
+    __out PFLT_RELATED_OBJECTS Objects,
+    __in_opt PFILE_OBJECT FileObject
+    )
+{
+    RtlZeroMemory( Objects, sizeof(FLT_RELATED_OBJECTS) );
+
+    Objects->Size = sizeof(FLT_RELATED_OBJECTS);
+    Objects->Filter = &FanFilter;
+    Objects->Volume = &FanVolume;
+    Objects->Instance = &FanInstance;
+    Objects->FileObject = FileObject;
+}
+
+
+NTSTATUS
+FltRegisterFilter (
+    __in PDRIVER_OBJECT Driver,
+    __in CONST FLT_REGISTRATION *Registration,
+    __deref_out PFLT_FILTER *RetFilter
+    )
+{
+    CONST FLT_OPERATION_REGISTRATION *operation;
+
+    ASSERT( Driver == &FanDriver );
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    *RetFilter = NULL;
+
+    if (Registration->Size < sizeof(FLT_REGISTRATION) ||
+        (Registration->Version >> 8) != (FLT_REGISTRATION_VERSION >> 8)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FanFilter.Registered) {
+
+        return STATUS_OBJECT_NAME_COLLISION;
+    }
+
+    RtlZeroMemory( FanFilter.PreOperation, sizeof(FanFilter.PreOperation) );
+    RtlZeroMemory( FanFilter.PostOperation, sizeof(FanFilter.PostOperation) );
+
+    //
+    //  The operations the filter manager alone has, with negative codes,
+    //  never happen here.
+    //
+
+    for (operation = Registration->OperationRegistration;
+         operation != NULL && operation->MajorFunction != IRP_MJ_OPERATION_END;
+         operation++) {
+
+        if (operation->MajorFunction <= IRP_MJ_MAXIMUM_FUNCTION) {
+
+            FanFilter.PreOperation[operation->MajorFunction] = operation->PreOperation;
+            FanFilter.PostOperation[operation->MajorFunction] = operation->PostOperation;
+        }
+    }
+
+    FanFilter.Registration = Registration;
+    FanFilter.Registered = TRUE;
+    FanFilter.Attached = FALSE;
+
+    *RetFilter = &FanFilter;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+FltStartFiltering (
+    __in PFLT_FILTER Filter
+    )
+{
+    FLT_RELATED_OBJECTS objects;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    ASSERT( Filter == &FanFilter && Filter->Registered );
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    FanRelatedObjects( &objects, NULL );
+
+    if (Filter->Registration->InstanceSetupCallback != NULL) {
+
+        status = Filter->Registration->InstanceSetupCallback( &objects,
+                                                              FLTFL_INSTANCE_SETUP_AUTOMATIC_ATTACHMENT,
+                                                              FILE_DEVICE_DISK_FILE_SYSTEM,
+                                                              FLT_FSTYPE_NTFS );
+    }
+
+    pthread_rwlock_wrlock( &Filter->Rundown );
+    Filter->Attached = (BOOLEAN) NT_SUCCESS( status );
+    pthread_rwlock_unlock( &Filter->Rundown );
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+FanDeleteVolumeContext (
+    VOID
+    );
+
+
+VOID
+FltUnregisterFilter (
+    __in PFLT_FILTER Filter
+    )
+{
+    FLT_RELATED_OBJECTS objects;
+    BOOLEAN attached;
+
+    ASSERT( Filter == &FanFilter && Filter->Registered );
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    pthread_rwlock_wrlock( &Filter->Rundown );
+
+    attached = Filter->Attached;
+    Filter->Attached = FALSE;
+
+    pthread_rwlock_unlock( &Filter->Rundown );
+
+    if (attached) {
+
+        FanRelatedObjects( &objects, NULL );
+
+        if (Filter->Registration->InstanceTeardownStartCallback != NULL) {
+
+            Filter->Registration->InstanceTeardownStartCallback( &objects,
+                                                                 FLTFL_INSTANCE_TEARDOWN_FILTER_UNLOAD );
+        }
+
+        if (Filter->Registration->InstanceTeardownCompleteCallback != NULL) {
+
+            Filter->Registration->InstanceTeardownCompleteCallback( &objects,
+                                                                    FLTFL_INSTANCE_TEARDOWN_FILTER_UNLOAD );
+        }
+
+        FanDeleteVolumeContext();
+    }
+
+    Filter->Registered = FALSE;
+}
+
+
+PVOID
+FltGetRoutineAddress (
+    __in PCSTR FltMgrRoutineName
+    )
+/*++
+
+Routine Description:
+
+    The filter manager here is the down-level one: the routines looked
+    up by name, the transaction ones, are not there.
+
+--*/
+{
+    UNREFERENCED_PARAMETER( FltMgrRoutineName );
+
+    return NULL;
+}
+
+
+static
+VOID
+FanVolumeString (
+    __inout PUNICODE_STRING String,
+    __inout PUCHAR *Next,
+    __in PUCHAR End,
+    __in PCSTR Value
+    )
+{
+    SIZE_T count = strlen( Value );
+
+    String->Length = String->MaximumLength = 0;
+    String->Buffer = NULL;
+
+    if ((SIZE_T)(End - *Next) < count * sizeof(WCHAR)) {
+
+        *Next = End;
+        return;
+    }
+
+    String->Buffer = (PWCH) *Next;
+    String->Length = String->MaximumLength = (USHORT)(count * sizeof(WCHAR));
+
+    for (; *Value != ANSI_NULL; Value++) {
+
+        *String->Buffer++ = (WCHAR)(UCHAR) *Value;
+    }
+
+    String->Buffer = (PWCH) *Next;
+    *Next += count * sizeof(WCHAR);
+}
+
+
+NTSTATUS
+FltGetVolumeProperties (
+    __in PFLT_VOLUME Volume,
+    __out_bcount_part_opt(VolumePropertiesLength,*LengthReturned) PFLT_VOLUME_PROPERTIES VolumeProperties,
+    __in ULONG VolumePropertiesLength,
+    __out PULONG LengthReturned
+    )
+/*++
+
+Routine Description:
+
+    Describes the volume, with its names after the structure.
+
+Return Value:
+
+    STATUS_BUFFER_TOO_SMALL if the structure itself does not fit,
+    STATUS_BUFFER_OVERFLOW if the names do not all fit; those that do not
+    are left empty.  LengthReturned is the length needed either way.
+
+--*/
+{
+    static CONST PCSTR driverName = "\\FileSystem\\Ntfs";
+    static CONST PCSTR deviceName = "\\Ntfs";
+    PUCHAR next = (PUCHAR)(VolumeProperties + 1);
+    PUCHAR end = Add2Ptr( VolumeProperties, VolumePropertiesLength );
+    ULONG required;
+
+    ASSERT( Volume == &FanVolume );
+
+    required = sizeof(FLT_VOLUME_PROPERTIES) +
+               (ULONG)(strlen( driverName ) + strlen( deviceName ) +
+                       strlen( FAN_SIM_VOLUME_NAME )) * sizeof(WCHAR);
+
+    *LengthReturned = required;
+
+    if (VolumePropertiesLength < sizeof(FLT_VOLUME_PROPERTIES)) {
+
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    VolumeProperties->DeviceType = FILE_DEVICE_DISK_FILE_SYSTEM;
+    VolumeProperties->DeviceCharacteristics = 0;
+    VolumeProperties->DeviceObjectFlags = 0;
+    VolumeProperties->AlignmentRequirement = 0;
+    VolumeProperties->SectorSize = 512;
+    VolumeProperties->Reserved0 = 0;
+
+    FanVolumeString( &VolumeProperties->FileSystemDriverName, &next, end, driverName );
+    FanVolumeString( &VolumeProperties->FileSystemDeviceName, &next, end, deviceName );
+    FanVolumeString( &VolumeProperties->RealDeviceName, &next, end, FAN_SIM_VOLUME_NAME );
+
+    return (VolumePropertiesLength < required) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+FltGetDiskDeviceObject (
+    __in PFLT_VOLUME Volume,
+    __deref_out PDEVICE_OBJECT *DiskDeviceObject
+    )
+{
+    ASSERT( Volume == &FanVolume );
+
+    FanReferenceObject( &FanDiskDevice );
+    *DiskDeviceObject = &FanDiskDevice;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+FltGetDeviceObject (
+    __in PFLT_VOLUME Volume,
+    __deref_out PDEVICE_OBJECT *DeviceObject
+    )
+{
+    ASSERT( Volume == &FanVolume );
+
+    FanReferenceObject( &FanVolumeDevice );
+    *DeviceObject = &FanVolumeDevice;
+
+    return STATUS_SUCCESS;
+}
+
+//---------------------------------------------------------------------------
+//  Filter manager: contexts
+//---------------------------------------------------------------------------
+
+//
+//  A context is headed by its reference count and how to free it.  The
+//  volume holds a reference on the context set on it until the context is
+//  deleted or replaced, or the instance is torn down.
+//
+
+typedef struct DECLSPEC_ALIGN(16) _FAN_CONTEXT {
+
+    LONG RefCount;
+    FLT_CONTEXT_TYPE Type;
+    BOOLEAN Deleted;
+    ULONG Tag;
+    PFLT_CONTEXT_CLEANUP_CALLBACK Cleanup;
+    PFLT_VOLUME Volume;
+
+} FAN_CONTEXT, *PFAN_CONTEXT;
+
+#define FanContextHeader(Context)   ((PFAN_CONTEXT)(Context) - 1)
+
+
+NTSTATUS
+FltAllocateContext (
+    __in PFLT_FILTER Filter,
+    __in FLT_CONTEXT_TYPE ContextType,
+    __in SIZE_T ContextSize,
+    __in POOL_TYPE PoolType,
+    __deref_out PFLT_CONTEXT *ReturnedContext
+    )
+{
+    CONST FLT_CONTEXT_REGISTRATION *registration;
+    PFAN_CONTEXT header;
+
+    ASSERT( Filter == &FanFilter && Filter->Registered );
+
+    *ReturnedContext = NULL;
+
+    for (registration = Filter->Registration->ContextRegistration;
+         registration != NULL && registration->ContextType != FLT_CONTEXT_END;
+         registration++) {
+
+        if (registration->ContextType == ContextType &&
+            (registration->Size == ContextSize ||
+             registration->Size == FLT_VARIABLE_SIZED_CONTEXTS)) {
+
+            break;
+        }
+    }
+
+    if (registration == NULL || registration->ContextType == FLT_CONTEXT_END) {
+
+        return STATUS_FLT_CONTEXT_ALLOCATION_NOT_FOUND;
+    }
+
+    header = ExAllocatePoolWithTag( PoolType,
+                                    sizeof(FAN_CONTEXT) + ContextSize,
+                                    registration->PoolTag );
+
+    if (header == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( header, sizeof(FAN_CONTEXT) );
+
+    header->RefCount = 1;
+    header->Type = ContextType;
+    header->Tag = registration->PoolTag;
+    header->Cleanup = registration->ContextCleanupCallback;
+
+    *ReturnedContext = header + 1;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+FltReferenceContext (
+    __in PFLT_CONTEXT Context
+    )
+{
+    PFAN_CONTEXT header = FanContextHeader( Context );
+
+    ASSERT( header->RefCount > 0 );
+
+    InterlockedIncrement( &header->RefCount );
+}
+
+
+VOID
+FltReleaseContext (
+    __in PFLT_CONTEXT Context
+    )
+{
+    PFAN_CONTEXT header = FanContextHeader( Context );
+    LONG count;
+
+    count = InterlockedDecrement( &header->RefCount );
+
+    ASSERT( count >= 0 );
+
+    if (count > 0) {
+
+        return;
+    }
+
+    if (header->Cleanup != NULL) {
+
+        header->Cleanup( Context, header->Type );
+    }
+
+    ExFreePoolWithTag( header, header->Tag );
+}
+
+
+VOID
+FltDeleteContext (
+    __in PFLT_CONTEXT Context
+    )
+{
+    PFAN_CONTEXT header;
+    PFLT_VOLUME volume;
+
+    if (Context == NULL) {
+
+        return;
+    }
+
+    header = FanContextHeader( Context );
+    volume = header->Volume;
+
+    if (volume == NULL) {
+
+        return;
+    }
+
+    pthread_mutex_lock( &volume->ContextLock );
+
+    if (header->Deleted) {
+
+        pthread_mutex_unlock( &volume->ContextLock );
+        return;
+    }
+
+    header->Deleted = TRUE;
+
+    if (volume->Context == Context) {
+
+        volume->Context = NULL;
+    }
+
+    pthread_mutex_unlock( &volume->ContextLock );
+
+    FltReleaseContext( Context );
+}
+
+
+static
+VOID
+FanDeleteVolumeContext (
+    VOID
+    )
+{
+    PFLT_CONTEXT context;
+
+    pthread_mutex_lock( &FanVolume.ContextLock );
+    context = FanVolume.Context;
+    pthread_mutex_unlock( &FanVolume.ContextLock );
+
+    FltDeleteContext( context );
+}
+
+
+NTSTATUS
+FltSetVolumeContext (
+    __in PFLT_VOLUME Volume,
+    __in FLT_SET_CONTEXT_OPERATION Operation,
+    __in PFLT_CONTEXT NewContext,
+    __deref_opt_out PFLT_CONTEXT *OldContext
+    )
+{
+    PFAN_CONTEXT header = FanContextHeader( NewContext );
+    PFLT_CONTEXT existing;
+
+    ASSERT( Volume == &FanVolume );
+    ASSERT( header->Type == FLT_VOLUME_CONTEXT && header->Volume == NULL );
+
+    if (OldContext != NULL) {
+
+        *OldContext = NULL;
+    }
+
+    pthread_mutex_lock( &Volume->ContextLock );
+
+    existing = Volume->Context;
+
+    if (existing != NULL && Operation == FLT_SET_CONTEXT_KEEP_IF_EXISTS) {
+
+        if (OldContext != NULL) {
+
+            FltReferenceContext( existing );
+            *OldContext = existing;
+        }
+
+        pthread_mutex_unlock( &Volume->ContextLock );
+
+        return STATUS_FLT_CONTEXT_ALREADY_DEFINED;
+    }
+
+    FltReferenceContext( NewContext );
+    header->Volume = Volume;
+    Volume->Context = NewContext;
+
+    if (existing != NULL) {
+
+        FanContextHeader( existing )->Deleted = TRUE;
+    }
+
+    pthread_mutex_unlock( &Volume->ContextLock );
+
+    if (existing != NULL) {
+
+        if (OldContext != NULL) {
+
+            *OldContext = existing;
+
+        } else {
+
+            FltReleaseContext( existing );
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+FltGetVolumeContext (
+    __in PFLT_FILTER Filter,
+    __in PFLT_VOLUME Volume,
+    __deref_out PFLT_CONTEXT *Context
+    )
+{
+    ASSERT( Filter == &FanFilter && Volume == &FanVolume );
+
+    pthread_mutex_lock( &Volume->ContextLock );
+
+    *Context = Volume->Context;
+
+    if (*Context != NULL) {
+
+        FltReferenceContext( *Context );
+    }
+
+    pthread_mutex_unlock( &Volume->ContextLock );
+
+    return (*Context != NULL) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+//---------------------------------------------------------------------------
+//  The volume's files
+//---------------------------------------------------------------------------
+
+//
+//  A node is a file or directory on the volume, named by its full path
+//  from the volume's root, "\" being the root itself.  Nodes hash by
+//  their upcased name; everything about them is under FanVolumeLock.
+//
+//  A node holds a reference for being in the namespace and one for each
+//  file object open on it, so a file deleted while open stays until its
+//  last file object closes.
+//
+
+#define FAN_NODE_BUCKETS            4096
+
+typedef struct _FAN_NODE {
+
+    LIST_ENTRY HashLinks;
+
+    PWCH Name;
+    USHORT NameLength;
+
+    BOOLEAN Directory;
+    BOOLEAN DeletePending;
+    BOOLEAN Deleted;
+
+    LONG RefCount;
+    LONG OpenCount;
+    ULONG Children;
+
+    LONGLONG Size;
+    ULONG Attributes;
+
+} FAN_NODE, *PFAN_NODE;
+
+//
+//  A file object and what the file system keeps of the open.  A file
+//  opened by ZwCreateFile is also the object its handle names, and goes
+//  when the handle is closed.
+//
+
+typedef struct _FAN_FILE {
+
+    FAN_OBJECT Header;
+    LIST_ENTRY Links;
+
+    FILE_OBJECT FileObject;
+
+    PFAN_NODE Node;
+    ACCESS_MASK GrantedAccess;
+    ULONG CreateOptions;
+
+    WCHAR NameBuffer[ANYSIZE_ARRAY];
+
+} FAN_FILE, *PFAN_FILE;
+
+#define FanFileFromObject(Object) \
+    CONTAINING_RECORD( (Object), FAN_FILE, FileObject )
+
+static pthread_mutex_t FanVolumeLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY FanNodeBuckets[FAN_NODE_BUCKETS];
+static LIST_ENTRY FanOpenFiles = { &FanOpenFiles, &FanOpenFiles };
+
+
+static
+ULONG
+FanHashName (
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Name,
+    __in USHORT Length
+    )
+{
+    ULONG hash = 2166136261u;
+    USHORT index;
+
+    for (index = 0; index < Length / sizeof(WCHAR); index++) {
+
+        hash = (hash ^ RtlUpcaseUnicodeChar( Name[index] )) * 16777619u;
+    }
+
+    return hash % FAN_NODE_BUCKETS;
+}
+
+
+static
+BOOLEAN
+FanValidPath (
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Path,
+    __in USHORT Length
+    )
+/*++
+
+Routine Description:
+
+    Whether Path names something on the volume: it starts at the root,
+    has no empty components and no trailing separator other than the
+    root's own, and no characters a file name cannot have.  Named streams
+    are not simulated, so a ':' makes a name invalid too.
+
+--*/
+{
+    USHORT count = Length / sizeof(WCHAR);
+    USHORT index;
+
+    if (count == 0 || Path[0] != '\\') {
+
+        return FALSE;
+    }
+
+    if (count == 1) {
+
+        return TRUE;
+    }
+
+    if (Path[count - 1] == '\\') {
+
+        return FALSE;
+    }
+
+    for (index = 1; index < count; index++) {
+
+        if ((Path[index] == '\\' && Path[index - 1] == '\\') ||
+            Path[index] < 0x20 ||
+            (Path[index] < 0x80 && strchr( "\"*:<>?|", (CHAR) Path[index] ) != NULL)) {
+
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+static
+USHORT
+FanParentLength (
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Path,
+    __in USHORT Length
+    )
+/*++
+
+Routine Description:
+
+    The length of the name of Path's parent, in bytes.  The root's parent
+    is the root.
+
+--*/
+{
+    USHORT index = Length / sizeof(WCHAR);
+
+    while (index > 1 && Path[index - 1] != '\\') {
+
+        index--;
+    }
+
+    return (USHORT)((index > 1 ? index - 1 : 1) * sizeof(WCHAR));
+}
+
+
+static
+PFAN_NODE
+FanLookupNode (
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Name,
+    __in USHORT Length
+    )
+{
+    PLIST_ENTRY bucket = &FanNodeBuckets[FanHashName( Name, Length )];
+    PLIST_ENTRY entry;
+    PFAN_NODE node;
+
+    for (entry = bucket->Flink; entry != bucket; entry = entry->Flink) {
+
+        node = CONTAINING_RECORD( entry, FAN_NODE, HashLinks );
+
+        if (FanEqualName( node->Name, node->NameLength, Name, Length )) {
+
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+
+static
+PFAN_NODE
+FanLookupParent (
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Path,
+    __in USHORT Length
+    )
+{
+    PFAN_NODE parent = FanLookupNode( Path, FanParentLength( Path, Length ) );
+
+    return (parent != NULL && parent->Directory) ? parent : NULL;
+}
+
+
+static
+PFAN_NODE
+FanInsertNode (
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Name,
+    __in USHORT Length,
+    __in BOOLEAN Directory
+    )
+/*++
+
+Routine Description:
+
+    Adds a file or directory whose parent the caller has found.
+
+--*/
+{
+    PFAN_NODE node = calloc( 1, sizeof(FAN_NODE) );
+    PFAN_NODE parent;
+
+    if (node == NULL || (node->Name = malloc( Length )) == NULL) {
+
+        free( node );
+        return NULL;
+    }
+
+    RtlCopyMemory( node->Name, Name, Length );
+    node->NameLength = Length;
+    node->Directory = Directory;
+    node->Attributes = Directory ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+    node->RefCount = 1;
+
+    if (Length > sizeof(WCHAR)) {
+
+        parent = FanLookupParent( Name, Length );
+        ASSERT( parent != NULL );
+        parent->Children++;
+    }
+
+    InsertTailList( &FanNodeBuckets[FanHashName( Name, Length )], &node->HashLinks );
+
+    return node;
+}
+
+
+static
+VOID
+FanReleaseNode (
+    __in PFAN_NODE Node
+    )
+{
+    ASSERT( Node->RefCount > 0 );
+
+    if (--Node->RefCount == 0) {
+
+        ASSERT( Node->Deleted );
+
+        free( Node->Name );
+        free( Node );
+    }
+}
+
+
+static
+VOID
+FanRemoveNode (
+    __in PFAN_NODE Node
+    )
+{
+    PFAN_NODE parent;
+
+    ASSERT( !Node->Deleted && Node->Children == 0 );
+
+    parent = FanLookupParent( Node->Name, Node->NameLength );
+    ASSERT( parent != NULL );
+    parent->Children--;
+
+    RemoveEntryList( &Node->HashLinks );
+    Node->Deleted = TRUE;
+
+    FanReleaseNode( Node );
+}
+
+
+static
+BOOLEAN
+FanRenameNode (
+    __in PFAN_NODE Node,
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Name,
+    __in USHORT Length
+    )
+/*++
+
+Routine Description:
+
+    Moves a node to Name, whose parent the caller has found and which is
+    free, and the files under it if it is a directory.
+
+Return Value:
+
+    FALSE if there was no memory for the new names, in which case nothing
+    has moved.
+
+--*/
+{
+    USHORT oldLength = Node->NameLength;
+    PWCH oldName = Node->Name;
+    LIST_ENTRY moved;
+    PLIST_ENTRY entry;
+    PFAN_NODE node;
+    PWCH *names;
+    ULONG count;
+    ULONG index;
+    ULONG bucket;
+
+    InitializeListHead( &moved );
+
+    //
+    //  Take what moves out of the hash first, so that every new name can
+    //  be allocated before anything is renamed.
+    //
+
+    RemoveEntryList( &Node->HashLinks );
+    InsertTailList( &moved, &Node->HashLinks );
+
+    if (Node->Directory && Node->Children > 0) {
+
+        for (bucket = 0; bucket < FAN_NODE_BUCKETS; bucket++) {
+
+            for (entry = FanNodeBuckets[bucket].Flink; entry != &FanNodeBuckets[bucket];) {
+
+                node = CONTAINING_RECORD( entry, FAN_NODE, HashLinks );
+                entry = entry->Flink;
+
+                if (node->NameLength > oldLength &&
+                    node->Name[oldLength / sizeof(WCHAR)] == '\\' &&
+                    FanEqualName( node->Name, oldLength, oldName, oldLength )) {
+
+                    RemoveEntryList( &node->HashLinks );
+                    InsertTailList( &moved, &node->HashLinks );
+                }
+            }
+        }
+    }
+
+    for (entry = moved.Flink, count = 0; entry != &moved; entry = entry->Flink, count++) {
+
+        node = CONTAINING_RECORD( entry, FAN_NODE, HashLinks );
+
+        if ((ULONG) node->NameLength - oldLength + Length > MAXUSHORT) {
+
+            goto Restore;
+        }
+    }
+
+    names = calloc( count, sizeof(PWCH) );
+
+    if (names == NULL) {
+
+        goto Restore;
+    }
+
+    for (entry = moved.Flink, index = 0; entry != &moved; entry = entry->Flink, index++) {
+
+        node = CONTAINING_RECORD( entry, FAN_NODE, HashLinks );
+
+        names[index] = malloc( node->NameLength - oldLength + Length );
+
+        if (names[index] == NULL) {
+
+            while (index > 0) {
+
+                free( names[--index] );
+            }
+
+            free( names );
+            goto Restore;
+        }
+    }
+
+    //
+    //  The parents' counts follow the node itself; the others stay under
+    //  the same, moved, parent.
+    //
+
+    FanLookupParent( Node->Name, Node->NameLength )->Children--;
+
+    for (index = 0; !IsListEmpty( &moved ); index++) {
+
+        entry = RemoveHeadList( &moved );
+        node = CONTAINING_RECORD( entry, FAN_NODE, HashLinks );
+
+        RtlCopyMemory( names[index], Name, Length );
+        RtlCopyMemory( Add2Ptr( names[index], Length ),
+                       Add2Ptr( node->Name, oldLength ),
+                       node->NameLength - oldLength );
+
+        if (node != Node) {
+
+            free( node->Name );
+        }
+
+        node->NameLength = (USHORT)(node->NameLength - oldLength + Length);
+        node->Name = names[index];
+
+        InsertTailList( &FanNodeBuckets[FanHashName( node->Name, node->NameLength )],
+                        &node->HashLinks );
+    }
+
+    free( names );
+    free( oldName );
+
+    FanLookupParent( Node->Name, Node->NameLength )->Children++;
+
+    return TRUE;
+
+Restore:
+
+    while (!IsListEmpty( &moved )) {
+
+        entry = RemoveHeadList( &moved );
+        node = CONTAINING_RECORD( entry, FAN_NODE, HashLinks );
+
+        InsertTailList( &FanNodeBuckets[FanHashName( node->Name, node->NameLength )],
+                        &node->HashLinks );
+    }
+
+    return FALSE;
+}
+
+
+static
+PFAN_FILE
+FanNewFile (
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Name,
+    __in USHORT Length
+    )
+/*++
+
+Routine Description:
+
+    Allocates a file object for opening Name, a path on the volume.
+
+--*/
+{
+    PFAN_FILE file = calloc( 1, sizeof(FAN_FILE) + Length );
+
+    if (file == NULL) {
+
+        return NULL;
+    }
+
+    file->Header.PointerCount = 1;
+    file->Header.Type = FanFileObject;
+
+    file->FileObject.Type = 5;
+    file->FileObject.Size = sizeof(FILE_OBJECT);
+    file->FileObject.DeviceObject = &FanVolumeDevice;
+    file->FileObject.Flags = FO_SYNCHRONOUS_IO;
+
+    RtlCopyMemory( file->NameBuffer, Name, Length );
+    file->FileObject.FileName.Buffer = file->NameBuffer;
+    file->FileObject.FileName.Length = Length;
+    file->FileObject.FileName.MaximumLength = Length;
+
+    return file;
+}
+
+
+static
+VOID
+FanFreeFile (
+    __in PFAN_FILE File
+    )
+/*++
+
+Routine Description:
+
+    Frees a file object that either never opened or has been closed.
+
+--*/
+{
+    pthread_mutex_lock( &FanVolumeLock );
+
+    if (File->Node != NULL) {
+
+        RemoveEntryList( &File->Links );
+        FanReleaseNode( File->Node );
+    }
+
+    pthread_mutex_unlock( &FanVolumeLock );
+
+    free( File );
+}
+
+//---------------------------------------------------------------------------
+//  Filter manager: operations
+//---------------------------------------------------------------------------
+
+//
+//  An operation in flight: its callback data and parameter block, the
+//  related objects the callbacks see, and what the filter asked the
+//  filter manager for along the way.
+//
+
+typedef struct _FAN_OPERATION {
+
+    FLT_CALLBACK_DATA Data;
+    FLT_IO_PARAMETER_BLOCK Iopb;
+    FLT_RELATED_OBJECTS Objects;
+
+    //
+    //  FltRequestOperationStatusCallback.
+    //
+
+    PFLT_GET_OPERATION_STATUS_CALLBACK StatusCallback;
+    PVOID StatusContext;
+    FLT_IO_PARAMETER_BLOCK Snapshot;
+
+    //
+    //  FltLockUserBuffer's MDL, which goes with the operation.
+    //
+
+    PMDL LockedMdl;
+
+    struct _FAN_OPERATION *Previous;
+
+} FAN_OPERATION, *PFAN_OPERATION;
+
+#define FanOperationFromData(CallbackData) \
+    CONTAINING_RECORD( (CallbackData), FAN_OPERATION, Data )
+
+
+static
+PMDL *
+FanMdlAddress (
+    __in PFLT_IO_PARAMETER_BLOCK Iopb
+    )
+{
+    switch (Iopb->MajorFunction) {
+
+        case IRP_MJ_READ:
+            return &Iopb->Parameters.Read.MdlAddress;
+
+        case IRP_MJ_WRITE:
+            return &Iopb->Parameters.Write.MdlAddress;
+
+        case IRP_MJ_DIRECTORY_CONTROL:
+            return &Iopb->Parameters.DirectoryControl.QueryDirectory.MdlAddress;
+
+        default:
+            return NULL;
+    }
+}
+
+
+static
+PVOID *
+FanUserBuffer (
+    __in PFLT_IO_PARAMETER_BLOCK Iopb,
+    __out PULONG Length
+    )
+{
+    switch (Iopb->MajorFunction) {
+
+        case IRP_MJ_READ:
+            *Length = Iopb->Parameters.Read.Length;
+            return &Iopb->Parameters.Read.ReadBuffer;
+
+        case IRP_MJ_WRITE:
+            *Length = Iopb->Parameters.Write.Length;
+            return &Iopb->Parameters.Write.WriteBuffer;
+
+        case IRP_MJ_DIRECTORY_CONTROL:
+            *Length = Iopb->Parameters.DirectoryControl.QueryDirectory.Length;
+            return &Iopb->Parameters.DirectoryControl.QueryDirectory.DirectoryBuffer;
+
+        default:
+            *Length = 0;
+            return NULL;
+    }
+}
+
+
+static
+PVOID
+FanOperationBuffer (
+    __in PFLT_IO_PARAMETER_BLOCK Iopb
+    )
+/*++
+
+Routine Description:
+
+    Where the file system reads or writes an operation's data: through
+    the MDL if there is one, as a file system would, otherwise the buffer.
+
+--*/
+{
+    PMDL *mdl = FanMdlAddress( Iopb );
+    ULONG length;
+
+    if (mdl != NULL && *mdl != NULL) {
+
+        return (*mdl)->MappedSystemVa;
+    }
+
+    return *FanUserBuffer( Iopb, &length );
+}
+
+
+NTSTATUS
+FltLockUserBuffer (
+    __in PFLT_CALLBACK_DATA CallbackData
+    )
+{
+    PFAN_OPERATION operation = FanOperationFromData( CallbackData );
+    PFLT_IO_PARAMETER_BLOCK iopb = CallbackData->Iopb;
+    PMDL *mdl = FanMdlAddress( iopb );
+    PVOID *buffer;
+    ULONG length;
+
+    ASSERT( FanThread.Irql <= APC_LEVEL );
+
+    if (mdl == NULL) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (*mdl != NULL) {
+
+        return STATUS_SUCCESS;
+    }
+
+    buffer = FanUserBuffer( iopb, &length );
+
+    *mdl = IoAllocateMdl( *buffer, length, FALSE, FALSE, NULL );
+
+    if (*mdl == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    MmBuildMdlForNonPagedPool( *mdl );
+
+    ASSERT( operation->LockedMdl == NULL );
+    operation->LockedMdl = *mdl;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+FltRequestOperationStatusCallback (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PFLT_GET_OPERATION_STATUS_CALLBACK CallbackRoutine,
+    __in_opt PVOID RequesterContext
+    )
+{
+    PFAN_OPERATION operation = FanOperationFromData( Data );
+
+    ASSERT( !FlagOn( Data->Flags, FLTFL_CALLBACK_DATA_POST_OPERATION ) );
+
+    operation->StatusCallback = CallbackRoutine;
+    operation->StatusContext = RequesterContext;
+    operation->Snapshot = *Data->Iopb;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+FltSetCallbackDataDirty (
+    __inout PFLT_CALLBACK_DATA Data
+    )
+{
+    SetFlag( Data->Flags, FLTFL_CALLBACK_DATA_DIRTY );
+}
+
+
+BOOLEAN
+FltDoCompletionProcessingWhenSafe (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in_opt PVOID CompletionContext,
+    __in FLT_POST_OPERATION_FLAGS Flags,
+    __in PFLT_POST_OPERATION_CALLBACK SafePostCallback,
+    __out FLT_POSTOP_CALLBACK_STATUS *RetPostOperationStatus
+    )
+/*++
+
+Routine Description:
+
+    Post-operation callbacks run at PASSIVE_LEVEL on the thread that sent
+    the operation here, which is always safe.
+
+--*/
+{
+    ASSERT( FanThread.Irql <= APC_LEVEL );
+
+    *RetPostOperationStatus = SafePostCallback( Data, FltObjects, CompletionContext, Flags );
+
+    return TRUE;
+}
+
+
+PCHAR
+FltGetIrpName (
+    __in UCHAR IrpMajorCode
+    )
+{
+    static CHAR *CONST names[IRP_MJ_MAXIMUM_FUNCTION + 1] = {
+        "IRP_MJ_CREATE",
+        "IRP_MJ_CREATE_NAMED_PIPE",
+        "IRP_MJ_CLOSE",
+        "IRP_MJ_READ",
+        "IRP_MJ_WRITE",
+        "IRP_MJ_QUERY_INFORMATION",
+        "IRP_MJ_SET_INFORMATION",
+        "IRP_MJ_QUERY_EA",
+        "IRP_MJ_SET_EA",
+        "IRP_MJ_FLUSH_BUFFERS",
+        "IRP_MJ_QUERY_VOLUME_INFORMATION",
+        "IRP_MJ_SET_VOLUME_INFORMATION",
+        "IRP_MJ_DIRECTORY_CONTROL",
+        "IRP_MJ_FILE_SYSTEM_CONTROL",
+        "IRP_MJ_DEVICE_CONTROL",
+        "IRP_MJ_INTERNAL_DEVICE_CONTROL",
+        "IRP_MJ_SHUTDOWN",
+        "IRP_MJ_LOCK_CONTROL",
+        "IRP_MJ_CLEANUP",
+        "IRP_MJ_CREATE_MAILSLOT",
+        "IRP_MJ_QUERY_SECURITY",
+        "IRP_MJ_SET_SECURITY",
+        "IRP_MJ_POWER",
+        "IRP_MJ_SYSTEM_CONTROL",
+        "IRP_MJ_DEVICE_CHANGE",
+        "IRP_MJ_QUERY_QUOTA",
+        "IRP_MJ_SET_QUOTA",
+        "IRP_MJ_PNP"
+    };
+
+    return (IrpMajorCode <= IRP_MJ_MAXIMUM_FUNCTION) ? names[IrpMajorCode] : "IRP_MJ_UNKNOWN";
+}
+
+//---------------------------------------------------------------------------
+//  Filter manager: names
+//---------------------------------------------------------------------------
+
+//
+//  Name information is one pool block holding the structure, its
+//  reference count and the name the strings in it point into.
+//
+
+typedef struct _FAN_NAME {
+
+    FLT_FILE_NAME_INFORMATION Information;
+    LONG RefCount;
+    WCHAR Buffer[ANYSIZE_ARRAY];
+
+} FAN_NAME, *PFAN_NAME;
+
+
+static
+NTSTATUS
+FanNewName (
+    __in FLT_FILE_NAME_OPTIONS Format,
+    __in_ecount(ParentLength / sizeof(WCHAR)) PCWCH Parent,
+    __in USHORT ParentLength,
+    __in_ecount(ComponentLength / sizeof(WCHAR)) PCWCH Component,
+    __in USHORT ComponentLength,
+    __deref_out PFLT_FILE_NAME_INFORMATION *Information
+    )
+/*++
+
+Routine Description:
+
+    Builds name information for the volume's name followed by Parent and
+    Component.  Component, which may be empty, is joined to Parent with a
+    separator unless Parent is the root.
+
+--*/
+{
+    BOOLEAN separator = (ComponentLength > 0 && ParentLength > sizeof(WCHAR));
+    ULONG length = FanVolumeNameLength + ParentLength + ComponentLength +
+                   (separator ? sizeof(WCHAR) : 0);
+    PFAN_NAME name;
+    PUCHAR next;
+
+    *Information = NULL;
+
+    if (length > MAXUSHORT - sizeof(WCHAR)) {
+
+        return STATUS_OBJECT_NAME_INVALID;
+    }
+
+    name = ExAllocatePoolWithTag( PagedPool,
+                                  FIELD_OFFSET(FAN_NAME, Buffer) + length + sizeof(WCHAR),
+                                  FAN_NAME_TAG );
+
+    if (name == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( name, sizeof(FAN_NAME) );
+    name->RefCount = 1;
+
+    next = (PUCHAR) name->Buffer;
+    RtlCopyMemory( next, FanVolumeName, FanVolumeNameLength );
+    next += FanVolumeNameLength;
+    RtlCopyMemory( next, Parent, ParentLength );
+    next += ParentLength;
+
+    if (separator) {
+
+        *(PWCH) next = '\\';
+        next += sizeof(WCHAR);
+    }
+
+    if (ComponentLength > 0) {
+
+        RtlCopyMemory( next, Component, ComponentLength );
+        next += ComponentLength;
+    }
+
+    *(PWCH) next = UNICODE_NULL;
+
+    name->Information.Size = sizeof(FLT_FILE_NAME_INFORMATION);
+    name->Information.Format = Format;
+    name->Information.Name.Buffer = name->Buffer;
+    name->Information.Name.Length = (USHORT) length;
+    name->Information.Name.MaximumLength = (USHORT)(length + sizeof(WCHAR));
+    name->Information.Volume.Buffer = name->Buffer;
+    name->Information.Volume.Length = FanVolumeNameLength;
+    name->Information.Volume.MaximumLength = FanVolumeNameLength;
+
+    *Information = &name->Information;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+FanPathName (
+    __in FLT_FILE_NAME_OPTIONS Format,
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Path,
+    __in USHORT Length,
+    __deref_out PFLT_FILE_NAME_INFORMATION *Information
+    )
+/*++
+
+Routine Description:
+
+    Builds name information for a path that may not exist yet.  Opened
+    names are the path as given.  Normalized ones are spelled as the
+    volume spells what exists of the path, which must be all of it but
+    the final component.
+
+    The caller holds FanVolumeLock.
+
+--*/
+{
+    USHORT parentLength;
+    PFAN_NODE node;
+
+    if (!FanValidPath( Path, Length )) {
+
+        return STATUS_OBJECT_NAME_INVALID;
+    }
+
+    if (Format == FLT_FILE_NAME_OPENED) {
+
+        return FanNewName( Format, Path, Length, NULL, 0, Information );
+    }
+
+    node = FanLookupNode( Path, Length );
+
+    if (node != NULL) {
+
+        return FanNewName( Format, node->Name, node->NameLength, NULL, 0, Information );
+    }
+
+    node = FanLookupParent( Path, Length );
+
+    if (node == NULL) {
+
+        return STATUS_OBJECT_PATH_NOT_FOUND;
+    }
+
+    parentLength = FanParentLength( Path, Length );
+
+    if (parentLength > sizeof(WCHAR)) {
+
+        parentLength += sizeof(WCHAR);
+    }
+
+    return FanNewName( Format,
+                       node->Name,
+                       node->NameLength,
+                       Add2Ptr( Path, parentLength ),
+                       Length - parentLength,
+                       Information );
+}
+
+
+NTSTATUS
+FltGetFileNameInformation (
+    __in PFLT_CALLBACK_DATA CallbackData,
+    __in FLT_FILE_NAME_OPTIONS NameOptions,
+    __deref_out PFLT_FILE_NAME_INFORMATION *FileNameInformation
+    )
+/*++
+
+Routine Description:
+
+    Names the file an operation is on.  Until the file opens, that is the
+    name it is being opened by; once it has, it is the name the file has
+    now, so a file renamed while open is named by its new name.
+
+Return Value:
+
+    STATUS_NOT_SUPPORTED for short names, which the volume does not have.
+
+--*/
+{
+    FLT_FILE_NAME_OPTIONS format = NameOptions & 0xff;
+    PFILE_OBJECT fileObject = CallbackData->Iopb->TargetFileObject;
+    PFAN_FILE file = FanFileFromObject( fileObject );
+    NTSTATUS status;
+
+    ASSERT( FanThread.Irql <= APC_LEVEL );
+
+    *FileNameInformation = NULL;
+
+    if (format != FLT_FILE_NAME_NORMALIZED && format != FLT_FILE_NAME_OPENED) {
+
+        return (format == FLT_FILE_NAME_SHORT) ? STATUS_NOT_SUPPORTED : STATUS_INVALID_PARAMETER;
+    }
+
+    pthread_mutex_lock( &FanVolumeLock );
+
+    if (file->Node != NULL) {
+
+        status = FanNewName( format,
+                             file->Node->Name,
+                             file->Node->NameLength,
+                             NULL,
+                             0,
+                             FileNameInformation );
+
+    } else {
+
+        status = FanPathName( format,
+                              fileObject->FileName.Buffer,
+                              fileObject->FileName.Length,
+                              FileNameInformation );
+    }
+
+    pthread_mutex_unlock( &FanVolumeLock );
+
+    return status;
+}
+
+
+static
+NTSTATUS
+FanVolumePath (
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Name,
+    __in USHORT Length,
+    __deref_out_ecount(*PathLength / sizeof(WCHAR)) PCWCH *Path,
+    __out PUSHORT PathLength
+    )
+/*++
+
+Routine Description:
+
+    Finds the path on the volume in a fully qualified name, one starting
+    \Device\HarddiskVolume1\ or \??\C:\.
+
+Return Value:
+
+    STATUS_OBJECT_PATH_NOT_FOUND if Name is not on the volume.
+
+--*/
+{
+    WCHAR dosName[sizeof("\\??\\" FAN_SIM_DOS_NAME)];
+    USHORT dosLength;
+    USHORT prefix = 0;
+
+    dosLength = (USHORT)(FanWidenAscii( dosName,
+                                        sizeof(dosName) / sizeof(WCHAR),
+                                        "\\??\\" FAN_SIM_DOS_NAME ) * sizeof(WCHAR));
+
+    if (Length > FanVolumeNameLength &&
+        FanEqualName( Name, FanVolumeNameLength, FanVolumeName, FanVolumeNameLength )) {
+
+        prefix = FanVolumeNameLength;
+
+    } else if (Length > dosLength &&
+               FanEqualName( Name, dosLength, dosName, dosLength )) {
+
+        prefix = dosLength;
+    }
+
+    if (prefix == 0 || Name[prefix / sizeof(WCHAR)] != '\\') {
+
+        return STATUS_OBJECT_PATH_NOT_FOUND;
+    }
+
+    *Path = Add2Ptr( Name, prefix );
+    *PathLength = Length - prefix;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+FanTargetPath (
+    __in PFAN_FILE File,
+    __in_bcount(FileNameLength) PCWCH FileName,
+    __in ULONG FileNameLength,
+    __deref_out PWCH *Path,
+    __out PUSHORT PathLength
+    )
+/*++
+
+Routine Description:
+
+    Resolves the name a file is being renamed to.  A fully qualified name
+    is taken as it is; a bare name, one with no separators, renames the
+    file within its directory.  The caller frees the path.
+
+    The caller holds FanVolumeLock.
+
+--*/
+{
+    USHORT length = (USHORT)(FileNameLength & ~1);
+    USHORT parentLength;
+    USHORT index;
+    PCWCH path;
+    NTSTATUS status;
+
+    *Path = NULL;
+    *PathLength = 0;
+
+    if (FileNameLength == 0 || FileNameLength > MAXUSHORT) {
+
+        return STATUS_OBJECT_NAME_INVALID;
+    }
+
+    if (FileName[0] == '\\') {
+
+        status = FanVolumePath( FileName, length, &path, &length );
+
+        if (!NT_SUCCESS( status )) {
+
+            return status;
+        }
+
+        *Path = malloc( length );
+
+        if (*Path == NULL) {
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlCopyMemory( *Path, path, length );
+        *PathLength = length;
+
+        return STATUS_SUCCESS;
+    }
+
+    if (File->Node == NULL) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (index = 0; index < length / sizeof(WCHAR); index++) {
+
+        if (FileName[index] == '\\') {
+
+            return STATUS_OBJECT_NAME_INVALID;
+        }
+    }
+
+    parentLength = FanParentLength( File->Node->Name, File->Node->NameLength );
+
+    if ((ULONG) parentLength + sizeof(WCHAR) + length > MAXUSHORT) {
+
+        return STATUS_OBJECT_NAME_INVALID;
+    }
+
+    *Path = malloc( parentLength + sizeof(WCHAR) + length );
+
+    if (*Path == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory( *Path, File->Node->Name, parentLength );
+
+    if (parentLength > sizeof(WCHAR)) {
+
+        (*Path)[parentLength / sizeof(WCHAR)] = '\\';
+        parentLength += sizeof(WCHAR);
+    }
+
+    RtlCopyMemory( Add2Ptr( *Path, parentLength ), FileName, length );
+    *PathLength = parentLength + length;
+
+    return STATUS_SUCCESS;
+}
+
+
+
+NTSTATUS
+FltGetDestinationFileNameInformation (
+    __in PFLT_INSTANCE Instance,
+    __in PFILE_OBJECT FileObject,
+    __in_opt HANDLE RootDirectory,
+    __in_bcount(FileNameLength) PWSTR FileName,
+    __in ULONG FileNameLength,
+    __in FLT_FILE_NAME_OPTIONS NameOptions,
+    __deref_out PFLT_FILE_NAME_INFORMATION *RetFileNameInformation
+    )
+/*++
+
+Routine Description:
+
+    Names what a file is being renamed to.
+
+Return Value:
+
+    STATUS_NOT_SUPPORTED for a name relative to a directory handle, which
+    nothing here renames by.
+
+--*/
+{
+    FLT_FILE_NAME_OPTIONS format = NameOptions & 0xff;
+    PFAN_FILE file = FanFileFromObject( FileObject );
+    USHORT length;
+    PWCH path;
+    NTSTATUS status;
+
+    ASSERT( Instance == &FanInstance );
+    ASSERT( FanThread.Irql <= APC_LEVEL );
+
+    *RetFileNameInformation = NULL;
+
+    if (RootDirectory != NULL) {
+
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (format != FLT_FILE_NAME_NORMALIZED && format != FLT_FILE_NAME_OPENED) {
+
+        return (format == FLT_FILE_NAME_SHORT) ? STATUS_NOT_SUPPORTED : STATUS_INVALID_PARAMETER;
+    }
+
+    pthread_mutex_lock( &FanVolumeLock );
+
+    status = FanTargetPath( file, FileName, FileNameLength, &path, &length );
+
+    if (NT_SUCCESS( status )) {
+
+        status = FanPathName( format, path, length, RetFileNameInformation );
+        free( path );
+    }
+
+    pthread_mutex_unlock( &FanVolumeLock );
+
+    return status;
+}
+
+
+NTSTATUS
+FltParseFileNameInformation (
+    __inout PFLT_FILE_NAME_INFORMATION FileNameInformation
+    )
+{
+    PUNICODE_STRING name = &FileNameInformation->Name;
+    USHORT start = FileNameInformation->Volume.Length / sizeof(WCHAR);
+    USHORT end = name->Length / sizeof(WCHAR);
+    USHORT final = end;
+    USHORT stream;
+    USHORT dot;
+
+    while (final > start && name->Buffer[final - 1] != '\\') {
+
+        final--;
+    }
+
+    //
+    //  The parent directory keeps its trailing separator, as the root's
+    //  does.  The final component includes any stream name, which the
+    //  extension does not.
+    //
+
+    FileNameInformation->ParentDir.Buffer = &name->Buffer[start];
+    FileNameInformation->ParentDir.Length = (USHORT)((final - start) * sizeof(WCHAR));
+    FileNameInformation->ParentDir.MaximumLength = FileNameInformation->ParentDir.Length;
+
+    FileNameInformation->FinalComponent.Buffer = &name->Buffer[final];
+    FileNameInformation->FinalComponent.Length = (USHORT)((end - final) * sizeof(WCHAR));
+    FileNameInformation->FinalComponent.MaximumLength = FileNameInformation->FinalComponent.Length;
+
+    for (stream = final; stream < end && name->Buffer[stream] != ':'; stream++) {
+
+        NOTHING;
+    }
+
+    FileNameInformation->Stream.Buffer = (stream < end) ? &name->Buffer[stream] : NULL;
+    FileNameInformation->Stream.Length = (USHORT)((end - stream) * sizeof(WCHAR));
+    FileNameInformation->Stream.MaximumLength = FileNameInformation->Stream.Length;
+
+    for (dot = stream; dot > final && name->Buffer[dot - 1] != '.'; dot--) {
+
+        NOTHING;
+    }
+
+    if (dot == final) {
+
+        dot = stream;
+    }
+
+    FileNameInformation->Extension.Buffer = (dot < stream) ? &name->Buffer[dot] : NULL;
+    FileNameInformation->Extension.Length = (USHORT)((stream - dot) * sizeof(WCHAR));
+    FileNameInformation->Extension.MaximumLength = FileNameInformation->Extension.Length;
+
+    FileNameInformation->NamesParsed = FLTFL_FILE_NAME_PARSED_FINAL_COMPONENT |
+                                       FLTFL_FILE_NAME_PARSED_EXTENSION |
+                                       FLTFL_FILE_NAME_PARSED_STREAM |
+                                       FLTFL_FILE_NAME_PARSED_PARENT_DIR;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+FltReferenceFileNameInformation (
+    __in PFLT_FILE_NAME_INFORMATION FileNameInformation
+    )
+{
+    PFAN_NAME name = CONTAINING_RECORD( FileNameInformation, FAN_NAME, Information );
+
+    ASSERT( name->RefCount > 0 );
+
+    InterlockedIncrement( &name->RefCount );
+}
+
+
+VOID
+FltReleaseFileNameInformation (
+    __in PFLT_FILE_NAME_INFORMATION FileNameInformation
+    )
+{
+    PFAN_NAME name = CONTAINING_RECORD( FileNameInformation, FAN_NAME, Information );
+    LONG count;
+
+    count = InterlockedDecrement( &name->RefCount );
+
+    ASSERT( count >= 0 );
+
+    if (count == 0) {
+
+        ExFreePoolWithTag( name, FAN_NAME_TAG );
+    }
+}
+
+
+NTSTATUS
+FltIsDirectory (
+    __in PFILE_OBJECT FileObject,
+    __in PFLT_INSTANCE Instance,
+    __out PBOOLEAN IsDirectory
+    )
+{
+    PFAN_FILE file = FanFileFromObject( FileObject );
+    NTSTATUS status = STATUS_SUCCESS;
+
+    ASSERT( Instance == &FanInstance );
+
+    pthread_mutex_lock( &FanVolumeLock );
+
+    if (file->Node != NULL) {
+
+        *IsDirectory = file->Node->Directory;
+
+    } else {
+
+        status = STATUS_INVALID_PARAMETER;
+    }
+
+    pthread_mutex_unlock( &FanVolumeLock );
+
+    return status;
+}
+
+//---------------------------------------------------------------------------
+//  The file system
+//---------------------------------------------------------------------------
+
+//
+//  What is left of an operation once the filter has passed it down.  The
+//  routines below run under FanVolumeLock and complete the callback data.
+//
+
+static
+NTSTATUS
+FanPerformCreate (
+    __inout PFAN_OPERATION Operation
+    )
+{
+    PFLT_IO_PARAMETER_BLOCK iopb = &Operation->Iopb;
+    PFILE_OBJECT fileObject = iopb->TargetFileObject;
+    PFAN_FILE file = FanFileFromObject( fileObject );
+    ULONG disposition = iopb->Parameters.Create.Options >> 24;
+    ULONG options = iopb->Parameters.Create.Options & 0x00ffffff;
+    PCWCH name = fileObject->FileName.Buffer;
+    USHORT length = fileObject->FileName.Length;
+    ULONG_PTR information = FILE_OPENED;
+    PFAN_NODE node;
+
+    if (disposition > FILE_MAXIMUM_DISPOSITION ||
+        (FlagOn( options, FILE_DIRECTORY_FILE ) && FlagOn( options, FILE_NON_DIRECTORY_FILE ))) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!FanValidPath( name, length )) {
+
+        return STATUS_OBJECT_NAME_INVALID;
+    }
+
+    node = FanLookupNode( name, length );
+
+    if (node == NULL) {
+
+        if (FanLookupParent( name, length ) == NULL) {
+
+            return STATUS_OBJECT_PATH_NOT_FOUND;
+        }
+
+        if (disposition == FILE_OPEN || disposition == FILE_OVERWRITE) {
+
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+        }
+
+        node = FanInsertNode( name, length, (BOOLEAN) FlagOn( options, FILE_DIRECTORY_FILE ) );
+
+        if (node == NULL) {
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        information = FILE_CREATED;
+
+    } else {
+
+        if (node->DeletePending) {
+
+            return STATUS_DELETE_PENDING;
+        }
+
+        if (disposition == FILE_CREATE) {
+
+            return STATUS_OBJECT_NAME_COLLISION;
+        }
+
+        if (FlagOn( options, FILE_DIRECTORY_FILE ) && !node->Directory) {
+
+            return STATUS_NOT_A_DIRECTORY;
+        }
+
+        if (FlagOn( options, FILE_NON_DIRECTORY_FILE ) && node->Directory) {
+
+            return STATUS_FILE_IS_A_DIRECTORY;
+        }
+
+        if (disposition == FILE_SUPERSEDE ||
+            disposition == FILE_OVERWRITE ||
+            disposition == FILE_OVERWRITE_IF) {
+
+            if (node->Directory) {
+
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            node->Size = 0;
+            information = (disposition == FILE_SUPERSEDE) ? FILE_SUPERSEDED : FILE_OVERWRITTEN;
+        }
+    }
+
+    if (FlagOn( options, FILE_DELETE_ON_CLOSE ) && node->Directory && node->Children > 0) {
+
+        if (information == FILE_CREATED) {
+
+            FanRemoveNode( node );
+        }
+
+        return STATUS_DIRECTORY_NOT_EMPTY;
+    }
+
+    node->RefCount++;
+    node->OpenCount++;
+
+    file->Node = node;
+    file->CreateOptions = options;
+    fileObject->FsContext = node;
+    fileObject->FsContext2 = file;
+
+    InsertTailList( &FanOpenFiles, &file->Links );
+
+    Operation->Data.IoStatus.Information = information;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+LONGLONG
+FanByteOffset (
+    __in PFAN_FILE File,
+    __in PLARGE_INTEGER ByteOffset
+    )
+{
+    if (ByteOffset->HighPart == -1 &&
+        (ByteOffset->LowPart == FILE_USE_FILE_POINTER_POSITION ||
+         ByteOffset->LowPart == FILE_WRITE_TO_END_OF_FILE)) {
+
+        return (ByteOffset->LowPart == FILE_WRITE_TO_END_OF_FILE) ?
+               File->Node->Size :
+               File->FileObject.CurrentByteOffset.QuadPart;
+    }
+
+    return ByteOffset->QuadPart;
+}
+
+
+static
+NTSTATUS
+FanPerformRead (
+    __inout PFAN_OPERATION Operation
+    )
+/*++
+
+Routine Description:
+
+    Files hold no data.  What a read returns is a pattern of the offsets
+    it was read from, (UCHAR) offset, which a test can check.
+
+--*/
+{
+    PFLT_IO_PARAMETER_BLOCK iopb = &Operation->Iopb;
+    PFAN_FILE file = FanFileFromObject( iopb->TargetFileObject );
+    PUCHAR buffer = FanOperationBuffer( iopb );
+    LONGLONG offset;
+    ULONG count;
+    ULONG index;
+
+    if (file->Node->Directory) {
+
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    offset = FanByteOffset( file, &iopb->Parameters.Read.ByteOffset );
+
+    if (offset < 0) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (offset >= file->Node->Size) {
+
+        return STATUS_END_OF_FILE;
+    }
+
+    count = (ULONG) min( (LONGLONG) iopb->Parameters.Read.Length, file->Node->Size - offset );
+
+    for (index = 0; index < count; index++) {
+
+        buffer[index] = (UCHAR)(offset + index);
+    }
+
+    file->FileObject.CurrentByteOffset.QuadPart = offset + count;
+    Operation->Data.IoStatus.Information = count;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+FanPerformWrite (
+    __inout PFAN_OPERATION Operation
+    )
+{
+    PFLT_IO_PARAMETER_BLOCK iopb = &Operation->Iopb;
+    PFAN_FILE file = FanFileFromObject( iopb->TargetFileObject );
+    ULONG length = iopb->Parameters.Write.Length;
+    LONGLONG offset;
+
+    if (file->Node->Directory) {
+
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    offset = FanByteOffset( file, &iopb->Parameters.Write.ByteOffset );
+
+    if (offset < 0 || offset > MAXLONGLONG - length) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (length > 0 && FanOperationBuffer( iopb ) == NULL) {
+
+        return STATUS_INVALID_USER_BUFFER;
+    }
+
+    file->Node->Size = max( file->Node->Size, offset + length );
+    file->FileObject.CurrentByteOffset.QuadPart = offset + length;
+    Operation->Data.IoStatus.Information = length;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+FanPerformRename (
+    __inout PFAN_OPERATION Operation
+    )
+{
+    PFLT_IO_PARAMETER_BLOCK iopb = &Operation->Iopb;
+    PFAN_FILE file = FanFileFromObject( iopb->TargetFileObject );
+    PFILE_RENAME_INFORMATION rename = iopb->Parameters.SetFileInformation.InfoBuffer;
+    PFAN_NODE node = file->Node;
+    PFAN_NODE target;
+    USHORT length;
+    PWCH path;
+    NTSTATUS status;
+
+    if (iopb->Parameters.SetFileInformation.Length < FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName) ||
+        rename->FileNameLength > iopb->Parameters.SetFileInformation.Length -
+                                 FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName)) {
+
+        return STATUS_INFO_LENGTH_MISMATCH;
+    }
+
+    if (rename->RootDirectory != NULL) {
+
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (node->NameLength == sizeof(WCHAR) || node->Deleted) {
+
+        return STATUS_ACCESS_DENIED;
+    }
+
+    status = FanTargetPath( file, rename->FileName, rename->FileNameLength, &path, &length );
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
+
+    if (!FanValidPath( path, length ) || length == sizeof(WCHAR)) {
+
+        status = STATUS_OBJECT_NAME_INVALID;
+        goto Cleanup;
+    }
+
+    if (FanLookupParent( path, length ) == NULL) {
+
+        status = STATUS_OBJECT_PATH_NOT_FOUND;
+        goto Cleanup;
+    }
+
+    //
+    //  A directory cannot move under itself.
+    //
+
+    if (node->Directory &&
+        length > node->NameLength &&
+        path[node->NameLength / sizeof(WCHAR)] == '\\' &&
+        FanEqualName( path, node->NameLength, node->Name, node->NameLength )) {
+
+        status = STATUS_INVALID_PARAMETER;
+        goto Cleanup;
+    }
+
+    target = FanLookupNode( path, length );
+
+    if (target != NULL && target != node) {
+
+        if (!rename->ReplaceIfExists) {
+
+            status = STATUS_OBJECT_NAME_COLLISION;
+            goto Cleanup;
+        }
+
+        if (target->Directory || target->OpenCount > 0) {
+
+            status = STATUS_ACCESS_DENIED;
+            goto Cleanup;
+        }
+
+        FanRemoveNode( target );
+    }
+
+    if (!FanRenameNode( node, path, length )) {
+
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+Cleanup:
+
+    free( path );
+
+    return status;
+}
+
+
+static
+NTSTATUS
+FanPerformSetInformation (
+    __inout PFAN_OPERATION Operation
+    )
+{
+    PFLT_IO_PARAMETER_BLOCK iopb = &Operation->Iopb;
+    PFAN_FILE file = FanFileFromObject( iopb->TargetFileObject );
+    PVOID information = iopb->Parameters.SetFileInformation.InfoBuffer;
+    ULONG length = iopb->Parameters.SetFileInformation.Length;
+    PFAN_NODE node = file->Node;
+
+    switch (iopb->Parameters.SetFileInformation.FileInformationClass) {
+
+        case FileRenameInformation:
+
+            return FanPerformRename( Operation );
+
+        case FileDispositionInformation:
+
+            if (length < sizeof(FILE_DISPOSITION_INFORMATION)) {
+
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            if (((PFILE_DISPOSITION_INFORMATION) information)->DeleteFile) {
+
+                if (node->NameLength == sizeof(WCHAR)) {
+
+                    return STATUS_CANNOT_DELETE;
+                }
+
+                if (node->Directory && node->Children > 0) {
+
+                    return STATUS_DIRECTORY_NOT_EMPTY;
+                }
+
+                node->DeletePending = TRUE;
+
+            } else {
+
+                node->DeletePending = FALSE;
+            }
+
+            file->FileObject.DeletePending = node->DeletePending;
+
+            return STATUS_SUCCESS;
+
+        case FileEndOfFileInformation:
+
+            if (length < sizeof(FILE_END_OF_FILE_INFORMATION)) {
+
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            if (node->Directory) {
+
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            if (((PFILE_END_OF_FILE_INFORMATION) information)->EndOfFile.QuadPart < 0) {
+
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            node->Size = ((PFILE_END_OF_FILE_INFORMATION) information)->EndOfFile.QuadPart;
+
+            return STATUS_SUCCESS;
+
+        case FileBasicInformation:
+
+            if (length < sizeof(FILE_BASIC_INFORMATION)) {
+
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            if (((PFILE_BASIC_INFORMATION) information)->FileAttributes != 0) {
+
+                node->Attributes = (((PFILE_BASIC_INFORMATION) information)->FileAttributes &
+                                    ~FILE_ATTRIBUTE_DIRECTORY) |
+                                   (node->Directory ? FILE_ATTRIBUTE_DIRECTORY : 0);
+            }
+
+            return STATUS_SUCCESS;
+
+        case FilePositionInformation:
+
+            if (length < sizeof(FILE_POSITION_INFORMATION)) {
+
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            if (((PFILE_POSITION_INFORMATION) information)->CurrentByteOffset.QuadPart < 0) {
+
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            file->FileObject.CurrentByteOffset =
+                ((PFILE_POSITION_INFORMATION) information)->CurrentByteOffset;
+
+            return STATUS_SUCCESS;
+
+        default:
+
+            return STATUS_INVALID_INFO_CLASS;
+    }
+}
+
+
+static
+NTSTATUS
+FanPerformCleanup (
+    __inout PFAN_OPERATION Operation
+    )
+/*++
+
+Routine Description:
+
+    The last handle on the file object is gone.  A file whose delete is
+    pending goes from the namespace when its last file object is cleaned
+    up, though it lives on until that is closed.
+
+--*/
+{
+    PFAN_FILE file = FanFileFromObject( Operation->Iopb.TargetFileObject );
+    PFAN_NODE node = file->Node;
+
+    ASSERT( node->OpenCount > 0 );
+
+    if (FlagOn( file->CreateOptions, FILE_DELETE_ON_CLOSE ) &&
+        (!node->Directory || node->Children == 0)) {
+
+        node->DeletePending = TRUE;
+    }
+
+    if (--node->OpenCount == 0 && node->DeletePending && !node->Deleted) {
+
+        FanRemoveNode( node );
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+FanPerform (
+    __inout PFAN_OPERATION Operation
+    )
+{
+    NTSTATUS status;
+
+    pthread_mutex_lock( &FanVolumeLock );
+
+    switch (Operation->Iopb.MajorFunction) {
+
+        case IRP_MJ_CREATE:
+            status = FanPerformCreate( Operation );
+            break;
+
+        case IRP_MJ_READ:
+            status = FanPerformRead( Operation );
+            break;
+
+        case IRP_MJ_WRITE:
+            status = FanPerformWrite( Operation );
+            break;
+
+        case IRP_MJ_SET_INFORMATION:
+            status = FanPerformSetInformation( Operation );
+            break;
+
+        case IRP_MJ_CLEANUP:
+            status = FanPerformCleanup( Operation );
+            break;
+
+        case IRP_MJ_CLOSE:
+            status = STATUS_SUCCESS;
+            break;
+
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    pthread_mutex_unlock( &FanVolumeLock );
+
+    if (!NT_SUCCESS( status ) && Operation->Iopb.MajorFunction != IRP_MJ_CREATE) {
+
+        Operation->Data.IoStatus.Information = 0;
+    }
+
+    Operation->Data.IoStatus.Status = status;
+
+    return status;
+}
+
+//---------------------------------------------------------------------------
+//  Filter manager: dispatch
+//---------------------------------------------------------------------------
+
+static
+NTSTATUS
+FanDispatch (
+    __in PFAN_FILE File,
+    __in PFLT_IO_PARAMETER_BLOCK Iopb,
+    __in KPROCESSOR_MODE RequestorMode,
+    __out_opt PIO_STATUS_BLOCK IoStatus
+    )
+/*++
+
+Routine Description:
+
+    Sends an operation down through the filter, if one is attached, to
+    the file system and back.
+
+    The pre-operation callback sees the operation first.  Unless it
+    completes the operation, the file system performs it and any status
+    callback the filter asked for is called.  The post-operation callback
+    sees it complete if the pre-operation callback asked for that.
+
+    What the filter left on the operation is freed after, as the I/O
+    manager would free it with the IRP: an MDL the filter swapped in and
+    the one FltLockUserBuffer built.
+
+--*/
+{
+    FAN_OPERATION operation;
+    FLT_PREOP_CALLBACK_STATUS preStatus = FLT_PREOP_SUCCESS_NO_CALLBACK;
+    FLT_POSTOP_CALLBACK_STATUS postStatus;
+    PFLT_PRE_OPERATION_CALLBACK preOperation = NULL;
+    PFLT_POST_OPERATION_CALLBACK postOperation = NULL;
+    PVOID completionContext = NULL;
+    PMDL *mdl;
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+    ASSERT( Iopb->MajorFunction <= IRP_MJ_MAXIMUM_FUNCTION );
+
+    RtlZeroMemory( &operation, sizeof(operation) );
+
+    operation.Iopb = *Iopb;
+    operation.Iopb.TargetFileObject = &File->FileObject;
+    operation.Iopb.TargetInstance = &FanInstance;
+
+    operation.Data.Flags = FLTFL_CALLBACK_DATA_IRP_OPERATION;
+    operation.Data.Thread = &FanCurrentProcess()->Thread;
+    operation.Data.Iopb = &operation.Iopb;
+    operation.Data.IoStatus.Status = STATUS_SUCCESS;
+    operation.Data.RequestorMode = RequestorMode;
+
+    FanRelatedObjects( &operation.Objects, &File->FileObject );
+
+    pthread_rwlock_rdlock( &FanFilter.Rundown );
+
+    if (FanFilter.Attached) {
+
+        preOperation = FanFilter.PreOperation[Iopb->MajorFunction];
+        postOperation = FanFilter.PostOperation[Iopb->MajorFunction];
+    }
+
+    operation.Previous = FanThread.Operation;
+    FanThread.Operation = &operation;
+
+    if (preOperation != NULL) {
+
+        preStatus = preOperation( &operation.Data, &operation.Objects, &completionContext );
+
+        ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+        ASSERT( preStatus != FLT_PREOP_PENDING );
+    }
+
+    if (preStatus != FLT_PREOP_COMPLETE) {
+
+        FanPerform( &operation );
+
+        if (operation.StatusCallback != NULL) {
+
+            operation.StatusCallback( &operation.Objects,
+                                      &operation.Snapshot,
+                                      operation.Data.IoStatus.Status,
+                                      operation.StatusContext );
+        }
+    }
+
+    if (postOperation != NULL &&
+        (preStatus == FLT_PREOP_SUCCESS_WITH_CALLBACK || preStatus == FLT_PREOP_SYNCHRONIZE)) {
+
+        SetFlag( operation.Data.Flags, FLTFL_CALLBACK_DATA_POST_OPERATION );
+
+        postStatus = postOperation( &operation.Data, &operation.Objects, completionContext, 0 );
+
+        ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+        ASSERT( postStatus == FLT_POSTOP_FINISHED_PROCESSING );
+        UNREFERENCED_PARAMETER( postStatus );
+    }
+
+    FanThread.Operation = operation.Previous;
+
+    pthread_rwlock_unlock( &FanFilter.Rundown );
+
+    mdl = FanMdlAddress( &operation.Iopb );
+
+    if (mdl != NULL && *mdl != NULL &&
+        *mdl != *FanMdlAddress( Iopb ) &&
+        *mdl != operation.LockedMdl) {
+
+        IoFreeMdl( *mdl );
+    }
+
+    if (operation.LockedMdl != NULL) {
+
+        IoFreeMdl( operation.LockedMdl );
+    }
+
+    if (IoStatus != NULL) {
+
+        *IoStatus = operation.Data.IoStatus;
+    }
+
+    return operation.Data.IoStatus.Status;
+}
+
+
+static
+ACCESS_MASK
+FanMapAccess (
+    __in ACCESS_MASK DesiredAccess
+    )
+{
+    ACCESS_MASK access = DesiredAccess & ~(GENERIC_READ | GENERIC_WRITE |
+                                           GENERIC_EXECUTE | GENERIC_ALL |
+                                           MAXIMUM_ALLOWED);
+
+    if (FlagOn( DesiredAccess, GENERIC_READ )) {
+
+        access |= FILE_GENERIC_READ;
+    }
+
+    if (FlagOn( DesiredAccess, GENERIC_WRITE )) {
+
+        access |= FILE_GENERIC_WRITE;
+    }
+
+    if (FlagOn( DesiredAccess, GENERIC_EXECUTE )) {
+
+        access |= FILE_GENERIC_EXECUTE;
+    }
+
+    if (FlagOn( DesiredAccess, GENERIC_ALL | MAXIMUM_ALLOWED )) {
+
+        access |= FILE_ALL_ACCESS;
+    }
+
+    return access;
+}
+
+
+static
+VOID
+FanCloseFile (
+    __in PFAN_FILE File
+    )
+/*++
+
+Routine Description:
+
+    Sends the cleanup and close of an open file object down through the
+    filter and frees it.
+
+--*/
+{
+    FLT_IO_PARAMETER_BLOCK iopb;
+
+    RtlZeroMemory( &iopb, sizeof(iopb) );
+
+    iopb.MajorFunction = IRP_MJ_CLEANUP;
+    FanDispatch( File, &iopb, KernelMode, NULL );
+
+    iopb.MajorFunction = IRP_MJ_CLOSE;
+    FanDispatch( File, &iopb, KernelMode, NULL );
+
+    FanFreeFile( File );
+}
+
+
+static
+NTSTATUS
+FanOpen (
+    __in PFAN_FILE File,
+    __in ACCESS_MASK DesiredAccess,
+    __in ULONG FileAttributes,
+    __in ULONG ShareAccess,
+    __in ULONG CreateDisposition,
+    __in ULONG CreateOptions,
+    __in KPROCESSOR_MODE RequestorMode,
+    __out_opt PIO_STATUS_BLOCK IoStatus
+    )
+/*++
+
+Routine Description:
+
+    Sends the create of a new file object down through the filter, as the
+    current process.  If the file system opened the file but the filter
+    failed the create after, the open is undone, as FltCancelFileOpen
+    would.  A file object that does not open is freed.
+
+--*/
+{
+    PEPROCESS process = FanCurrentProcess();
+    ACCESS_STATE accessState;
+    IO_SECURITY_CONTEXT securityContext;
+    FLT_IO_PARAMETER_BLOCK iopb;
+    ACCESS_MASK access = FanMapAccess( DesiredAccess );
+    NTSTATUS status;
+
+    RtlZeroMemory( &accessState, sizeof(accessState) );
+    RtlZeroMemory( &securityContext, sizeof(securityContext) );
+    RtlZeroMemory( &iopb, sizeof(iopb) );
+
+    accessState.OriginalDesiredAccess = access;
+    accessState.RemainingDesiredAccess = access;
+    accessState.SubjectSecurityContext.PrimaryToken = process->Token;
+
+    securityContext.AccessState = &accessState;
+    securityContext.DesiredAccess = access;
+    securityContext.FullCreateOptions = CreateOptions;
+
+    iopb.MajorFunction = IRP_MJ_CREATE;
+    iopb.Parameters.Create.SecurityContext = &securityContext;
+    iopb.Parameters.Create.Options = (CreateDisposition << 24) | (CreateOptions & 0x00ffffff);
+    iopb.Parameters.Create.FileAttributes = (USHORT) FileAttributes;
+    iopb.Parameters.Create.ShareAccess = (USHORT) ShareAccess;
+
+    File->GrantedAccess = access;
+
+    status = FanDispatch( File, &iopb, RequestorMode, IoStatus );
+
+    if (!NT_SUCCESS( status ) && File->Node != NULL) {
+
+        FanCloseFile( File );
+        return status;
+    }
+
+    if (!NT_SUCCESS( status )) {
+
+        FanFreeFile( File );
+    }
+
+    return status;
+}
+
+
+static
+VOID
+FanDeleteFileObject (
+    __in PFAN_OBJECT Object
+    )
+{
+    FanCloseFile( CONTAINING_RECORD( Object, FAN_FILE, Header ) );
+}
+
+
+NTSTATUS
+ZwCreateFile (
+    __out PHANDLE FileHandle,
+    __in ACCESS_MASK DesiredAccess,
+    __in POBJECT_ATTRIBUTES ObjectAttributes,
+    __out PIO_STATUS_BLOCK IoStatusBlock,
+    __in_opt PLARGE_INTEGER AllocationSize,
+    __in ULONG FileAttributes,
+    __in ULONG ShareAccess,
+    __in ULONG CreateDisposition,
+    __in ULONG CreateOptions,
+    __in_bcount_opt(EaLength) PVOID EaBuffer,
+    __in ULONG EaLength
+    )
+/*++
+
+Routine Description:
+
+    Opens a file on the volume by its fully qualified name, as the kernel
+    on behalf of the current process.  The handle is the file object, and
+    closing it cleans up and closes the file through the filter.
+
+Return Value:
+
+    STATUS_OBJECT_PATH_NOT_FOUND for a name not on the volume and
+    STATUS_NOT_SUPPORTED for one relative to a directory handle.
+
+--*/
+{
+    PUNICODE_STRING name = ObjectAttributes->ObjectName;
+    PFAN_FILE file;
+    USHORT length;
+    PCWCH path;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER( AllocationSize );
+    UNREFERENCED_PARAMETER( EaBuffer );
+    UNREFERENCED_PARAMETER( EaLength );
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    *FileHandle = NULL;
+    IoStatusBlock->Information = 0;
+
+    if (ObjectAttributes->RootDirectory != NULL) {
+
+        return IoStatusBlock->Status = STATUS_NOT_SUPPORTED;
+    }
+
+    status = FanVolumePath( name->Buffer, name->Length, &path, &length );
+
+    if (!NT_SUCCESS( status )) {
+
+        return IoStatusBlock->Status = status;
+    }
+
+    file = FanNewFile( path, length );
+
+    if (file == NULL) {
+
+        return IoStatusBlock->Status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    file->Header.Temporary = TRUE;
+
+    status = FanOpen( file,
+                      DesiredAccess,
+                      FileAttributes,
+                      ShareAccess,
+                      CreateDisposition,
+                      CreateOptions,
+                      KernelMode,
+                      IoStatusBlock );
+
+    if (NT_SUCCESS( status )) {
+
+        *FileHandle = &file->Header;
+    }
+
+    return status;
+}
+
+//---------------------------------------------------------------------------
+//  Simulated file operations
+//---------------------------------------------------------------------------
+
+NTSTATUS
+FanSimCreateFile (
+    __in PCSTR FileName,
+    __in ACCESS_MASK DesiredAccess,
+    __in ULONG CreateDisposition,
+    __in ULONG CreateOptions,
+    __deref_out PFILE_OBJECT *FileObject,
+    __out_opt PULONG_PTR Information
+    )
+/*++
+
+Routine Description:
+
+    Opens FileName on the volume as the current process would, as a user
+    mode request with no sharing restrictions.
+
+--*/
+{
+    IO_STATUS_BLOCK ioStatus;
+    PFAN_FILE file;
+    USHORT length;
+    PWCH name;
+    NTSTATUS status;
+
+    FanEnsureInitialized();
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    *FileObject = NULL;
+
+    if (Information != NULL) {
+
+        *Information = 0;
+    }
+
+    name = FanDuplicateAscii( FileName, &length );
+
+    if (name == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    file = FanNewFile( name, length );
+    free( name );
+
+    if (file == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = FanOpen( file,
+                      DesiredAccess,
+                      FILE_ATTRIBUTE_NORMAL,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                      CreateDisposition,
+                      CreateOptions,
+                      UserMode,
+                      &ioStatus );
+
+    if (Information != NULL) {
+
+        *Information = ioStatus.Information;
+    }
+
+    if (NT_SUCCESS( status )) {
+
+        *FileObject = &file->FileObject;
+    }
+
+    return status;
+}
+
+
+static
+VOID
+FanSetByteOffset (
+    __out PLARGE_INTEGER ByteOffset,
+    __in LONGLONG Offset
+    )
+{
+    if (Offset < 0) {
+
+        ByteOffset->LowPart = FILE_USE_FILE_POINTER_POSITION;
+        ByteOffset->HighPart = -1;
+
+    } else {
+
+        ByteOffset->QuadPart = Offset;
+    }
+}
+
+
+NTSTATUS
+FanSimRead (
+    __in PFILE_OBJECT FileObject,
+    __in LONGLONG ByteOffset,
+    __out_bcount(Length) PVOID Buffer,
+    __in ULONG Length,
+    __out_opt PULONG_PTR BytesRead
+    )
+{
+    PFAN_FILE file = FanFileFromObject( FileObject );
+    FLT_IO_PARAMETER_BLOCK iopb;
+    IO_STATUS_BLOCK ioStatus = { { STATUS_ACCESS_DENIED }, 0 };
+
+    if (FlagOn( file->GrantedAccess, FILE_READ_DATA )) {
+
+        RtlZeroMemory( &iopb, sizeof(iopb) );
+
+        iopb.MajorFunction = IRP_MJ_READ;
+        iopb.IrpFlags = IRP_SYNCHRONOUS_API;
+        iopb.Parameters.Read.Length = Length;
+        iopb.Parameters.Read.ReadBuffer = Buffer;
+        FanSetByteOffset( &iopb.Parameters.Read.ByteOffset, ByteOffset );
+
+        FanDispatch( file, &iopb, UserMode, &ioStatus );
+    }
+
+    if (BytesRead != NULL) {
+
+        *BytesRead = ioStatus.Information;
+    }
+
+    return ioStatus.Status;
+}
+
+
+NTSTATUS
+FanSimWrite (
+    __in PFILE_OBJECT FileObject,
+    __in LONGLONG ByteOffset,
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length,
+    __out_opt PULONG_PTR BytesWritten
+    )
+{
+    PFAN_FILE file = FanFileFromObject( FileObject );
+    FLT_IO_PARAMETER_BLOCK iopb;
+    IO_STATUS_BLOCK ioStatus = { { STATUS_ACCESS_DENIED }, 0 };
+
+    if (FlagOn( file->GrantedAccess, FILE_WRITE_DATA | FILE_APPEND_DATA )) {
+
+        RtlZeroMemory( &iopb, sizeof(iopb) );
+
+        iopb.MajorFunction = IRP_MJ_WRITE;
+        iopb.IrpFlags = IRP_SYNCHRONOUS_API;
+        iopb.Parameters.Write.Length = Length;
+        iopb.Parameters.Write.WriteBuffer = (PVOID) Buffer;
+        FanSetByteOffset( &iopb.Parameters.Write.ByteOffset, ByteOffset );
+
+        //
+        //  A handle with append access alone only writes at the end.
+        //
+
+        if (!FlagOn( file->GrantedAccess, FILE_WRITE_DATA )) {
+
+            iopb.Parameters.Write.ByteOffset.LowPart = FILE_WRITE_TO_END_OF_FILE;
+            iopb.Parameters.Write.ByteOffset.HighPart = -1;
+        }
+
+        FanDispatch( file, &iopb, UserMode, &ioStatus );
+    }
+
+    if (BytesWritten != NULL) {
+
+        *BytesWritten = ioStatus.Information;
+    }
+
+    return ioStatus.Status;
+}
+
+
+NTSTATUS
+FanSimSetInformation (
+    __in PFILE_OBJECT FileObject,
+    __in FILE_INFORMATION_CLASS FileInformationClass,
+    __in_bcount(Length) PVOID FileInformation,
+    __in ULONG Length
+    )
+{
+    PFAN_FILE file = FanFileFromObject( FileObject );
+    FLT_IO_PARAMETER_BLOCK iopb;
+    ACCESS_MASK required;
+
+    switch (FileInformationClass) {
+
+        case FileRenameInformation:
+        case FileDispositionInformation:
+            required = DELETE;
+            break;
+
+        case FileBasicInformation:
+            required = FILE_WRITE_ATTRIBUTES;
+            break;
+
+        case FileEndOfFileInformation:
+            required = FILE_WRITE_DATA;
+            break;
+
+        default:
+            required = 0;
+            break;
+    }
+
+    if (required != 0 && !FlagOn( file->GrantedAccess, required )) {
+
+        return STATUS_ACCESS_DENIED;
+    }
+
+    RtlZeroMemory( &iopb, sizeof(iopb) );
+
+    iopb.MajorFunction = IRP_MJ_SET_INFORMATION;
+    iopb.Parameters.SetFileInformation.Length = Length;
+    iopb.Parameters.SetFileInformation.FileInformationClass = FileInformationClass;
+    iopb.Parameters.SetFileInformation.InfoBuffer = FileInformation;
+
+    if (FileInformationClass == FileRenameInformation &&
+        Length >= FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName)) {
+
+        iopb.Parameters.SetFileInformation.ReplaceIfExists =
+            ((PFILE_RENAME_INFORMATION) FileInformation)->ReplaceIfExists;
+    }
+
+    return FanDispatch( file, &iopb, UserMode, NULL );
+}
+
+
+NTSTATUS
+FanSimRename (
+    __in PFILE_OBJECT FileObject,
+    __in PCSTR NewName,
+    __in BOOLEAN ReplaceIfExists
+    )
+/*++
+
+Routine Description:
+
+    Renames a file to NewName, a name on the volume, passing it fully
+    qualified as \??\C:\... as Win32 does.
+
+--*/
+{
+    static CONST CHAR prefix[] = "\\??\\" FAN_SIM_DOS_NAME;
+    SIZE_T count = strlen( prefix ) + strlen( NewName );
+    ULONG length = FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName) + (ULONG)((count + 1) * sizeof(WCHAR));
+    PFILE_RENAME_INFORMATION rename;
+    SIZE_T copied;
+    NTSTATUS status;
+
+    rename = calloc( 1, length );
+
+    if (rename == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    copied = FanWidenAscii( rename->FileName, count + 1, prefix );
+    FanWidenAscii( &rename->FileName[copied], count + 1 - copied, NewName );
+
+    rename->ReplaceIfExists = ReplaceIfExists;
+    rename->RootDirectory = NULL;
+    rename->FileNameLength = (ULONG)(count * sizeof(WCHAR));
+
+    status = FanSimSetInformation( FileObject, FileRenameInformation, rename, length );
+
+    free( rename );
+
+    return status;
+}
+
+
+NTSTATUS
+FanSimDelete (
+    __in PFILE_OBJECT FileObject
+    )
+{
+    FILE_DISPOSITION_INFORMATION disposition = { TRUE };
+
+    return FanSimSetInformation( FileObject,
+                                 FileDispositionInformation,
+                                 &disposition,
+                                 sizeof(disposition) );
+}
+
+
+VOID
+FanSimCloseFile (
+    __in PFILE_OBJECT FileObject
+    )
+{
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    FanCloseFile( FanFileFromObject( FileObject ) );
+}
+
+//---------------------------------------------------------------------------
+//  Filter manager: communication ports
+//---------------------------------------------------------------------------
+
+//
+//  A server port is the filter's, named and listed until it is closed.
+//  A client port is one connection to it, from FanSimConnect, listed
+//  until it disconnects.  A server port closed with connections still on
+//  it lives until the last of them goes.
+//
+//  Messages hold the client port's Rundown shared, so a disconnect waits
+//  for those in flight before it tells the filter.
+//
+
+struct _FLT_PORT {
+
+    LIST_ENTRY Links;
+    BOOLEAN Server;
+
+    //
+    //  Server ports
+    //
+
+    PWCH Name;
+    USHORT NameLength;
+    BOOLEAN Closed;
+    PVOID Cookie;
+    PFLT_CONNECT_NOTIFY ConnectNotify;
+    PFLT_DISCONNECT_NOTIFY DisconnectNotify;
+    PFLT_MESSAGE_NOTIFY MessageNotify;
+    LONG MaxConnections;
+    LONG Connections;
+
+    //
+    //  Client ports.  Disconnected is set once the filter has closed the
+    //  port or been told the client has gone.
+    //
+
+    struct _FLT_PORT *ServerPort;
+    PVOID ConnectionCookie;
+    BOOLEAN Disconnected;
+    pthread_rwlock_t Rundown;
+};
+
+static pthread_mutex_t FanPortLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY FanServerPorts = { &FanServerPorts, &FanServerPorts };
+static LIST_ENTRY FanClientPorts = { &FanClientPorts, &FanClientPorts };
+
+
+NTSTATUS
+FltBuildDefaultSecurityDescriptor (
+    __deref_out PSECURITY_DESCRIPTOR *SecurityDescriptor,
+    __in ACCESS_MASK DesiredAccess
+    )
+/*++
+
+Routine Description:
+
+    Ports are not access checked.  The descriptor is only pool to free.
+
+--*/
+{
+    UNREFERENCED_PARAMETER( DesiredAccess );
+
+    *SecurityDescriptor = ExAllocatePoolWithTag( PagedPool, 64, FAN_SECURITY_TAG );
+
+    if (*SecurityDescriptor == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( *SecurityDescriptor, 64 );
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+FltFreeSecurityDescriptor (
+    __in PSECURITY_DESCRIPTOR SecurityDescriptor
+    )
+{
+    ExFreePoolWithTag( SecurityDescriptor, FAN_SECURITY_TAG );
+}
+
+
+static
+PFLT_PORT
+FanFindServerPort (
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Name,
+    __in USHORT Length
+    )
+{
+    PLIST_ENTRY entry;
+    PFLT_PORT port;
+
+    for (entry = FanServerPorts.Flink; entry != &FanServerPorts; entry = entry->Flink) {
+
+        port = CONTAINING_RECORD( entry, struct _FLT_PORT, Links );
+
+        if (FanEqualName( port->Name, port->NameLength, Name, Length )) {
+
+            return port;
+        }
+    }
+
+    return NULL;
+}
+
+
+static
+VOID
+FanFreeServerPort (
+    __in PFLT_PORT ServerPort
+    )
+{
+    free( ServerPort->Name );
+    free( ServerPort );
+}
+
+
+NTSTATUS
+FltCreateCommunicationPort (
+    __in PFLT_FILTER Filter,
+    __deref_out PFLT_PORT *ServerPort,
+    __in POBJECT_ATTRIBUTES ObjectAttributes,
+    __in_opt PVOID ServerPortCookie,
+    __in PFLT_CONNECT_NOTIFY ConnectNotifyCallback,
+    __in PFLT_DISCONNECT_NOTIFY DisconnectNotifyCallback,
+    __in_opt PFLT_MESSAGE_NOTIFY MessageNotifyCallback,
+    __in LONG MaxConnections
+    )
+{
+    PUNICODE_STRING name = ObjectAttributes->ObjectName;
+    PFLT_PORT port;
+
+    ASSERT( Filter == &FanFilter && Filter->Registered );
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    *ServerPort = NULL;
+
+    if (name == NULL || name->Length == 0 || MaxConnections <= 0) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    port = calloc( 1, sizeof(struct _FLT_PORT) );
+
+    if (port == NULL || (port->Name = malloc( name->Length )) == NULL) {
+
+        free( port );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory( port->Name, name->Buffer, name->Length );
+    port->NameLength = name->Length;
+    port->Server = TRUE;
+    port->Cookie = ServerPortCookie;
+    port->ConnectNotify = ConnectNotifyCallback;
+    port->DisconnectNotify = DisconnectNotifyCallback;
+    port->MessageNotify = MessageNotifyCallback;
+    port->MaxConnections = MaxConnections;
+
+    pthread_mutex_lock( &FanPortLock );
+
+    if (FanFindServerPort( name->Buffer, name->Length ) != NULL) {
+
+        pthread_mutex_unlock( &FanPortLock );
+        FanFreeServerPort( port );
+
+        return STATUS_OBJECT_NAME_COLLISION;
+    }
+
+    InsertTailList( &FanServerPorts, &port->Links );
+
+    pthread_mutex_unlock( &FanPortLock );
+
+    *ServerPort = port;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+FltCloseCommunicationPort (
+    __in PFLT_PORT ServerPort
+    )
+/*++
+
+Routine Description:
+
+    Closes a server port to new connections.  Those already on it stay
+    until they are closed.
+
+--*/
+{
+    BOOLEAN last;
+
+    ASSERT( ServerPort->Server && !ServerPort->Closed );
+
+    pthread_mutex_lock( &FanPortLock );
+
+    RemoveEntryList( &ServerPort->Links );
+    ServerPort->Closed = TRUE;
+    last = (ServerPort->Connections == 0);
+
+    pthread_mutex_unlock( &FanPortLock );
+
+    if (last) {
+
+        FanFreeServerPort( ServerPort );
+    }
+}
+
+
+VOID
+FltCloseClientPort (
+    __in PFLT_FILTER Filter,
+    __deref_out PFLT_PORT *ClientPort
+    )
+/*++
+
+Routine Description:
+
+    Closes the filter's end of a connection.  The client's messages fail
+    from then on, and it is not told it has been disconnected.
+
+--*/
+{
+    PFLT_PORT port = *ClientPort;
+
+    ASSERT( Filter == &FanFilter );
+
+    if (port == NULL) {
+
+        return;
+    }
+
+    ASSERT( !port->Server );
+
+    pthread_mutex_lock( &FanPortLock );
+    port->Disconnected = TRUE;
+    pthread_mutex_unlock( &FanPortLock );
+
+    *ClientPort = NULL;
+}
+
+
+NTSTATUS
+FanSimConnect (
+    __in PCSTR PortName,
+    __in_bcount_opt(ContextSize) PVOID Context,
+    __in ULONG ContextSize,
+    __deref_out PFLT_PORT *ClientPort
+    )
+/*++
+
+Routine Description:
+
+    Connects to the filter's port PortName as the current process would,
+    as FilterConnectCommunicationPort does.
+
+Return Value:
+
+    STATUS_OBJECT_NAME_NOT_FOUND if there is no such port, otherwise the
+    filter's answer or STATUS_CONNECTION_COUNT_LIMIT.
+
+--*/
+{
+    PFLT_PORT serverPort;
+    PFLT_PORT port;
+    USHORT length;
+    PWCH name;
+    BOOLEAN last;
+    NTSTATUS status;
+
+    FanEnsureInitialized();
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    *ClientPort = NULL;
+
+    name = FanDuplicateAscii( PortName, &length );
+    port = calloc( 1, sizeof(struct _FLT_PORT) );
+
+    if (name == NULL || port == NULL) {
+
+        free( name );
+        free( port );
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    pthread_rwlock_init( &port->Rundown, NULL );
+
+    pthread_mutex_lock( &FanPortLock );
+
+    serverPort = FanFindServerPort( name, length );
+    free( name );
+
+    if (serverPort == NULL || serverPort->Connections >= serverPort->MaxConnections) {
+
+        pthread_mutex_unlock( &FanPortLock );
+
+        pthread_rwlock_destroy( &port->Rundown );
+        free( port );
+
+        return (serverPort == NULL) ? STATUS_OBJECT_NAME_NOT_FOUND : STATUS_CONNECTION_COUNT_LIMIT;
+    }
+
+    serverPort->Connections++;
+    port->ServerPort = serverPort;
+
+    pthread_mutex_unlock( &FanPortLock );
+
+    status = serverPort->ConnectNotify( port,
+                                        serverPort->Cookie,
+                                        Context,
+                                        ContextSize,
+                                        &port->ConnectionCookie );
+
+    pthread_mutex_lock( &FanPortLock );
+
+    if (NT_SUCCESS( status )) {
+
+        InsertTailList( &FanClientPorts, &port->Links );
+
+        pthread_mutex_unlock( &FanPortLock );
+
+        *ClientPort = port;
+
+        return status;
+    }
+
+    serverPort->Connections--;
+    last = (serverPort->Closed && serverPort->Connections == 0);
+
+    pthread_mutex_unlock( &FanPortLock );
+
+    if (last) {
+
+        FanFreeServerPort( serverPort );
+    }
+
+    pthread_rwlock_destroy( &port->Rundown );
+    free( port );
+
+    return status;
+}
+
+
+NTSTATUS
+FanSimSendMessage (
+    __in PFLT_PORT ClientPort,
+    __in_bcount_opt(InputLength) PVOID InputBuffer,
+    __in ULONG InputLength,
+    __out_bcount_part_opt(OutputLength,*ReturnedLength) PVOID OutputBuffer,
+    __in ULONG OutputLength,
+    __out PULONG ReturnedLength
+    )
+/*++
+
+Routine Description:
+
+    Sends a message to the filter, as FilterSendMessage does.
+
+Return Value:
+
+    STATUS_PORT_DISCONNECTED if the filter has closed the connection,
+    otherwise the filter's answer.
+
+--*/
+{
+    PFLT_PORT serverPort = ClientPort->ServerPort;
+    BOOLEAN disconnected;
+    NTSTATUS status;
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    *ReturnedLength = 0;
+
+    pthread_rwlock_rdlock( &ClientPort->Rundown );
+
+    pthread_mutex_lock( &FanPortLock );
+    disconnected = ClientPort->Disconnected;
+    pthread_mutex_unlock( &FanPortLock );
+
+    if (disconnected) {
+
+        status = STATUS_PORT_DISCONNECTED;
+
+    } else if (serverPort->MessageNotify == NULL) {
+
+        status = STATUS_INVALID_DEVICE_REQUEST;
+
+    } else {
+
+        status = serverPort->MessageNotify( ClientPort->ConnectionCookie,
+                                            InputBuffer,
+                                            InputLength,
+                                            OutputBuffer,
+                                            OutputLength,
+                                            ReturnedLength );
+    }
+
+    pthread_rwlock_unlock( &ClientPort->Rundown );
+
+    return status;
+}
+
+
+VOID
+FanSimDisconnect (
+    __in PFLT_PORT ClientPort
+    )
+/*++
+
+Routine Description:
+
+    Closes the client's end of a connection, as closing the port handle
+    does.  The filter is told unless it closed the connection itself.
+
+--*/
+{
+    PFLT_PORT serverPort = ClientPort->ServerPort;
+    BOOLEAN notify;
+    BOOLEAN last;
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    pthread_rwlock_wrlock( &ClientPort->Rundown );
+
+    pthread_mutex_lock( &FanPortLock );
+    notify = !ClientPort->Disconnected;
+    ClientPort->Disconnected = TRUE;
+    pthread_mutex_unlock( &FanPortLock );
+
+    if (notify) {
+
+        serverPort->DisconnectNotify( ClientPort->ConnectionCookie );
+    }
+
+    pthread_mutex_lock( &FanPortLock );
+
+    RemoveEntryList( &ClientPort->Links );
+    serverPort->Connections--;
+    last = (serverPort->Closed && serverPort->Connections == 0);
+
+    pthread_mutex_unlock( &FanPortLock );
+
+    pthread_rwlock_unlock( &ClientPort->Rundown );
+
+    if (last) {
+
+        FanFreeServerPort( serverPort );
+    }
+
+    pthread_rwlock_destroy( &ClientPort->Rundown );
+    free( ClientPort );
+}
+
+//---------------------------------------------------------------------------
+//  MDLs
+//---------------------------------------------------------------------------
+
+PMDL
+IoAllocateMdl (
+    __in_opt PVOID VirtualAddress,
+    __in ULONG Length,
+    __in BOOLEAN SecondaryBuffer,
+    __in BOOLEAN ChargeQuota,
+    __in_opt PVOID Irp
+    )
+/*++
+
+Routine Description:
+
+    Describes a buffer.  Every address is a system address here, so the
+    MDL maps the buffer as it is.
+
+--*/
+{
+    PMDL mdl;
+
+    ASSERT( !SecondaryBuffer && Irp == NULL );
+    UNREFERENCED_PARAMETER( ChargeQuota );
+
+    mdl = ExAllocatePoolWithTag( NonPagedPool, sizeof(MDL), FAN_MDL_TAG );
+
+    if (mdl == NULL) {
+
+        return NULL;
+    }
+
+    mdl->Next = NULL;
+    mdl->Size = sizeof(MDL);
+    mdl->MdlFlags = 0;
+    mdl->MappedSystemVa = VirtualAddress;
+    mdl->StartVa = (PVOID)((ULONG_PTR) VirtualAddress & ~(ULONG_PTR) 0xfff);
+    mdl->ByteOffset = (ULONG)((ULONG_PTR) VirtualAddress & 0xfff);
+    mdl->ByteCount = Length;
+
+    return mdl;
+}
+
+
+VOID
+IoFreeMdl (
+    __in PMDL Mdl
+    )
+{
+    ExFreePoolWithTag( Mdl, FAN_MDL_TAG );
+}
+
+
+VOID
+MmBuildMdlForNonPagedPool (
+    __inout PMDL MemoryDescriptorList
+    )
+{
+    SetFlag( MemoryDescriptorList->MdlFlags, MDL_SOURCE_IS_NONPAGED_POOL | MDL_MAPPED_TO_SYSTEM_VA );
+}
+
+//---------------------------------------------------------------------------
+//  Loading and unloading
+//---------------------------------------------------------------------------
+
+static WCHAR FanRegistryPath[MAX_PATH];
+
+
+NTSTATUS
+FanSimLoad (
+    __in PDRIVER_INITIALIZE DriverEntry,
+    __in PCSTR RegistryPath
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver as the system process, passing it its service key,
+    such as \Registry\Machine\System\CurrentControlSet\Services\fsFilter.
+
+--*/
+{
+    PEPROCESS process = FanThread.Process;
+    UNICODE_STRING registryPath;
+    NTSTATUS status;
+
+    FanEnsureInitialized();
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+    ASSERT( !FanFilter.Registered );
+
+    registryPath.Buffer = FanRegistryPath;
+    registryPath.Length = (USHORT)(FanWidenAscii( FanRegistryPath, MAX_PATH, RegistryPath ) *
+                                   sizeof(WCHAR));
+    registryPath.MaximumLength = sizeof(FanRegistryPath);
+
+    FanThread.Process = NULL;
+
+    status = DriverEntry( &FanDriver, &registryPath );
+
+    FanThread.Process = process;
+
+    return status;
+}
+
+
+NTSTATUS
+FanSimUnload (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Unloads the driver as the system process.  Clients still connected
+    disconnect first, as they would when the service stops, then the
+    filter is asked to unload, and is made to if it refused.  Timers left
+    set stop firing.
+
+Return Value:
+
+    What the filter's unload callback returned.
+
+--*/
+{
+    PEPROCESS process = FanThread.Process;
+    PFLT_PORT port;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    FanEnsureInitialized();
+
+    ASSERT( FanThread.Irql == PASSIVE_LEVEL );
+
+    FanThread.Process = NULL;
+
+    for (;;) {
+
+        pthread_mutex_lock( &FanPortLock );
+
+        port = IsListEmpty( &FanClientPorts ) ?
+               NULL :
+               CONTAINING_RECORD( FanClientPorts.Flink, struct _FLT_PORT, Links );
+
+        pthread_mutex_unlock( &FanPortLock );
+
+        if (port == NULL) {
+
+            break;
+        }
+
+        FanSimDisconnect( port );
+    }
+
+    if (FanFilter.Registered && FanFilter.Registration->FilterUnloadCallback != NULL) {
+
+        status = FanFilter.Registration->FilterUnloadCallback( FLTFL_FILTER_UNLOAD_MANDATORY );
+    }
+
+    if (FanFilter.Registered) {
+
+        FltUnregisterFilter( &FanFilter );
+    }
+
+    FanStopTimers();
+
+    FanThread.Process = process;
+
+    return status;
+}
+
+//---------------------------------------------------------------------------
+//  Accounting
+//---------------------------------------------------------------------------
+
+static
+VOID
+FanPrintName (
+    __in FILE *Stream,
+    __in_ecount(Length / sizeof(WCHAR)) PCWCH Name,
+    __in USHORT Length
+    )
+{
+    USHORT index;
+
+    for (index = 0; index < Length / sizeof(WCHAR); index++) {
+
+        fputc( (Name[index] >= 0x20 && Name[index] < 0x7f) ? (int) Name[index] : '?', Stream );
+    }
+}
+
+
+static
+ULONG
+FanReportReferences (
+    __in FILE *Stream,
+    __in PCSTR What,
+    __in ULONG Id,
+    __in PFAN_OBJECT Object
+    )
+{
+    if (Object->PointerCount == 1) {
+
+        return 0;
+    }
+
+    fprintf( Stream,
+             "leak: %s %u has %d references, expected 1\n",
+             What,
+             Id,
+             (int) Object->PointerCount );
+
+    return (ULONG) abs( (int) Object->PointerCount - 1 );
+}
+
+
+ULONG
+FanSimReportLeaks (
+    __in FILE *Stream
+    )
+/*++
+
+Routine Description:
+
+    Reports what the driver left behind: pool, references on the objects
+    it looked up, handles, open files, timers, resources and ports.  Call
+    it once the driver has unloaded and the test has closed its files.
+
+Return Value:
+
+    How many things leaked; 0 if nothing did.
+
+--*/
+{
+    PLIST_ENTRY entry;
+    PLIST_ENTRY other;
+    PFAN_POOL_HEADER header;
+    PEPROCESS process;
+    PFAN_EVENT event;
+    PFAN_FILE file;
+    ULONG allocations;
+    SIZE_T bytes;
+    ULONG leaks = 0;
+    ULONG count;
+
+    FanEnsureInitialized();
+
+    //
+    //  Pool, by tag.  An allocation is reported with the first of its tag.
+    //
+
+    pthread_mutex_lock( &FanPoolLock );
+
+    for (entry = FanPoolList.Flink; entry != &FanPoolList; entry = entry->Flink) {
+
+        header = CONTAINING_RECORD( entry, FAN_POOL_HEADER, Links );
+
+        for (other = FanPoolList.Flink; other != entry; other = other->Flink) {
+
+            if (CONTAINING_RECORD( other, FAN_POOL_HEADER, Links )->Tag == header->Tag) {
+
+                break;
+            }
+        }
+
+        if (other != entry) {
+
+            continue;
+        }
+
+        for (allocations = 0, bytes = 0; other != &FanPoolList; other = other->Flink) {
+
+            if (CONTAINING_RECORD( other, FAN_POOL_HEADER, Links )->Tag == header->Tag) {
+
+                allocations++;
+                bytes += CONTAINING_RECORD( other, FAN_POOL_HEADER, Links )->Size;
+            }
+        }
+
+        fprintf( Stream,
+                 "leak: %u pool allocations, %zu bytes, tagged '%.4s'\n",
+                 allocations,
+                 bytes,
+                 (PCSTR) &header->Tag );
+
+        leaks += allocations;
+    }
+
+    if (FanPoolStatistics.TagMismatches > 0) {
+
+        fprintf( Stream, "leak: %u pool frees with the wrong tag\n", FanPoolStatistics.TagMismatches );
+        leaks += FanPoolStatistics.TagMismatches;
+    }
+
+    pthread_mutex_unlock( &FanPoolLock );
+
+    //
+    //  References on processes, their threads and tokens, the devices and
+    //  the driver, and events.  Every one of them holds one of its own.
+    //
+
+    pthread_mutex_lock( &FanProcessLock );
+
+    for (entry = FanProcessList.Flink; entry != &FanProcessList; entry = entry->Flink) {
+
+        process = CONTAINING_RECORD( entry, struct _KPROCESS, Links );
+
+        leaks += FanReportReferences( Stream, "process", process->ProcessId, &process->Header );
+        leaks += FanReportReferences( Stream, "thread", process->Thread.ThreadId, &process->Thread.Header );
+        leaks += FanReportReferences( Stream, "token of process", process->ProcessId, &process->Token->Header );
+    }
+
+    pthread_mutex_unlock( &FanProcessLock );
+
+    leaks += FanReportReferences( Stream, "volume device", 0, &FanVolumeDevice.Header );
+    leaks += FanReportReferences( Stream, "disk device", 0, &FanDiskDevice.Header );
+    leaks += FanReportReferences( Stream, "driver object", 0, &FanDriver.Header );
+
+    pthread_mutex_lock( &FanEventLock );
+
+    count = 0;
+
+    for (entry = FanEventList.Flink; entry != &FanEventList; entry = entry->Flink) {
+
+        event = CONTAINING_RECORD( entry, FAN_EVENT, Links );
+        leaks += FanReportReferences( Stream, "event", count++, &event->Header );
+    }
+
+    pthread_mutex_unlock( &FanEventLock );
+
+    //
+    //  Handles, files, timers, resources and ports.
+    //
+
+    if (FanKeyHandles != 0) {
+
+        fprintf( Stream, "leak: %d registry key handles open\n", (int) FanKeyHandles );
+        leaks += (ULONG) abs( (int) FanKeyHandles );
+    }
+
+    pthread_mutex_lock( &FanVolumeLock );
+
+    for (entry = FanOpenFiles.Flink; entry != &FanOpenFiles; entry = entry->Flink) {
+
+        file = CONTAINING_RECORD( entry, FAN_FILE, Links );
+
+        fprintf( Stream, "leak: file object open on " );
+        FanPrintName( Stream, file->Node->Name, file->Node->NameLength );
+        fprintf( Stream, "\n" );
+        leaks++;
+    }
+
+    pthread_mutex_unlock( &FanVolumeLock );
+
+    pthread_mutex_lock( &FanTimerLock );
+
+    for (count = 0, entry = FanTimerList.Flink; entry != &FanTimerList; entry = entry->Flink) {
+
+        count++;
+    }
+
+    pthread_mutex_unlock( &FanTimerLock );
+
+    if (count > 0) {
+
+        fprintf( Stream, "leak: %u timers still set\n", count );
+        leaks += count;
+    }
+
+    if (FanResourcesInUse != 0) {
+
+        fprintf( Stream, "leak: %d resources not deleted\n", (int) FanResourcesInUse );
+        leaks += (ULONG) abs( (int) FanResourcesInUse );
+    }
+
+    pthread_mutex_lock( &FanPortLock );
+
+    for (count = 0, entry = FanServerPorts.Flink; entry != &FanServerPorts; entry = entry->Flink) {
+
+        count++;
+    }
+
+    for (entry = FanClientPorts.Flink; entry != &FanClientPorts; entry = entry->Flink) {
+
+        count++;
+    }
+
+    pthread_mutex_unlock( &FanPortLock );
+
+    if (count > 0) {
+
+        fprintf( Stream, "leak: %u communication ports still open\n", count );
+        leaks += count;
+    }
+
+    if (FanFilter.Registered) {
+
+        fprintf( Stream, "leak: the filter is still registered\n" );
+        leaks++;
+    }
+
+    return leaks;
+}
+
+//---------------------------------------------------------------------------
+//  Initialization
+//---------------------------------------------------------------------------
+
+static
+VOID
+FanInitialize (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Starts the system: the system process and an empty volume.
+
+--*/
+{
+    pthread_condattr_t attributes;
+    WCHAR root = '\\';
+    ULONG bucket;
+    NTSTATUS status;
+
+    pthread_condattr_init( &attributes );
+    pthread_condattr_setclock( &attributes, CLOCK_MONOTONIC );
+    pthread_cond_init( &FanTimerWake, &attributes );
+    pthread_condattr_destroy( &attributes );
+
+    FanVolumeNameLength = (USHORT)(FanWidenAscii( FanVolumeName,
+                                                  sizeof(FanVolumeName) / sizeof(WCHAR),
+                                                  FAN_SIM_VOLUME_NAME ) * sizeof(WCHAR));
+
+    status = FanAddProcess( FAN_SIM_SYSTEM_PROCESS, "\\Windows\\System32\\ntoskrnl.exe", "S-1-5-18" );
+    ASSERT( NT_SUCCESS( status ) );
+    UNREFERENCED_PARAMETER( status );
+
+    pthread_mutex_lock( &FanProcessLock );
+    FanSystemProcess = FanFindProcess( FAN_SIM_SYSTEM_PROCESS );
+    pthread_mutex_unlock( &FanProcessLock );
+
+    for (bucket = 0; bucket < FAN_NODE_BUCKETS; bucket++) {
+
+        InitializeListHead( &FanNodeBuckets[bucket] );
+    }
+
+    pthread_mutex_lock( &FanVolumeLock );
+    FanInsertNode( &root, sizeof(root), TRUE );
+    pthread_mutex_unlock( &FanVolumeLock );
+}
@@ -0,0 +1,681 @@
+/*++
+
+Module Name:
+
+    fanSim.c
+
+Abstract:
+
+    Runs the driver, built from its own unmodified sources against
+    fanShim.c, through a day on one volume and checks what it did.
+
+    The system process lays out the volume before the driver loads: a
+    protected folder holding one file, and a public folder.  The registry
+    names the protected folder and the one image allowed into it.  Once
+    the driver is loaded a consumer connects to its port the way minispy
+    does, and two processes - the allowed image and another one - open,
+    read, write, rename and delete files in and out of the protected
+    folder.  Every operation goes down through the driver's pre- and
+    post-operation callbacks.
+
+    Each operation's status is checked against what the policy allows,
+    then the consumer pulls the log with GetMiniSpyLog and
+    AckMiniSpyLog, decodes it with ../userdll/mspyDecode.c and checks the
+    denials and the protected-folder writes, renames and deletes it holds.
+    Last the driver is unloaded and whatever it left behind is reported.
+
+    With -v each decoded record is printed as well.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fanSim.h"
+#include "mspyDecode.h"
+
+DRIVER_INITIALIZE DriverEntry;
+
+#define SIM_SERVICE_KEY     "\\Registry\\Machine\\System\\CurrentControlSet\\Services\\fsFilter"
+
+//
+//  The processes.  Only the first one's image is allowed into the
+//  protected folder.
+//
+
+#define SIM_ALLOWED         100
+#define SIM_DENIED          200
+#define SIM_CONSUMER        300
+
+#define SIM_IO_SIZE         4096
+#define SIM_LOG_SIZE        (64 * 1024)
+
+static ULONG Failures;
+static BOOLEAN Verbose;
+
+//
+//  A file SIM_DENIED opened for writing before the driver loaded.
+//
+
+static PFILE_OBJECT EarlyObject;
+
+#define CHECK(Condition)                                                \
+    ((Condition) ? (void) 0 :                                           \
+     (void) (Failures++, fprintf( stderr, "%s:%d: %s\n",                \
+                                  __FILE__, __LINE__, #Condition )))
+
+#define CHECK_STATUS(Call, Expected)                                    \
+    do {                                                                \
+        NTSTATUS _status = (Call);                                      \
+        if (_status != (NTSTATUS)(Expected)) {                          \
+            Failures++;                                                 \
+            fprintf( stderr, "%s:%d: %s returned %08x, not %08x\n",     \
+                     __FILE__, __LINE__, #Call,                         \
+                     (unsigned) _status, (unsigned)(Expected) );        \
+        }                                                               \
+    } while (0)
+
+//
+//  What the log should hold once the scenario has run.
+//
+
+typedef struct _SIM_EXPECTED {
+
+    //
+    //  Denials, all by SIM_DENIED, by the access denied.
+    //
+
+    ULONG DeniedCreates;
+    ULONG DeniedWrites;
+    ULONG DeniedRenames;
+
+    //
+    //  Allowed operations in the protected folder, all by SIM_ALLOWED.
+    //  Writes to one file may be coalesced into one record, so it is the
+    //  files written that are counted.
+    //
+
+    ULONG FilesWritten;
+    ULONG Renames;
+    ULONG Deletes;
+
+} SIM_EXPECTED, *PSIM_EXPECTED;
+
+typedef struct _SIM_SEEN {
+
+    ULONG Records;
+    ULONG Denials[256];
+    ULONG DeniedByOthers;
+    ULONG Writes;
+    ULONG Renames;
+    ULONG Deletes;
+    ULONG AccessesByOthers;
+    ULONG Gaps;
+
+} SIM_SEEN, *PSIM_SEEN;
+
+
+//---------------------------------------------------------------------------
+//  The scenario
+//---------------------------------------------------------------------------
+
+static PFILE_OBJECT
+SimCreate (
+    __in PCSTR FileName,
+    __in ACCESS_MASK DesiredAccess,
+    __in ULONG CreateDisposition,
+    __in NTSTATUS Expected
+    )
+/*++
+
+Routine Description:
+
+    Opens or creates FileName and checks the status.
+
+Return Value:
+
+    The file object when the create succeeded, NULL otherwise.
+
+--*/
+{
+    PFILE_OBJECT fileObject = NULL;
+    NTSTATUS status;
+
+    status = FanSimCreateFile( FileName,
+                               DesiredAccess,
+                               CreateDisposition,
+                               FILE_NON_DIRECTORY_FILE,
+                               &fileObject,
+                               NULL );
+
+    if (status != Expected) {
+
+        Failures++;
+        fprintf( stderr, "create %s: %08x, not %08x\n",
+                 FileName, (unsigned) status, (unsigned) Expected );
+    }
+
+    return NT_SUCCESS( status ) ? fileObject : NULL;
+}
+
+
+static VOID
+SimPrepareVolume (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Lays the volume out as the system process, before the driver loads.
+
+--*/
+{
+    static UCHAR data[SIM_IO_SIZE];
+    PFILE_OBJECT fileObject;
+
+    CHECK_STATUS( FanSimSetProcess( FAN_SIM_SYSTEM_PROCESS ), STATUS_SUCCESS );
+
+    CHECK_STATUS( FanSimCreateFile( "\\protected", FILE_LIST_DIRECTORY, FILE_CREATE,
+                                    FILE_DIRECTORY_FILE, &fileObject, NULL ),
+                  STATUS_SUCCESS );
+    FanSimCloseFile( fileObject );
+
+    CHECK_STATUS( FanSimCreateFile( "\\public", FILE_LIST_DIRECTORY, FILE_CREATE,
+                                    FILE_DIRECTORY_FILE, &fileObject, NULL ),
+                  STATUS_SUCCESS );
+    FanSimCloseFile( fileObject );
+
+    fileObject = SimCreate( "\\protected\\old.txt", FILE_GENERIC_WRITE, FILE_CREATE, STATUS_SUCCESS );
+
+    if (fileObject != NULL) {
+
+        CHECK_STATUS( FanSimWrite( fileObject, 0, data, sizeof(data), NULL ), STATUS_SUCCESS );
+        FanSimCloseFile( fileObject );
+    }
+
+    //
+    //  Nothing stops the other image from opening the protected file
+    //  before the driver is there, but the driver still stops it writing.
+    //
+
+    CHECK_STATUS( FanSimSetProcess( SIM_DENIED ), STATUS_SUCCESS );
+
+    EarlyObject = SimCreate( "\\protected\\old.txt", FILE_GENERIC_WRITE, FILE_OPEN, STATUS_SUCCESS );
+
+    CHECK_STATUS( FanSimSetProcess( FAN_SIM_SYSTEM_PROCESS ), STATUS_SUCCESS );
+}
+
+
+static VOID
+SimAllowed (
+    __inout PSIM_EXPECTED Expected
+    )
+/*++
+
+Routine Description:
+
+    The allowed image works in the protected folder: everything it does
+    succeeds, and its writes are logged.
+
+--*/
+{
+    UCHAR buffer[SIM_IO_SIZE];
+    PFILE_OBJECT fileObject;
+    ULONG_PTR information;
+    ULONG i;
+
+    CHECK_STATUS( FanSimSetProcess( SIM_ALLOWED ), STATUS_SUCCESS );
+
+    //
+    //  Read the file the system left, then write a new one and read it
+    //  back.
+    //
+
+    fileObject = SimCreate( "\\protected\\old.txt", FILE_GENERIC_READ, FILE_OPEN, STATUS_SUCCESS );
+
+    if (fileObject != NULL) {
+
+        CHECK_STATUS( FanSimRead( fileObject, 0, buffer, sizeof(buffer), &information ),
+                      STATUS_SUCCESS );
+        CHECK( information == sizeof(buffer) );
+        FanSimCloseFile( fileObject );
+    }
+
+    fileObject = SimCreate( "\\protected\\a.txt",
+                            FILE_GENERIC_READ | FILE_GENERIC_WRITE | DELETE,
+                            FILE_CREATE,
+                            STATUS_SUCCESS );
+
+    if (fileObject != NULL) {
+
+        memset( buffer, 'a', sizeof(buffer) );
+
+        for (i = 0; i < 4; i += 1) {
+
+            CHECK_STATUS( FanSimWrite( fileObject, FAN_SIM_CURRENT_OFFSET, buffer, sizeof(buffer), &information ),
+                          STATUS_SUCCESS );
+            CHECK( information == sizeof(buffer) );
+        }
+
+        Expected->FilesWritten += 1;
+
+        CHECK_STATUS( FanSimRead( fileObject, 3 * sizeof(buffer), buffer, sizeof(buffer), &information ),
+                      STATUS_SUCCESS );
+        CHECK( information == sizeof(buffer) );
+
+        CHECK_STATUS( FanSimRename( fileObject, "\\protected\\b.txt", FALSE ), STATUS_SUCCESS );
+        Expected->Renames += 1;
+        FanSimCloseFile( fileObject );
+    }
+
+    //
+    //  The renamed file is found under its new name only.
+    //
+
+    SimCreate( "\\protected\\a.txt", FILE_GENERIC_READ, FILE_OPEN, STATUS_OBJECT_NAME_NOT_FOUND );
+
+    fileObject = SimCreate( "\\protected\\b.txt", DELETE, FILE_OPEN, STATUS_SUCCESS );
+
+    if (fileObject != NULL) {
+
+        CHECK_STATUS( FanSimDelete( fileObject ), STATUS_SUCCESS );
+        Expected->Deletes += 1;
+        FanSimCloseFile( fileObject );
+    }
+
+    SimCreate( "\\protected\\b.txt", FILE_GENERIC_READ, FILE_OPEN, STATUS_OBJECT_NAME_NOT_FOUND );
+
+    //
+    //  Overwriting an existing file goes through JudgeFileExist, which
+    //  opens the file again from inside the driver.
+    //
+
+    fileObject = SimCreate( "\\protected\\old.txt", FILE_GENERIC_WRITE, FILE_OVERWRITE_IF, STATUS_SUCCESS );
+
+    if (fileObject != NULL) {
+
+        memset( buffer, 'o', sizeof(buffer) );
+
+        CHECK_STATUS( FanSimWrite( fileObject, 0, buffer, 16, NULL ), STATUS_SUCCESS );
+        Expected->FilesWritten += 1;
+        FanSimCloseFile( fileObject );
+    }
+}
+
+
+static VOID
+SimDenied (
+    __inout PSIM_EXPECTED Expected
+    )
+/*++
+
+Routine Description:
+
+    Any other image is kept out of the protected folder but works
+    outside it as it likes.
+
+--*/
+{
+    UCHAR buffer[SIM_IO_SIZE];
+    PFILE_OBJECT fileObject;
+    PFILE_OBJECT publicObject;
+    ULONG_PTR information;
+
+    CHECK_STATUS( FanSimSetProcess( SIM_DENIED ), STATUS_SUCCESS );
+
+    memset( buffer, 'b', sizeof(buffer) );
+
+    //
+    //  Inside the protected folder nothing is allowed, not even opening
+    //  a file to read it.  Every open is logged as a denied create.
+    //
+
+    SimCreate( "\\protected\\old.txt", FILE_GENERIC_READ, FILE_OPEN, STATUS_ACCESS_DENIED );
+    Expected->DeniedCreates += 1;
+
+    SimCreate( "\\protected\\c.txt", FILE_GENERIC_WRITE, FILE_CREATE, STATUS_ACCESS_DENIED );
+    Expected->DeniedCreates += 1;
+
+    SimCreate( "\\protected\\old.txt", DELETE, FILE_OPEN, STATUS_ACCESS_DENIED );
+    Expected->DeniedCreates += 1;
+
+    if (EarlyObject != NULL) {
+
+        CHECK_STATUS( FanSimWrite( EarlyObject, 0, buffer, sizeof(buffer), NULL ), STATUS_ACCESS_DENIED );
+        Expected->DeniedWrites += 1;
+
+        FanSimCloseFile( EarlyObject );
+        EarlyObject = NULL;
+    }
+
+    //
+    //  Outside it everything is.
+    //
+
+    publicObject = SimCreate( "\\public\\c.txt",
+                              FILE_GENERIC_READ | FILE_GENERIC_WRITE | DELETE,
+                              FILE_CREATE,
+                              STATUS_SUCCESS );
+
+    if (publicObject != NULL) {
+
+        CHECK_STATUS( FanSimWrite( publicObject, 0, buffer, sizeof(buffer), &information ),
+                      STATUS_SUCCESS );
+        CHECK( information == sizeof(buffer) );
+
+        CHECK_STATUS( FanSimRead( publicObject, 0, buffer, sizeof(buffer), &information ),
+                      STATUS_SUCCESS );
+        CHECK( information == sizeof(buffer) );
+
+        CHECK_STATUS( FanSimRename( publicObject, "\\public\\d.txt", FALSE ), STATUS_SUCCESS );
+
+        //
+        //  But a file may not be moved into the protected folder.
+        //
+
+        CHECK_STATUS( FanSimRename( publicObject, "\\protected\\d.txt", FALSE ), STATUS_ACCESS_DENIED );
+        Expected->DeniedRenames += 1;
+
+        CHECK_STATUS( FanSimDelete( publicObject ), STATUS_SUCCESS );
+        FanSimCloseFile( publicObject );
+    }
+
+    SimCreate( "\\public\\d.txt", FILE_GENERIC_READ, FILE_OPEN, STATUS_OBJECT_NAME_NOT_FOUND );
+
+    //
+    //  The protected file is still there, untouched by any of it.
+    //
+
+    CHECK_STATUS( FanSimSetProcess( SIM_ALLOWED ), STATUS_SUCCESS );
+
+    fileObject = SimCreate( "\\protected\\old.txt", FILE_GENERIC_READ, FILE_OPEN, STATUS_SUCCESS );
+
+    if (fileObject != NULL) {
+
+        FanSimCloseFile( fileObject );
+    }
+}
+
+
+//---------------------------------------------------------------------------
+//  The consumer
+//---------------------------------------------------------------------------
+
+static VOID
+SimCount (
+    __in PMSPY_BATCH Batch,
+    __inout PSIM_SEEN Seen,
+    __inout PMINISPY_ACK Ack
+    )
+{
+    PMSPY_BATCH_RECORD record;
+    BOOLEAN byAllowed;
+    ULONG lane;
+    ULONG i;
+
+    for (i = 0; i < Batch->Count; i += 1) {
+
+        record = &Batch->Records[i];
+        Seen->Records += 1;
+
+        lane = (record->RecordType & RECORD_TYPE_FLAG_PRIORITY) ? LOG_QUEUES : record->Processor;
+
+        if (lane < ACK_LANES) {
+
+            Ack->Sequence[lane] = record->SequenceNumber;
+        }
+
+        if (Verbose) {
+
+            printf( "  %c%c %4llu %02x.%02x %.*s\n",
+                    record->AccessType ? record->AccessType : '-',
+                    record->DeniedAccess ? record->DeniedAccess : ' ',
+                    (unsigned long long) record->ProcessId,
+                    record->CallbackMajorId,
+                    record->CallbackMinorId,
+                    (int) record->FileName.Length,
+                    (const char *) record->FileName.Buffer );
+        }
+
+        if ((record->RecordType & ~RECORD_TYPE_FLAG_MASK) == RECORD_TYPE_GAP) {
+
+            Seen->Gaps += 1;
+            continue;
+        }
+
+        byAllowed = (record->ProcessId == SIM_ALLOWED);
+
+        if (record->AccessType == 'A') {
+
+            if (record->ProcessId == SIM_DENIED) {
+
+                Seen->Denials[(UCHAR) record->DeniedAccess] += 1;
+
+            } else {
+
+                Seen->DeniedByOthers += 1;
+            }
+
+        } else if (record->AccessType != 0) {
+
+            if (!byAllowed) {
+
+                Seen->AccessesByOthers += 1;
+
+            } else if (record->CallbackMajorId == IRP_MJ_WRITE) {
+
+                //
+                //  SpyLogPostOperationData tests Create.Options for
+                //  FILE_DELETE_ON_CLOSE whatever the operation, and for a
+                //  write that is the low part of the ByteOffset, so a
+                //  write whose offset has 0x1000 set is logged as 'D'.
+                //  Count writes by the operation instead.
+                //
+
+                Seen->Writes += 1;
+
+            } else if (record->AccessType == 'R') {
+
+                Seen->Renames += 1;
+
+            } else if (record->AccessType == 'D' || record->AccessType == 'd') {
+
+                Seen->Deletes += 1;
+            }
+        }
+    }
+}
+
+
+static VOID
+SimConsume (
+    __in PFLT_PORT Port,
+    __out PSIM_SEEN Seen
+    )
+/*++
+
+Routine Description:
+
+    Drains the log as minispy does: GetMiniSpyLog first, then
+    AckMiniSpyLog for each batch, which returns the next one, until a
+    reply comes back empty.
+
+--*/
+{
+    static PVOID buffer[SIM_LOG_SIZE / sizeof(PVOID)];
+    UCHAR message[FIELD_OFFSET(COMMAND_MESSAGE, Data) + sizeof(MINISPY_ACK)];
+    PCOMMAND_MESSAGE command = (PCOMMAND_MESSAGE) message;
+    MINISPY_ACK ack;
+    MSPY_BATCH batch;
+    ULONG returned;
+    ULONG rounds;
+    NTSTATUS status;
+
+    memset( Seen, 0, sizeof(*Seen) );
+    memset( &batch, 0, sizeof(batch) );
+    memset( &ack, 0, sizeof(ack) );
+
+    memset( message, 0, sizeof(message) );
+    command->Command = GetMiniSpyLog;
+
+    status = FanSimSendMessage( Port,
+                                command,
+                                FIELD_OFFSET(COMMAND_MESSAGE, Data),
+                                buffer,
+                                sizeof(buffer),
+                                &returned );
+
+    for (rounds = 0; rounds < 1000; rounds += 1) {
+
+        if (status == STATUS_NO_MORE_ENTRIES) {
+
+            break;
+        }
+
+        if (!NT_SUCCESS( status )) {
+
+            Failures++;
+            fprintf( stderr, "reading the log: %08x\n", (unsigned) status );
+            break;
+        }
+
+        if (returned == 0) {
+
+            break;
+        }
+
+        CHECK( MspyDecodeBatch( buffer, returned, MSPY_FIELD_ALL, MspyEncodingUtf8, NULL, &batch ) );
+        SimCount( &batch, Seen, &ack );
+
+        command->Command = AckMiniSpyLog;
+        memcpy( command->Data, &ack, sizeof(ack) );
+
+        status = FanSimSendMessage( Port,
+                                    command,
+                                    sizeof(message),
+                                    buffer,
+                                    sizeof(buffer),
+                                    &returned );
+    }
+
+    CHECK( rounds < 1000 );
+
+    MspyResetBatch( &batch );
+}
+
+
+//---------------------------------------------------------------------------
+//  Main
+//---------------------------------------------------------------------------
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    FAN_SIM_POOL_STATISTICS pool;
+    SIM_EXPECTED expected;
+    SIM_SEEN seen;
+    MINISPY_CONNECT connect;
+    PFLT_PORT port = NULL;
+    ULONG leaks;
+
+    Verbose = (argc > 1 && strcmp( argv[1], "-v" ) == 0);
+
+    memset( &expected, 0, sizeof(expected) );
+
+    CHECK_STATUS( FanSimAddProcess( SIM_ALLOWED, "\\Program Files\\App\\a.exe", "S-1-5-21-1-1001" ),
+                  STATUS_SUCCESS );
+    CHECK_STATUS( FanSimAddProcess( SIM_DENIED, "\\Windows\\b.exe", "S-1-5-21-1-1002" ),
+                  STATUS_SUCCESS );
+    CHECK_STATUS( FanSimAddProcess( SIM_CONSUMER, "\\Windows\\minispy.exe", "S-1-5-21-1-500" ),
+                  STATUS_SUCCESS );
+
+    FanSimSetRegistryString( SIM_SERVICE_KEY,
+                             "ProtectedDir",
+                             FAN_SIM_VOLUME_NAME "\\protected\\" );
+    FanSimSetRegistryString( SIM_SERVICE_KEY, "OpenProccess", "a.exe" );
+
+    SimPrepareVolume();
+
+    CHECK_STATUS( FanSimLoad( DriverEntry, SIM_SERVICE_KEY ), STATUS_SUCCESS );
+
+    CHECK_STATUS( FanSimSetProcess( SIM_CONSUMER ), STATUS_SUCCESS );
+
+    connect.SubscriberId = 0;
+    CHECK_STATUS( FanSimConnect( "\\MiniSpyPort", &connect, sizeof(connect), &port ),
+                  STATUS_SUCCESS );
+
+    SimAllowed( &expected );
+    SimDenied( &expected );
+
+    CHECK_STATUS( FanSimSetProcess( SIM_CONSUMER ), STATUS_SUCCESS );
+
+    if (port != NULL) {
+
+        SimConsume( port, &seen );
+
+        printf( "fanSim: %u records, %u denials, %u writes, %u renames and %u deletes in the protected folder\n",
+                seen.Records,
+                seen.Denials['C'] + seen.Denials['W'] + seen.Denials['R'] +
+                    seen.Denials['D'] + seen.Denials['S'],
+                seen.Writes,
+                seen.Renames,
+                seen.Deletes );
+
+        CHECK( seen.Gaps == 0 );
+        CHECK( seen.DeniedByOthers == 0 );
+        CHECK( seen.AccessesByOthers == 0 );
+        CHECK( seen.Denials['C'] == expected.DeniedCreates );
+        CHECK( seen.Denials['W'] == expected.DeniedWrites );
+        CHECK( seen.Denials['R'] == expected.DeniedRenames );
+        CHECK( seen.Denials['D'] + seen.Denials['S'] == 0 );
+        CHECK( seen.Writes >= expected.FilesWritten );
+        CHECK( seen.Renames == expected.Renames );
+        CHECK( seen.Deletes == expected.Deletes );
+
+        FanSimDisconnect( port );
+    }
+
+    CHECK_STATUS( FanSimSetProcess( FAN_SIM_SYSTEM_PROCESS ), STATUS_SUCCESS );
+    CHECK_STATUS( FanSimUnload(), STATUS_SUCCESS );
+
+    FanSimPoolStatistics( &pool );
+
+    printf( "fanSim: pool peak %zu bytes in %u allocations, %llu allocations in all\n",
+            (size_t) pool.PeakBytesInUse,
+            pool.PeakAllocationsInUse,
+            (unsigned long long) pool.Allocations );
+
+    //
+    //  Some of what the driver leaves behind it always has, and that is
+    //  reported, not failed: Process.c opens a handle to each process it
+    //  asks the image name of and never closes it, and FilterUnload frees
+    //  neither the settings read from the registry nor the registry path.
+    //  Any other pool left behind fails.
+    //
+
+    leaks = FanSimReportLeaks( stdout );
+
+    CHECK( pool.TagMismatches == 0 );
+    CHECK( pool.AllocationsInUse == FanSimPoolInUse( 'RID_' ) +
+                                    FanSimPoolInUse( 'CRP_' ) +
+                                    FanSimPoolInUse( 'GER_' ) +
+                                    FanSimPoolInUse( 'exe_' ) );
+
+    if (Failures != 0) {
+
+        printf( "fanSim: %u checks failed\n", Failures );
+        return 1;
+    }
+
+    printf( "fanSim: passed, %u leaks reported\n", leaks );
+    return 0;
+}
@@ -0,0 +1,305 @@
+/*++
+
+Module Name:
+
+    fanSim.h
+
+Abstract:
+
+    Header file which contains the structures, type definitions, constants
+    and function prototypes of the simulated system fanShim.c runs the
+    driver in.
+
+    fanSim builds the driver's own sources, ../filter/fsFilter.c down to
+    mspy*.c, against shim/fltKernel.h, and fanShim.c is the kernel and the
+    filter manager beneath them: pool with leak accounting, lookaside
+    lists, spin locks, resources, timers whose DPCs run on a thread of
+    their own, processes with tokens, a registry, communication ports and
+    one NTFS-like volume, \Device\HarddiskVolume1 or C:, whose files live
+    in memory.
+
+    The routines here are what the test drives it with.  They stand in
+    for what a user process does - opening, reading, writing, renaming
+    and deleting files, and connecting to the driver's port as minispy
+    does - and for what the system does around the driver - loading and
+    unloading it, and which process and processor a thread runs as.
+
+    Each operation goes down through the filter manager as an I/O would:
+    the driver's pre-operation callback sees the callback data first, the
+    file system performs what is left of the operation, and the post-
+    operation callback sees it complete.  Operations are synchronous and
+    start at PASSIVE_LEVEL on the calling thread, so any number of threads
+    may drive the volume at once.
+
+    What the simulation leaves out: share access, oplocks, fast I/O, the
+    cache manager and paging I/O, file data (reads return a pattern),
+    pended operations and more than one filter or volume.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+#ifndef __FANSIM_H__
+#define __FANSIM_H__
+
+#include <stdio.h>
+
+#include "fltKernel.h"
+
+//
+//  The volume's device name and the drive letter it is mounted on.
+//  Names passed to the routines below are relative to the volume, such
+//  as "\protected\a.txt".
+//
+
+#define FAN_SIM_VOLUME_NAME         "\\Device\\HarddiskVolume1"
+#define FAN_SIM_DOS_NAME            "C:"
+
+//
+//  The process a thread runs as until it says otherwise.
+//
+
+#define FAN_SIM_SYSTEM_PROCESS      4
+
+typedef struct _FAN_SIM_POOL_STATISTICS {
+
+    //
+    //  Pool in use now and at most, in bytes and in allocations.
+    //
+
+    SIZE_T BytesInUse;
+    SIZE_T PeakBytesInUse;
+    ULONG AllocationsInUse;
+    ULONG PeakAllocationsInUse;
+
+    //
+    //  Totals since the process started.  Failed counts the allocations
+    //  FanSimFailPoolAllocations made fail.
+    //
+
+    ULONGLONG Allocations;
+    ULONGLONG Frees;
+    ULONGLONG Failed;
+
+    //
+    //  Frees whose tag did not match the allocation's.
+    //
+
+    ULONG TagMismatches;
+
+    //
+    //  Lookaside allocations that handed a processor pool from another
+    //  node, which every access to it then has to reach across to.
+    //
+
+    ULONGLONG RemoteAllocations;
+
+} FAN_SIM_POOL_STATISTICS, *PFAN_SIM_POOL_STATISTICS;
+
+//
+//  Processes and processors
+//
+
+NTSTATUS
+FanSimAddProcess (
+    __in ULONG ProcessId,
+    __in PCSTR ImageName,
+    __in PCSTR UserSid
+    );
+
+NTSTATUS
+FanSimAddGroup (
+    __in ULONG ProcessId,
+    __in PCSTR GroupSid,
+    __in ULONG Attributes
+    );
+
+NTSTATUS
+FanSimSetProcess (
+    __in ULONG ProcessId
+    );
+
+VOID
+FanSimSetProcessor (
+    __in ULONG Processor
+    );
+
+//
+//  Groups the processors into NUMA nodes of ProcessorsPerNode each, 0
+//  for one node.  Pool is allocated from the node of the processor that
+//  asks for it.
+//
+
+VOID
+FanSimSetNodeSize (
+    __in ULONG ProcessorsPerNode
+    );
+
+//
+//  Registry
+//
+
+VOID
+FanSimSetRegistryString (
+    __in PCSTR KeyName,
+    __in PCSTR ValueName,
+    __in PCSTR Value
+    );
+
+VOID
+FanSimSetRegistryDword (
+    __in PCSTR KeyName,
+    __in PCSTR ValueName,
+    __in ULONG Value
+    );
+
+//
+//  Loading and unloading
+//
+
+NTSTATUS
+FanSimLoad (
+    __in PDRIVER_INITIALIZE DriverEntry,
+    __in PCSTR RegistryPath
+    );
+
+NTSTATUS
+FanSimUnload (
+    VOID
+    );
+
+//
+//  File operations
+//
+
+NTSTATUS
+FanSimCreateFile (
+    __in PCSTR FileName,
+    __in ACCESS_MASK DesiredAccess,
+    __in ULONG CreateDisposition,
+    __in ULONG CreateOptions,
+    __deref_out PFILE_OBJECT *FileObject,
+    __out_opt PULONG_PTR Information
+    );
+
+NTSTATUS
+FanSimRead (
+    __in PFILE_OBJECT FileObject,
+    __in LONGLONG ByteOffset,
+    __out_bcount(Length) PVOID Buffer,
+    __in ULONG Length,
+    __out_opt PULONG_PTR BytesRead
+    );
+
+NTSTATUS
+FanSimWrite (
+    __in PFILE_OBJECT FileObject,
+    __in LONGLONG ByteOffset,
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length,
+    __out_opt PULONG_PTR BytesWritten
+    );
+
+NTSTATUS
+FanSimSetInformation (
+    __in PFILE_OBJECT FileObject,
+    __in FILE_INFORMATION_CLASS FileInformationClass,
+    __in_bcount(Length) PVOID FileInformation,
+    __in ULONG Length
+    );
+
+NTSTATUS
+FanSimRename (
+    __in PFILE_OBJECT FileObject,
+    __in PCSTR NewName,
+    __in BOOLEAN ReplaceIfExists
+    );
+
+NTSTATUS
+FanSimDelete (
+    __in PFILE_OBJECT FileObject
+    );
+
+VOID
+FanSimCloseFile (
+    __in PFILE_OBJECT FileObject
+    );
+
+//
+//  A negative ByteOffset reads or writes at the file pointer.
+//
+
+#define FAN_SIM_CURRENT_OFFSET      (-1LL)
+
+//
+//  Communication ports
+//
+
+NTSTATUS
+FanSimConnect (
+    __in PCSTR PortName,
+    __in_bcount_opt(ContextSize) PVOID Context,
+    __in ULONG ContextSize,
+    __deref_out PFLT_PORT *ClientPort
+    );
+
+NTSTATUS
+FanSimSendMessage (
+    __in PFLT_PORT ClientPort,
+    __in_bcount_opt(InputLength) PVOID InputBuffer,
+    __in ULONG InputLength,
+    __out_bcount_part_opt(OutputLength,*ReturnedLength) PVOID OutputBuffer,
+    __in ULONG OutputLength,
+    __out PULONG ReturnedLength
+    );
+
+VOID
+FanSimDisconnect (
+    __in PFLT_PORT ClientPort
+    );
+
+//
+//  System conditions and accounting
+//
+
+VOID
+FanSimSetLowMemory (
+    __in BOOLEAN LowMemory
+    );
+
+VOID
+FanSimFailPoolAllocations (
+    __in ULONG Every
+    );
+
+//
+//  Makes FanSimFailPoolAllocations fail only allocations with Tag, or
+//  any allocation if Tag is 0.
+//
+
+VOID
+FanSimFailPoolTag (
+    __in ULONG Tag
+    );
+
+VOID
+FanSimPoolStatistics (
+    __out PFAN_SIM_POOL_STATISTICS Statistics
+    );
+
+//
+//  How many allocations with Tag are in use.
+//
+
+ULONG
+FanSimPoolInUse (
+    __in ULONG Tag
+    );
+
+ULONG
+FanSimReportLeaks (
+    __in FILE *Stream
+    );
+
+#endif //__FANSIM_H__
@@ -0,0 +1,179 @@
+/*++
+
+Module Name:
+
+    fanVerdict.c
+
+Abstract:
+
+    This module remembers the files that are not protected, so that the
+    reads of them are let through without looking up the file's name each
+    time.
+
+    fanotify hands every event a new descriptor, so there is no handle to
+    key on; the file itself, its device and inode as fstat gives them, is
+    the key.  The table has
+    FAN_VERDICT_SLOTS slots, with the slot picked by the key, and the
+    slots are shared out among FAN_VERDICT_LOCKS locks so that a lookup
+    compares the whole key under one.  Only the verdict that the file is
+    not protected is kept: whether a protected file may be read depends on
+    the process.
+
+    A rename anywhere may move a file into a protected folder, and so may
+    a new policy; either one forgets the whole table by bumping
+    VerdictGeneration.  A verdict is only remembered with the generation
+    read before the file's name was, so a verdict worked out across a bump
+    is never found.  Renames are only seen through the notifications, so
+    without them nothing is remembered at all.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include "fanFilter.h"
+
+#define FanVerdictHash(_dev, _ino) \
+    ((ULONG)(((ULONGLONG)(_ino) * 0x9E3779B97F4A7C15ULL + (ULONGLONG)(_dev)) >> 40))
+
+#define FanVerdictSlot(_hash)   (&FanData.Verdicts[(_hash) & (FAN_VERDICT_SLOTS - 1)])
+#define FanVerdictLock(_hash)   (&FanData.VerdictLocks[(_hash) & (FAN_VERDICT_LOCKS - 1)])
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+LONG
+FanVerdictGeneration (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Returns the current generation of the cache.  It is read before a
+    file's name is looked at and handed back to FanVerdictRemember.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    The generation.
+
+--*/
+{
+    return atomic_load( &FanData.VerdictGeneration );
+}
+
+
+BOOLEAN
+FanVerdictUnprotected (
+    __in dev_t Device,
+    __in ino_t Inode
+    )
+/*++
+
+Routine Description:
+
+    Checks whether a file is known not to be protected.
+
+Arguments:
+
+    Device - the device of the file
+    Inode - its inode
+
+Return Value:
+
+    TRUE if the file is not protected; FALSE if it is or is not known.
+
+--*/
+{
+    ULONG hash = FanVerdictHash( Device, Inode );
+    PFAN_VERDICT verdict = FanVerdictSlot( hash );
+    BOOLEAN found;
+
+    if (FanData.NotifyFd < 0) {
+
+        return FALSE;
+    }
+
+    pthread_mutex_lock( FanVerdictLock( hash ) );
+
+    found = (BOOLEAN)(verdict->Device == Device &&
+                      verdict->Inode == Inode &&
+                      verdict->Generation == FanVerdictGeneration());
+
+    pthread_mutex_unlock( FanVerdictLock( hash ) );
+
+    return found;
+}
+
+
+VOID
+FanVerdictRemember (
+    __in dev_t Device,
+    __in ino_t Inode,
+    __in LONG Generation
+    )
+/*++
+
+Routine Description:
+
+    Remembers that a file is not protected, replacing whatever was in its
+    slot.
+
+Arguments:
+
+    Device - the device of the file
+    Inode - its inode
+    Generation - the generation read before the file's name was
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG hash = FanVerdictHash( Device, Inode );
+    PFAN_VERDICT verdict = FanVerdictSlot( hash );
+
+    if (FanData.NotifyFd < 0) {
+
+        return;
+    }
+
+    pthread_mutex_lock( FanVerdictLock( hash ) );
+
+    verdict->Device = Device;
+    verdict->Inode = Inode;
+    verdict->Generation = Generation;
+
+    pthread_mutex_unlock( FanVerdictLock( hash ) );
+}
+
+
+VOID
+FanVerdictForget (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Forgets every verdict, after a rename or a new policy.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None.
+
+--*/
+{
+    atomic_fetch_add( &FanData.VerdictGeneration, 1 );
+}
@@ -0,0 +1,734 @@
+/*++
+
+Module Name:
+
+    mspyAlloc.c
+
+Abstract:
+
+    Measures the record allocator of ../filter/mspyLib.c, the size
+    classes and their per node, per processor lookaside lists, on the
+    driver built on fanShim.c: how many records a second it hands out,
+    how much pool that takes, how well the classes fit the records and
+    how often a processor is handed a buffer from another node's pool.
+
+    The records carry names drawn from the distributions a Windows volume
+    gives: most file names between 40 and 160 characters, a tail past
+    MAX_PATH, a few process images and the system's or a user's SID.
+
+    Each run is made in two ways:
+
+    local   - each thread allocates a batch of records and frees them,
+              as an operation whose record is filtered out does, so the
+              lists only ever see their own processor.
+
+    logged  - each thread allocates records and logs them, and a
+              consumer on processor 0 reads the log as minispy does, so
+              the records are freed on the consumer's node, as they are
+              in the driver.
+
+    The threads run on processors 0 and up, grouped into nodes of
+    --threads / --nodes processors.  The pool's footprint is sampled
+    while they run; it includes what the lookaside lists hold.
+
+    The results are printed as a table and, with --json, written in the
+    format Google Benchmark writes, which mspyBenchCompare.py compares.
+
+    Usage: mspyAlloc [--threads=n] [--nodes=n] [--seconds=s] [--json=file]
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fanSim.h"
+#include "mspyKern.h"
+#include "mspyReplay.h"
+
+DRIVER_INITIALIZE DriverEntry;
+
+#define ALLOC_SERVICE_KEY       "\\Registry\\Machine\\System\\CurrentControlSet\\Services\\fsFilter"
+#define ALLOC_CONSUMER          300
+#define ALLOC_MAX_RECORDS       (16 * 1024)
+#define ALLOC_MAX_THREADS       64
+#define ALLOC_BATCH             64
+#define ALLOC_NAME_SETS         1024
+#define ALLOC_LOG_SIZE          (1024 * 1024)
+
+typedef enum _ALLOC_MODE {
+
+    AllocLocal = 0,
+    AllocLogged,
+    AllocModes
+
+} ALLOC_MODE;
+
+//
+//  A length, in characters, and how many in a thousand names have it.
+//
+
+typedef struct _ALLOC_WEIGHT {
+
+    ULONG Length;
+    ULONG PerMille;
+
+} ALLOC_WEIGHT;
+
+//
+//  The names one record carries, as SpyPreOperationCallback sets them.
+//
+
+typedef struct _ALLOC_NAMES {
+
+    PUNICODE_STRING Names[3];
+    ULONG NameSpace;
+
+} ALLOC_NAMES, *PALLOC_NAMES;
+
+typedef struct _ALLOC_THREAD {
+
+    ULONG Index;
+    ALLOC_MODE Mode;
+    pthread_t Thread;
+
+    ULONGLONG Allocations;
+    ULONGLONG Failed;
+
+    //
+    //  Bytes the records needed and bytes their size classes gave them.
+    //
+
+    ULONGLONG Requested;
+    ULONGLONG Allocated;
+
+} ALLOC_THREAD, *PALLOC_THREAD;
+
+typedef struct _ALLOC_RESULT {
+
+    CHAR Name[64];
+    ULONGLONG Allocations;
+    ULONGLONG Failed;
+    double Seconds;
+    double Fill;
+    double Remote;
+    SIZE_T Footprint;
+
+} ALLOC_RESULT, *PALLOC_RESULT;
+
+static const PCSTR AllocModeNames[AllocModes] = { "local", "logged" };
+
+static const ALLOC_WEIGHT FileLengths[] = {
+
+    { 32, 60 }, { 48, 140 }, { 64, 180 }, { 80, 170 }, { 100, 150 }, { 128, 120 },
+    { 160, 80 }, { 200, 50 }, { 260, 30 }, { 400, 15 }, { 1024, 5 }
+};
+
+static const PCSTR Images[] = {
+
+    "\\Device\\HarddiskVolume1\\Windows\\System32\\svchost.exe",
+    "\\Device\\HarddiskVolume1\\Windows\\explorer.exe",
+    "\\Device\\HarddiskVolume1\\Program Files\\Microsoft Office\\root\\Office16\\WINWORD.EXE",
+    "\\Device\\HarddiskVolume1\\Program Files\\Microsoft Visual Studio\\2022\\Community\\MSBuild\\Current\\Bin\\MSBuild.exe",
+    "\\Device\\HarddiskVolume1\\Users\\user\\AppData\\Local\\Programs\\Microsoft VS Code\\Code.exe"
+};
+
+static const PCSTR Sids[] = {
+
+    "S-1-5-18",
+    "S-1-5-21-3623811015-3361044348-30300820-1013"
+};
+
+static ALLOC_NAMES Names[ALLOC_NAME_SETS];
+
+static ULONG Threads = 4;
+static ULONG Nodes = 2;
+static double Seconds = 1;
+static PCSTR JsonFile;
+
+static volatile BOOLEAN Stop;
+
+static PFLT_PORT DriverPort;
+
+//---------------------------------------------------------------------------
+//  Names
+//---------------------------------------------------------------------------
+
+static PUNICODE_STRING
+AllocString (
+    __in ULONG Length,
+    __in PCSTR Text
+    )
+/*++
+
+Routine Description:
+
+    Makes a name of Length characters: Text, then as many folders as it
+    takes, then a file name.
+
+--*/
+{
+    static const CHAR tail[] = "\\Quarterly report (final).docx";
+    PUNICODE_STRING string;
+    ULONG textLength = (ULONG) strlen( Text );
+    ULONG i;
+
+    string = malloc( sizeof(UNICODE_STRING) + (Length + 1) * sizeof(WCHAR) );
+    string->Buffer = (PWCHAR)(string + 1);
+    string->Length = (USHORT)(Length * sizeof(WCHAR));
+    string->MaximumLength = string->Length + sizeof(WCHAR);
+
+    for (i = 0; i < Length; i += 1) {
+
+        if (i < textLength) {
+
+            string->Buffer[i] = (UCHAR) Text[i];
+
+        } else if (Length - i < sizeof(tail) - 1 && Length > textLength + sizeof(tail)) {
+
+            string->Buffer[i] = (UCHAR) tail[sizeof(tail) - 1 - (Length - i)];
+
+        } else {
+
+            string->Buffer[i] = (i % 12 == 0) ? L'\\' : (WCHAR)('a' + i % 26);
+        }
+    }
+
+    string->Buffer[Length] = UNICODE_NULL;
+
+    return string;
+}
+
+
+static VOID
+AllocMakeNames (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Draws ALLOC_NAME_SETS sets of names from the distributions, the same
+    ones every run.
+
+--*/
+{
+    ULONG seed = 12345;
+    ULONG draw;
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < ALLOC_NAME_SETS; i += 1) {
+
+        seed = seed * 1103515245 + 12345;
+        draw = (seed >> 16) % 1000;
+
+        for (j = 0; draw >= FileLengths[j].PerMille; j += 1) {
+
+            draw -= FileLengths[j].PerMille;
+        }
+
+        Names[i].Names[0] = AllocString( FileLengths[j].Length, "\\Device\\HarddiskVolume1\\Users\\user" );
+
+        seed = seed * 1103515245 + 12345;
+        draw = seed >> 16;
+
+        Names[i].Names[1] = AllocString( (ULONG) strlen( Images[draw % 5] ), Images[draw % 5] );
+        Names[i].Names[2] = AllocString( (ULONG) strlen( Sids[(draw / 5) % 10 < 3 ? 0 : 1] ),
+                                         Sids[(draw / 5) % 10 < 3 ? 0 : 1] );
+
+        for (j = 0; j < 3; j += 1) {
+
+            Names[i].NameSpace += SPY_NAME_SPACE( Names[i].Names[j]->Length );
+        }
+    }
+}
+
+
+static VOID
+AllocFreeNames (
+    VOID
+    )
+{
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < ALLOC_NAME_SETS; i += 1) {
+
+        for (j = 0; j < 3; j += 1) {
+
+            free( Names[i].Names[j] );
+        }
+    }
+}
+
+//---------------------------------------------------------------------------
+//  The threads
+//---------------------------------------------------------------------------
+
+static PRECORD_LIST
+AllocRecord (
+    __inout PALLOC_THREAD Thread,
+    __in PALLOC_NAMES Names
+    )
+{
+    PRECORD_LIST record;
+    ULONG i;
+
+    record = SpyNewRecord( IRP_MJ_WRITE, Names->NameSpace );
+
+    if (record == NULL) {
+
+        Thread->Failed += 1;
+        return NULL;
+    }
+
+    for (i = 0; i < 3; i += 1) {
+
+        SpySetRecordName( &record->LogRecord, Names->Names[i] );
+    }
+
+    Thread->Allocations += 1;
+    Thread->Requested += FIELD_OFFSET(RECORD_LIST, LogRecord.Name) + Names->NameSpace;
+    Thread->Allocated += record->Size;
+
+    return record;
+}
+
+
+static PVOID
+AllocThread (
+    __in PVOID Parameter
+    )
+{
+    PALLOC_THREAD thread = Parameter;
+    PRECORD_LIST batch[ALLOC_BATCH];
+    ULONG next = thread->Index * (ALLOC_NAME_SETS / ALLOC_MAX_THREADS);
+    ULONG count;
+    ULONG i;
+
+    FanSimSetProcessor( thread->Index );
+
+    while (!Stop) {
+
+        if (thread->Mode == AllocLocal) {
+
+            for (count = 0; count < ALLOC_BATCH; count += 1) {
+
+                batch[count] = AllocRecord( thread, &Names[next++ % ALLOC_NAME_SETS] );
+            }
+
+            for (i = 0; i < count; i += 1) {
+
+                if (batch[i] != NULL) {
+
+                    SpyFreeRecord( batch[i] );
+                }
+            }
+
+        } else {
+
+            batch[0] = AllocRecord( thread, &Names[next++ % ALLOC_NAME_SETS] );
+
+            if (batch[0] != NULL) {
+
+                SpyLog( batch[0] );
+
+            } else {
+
+                sched_yield();
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+static VOID
+AllocIgnoreRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    UNREFERENCED_PARAMETER( Context );
+    UNREFERENCED_PARAMETER( LogRecord );
+}
+
+
+static PVOID
+AllocConsume (
+    __in PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Reads the log as minispy does, on processor 0, until told to stop and
+    the log is empty.
+
+--*/
+{
+    UCHAR message[FIELD_OFFSET(COMMAND_MESSAGE, Data) + sizeof(MINISPY_ACK)];
+    PCOMMAND_MESSAGE command = (PCOMMAND_MESSAGE) message;
+    LOG_SEQUENCE sequence;
+    PVOID buffer;
+    ULONG returned = 0;
+    ULONG used;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER( Parameter );
+
+    buffer = aligned_alloc( sizeof(PVOID), ALLOC_LOG_SIZE );
+
+    FanSimSetProcess( ALLOC_CONSUMER );
+    FanSimSetProcessor( 0 );
+    SequenceReset( &sequence );
+
+    memset( message, 0, sizeof(message) );
+    command->Command = GetMiniSpyLog;
+
+    status = FanSimSendMessage( DriverPort, command, FIELD_OFFSET(COMMAND_MESSAGE, Data),
+                                buffer, ALLOC_LOG_SIZE, &returned );
+
+    for (;;) {
+
+        if (status == STATUS_NO_MORE_ENTRIES || (NT_SUCCESS( status ) && returned == 0)) {
+
+            if (Stop) {
+
+                break;
+            }
+
+            sched_yield();
+
+            command->Command = GetMiniSpyLog;
+            status = FanSimSendMessage( DriverPort, command, FIELD_OFFSET(COMMAND_MESSAGE, Data),
+                                        buffer, ALLOC_LOG_SIZE, &returned );
+            continue;
+        }
+
+        if (!NT_SUCCESS( status )) {
+
+            fprintf( stderr, "mspyAlloc: reading the log: %08x\n", (unsigned) status );
+            break;
+        }
+
+        ReplayBatch( &sequence, buffer, returned, AllocIgnoreRecord, NULL, &used );
+
+        command->Command = AckMiniSpyLog;
+        memcpy( ((PMINISPY_ACK) command->Data)->Sequence, sequence.Received, sizeof(sequence.Received) );
+
+        status = FanSimSendMessage( DriverPort, command, sizeof(message),
+                                    buffer, ALLOC_LOG_SIZE, &returned );
+    }
+
+    free( buffer );
+    return NULL;
+}
+
+//---------------------------------------------------------------------------
+//  Running it
+//---------------------------------------------------------------------------
+
+static double
+AllocNow (
+    VOID
+    )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+static BOOLEAN
+AllocLoadDriver (
+    VOID
+    )
+{
+    MINISPY_CONNECT connect;
+
+    memset( &connect, 0, sizeof(connect) );
+
+    FanSimAddProcess( ALLOC_CONSUMER, "\\Windows\\minispy.exe", "S-1-5-21-1-500" );
+    FanSimSetRegistryString( ALLOC_SERVICE_KEY, "ProtectedDir", FAN_SIM_VOLUME_NAME "\\protected\\" );
+    FanSimSetRegistryString( ALLOC_SERVICE_KEY, "OpenProccess", "a.exe" );
+    FanSimSetRegistryDword( ALLOC_SERVICE_KEY, "MaxRecords", ALLOC_MAX_RECORDS );
+
+    if (!NT_SUCCESS( FanSimLoad( DriverEntry, ALLOC_SERVICE_KEY ) )) {
+
+        return FALSE;
+    }
+
+    FanSimSetProcess( ALLOC_CONSUMER );
+
+    return NT_SUCCESS( FanSimConnect( "\\MiniSpyPort", &connect, sizeof(connect), &DriverPort ) );
+}
+
+
+static VOID
+AllocUnloadDriver (
+    VOID
+    )
+{
+    FanSimSetProcess( ALLOC_CONSUMER );
+    FanSimDisconnect( DriverPort );
+
+    FanSimSetProcess( FAN_SIM_SYSTEM_PROCESS );
+    FanSimUnload();
+}
+
+
+static VOID
+AllocRun (
+    __in ALLOC_MODE Mode,
+    __out PALLOC_RESULT Result
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver, runs the threads for Seconds while sampling the
+    pool, and unloads it, so each run starts with empty lookaside lists.
+
+--*/
+{
+    FAN_SIM_POOL_STATISTICS before;
+    FAN_SIM_POOL_STATISTICS now;
+    ALLOC_THREAD threads[ALLOC_MAX_THREADS];
+    pthread_t consumer;
+    ULONGLONG requested = 0;
+    ULONGLONG allocated = 0;
+    double start;
+    ULONG i;
+
+    memset( Result, 0, sizeof(*Result) );
+    memset( threads, 0, sizeof(threads) );
+
+    snprintf( Result->Name, sizeof(Result->Name), "NewRecord/%s/threads:%u/nodes:%u",
+              AllocModeNames[Mode], Threads, Nodes );
+
+    FanSimSetNodeSize( (Threads + Nodes - 1) / Nodes );
+
+    if (!AllocLoadDriver()) {
+
+        fprintf( stderr, "mspyAlloc: the driver did not load\n" );
+        exit( 1 );
+    }
+
+    FanSimPoolStatistics( &before );
+
+    Stop = FALSE;
+
+    if (Mode == AllocLogged) {
+
+        pthread_create( &consumer, NULL, AllocConsume, NULL );
+    }
+
+    start = AllocNow();
+
+    for (i = 0; i < Threads; i += 1) {
+
+        threads[i].Index = i;
+        threads[i].Mode = Mode;
+
+        pthread_create( &threads[i].Thread, NULL, AllocThread, &threads[i] );
+    }
+
+    while (AllocNow() - start < Seconds) {
+
+        usleep( 1000 );
+
+        FanSimPoolStatistics( &now );
+        Result->Footprint = max( Result->Footprint, now.BytesInUse - before.BytesInUse );
+    }
+
+    Stop = TRUE;
+
+    for (i = 0; i < Threads; i += 1) {
+
+        pthread_join( threads[i].Thread, NULL );
+
+        Result->Allocations += threads[i].Allocations;
+        Result->Failed += threads[i].Failed;
+        requested += threads[i].Requested;
+        allocated += threads[i].Allocated;
+    }
+
+    Result->Seconds = AllocNow() - start;
+
+    if (Mode == AllocLogged) {
+
+        pthread_join( consumer, NULL );
+    }
+
+    FanSimPoolStatistics( &now );
+
+    Result->Fill = allocated ? 100.0 * requested / allocated : 0;
+    Result->Remote = Result->Allocations ?
+                     100.0 * (now.RemoteAllocations - before.RemoteAllocations) / Result->Allocations : 0;
+
+    AllocUnloadDriver();
+}
+
+
+static BOOLEAN
+AllocWriteJson (
+    __in_ecount(Count) PALLOC_RESULT Results,
+    __in ULONG Count,
+    __in PCSTR Executable
+    )
+{
+    FILE *file = fopen( JsonFile, "w" );
+    CHAR date[64];
+    CHAR host[256] = "";
+    time_t now = time( NULL );
+    struct tm local;
+    ULONG i;
+
+    if (file == NULL) {
+
+        perror( JsonFile );
+        return FALSE;
+    }
+
+    localtime_r( &now, &local );
+    strftime( date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &local );
+    gethostname( host, sizeof(host) - 1 );
+
+    fprintf( file, "{\n  \"context\": {\n" );
+    fprintf( file, "    \"date\": \"%s\",\n", date );
+    fprintf( file, "    \"host_name\": \"%s\",\n", host );
+    fprintf( file, "    \"executable\": \"%s\",\n", Executable );
+    fprintf( file, "    \"num_cpus\": %ld,\n", sysconf( _SC_NPROCESSORS_ONLN ) );
+    fprintf( file, "    \"pinned_cpu\": -1,\n" );
+#ifdef __OPTIMIZE__
+    fprintf( file, "    \"library_build_type\": \"release\"\n" );
+#else
+    fprintf( file, "    \"library_build_type\": \"debug\"\n" );
+#endif
+    fprintf( file, "  },\n  \"benchmarks\": [\n" );
+
+    for (i = 0; i < Count; i += 1) {
+
+        fprintf( file,
+                 "    {\n"
+                 "      \"name\": \"%s\",\n"
+                 "      \"run_type\": \"iteration\",\n"
+                 "      \"iterations\": %llu,\n"
+                 "      \"real_time\": %.3f,\n"
+                 "      \"cpu_time\": %.3f,\n"
+                 "      \"time_unit\": \"ns\",\n"
+                 "      \"items_per_second\": %.1f,\n"
+                 "      \"footprint_bytes\": %zu,\n"
+                 "      \"fill_percent\": %.1f,\n"
+                 "      \"remote_percent\": %.2f,\n"
+                 "      \"failed\": %llu\n"
+                 "    }%s\n",
+                 Results[i].Name,
+                 (unsigned long long) Results[i].Allocations,
+                 Results[i].Seconds * 1e9 / max( Results[i].Allocations, 1 ),
+                 Results[i].Seconds * 1e9 / max( Results[i].Allocations, 1 ),
+                 Results[i].Allocations / Results[i].Seconds,
+                 (size_t) Results[i].Footprint,
+                 Results[i].Fill,
+                 Results[i].Remote,
+                 (unsigned long long) Results[i].Failed,
+                 i + 1 < Count ? "," : "" );
+    }
+
+    fprintf( file, "  ]\n}\n" );
+
+    return fclose( file ) == 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    ALLOC_RESULT results[AllocModes];
+    BOOLEAN valid = TRUE;
+    PCSTR value;
+    ULONG i;
+
+    for (i = 1; i < (ULONG) argc && valid; i += 1) {
+
+        value = strchr( argv[i], '=' );
+        value = value ? value + 1 : "";
+
+        if (strncmp( argv[i], "--threads=", 10 ) == 0) {
+
+            Threads = (ULONG) strtoul( value, NULL, 10 );
+            valid = Threads > 0 && Threads <= ALLOC_MAX_THREADS;
+
+        } else if (strncmp( argv[i], "--nodes=", 8 ) == 0) {
+
+            Nodes = (ULONG) strtoul( value, NULL, 10 );
+            valid = Nodes > 0;
+
+        } else if (strncmp( argv[i], "--seconds=", 10 ) == 0) {
+
+            Seconds = atof( value );
+            valid = Seconds > 0;
+
+        } else if (strncmp( argv[i], "--json=", 7 ) == 0) {
+
+            JsonFile = value;
+
+        } else {
+
+            valid = FALSE;
+        }
+    }
+
+    if (!valid || Nodes > Threads) {
+
+        fprintf( stderr, "usage: mspyAlloc [--threads=n] [--nodes=n] [--seconds=s] [--json=file]\n" );
+        return 2;
+    }
+
+    AllocMakeNames();
+
+    printf( "%-36s %14s %12s %12s %8s %8s %10s\n",
+            "Benchmark", "Allocations/s", "ns/alloc", "Footprint", "Fill", "Remote", "Failed" );
+
+    for (i = 0; i < AllocModes; i += 1) {
+
+        AllocRun( (ALLOC_MODE) i, &results[i] );
+
+        printf( "%-36s %14.0f %12.1f %9zu KB %7.1f%% %7.2f%% %10llu\n",
+                results[i].Name,
+                results[i].Allocations / results[i].Seconds,
+                results[i].Seconds * 1e9 / max( results[i].Allocations, 1 ),
+                (size_t)(results[i].Footprint / 1024),
+                results[i].Fill,
+                results[i].Remote,
+                (unsigned long long) results[i].Failed );
+
+        fflush( stdout );
+    }
+
+    AllocFreeNames();
+
+    if (JsonFile != NULL && !AllocWriteJson( results, AllocModes, argv[0] )) {
+
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,1662 @@
+/*++
+
+Module Name:
+
+    mspyBench.c
+
+Abstract:
+
+    Times the routines every operation and every record goes through, on
+    the driver's and minispy's own code: the protected folder, process,
+    extension and rule matches of ../filter/Policy.c, SpySetRecordName,
+    DumpNameCxtLine and the GetMiniSpyLog reply of the driver built on
+    fanShim.c, and the decoding of that reply by ../userdll/mspyDecode.c,
+    which is the RetrieveLogRecords parse loop and FormatSystemTime.
+
+    Each benchmark is run for each of the inputs it takes: path lengths
+    in characters, numbers of rules and numbers of records to a batch.
+    After a warmup the number of iterations is grown until one run takes
+    at least the minimum time, then that many iterations are run once for
+    each repetition.  The median time of an iteration is reported, with
+    the mean, the spread and the items a second.  The thread is pinned to
+    one processor throughout.
+
+    The results are printed as a table and, with --json, written in the
+    format Google Benchmark writes, which mspyBenchCompare.py compares
+    with a baseline.
+
+    Usage: mspyBench [--filter=text] [--path-lengths=n,...]
+                     [--rule-counts=n,...] [--batch-sizes=n,...]
+                     [--min-time=seconds] [--warmup=seconds]
+                     [--repetitions=n] [--cpu=n] [--json=file]
+
+    --cpu=-1 leaves the thread unpinned.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "fanSim.h"
+#include "mspyKern.h"
+#include "Policy.h"
+#include "mspyDecode.h"
+
+DRIVER_INITIALIZE DriverEntry;
+
+WCHAR* DumpNameCxtLine(__in WCHAR* Name,  __inout WCHAR* line, __inout size_t *length);
+
+#define BENCH_MAX_VALUES        16
+#define BENCH_MAX_RESULTS       256
+#define BENCH_MAX_REPETITIONS   64
+#define BENCH_MAX_PATH          2048
+#define BENCH_REPLY_SIZE        (1024 * 1024)
+
+#define BENCH_SERVICE_KEY       "\\Registry\\Machine\\System\\CurrentControlSet\\Services\\fsFilter"
+#define BENCH_CONSUMER          300
+#define BENCH_MAX_RECORDS       (16 * 1024)
+
+//
+//  The inputs a benchmark is run for, up to two of them.
+//
+
+typedef enum _BENCH_AXIS {
+
+    BenchNone = 0,
+    BenchPathLength,
+    BenchRuleCount,
+    BenchBatchSize
+
+} BENCH_AXIS;
+
+typedef struct _BENCH_STATE {
+
+    ULONG Args[2];
+
+    //
+    //  Set by the setup routine: what one iteration processes, and the
+    //  benchmark's own data.
+    //
+
+    ULONG Items;
+    PVOID Context;
+
+} BENCH_STATE, *PBENCH_STATE;
+
+typedef struct _BENCH {
+
+    PCSTR Name;
+    BENCH_AXIS Axes[2];
+
+    BOOLEAN (*Setup)( PBENCH_STATE State );
+    VOID (*Run)( PBENCH_STATE State, ULONGLONG Iterations );
+    VOID (*Teardown)( PBENCH_STATE State );
+
+} BENCH, *PBENCH;
+
+typedef struct _BENCH_RESULT {
+
+    CHAR Name[64];
+    ULONGLONG Iterations;
+    ULONG Repetitions;
+
+    //
+    //  Nanoseconds an iteration.
+    //
+
+    double Median;
+    double Mean;
+    double Stddev;
+    double Cpu;
+
+    double ItemsPerSecond;
+
+} BENCH_RESULT, *PBENCH_RESULT;
+
+typedef struct _BENCH_VALUES {
+
+    ULONG Count;
+    ULONG Values[BENCH_MAX_VALUES];
+
+} BENCH_VALUES, *PBENCH_VALUES;
+
+//
+//  Settings
+//
+
+static BENCH_VALUES PathLengths = { 3, { 32, 128, 512 } };
+static BENCH_VALUES RuleCounts = { 3, { 1, 8, 64 } };
+static BENCH_VALUES BatchSizes = { 3, { 1, 32, 512 } };
+
+static double MinTime = 0.1;
+static double WarmupTime = 0.05;
+static ULONG Repetitions = 5;
+static LONG PinnedCpu;
+static PCSTR Filter;
+static PCSTR JsonFile;
+
+static BENCH_RESULT Results[BENCH_MAX_RESULTS];
+static ULONG ResultCount;
+
+//
+//  Keeps the compiler from dropping what a benchmark computes.
+//
+
+static volatile ULONG Sink;
+
+//---------------------------------------------------------------------------
+//  Inputs
+//---------------------------------------------------------------------------
+
+static VOID
+BenchWiden (
+    __out_ecount(Length) PWCHAR Dest,
+    __in PCSTR Source,
+    __in ULONG Length
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Length; i += 1) {
+
+        Dest[i] = (UCHAR) Source[i];
+    }
+}
+
+
+static VOID
+BenchMakePath (
+    __out_ecount(Length + 1) PWCHAR Buffer,
+    __in ULONG Length,
+    __in PCSTR Tail
+    )
+/*++
+
+Routine Description:
+
+    Makes a file name of Length characters on the volume, as the filter
+    sees it normalized, down a chain of folders and ending in Tail.
+
+--*/
+{
+    static CONST CHAR prefix[] = "\\Device\\HarddiskVolume1\\Users\\bench";
+    CHAR folder[16];
+    ULONG tailLength = (ULONG) strlen( Tail );
+    ULONG used;
+    ULONG chunk;
+    ULONG index = 0;
+
+    used = (ULONG) min( sizeof(prefix) - 1, Length );
+    BenchWiden( Buffer, prefix, used );
+
+    while (used < Length) {
+
+        snprintf( folder, sizeof(folder), "\\folder%u", index++ );
+        chunk = min( (ULONG) strlen( folder ), Length - used );
+        BenchWiden( Buffer + used, folder, chunk );
+        used += chunk;
+    }
+
+    tailLength = min( tailLength, Length );
+    BenchWiden( Buffer + Length - tailLength, Tail, tailLength );
+    Buffer[Length] = UNICODE_NULL;
+}
+
+
+static PWCHAR
+BenchString (
+    __in PCSTR Source,
+    __out PUNICODE_STRING String
+    )
+{
+    ULONG length = (ULONG) strlen( Source );
+    PWCHAR buffer = malloc( (length + 1) * sizeof(WCHAR) );
+
+    BenchWiden( buffer, Source, length );
+    buffer[length] = UNICODE_NULL;
+
+    String->Buffer = buffer;
+    String->Length = (USHORT)(length * sizeof(WCHAR));
+    String->MaximumLength = String->Length + sizeof(WCHAR);
+
+    return buffer;
+}
+
+
+static PUNICODE_STRING
+BenchPath (
+    __in ULONG Length,
+    __in PCSTR Tail
+    )
+{
+    PUNICODE_STRING string;
+
+    Length = min( Length, BENCH_MAX_PATH );
+
+    string = malloc( sizeof(UNICODE_STRING) + (Length + 1) * sizeof(WCHAR) );
+    string->Buffer = (PWCHAR)(string + 1);
+    string->Length = (USHORT)(Length * sizeof(WCHAR));
+    string->MaximumLength = string->Length + sizeof(WCHAR);
+
+    BenchMakePath( string->Buffer, Length, Tail );
+
+    return string;
+}
+
+//---------------------------------------------------------------------------
+//  Policy.c
+//---------------------------------------------------------------------------
+
+typedef struct _BENCH_POLICY {
+
+    PUNICODE_STRING Name;
+    UNICODE_STRING Pattern;
+    PFF_LIST_CONTEXT List;
+    FF_PROCESS_TABLE Processes;
+    FF_EXTENSION_TABLE Extensions;
+    UNICODE_STRING Probe[2];
+    FF_RULE_TABLE Rules;
+    FF_RULE_SUBJECT Subject;
+    UNICODE_STRING Image;
+
+} BENCH_POLICY, *PBENCH_POLICY;
+
+
+static PFF_LIST_CONTEXT
+BenchListEntry (
+    __in PCSTR Item,
+    __in PFF_LIST_CONTEXT Head
+    )
+{
+    ULONG length = (ULONG) strlen( Item );
+    PFF_LIST_CONTEXT entry = calloc( 1, sizeof(FF_LIST_CONTEXT) + (length + 1) * sizeof(WCHAR) );
+
+    entry->head = Head;
+    entry->item.Buffer = (PWCHAR)(entry + 1);
+    entry->item.Length = (USHORT)(length * sizeof(WCHAR));
+    entry->item.MaximumLength = entry->item.Length + sizeof(WCHAR);
+    BenchWiden( entry->item.Buffer, Item, length );
+
+    return entry;
+}
+
+
+static VOID
+BenchPolicyTeardown (
+    __in PBENCH_STATE State
+    )
+{
+    PBENCH_POLICY policy = State->Context;
+    PFF_LIST_CONTEXT next;
+
+    while (policy->List != NULL) {
+
+        next = policy->List->head;
+        free( policy->List );
+        policy->List = next;
+    }
+
+    free( policy->Name );
+    free( policy->Pattern.Buffer );
+    free( policy->Probe[0].Buffer );
+    free( policy->Probe[1].Buffer );
+    free( policy->Image.Buffer );
+    free( policy );
+}
+
+
+static BOOLEAN
+BenchFindSubStringSetup (
+    __in PBENCH_STATE State
+    )
+/*++
+
+Routine Description:
+
+    A name that does not hold the protected folder, so every position is
+    looked at.
+
+--*/
+{
+    PBENCH_POLICY policy = calloc( 1, sizeof(BENCH_POLICY) );
+
+    policy->Name = BenchPath( State->Args[0], "\\report.txt" );
+    BenchString( "\\protected\\", &policy->Pattern );
+
+    State->Context = policy;
+    return TRUE;
+}
+
+
+static VOID
+BenchFindSubString (
+    __in PBENCH_STATE State,
+    __in ULONGLONG Iterations
+    )
+{
+    PBENCH_POLICY policy = State->Context;
+    ULONG found = 0;
+
+    while (Iterations--) {
+
+        found += RtlFindSubString( policy->Name, &policy->Pattern );
+    }
+
+    Sink = found;
+}
+
+
+static BOOLEAN
+BenchMatchFolderSetup (
+    __in PBENCH_STATE State
+    )
+/*++
+
+Routine Description:
+
+    Args[0] protected folders, none of which the name is in.
+
+--*/
+{
+    PBENCH_POLICY policy = calloc( 1, sizeof(BENCH_POLICY) );
+    CHAR folder[32];
+    ULONG i;
+
+    for (i = 0; i < State->Args[0]; i += 1) {
+
+        snprintf( folder, sizeof(folder), "\\protected%u\\", i );
+        policy->List = BenchListEntry( folder, policy->List );
+    }
+
+    policy->Name = BenchPath( State->Args[1], "\\report.txt" );
+
+    State->Context = policy;
+    return TRUE;
+}
+
+
+static VOID
+BenchMatchFolder (
+    __in PBENCH_STATE State,
+    __in ULONGLONG Iterations
+    )
+{
+    PBENCH_POLICY policy = State->Context;
+    ULONG found = 0;
+
+    while (Iterations--) {
+
+        found += PolicyMatchFolder( policy->List, policy->Name );
+    }
+
+    Sink = found;
+}
+
+
+static BOOLEAN
+BenchMatchProcessSetup (
+    __in PBENCH_STATE State
+    )
+/*++
+
+Routine Description:
+
+    Args[0] allowed processes as fsFilter.c lists them, "*" and the image
+    name, one in eight with wildcards of its own so that it is matched by
+    FsRtlIsNameInExpression.  The image is none of them.
+
+--*/
+{
+    PBENCH_POLICY policy = calloc( 1, sizeof(BENCH_POLICY) );
+    CHAR process[32];
+    ULONG i;
+
+    PolicyClearProcesses( &policy->Processes );
+
+    for (i = 0; i < State->Args[0]; i += 1) {
+
+        if (i % 8 == 7) {
+
+            snprintf( process, sizeof(process), "*\\TOOL?%u\\*.EXE", i );
+
+        } else {
+
+            snprintf( process, sizeof(process), "*\\app%u.exe", i );
+        }
+
+        policy->List = BenchListEntry( process, policy->List );
+        PolicyAddProcess( &policy->Processes, policy->List );
+    }
+
+    policy->Name = BenchPath( State->Args[1], "\\notepad.exe" );
+
+    State->Context = policy;
+    return TRUE;
+}
+
+
+static VOID
+BenchMatchProcess (
+    __in PBENCH_STATE State,
+    __in ULONGLONG Iterations
+    )
+{
+    PBENCH_POLICY policy = State->Context;
+    ULONG found = 0;
+
+    while (Iterations--) {
+
+        found += PolicyMatchProcess( &policy->Processes, policy->Name );
+    }
+
+    Sink = found;
+}
+
+
+static BOOLEAN
+BenchMatchExtensionSetup (
+    __in PBENCH_STATE State
+    )
+/*++
+
+Routine Description:
+
+    Args[0] protected extensions; the lookups alternate between one of
+    them and one that is not.
+
+--*/
+{
+    PBENCH_POLICY policy = calloc( 1, sizeof(BENCH_POLICY) );
+    CHAR list[FF_EXTENSION_MAX * 8];
+    UNICODE_STRING string;
+    ULONG used = 0;
+    ULONG i;
+
+    for (i = 0; i < min( State->Args[0], FF_EXTENSION_MAX ); i += 1) {
+
+        used += snprintf( list + used, sizeof(list) - used, "ex%u\n", i );
+    }
+
+    BenchString( list, &string );
+
+    if (!NT_SUCCESS( PolicySetExtensions( &policy->Extensions, &string ) )) {
+
+        free( string.Buffer );
+        free( policy );
+        return FALSE;
+    }
+
+    free( string.Buffer );
+
+    BenchString( "ex0", &policy->Probe[0] );
+    BenchString( "docx", &policy->Probe[1] );
+
+    State->Context = policy;
+    return TRUE;
+}
+
+
+static VOID
+BenchMatchExtension (
+    __in PBENCH_STATE State,
+    __in ULONGLONG Iterations
+    )
+{
+    PBENCH_POLICY policy = State->Context;
+    ULONG found = 0;
+
+    while (Iterations--) {
+
+        found += PolicyMatchExtension( &policy->Extensions, &policy->Probe[Iterations & 1] );
+    }
+
+    Sink = found;
+}
+
+
+static PUNICODE_STRING
+BenchRuleImage (
+    __inout PFF_RULE_SUBJECT Subject
+    )
+{
+    return Subject->context;
+}
+
+
+static USHORT
+BenchRuleMember (
+    __inout PFF_RULE_SUBJECT Subject,
+    __in PVOID Sid
+    )
+{
+    UNREFERENCED_PARAMETER( Subject );
+    UNREFERENCED_PARAMETER( Sid );
+
+    return FF_RULE_NOT_MEMBER;
+}
+
+
+static USHORT
+BenchRuleString (
+    __inout PPOLICY_RULES Rules,
+    __in PCSTR String
+    )
+{
+    ULONG length = (ULONG) strlen( String );
+    USHORT offset = (USHORT) Rules->StringsLength;
+
+    BenchWiden( (PWCHAR) &Rules->Strings[offset], String, length );
+    ((PWCHAR) &Rules->Strings[offset])[length] = UNICODE_NULL;
+    Rules->StringsLength += (length + 1) * sizeof(WCHAR);
+
+    return offset;
+}
+
+
+static BOOLEAN
+BenchEvaluateRulesSetup (
+    __in PBENCH_STATE State
+    )
+/*++
+
+Routine Description:
+
+    Args[0] write rules, each for a folder the name is not in, but the
+    last, which takes the name's extension, folder and process to rule
+    out.
+
+--*/
+{
+    PBENCH_POLICY policy = calloc( 1, sizeof(BENCH_POLICY) );
+    PPOLICY_RULES rules = calloc( 1, sizeof(POLICY_RULES) );
+    CHAR path[32];
+    ULONG count = min( State->Args[0], RULE_MAX );
+    ULONG i;
+
+    for (i = 0; i < count; i += 1) {
+
+        rules->Rules[i].Verdict = RULE_DENY;
+        rules->Rules[i].Operations = RULE_OP_WRITE;
+        rules->Rules[i].Extension = RULE_ANY;
+        rules->Rules[i].Process = RULE_ANY;
+        rules->Rules[i].User = RULE_ANY;
+
+        if (i == count - 1) {
+
+            rules->Rules[i].Extension = BenchRuleString( rules, "txt" );
+            rules->Rules[i].Path = BenchRuleString( rules, "\\folder0" );
+            rules->Rules[i].Process = BenchRuleString( rules, "\\backup.exe" );
+
+        } else {
+
+            snprintf( path, sizeof(path), "\\vault%u\\", i );
+            rules->Rules[i].Path = BenchRuleString( rules, path );
+        }
+    }
+
+    rules->Count = count;
+
+    if (!NT_SUCCESS( PolicySetRules( &policy->Rules, rules ) )) {
+
+        free( rules );
+        free( policy );
+        return FALSE;
+    }
+
+    free( rules );
+
+    policy->Name = BenchPath( State->Args[1], "\\report.txt" );
+    BenchString( "txt", &policy->Probe[0] );
+    BenchString( "\\Device\\HarddiskVolume1\\Windows\\notepad.exe", &policy->Image );
+
+    policy->Subject.operation = RULE_OP_WRITE;
+    policy->Subject.name = policy->Name;
+    policy->Subject.extension = &policy->Probe[0];
+    policy->Subject.image = BenchRuleImage;
+    policy->Subject.member = BenchRuleMember;
+    policy->Subject.context = &policy->Image;
+
+    State->Context = policy;
+    return TRUE;
+}
+
+
+static VOID
+BenchEvaluateRules (
+    __in PBENCH_STATE State,
+    __in ULONGLONG Iterations
+    )
+{
+    PBENCH_POLICY policy = State->Context;
+    ULONG verdicts = 0;
+
+    while (Iterations--) {
+
+        verdicts += PolicyEvaluateRules( &policy->Rules, &policy->Subject );
+    }
+
+    Sink = verdicts;
+}
+
+//---------------------------------------------------------------------------
+//  The driver's records
+//---------------------------------------------------------------------------
+
+//
+//  The driver is loaded once, for all of the benchmarks that need it,
+//  with a consumer connected so that records are kept.
+//
+
+static BOOLEAN DriverLoaded;
+static PFLT_PORT DriverPort;
+
+typedef struct _BENCH_RECORDS {
+
+    PUNICODE_STRING Names[3];
+    ULONG NameSpace;
+
+    PUCHAR Reply;
+    ULONG ReplyLength;
+
+    PWCHAR Lines;
+    WCHAR Line[BENCH_MAX_PATH + 1];
+
+    MSPY_BATCH Batch;
+
+} BENCH_RECORDS, *PBENCH_RECORDS;
+
+
+static BOOLEAN
+BenchLoadDriver (
+    VOID
+    )
+{
+    MINISPY_CONNECT connect = { 0 };
+
+    if (DriverLoaded) {
+
+        return DriverPort != NULL;
+    }
+
+    DriverLoaded = TRUE;
+
+    FanSimAddProcess( BENCH_CONSUMER, "\\Windows\\minispy.exe", "S-1-5-21-1-500" );
+    FanSimSetRegistryString( BENCH_SERVICE_KEY, "ProtectedDir", FAN_SIM_VOLUME_NAME "\\protected\\" );
+    FanSimSetRegistryString( BENCH_SERVICE_KEY, "OpenProccess", "a.exe" );
+
+    //
+    //  Room for the largest batch with the default 500 records.
+    //
+
+    FanSimSetRegistryDword( BENCH_SERVICE_KEY, "MaxRecords", BENCH_MAX_RECORDS );
+
+    if (!NT_SUCCESS( FanSimLoad( DriverEntry, BENCH_SERVICE_KEY ) )) {
+
+        return FALSE;
+    }
+
+    FanSimSetProcess( BENCH_CONSUMER );
+
+    if (!NT_SUCCESS( FanSimConnect( "\\MiniSpyPort", &connect, sizeof(connect), &DriverPort ) )) {
+
+        DriverPort = NULL;
+    }
+
+    return DriverPort != NULL;
+}
+
+
+static VOID
+BenchUnloadDriver (
+    VOID
+    )
+{
+    if (DriverPort != NULL) {
+
+        FanSimDisconnect( DriverPort );
+        DriverPort = NULL;
+    }
+
+    if (DriverLoaded) {
+
+        FanSimSetProcess( FAN_SIM_SYSTEM_PROCESS );
+        FanSimUnload();
+    }
+}
+
+
+static BOOLEAN
+BenchRecordsSetup (
+    __in PBENCH_STATE State
+    )
+/*++
+
+Routine Description:
+
+    The names a record holds, as SpyPreOperationCallback sets them: the
+    file's, of Args[0] characters, the process image's and the user's.
+
+--*/
+{
+    PBENCH_RECORDS records;
+    ULONG i;
+
+    if (!BenchLoadDriver()) {
+
+        return FALSE;
+    }
+
+    records = calloc( 1, sizeof(BENCH_RECORDS) );
+
+    records->Names[0] = BenchPath( State->Args[0], "\\report.txt" );
+    records->Names[1] = BenchPath( 48, "\\Windows\\notepad.exe" );
+    records->Names[2] = BenchPath( 14, "S-1-5-21-1-1001" );
+
+    for (i = 0; i < 3; i += 1) {
+
+        records->NameSpace += SPY_NAME_SPACE( records->Names[i]->Length );
+    }
+
+    records->Reply = aligned_alloc( sizeof(PVOID), BENCH_REPLY_SIZE );
+
+    State->Context = records;
+    return TRUE;
+}
+
+
+static VOID
+BenchRecordsTeardown (
+    __in PBENCH_STATE State
+    )
+{
+    PBENCH_RECORDS records = State->Context;
+    ULONG i;
+
+    for (i = 0; i < 3; i += 1) {
+
+        free( records->Names[i] );
+    }
+
+    MspyResetBatch( &records->Batch );
+    free( records->Lines );
+    free( records->Reply );
+    free( records );
+}
+
+
+static PRECORD_LIST
+BenchNewRecord (
+    __in PBENCH_RECORDS Records
+    )
+{
+    PRECORD_LIST record;
+    ULONG i;
+
+    record = SpyNewRecord( IRP_MJ_WRITE, Records->NameSpace );
+
+    if (record != NULL) {
+
+        for (i = 0; i < 3; i += 1) {
+
+            SpySetRecordName( &record->LogRecord, Records->Names[i] );
+        }
+    }
+
+    return record;
+}
+
+
+static VOID
+BenchSetRecordName (
+    __in PBENCH_STATE State,
+    __in ULONGLONG Iterations
+    )
+{
+    PRECORD_LIST record;
+    ULONG length = 0;
+
+    while (Iterations--) {
+
+        record = BenchNewRecord( State->Context );
+
+        if (record != NULL) {
+
+            length += record->LogRecord.Length;
+            SpyFreeRecord( record );
+        }
+    }
+
+    Sink = length;
+}
+
+
+static ULONG
+BenchFetch (
+    __in PBENCH_RECORDS Records,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Logs Count records and reads them back as minispy does: GetMiniSpyLog,
+    then AckMiniSpyLog for each reply, which returns the next, until the
+    log is empty.  The first reply is left in Records->Reply.
+
+Return Value:
+
+    The length of the first reply, 0 if there was none.
+
+--*/
+{
+    UCHAR message[FIELD_OFFSET(COMMAND_MESSAGE, Data) + sizeof(MINISPY_ACK)];
+    PCOMMAND_MESSAGE command = (PCOMMAND_MESSAGE) message;
+    PMINISPY_ACK ack = (PMINISPY_ACK) command->Data;
+    PRECORD_LIST record;
+    PLOG_RECORD logRecord;
+    PUCHAR reply = Records->Reply;
+    ULONG first = 0;
+    ULONG returned = 0;
+    ULONG offset;
+    ULONG i;
+    NTSTATUS status;
+
+    for (i = 0; i < Count; i += 1) {
+
+        record = BenchNewRecord( Records );
+
+        if (record != NULL) {
+
+            SpyLog( record );
+        }
+    }
+
+    memset( message, 0, sizeof(message) );
+    command->Command = GetMiniSpyLog;
+
+    status = FanSimSendMessage( DriverPort,
+                                command,
+                                FIELD_OFFSET(COMMAND_MESSAGE, Data),
+                                reply,
+                                BENCH_REPLY_SIZE,
+                                &returned );
+
+    while (NT_SUCCESS( status ) && status != STATUS_NO_MORE_ENTRIES && returned > 0) {
+
+        if (first == 0) {
+
+            first = returned;
+        }
+
+        for (offset = 0; offset + sizeof(LOG_RECORD) <= returned; offset += logRecord->Length) {
+
+            logRecord = (PLOG_RECORD)(reply + offset);
+
+            if (logRecord->Length == 0) {
+
+                break;
+            }
+
+            if (FlagOn( logRecord->RecordType, RECORD_TYPE_FLAG_PRIORITY )) {
+
+                ack->Sequence[LOG_QUEUES] = logRecord->SequenceNumber;
+
+            } else if (logRecord->Processor < LOG_QUEUES) {
+
+                ack->Sequence[logRecord->Processor] = logRecord->SequenceNumber;
+            }
+        }
+
+        //
+        //  Later replies go after the first, which the decoding benchmarks
+        //  keep, if there is room, or over the one before.
+        //
+
+        if (reply == Records->Reply) {
+
+            reply += ROUND_TO_SIZE( first, sizeof(PVOID) );
+        }
+
+        if (reply + MAX_LOG_RECORD_LENGTH > Records->Reply + BENCH_REPLY_SIZE) {
+
+            reply = Records->Reply + ROUND_TO_SIZE( first, sizeof(PVOID) );
+        }
+
+        command->Command = AckMiniSpyLog;
+
+        status = FanSimSendMessage( DriverPort,
+                                    command,
+                                    sizeof(message),
+                                    reply,
+                                    (ULONG)(Records->Reply + BENCH_REPLY_SIZE - reply),
+                                    &returned );
+    }
+
+    return first;
+}
+
+
+static BOOLEAN
+BenchGetLogSetup (
+    __in PBENCH_STATE State
+    )
+{
+    ULONG pathLength = State->Args[1];
+
+    State->Args[1] = State->Args[0];
+    State->Args[0] = pathLength;
+
+    if (!BenchRecordsSetup( State )) {
+
+        return FALSE;
+    }
+
+    State->Items = State->Args[1];
+    return TRUE;
+}
+
+
+static VOID
+BenchGetLog (
+    __in PBENCH_STATE State,
+    __in ULONGLONG Iterations
+    )
+{
+    ULONG length = 0;
+
+    while (Iterations--) {
+
+        length += BenchFetch( State->Context, State->Args[1] );
+    }
+
+    Sink = length;
+}
+
+
+static BOOLEAN
+BenchDumpNameCxtLineSetup (
+    __in PBENCH_STATE State
+    )
+/*++
+
+Routine Description:
+
+    The names of a record as they come out of the reply, one to a line.
+
+--*/
+{
+    PBENCH_RECORDS records;
+    ULONG length = 0;
+    ULONG i;
+
+    if (!BenchRecordsSetup( State )) {
+
+        return FALSE;
+    }
+
+    records = State->Context;
+    records->Lines = malloc( 3 * (BENCH_MAX_PATH + 1) * sizeof(WCHAR) + sizeof(WCHAR) );
+
+    for (i = 0; i < 3; i += 1) {
+
+        memcpy( records->Lines + length, records->Names[i]->Buffer, records->Names[i]->Length );
+        length += records->Names[i]->Length / sizeof(WCHAR);
+        records->Lines[length++] = L'\n';
+    }
+
+    records->Lines[length] = UNICODE_NULL;
+    return TRUE;
+}
+
+
+static VOID
+BenchDumpNameCxtLine (
+    __in PBENCH_STATE State,
+    __in ULONGLONG Iterations
+    )
+{
+    PBENCH_RECORDS records = State->Context;
+    PWCHAR next;
+    size_t length;
+    ULONG total = 0;
+    ULONG i;
+
+    while (Iterations--) {
+
+        next = records->Lines;
+
+        for (i = 0; i < 3 && next != NULL; i += 1) {
+
+            length = sizeof(records->Line);
+            next = DumpNameCxtLine( next, records->Line, &length );
+            total += (ULONG) length;
+        }
+    }
+
+    Sink = total;
+}
+
+
+static ULONG
+BenchFormatTime (
+    __in CONST LARGE_INTEGER *Time,
+    __out_bcount(BufferLength) CHAR *Buffer,
+    __in ULONG BufferLength
+    )
+/*++
+
+Routine Description:
+
+    Formats a time as FormatSystemTime does once the record's time has
+    been turned into local time.
+
+--*/
+{
+    struct tm local;
+    time_t seconds = (time_t)(Time->QuadPart / 10000000 - 11644473600LL);
+
+    localtime_r( &seconds, &local );
+
+    return (ULONG) snprintf( Buffer,
+                             BufferLength,
+                             "%04d-%02d-%02d %02d:%02d:%02d",
+                             local.tm_year + 1900,
+                             local.tm_mon + 1,
+                             local.tm_mday,
+                             local.tm_hour,
+                             local.tm_min,
+                             local.tm_sec );
+}
+
+static CONST MSPY_DECODE_HOOKS BenchHooks = { NULL, BenchFormatTime, NULL };
+
+
+static BOOLEAN
+BenchDecodeSetup (
+    __in PBENCH_STATE State
+    )
+/*++
+
+Routine Description:
+
+    A reply of Args[0] records, each named as BenchRecordsSetup names
+    them with a 128 character file name, packed by the driver.
+
+--*/
+{
+    PBENCH_RECORDS records;
+    ULONG count = State->Args[0];
+
+    State->Args[0] = 128;
+
+    if (!BenchRecordsSetup( State )) {
+
+        return FALSE;
+    }
+
+    records = State->Context;
+    records->ReplyLength = BenchFetch( records, count );
+
+    State->Args[0] = count;
+    State->Items = count;
+
+    //
+    //  Every record must have come back on its own, neither coalesced
+    //  nor sampled away, or the items a second would be wrong.
+    //
+
+    return records->ReplyLength > 0 &&
+           MspyDecodeBatch( records->Reply,
+                            records->ReplyLength,
+                            MSPY_FIELD_ALL,
+                            MspyEncodingUtf8,
+                            &BenchHooks,
+                            &records->Batch ) &&
+           records->Batch.Count == count;
+}
+
+
+static VOID
+BenchDecode (
+    __in PBENCH_STATE State,
+    __in ULONGLONG Iterations
+    )
+{
+    PBENCH_RECORDS records = State->Context;
+    ULONG count = 0;
+
+    while (Iterations--) {
+
+        MspyDecodeBatch( records->Reply,
+                         records->ReplyLength,
+                         MSPY_FIELD_ALL,
+                         MspyEncodingUtf8,
+                         &BenchHooks,
+                         &records->Batch );
+
+        count += records->Batch.Count;
+    }
+
+    Sink = count;
+}
+
+
+static VOID
+BenchDecodeNames (
+    __in PBENCH_STATE State,
+    __in ULONGLONG Iterations
+    )
+{
+    PBENCH_RECORDS records = State->Context;
+    ULONG count = 0;
+
+    while (Iterations--) {
+
+        MspyDecodeBatch( records->Reply,
+                         records->ReplyLength,
+                         MSPY_FIELD_FILE_NAME | MSPY_FIELD_PROCESS | MSPY_FIELD_USER,
+                         MspyEncodingUtf8,
+                         &BenchHooks,
+                         &records->Batch );
+
+        count += records->Batch.Count;
+    }
+
+    Sink = count;
+}
+
+//---------------------------------------------------------------------------
+//  The benchmarks
+//---------------------------------------------------------------------------
+
+static CONST BENCH Benchmarks[] = {
+
+    { "FindSubString", { BenchPathLength, BenchNone },
+      BenchFindSubStringSetup, BenchFindSubString, BenchPolicyTeardown },
+
+    { "MatchFolder", { BenchRuleCount, BenchPathLength },
+      BenchMatchFolderSetup, BenchMatchFolder, BenchPolicyTeardown },
+
+    { "MatchProcess", { BenchRuleCount, BenchPathLength },
+      BenchMatchProcessSetup, BenchMatchProcess, BenchPolicyTeardown },
+
+    { "MatchExtension", { BenchRuleCount, BenchNone },
+      BenchMatchExtensionSetup, BenchMatchExtension, BenchPolicyTeardown },
+
+    { "EvaluateRules", { BenchRuleCount, BenchPathLength },
+      BenchEvaluateRulesSetup, BenchEvaluateRules, BenchPolicyTeardown },
+
+    { "SetRecordName", { BenchPathLength, BenchNone },
+      BenchRecordsSetup, BenchSetRecordName, BenchRecordsTeardown },
+
+    { "DumpNameCxtLine", { BenchPathLength, BenchNone },
+      BenchDumpNameCxtLineSetup, BenchDumpNameCxtLine, BenchRecordsTeardown },
+
+    { "GetLog", { BenchBatchSize, BenchPathLength },
+      BenchGetLogSetup, BenchGetLog, BenchRecordsTeardown },
+
+    { "DecodeBatch", { BenchBatchSize, BenchNone },
+      BenchDecodeSetup, BenchDecode, BenchRecordsTeardown },
+
+    { "DecodeBatchNoTime", { BenchBatchSize, BenchNone },
+      BenchDecodeSetup, BenchDecodeNames, BenchRecordsTeardown },
+};
+
+//---------------------------------------------------------------------------
+//  Running them
+//---------------------------------------------------------------------------
+
+static double
+BenchNow (
+    __in clockid_t Clock
+    )
+{
+    struct timespec now;
+
+    clock_gettime( Clock, &now );
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+static int
+BenchCompare (
+    const void *Left,
+    const void *Right
+    )
+{
+    double left = *(const double *) Left;
+    double right = *(const double *) Right;
+
+    return (left > right) - (left < right);
+}
+
+
+static VOID
+BenchMeasure (
+    __in CONST BENCH *Bench,
+    __inout PBENCH_STATE State,
+    __out PBENCH_RESULT Result
+    )
+/*++
+
+Routine Description:
+
+    Warms up, finds how many iterations take MinTime and times that many
+    Repetitions times.
+
+--*/
+{
+    double times[BENCH_MAX_REPETITIONS];
+    double start;
+    double cpuStart;
+    double elapsed;
+    double cpu = 0;
+    double sum = 0;
+    double squares = 0;
+    double multiplier;
+    ULONGLONG iterations;
+    ULONG i;
+
+    //
+    //  Warm up: caches, branch predictors, the pool's free lists.
+    //
+
+    start = BenchNow( CLOCK_MONOTONIC );
+
+    for (iterations = 1; BenchNow( CLOCK_MONOTONIC ) - start < WarmupTime; iterations *= 2) {
+
+        Bench->Run( State, iterations );
+    }
+
+    //
+    //  Grow the iterations until a run takes MinTime, at most tenfold a
+    //  step, as Google Benchmark does.
+    //
+
+    for (iterations = 1;; iterations = (ULONGLONG) ceil( iterations * multiplier )) {
+
+        start = BenchNow( CLOCK_MONOTONIC );
+        Bench->Run( State, iterations );
+        elapsed = BenchNow( CLOCK_MONOTONIC ) - start;
+
+        if (elapsed >= MinTime || iterations >= 1000000000ULL) {
+
+            break;
+        }
+
+        multiplier = elapsed > 0 ? MinTime * 1.4 / elapsed : 10;
+        multiplier = min( max( multiplier, 2.0 ), 10.0 );
+    }
+
+    for (i = 0; i < Repetitions; i += 1) {
+
+        start = BenchNow( CLOCK_MONOTONIC );
+        cpuStart = BenchNow( CLOCK_THREAD_CPUTIME_ID );
+
+        Bench->Run( State, iterations );
+
+        cpu += BenchNow( CLOCK_THREAD_CPUTIME_ID ) - cpuStart;
+        times[i] = (BenchNow( CLOCK_MONOTONIC ) - start) * 1e9 / iterations;
+
+        sum += times[i];
+        squares += times[i] * times[i];
+    }
+
+    qsort( times, Repetitions, sizeof(double), BenchCompare );
+
+    Result->Iterations = iterations;
+    Result->Repetitions = Repetitions;
+    Result->Median = (Repetitions % 2) ? times[Repetitions / 2] :
+                     (times[Repetitions / 2 - 1] + times[Repetitions / 2]) / 2;
+    Result->Mean = sum / Repetitions;
+    Result->Stddev = Repetitions > 1 ?
+                     sqrt( max( (squares - sum * sum / Repetitions) / (Repetitions - 1), 0.0 ) ) : 0;
+    Result->Cpu = cpu * 1e9 / ((double) iterations * Repetitions);
+    Result->ItemsPerSecond = State->Items * 1e9 / Result->Median;
+}
+
+
+static PBENCH_VALUES
+BenchAxisValues (
+    __in BENCH_AXIS Axis
+    )
+{
+    static BENCH_VALUES none = { 1, { 0 } };
+
+    switch (Axis) {
+
+    case BenchPathLength:
+        return &PathLengths;
+
+    case BenchRuleCount:
+        return &RuleCounts;
+
+    case BenchBatchSize:
+        return &BatchSizes;
+
+    default:
+        return &none;
+    }
+}
+
+
+static VOID
+BenchRun (
+    __in CONST BENCH *Bench
+    )
+{
+    PBENCH_VALUES first = BenchAxisValues( Bench->Axes[0] );
+    PBENCH_VALUES second = BenchAxisValues( Bench->Axes[1] );
+    BENCH_STATE state;
+    PBENCH_RESULT result;
+    ULONG i;
+    ULONG j;
+    int length;
+
+    for (i = 0; i < first->Count; i += 1) {
+
+        for (j = 0; j < second->Count; j += 1) {
+
+            if (ResultCount == BENCH_MAX_RESULTS) {
+
+                return;
+            }
+
+            result = &Results[ResultCount];
+            memset( result, 0, sizeof(*result) );
+
+            length = snprintf( result->Name, sizeof(result->Name), "%s", Bench->Name );
+
+            if (Bench->Axes[0] != BenchNone) {
+
+                length += snprintf( result->Name + length, sizeof(result->Name) - length, "/%u", first->Values[i] );
+            }
+
+            if (Bench->Axes[1] != BenchNone) {
+
+                snprintf( result->Name + length, sizeof(result->Name) - length, "/%u", second->Values[j] );
+            }
+
+            if (Filter != NULL && strstr( result->Name, Filter ) == NULL) {
+
+                continue;
+            }
+
+            memset( &state, 0, sizeof(state) );
+            state.Args[0] = first->Values[i];
+            state.Args[1] = second->Values[j];
+            state.Items = 1;
+
+            if (!Bench->Setup( &state )) {
+
+                fprintf( stderr, "mspyBench: %s could not be set up\n", result->Name );
+                continue;
+            }
+
+            BenchMeasure( Bench, &state, result );
+            Bench->Teardown( &state );
+
+            printf( "%-32s %12.1f ns %12.1f ns %10.1f%% %12llu %14.0f/s\n",
+                    result->Name,
+                    result->Median,
+                    result->Cpu,
+                    result->Mean > 0 ? 100 * result->Stddev / result->Mean : 0,
+                    (unsigned long long) result->Iterations,
+                    result->ItemsPerSecond );
+
+            fflush( stdout );
+            ResultCount += 1;
+        }
+    }
+}
+
+
+static BOOLEAN
+BenchWriteJson (
+    __in PCSTR FileName,
+    __in PCSTR Executable
+    )
+{
+    FILE *file = fopen( FileName, "w" );
+    CHAR date[64];
+    CHAR host[256] = "";
+    time_t now = time( NULL );
+    struct tm local;
+    ULONG i;
+
+    if (file == NULL) {
+
+        perror( FileName );
+        return FALSE;
+    }
+
+    localtime_r( &now, &local );
+    strftime( date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &local );
+    gethostname( host, sizeof(host) - 1 );
+
+    fprintf( file, "{\n  \"context\": {\n" );
+    fprintf( file, "    \"date\": \"%s\",\n", date );
+    fprintf( file, "    \"host_name\": \"%s\",\n", host );
+    fprintf( file, "    \"executable\": \"%s\",\n", Executable );
+    fprintf( file, "    \"num_cpus\": %ld,\n", sysconf( _SC_NPROCESSORS_ONLN ) );
+    fprintf( file, "    \"pinned_cpu\": %d,\n", (int) PinnedCpu );
+    fprintf( file, "    \"min_time\": %g,\n", MinTime );
+    fprintf( file, "    \"warmup_time\": %g,\n", WarmupTime );
+    fprintf( file, "    \"repetitions\": %u,\n", Repetitions );
+#ifdef __OPTIMIZE__
+    fprintf( file, "    \"library_build_type\": \"release\"\n" );
+#else
+    fprintf( file, "    \"library_build_type\": \"debug\"\n" );
+#endif
+    fprintf( file, "  },\n  \"benchmarks\": [\n" );
+
+    for (i = 0; i < ResultCount; i += 1) {
+
+        fprintf( file,
+                 "    {\n"
+                 "      \"name\": \"%s\",\n"
+                 "      \"run_type\": \"aggregate\",\n"
+                 "      \"aggregate_name\": \"median\",\n"
+                 "      \"repetitions\": %u,\n"
+                 "      \"iterations\": %llu,\n"
+                 "      \"real_time\": %.3f,\n"
+                 "      \"real_time_mean\": %.3f,\n"
+                 "      \"real_time_stddev\": %.3f,\n"
+                 "      \"cpu_time\": %.3f,\n"
+                 "      \"time_unit\": \"ns\",\n"
+                 "      \"items_per_second\": %.1f\n"
+                 "    }%s\n",
+                 Results[i].Name,
+                 Results[i].Repetitions,
+                 (unsigned long long) Results[i].Iterations,
+                 Results[i].Median,
+                 Results[i].Mean,
+                 Results[i].Stddev,
+                 Results[i].Cpu,
+                 Results[i].ItemsPerSecond,
+                 i + 1 < ResultCount ? "," : "" );
+    }
+
+    fprintf( file, "  ]\n}\n" );
+
+    return fclose( file ) == 0;
+}
+
+
+static BOOLEAN
+BenchParseValues (
+    __in PCSTR Text,
+    __out PBENCH_VALUES Values
+    )
+{
+    PCHAR end;
+
+    Values->Count = 0;
+
+    while (*Text != '\0' && Values->Count < BENCH_MAX_VALUES) {
+
+        Values->Values[Values->Count] = (ULONG) strtoul( Text, &end, 10 );
+
+        if (end == Text || Values->Values[Values->Count] == 0) {
+
+            return FALSE;
+        }
+
+        Values->Count += 1;
+        Text = (*end == ',') ? end + 1 : end;
+    }
+
+    return Values->Count > 0 && *Text == '\0';
+}
+
+
+static BOOLEAN
+BenchPin (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Pins the thread to PinnedCpu, or to the first processor it may run on
+    if PinnedCpu is not set.
+
+--*/
+{
+    cpu_set_t set;
+    LONG cpu;
+
+    if (PinnedCpu == -1) {
+
+        return TRUE;
+    }
+
+    if (PinnedCpu < -1) {
+
+        if (sched_getaffinity( 0, sizeof(set), &set ) != 0) {
+
+            return FALSE;
+        }
+
+        for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET( cpu, &set ); cpu += 1) {
+        }
+
+        PinnedCpu = cpu;
+    }
+
+    CPU_ZERO( &set );
+    CPU_SET( PinnedCpu, &set );
+
+    return sched_setaffinity( 0, sizeof(set), &set ) == 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    BOOLEAN valid = TRUE;
+    PCSTR value;
+    ULONG i;
+
+    PinnedCpu = -2;
+
+    for (i = 1; i < (ULONG) argc && valid; i += 1) {
+
+        value = strchr( argv[i], '=' );
+        value = value ? value + 1 : "";
+
+        if (strncmp( argv[i], "--filter=", 9 ) == 0) {
+
+            Filter = value;
+
+        } else if (strncmp( argv[i], "--path-lengths=", 15 ) == 0) {
+
+            valid = BenchParseValues( value, &PathLengths );
+
+        } else if (strncmp( argv[i], "--rule-counts=", 14 ) == 0) {
+
+            valid = BenchParseValues( value, &RuleCounts );
+
+        } else if (strncmp( argv[i], "--batch-sizes=", 14 ) == 0) {
+
+            valid = BenchParseValues( value, &BatchSizes );
+
+        } else if (strncmp( argv[i], "--min-time=", 11 ) == 0) {
+
+            MinTime = atof( value );
+            valid = MinTime > 0;
+
+        } else if (strncmp( argv[i], "--warmup=", 9 ) == 0) {
+
+            WarmupTime = atof( value );
+            valid = WarmupTime >= 0;
+
+        } else if (strncmp( argv[i], "--repetitions=", 14 ) == 0) {
+
+            Repetitions = (ULONG) atoi( value );
+            valid = Repetitions > 0 && Repetitions <= BENCH_MAX_REPETITIONS;
+
+        } else if (strncmp( argv[i], "--cpu=", 6 ) == 0) {
+
+            PinnedCpu = atoi( value );
+            valid = PinnedCpu >= -1 && PinnedCpu < CPU_SETSIZE;
+
+        } else if (strncmp( argv[i], "--json=", 7 ) == 0) {
+
+            JsonFile = value;
+
+        } else {
+
+            valid = FALSE;
+        }
+    }
+
+    if (!valid) {
+
+        fprintf( stderr,
+                 "usage: mspyBench [--filter=text] [--path-lengths=n,...] [--rule-counts=n,...]\n"
+                 "                 [--batch-sizes=n,...] [--min-time=seconds] [--warmup=seconds]\n"
+                 "                 [--repetitions=n] [--cpu=n] [--json=file]\n" );
+        return 2;
+    }
+
+    if (!BenchPin()) {
+
+        perror( "mspyBench: pinning" );
+        return 1;
+    }
+
+    FanSimSetProcessor( 0 );
+
+    printf( "%-32s %15s %15s %11s %12s %16s\n",
+            "Benchmark", "Time", "CPU", "Spread", "Iterations", "Items" );
+
+    for (i = 0; i < sizeof(Benchmarks) / sizeof(Benchmarks[0]); i += 1) {
+
+        BenchRun( &Benchmarks[i] );
+    }
+
+    BenchUnloadDriver();
+
+    if (JsonFile != NULL && !BenchWriteJson( JsonFile, argv[0] )) {
+
+        return 1;
+    }
+
+    return 0;
+}
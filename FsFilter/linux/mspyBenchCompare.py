@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+#
+#   Compares two runs of mspyBench --json, or of anything else writing
+#   Google Benchmark's JSON, benchmark by benchmark:
+#
+#       mspyBenchCompare.py [--threshold=percent] baseline.json current.json
+#
+#   Prints each benchmark's time in both and the change, and exits with 1
+#   if any benchmark in both is more than threshold percent (25 if not
+#   given) slower than in the baseline.  Benchmarks in only one of them
+#   are listed but do not fail the comparison.
+#
+
+import json
+import sys
+
+
+def load(path):
+    with open(path) as file:
+        report = json.load(file)
+
+    times = {}
+
+    for benchmark in report.get("benchmarks", []):
+        if benchmark.get("run_type") == "aggregate" and benchmark.get("aggregate_name") != "median":
+            continue
+
+        times[benchmark["name"]] = benchmark["real_time"]
+
+    return report.get("context", {}), times
+
+
+def main(argv):
+    threshold = 25.0
+    paths = []
+
+    for arg in argv[1:]:
+        if arg.startswith("--threshold="):
+            threshold = float(arg.split("=", 1)[1])
+        else:
+            paths.append(arg)
+
+    if len(paths) != 2:
+        sys.stderr.write("usage: mspyBenchCompare.py [--threshold=percent] baseline.json current.json\n")
+        return 2
+
+    baselineContext, baseline = load(paths[0])
+    currentContext, current = load(paths[1])
+
+    for key in ("host_name", "library_build_type", "pinned_cpu"):
+        if baselineContext.get(key) != currentContext.get(key):
+            print("note: %s differs: %s, now %s" % (key, baselineContext.get(key), currentContext.get(key)))
+
+    print("%-32s %14s %14s %9s" % ("Benchmark", "Baseline", "Current", "Change"))
+
+    regressions = []
+
+    for name in current:
+        if name not in baseline:
+            print("%-32s %14s %11.1f ns %9s" % (name, "-", current[name], "new"))
+            continue
+
+        change = 100.0 * (current[name] - baseline[name]) / baseline[name] if baseline[name] else 0.0
+        mark = ""
+
+        if change > threshold:
+            regressions.append(name)
+            mark = "  slower"
+
+        print("%-32s %11.1f ns %11.1f ns %+8.1f%%%s" % (name, baseline[name], current[name], change, mark))
+
+    for name in baseline:
+        if name not in current:
+            print("%-32s %11.1f ns %14s %9s" % (name, baseline[name], "-", "gone"))
+
+    if regressions:
+        print("%d of %d benchmarks more than %g%% slower than the baseline" %
+              (len(regressions), len(current), threshold))
+        return 1
+
+    print("no benchmark more than %g%% slower than the baseline" % threshold)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,78 @@
+/*++
+
+Module Name:
+
+    Ntstrsafe.h
+
+Abstract:
+
+    Stands in for the WDK's Ntstrsafe.h.  Declares the bounded string
+    routines the driver calls; they are in fanShim.c.
+
+    The formatting routines take the format specifications the driver
+    uses: flags '-' and '0', a width, the h, l, ll and I64 size prefixes
+    and the conversions d, i, u, x, X, c, p, s (a wide string) and S (a
+    narrow one).
+
+Environment:
+
+    User mode, Linux
+
+--*/
+#ifndef __FAN_NTSTRSAFE_H__
+#define __FAN_NTSTRSAFE_H__
+
+#include <fltKernel.h>
+
+#define NTSTRSAFE_MAX_CCH           2147483647
+
+#define STRSAFE_IGNORE_NULLS        0x00000100
+#define STRSAFE_FILL_BEHIND_NULL    0x00000200
+#define STRSAFE_NULL_ON_FAILURE     0x00000400
+#define STRSAFE_NO_TRUNCATION       0x00001000
+
+typedef WCHAR *NTSTRSAFE_PWSTR;
+typedef CONST WCHAR *NTSTRSAFE_PCWSTR;
+
+NTSTATUS
+RtlStringCbPrintfW (
+    __out_bcount(cbDest) NTSTRSAFE_PWSTR pszDest,
+    __in size_t cbDest,
+    __in NTSTRSAFE_PCWSTR pszFormat,
+    ...
+    );
+
+NTSTATUS
+RtlStringCbPrintfExW (
+    __out_bcount(cbDest) NTSTRSAFE_PWSTR pszDest,
+    __in size_t cbDest,
+    __deref_opt_out NTSTRSAFE_PWSTR *ppszDestEnd,
+    __out_opt size_t *pcbRemaining,
+    __in ULONG dwFlags,
+    __in NTSTRSAFE_PCWSTR pszFormat,
+    ...
+    );
+
+NTSTATUS
+RtlStringCbVPrintfW (
+    __out_bcount(cbDest) NTSTRSAFE_PWSTR pszDest,
+    __in size_t cbDest,
+    __in NTSTRSAFE_PCWSTR pszFormat,
+    __in va_list argList
+    );
+
+NTSTATUS
+RtlStringCbCopyW (
+    __out_bcount(cbDest) NTSTRSAFE_PWSTR pszDest,
+    __in size_t cbDest,
+    __in NTSTRSAFE_PCWSTR pszSrc
+    );
+
+NTSTATUS
+RtlStringCbLengthW (
+    __in NTSTRSAFE_PCWSTR psz,
+    __in size_t cbMax,
+    __out_opt size_t *pcbLength
+    );
+
+#endif //__FAN_NTSTRSAFE_H__
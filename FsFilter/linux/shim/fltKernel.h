@@ -0,0 +1,2110 @@
+/*++
+
+Module Name:
+
+    fltKernel.h
+
+Abstract:
+
+    Stands in for the WDK's fltKernel.h on Linux.  ../filter/Policy.c is
+    built against it into the Linux backend, so that the backend decides
+    with the very code the driver does, and the whole driver is built
+    against it into fanSim, where fanShim.c plays the kernel and the
+    filter manager beneath it, see fanSim.h.
+
+    It declares the part of the kernel and filter manager interfaces the
+    driver sources use, with the names, types and meanings they have in
+    the WDK.  Structures are cut down to the fields the driver reads;
+    the objects only the kernel looks into (volumes, instances, ports,
+    processes and tokens) are opaque here as they are there.
+
+    The driver's strings are UTF-16.  fanSim builds with -fshort-wchar so
+    that L"" literals are too, and then the few C library wide string
+    routines the driver calls are replaced by ones that count 16 bit
+    characters.  Policy.c alone builds either way.
+
+    Structured exception handling has no C equivalent.  try/finally runs
+    its finally block when the try block ends or leaves; try/except
+    never takes the handler, as nothing in fanSim raises.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+#ifndef __FAN_FLTKERNEL_H__
+#define __FAN_FLTKERNEL_H__
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include "mspyTypes.h"
+
+//---------------------------------------------------------------------------
+//  Compiler and build environment
+//---------------------------------------------------------------------------
+
+#define __in_bcount_opt(x)
+#define __inout_bcount(x)
+#define __out_bcount_opt(x)
+#define __out_bcount_part(x,y)
+#define __out_bcount_part_opt(x,y)
+#define __in_ecount_opt(x)
+#define __deref_out_opt
+#define __deref_opt_out
+#define __deref_out_ecount(x)
+#define __drv_maxIRQL(x)
+#define _IRQL_requires_max_(x)
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define NTAPI
+#define NTKERNELAPI
+#define NTSYSAPI
+#define FLTAPI
+#define __fastcall
+#define __inline            inline
+#define FORCEINLINE         static inline
+
+#define DECLSPEC_ALIGN(x)   __attribute__((aligned(x)))
+
+#define C_ASSERT(e)         _Static_assert( (e), #e )
+
+#define UNREFERENCED_PARAMETER(P)   ((void)(P))
+#define NOTHING
+
+#if defined(__LP64__)
+#define _WIN64
+#endif
+
+#define NTDDI_WIN2K         0x05000000
+#define NTDDI_WINXP         0x05010000
+#define NTDDI_VISTA         0x06000000
+#define NTDDI_WIN7          0x06010000
+#define NTDDI_VERSION       NTDDI_WIN7
+#define OSVER(Version)      ((Version) & 0xFFFF0000)
+
+#define try                 if (1)
+#define leave               goto FanFinally
+#define finally             FanFinally:
+#define except(Filter)      else if (0)
+
+#define EXCEPTION_EXECUTE_HANDLER       1
+#define EXCEPTION_CONTINUE_SEARCH       0
+
+#define GetExceptionCode()  STATUS_ACCESS_VIOLATION
+
+#define PAGED_CODE()
+
+#ifndef min
+#define min(a,b)            (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b)            (((a) > (b)) ? (a) : (b))
+#endif
+
+//---------------------------------------------------------------------------
+//  Base types
+//---------------------------------------------------------------------------
+
+typedef const char *PCSTR;
+typedef char *PSTR;
+typedef char CCHAR;
+typedef int16_t SHORT, CSHORT, *PSHORT;
+typedef int INT;
+typedef unsigned int UINT;
+typedef intptr_t LONG_PTR, *PLONG_PTR;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+typedef size_t SIZE_T, *PSIZE_T;
+typedef int64_t LONG64, *PLONG64;
+typedef uint64_t ULONG64, *PULONG64;
+typedef ULONG ACCESS_MASK, *PACCESS_MASK;
+typedef ULONG DEVICE_TYPE;
+typedef ULONG CLONG;
+typedef PVOID HANDLE, *PHANDLE;
+typedef PVOID *PPVOID;
+
+typedef WCHAR *PWCH, *PWSTR, *LPWSTR;
+typedef CONST WCHAR *PCWCH, *PCWSTR, *LPCWSTR;
+
+//
+//  minispy.h declares NTSTATUS the same way.
+//
+
+typedef LONG NTSTATUS, *PNTSTATUS;
+
+#define NT_SUCCESS(Status)          ((NTSTATUS)(Status) >= 0)
+
+#define MAXUCHAR                    0xff
+#define MAXUSHORT                   0xffff
+#define MAXULONG                    0xffffffff
+#define MAXLONG                     0x7fffffff
+
+#define ANYSIZE_ARRAY               1
+
+#define MAX_PATH                    260
+
+#define ANSI_NULL                   ((CHAR)0)
+
+//
+//  ASSERT and NT_ASSERT check in fanSim whatever the build, as they do
+//  in a checked build of the driver.
+//
+
+VOID
+FanAssertFailed (
+    __in PCSTR Expression,
+    __in PCSTR File,
+    __in ULONG Line
+    );
+
+#define ASSERT(e)           ((e) ? (void)0 : FanAssertFailed( #e, __FILE__, __LINE__ ))
+#define NT_ASSERT(e)        ASSERT(e)
+
+typedef struct _LUID {
+    ULONG LowPart;
+    LONG HighPart;
+} LUID, *PLUID;
+
+typedef struct _SINGLE_LIST_ENTRY {
+    struct _SINGLE_LIST_ENTRY *Next;
+} SINGLE_LIST_ENTRY, *PSINGLE_LIST_ENTRY;
+
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *)((PCHAR)(address) - (ULONG_PTR)(&((type *)0)->field)))
+
+#define IS_ALIGNED(Pointer, Alignment) \
+    ((((ULONG_PTR)(Pointer)) & ((Alignment) - 1)) == 0)
+
+#define Add2Ptr(P,I)                ((PVOID)((PUCHAR)(P) + (I)))
+
+#define ROUND_TO_SIZE(_length, _alignment) \
+    ((((ULONG_PTR)(_length)) + ((_alignment) - 1)) & ~(ULONG_PTR)((_alignment) - 1))
+
+#define ALIGN_UP_BY(Length, Alignment) \
+    (((ULONG_PTR)(Length) + (Alignment) - 1) & ~((ULONG_PTR)(Alignment) - 1))
+
+#define FlagOn(_F,_SF)              ((_F) & (_SF))
+#define SetFlag(_F,_SF)             ((_F) |= (_SF))
+#define ClearFlag(_F,_SF)           ((_F) &= ~(_SF))
+
+#define RtlZeroMemory(Destination, Length)          memset( (Destination), 0, (Length) )
+#define RtlFillMemory(Destination, Length, Fill)    memset( (Destination), (Fill), (Length) )
+#define RtlCopyMemory(Destination, Source, Length)  memcpy( (Destination), (Source), (Length) )
+#define RtlMoveMemory(Destination, Source, Length)  memmove( (Destination), (Source), (Length) )
+#define RtlEqualMemory(Source1, Source2, Length)    (memcmp( (Source1), (Source2), (Length) ) == 0)
+
+SIZE_T
+RtlCompareMemory (
+    __in CONST VOID *Source1,
+    __in CONST VOID *Source2,
+    __in SIZE_T Length
+    );
+
+//---------------------------------------------------------------------------
+//  Status codes
+//---------------------------------------------------------------------------
+
+#define STATUS_SUCCESS                      ((NTSTATUS)0x00000000L)
+#define STATUS_PENDING                      ((NTSTATUS)0x00000103L)
+#define STATUS_REPARSE                      ((NTSTATUS)0x00000104L)
+#define STATUS_BUFFER_OVERFLOW              ((NTSTATUS)0x80000005L)
+#define STATUS_NO_MORE_ENTRIES              ((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL                 ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED              ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_INFO_CLASS           ((NTSTATUS)0xC0000003L)
+#define STATUS_INFO_LENGTH_MISMATCH         ((NTSTATUS)0xC0000004L)
+#define STATUS_ACCESS_VIOLATION             ((NTSTATUS)0xC0000005L)
+#define STATUS_INVALID_HANDLE               ((NTSTATUS)0xC0000008L)
+#define STATUS_INVALID_CID                  ((NTSTATUS)0xC000000BL)
+#define STATUS_INVALID_PARAMETER            ((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST       ((NTSTATUS)0xC0000010L)
+#define STATUS_END_OF_FILE                  ((NTSTATUS)0xC0000011L)
+#define STATUS_NO_MEMORY                    ((NTSTATUS)0xC0000017L)
+#define STATUS_ACCESS_DENIED                ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL             ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_TYPE_MISMATCH         ((NTSTATUS)0xC0000024L)
+#define STATUS_OBJECT_NAME_INVALID          ((NTSTATUS)0xC0000033L)
+#define STATUS_OBJECT_NAME_NOT_FOUND        ((NTSTATUS)0xC0000034L)
+#define STATUS_OBJECT_NAME_COLLISION        ((NTSTATUS)0xC0000035L)
+#define STATUS_PORT_DISCONNECTED            ((NTSTATUS)0xC0000037L)
+#define STATUS_OBJECT_PATH_NOT_FOUND        ((NTSTATUS)0xC000003AL)
+#define STATUS_DELETE_PENDING               ((NTSTATUS)0xC0000056L)
+#define STATUS_INSUFFICIENT_RESOURCES       ((NTSTATUS)0xC000009AL)
+#define STATUS_DATATYPE_MISALIGNMENT        ((NTSTATUS)0x80000002L)
+#define STATUS_INVALID_USER_BUFFER          ((NTSTATUS)0xC00000E8L)
+#define STATUS_FILE_IS_A_DIRECTORY          ((NTSTATUS)0xC00000BAL)
+#define STATUS_NOT_SUPPORTED                ((NTSTATUS)0xC00000BBL)
+#define STATUS_DIRECTORY_NOT_EMPTY          ((NTSTATUS)0xC0000101L)
+#define STATUS_CANNOT_DELETE                ((NTSTATUS)0xC0000121L)
+#define STATUS_NOT_A_DIRECTORY              ((NTSTATUS)0xC0000103L)
+#define STATUS_INTERNAL_ERROR               ((NTSTATUS)0xC00000E5L)
+#define STATUS_CANCELLED                    ((NTSTATUS)0xC0000120L)
+#define STATUS_CONNECTION_COUNT_LIMIT       ((NTSTATUS)0xC0000246L)
+#define STATUS_NOT_FOUND                    ((NTSTATUS)0xC0000225L)
+#define STATUS_FAIL_CHECK                   ((NTSTATUS)0xC0000229L)
+#define STATUS_FLT_NO_HANDLER_DEFINED       ((NTSTATUS)0xC01C0001L)
+#define STATUS_FLT_CONTEXT_ALREADY_DEFINED  ((NTSTATUS)0xC01C0002L)
+#define STATUS_FLT_INVALID_NAME_REQUEST     ((NTSTATUS)0xC01C0005L)
+#define STATUS_FLT_NOT_INITIALIZED          ((NTSTATUS)0xC01C0007L)
+#define STATUS_FLT_DO_NOT_ATTACH            ((NTSTATUS)0xC01C000FL)
+#define STATUS_FLT_DELETING_OBJECT          ((NTSTATUS)0xC01C000BL)
+#define STATUS_FLT_CONTEXT_ALLOCATION_NOT_FOUND ((NTSTATUS)0xC01C0016L)
+#define STATUS_FLT_ALREADY_ENLISTED         ((NTSTATUS)0xC01C001BL)
+
+//---------------------------------------------------------------------------
+//  Strings
+//---------------------------------------------------------------------------
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCH Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef CONST UNICODE_STRING *PCUNICODE_STRING;
+
+typedef struct _STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PCHAR Buffer;
+} STRING, ANSI_STRING, *PSTRING, *PANSI_STRING;
+
+#define RTL_CONSTANT_STRING(s) \
+    { sizeof( s ) - sizeof( (s)[0] ), sizeof( s ), (PWCH)(s) }
+
+VOID
+RtlInitUnicodeString (
+    __out PUNICODE_STRING DestinationString,
+    __in_opt PCWSTR SourceString
+    );
+
+FORCEINLINE
+VOID
+RtlInitEmptyUnicodeString (
+    __out PUNICODE_STRING UnicodeString,
+    __in_opt PWCHAR Buffer,
+    __in USHORT BufferSize
+    )
+{
+    UnicodeString->Length = 0;
+    UnicodeString->MaximumLength = BufferSize;
+    UnicodeString->Buffer = Buffer;
+}
+
+VOID
+RtlCopyUnicodeString (
+    __inout PUNICODE_STRING DestinationString,
+    __in_opt PCUNICODE_STRING SourceString
+    );
+
+NTSTATUS
+RtlAppendUnicodeToString (
+    __inout PUNICODE_STRING Destination,
+    __in_opt PCWSTR Source
+    );
+
+NTSTATUS
+RtlAppendUnicodeStringToString (
+    __inout PUNICODE_STRING Destination,
+    __in PCUNICODE_STRING Source
+    );
+
+LONG
+RtlCompareUnicodeString (
+    __in PCUNICODE_STRING String1,
+    __in PCUNICODE_STRING String2,
+    __in BOOLEAN CaseInSensitive
+    );
+
+BOOLEAN
+RtlEqualUnicodeString (
+    __in CONST UNICODE_STRING *String1,
+    __in CONST UNICODE_STRING *String2,
+    __in BOOLEAN CaseInSensitive
+    );
+
+BOOLEAN
+RtlPrefixUnicodeString (
+    __in PCUNICODE_STRING String1,
+    __in PCUNICODE_STRING String2,
+    __in BOOLEAN CaseInSensitive
+    );
+
+WCHAR
+RtlUpcaseUnicodeChar (
+    __in WCHAR SourceCharacter
+    );
+
+NTSTATUS
+RtlUpcaseUnicodeString (
+    __inout PUNICODE_STRING DestinationString,
+    __in PCUNICODE_STRING SourceString,
+    __in BOOLEAN AllocateDestinationString
+    );
+
+VOID
+RtlFreeUnicodeString (
+    __inout PUNICODE_STRING UnicodeString
+    );
+
+int
+_wcsnicmp (
+    __in CONST WCHAR *String1,
+    __in CONST WCHAR *String2,
+    __in size_t Count
+    );
+
+//
+//  With 16 bit wchar_t the C library's wide string routines, which count
+//  32 bit characters, would misread the driver's strings.
+//
+
+#if __SIZEOF_WCHAR_T__ == 2
+
+size_t
+FanWcslen (
+    __in CONST WCHAR *String
+    );
+
+WCHAR *
+FanWcschr (
+    __in CONST WCHAR *String,
+    __in WCHAR Character
+    );
+
+#define wcslen(s)           FanWcslen( (CONST WCHAR *)(s) )
+#define wcschr(s,c)         FanWcschr( (CONST WCHAR *)(s), (c) )
+
+#endif
+
+//
+//  The wildcards FsRtlIsNameInExpression knows besides '*' and '?'.
+//
+
+#define DOS_STAR                    ((WCHAR)'<')
+#define DOS_QM                      ((WCHAR)'>')
+#define DOS_DOT                     ((WCHAR)'"')
+
+BOOLEAN
+FsRtlIsNameInExpression (
+    __in PUNICODE_STRING Expression,
+    __in PUNICODE_STRING Name,
+    __in BOOLEAN IgnoreCase,
+    __in_opt PWCH UpcaseTable
+    );
+
+//---------------------------------------------------------------------------
+//  Security identifiers and tokens
+//---------------------------------------------------------------------------
+
+typedef PVOID PSID;
+typedef PVOID PACCESS_TOKEN;
+typedef PVOID PSECURITY_DESCRIPTOR;
+
+typedef struct _SID_IDENTIFIER_AUTHORITY {
+    UCHAR Value[6];
+} SID_IDENTIFIER_AUTHORITY, *PSID_IDENTIFIER_AUTHORITY;
+
+typedef struct _SID {
+    UCHAR Revision;
+    UCHAR SubAuthorityCount;
+    SID_IDENTIFIER_AUTHORITY IdentifierAuthority;
+    ULONG SubAuthority[1];
+} SID, *PISID;
+
+#define SID_REVISION                1
+#define SID_MAX_SUB_AUTHORITIES     15
+
+typedef enum _SID_NAME_USE {
+    SidTypeUser = 1,
+    SidTypeGroup,
+    SidTypeDomain,
+    SidTypeAlias,
+    SidTypeWellKnownGroup,
+    SidTypeDeletedAccount,
+    SidTypeInvalid,
+    SidTypeUnknown,
+    SidTypeComputer,
+    SidTypeLabel
+} SID_NAME_USE, *PSID_NAME_USE;
+
+typedef struct _SID_AND_ATTRIBUTES {
+    PSID Sid;
+    ULONG Attributes;
+} SID_AND_ATTRIBUTES, *PSID_AND_ATTRIBUTES;
+
+#define SE_GROUP_MANDATORY          0x00000001L
+#define SE_GROUP_ENABLED_BY_DEFAULT 0x00000002L
+#define SE_GROUP_ENABLED            0x00000004L
+#define SE_GROUP_OWNER              0x00000008L
+#define SE_GROUP_USE_FOR_DENY_ONLY  0x00000010L
+
+typedef struct _TOKEN_USER {
+    SID_AND_ATTRIBUTES User;
+} TOKEN_USER, *PTOKEN_USER;
+
+typedef struct _TOKEN_GROUPS {
+    ULONG GroupCount;
+    SID_AND_ATTRIBUTES Groups[1];
+} TOKEN_GROUPS, *PTOKEN_GROUPS;
+
+typedef struct _TOKEN_OWNER {
+    PSID Owner;
+} TOKEN_OWNER, *PTOKEN_OWNER;
+
+typedef enum _TOKEN_INFORMATION_CLASS {
+    TokenUser = 1,
+    TokenGroups,
+    TokenPrivileges,
+    TokenOwner,
+    TokenPrimaryGroup
+} TOKEN_INFORMATION_CLASS, *PTOKEN_INFORMATION_CLASS;
+
+typedef struct _SECURITY_SUBJECT_CONTEXT {
+    PACCESS_TOKEN ClientToken;
+    ULONG ImpersonationLevel;
+    PACCESS_TOKEN PrimaryToken;
+    PVOID ProcessAuditId;
+} SECURITY_SUBJECT_CONTEXT, *PSECURITY_SUBJECT_CONTEXT;
+
+typedef struct _ACCESS_STATE {
+    LUID OperationID;
+    BOOLEAN SecurityEvaluated;
+    BOOLEAN GenerateAudit;
+    BOOLEAN GenerateOnClose;
+    BOOLEAN PrivilegesAllocated;
+    ULONG Flags;
+    ACCESS_MASK RemainingDesiredAccess;
+    ACCESS_MASK PreviouslyGrantedAccess;
+    ACCESS_MASK OriginalDesiredAccess;
+    SECURITY_SUBJECT_CONTEXT SubjectSecurityContext;
+} ACCESS_STATE, *PACCESS_STATE;
+
+typedef struct _SECURITY_USER_DATA {
+    UNICODE_STRING UserName;
+    UNICODE_STRING LogonDomainName;
+    UNICODE_STRING LogonServer;
+    PSID pSid;
+} SECURITY_USER_DATA, *PSECURITY_USER_DATA, SecurityUserData, *PSecurityUserData;
+
+#define UNDERSTANDS_LONG_NAMES      1
+
+ULONG
+RtlLengthRequiredSid (
+    __in ULONG SubAuthorityCount
+    );
+
+ULONG
+RtlLengthSid (
+    __in PSID Sid
+    );
+
+BOOLEAN
+RtlValidSid (
+    __in PSID Sid
+    );
+
+BOOLEAN
+RtlEqualSid (
+    __in PSID Sid1,
+    __in PSID Sid2
+    );
+
+NTSTATUS
+RtlConvertSidToUnicodeString (
+    __inout PUNICODE_STRING UnicodeString,
+    __in PSID Sid,
+    __in BOOLEAN AllocateDestinationString
+    );
+
+//---------------------------------------------------------------------------
+//  Access rights
+//---------------------------------------------------------------------------
+
+#define DELETE                      0x00010000L
+#define READ_CONTROL                0x00020000L
+#define WRITE_DAC                   0x00040000L
+#define WRITE_OWNER                 0x00080000L
+#define SYNCHRONIZE                 0x00100000L
+#define STANDARD_RIGHTS_REQUIRED    0x000F0000L
+#define STANDARD_RIGHTS_READ        READ_CONTROL
+#define STANDARD_RIGHTS_ALL         0x001F0000L
+#define MAXIMUM_ALLOWED             0x02000000L
+#define GENERIC_READ                0x80000000L
+#define GENERIC_WRITE               0x40000000L
+#define GENERIC_EXECUTE             0x20000000L
+#define GENERIC_ALL                 0x10000000L
+
+#define FILE_READ_DATA              0x0001
+#define FILE_LIST_DIRECTORY         0x0001
+#define FILE_WRITE_DATA             0x0002
+#define FILE_ADD_FILE               0x0002
+#define FILE_APPEND_DATA            0x0004
+#define FILE_READ_EA                0x0008
+#define FILE_WRITE_EA               0x0010
+#define FILE_EXECUTE                0x0020
+#define FILE_DELETE_CHILD           0x0040
+#define FILE_READ_ATTRIBUTES        0x0080
+#define FILE_WRITE_ATTRIBUTES       0x0100
+
+#define FILE_ALL_ACCESS             (STANDARD_RIGHTS_REQUIRED | SYNCHRONIZE | 0x1FF)
+#define FILE_GENERIC_READ           (READ_CONTROL | FILE_READ_DATA | FILE_READ_ATTRIBUTES | \
+                                     FILE_READ_EA | SYNCHRONIZE)
+#define FILE_GENERIC_WRITE          (READ_CONTROL | FILE_WRITE_DATA | FILE_WRITE_ATTRIBUTES | \
+                                     FILE_WRITE_EA | FILE_APPEND_DATA | SYNCHRONIZE)
+#define FILE_GENERIC_EXECUTE        (READ_CONTROL | FILE_READ_ATTRIBUTES | FILE_EXECUTE | \
+                                     SYNCHRONIZE)
+
+#define KEY_QUERY_VALUE             0x0001
+#define KEY_SET_VALUE               0x0002
+#define KEY_ENUMERATE_SUB_KEYS      0x0008
+#define KEY_NOTIFY                  0x0010
+#define KEY_READ                    ((STANDARD_RIGHTS_READ | KEY_QUERY_VALUE | \
+                                      KEY_ENUMERATE_SUB_KEYS | KEY_NOTIFY) & ~SYNCHRONIZE)
+#define KEY_WRITE                   0x20006
+
+#define TOKEN_QUERY                 0x0008
+
+#define PROCESS_QUERY_INFORMATION   0x0400
+
+//---------------------------------------------------------------------------
+//  Objects, handles and the registry
+//---------------------------------------------------------------------------
+
+typedef struct _OBJECT_ATTRIBUTES {
+    ULONG Length;
+    HANDLE RootDirectory;
+    PUNICODE_STRING ObjectName;
+    ULONG Attributes;
+    PVOID SecurityDescriptor;
+    PVOID SecurityQualityOfService;
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define OBJ_INHERIT                 0x00000002L
+#define OBJ_CASE_INSENSITIVE        0x00000040L
+#define OBJ_KERNEL_HANDLE           0x00000200L
+
+#define InitializeObjectAttributes( p, n, a, r, s ) {   \
+    (p)->Length = sizeof( OBJECT_ATTRIBUTES );          \
+    (p)->RootDirectory = r;                             \
+    (p)->Attributes = a;                                \
+    (p)->ObjectName = n;                                \
+    (p)->SecurityDescriptor = s;                        \
+    (p)->SecurityQualityOfService = NULL;               \
+    }
+
+typedef struct _OBJECT_NAME_INFORMATION {
+    UNICODE_STRING Name;
+} OBJECT_NAME_INFORMATION, *POBJECT_NAME_INFORMATION;
+
+typedef PVOID POBJECT_TYPE;
+
+typedef enum _MODE {
+    KernelMode,
+    UserMode,
+    MaximumMode
+} MODE;
+
+typedef CCHAR KPROCESSOR_MODE;
+
+NTSTATUS
+ObOpenObjectByPointer (
+    __in PVOID Object,
+    __in ULONG HandleAttributes,
+    __in_opt PACCESS_STATE PassedAccessState,
+    __in ACCESS_MASK DesiredAccess,
+    __in_opt POBJECT_TYPE ObjectType,
+    __in KPROCESSOR_MODE AccessMode,
+    __out PHANDLE Handle
+    );
+
+VOID
+ObfDereferenceObject (
+    __in PVOID Object
+    );
+
+#define ObDereferenceObject(Object) ObfDereferenceObject( Object )
+
+NTSTATUS
+ZwClose (
+    __in HANDLE Handle
+    );
+
+#define REG_NONE                    0
+#define REG_SZ                      1
+#define REG_EXPAND_SZ               2
+#define REG_BINARY                  3
+#define REG_DWORD                   4
+#define REG_MULTI_SZ                7
+
+typedef enum _KEY_VALUE_INFORMATION_CLASS {
+    KeyValueBasicInformation,
+    KeyValueFullInformation,
+    KeyValuePartialInformation
+} KEY_VALUE_INFORMATION_CLASS;
+
+typedef struct _KEY_VALUE_PARTIAL_INFORMATION {
+    ULONG TitleIndex;
+    ULONG Type;
+    ULONG DataLength;
+    UCHAR Data[1];
+} KEY_VALUE_PARTIAL_INFORMATION, *PKEY_VALUE_PARTIAL_INFORMATION;
+
+NTSTATUS
+ZwOpenKey (
+    __out PHANDLE KeyHandle,
+    __in ACCESS_MASK DesiredAccess,
+    __in POBJECT_ATTRIBUTES ObjectAttributes
+    );
+
+NTSTATUS
+ZwQueryValueKey (
+    __in HANDLE KeyHandle,
+    __in PUNICODE_STRING ValueName,
+    __in KEY_VALUE_INFORMATION_CLASS KeyValueInformationClass,
+    __out_bcount_opt(Length) PVOID KeyValueInformation,
+    __in ULONG Length,
+    __out PULONG ResultLength
+    );
+
+NTSTATUS
+ZwSetValueKey (
+    __in HANDLE KeyHandle,
+    __in PUNICODE_STRING ValueName,
+    __in_opt ULONG TitleIndex,
+    __in ULONG Type,
+    __in_bcount_opt(DataSize) PVOID Data,
+    __in ULONG DataSize
+    );
+
+//---------------------------------------------------------------------------
+//  Processor, IRQL, synchronization and time
+//---------------------------------------------------------------------------
+
+typedef UCHAR KIRQL, *PKIRQL;
+
+#define PASSIVE_LEVEL               0
+#define APC_LEVEL                   1
+#define DISPATCH_LEVEL              2
+
+KIRQL
+KeGetCurrentIrql (
+    VOID
+    );
+
+ULONG
+KeGetCurrentProcessorNumber (
+    VOID
+    );
+
+USHORT
+KeGetCurrentNodeNumber (
+    VOID
+    );
+
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+VOID
+KeInitializeSpinLock (
+    __out PKSPIN_LOCK SpinLock
+    );
+
+VOID
+KeAcquireSpinLockRaiseToDpc (
+    __inout PKSPIN_LOCK SpinLock,
+    __out PKIRQL OldIrql
+    );
+
+#define KeAcquireSpinLock(SpinLock, OldIrql) KeAcquireSpinLockRaiseToDpc( (SpinLock), (OldIrql) )
+
+VOID
+KeReleaseSpinLock (
+    __inout PKSPIN_LOCK SpinLock,
+    __in KIRQL NewIrql
+    );
+
+VOID
+KeAcquireSpinLockAtDpcLevel (
+    __inout PKSPIN_LOCK SpinLock
+    );
+
+VOID
+KeReleaseSpinLockFromDpcLevel (
+    __inout PKSPIN_LOCK SpinLock
+    );
+
+//
+//  The Interlocked routines and KeMemoryBarrier are full barriers, as on
+//  x86 and x64.
+//
+
+#define InterlockedIncrement(Addend)                    __sync_add_and_fetch( (Addend), 1 )
+#define InterlockedDecrement(Addend)                    __sync_sub_and_fetch( (Addend), 1 )
+#define InterlockedExchangeAdd(Addend, Value)           __sync_fetch_and_add( (Addend), (Value) )
+#define InterlockedExchangeAdd64(Addend, Value)         __sync_fetch_and_add( (Addend), (Value) )
+#define InterlockedOr(Destination, Value)               __sync_fetch_and_or( (Destination), (Value) )
+#define InterlockedAnd(Destination, Value)              __sync_fetch_and_and( (Destination), (Value) )
+#define InterlockedExchange(Target, Value) \
+    ({ __typeof__( *(Target) ) _r = __atomic_exchange_n( (Target), (Value), __ATOMIC_SEQ_CST ); _r; })
+#define InterlockedExchangePointer(Target, Value)       InterlockedExchange( (Target), (Value) )
+#define InterlockedCompareExchange(Destination, ExChange, Comperand) \
+    ({ __typeof__( *(Destination) ) _r = __sync_val_compare_and_swap( (Destination), (Comperand), (ExChange) ); _r; })
+#define InterlockedCompareExchange64(Destination, ExChange, Comperand) \
+    InterlockedCompareExchange( (Destination), (ExChange), (Comperand) )
+#define InterlockedCompareExchangePointer(Destination, ExChange, Comperand) \
+    InterlockedCompareExchange( (Destination), (ExChange), (Comperand) )
+
+#define KeMemoryBarrier()           __sync_synchronize()
+
+FORCEINLINE
+BOOLEAN
+_BitScanReverse (
+    __out PULONG Index,
+    __in ULONG Mask
+    )
+{
+    if (Mask == 0) {
+
+        return FALSE;
+    }
+
+    *Index = 31 - (ULONG)__builtin_clz( Mask );
+    return TRUE;
+}
+
+typedef struct _ERESOURCE {
+    PVOID Lock;
+} ERESOURCE, *PERESOURCE;
+
+NTSTATUS
+ExInitializeResourceLite (
+    __out PERESOURCE Resource
+    );
+
+NTSTATUS
+ExDeleteResourceLite (
+    __inout PERESOURCE Resource
+    );
+
+typedef struct _KEVENT {
+    LONG SignalState;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+LONG
+KeReadStateEvent (
+    __in PRKEVENT Event
+    );
+
+PKEVENT
+IoCreateNotificationEvent (
+    __in PUNICODE_STRING EventName,
+    __out PHANDLE EventHandle
+    );
+
+VOID
+KeQuerySystemTime (
+    __out PLARGE_INTEGER CurrentTime
+    );
+
+ULONGLONG
+KeQueryInterruptTime (
+    VOID
+    );
+
+LARGE_INTEGER
+KeQueryPerformanceCounter (
+    __out_opt PLARGE_INTEGER PerformanceFrequency
+    );
+
+struct _KDPC;
+
+typedef
+VOID
+KDEFERRED_ROUTINE (
+    __in struct _KDPC *Dpc,
+    __in_opt PVOID DeferredContext,
+    __in_opt PVOID SystemArgument1,
+    __in_opt PVOID SystemArgument2
+    );
+
+typedef KDEFERRED_ROUTINE *PKDEFERRED_ROUTINE;
+
+typedef struct _KDPC {
+    PKDEFERRED_ROUTINE DeferredRoutine;
+    PVOID DeferredContext;
+} KDPC, *PKDPC, *PRKDPC;
+
+typedef struct _KTIMER {
+    LIST_ENTRY TimerListEntry;
+    ULONGLONG DueTime;
+    LONG Period;
+    BOOLEAN Inserted;
+    PKDPC Dpc;
+} KTIMER, *PKTIMER;
+
+VOID
+KeInitializeDpc (
+    __out PRKDPC Dpc,
+    __in PKDEFERRED_ROUTINE DeferredRoutine,
+    __in_opt PVOID DeferredContext
+    );
+
+VOID
+KeInitializeTimer (
+    __out PKTIMER Timer
+    );
+
+BOOLEAN
+KeSetTimerEx (
+    __inout PKTIMER Timer,
+    __in LARGE_INTEGER DueTime,
+    __in LONG Period,
+    __in_opt PKDPC Dpc
+    );
+
+BOOLEAN
+KeCancelTimer (
+    __inout PKTIMER Timer
+    );
+
+VOID
+KeFlushQueuedDpcs (
+    VOID
+    );
+
+//---------------------------------------------------------------------------
+//  Pool and lookaside lists
+//---------------------------------------------------------------------------
+
+typedef enum _POOL_TYPE {
+    NonPagedPool,
+    PagedPool,
+    NonPagedPoolMustSucceed,
+    DontUseThisType,
+    NonPagedPoolCacheAligned,
+    PagedPoolCacheAligned,
+    NonPagedPoolCacheAlignedMustS,
+    NonPagedPoolNx = 512
+} POOL_TYPE;
+
+typedef enum _MM_PAGE_PRIORITY {
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+PVOID
+ExAllocatePoolWithTag (
+    __in POOL_TYPE PoolType,
+    __in SIZE_T NumberOfBytes,
+    __in ULONG Tag
+    );
+
+#define ExAllocatePool(PoolType, NumberOfBytes) \
+    ExAllocatePoolWithTag( (PoolType), (NumberOfBytes), 'enoN' )
+
+VOID
+ExFreePoolWithTag (
+    __in PVOID P,
+    __in ULONG Tag
+    );
+
+#define ExFreePool(P)               ExFreePoolWithTag( (P), 0 )
+
+typedef
+PVOID
+ALLOCATE_FUNCTION (
+    __in POOL_TYPE PoolType,
+    __in SIZE_T NumberOfBytes,
+    __in ULONG Tag
+    );
+
+typedef ALLOCATE_FUNCTION *PALLOCATE_FUNCTION;
+
+typedef
+VOID
+FREE_FUNCTION (
+    __in PVOID Buffer
+    );
+
+typedef FREE_FUNCTION *PFREE_FUNCTION;
+
+//
+//  A lookaside list keeps up to Depth freed entries for the next
+//  allocations, as the kernel's does.
+//
+
+typedef struct _NPAGED_LOOKASIDE_LIST {
+    KSPIN_LOCK Lock;
+    SINGLE_LIST_ENTRY ListHead;
+    USHORT Depth;
+    USHORT CurrentDepth;
+    ULONG TotalAllocates;
+    ULONG AllocateMisses;
+    ULONG TotalFrees;
+    ULONG FreeMisses;
+    POOL_TYPE Type;
+    ULONG Tag;
+    ULONG Size;
+    PALLOCATE_FUNCTION Allocate;
+    PFREE_FUNCTION Free;
+} NPAGED_LOOKASIDE_LIST, *PNPAGED_LOOKASIDE_LIST;
+
+VOID
+ExInitializeNPagedLookasideList (
+    __out PNPAGED_LOOKASIDE_LIST Lookaside,
+    __in_opt PALLOCATE_FUNCTION Allocate,
+    __in_opt PFREE_FUNCTION Free,
+    __in ULONG Flags,
+    __in SIZE_T Size,
+    __in ULONG Tag,
+    __in USHORT Depth
+    );
+
+VOID
+ExDeleteNPagedLookasideList (
+    __inout PNPAGED_LOOKASIDE_LIST Lookaside
+    );
+
+PVOID
+ExAllocateFromNPagedLookasideList (
+    __inout PNPAGED_LOOKASIDE_LIST Lookaside
+    );
+
+VOID
+ExFreeToNPagedLookasideList (
+    __inout PNPAGED_LOOKASIDE_LIST Lookaside,
+    __in PVOID Entry
+    );
+
+//---------------------------------------------------------------------------
+//  Lists
+//---------------------------------------------------------------------------
+
+FORCEINLINE
+VOID
+InitializeListHead (
+    __out PLIST_ENTRY ListHead
+    )
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+FORCEINLINE
+BOOLEAN
+IsListEmpty (
+    __in CONST LIST_ENTRY *ListHead
+    )
+{
+    return (BOOLEAN)(ListHead->Flink == ListHead);
+}
+
+FORCEINLINE
+BOOLEAN
+RemoveEntryList (
+    __in PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY blink = Entry->Blink;
+    PLIST_ENTRY flink = Entry->Flink;
+
+    blink->Flink = flink;
+    flink->Blink = blink;
+    return (BOOLEAN)(flink == blink);
+}
+
+FORCEINLINE
+PLIST_ENTRY
+RemoveHeadList (
+    __inout PLIST_ENTRY ListHead
+    )
+{
+    PLIST_ENTRY entry = ListHead->Flink;
+
+    RemoveEntryList( entry );
+    return entry;
+}
+
+FORCEINLINE
+PLIST_ENTRY
+RemoveTailList (
+    __inout PLIST_ENTRY ListHead
+    )
+{
+    PLIST_ENTRY entry = ListHead->Blink;
+
+    RemoveEntryList( entry );
+    return entry;
+}
+
+FORCEINLINE
+VOID
+InsertTailList (
+    __inout PLIST_ENTRY ListHead,
+    __inout PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY blink = ListHead->Blink;
+
+    Entry->Flink = ListHead;
+    Entry->Blink = blink;
+    blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+FORCEINLINE
+VOID
+InsertHeadList (
+    __inout PLIST_ENTRY ListHead,
+    __inout PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY flink = ListHead->Flink;
+
+    Entry->Flink = flink;
+    Entry->Blink = ListHead;
+    flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+//---------------------------------------------------------------------------
+//  Processes and threads
+//---------------------------------------------------------------------------
+
+typedef struct _KPROCESS *PEPROCESS, *PKPROCESS;
+typedef struct _KTHREAD *PETHREAD, *PKTHREAD;
+
+typedef struct _CLIENT_ID {
+    HANDLE UniqueProcess;
+    HANDLE UniqueThread;
+} CLIENT_ID, *PCLIENT_ID;
+
+typedef enum _PROCESSINFOCLASS {
+    ProcessBasicInformation = 0,
+    ProcessImageFileName = 27
+} PROCESSINFOCLASS;
+
+#define NtCurrentProcess()          ((HANDLE)(LONG_PTR)-1)
+#define ZwCurrentProcess()          NtCurrentProcess()
+
+PEPROCESS
+PsGetCurrentProcess (
+    VOID
+    );
+
+HANDLE
+PsGetCurrentProcessId (
+    VOID
+    );
+
+HANDLE
+PsGetCurrentThreadId (
+    VOID
+    );
+
+HANDLE
+PsGetProcessId (
+    __in PEPROCESS Process
+    );
+
+NTSTATUS
+PsLookupProcessByProcessId (
+    __in HANDLE ProcessId,
+    __out PEPROCESS *Process
+    );
+
+PEPROCESS
+IoThreadToProcess (
+    __in PETHREAD Thread
+    );
+
+PACCESS_TOKEN
+PsReferencePrimaryToken (
+    __inout PEPROCESS Process
+    );
+
+VOID
+PsDereferencePrimaryToken (
+    __in PACCESS_TOKEN PrimaryToken
+    );
+
+NTSTATUS
+SeQueryInformationToken (
+    __in PACCESS_TOKEN Token,
+    __in TOKEN_INFORMATION_CLASS TokenInformationClass,
+    __deref_out PVOID *TokenInformation
+    );
+
+NTSTATUS
+SeQueryAuthenticationIdToken (
+    __in PACCESS_TOKEN Token,
+    __out PLUID AuthenticationId
+    );
+
+PACCESS_TOKEN
+SeQuerySubjectContextToken (
+    __in PSECURITY_SUBJECT_CONTEXT SubjectContext
+    );
+
+NTSTATUS
+ZwOpenProcessTokenEx (
+    __in HANDLE ProcessHandle,
+    __in ACCESS_MASK DesiredAccess,
+    __in ULONG HandleAttributes,
+    __out PHANDLE TokenHandle
+    );
+
+NTSTATUS
+ZwQueryInformationToken (
+    __in HANDLE TokenHandle,
+    __in TOKEN_INFORMATION_CLASS TokenInformationClass,
+    __out_bcount_part_opt(Length,*ResultLength) PVOID TokenInformation,
+    __in ULONG Length,
+    __out PULONG ResultLength
+    );
+
+BOOLEAN
+IoIs32bitProcess (
+    __in_opt PVOID Irp
+    );
+
+PVOID
+MmGetSystemRoutineAddress (
+    __in PUNICODE_STRING SystemRoutineName
+    );
+
+//---------------------------------------------------------------------------
+//  Devices, files and MDLs
+//---------------------------------------------------------------------------
+
+typedef struct _DRIVER_OBJECT *PDRIVER_OBJECT;
+typedef struct _DEVICE_OBJECT *PDEVICE_OBJECT;
+
+typedef
+NTSTATUS
+DRIVER_INITIALIZE (
+    __in PDRIVER_OBJECT DriverObject,
+    __in PUNICODE_STRING RegistryPath
+    );
+
+typedef DRIVER_INITIALIZE *PDRIVER_INITIALIZE;
+
+#define FILE_DEVICE_DISK                0x00000007
+#define FILE_DEVICE_DISK_FILE_SYSTEM    0x00000008
+#define FILE_DEVICE_NETWORK_FILE_SYSTEM 0x00000014
+
+typedef struct _IO_STATUS_BLOCK {
+    union {
+        NTSTATUS Status;
+        PVOID Pointer;
+    };
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+#define IO_NO_INCREMENT             0
+
+typedef struct _FILE_OBJECT {
+    CSHORT Type;
+    CSHORT Size;
+    PDEVICE_OBJECT DeviceObject;
+    PVOID FsContext;
+    PVOID FsContext2;
+    BOOLEAN DeletePending;
+    ULONG Flags;
+    UNICODE_STRING FileName;
+    LARGE_INTEGER CurrentByteOffset;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+#define FO_SYNCHRONOUS_IO           0x00000002
+
+typedef struct _MDL {
+    struct _MDL *Next;
+    CSHORT Size;
+    CSHORT MdlFlags;
+    PVOID MappedSystemVa;
+    PVOID StartVa;
+    ULONG ByteCount;
+    ULONG ByteOffset;
+} MDL, *PMDL;
+
+#define MDL_MAPPED_TO_SYSTEM_VA     0x0001
+#define MDL_SOURCE_IS_NONPAGED_POOL 0x0004
+
+PMDL
+IoAllocateMdl (
+    __in_opt PVOID VirtualAddress,
+    __in ULONG Length,
+    __in BOOLEAN SecondaryBuffer,
+    __in BOOLEAN ChargeQuota,
+    __in_opt PVOID Irp
+    );
+
+VOID
+IoFreeMdl (
+    __in PMDL Mdl
+    );
+
+VOID
+MmBuildMdlForNonPagedPool (
+    __inout PMDL MemoryDescriptorList
+    );
+
+#define MmGetSystemAddressForMdlSafe(Mdl, Priority) \
+    ((VOID)(Priority), (Mdl)->MappedSystemVa)
+
+NTSTATUS
+RtlVolumeDeviceToDosName (
+    __in PVOID VolumeDeviceObject,
+    __out PUNICODE_STRING DosName
+    );
+
+#define IoVolumeDeviceToDosName     RtlVolumeDeviceToDosName
+
+//
+//  Create dispositions, in the top byte of the create options the filter
+//  manager hands a filter.
+//
+
+#define FILE_SUPERSEDE                  0x00000000
+#define FILE_OPEN                       0x00000001
+#define FILE_CREATE                     0x00000002
+#define FILE_OPEN_IF                    0x00000003
+#define FILE_OVERWRITE                  0x00000004
+#define FILE_OVERWRITE_IF               0x00000005
+#define FILE_MAXIMUM_DISPOSITION        0x00000005
+
+#define FILE_DIRECTORY_FILE             0x00000001
+#define FILE_WRITE_THROUGH              0x00000002
+#define FILE_SEQUENTIAL_ONLY            0x00000004
+#define FILE_NO_INTERMEDIATE_BUFFERING  0x00000008
+#define FILE_SYNCHRONOUS_IO_ALERT       0x00000010
+#define FILE_SYNCHRONOUS_IO_NONALERT    0x00000020
+#define FILE_NON_DIRECTORY_FILE         0x00000040
+#define FILE_DELETE_ON_CLOSE            0x00001000
+#define FILE_OPEN_BY_FILE_ID            0x00002000
+
+//
+//  Create results, in IoStatus.Information.
+//
+
+#define FILE_SUPERSEDED                 0x00000000
+#define FILE_OPENED                     0x00000001
+#define FILE_CREATED                    0x00000002
+#define FILE_OVERWRITTEN                0x00000003
+#define FILE_EXISTS                     0x00000004
+#define FILE_DOES_NOT_EXIST             0x00000005
+
+#define FILE_ATTRIBUTE_READONLY         0x00000001
+#define FILE_ATTRIBUTE_DIRECTORY        0x00000010
+#define FILE_ATTRIBUTE_NORMAL           0x00000080
+
+#define FILE_SHARE_READ                 0x00000001
+#define FILE_SHARE_WRITE                0x00000002
+#define FILE_SHARE_DELETE               0x00000004
+
+//
+//  A write at this offset goes where the file pointer is.
+//
+
+#define FILE_WRITE_TO_END_OF_FILE       0xffffffff
+#define FILE_USE_FILE_POINTER_POSITION  0xfffffffe
+
+typedef enum _FILE_INFORMATION_CLASS {
+    FileDirectoryInformation = 1,
+    FileFullDirectoryInformation,
+    FileBothDirectoryInformation,
+    FileBasicInformation,
+    FileStandardInformation,
+    FileInternalInformation,
+    FileEaInformation,
+    FileAccessInformation,
+    FileNameInformation,
+    FileRenameInformation,
+    FileLinkInformation,
+    FileNamesInformation,
+    FileDispositionInformation,
+    FilePositionInformation,
+    FileFullEaInformation,
+    FileModeInformation,
+    FileAlignmentInformation,
+    FileAllInformation,
+    FileAllocationInformation,
+    FileEndOfFileInformation,
+    FileMaximumInformation = 76
+} FILE_INFORMATION_CLASS, *PFILE_INFORMATION_CLASS;
+
+typedef struct _FILE_RENAME_INFORMATION {
+    BOOLEAN ReplaceIfExists;
+    HANDLE RootDirectory;
+    ULONG FileNameLength;
+    WCHAR FileName[1];
+} FILE_RENAME_INFORMATION, *PFILE_RENAME_INFORMATION;
+
+typedef struct _FILE_DISPOSITION_INFORMATION {
+    BOOLEAN DeleteFile;
+} FILE_DISPOSITION_INFORMATION, *PFILE_DISPOSITION_INFORMATION;
+
+typedef struct _FILE_END_OF_FILE_INFORMATION {
+    LARGE_INTEGER EndOfFile;
+} FILE_END_OF_FILE_INFORMATION, *PFILE_END_OF_FILE_INFORMATION;
+
+typedef struct _FILE_POSITION_INFORMATION {
+    LARGE_INTEGER CurrentByteOffset;
+} FILE_POSITION_INFORMATION, *PFILE_POSITION_INFORMATION;
+
+typedef struct _FILE_BASIC_INFORMATION {
+    LARGE_INTEGER CreationTime;
+    LARGE_INTEGER LastAccessTime;
+    LARGE_INTEGER LastWriteTime;
+    LARGE_INTEGER ChangeTime;
+    ULONG FileAttributes;
+} FILE_BASIC_INFORMATION, *PFILE_BASIC_INFORMATION;
+
+NTSTATUS
+ZwCreateFile (
+    __out PHANDLE FileHandle,
+    __in ACCESS_MASK DesiredAccess,
+    __in POBJECT_ATTRIBUTES ObjectAttributes,
+    __out PIO_STATUS_BLOCK IoStatusBlock,
+    __in_opt PLARGE_INTEGER AllocationSize,
+    __in ULONG FileAttributes,
+    __in ULONG ShareAccess,
+    __in ULONG CreateDisposition,
+    __in ULONG CreateOptions,
+    __in_bcount_opt(EaLength) PVOID EaBuffer,
+    __in ULONG EaLength
+    );
+
+//
+//  Major and minor function codes.  The negative ones, which only the
+//  filter manager knows, are in minispy.h.
+//
+
+#define IRP_MJ_CREATE                   0x00
+#define IRP_MJ_CREATE_NAMED_PIPE        0x01
+#define IRP_MJ_CLOSE                    0x02
+#define IRP_MJ_READ                     0x03
+#define IRP_MJ_WRITE                    0x04
+#define IRP_MJ_QUERY_INFORMATION        0x05
+#define IRP_MJ_SET_INFORMATION          0x06
+#define IRP_MJ_QUERY_EA                 0x07
+#define IRP_MJ_SET_EA                   0x08
+#define IRP_MJ_FLUSH_BUFFERS            0x09
+#define IRP_MJ_QUERY_VOLUME_INFORMATION 0x0a
+#define IRP_MJ_SET_VOLUME_INFORMATION   0x0b
+#define IRP_MJ_DIRECTORY_CONTROL        0x0c
+#define IRP_MJ_FILE_SYSTEM_CONTROL      0x0d
+#define IRP_MJ_DEVICE_CONTROL           0x0e
+#define IRP_MJ_INTERNAL_DEVICE_CONTROL  0x0f
+#define IRP_MJ_SHUTDOWN                 0x10
+#define IRP_MJ_LOCK_CONTROL             0x11
+#define IRP_MJ_CLEANUP                  0x12
+#define IRP_MJ_CREATE_MAILSLOT          0x13
+#define IRP_MJ_QUERY_SECURITY           0x14
+#define IRP_MJ_SET_SECURITY             0x15
+#define IRP_MJ_POWER                    0x16
+#define IRP_MJ_SYSTEM_CONTROL           0x17
+#define IRP_MJ_DEVICE_CHANGE            0x18
+#define IRP_MJ_QUERY_QUOTA              0x19
+#define IRP_MJ_SET_QUOTA                0x1a
+#define IRP_MJ_PNP                      0x1b
+#define IRP_MJ_MAXIMUM_FUNCTION         0x1b
+
+#define IRP_MJ_OPERATION_END            ((UCHAR)0x80)
+
+#define IRP_MN_QUERY_DIRECTORY          0x01
+#define IRP_MN_NOTIFY_CHANGE_DIRECTORY  0x02
+#define IRP_MN_USER_FS_REQUEST          0x00
+
+#define IRP_NOCACHE                     0x00000001
+#define IRP_PAGING_IO                   0x00000002
+#define IRP_SYNCHRONOUS_API             0x00000004
+#define IRP_SYNCHRONOUS_PAGING_IO       0x00000040
+
+#define FSCTL_REQUEST_OPLOCK_LEVEL_1    0x00090000
+#define FSCTL_REQUEST_OPLOCK_LEVEL_2    0x00090004
+#define FSCTL_REQUEST_BATCH_OPLOCK      0x00090008
+#define FSCTL_REQUEST_FILTER_OPLOCK     0x0009005C
+
+//---------------------------------------------------------------------------
+//  Filter manager
+//---------------------------------------------------------------------------
+
+typedef struct _FLT_FILTER *PFLT_FILTER;
+typedef struct _FLT_VOLUME *PFLT_VOLUME;
+typedef struct _FLT_INSTANCE *PFLT_INSTANCE;
+typedef struct _FLT_PORT *PFLT_PORT;
+typedef struct _KTRANSACTION *PKTRANSACTION;
+typedef PVOID PFLT_CONTEXT;
+
+typedef ULONG FLT_CALLBACK_DATA_FLAGS;
+typedef ULONG FLT_FILTER_UNLOAD_FLAGS;
+typedef ULONG FLT_INSTANCE_SETUP_FLAGS;
+typedef ULONG FLT_INSTANCE_QUERY_TEARDOWN_FLAGS;
+typedef ULONG FLT_INSTANCE_TEARDOWN_FLAGS;
+typedef ULONG FLT_POST_OPERATION_FLAGS;
+typedef ULONG FLT_OPERATION_REGISTRATION_FLAGS;
+typedef ULONG FLT_REGISTRATION_FLAGS;
+typedef ULONG FLT_FILE_NAME_OPTIONS;
+typedef USHORT FLT_FILE_NAME_PARSED_FLAGS;
+typedef USHORT FLT_CONTEXT_TYPE;
+typedef USHORT FLT_CONTEXT_REGISTRATION_FLAGS;
+typedef ULONG NOTIFICATION_MASK;
+
+#define FLTFL_CALLBACK_DATA_IRP_OPERATION       0x00000001
+#define FLTFL_CALLBACK_DATA_FAST_IO_OPERATION   0x00000002
+#define FLTFL_CALLBACK_DATA_FS_FILTER_OPERATION 0x00000004
+#define FLTFL_CALLBACK_DATA_SYSTEM_BUFFER       0x00000008
+#define FLTFL_CALLBACK_DATA_GENERATED_IO        0x00010000
+#define FLTFL_CALLBACK_DATA_REISSUED_IO         0x00020000
+#define FLTFL_CALLBACK_DATA_DRAINING_IO         0x00040000
+#define FLTFL_CALLBACK_DATA_POST_OPERATION      0x00080000
+#define FLTFL_CALLBACK_DATA_DIRTY               0x80000000
+
+#define FLT_IS_IRP_OPERATION(Data)      (FlagOn( (Data)->Flags, FLTFL_CALLBACK_DATA_IRP_OPERATION ))
+#define FLT_IS_FASTIO_OPERATION(Data)   (FlagOn( (Data)->Flags, FLTFL_CALLBACK_DATA_FAST_IO_OPERATION ))
+#define FLT_IS_SYSTEM_BUFFER(Data)      (FlagOn( (Data)->Flags, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER ))
+
+#define FLTFL_POST_OPERATION_DRAINING           0x00000001
+
+#define FLTFL_INSTANCE_SETUP_AUTOMATIC_ATTACHMENT   0x00000001
+
+#define FLTFL_INSTANCE_TEARDOWN_MANUAL                  0x00000001
+#define FLTFL_INSTANCE_TEARDOWN_FILTER_UNLOAD           0x00000002
+#define FLTFL_INSTANCE_TEARDOWN_MANDATORY_FILTER_UNLOAD 0x00000004
+
+#define FLTFL_FILTER_UNLOAD_MANDATORY           0x00000001
+
+#define FLTREGFL_DO_NOT_SUPPORT_SERVICE_STOP    0x00000001
+
+#define FLT_REGISTRATION_VERSION                0x0202
+
+typedef enum _FLT_FILESYSTEM_TYPE {
+    FLT_FSTYPE_UNKNOWN,
+    FLT_FSTYPE_RAW,
+    FLT_FSTYPE_NTFS,
+    FLT_FSTYPE_FAT
+} FLT_FILESYSTEM_TYPE, *PFLT_FILESYSTEM_TYPE;
+
+typedef enum _FLT_PREOP_CALLBACK_STATUS {
+    FLT_PREOP_SUCCESS_WITH_CALLBACK,
+    FLT_PREOP_SUCCESS_NO_CALLBACK,
+    FLT_PREOP_PENDING,
+    FLT_PREOP_DISALLOW_FASTIO,
+    FLT_PREOP_COMPLETE,
+    FLT_PREOP_SYNCHRONIZE
+} FLT_PREOP_CALLBACK_STATUS, *PFLT_PREOP_CALLBACK_STATUS;
+
+typedef enum _FLT_POSTOP_CALLBACK_STATUS {
+    FLT_POSTOP_FINISHED_PROCESSING,
+    FLT_POSTOP_MORE_PROCESSING_REQUIRED
+} FLT_POSTOP_CALLBACK_STATUS, *PFLT_POSTOP_CALLBACK_STATUS;
+
+typedef struct _IO_SECURITY_CONTEXT {
+    PVOID SecurityQos;
+    PACCESS_STATE AccessState;
+    ACCESS_MASK DesiredAccess;
+    ULONG FullCreateOptions;
+} IO_SECURITY_CONTEXT, *PIO_SECURITY_CONTEXT;
+
+//
+//  The parameters of the operations the driver looks into.
+//
+
+typedef union _FLT_PARAMETERS {
+
+    struct {
+        PIO_SECURITY_CONTEXT SecurityContext;
+        ULONG Options;
+        USHORT FileAttributes;
+        USHORT ShareAccess;
+        ULONG EaLength;
+        PVOID EaBuffer;
+        LARGE_INTEGER AllocationSize;
+    } Create;
+
+    struct {
+        ULONG Length;
+        ULONG Key;
+        LARGE_INTEGER ByteOffset;
+        PVOID ReadBuffer;
+        PMDL MdlAddress;
+    } Read;
+
+    struct {
+        ULONG Length;
+        ULONG Key;
+        LARGE_INTEGER ByteOffset;
+        PVOID WriteBuffer;
+        PMDL MdlAddress;
+    } Write;
+
+    struct {
+        ULONG Length;
+        FILE_INFORMATION_CLASS FileInformationClass;
+        PVOID InfoBuffer;
+    } QueryFileInformation;
+
+    struct {
+        ULONG Length;
+        FILE_INFORMATION_CLASS FileInformationClass;
+        PFILE_OBJECT ParentOfTarget;
+        union {
+            struct {
+                BOOLEAN ReplaceIfExists;
+                BOOLEAN AdvanceOnly;
+            };
+            ULONG ClusterCount;
+            HANDLE DeleteHandle;
+        };
+        PVOID InfoBuffer;
+    } SetFileInformation;
+
+    union {
+        struct {
+            ULONG Length;
+            PUNICODE_STRING FileName;
+            FILE_INFORMATION_CLASS FileInformationClass;
+            ULONG FileIndex;
+            PVOID DirectoryBuffer;
+            PMDL MdlAddress;
+        } QueryDirectory;
+
+        struct {
+            ULONG Length;
+            ULONG CompletionFilter;
+            ULONG Spare1;
+            ULONG Spare2;
+            PVOID DirectoryBuffer;
+            PMDL MdlAddress;
+        } NotifyDirectory;
+    } DirectoryControl;
+
+    union {
+        struct {
+            ULONG OutputBufferLength;
+            ULONG InputBufferLength;
+            ULONG FsControlCode;
+        } Common;
+    } FileSystemControl;
+
+    struct {
+        PVOID Argument1;
+        PVOID Argument2;
+        PVOID Argument3;
+        PVOID Argument4;
+        PVOID Argument5;
+        LARGE_INTEGER Argument6;
+    } Others;
+
+} FLT_PARAMETERS, *PFLT_PARAMETERS;
+
+typedef struct _FLT_IO_PARAMETER_BLOCK {
+    ULONG IrpFlags;
+    UCHAR MajorFunction;
+    UCHAR MinorFunction;
+    UCHAR OperationFlags;
+    UCHAR Reserved;
+    PFILE_OBJECT TargetFileObject;
+    PFLT_INSTANCE TargetInstance;
+    FLT_PARAMETERS Parameters;
+} FLT_IO_PARAMETER_BLOCK, *PFLT_IO_PARAMETER_BLOCK;
+
+typedef struct _FLT_TAG_DATA_BUFFER {
+    ULONG FileTag;
+    USHORT TagDataLength;
+    USHORT UnparsedNameLength;
+    union {
+        struct {
+            USHORT SubstituteNameOffset;
+            USHORT SubstituteNameLength;
+            USHORT PrintNameOffset;
+            USHORT PrintNameLength;
+            ULONG Flags;
+            WCHAR PathBuffer[1];
+        } SymbolicLinkReparseBuffer;
+        struct {
+            UCHAR DataBuffer[1];
+        } GenericReparseBuffer;
+    };
+} FLT_TAG_DATA_BUFFER, *PFLT_TAG_DATA_BUFFER;
+
+#define FLT_TAG_DATA_BUFFER_HEADER_SIZE \
+    FIELD_OFFSET( FLT_TAG_DATA_BUFFER, GenericReparseBuffer )
+
+typedef struct _FLT_CALLBACK_DATA {
+    FLT_CALLBACK_DATA_FLAGS Flags;
+    PETHREAD Thread;
+    PFLT_IO_PARAMETER_BLOCK Iopb;
+    IO_STATUS_BLOCK IoStatus;
+    PFLT_TAG_DATA_BUFFER TagData;
+    union {
+        struct {
+            LIST_ENTRY QueueLinks;
+            PVOID QueueContext[2];
+        };
+        PVOID FilterContext[4];
+    };
+    KPROCESSOR_MODE RequestorMode;
+} FLT_CALLBACK_DATA, *PFLT_CALLBACK_DATA;
+
+typedef struct _FLT_RELATED_OBJECTS {
+    USHORT Size;
+    USHORT TransactionContext;
+    PFLT_FILTER Filter;
+    PFLT_VOLUME Volume;
+    PFLT_INSTANCE Instance;
+    PFILE_OBJECT FileObject;
+    PKTRANSACTION Transaction;
+} FLT_RELATED_OBJECTS, *PFLT_RELATED_OBJECTS;
+
+typedef CONST FLT_RELATED_OBJECTS *PCFLT_RELATED_OBJECTS;
+
+typedef
+FLT_PREOP_CALLBACK_STATUS
+(*PFLT_PRE_OPERATION_CALLBACK) (
+    __inout PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __deref_out_opt PVOID *CompletionContext
+    );
+
+typedef
+FLT_POSTOP_CALLBACK_STATUS
+(*PFLT_POST_OPERATION_CALLBACK) (
+    __inout PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in_opt PVOID CompletionContext,
+    __in FLT_POST_OPERATION_FLAGS Flags
+    );
+
+typedef
+NTSTATUS
+(*PFLT_FILTER_UNLOAD_CALLBACK) (
+    __in FLT_FILTER_UNLOAD_FLAGS Flags
+    );
+
+typedef
+NTSTATUS
+(*PFLT_INSTANCE_SETUP_CALLBACK) (
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in FLT_INSTANCE_SETUP_FLAGS Flags,
+    __in DEVICE_TYPE VolumeDeviceType,
+    __in FLT_FILESYSTEM_TYPE VolumeFilesystemType
+    );
+
+typedef
+NTSTATUS
+(*PFLT_INSTANCE_QUERY_TEARDOWN_CALLBACK) (
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in FLT_INSTANCE_QUERY_TEARDOWN_FLAGS Flags
+    );
+
+typedef
+VOID
+(*PFLT_INSTANCE_TEARDOWN_CALLBACK) (
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in FLT_INSTANCE_TEARDOWN_FLAGS Reason
+    );
+
+typedef
+VOID
+(*PFLT_CONTEXT_CLEANUP_CALLBACK) (
+    __in PFLT_CONTEXT Context,
+    __in FLT_CONTEXT_TYPE ContextType
+    );
+
+typedef
+NTSTATUS
+(*PFLT_TRANSACTION_NOTIFICATION_CALLBACK) (
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PFLT_CONTEXT TransactionContext,
+    __in ULONG NotificationMask
+    );
+
+typedef PVOID PFLT_GENERATE_FILE_NAME;
+typedef PVOID PFLT_NORMALIZE_NAME_COMPONENT;
+typedef PVOID PFLT_NORMALIZE_CONTEXT_CLEANUP;
+
+typedef struct _FLT_OPERATION_REGISTRATION {
+    UCHAR MajorFunction;
+    FLT_OPERATION_REGISTRATION_FLAGS Flags;
+    PFLT_PRE_OPERATION_CALLBACK PreOperation;
+    PFLT_POST_OPERATION_CALLBACK PostOperation;
+    PVOID Reserved1;
+} FLT_OPERATION_REGISTRATION, *PFLT_OPERATION_REGISTRATION;
+
+#define FLT_VOLUME_CONTEXT          0x0001
+#define FLT_INSTANCE_CONTEXT        0x0002
+#define FLT_FILE_CONTEXT            0x0004
+#define FLT_STREAM_CONTEXT          0x0008
+#define FLT_STREAMHANDLE_CONTEXT    0x0010
+#define FLT_TRANSACTION_CONTEXT     0x0020
+#define FLT_CONTEXT_END             0xffff
+
+#define FLT_VARIABLE_SIZED_CONTEXTS ((SIZE_T)-1)
+
+typedef struct _FLT_CONTEXT_REGISTRATION {
+    FLT_CONTEXT_TYPE ContextType;
+    FLT_CONTEXT_REGISTRATION_FLAGS Flags;
+    PFLT_CONTEXT_CLEANUP_CALLBACK ContextCleanupCallback;
+    SIZE_T Size;
+    ULONG PoolTag;
+    PVOID ContextAllocateCallback;
+    PVOID ContextFreeCallback;
+    PVOID Reserved1;
+} FLT_CONTEXT_REGISTRATION, *PFLT_CONTEXT_REGISTRATION;
+
+typedef struct _FLT_REGISTRATION {
+    USHORT Size;
+    USHORT Version;
+    FLT_REGISTRATION_FLAGS Flags;
+    CONST FLT_CONTEXT_REGISTRATION *ContextRegistration;
+    CONST FLT_OPERATION_REGISTRATION *OperationRegistration;
+    PFLT_FILTER_UNLOAD_CALLBACK FilterUnloadCallback;
+    PFLT_INSTANCE_SETUP_CALLBACK InstanceSetupCallback;
+    PFLT_INSTANCE_QUERY_TEARDOWN_CALLBACK InstanceQueryTeardownCallback;
+    PFLT_INSTANCE_TEARDOWN_CALLBACK InstanceTeardownStartCallback;
+    PFLT_INSTANCE_TEARDOWN_CALLBACK InstanceTeardownCompleteCallback;
+    PFLT_GENERATE_FILE_NAME GenerateFileNameCallback;
+    PFLT_NORMALIZE_NAME_COMPONENT NormalizeNameComponentCallback;
+    PFLT_NORMALIZE_CONTEXT_CLEANUP NormalizeContextCleanupCallback;
+    PFLT_TRANSACTION_NOTIFICATION_CALLBACK TransactionNotificationCallback;
+    PVOID NormalizeNameComponentExCallback;
+} FLT_REGISTRATION, *PFLT_REGISTRATION;
+
+NTSTATUS
+FltRegisterFilter (
+    __in PDRIVER_OBJECT Driver,
+    __in CONST FLT_REGISTRATION *Registration,
+    __deref_out PFLT_FILTER *RetFilter
+    );
+
+VOID
+FltUnregisterFilter (
+    __in PFLT_FILTER Filter
+    );
+
+NTSTATUS
+FltStartFiltering (
+    __in PFLT_FILTER Filter
+    );
+
+PVOID
+FltGetRoutineAddress (
+    __in PCSTR FltMgrRoutineName
+    );
+
+//
+//  Names
+//
+
+#define FLT_FILE_NAME_NORMALIZED                0x01
+#define FLT_FILE_NAME_OPENED                    0x02
+#define FLT_FILE_NAME_SHORT                     0x03
+#define FLT_VALID_FILE_NAME_FORMATS             0x000000ff
+
+#define FLT_FILE_NAME_QUERY_DEFAULT                     0x0100
+#define FLT_FILE_NAME_QUERY_CACHE_ONLY                  0x0200
+#define FLT_FILE_NAME_QUERY_FILESYSTEM_ONLY             0x0300
+#define FLT_FILE_NAME_QUERY_ALWAYS_ALLOW_CACHE_LOOKUP   0x0400
+#define FLT_VALID_FILE_NAME_QUERY_METHODS               0x0000ff00
+
+#define FLTFL_FILE_NAME_PARSED_FINAL_COMPONENT  0x0001
+#define FLTFL_FILE_NAME_PARSED_EXTENSION        0x0002
+#define FLTFL_FILE_NAME_PARSED_STREAM           0x0004
+#define FLTFL_FILE_NAME_PARSED_PARENT_DIR       0x0008
+
+typedef struct _FLT_FILE_NAME_INFORMATION {
+    USHORT Size;
+    FLT_FILE_NAME_PARSED_FLAGS NamesParsed;
+    FLT_FILE_NAME_OPTIONS Format;
+    UNICODE_STRING Name;
+    UNICODE_STRING Volume;
+    UNICODE_STRING Share;
+    UNICODE_STRING Extension;
+    UNICODE_STRING Stream;
+    UNICODE_STRING FinalComponent;
+    UNICODE_STRING ParentDir;
+} FLT_FILE_NAME_INFORMATION, *PFLT_FILE_NAME_INFORMATION;
+
+NTSTATUS
+FltGetFileNameInformation (
+    __in PFLT_CALLBACK_DATA CallbackData,
+    __in FLT_FILE_NAME_OPTIONS NameOptions,
+    __deref_out PFLT_FILE_NAME_INFORMATION *FileNameInformation
+    );
+
+NTSTATUS
+FltGetDestinationFileNameInformation (
+    __in PFLT_INSTANCE Instance,
+    __in PFILE_OBJECT FileObject,
+    __in_opt HANDLE RootDirectory,
+    __in_bcount(FileNameLength) PWSTR FileName,
+    __in ULONG FileNameLength,
+    __in FLT_FILE_NAME_OPTIONS NameOptions,
+    __deref_out PFLT_FILE_NAME_INFORMATION *RetFileNameInformation
+    );
+
+NTSTATUS
+FltParseFileNameInformation (
+    __inout PFLT_FILE_NAME_INFORMATION FileNameInformation
+    );
+
+VOID
+FltReferenceFileNameInformation (
+    __in PFLT_FILE_NAME_INFORMATION FileNameInformation
+    );
+
+VOID
+FltReleaseFileNameInformation (
+    __in PFLT_FILE_NAME_INFORMATION FileNameInformation
+    );
+
+NTSTATUS
+FltIsDirectory (
+    __in PFILE_OBJECT FileObject,
+    __in PFLT_INSTANCE Instance,
+    __out PBOOLEAN IsDirectory
+    );
+
+//
+//  Volumes and contexts
+//
+
+typedef struct _FLT_VOLUME_PROPERTIES {
+    DEVICE_TYPE DeviceType;
+    ULONG DeviceCharacteristics;
+    ULONG DeviceObjectFlags;
+    ULONG AlignmentRequirement;
+    USHORT SectorSize;
+    USHORT Reserved0;
+    UNICODE_STRING FileSystemDriverName;
+    UNICODE_STRING FileSystemDeviceName;
+    UNICODE_STRING RealDeviceName;
+} FLT_VOLUME_PROPERTIES, *PFLT_VOLUME_PROPERTIES;
+
+NTSTATUS
+FltGetVolumeProperties (
+    __in PFLT_VOLUME Volume,
+    __out_bcount_part_opt(VolumePropertiesLength,*LengthReturned) PFLT_VOLUME_PROPERTIES VolumeProperties,
+    __in ULONG VolumePropertiesLength,
+    __out PULONG LengthReturned
+    );
+
+NTSTATUS
+FltGetDiskDeviceObject (
+    __in PFLT_VOLUME Volume,
+    __deref_out PDEVICE_OBJECT *DiskDeviceObject
+    );
+
+NTSTATUS
+FltGetDeviceObject (
+    __in PFLT_VOLUME Volume,
+    __deref_out PDEVICE_OBJECT *DeviceObject
+    );
+
+typedef enum _FLT_SET_CONTEXT_OPERATION {
+    FLT_SET_CONTEXT_REPLACE_IF_EXISTS,
+    FLT_SET_CONTEXT_KEEP_IF_EXISTS
+} FLT_SET_CONTEXT_OPERATION, *PFLT_SET_CONTEXT_OPERATION;
+
+NTSTATUS
+FltAllocateContext (
+    __in PFLT_FILTER Filter,
+    __in FLT_CONTEXT_TYPE ContextType,
+    __in SIZE_T ContextSize,
+    __in POOL_TYPE PoolType,
+    __deref_out PFLT_CONTEXT *ReturnedContext
+    );
+
+VOID
+FltReferenceContext (
+    __in PFLT_CONTEXT Context
+    );
+
+VOID
+FltReleaseContext (
+    __in PFLT_CONTEXT Context
+    );
+
+VOID
+FltDeleteContext (
+    __in PFLT_CONTEXT Context
+    );
+
+NTSTATUS
+FltSetVolumeContext (
+    __in PFLT_VOLUME Volume,
+    __in FLT_SET_CONTEXT_OPERATION Operation,
+    __in PFLT_CONTEXT NewContext,
+    __deref_opt_out PFLT_CONTEXT *OldContext
+    );
+
+NTSTATUS
+FltGetVolumeContext (
+    __in PFLT_FILTER Filter,
+    __in PFLT_VOLUME Volume,
+    __deref_out PFLT_CONTEXT *Context
+    );
+
+//
+//  Operation processing
+//
+
+typedef
+VOID
+(*PFLT_GET_OPERATION_STATUS_CALLBACK) (
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in PFLT_IO_PARAMETER_BLOCK IopbSnapshot,
+    __in NTSTATUS OperationStatus,
+    __in_opt PVOID RequesterContext
+    );
+
+NTSTATUS
+FltRequestOperationStatusCallback (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PFLT_GET_OPERATION_STATUS_CALLBACK CallbackRoutine,
+    __in_opt PVOID RequesterContext
+    );
+
+VOID
+FltSetCallbackDataDirty (
+    __inout PFLT_CALLBACK_DATA Data
+    );
+
+NTSTATUS
+FltLockUserBuffer (
+    __in PFLT_CALLBACK_DATA CallbackData
+    );
+
+BOOLEAN
+FltDoCompletionProcessingWhenSafe (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PCFLT_RELATED_OBJECTS FltObjects,
+    __in_opt PVOID CompletionContext,
+    __in FLT_POST_OPERATION_FLAGS Flags,
+    __in PFLT_POST_OPERATION_CALLBACK SafePostCallback,
+    __out FLT_POSTOP_CALLBACK_STATUS *RetPostOperationStatus
+    );
+
+PCHAR
+FltGetIrpName (
+    __in UCHAR IrpMajorCode
+    );
+
+//
+//  Synchronization
+//
+
+VOID
+FltAcquireResourceShared (
+    __inout PERESOURCE Resource
+    );
+
+VOID
+FltAcquireResourceExclusive (
+    __inout PERESOURCE Resource
+    );
+
+VOID
+FltReleaseResource (
+    __inout PERESOURCE Resource
+    );
+
+//
+//  Communication ports
+//
+
+#define FLT_PORT_CONNECT            0x0001
+#define FLT_PORT_ALL_ACCESS         (FLT_PORT_CONNECT | STANDARD_RIGHTS_ALL)
+
+typedef
+NTSTATUS
+(*PFLT_CONNECT_NOTIFY) (
+    __in PFLT_PORT ClientPort,
+    __in_opt PVOID ServerPortCookie,
+    __in_bcount_opt(SizeOfContext) PVOID ConnectionContext,
+    __in ULONG SizeOfContext,
+    __deref_out_opt PVOID *ConnectionPortCookie
+    );
+
+typedef
+VOID
+(*PFLT_DISCONNECT_NOTIFY) (
+    __in_opt PVOID ConnectionCookie
+    );
+
+typedef
+NTSTATUS
+(*PFLT_MESSAGE_NOTIFY) (
+    __in_opt PVOID PortCookie,
+    __in_bcount_opt(InputBufferLength) PVOID InputBuffer,
+    __in ULONG InputBufferLength,
+    __out_bcount_part_opt(OutputBufferLength,*ReturnOutputBufferLength) PVOID OutputBuffer,
+    __in ULONG OutputBufferLength,
+    __out PULONG ReturnOutputBufferLength
+    );
+
+NTSTATUS
+FltBuildDefaultSecurityDescriptor (
+    __deref_out PSECURITY_DESCRIPTOR *SecurityDescriptor,
+    __in ACCESS_MASK DesiredAccess
+    );
+
+VOID
+FltFreeSecurityDescriptor (
+    __in PSECURITY_DESCRIPTOR SecurityDescriptor
+    );
+
+NTSTATUS
+FltCreateCommunicationPort (
+    __in PFLT_FILTER Filter,
+    __deref_out PFLT_PORT *ServerPort,
+    __in POBJECT_ATTRIBUTES ObjectAttributes,
+    __in_opt PVOID ServerPortCookie,
+    __in PFLT_CONNECT_NOTIFY ConnectNotifyCallback,
+    __in PFLT_DISCONNECT_NOTIFY DisconnectNotifyCallback,
+    __in_opt PFLT_MESSAGE_NOTIFY MessageNotifyCallback,
+    __in LONG MaxConnections
+    );
+
+VOID
+FltCloseCommunicationPort (
+    __in PFLT_PORT ServerPort
+    );
+
+VOID
+FltCloseClientPort (
+    __in PFLT_FILTER Filter,
+    __deref_out PFLT_PORT *ClientPort
+    );
+
+//
+//  Transactions.  FltGetRoutineAddress finds none of the routines, so the
+//  driver runs as it does down-level.
+//
+
+#define FLT_MAX_TRANSACTION_NOTIFICATIONS   0x0000003F
+
+#define TRANSACTION_NOTIFY_PREPREPARE       0x00000001
+#define TRANSACTION_NOTIFY_PREPARE          0x00000002
+#define TRANSACTION_NOTIFY_COMMIT           0x00000004
+#define TRANSACTION_NOTIFY_ROLLBACK         0x00000008
+#define TRANSACTION_NOTIFY_COMMIT_FINALIZE  0x40000000
+
+//---------------------------------------------------------------------------
+//  Debugging
+//---------------------------------------------------------------------------
+
+ULONG
+DbgPrint (
+    __in PCSTR Format,
+    ...
+    );
+
+#define KdPrint(_x_)
+
+#endif //__FAN_FLTKERNEL_H__
@@ -0,0 +1,18 @@
+/*++
+
+Module Name:
+
+    minispy.h
+
+Abstract:
+
+    Policy.c includes minispy.h by the name it has on Windows, where case
+    does not matter.  This is the shared header under that name.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include "../../inc/miniSpy.h"
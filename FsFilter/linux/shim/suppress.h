@@ -0,0 +1,20 @@
+/*++
+
+Module Name:
+
+    suppress.h
+
+Abstract:
+
+    Stands in for the WDK's suppress.h, which only lets PREfast
+    warnings be silenced.  GCC ignores the pragmas.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+#ifndef __FAN_SUPPRESS_H__
+#define __FAN_SUPPRESS_H__
+
+#endif //__FAN_SUPPRESS_H__
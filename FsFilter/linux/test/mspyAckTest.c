@@ -0,0 +1,869 @@
+/*++
+
+Module Name:
+
+    mspyAckTest.c
+
+Abstract:
+
+    Tests acknowledged delivery, SpyReaderAcknowledge and the detached
+    readers of ../filter/mspyReader.c, through the driver, with a consumer
+    that crashes.  The consumer keeps what it stores the way minispy keeps
+    its log file: each record is written out before it is acknowledged,
+    along with the last number written on each lane, so when it comes back
+    it knows which of the records sent again it already has.  Across any
+    number of crashes, before a batch is taken in, in the middle of one or
+    after it is stored and before it is acknowledged, every write is
+    stored exactly once, every lane's numbers follow on without a hole,
+    and a record sent again carries the number it had the first time.
+
+    It also checks that no more than ACK_WINDOW records are outstanding at
+    once, and that a consumer away when the quota runs out is forgotten.
+
+    With -b [seconds] it runs writers flat out against a consumer that
+    does not acknowledge, one that does and one that also crashes every
+    fifty milliseconds, and prints the writes and records stored a second,
+    the share lost and, for the one that crashes, the crashes and the
+    records sent again for each.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+
+#define TEST_QUOTA              65536
+#define TEST_WRITERS            4
+#define TEST_MAX_WRITES         (1 << 21)
+#define TEST_SUBSCRIBER_ID      7
+
+//
+//  What the consumer has written out, which survives its crashes: how
+//  many times each write was stored, the lane and number it was stored
+//  with, and the last number stored on each lane.  Alerts counts the
+//  burst alerts stored, which come of a file being written for the first
+//  time, as every file here is.
+//
+
+typedef struct _TEST_STORE {
+
+    UCHAR Stored[TEST_MAX_WRITES];
+    UCHAR Lane[TEST_MAX_WRITES];
+    ULONG Sequence[TEST_MAX_WRITES];
+
+    ULONG HighWater[ACK_LANES];
+
+    ULONGLONG Records;
+    ULONGLONG Alerts;
+    ULONGLONG Resent;
+    ULONG Holes;
+    ULONG Renumbered;
+    ULONG Strays;
+
+} TEST_STORE, *PTEST_STORE;
+
+//
+//  The consumer.  CrashAfter, if not 0, is how many more records it
+//  takes in before it dies; once Crashed it takes in nothing more until
+//  it is started again.
+//
+
+typedef struct _TEST_CONSUMER {
+
+    SIM_TEST_READER Reader;
+    ULONG SubscriberId;
+    PTEST_STORE Store;
+
+    ULONG CrashAfter;
+    BOOLEAN Crashed;
+    ULONG Crashes;
+
+} TEST_CONSUMER, *PTEST_CONSUMER;
+
+static TEST_STORE Store;
+
+static volatile ULONG NextWrite;
+
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+/*++
+
+Routine Description:
+
+    Stores a record, unless the consumer has crashed or already has it.
+    The write is known by the number in its file name, which comes first
+    in the record's names, ended by a newline.
+
+--*/
+{
+    PTEST_CONSUMER consumer = Context;
+    PTEST_STORE store = consumer->Store;
+    PWCHAR name = LogRecord->Name;
+    PWCHAR last = NULL;
+    ULONG first = LogRecord->SequenceNumber;
+    ULONG lane;
+    ULONG write = 0;
+
+    if (consumer->Crashed) {
+
+        return;
+    }
+
+    if (consumer->CrashAfter != 0 && --consumer->CrashAfter == 0) {
+
+        consumer->Crashed = TRUE;
+        return;
+    }
+
+    lane = FlagOn( LogRecord->RecordType, RECORD_TYPE_FLAG_PRIORITY ) ?
+                LOG_QUEUES :
+                LogRecord->Processor;
+
+    if (lane >= ACK_LANES) {
+
+        store->Strays += 1;
+        return;
+    }
+
+    //
+    //  Already stored before a crash.
+    //
+
+    if ((LONG)(LogRecord->SequenceNumber - store->HighWater[lane]) <= 0) {
+
+        store->Resent += 1;
+        return;
+    }
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP )) {
+
+        first = ((PRECORD_GAP) LogRecord->Name)->FirstSequence;
+    }
+
+    if (first != store->HighWater[lane] + 1) {
+
+        store->Holes += 1;
+    }
+
+    store->HighWater[lane] = LogRecord->SequenceNumber;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP )) {
+
+        return;
+    }
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_BURST )) {
+
+        store->Alerts += 1;
+        return;
+    }
+
+    if (LogRecord->Data.CallbackMajorId != IRP_MJ_WRITE) {
+        store->Strays += 1;
+        return;
+    }
+
+    for (; *name != 0 && *name != '\n'; name++) {
+
+        if (*name == '\\') {
+
+            last = name + 1;
+        }
+    }
+
+    if (last == NULL || last[0] != 'a' || last[1] != 'c' || last[2] != 'k') {
+
+        store->Strays += 1;
+        return;
+    }
+
+    for (last += 3; *last >= '0' && *last <= '9'; last++) {
+
+        write = write * 10 + (*last - '0');
+    }
+
+    if (write >= TEST_MAX_WRITES) {
+
+        store->Strays += 1;
+        return;
+    }
+
+    if (store->Stored[write] != 0 &&
+        (store->Lane[write] != lane || store->Sequence[write] != LogRecord->SequenceNumber)) {
+
+        store->Renumbered += 1;
+    }
+
+    store->Stored[write] += 1;
+    store->Lane[write] = (UCHAR) lane;
+    store->Sequence[write] = LogRecord->SequenceNumber;
+    store->Records += 1;
+}
+
+
+static BOOLEAN
+TestStart (
+    __in ULONG Quota
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver with a fixed quota, coalescing and sampling off so
+    each write is one record.
+
+--*/
+{
+    memset( &Store, 0, sizeof(Store) );
+    NextWrite = 0;
+
+    SimTestSetDword( "MaxRecords", Quota );
+    SimTestSetDword( "RecordQuotaFloor", Quota );
+    SimTestSetDword( "RecordQuotaCeiling", Quota );
+    SimTestSetDword( "WriteCoalesceLimit", 1 );
+    SimTestSetDword( "ProcessRecordBudget", 0 );
+
+    return SimTestLoad();
+}
+
+
+static BOOLEAN
+TestConnect (
+    __out PTEST_CONSUMER Consumer,
+    __in ULONG SubscriberId
+    )
+{
+    memset( Consumer, 0, sizeof(*Consumer) );
+    Consumer->SubscriberId = SubscriberId;
+    Consumer->Store = &Store;
+
+    return SimTestConnect( &Consumer->Reader, SubscriberId, TestTakeRecord, Consumer );
+}
+
+
+static BOOLEAN
+TestRestart (
+    __inout PTEST_CONSUMER Consumer,
+    __in ULONG CrashAfter
+    )
+/*++
+
+Routine Description:
+
+    Starts a consumer that crashed again.  Its connection goes without a
+    word and nothing it held in memory is kept, sequence checks included;
+    the store is.
+
+--*/
+{
+    SimTestDisconnect( &Consumer->Reader );
+
+    Consumer->Crashes += 1;
+    Consumer->Crashed = FALSE;
+    Consumer->CrashAfter = CrashAfter;
+
+    return SimTestConnect( &Consumer->Reader, Consumer->SubscriberId, TestTakeRecord, Consumer );
+}
+
+
+static VOID
+TestWrite (
+    __in ULONG Processor,
+    __in ULONG Writes
+    )
+/*++
+
+Routine Description:
+
+    Makes Writes writes from the processor, each to a file named after
+    the write's number, so a record tells which write it is.
+
+--*/
+{
+    static const UCHAR data[16];
+    PFILE_OBJECT fileObject;
+    CHAR name[64];
+    ULONG write;
+    ULONG i;
+
+    FanSimSetProcessor( Processor );
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+
+    for (i = 0; i < Writes; i++) {
+
+        write = __atomic_fetch_add( &NextWrite, 1, __ATOMIC_RELAXED );
+
+        if (write >= TEST_MAX_WRITES) {
+
+            return;
+        }
+
+        snprintf( name, sizeof(name), "\\protected\\ack%u.dat", write );
+
+        fileObject = SimTestCreate( name, FILE_GENERIC_WRITE, FILE_OVERWRITE_IF );
+
+        if (fileObject == NULL) {
+
+            return;
+        }
+
+        CHECK( FanSimWrite( fileObject, 0, data, sizeof(data), NULL ) == STATUS_SUCCESS );
+        FanSimCloseFile( fileObject );
+    }
+}
+
+
+static VOID
+TestExactlyOnce (
+    __in ULONG Writes
+    )
+/*++
+
+Routine Description:
+
+    Checks the store holds each of the first Writes writes once, and
+    nothing else.
+
+--*/
+{
+    ULONG missing = 0;
+    ULONG repeated = 0;
+    ULONG i;
+
+    for (i = 0; i < Writes; i++) {
+
+        if (Store.Stored[i] == 0) {
+
+            missing += 1;
+
+        } else if (Store.Stored[i] > 1) {
+
+            repeated += 1;
+        }
+    }
+
+    CHECK( missing == 0 );
+    CHECK( repeated == 0 );
+    CHECK( Store.Records == Writes );
+    CHECK( Store.Holes == 0 );
+    CHECK( Store.Renumbered == 0 );
+    CHECK( Store.Strays == 0 );
+}
+
+
+//---------------------------------------------------------------------------
+//  Threads
+//---------------------------------------------------------------------------
+
+typedef struct _TEST_RUN {
+
+    PTEST_CONSUMER Consumer;
+    ULONG Writes;
+    LONGLONG Until;
+
+    //
+    //  How often the consumer crashes: after some random number of
+    //  records up to CrashEvery, or, if CrashPeriod is not 0, about
+    //  every CrashPeriod nanoseconds.
+    //
+
+    ULONG CrashEvery;
+    LONGLONG CrashPeriod;
+
+    volatile BOOLEAN Stop;
+
+} TEST_RUN, *PTEST_RUN;
+
+typedef struct _TEST_WRITER {
+
+    pthread_t Thread;
+    PTEST_RUN Run;
+    ULONG Processor;
+
+} TEST_WRITER, *PTEST_WRITER;
+
+
+static PVOID
+TestWriter (
+    __in PVOID Parameter
+    )
+{
+    PTEST_WRITER writer = Parameter;
+    PTEST_RUN run = writer->Run;
+
+    if (run->Until != 0) {
+
+        while (SimTestNow() < run->Until && NextWrite < TEST_MAX_WRITES - 64) {
+
+            TestWrite( writer->Processor, 64 );
+        }
+
+    } else {
+
+        TestWrite( writer->Processor, run->Writes );
+    }
+
+    return NULL;
+}
+
+
+static ULONG
+TestCrashAfter (
+    __in PTEST_RUN Run
+    )
+{
+    return Run->CrashEvery != 0 ? (ULONG) rand() % Run->CrashEvery + 1 : 0;
+}
+
+
+static PVOID
+TestConsumer (
+    __in PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Reads and stores until told to stop, starting again each time it
+    crashes.
+
+--*/
+{
+    PTEST_RUN run = Parameter;
+    PTEST_CONSUMER consumer = run->Consumer;
+    LONGLONG crash = run->CrashPeriod != 0 ? SimTestNow() + run->CrashPeriod : 0;
+
+    consumer->CrashAfter = TestCrashAfter( run );
+
+    while (!run->Stop) {
+
+        if (crash != 0 && SimTestNow() >= crash) {
+
+            consumer->Crashed = TRUE;
+            crash += run->CrashPeriod;
+        }
+
+        if (consumer->Crashed) {
+
+            if (!TestRestart( consumer, TestCrashAfter( run ) )) {
+
+                break;
+            }
+
+            continue;
+        }
+
+        if (!SimTestRead( &consumer->Reader )) {
+
+            usleep( 100 );
+        }
+    }
+
+    return NULL;
+}
+
+
+static VOID
+TestRun (
+    __inout PTEST_RUN Run
+    )
+/*++
+
+Routine Description:
+
+    Runs TEST_WRITERS writers, each on its own processor, against the
+    consumer, then has the consumer, started again if need be, read what
+    is left without crashing.
+
+--*/
+{
+    TEST_WRITER writers[TEST_WRITERS];
+    pthread_t consumer;
+    ULONG i;
+
+    pthread_create( &consumer, NULL, TestConsumer, Run );
+
+    for (i = 0; i < TEST_WRITERS; i++) {
+
+        writers[i].Run = Run;
+        writers[i].Processor = i;
+        pthread_create( &writers[i].Thread, NULL, TestWriter, &writers[i] );
+    }
+
+    for (i = 0; i < TEST_WRITERS; i++) {
+
+        pthread_join( writers[i].Thread, NULL );
+    }
+
+    Run->Stop = TRUE;
+    pthread_join( consumer, NULL );
+
+    if (Run->Consumer->Crashed) {
+
+        TestRestart( Run->Consumer, 0 );
+    }
+
+    Run->Consumer->CrashAfter = 0;
+    SimTestDrain( &Run->Consumer->Reader );
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestResume (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Writes come in on three processors while the consumer crashes every
+    which way: at a random record, which is in the middle of a batch as
+    often as not; after storing a batch and before acknowledging it; and
+    with records written while it is away.  Each write is stored once.
+
+--*/
+{
+    TEST_CONSUMER consumer;
+    ULONG round;
+
+    srand( 35 );
+
+    if (!TestStart( TEST_QUOTA )) {
+
+        return;
+    }
+
+    if (!TestConnect( &consumer, TEST_SUBSCRIBER_ID )) {
+
+        SimTestUnload( NULL );
+        return;
+    }
+
+    for (round = 0; round < 60; round++) {
+
+        TestWrite( round % 3, 100 );
+
+        switch (round % 3) {
+
+        case 0:
+
+            //
+            //  Dies part way through what comes.
+            //
+
+            consumer.CrashAfter = (ULONG) rand() % 150 + 1;
+
+            while (!consumer.Crashed && SimTestRead( &consumer.Reader )) {
+
+                NOTHING;
+            }
+
+            break;
+
+        case 1:
+
+            //
+            //  Stores a batch, then dies before acknowledging it.
+            //
+
+            consumer.CrashAfter = 0;
+            SimTestRead( &consumer.Reader );
+            consumer.Crashed = TRUE;
+            break;
+
+        default:
+
+            //
+            //  Keeps up and acknowledges everything, then dies and stays
+            //  away while writes come in.
+            //
+
+            consumer.CrashAfter = 0;
+            SimTestDrain( &consumer.Reader );
+            consumer.Crashed = TRUE;
+            TestWrite( 1, 50 );
+            break;
+        }
+
+        TestRestart( &consumer, 0 );
+    }
+
+    SimTestDrain( &consumer.Reader );
+
+    CHECK( consumer.Crashes == 60 );
+    CHECK( consumer.Reader.Lost == 0 );
+    CHECK( Store.Resent != 0 );
+    TestExactlyOnce( NextWrite );
+
+    //
+    //  Everything was acknowledged, so nothing is left queued.
+    //
+
+    SimTestDisconnect( &consumer.Reader );
+    CHECK( MiniSpyData.RecordsAllocated == 0 );
+
+    SimTestUnload( NULL );
+}
+
+
+static VOID
+TestWindow (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A consumer that never acknowledges is sent ACK_WINDOW records and no
+    more; acknowledging them lets the rest come.
+
+--*/
+{
+    TEST_CONSUMER consumer;
+    ULONGLONG sent;
+
+    if (!TestStart( TEST_QUOTA )) {
+
+        return;
+    }
+
+    if (!TestConnect( &consumer, TEST_SUBSCRIBER_ID )) {
+
+        SimTestUnload( NULL );
+        return;
+    }
+
+    TestWrite( 0, 2 * ACK_WINDOW + 100 );
+
+    do {
+
+        memset( consumer.Reader.Sequence.Received, 0, sizeof(consumer.Reader.Sequence.Received) );
+
+    } while (SimTestRead( &consumer.Reader ));
+
+    sent = Store.Records + Store.Alerts;
+
+    CHECK( sent == ACK_WINDOW );
+    CHECK( MiniSpyData.Readers[0].Retained == ACK_WINDOW );
+
+    consumer.Reader.Sequence.Received[0] = Store.HighWater[0];
+    SimTestDrain( &consumer.Reader );
+
+    CHECK( Store.Records == NextWrite );
+    CHECK( Store.Holes == 0 );
+    CHECK( Store.Strays == 0 );
+
+    SimTestUnload( &consumer.Reader );
+}
+
+
+static VOID
+TestForgotten (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A consumer away when the quota runs out is let go, so that records
+    keep being logged, and its next connection starts afresh.
+
+--*/
+{
+    TEST_CONSUMER consumer;
+    ULONG write;
+
+    if (!TestStart( 1024 )) {
+
+        return;
+    }
+
+    if (!TestConnect( &consumer, TEST_SUBSCRIBER_ID )) {
+
+        SimTestUnload( NULL );
+        return;
+    }
+
+    TestWrite( 0, 100 );
+    SimTestRead( &consumer.Reader );
+    SimTestDisconnect( &consumer.Reader );
+
+    CHECK( MiniSpyData.ReaderMask != 0 );
+
+    TestWrite( 0, 2000 );
+
+    CHECK( MiniSpyData.ReaderMask == 0 );
+
+    memset( Store.HighWater, 0, sizeof(Store.HighWater) );
+
+    if (SimTestConnect( &consumer.Reader, TEST_SUBSCRIBER_ID, TestTakeRecord, &consumer )) {
+
+        SimTestDrain( &consumer.Reader );
+    }
+
+    //
+    //  The records it had not been sent when it was let go are gone, and
+    //  it is sent the ones logged since, numbered from 1.
+    //
+
+    for (write = 100; write < NextWrite && Store.Stored[write] == 0; write++) {
+
+        NOTHING;
+    }
+
+    CHECK( Store.Stored[0] == 1 );
+    CHECK( Store.Stored[99] == 1 );
+    CHECK( Store.Stored[100] == 0 );
+    CHECK( write < NextWrite && Store.Sequence[write] == 1 );
+    CHECK( Store.Holes == 0 );
+    CHECK( Store.Records < NextWrite );
+
+    SimTestUnload( &consumer.Reader );
+}
+
+
+static VOID
+TestCrashes (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Writers on four processors against a consumer that crashes every few
+    hundred records, at random.
+
+--*/
+{
+    TEST_CONSUMER consumer;
+    TEST_RUN run;
+
+    srand( 36 );
+
+    if (!TestStart( TEST_QUOTA )) {
+
+        return;
+    }
+
+    if (!TestConnect( &consumer, TEST_SUBSCRIBER_ID )) {
+
+        SimTestUnload( NULL );
+        return;
+    }
+
+    memset( &run, 0, sizeof(run) );
+    run.Consumer = &consumer;
+    run.Writes = 5000;
+    run.CrashEvery = 500;
+
+    TestRun( &run );
+
+    CHECK( NextWrite == TEST_WRITERS * 5000 );
+    CHECK( consumer.Crashes != 0 );
+    CHECK( consumer.Reader.Lost == 0 );
+    TestExactlyOnce( NextWrite );
+
+    SimTestUnload( &consumer.Reader );
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+{
+    static const PCSTR modes[] = { "plain", "acked", "crashing" };
+    TEST_CONSUMER consumer;
+    TEST_RUN run;
+    LONGLONG start;
+    double elapsed;
+    ULONG writes;
+    ULONG mode;
+
+    printf( "%-9s %12s %12s %7s %8s %12s\n",
+            "consumer", "writes/s", "stored/s", "lost", "crashes", "resent each" );
+
+    for (mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++) {
+
+        if (!TestStart( TEST_QUOTA )) {
+
+            return 1;
+        }
+
+        if (!TestConnect( &consumer, mode != 0 ? TEST_SUBSCRIBER_ID : 0 )) {
+
+            SimTestUnload( NULL );
+            return 1;
+        }
+
+        memset( &run, 0, sizeof(run) );
+        run.Consumer = &consumer;
+        run.CrashPeriod = mode == 2 ? 50 * 1000000 : 0;
+
+        start = SimTestNow();
+        run.Until = start + (LONGLONG) Seconds * 1000000000;
+
+        TestRun( &run );
+
+        elapsed = (SimTestNow() - start) / 1e9;
+        writes = min( NextWrite, TEST_MAX_WRITES );
+
+        printf( "%-9s %12.0f %12.0f %6.2f%% %8u %12.0f\n",
+                modes[mode],
+                writes / elapsed,
+                Store.Records / elapsed,
+                writes != 0 ? 100.0 * consumer.Reader.Lost / writes : 0.0,
+                consumer.Crashes,
+                consumer.Crashes != 0 ? (double) Store.Resent / consumer.Crashes : 0.0 );
+
+        if (mode != 0) {
+
+            CHECK( consumer.Reader.Lost == 0 );
+            TestExactlyOnce( writes );
+        }
+
+        SimTestUnload( &consumer.Reader );
+    }
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestResume();
+    TestWindow();
+    TestForgotten();
+    TestCrashes();
+
+    return SimTestFinish( "mspyAckTest" );
+}
@@ -0,0 +1,803 @@
+/*++
+
+Module Name:
+
+    mspyBurstTest.c
+
+Abstract:
+
+    Tests the burst detector, ../filter/mspyBurst.c, through the driver:
+    renames, deletes and overwrites in the protected folder are counted
+    per process and kind, a process that reaches a threshold is reported
+    once per window on the priority lane, an overwrite is counted once
+    per handle, counts leave the window as it slides, and with blocking
+    on the process is denied further changes until SetMiniSpyBurst lets
+    it go.  Then many threads count at once, as one process and as many,
+    and not one operation may be lost.
+
+    With -b [seconds] it times SpyBurstOperation itself, called directly
+    below the thresholds, from 1 to TEST_THREADS threads, all counting
+    against one process's counters and each against its own.  The "off"
+    rows, with no threshold, are the cost of the call around the
+    counters.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+
+//
+//  The counting threads run as processes TEST_FIRST_PROCESS on, all
+//  running the allowed image.
+//
+
+#define TEST_FIRST_PROCESS      1000
+#define TEST_THREADS            8
+#define TEST_CALLS              200000
+
+#define TEST_WINDOW             10000
+
+//
+//  What the log held.
+//
+
+typedef struct _TEST_TALLY {
+
+    ULONG Alerts;
+    ULONG BlockedAlerts;
+    ULONG Kinds[BURST_KINDS];
+    ULONG Count;
+    BOOLEAN Priority;
+
+} TEST_TALLY, *PTEST_TALLY;
+
+static TEST_TALLY Tally;
+
+//
+//  What a counting thread does.
+//
+
+typedef struct _TEST_COUNTER {
+
+    pthread_t Thread;
+    ULONG Process;
+    ULONG Calls;
+    ULONGLONG Done;
+
+} TEST_COUNTER, *PTEST_COUNTER;
+
+static volatile BOOLEAN Stop;
+
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    PTEST_TALLY tally = Context;
+    ULONG kind;
+
+    if (!FlagOn( LogRecord->RecordType, RECORD_TYPE_BURST )) {
+
+        return;
+    }
+
+    tally->Alerts += 1;
+    tally->BlockedAlerts += (LogRecord->Data.Reserved[0] == 'b');
+    tally->Count = LogRecord->Data.Aggregate.Count;
+    tally->Priority = (BOOLEAN) (FlagOn( LogRecord->RecordType, RECORD_TYPE_FLAG_PRIORITY ) != 0);
+
+    for (kind = 0; kind < BURST_KINDS; kind++) {
+
+        if (LogRecord->Data.Reserved[1] == "RDW"[kind]) {
+
+            tally->Kinds[kind] += 1;
+        }
+    }
+}
+
+
+static BOOLEAN
+TestStart (
+    __out PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver with every threshold off, so the files can be laid
+    out without counting, and connects.
+
+--*/
+{
+    static BOOLEAN added;
+    ULONG i;
+
+    if (!added) {
+
+        for (i = 0; i < TEST_THREADS; i++) {
+
+            FanSimAddProcess( TEST_FIRST_PROCESS + i, "\\Program Files\\App\\a.exe", "S-1-5-21-1-1001" );
+        }
+
+        added = TRUE;
+    }
+
+    memset( &Tally, 0, sizeof(Tally) );
+
+    SimTestSetDword( "BurstRenameThreshold", 0 );
+    SimTestSetDword( "BurstDeleteThreshold", 0 );
+    SimTestSetDword( "BurstWriteThreshold", 0 );
+    SimTestSetDword( "BurstWindow", TEST_WINDOW );
+    SimTestSetDword( "BurstBlock", 0 );
+
+    if (!SimTestLoad()) {
+
+        return FALSE;
+    }
+
+    if (!SimTestConnect( Reader, 0, TestTakeRecord, &Tally )) {
+
+        SimTestUnload( NULL );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static LONG
+TestSetBurst (
+    __inout PSIM_TEST_READER Reader,
+    __in LONG Renames,
+    __in LONG Deletes,
+    __in LONG Writes,
+    __in LONG Window,
+    __in LONG Block
+    )
+/*++
+
+Routine Description:
+
+    Sends SetMiniSpyBurst as minispy's /k does.
+
+Return Value:
+
+    The reply's Reserved: 0 if the settings were taken, -1 if not.
+
+--*/
+{
+    UCHAR message[FIELD_OFFSET(COMMAND_MESSAGE, Data) + sizeof(BURST_SETTINGS)];
+    PCOMMAND_MESSAGE command = (PCOMMAND_MESSAGE) message;
+    PBURST_SETTINGS settings = (PBURST_SETTINGS) command->Data;
+    PVOID reply[512 / sizeof(PVOID)];
+    ULONG returned = 0;
+
+    memset( message, 0, sizeof(message) );
+    command->Command = SetMiniSpyBurst;
+    settings->Threshold[BURST_RENAME] = Renames;
+    settings->Threshold[BURST_DELETE] = Deletes;
+    settings->Threshold[BURST_WRITE] = Writes;
+    settings->Window = Window;
+    settings->Block = Block;
+
+    FanSimSetProcess( SIM_TEST_CONSUMER );
+
+    CHECK( FanSimSendMessage( Reader->Port,
+                              command,
+                              sizeof(message),
+                              reply,
+                              sizeof(reply),
+                              &returned ) == STATUS_SUCCESS );
+
+    return (LONG) ((PLOG_RECORD) reply)->Reserved;
+}
+
+
+static PFILE_OBJECT
+TestOpen (
+    __in ULONG Process,
+    __in PCSTR Prefix,
+    __in ULONG Number,
+    __in ULONG CreateDisposition
+    )
+/*++
+
+Routine Description:
+
+    Opens \protected\<Prefix><Number>.dat for writing and deleting as
+    the given process.
+
+--*/
+{
+    CHAR name[64];
+
+    snprintf( name, sizeof(name), "\\protected\\%s%u.dat", Prefix, Number );
+    FanSimSetProcess( Process );
+
+    return SimTestCreate( name, FILE_GENERIC_WRITE | DELETE, CreateDisposition );
+}
+
+
+static VOID
+TestLayOut (
+    __in PCSTR Prefix,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Creates Count files to rename or delete, with the thresholds off.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+
+        fileObject = TestOpen( SIM_TEST_ALLOWED, Prefix, i, FILE_OVERWRITE_IF );
+        CHECK( fileObject != NULL );
+
+        if (fileObject != NULL) {
+
+            FanSimCloseFile( fileObject );
+        }
+    }
+}
+
+
+static NTSTATUS
+TestDelete (
+    __in ULONG Process,
+    __in PCSTR Prefix,
+    __in ULONG Number
+    )
+{
+    PFILE_OBJECT fileObject = TestOpen( Process, Prefix, Number, FILE_OPEN );
+    NTSTATUS status;
+
+    if (fileObject == NULL) {
+
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    status = FanSimDelete( fileObject );
+    FanSimCloseFile( fileObject );
+
+    return status;
+}
+
+
+static NTSTATUS
+TestRename (
+    __in ULONG Process,
+    __in PCSTR Prefix,
+    __in ULONG Number
+    )
+{
+    PFILE_OBJECT fileObject = TestOpen( Process, Prefix, Number, FILE_OPEN );
+    CHAR name[64];
+    NTSTATUS status;
+
+    if (fileObject == NULL) {
+
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    snprintf( name, sizeof(name), "\\protected\\%s%u.locked", Prefix, Number );
+    status = FanSimRename( fileObject, name, TRUE );
+    FanSimCloseFile( fileObject );
+
+    return status;
+}
+
+
+static ULONGLONG
+TestWindowCount (
+    __in ULONG ProcessId,
+    __in ULONG Kind
+    )
+/*++
+
+Routine Description:
+
+    Adds up a process's counters of one kind, as SpyBurstCount does, for
+    the slice it last counted in.
+
+--*/
+{
+    PSPY_BURST_ENTRY entry;
+    ULONGLONG value;
+    ULONGLONG total = 0;
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < SPY_BURST_ENTRIES; i++) {
+
+        entry = &MiniSpyData.BurstEntries[i];
+
+        if (entry->Key == 0 || entry->ProcessId != (FILE_ID) ProcessId) {
+
+            continue;
+        }
+
+        for (j = 0; j < SPY_BURST_SLOTS; j++) {
+
+            value = (ULONGLONG) entry->Slots[Kind][j];
+
+            if ((ULONG) entry->LastSlice - (ULONG) (value >> 32) < SPY_BURST_SLOTS) {
+
+                total += (ULONG) value;
+            }
+        }
+    }
+
+    return total;
+}
+
+
+static void *
+TestCount (
+    void *Context
+    )
+/*++
+
+Routine Description:
+
+    Counts deletes as its process, Calls of them or until Stop.
+
+--*/
+{
+    PTEST_COUNTER counter = Context;
+    ULONG i;
+
+    FanSimSetProcess( counter->Process );
+
+    do {
+
+        for (i = 0; i < 1024; i++) {
+
+            SpyBurstOperation( NULL, NULL, NULL, BURST_DELETE );
+        }
+
+        counter->Done += 1024;
+
+    } while (counter->Calls != 0 ? counter->Done < counter->Calls : !Stop);
+
+    return NULL;
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestThresholds (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Deletes and renames up to their thresholds and past them.  Each kind
+    is reported once, on the priority lane, when its count reaches the
+    threshold, and not again within the window.  Opening files to do it
+    counts nothing.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    ULONG i;
+
+    if (!TestStart( &reader )) {
+
+        return;
+    }
+
+    TestLayOut( "d", 20 );
+    TestLayOut( "r", 10 );
+
+    CHECK( TestSetBurst( &reader, 5, 10, 0, TEST_WINDOW, 0 ) == 0 );
+    CHECK( TestSetBurst( &reader, 5, -1, 0, TEST_WINDOW, 0 ) == -1 );
+    CHECK( TestSetBurst( &reader, 5, 10, 0, SPY_BURST_SLOTS - 1, 0 ) == -1 );
+
+    for (i = 0; i < 9; i++) {
+
+        CHECK( TestDelete( SIM_TEST_ALLOWED, "d", i ) == STATUS_SUCCESS );
+    }
+
+    SimTestDrain( &reader );
+    CHECK( Tally.Alerts == 0 );
+
+    CHECK( TestDelete( SIM_TEST_ALLOWED, "d", 9 ) == STATUS_SUCCESS );
+    SimTestDrain( &reader );
+
+    CHECK( Tally.Alerts == 1 );
+    CHECK( Tally.Kinds[BURST_DELETE] == 1 );
+    CHECK( Tally.Count == 10 );
+    CHECK( Tally.Priority );
+    CHECK( Tally.BlockedAlerts == 0 );
+
+    for (i = 10; i < 20; i++) {
+
+        CHECK( TestDelete( SIM_TEST_ALLOWED, "d", i ) == STATUS_SUCCESS );
+    }
+
+    for (i = 0; i < 10; i++) {
+
+        CHECK( TestRename( SIM_TEST_ALLOWED, "r", i ) == STATUS_SUCCESS );
+    }
+
+    SimTestDrain( &reader );
+
+    CHECK( Tally.Alerts == 2 );
+    CHECK( Tally.Kinds[BURST_DELETE] == 1 );
+    CHECK( Tally.Kinds[BURST_RENAME] == 1 );
+    CHECK( TestWindowCount( SIM_TEST_ALLOWED, BURST_DELETE ) == 20 );
+    CHECK( TestWindowCount( SIM_TEST_ALLOWED, BURST_RENAME ) == 10 );
+
+    SimTestUnload( &reader );
+}
+
+
+static VOID
+TestOverwrites (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Any number of writes on one handle are one overwrite; a create that
+    overwrites is one, and the writes after it are not counted again.
+
+--*/
+{
+    static const UCHAR data[16];
+    SIM_TEST_READER reader;
+    PFILE_OBJECT handles[3];
+    ULONG i;
+    ULONG j;
+
+    if (!TestStart( &reader )) {
+
+        return;
+    }
+
+    TestLayOut( "w", 3 );
+    CHECK( TestSetBurst( &reader, 0, 0, 3, TEST_WINDOW, 0 ) == 0 );
+
+    handles[0] = TestOpen( SIM_TEST_ALLOWED, "w", 0, FILE_OPEN );
+    handles[1] = TestOpen( SIM_TEST_ALLOWED, "w", 1, FILE_OVERWRITE );
+    CHECK( handles[0] != NULL && handles[1] != NULL );
+
+    for (i = 0; i < 100; i++) {
+
+        for (j = 0; j < 2; j++) {
+
+            if (handles[j] != NULL) {
+
+                CHECK( FanSimWrite( handles[j], -1, data, sizeof(data), NULL ) == STATUS_SUCCESS );
+            }
+        }
+    }
+
+    SimTestDrain( &reader );
+    CHECK( Tally.Alerts == 0 );
+    CHECK( TestWindowCount( SIM_TEST_ALLOWED, BURST_WRITE ) == 2 );
+
+    handles[2] = TestOpen( SIM_TEST_ALLOWED, "w", 2, FILE_SUPERSEDE );
+    CHECK( handles[2] != NULL );
+    SimTestDrain( &reader );
+
+    CHECK( Tally.Alerts == 1 );
+    CHECK( Tally.Kinds[BURST_WRITE] == 1 );
+    CHECK( Tally.Count == 3 );
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+
+    for (j = 0; j < 3; j++) {
+
+        if (handles[j] != NULL) {
+
+            FanSimCloseFile( handles[j] );
+        }
+    }
+
+    SimTestUnload( &reader );
+}
+
+
+static VOID
+TestSliding (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Nine deletes, a wait longer than the window, nine more: never ten in
+    one window, so never reported, and the old ones are no longer
+    counted.  Slower running only spreads the deletes further apart.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    ULONG i;
+
+    if (!TestStart( &reader )) {
+
+        return;
+    }
+
+    TestLayOut( "s", 18 );
+    CHECK( TestSetBurst( &reader, 0, 10, 0, 80, 0 ) == 0 );
+
+    for (i = 0; i < 9; i++) {
+
+        CHECK( TestDelete( SIM_TEST_ALLOWED, "s", i ) == STATUS_SUCCESS );
+    }
+
+    usleep( 120 * 1000 );
+
+    for (i = 9; i < 18; i++) {
+
+        CHECK( TestDelete( SIM_TEST_ALLOWED, "s", i ) == STATUS_SUCCESS );
+    }
+
+    SimTestDrain( &reader );
+
+    CHECK( Tally.Alerts == 0 );
+    CHECK( TestWindowCount( SIM_TEST_ALLOWED, BURST_DELETE ) <= 9 );
+
+    SimTestUnload( &reader );
+}
+
+
+static VOID
+TestBlocking (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    With blocking on, the delete that reaches the threshold is denied and
+    so is every later change by that process, writes on a handle it
+    already had included, while another process running the same image
+    carries on.  Setting the thresholds again lets it go.
+
+--*/
+{
+    static const UCHAR data[16];
+    SIM_TEST_READER reader;
+    PFILE_OBJECT handle;
+    ULONG i;
+
+    if (!TestStart( &reader )) {
+
+        return;
+    }
+
+    TestLayOut( "b", 10 );
+
+    handle = TestOpen( SIM_TEST_ALLOWED, "held", 0, FILE_OVERWRITE_IF );
+    CHECK( handle != NULL );
+
+    CHECK( TestSetBurst( &reader, 0, 5, 0, TEST_WINDOW, 1 ) == 0 );
+
+    for (i = 0; i < 4; i++) {
+
+        CHECK( TestDelete( SIM_TEST_ALLOWED, "b", i ) == STATUS_SUCCESS );
+    }
+
+    CHECK( TestDelete( SIM_TEST_ALLOWED, "b", 4 ) == STATUS_ACCESS_DENIED );
+    CHECK( TestDelete( SIM_TEST_ALLOWED, "b", 5 ) == STATUS_ACCESS_DENIED );
+    CHECK( TestRename( SIM_TEST_ALLOWED, "b", 5 ) == STATUS_ACCESS_DENIED );
+
+    if (handle != NULL) {
+
+        FanSimSetProcess( SIM_TEST_ALLOWED );
+        CHECK( FanSimWrite( handle, 0, data, sizeof(data), NULL ) == STATUS_ACCESS_DENIED );
+    }
+
+    CHECK( TestDelete( TEST_FIRST_PROCESS, "b", 6 ) == STATUS_SUCCESS );
+
+    SimTestDrain( &reader );
+    CHECK( Tally.Alerts == 1 );
+    CHECK( Tally.BlockedAlerts == 1 );
+    CHECK( MiniSpyData.BurstBlocked == 1 );
+
+    CHECK( TestSetBurst( &reader, 0, 5, 0, TEST_WINDOW, 1 ) == 0 );
+    CHECK( MiniSpyData.BurstBlocked == 0 );
+    CHECK( TestDelete( SIM_TEST_ALLOWED, "b", 4 ) == STATUS_SUCCESS );
+
+    if (handle != NULL) {
+
+        FanSimSetProcess( SIM_TEST_ALLOWED );
+        CHECK( FanSimWrite( handle, 0, data, sizeof(data), NULL ) == STATUS_SUCCESS );
+        FanSimCloseFile( handle );
+    }
+
+    SimTestUnload( &reader );
+}
+
+
+static VOID
+TestContention (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    TEST_THREADS threads count TEST_CALLS deletes each, first all as one
+    process, on the same counters, then each as its own.  The window is
+    far longer than the run and the threshold never reached, so every
+    count must be there.
+
+--*/
+{
+    TEST_COUNTER counters[TEST_THREADS];
+    SIM_TEST_READER reader;
+    ULONG shared;
+    ULONG i;
+
+    for (shared = 0; shared < 2; shared++) {
+
+        if (!TestStart( &reader )) {
+
+            return;
+        }
+
+        CHECK( TestSetBurst( &reader, 0, 0x7FFFFFFF, 0, 1000000, 0 ) == 0 );
+
+        for (i = 0; i < TEST_THREADS; i++) {
+
+            counters[i].Process = TEST_FIRST_PROCESS + (shared == 0 ? 0 : i);
+            counters[i].Calls = TEST_CALLS;
+            counters[i].Done = 0;
+            CHECK( pthread_create( &counters[i].Thread, NULL, TestCount, &counters[i] ) == 0 );
+        }
+
+        for (i = 0; i < TEST_THREADS; i++) {
+
+            pthread_join( counters[i].Thread, NULL );
+        }
+
+        if (shared == 0) {
+
+            CHECK( TestWindowCount( TEST_FIRST_PROCESS, BURST_DELETE ) ==
+                   (ULONGLONG) TEST_THREADS * ROUND_TO_SIZE( TEST_CALLS, 1024 ) );
+
+        } else {
+
+            for (i = 0; i < TEST_THREADS; i++) {
+
+                CHECK( TestWindowCount( TEST_FIRST_PROCESS + i, BURST_DELETE ) ==
+                       ROUND_TO_SIZE( TEST_CALLS, 1024 ) );
+            }
+        }
+
+        SimTestDrain( &reader );
+        CHECK( Tally.Alerts == 0 );
+
+        SimTestUnload( &reader );
+    }
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    SpyBurstOperation from 1 to TEST_THREADS threads for Seconds each,
+    with deletes off, then counted against one process shared by all the
+    threads, then each thread against its own process.  ns/call is per
+    thread, so it grows with the threads once they outnumber the
+    processors.  Each counted call reads the clock, which here is
+    clock_gettime; where that is a system call it is most of the cost.
+
+--*/
+{
+    static const ULONG threads[] = { 1, 2, 4, 8 };
+    static const PCSTR modes[] = { "off", "shared", "own" };
+    TEST_COUNTER counters[TEST_THREADS];
+    SIM_TEST_READER reader;
+    ULONGLONG calls;
+    LONGLONG start;
+    LONGLONG elapsed;
+    ULONG mode;
+    ULONG i;
+    ULONG j;
+
+    printf( "%-8s %8s %14s %12s\n", "counters", "threads", "calls/s", "ns/call" );
+
+    for (mode = 0; mode < 3; mode++) {
+
+        for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+
+            if (!TestStart( &reader )) {
+
+                return 1;
+            }
+
+            CHECK( TestSetBurst( &reader, 0, mode != 0 ? 0x7FFFFFFF : 0, 0, 1000000, 0 ) == 0 );
+
+            Stop = FALSE;
+            start = SimTestNow();
+
+            for (j = 0; j < threads[i]; j++) {
+
+                counters[j].Process = TEST_FIRST_PROCESS + (mode == 2 ? j : 0);
+                counters[j].Calls = 0;
+                counters[j].Done = 0;
+                pthread_create( &counters[j].Thread, NULL, TestCount, &counters[j] );
+            }
+
+            usleep( Seconds * 1000000 );
+            Stop = TRUE;
+            calls = 0;
+
+            for (j = 0; j < threads[i]; j++) {
+
+                pthread_join( counters[j].Thread, NULL );
+                calls += counters[j].Done;
+            }
+
+            elapsed = SimTestNow() - start;
+
+            printf( "%-8s %8u %14.0f %12.1f\n",
+                    modes[mode],
+                    threads[i],
+                    calls * 1e9 / elapsed,
+                    (double) elapsed * threads[i] / calls );
+
+            SimTestUnload( &reader );
+        }
+    }
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestThresholds();
+    TestOverwrites();
+    TestSliding();
+    TestBlocking();
+    TestContention();
+
+    return SimTestFinish( "mspyBurstTest" );
+}
@@ -0,0 +1,635 @@
+/*++
+
+Module Name:
+
+    mspyCoalesceTest.c
+
+Abstract:
+
+    Tests the write coalescer, ../filter/mspyCoalesce.c, through the
+    driver: the allowed image writes in the protected folder and the log
+    is read back, and however the writes were folded the aggregates must
+    add up to exactly the writes and bytes that were made.  Each way a
+    held record is sent up is checked too: the write limit, the byte cap,
+    cleanup, another operation on the handle and the idle timer.
+
+    With -b [seconds] it reports instead how far coalescing cuts the
+    records a workload produces, for sequential writes to one file,
+    writes interleaved across many open files and many small files, at a
+    range of WriteCoalesceLimit settings.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simTest.h"
+
+#define TEST_WRITE_SIZE         4096
+#define TEST_BIG_WRITE          (1024 * 1024)
+
+static UCHAR WriteData[TEST_BIG_WRITE];
+
+//
+//  What the log held of the writes.
+//
+
+typedef struct _TEST_WRITES {
+
+    ULONG Records;
+    ULONG Aggregates;
+    ULONGLONG Writes;
+    ULONGLONG Bytes;
+    ULONGLONG Covered;
+    LONGLONG Lowest;
+    LONGLONG Highest;
+    ULONG Largest;
+    ULONG Other;
+
+} TEST_WRITES, *PTEST_WRITES;
+
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    PTEST_WRITES writes = Context;
+    PRECORD_AGGREGATE aggregate = &LogRecord->Data.Aggregate;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP | RECORD_TYPE_FLAG_PRIORITY ) ||
+        LogRecord->Data.CallbackMajorId != IRP_MJ_WRITE) {
+
+        writes->Other += 1;
+        return;
+    }
+
+    writes->Records += 1;
+
+    if (!FlagOn( LogRecord->RecordType, RECORD_TYPE_AGGREGATE )) {
+
+        writes->Writes += 1;
+        return;
+    }
+
+    writes->Aggregates += 1;
+    writes->Writes += aggregate->Count;
+    writes->Bytes += aggregate->TotalBytes;
+    writes->Covered += aggregate->EndOffset - aggregate->StartOffset;
+
+    if (writes->Aggregates == 1 || aggregate->StartOffset < writes->Lowest) {
+
+        writes->Lowest = aggregate->StartOffset;
+    }
+
+    if (aggregate->EndOffset > writes->Highest) {
+
+        writes->Highest = aggregate->EndOffset;
+    }
+
+    if (aggregate->Count > writes->Largest) {
+
+        writes->Largest = aggregate->Count;
+    }
+}
+
+
+static BOOLEAN
+TestStart (
+    __in ULONG Limit,
+    __in ULONG Idle,
+    __out PSIM_TEST_READER Reader,
+    __out PTEST_WRITES Writes
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver with the given WriteCoalesceLimit and
+    WriteCoalesceIdle, and connects.  MaxRecords is raised so that
+    nothing is lost between drains even with coalescing off.
+
+--*/
+{
+    memset( Writes, 0, sizeof(*Writes) );
+
+    SimTestSetDword( "MaxRecords", 65536 );
+    SimTestSetDword( "WriteCoalesceLimit", Limit );
+    SimTestSetDword( "WriteCoalesceIdle", Idle );
+
+    if (!SimTestLoad()) {
+
+        return FALSE;
+    }
+
+    if (!SimTestConnect( Reader, 0, TestTakeRecord, Writes )) {
+
+        SimTestUnload( NULL );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static VOID
+TestWrite (
+    __in PFILE_OBJECT FileObject,
+    __in ULONG Length
+    )
+{
+    ULONG_PTR written = 0;
+
+    CHECK( FanSimWrite( FileObject, FAN_SIM_CURRENT_OFFSET, WriteData, Length, &written ) == STATUS_SUCCESS );
+    CHECK( written == Length );
+}
+
+
+static PFILE_OBJECT
+TestOpen (
+    __in ULONG Index
+    )
+{
+    CHAR name[64];
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    snprintf( name, sizeof(name), "\\protected\\c%u.dat", Index );
+
+    return SimTestCreate( name, FILE_GENERIC_WRITE | FILE_GENERIC_READ, FILE_OVERWRITE_IF );
+}
+
+
+//---------------------------------------------------------------------------
+//  Workloads
+//---------------------------------------------------------------------------
+
+static ULONG
+TestSequential (
+    __in ULONG Writes
+    )
+/*++
+
+Routine Description:
+
+    Writes one file front to back in TEST_WRITE_SIZE pieces.
+
+Return Value:
+
+    The writes made.
+
+--*/
+{
+    PFILE_OBJECT fileObject = TestOpen( 0 );
+    ULONG i;
+
+    if (fileObject == NULL) {
+
+        return 0;
+    }
+
+    for (i = 0; i < Writes; i++) {
+
+        TestWrite( fileObject, TEST_WRITE_SIZE );
+    }
+
+    FanSimCloseFile( fileObject );
+    return Writes;
+}
+
+
+static ULONG
+TestInterleaved (
+    __in ULONG Files,
+    __in ULONG Writes
+    )
+/*++
+
+Routine Description:
+
+    Holds Files files open at once and writes each in turn, Writes times
+    over.  Handles whose file objects share a coalescer slot evict each
+    other's records.
+
+--*/
+{
+    PFILE_OBJECT fileObjects[64];
+    ULONG made = 0;
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < Files; i++) {
+
+        fileObjects[i] = TestOpen( i );
+    }
+
+    for (j = 0; j < Writes; j++) {
+
+        for (i = 0; i < Files; i++) {
+
+            if (fileObjects[i] != NULL) {
+
+                TestWrite( fileObjects[i], TEST_WRITE_SIZE );
+                made += 1;
+            }
+        }
+    }
+
+    for (i = 0; i < Files; i++) {
+
+        if (fileObjects[i] != NULL) {
+
+            FanSimCloseFile( fileObjects[i] );
+        }
+    }
+
+    return made;
+}
+
+
+static ULONG
+TestSmallFiles (
+    __in ULONG Files,
+    __in ULONG Writes
+    )
+/*++
+
+Routine Description:
+
+    Creates, writes and closes Files files one after another, Writes
+    writes each.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+    ULONG made = 0;
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < Files; i++) {
+
+        fileObject = TestOpen( i );
+
+        if (fileObject == NULL) {
+
+            continue;
+        }
+
+        for (j = 0; j < Writes; j++) {
+
+            TestWrite( fileObject, TEST_WRITE_SIZE );
+            made += 1;
+        }
+
+        FanSimCloseFile( fileObject );
+    }
+
+    return made;
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestLimit (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Sequential writes fold into records of exactly WriteCoalesceLimit
+    writes, the last one sent up at cleanup with the rest, and the ranges
+    they cover meet end to end.  With the limit at 1 every write goes up
+    alone.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    TEST_WRITES writes;
+
+    if (TestStart( 64, 1000, &reader, &writes )) {
+
+        TestSequential( 200 );
+        SimTestDrain( &reader );
+
+        CHECK( writes.Records == 4 );
+        CHECK( writes.Aggregates == 4 );
+        CHECK( writes.Largest == 64 );
+        CHECK( writes.Writes == 200 );
+        CHECK( writes.Bytes == 200 * TEST_WRITE_SIZE );
+        CHECK( writes.Lowest == 0 );
+        CHECK( writes.Highest == 200 * TEST_WRITE_SIZE );
+        CHECK( writes.Covered == 200 * TEST_WRITE_SIZE );
+        CHECK( reader.Lost == 0 );
+
+        SimTestUnload( &reader );
+    }
+
+    if (TestStart( 1, 1000, &reader, &writes )) {
+
+        TestSequential( 200 );
+        SimTestDrain( &reader );
+
+        CHECK( writes.Records == 200 );
+        CHECK( writes.Aggregates == 0 );
+        CHECK( writes.Writes == 200 );
+        CHECK( reader.Lost == 0 );
+
+        SimTestUnload( &reader );
+    }
+}
+
+
+static VOID
+TestByteCap (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A record is sent up once it stands for 16 MB, however high the write
+    limit.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    TEST_WRITES writes;
+    PFILE_OBJECT fileObject;
+    ULONG i;
+
+    if (!TestStart( 100000, 1000, &reader, &writes )) {
+
+        return;
+    }
+
+    fileObject = TestOpen( 0 );
+
+    if (fileObject != NULL) {
+
+        for (i = 0; i < 40; i++) {
+
+            TestWrite( fileObject, TEST_BIG_WRITE );
+        }
+
+        FanSimCloseFile( fileObject );
+    }
+
+    SimTestDrain( &reader );
+
+    CHECK( writes.Records == 3 );
+    CHECK( writes.Largest == 16 );
+    CHECK( writes.Writes == 40 );
+    CHECK( writes.Bytes == 40ULL * TEST_BIG_WRITE );
+
+    SimTestUnload( &reader );
+}
+
+
+static VOID
+TestFlushes (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A held record goes up ahead of any other operation on its handle, at
+    cleanup, and when nothing has been folded into it for the idle time,
+    with the handle still open.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    TEST_WRITES writes;
+    PFILE_OBJECT fileObject;
+    UCHAR buffer[TEST_WRITE_SIZE];
+    ULONG i;
+
+    if (!TestStart( 64, 20, &reader, &writes )) {
+
+        return;
+    }
+
+    fileObject = TestOpen( 0 );
+
+    if (fileObject != NULL) {
+
+        //
+        //  Three writes are held...
+        //
+
+        for (i = 0; i < 3; i++) {
+
+            TestWrite( fileObject, TEST_WRITE_SIZE );
+        }
+
+        SimTestDrain( &reader );
+        CHECK( writes.Records == 0 );
+
+        //
+        //  ...until a read on the handle sends them up.
+        //
+
+        FanSimSetProcess( SIM_TEST_ALLOWED );
+        CHECK( FanSimRead( fileObject, 0, buffer, sizeof(buffer), NULL ) == STATUS_SUCCESS );
+
+        SimTestDrain( &reader );
+        CHECK( writes.Records == 1 );
+        CHECK( writes.Writes == 3 );
+
+        //
+        //  Two more go up on their own once the handle has been idle.
+        //
+
+        FanSimSetProcess( SIM_TEST_ALLOWED );
+        TestWrite( fileObject, TEST_WRITE_SIZE );
+        TestWrite( fileObject, TEST_WRITE_SIZE );
+
+        for (i = 0; i < 50 && writes.Records < 2; i++) {
+
+            usleep( 10000 );
+            SimTestDrain( &reader );
+        }
+
+        CHECK( writes.Records == 2 );
+        CHECK( writes.Writes == 5 );
+
+        //
+        //  And the last one at cleanup.
+        //
+
+        FanSimSetProcess( SIM_TEST_ALLOWED );
+        TestWrite( fileObject, TEST_WRITE_SIZE );
+        FanSimCloseFile( fileObject );
+
+        SimTestDrain( &reader );
+        CHECK( writes.Records == 3 );
+        CHECK( writes.Writes == 6 );
+        CHECK( writes.Bytes == 6 * TEST_WRITE_SIZE );
+    }
+
+    SimTestUnload( &reader );
+}
+
+
+static VOID
+TestWorkloads (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Whatever the limit, and however handles evict each other, every write
+    and every byte is accounted for exactly once.
+
+--*/
+{
+    static const ULONG limits[] = { 0, 2, 64, 1000 };
+    SIM_TEST_READER reader;
+    TEST_WRITES writes;
+    ULONG made;
+    ULONG i;
+
+    for (i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+
+        if (!TestStart( limits[i], 1000, &reader, &writes )) {
+
+            continue;
+        }
+
+        made = TestInterleaved( 48, 20 );
+        SimTestDrain( &reader );
+        made += TestSmallFiles( 100, 5 );
+        SimTestDrain( &reader );
+
+        CHECK( writes.Writes == made );
+        CHECK( reader.Lost == 0 );
+
+        if (limits[i] > 1) {
+
+            CHECK( writes.Aggregates == writes.Records );
+            CHECK( writes.Bytes == (ULONGLONG) made * TEST_WRITE_SIZE );
+            CHECK( writes.Records >= 48 + 100 );
+
+        } else {
+
+            CHECK( writes.Records == made );
+        }
+
+        SimTestUnload( &reader );
+    }
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    Runs each workload for Seconds at each limit, draining the log after
+    every round as minispy would, and prints the writes made, the records
+    they became and the time a write took, log reading included.
+
+--*/
+{
+    static const ULONG limits[] = { 1, 8, 64, 1024 };
+    static const PCSTR names[] = { "sequential", "interleaved", "smallfiles" };
+    SIM_TEST_READER reader;
+    TEST_WRITES writes;
+    ULONGLONG made;
+    LONGLONG start;
+    LONGLONG elapsed;
+    ULONG workload;
+    ULONG i;
+
+    printf( "%-12s %6s %10s %10s %10s %10s\n",
+            "workload", "limit", "writes", "records", "reduction", "ns/write" );
+
+    for (workload = 0; workload < sizeof(names) / sizeof(names[0]); workload++) {
+
+        for (i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+
+            if (!TestStart( limits[i], 1000, &reader, &writes )) {
+
+                return 1;
+            }
+
+            made = 0;
+            start = SimTestNow();
+
+            do {
+
+                switch (workload) {
+
+                case 0:
+                    made += TestSequential( 256 );
+                    break;
+
+                case 1:
+                    made += TestInterleaved( 16, 16 );
+                    break;
+
+                default:
+                    made += TestSmallFiles( 64, 4 );
+                    break;
+                }
+
+                SimTestDrain( &reader );
+                elapsed = SimTestNow() - start;
+
+            } while (elapsed < (LONGLONG) Seconds * 1000000000);
+
+            CHECK( writes.Writes == made );
+            CHECK( reader.Lost == 0 );
+
+            printf( "%-12s %6u %10llu %10u %9.1fx %10.0f\n",
+                    names[workload],
+                    limits[i],
+                    (unsigned long long) made,
+                    writes.Records,
+                    writes.Records != 0 ? (double) made / writes.Records : 0.0,
+                    (double) elapsed / made );
+
+            SimTestUnload( &reader );
+        }
+    }
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestLimit();
+    TestByteCap();
+    TestFlushes();
+    TestWorkloads();
+
+    return SimTestFinish( "mspyCoalesceTest" );
+}
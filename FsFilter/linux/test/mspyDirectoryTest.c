@@ -0,0 +1,780 @@
+/*++
+
+Module Name:
+
+    mspyDirectoryTest.c
+
+Abstract:
+
+    Tests the directory verdict cache, ../filter/mspyDirectory.c, called
+    directly.  A verdict remembered is found again under the name in
+    another ASCII case but not in another case outside ASCII, names too
+    long for an entry are never kept, and SpyDirectoryForget hides every
+    verdict at once, including ones worked out across it.  Then a long
+    random run of lookups, remembers and forgets is checked against a
+    model of what was remembered in each generation: the cache may forget
+    anything, but what it finds must be the last verdict remembered in
+    the current generation.  Last, threads remember and look up the same
+    directories at once, and no lookup may return a verdict torn by a
+    writer.
+
+    With -b [seconds] it times a lookup that hits and one that misses,
+    and a remember, for directories of 16 to SPY_DIRECTORY_CHARS
+    characters, beside PolicyMatchFolder on a file in them, which is what
+    a hit saves.  Then SpyDirectoryForget and the refilling after it, for
+    working sets of 16 to SPY_DIRECTORY_ENTRIES directories, and lookups
+    from 1 to TEST_THREADS threads at once.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+#include "Policy.h"
+
+#define TEST_THREADS            8
+#define TEST_POOL               (4 * SPY_DIRECTORY_ENTRIES)
+#define TEST_STEPS              1000000
+
+//
+//  What a thread of TestConcurrent or the benchmark does.
+//
+
+typedef struct _TEST_WORKER {
+
+    pthread_t Thread;
+    BOOLEAN Writer;
+    ULONG Seed;
+    ULONGLONG Lookups;
+    ULONGLONG Hits;
+    ULONGLONG Wrong;
+
+} TEST_WORKER, *PTEST_WORKER;
+
+static volatile BOOLEAN Stop;
+
+//
+//  The directories of the random runs, "\Device\HarddiskVolume1\d<n>\".
+//
+
+static WCHAR TestNames[TEST_POOL][48];
+static UNICODE_STRING TestDirectories[TEST_POOL];
+
+
+static ULONG
+TestRandom (
+    __inout PULONG Seed
+    )
+{
+    *Seed ^= *Seed << 13;
+    *Seed ^= *Seed >> 17;
+    *Seed ^= *Seed << 5;
+
+    return *Seed;
+}
+
+
+static ULONG
+TestWiden (
+    __out PWCHAR Wide,
+    __in PCSTR Narrow
+    )
+{
+    ULONG length;
+
+    for (length = 0; Narrow[length] != '\0'; length++) {
+
+        Wide[length] = (WCHAR) Narrow[length];
+    }
+
+    return length;
+}
+
+
+static VOID
+TestString (
+    __out PUNICODE_STRING String,
+    __in PWCHAR Buffer,
+    __in PCSTR Narrow
+    )
+{
+    String->Buffer = Buffer;
+    String->Length = String->MaximumLength = (USHORT) (TestWiden( Buffer, Narrow ) * sizeof(WCHAR));
+}
+
+
+static VOID
+TestReset (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Empties the cache, as the driver finds it when it loads.
+
+--*/
+{
+    memset( MiniSpyData.DirectoryEntries, 0, sizeof(MiniSpyData.DirectoryEntries) );
+    MiniSpyData.DirectoryGeneration = 0;
+}
+
+
+static VOID
+TestMakePool (
+    VOID
+    )
+{
+    CHAR name[48];
+    ULONG i;
+
+    for (i = 0; i < TEST_POOL; i++) {
+
+        snprintf( name, sizeof(name), "\\Device\\HarddiskVolume1\\d%u\\", i );
+        TestString( &TestDirectories[i], TestNames[i], name );
+    }
+}
+
+
+//
+//  The verdict TestConcurrent remembers for a directory, so a reader can
+//  tell a right one from a torn one.
+//
+
+#define TestVerdict(Index)      ((BOOLEAN) (((Index) * 2654435761u) >> 31))
+
+
+static void *
+TestWork (
+    void *Context
+    )
+/*++
+
+Routine Description:
+
+    Looks up, or remembers and looks up, random directories of the first
+    SPY_DIRECTORY_ENTRIES until Stop, counting verdicts that are not
+    TestVerdict's.
+
+--*/
+{
+    PTEST_WORKER worker = Context;
+    LONG generation = SpyDirectoryGeneration();
+    BOOLEAN protect;
+    ULONG index;
+
+    do {
+
+        index = TestRandom( &worker->Seed ) % SPY_DIRECTORY_ENTRIES;
+
+        if (worker->Writer) {
+
+            SpyDirectoryRemember( &TestDirectories[index], generation, TestVerdict( index ) );
+        }
+
+        if (SpyDirectoryLookup( &TestDirectories[index], generation, &protect )) {
+
+            worker->Hits++;
+            worker->Wrong += (protect != TestVerdict( index ));
+        }
+
+        worker->Lookups++;
+
+    } while (!Stop);
+
+    return NULL;
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestRemember (
+    VOID
+    )
+{
+    static WCHAR buffer[SPY_DIRECTORY_CHARS + 2];
+    UNICODE_STRING directory;
+    UNICODE_STRING other;
+    WCHAR otherBuffer[64];
+    LONG generation;
+    BOOLEAN protect;
+    ULONG i;
+
+    TestReset();
+    generation = SpyDirectoryGeneration();
+
+    TestString( &directory, buffer, "\\Device\\HarddiskVolume1\\Protected\\Sub\\" );
+    CHECK( !SpyDirectoryLookup( &directory, generation, &protect ) );
+
+    SpyDirectoryRemember( &directory, generation, TRUE );
+    protect = FALSE;
+    CHECK( SpyDirectoryLookup( &directory, generation, &protect ) && protect );
+
+    TestString( &other, otherBuffer, "\\DEVICE\\HARDDISKVOLUME1\\protected\\sub\\" );
+    protect = FALSE;
+    CHECK( SpyDirectoryLookup( &other, generation, &protect ) && protect );
+
+    TestString( &other, otherBuffer, "\\Device\\HarddiskVolume1\\Protected\\Sub" );
+    CHECK( !SpyDirectoryLookup( &other, generation, &protect ) );
+
+    SpyDirectoryRemember( &directory, generation, FALSE );
+    protect = TRUE;
+    CHECK( SpyDirectoryLookup( &directory, generation, &protect ) && !protect );
+
+    //
+    //  The key folds ASCII case alone, as the folder match does.
+    //
+
+    TestString( &directory, buffer, "\\Device\\HarddiskVolume1\\caf?\\" );
+    TestString( &other, otherBuffer, "\\Device\\HarddiskVolume1\\CAF?\\" );
+    directory.Buffer[28] = 0x00E9;
+    other.Buffer[28] = 0x00C9;
+
+    SpyDirectoryRemember( &directory, generation, TRUE );
+    CHECK( SpyDirectoryLookup( &directory, generation, &protect ) );
+    CHECK( !SpyDirectoryLookup( &other, generation, &protect ) );
+
+    //
+    //  SPY_DIRECTORY_CHARS characters fit, one more does not, and an
+    //  empty name is never kept.
+    //
+
+    for (i = 0; i < SPY_DIRECTORY_CHARS + 1; i++) {
+
+        buffer[i] = (i % 10 == 0) ? L'\\' : L'a';
+    }
+
+    directory.Buffer = buffer;
+    directory.Length = SPY_DIRECTORY_CHARS * sizeof(WCHAR);
+    SpyDirectoryRemember( &directory, generation, TRUE );
+    CHECK( SpyDirectoryLookup( &directory, generation, &protect ) );
+
+    directory.Length += sizeof(WCHAR);
+    SpyDirectoryRemember( &directory, generation, TRUE );
+    CHECK( !SpyDirectoryLookup( &directory, generation, &protect ) );
+
+    directory.Length = 0;
+    SpyDirectoryRemember( &directory, generation, TRUE );
+    CHECK( !SpyDirectoryLookup( &directory, generation, &protect ) );
+}
+
+
+static VOID
+TestForget (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    SpyDirectoryForget hides what was remembered before it, and a
+    verdict worked out across it, remembered under the generation read
+    before, is never found under the new one.
+
+--*/
+{
+    LONG generation;
+    BOOLEAN protect;
+    ULONG i;
+
+    TestReset();
+    generation = SpyDirectoryGeneration();
+
+    for (i = 0; i < 64; i++) {
+
+        SpyDirectoryRemember( &TestDirectories[i], generation, TRUE );
+    }
+
+    SpyDirectoryForget();
+    CHECK( SpyDirectoryGeneration() != generation );
+
+    for (i = 0; i < 64; i++) {
+
+        CHECK( !SpyDirectoryLookup( &TestDirectories[i], SpyDirectoryGeneration(), &protect ) );
+    }
+
+    SpyDirectoryRemember( &TestDirectories[64], generation, TRUE );
+    CHECK( !SpyDirectoryLookup( &TestDirectories[64], SpyDirectoryGeneration(), &protect ) );
+
+    generation = SpyDirectoryGeneration();
+    SpyDirectoryRemember( &TestDirectories[0], generation, FALSE );
+    protect = TRUE;
+    CHECK( SpyDirectoryLookup( &TestDirectories[0], generation, &protect ) && !protect );
+}
+
+
+static VOID
+TestModel (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    TEST_STEPS random lookups, remembers and occasional forgets over
+    TEST_POOL directories, four times as many as there are entries.  The
+    verdicts change from one generation to the next, so a stale one is
+    caught.  Also counts the hits on a working set that fits, which must
+    nearly all be found.
+
+--*/
+{
+    static LONG rememberedIn[TEST_POOL];
+    static BOOLEAN remembered[TEST_POOL];
+    LONG generation;
+    BOOLEAN protect;
+    ULONG seed = 12345;
+    ULONG wrong = 0;
+    ULONG hits = 0;
+    ULONG index;
+    ULONG step;
+    ULONG action;
+    ULONG i;
+
+    TestReset();
+
+    for (i = 0; i < TEST_POOL; i++) {
+
+        rememberedIn[i] = -1;
+    }
+
+    for (step = 0; step < TEST_STEPS; step++) {
+
+        generation = SpyDirectoryGeneration();
+        index = TestRandom( &seed ) % TEST_POOL;
+        action = TestRandom( &seed ) % 1000;
+
+        if (action == 0) {
+
+            SpyDirectoryForget();
+
+        } else if (action < 400) {
+
+            remembered[index] = (BOOLEAN) ((TestRandom( &seed ) >> 7) & 1);
+            rememberedIn[index] = generation;
+            SpyDirectoryRemember( &TestDirectories[index], generation, remembered[index] );
+
+        } else if (SpyDirectoryLookup( &TestDirectories[index], generation, &protect )) {
+
+            wrong += (rememberedIn[index] != generation || protect != remembered[index]);
+        }
+    }
+
+    CHECK( wrong == 0 );
+
+    //
+    //  A quarter of the entries' worth of directories all fit.
+    //
+
+    TestReset();
+    generation = SpyDirectoryGeneration();
+
+    for (i = 0; i < SPY_DIRECTORY_ENTRIES / 4; i++) {
+
+        SpyDirectoryRemember( &TestDirectories[i], generation, TRUE );
+    }
+
+    for (i = 0; i < SPY_DIRECTORY_ENTRIES / 4; i++) {
+
+        hits += SpyDirectoryLookup( &TestDirectories[i], generation, &protect );
+    }
+
+    CHECK( hits >= SPY_DIRECTORY_ENTRIES / 4 * 9 / 10 );
+}
+
+
+static VOID
+TestConcurrent (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Half the threads remember directories and half only look them up, for
+    half a second; no verdict found may be other than the one remembered.
+
+--*/
+{
+    TEST_WORKER workers[TEST_THREADS];
+    ULONGLONG hits = 0;
+    ULONGLONG wrong = 0;
+    ULONG i;
+
+    TestReset();
+    Stop = FALSE;
+
+    for (i = 0; i < TEST_THREADS; i++) {
+
+        memset( &workers[i], 0, sizeof(TEST_WORKER) );
+        workers[i].Writer = (BOOLEAN) (i % 2 == 0);
+        workers[i].Seed = 1 + i;
+        CHECK( pthread_create( &workers[i].Thread, NULL, TestWork, &workers[i] ) == 0 );
+    }
+
+    usleep( 500000 );
+    Stop = TRUE;
+
+    for (i = 0; i < TEST_THREADS; i++) {
+
+        pthread_join( workers[i].Thread, NULL );
+        hits += workers[i].Hits;
+        wrong += workers[i].Wrong;
+    }
+
+    CHECK( hits != 0 );
+    CHECK( wrong == 0 );
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+static double
+BenchmarkLoop (
+    __in ULONG Kind,
+    __in PUNICODE_STRING Directory,
+    __in PUNICODE_STRING Name,
+    __in PFF_LIST_CONTEXT Folders,
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    ns per SpyDirectoryLookup (Kind 0), SpyDirectoryRemember (1) or
+    PolicyMatchFolder (2).
+
+--*/
+{
+    LONG generation = SpyDirectoryGeneration();
+    LONGLONG start = SimTestNow();
+    LONGLONG elapsed;
+    ULONGLONG calls = 0;
+    BOOLEAN protect;
+    ULONG i;
+
+    do {
+
+        for (i = 0; i < 64; i++) {
+
+            switch (Kind) {
+
+            case 0:
+                SpyDirectoryLookup( Directory, generation, &protect );
+                break;
+
+            case 1:
+                SpyDirectoryRemember( Directory, generation, FALSE );
+                break;
+
+            default:
+                PolicyMatchFolder( Folders, Name );
+                break;
+            }
+        }
+
+        calls += 64;
+        elapsed = SimTestNow() - start;
+
+    } while (elapsed < (LONGLONG) Seconds * 1000000000 / 8);
+
+    return (double) elapsed / calls;
+}
+
+
+static PFF_LIST_CONTEXT
+BenchmarkFolders (
+    __in ULONG Count
+    )
+{
+    PFF_LIST_CONTEXT list = NULL;
+    PFF_LIST_CONTEXT entry;
+    CHAR folder[32];
+    ULONG length;
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+
+        snprintf( folder, sizeof(folder), "\\protected%u\\", i );
+        length = (ULONG) strlen( folder );
+
+        entry = calloc( 1, sizeof(FF_LIST_CONTEXT) + (length + 1) * sizeof(WCHAR) );
+        entry->head = list;
+        entry->item.Buffer = (PWCHAR)(entry + 1);
+        entry->item.Length = (USHORT) (length * sizeof(WCHAR));
+        entry->item.MaximumLength = entry->item.Length + sizeof(WCHAR);
+        TestWiden( entry->item.Buffer, folder );
+
+        list = entry;
+    }
+
+    return list;
+}
+
+
+static VOID
+BenchmarkFreeFolders (
+    __in PFF_LIST_CONTEXT List
+    )
+{
+    PFF_LIST_CONTEXT next;
+
+    while (List != NULL) {
+
+        next = List->head;
+        free( List );
+        List = next;
+    }
+}
+
+
+static VOID
+BenchmarkLookups (
+    __in ULONG Seconds
+    )
+{
+    static const ULONG lengths[] = { 16, 64, SPY_DIRECTORY_CHARS };
+    static const ULONG folderCounts[] = { 1, 8, 64 };
+    PFF_LIST_CONTEXT folders[3];
+    WCHAR buffer[SPY_DIRECTORY_CHARS + 16];
+    UNICODE_STRING directory;
+    UNICODE_STRING missing;
+    UNICODE_STRING name;
+    WCHAR missingBuffer[SPY_DIRECTORY_CHARS];
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < 3; i++) {
+
+        folders[i] = BenchmarkFolders( folderCounts[i] );
+    }
+
+    printf( "%8s %10s %10s %10s %10s %10s %10s\n",
+            "chars", "hit", "miss", "remember", "match 1", "match 8", "match 64" );
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+
+        TestReset();
+
+        for (j = 0; j < lengths[i]; j++) {
+
+            buffer[j] = "\\Users\\Public\\Documents\\Reports\\"[j % 32];
+            missingBuffer[j] = buffer[j];
+        }
+
+        buffer[lengths[i] - 1] = L'\\';
+        missingBuffer[lengths[i] - 1] = L'\\';
+        missingBuffer[lengths[i] / 2] = L'z';
+
+        directory.Buffer = buffer;
+        directory.Length = directory.MaximumLength = (USHORT) (lengths[i] * sizeof(WCHAR));
+        missing.Buffer = missingBuffer;
+        missing.Length = missing.MaximumLength = directory.Length;
+
+        name.Buffer = buffer;
+        name.Length = name.MaximumLength =
+            (USHORT) ((lengths[i] + TestWiden( buffer + lengths[i], "report.txt" )) * sizeof(WCHAR));
+
+        SpyDirectoryRemember( &directory, SpyDirectoryGeneration(), FALSE );
+
+        printf( "%8u", lengths[i] );
+        printf( " %10.1f", BenchmarkLoop( 0, &directory, NULL, NULL, Seconds ) );
+        printf( " %10.1f", BenchmarkLoop( 0, &missing, NULL, NULL, Seconds ) );
+        printf( " %10.1f", BenchmarkLoop( 1, &directory, NULL, NULL, Seconds ) );
+
+        for (j = 0; j < 3; j++) {
+
+            printf( " %10.1f", BenchmarkLoop( 2, NULL, &name, folders[j], Seconds ) );
+        }
+
+        printf( "\n" );
+    }
+
+    for (i = 0; i < 3; i++) {
+
+        BenchmarkFreeFolders( folders[i] );
+    }
+}
+
+
+static VOID
+BenchmarkForget (
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    A forget followed by what the creates after it do for a working set
+    of directories: a lookup that misses and a remember for each, then
+    a lookup that should hit.  The refill is per directory, and the hit
+    share is how much of the working set the entries could hold.
+
+--*/
+{
+    static const ULONG sets[] = { 16, 64, SPY_DIRECTORY_ENTRIES };
+    LONGLONG start;
+    LONGLONG forgetTime;
+    LONGLONG refillTime;
+    LONG generation;
+    ULONGLONG rounds;
+    ULONGLONG hits;
+    BOOLEAN protect;
+    ULONG i;
+    ULONG j;
+
+    printf( "\n%8s %10s %10s %10s\n", "dirs", "forget", "refill", "hits %" );
+
+    for (i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+
+        TestReset();
+        forgetTime = 0;
+        refillTime = 0;
+        hits = 0;
+
+        for (rounds = 0; forgetTime + refillTime < (LONGLONG) Seconds * 1000000000 / 4; rounds++) {
+
+            start = SimTestNow();
+            SpyDirectoryForget();
+            forgetTime += SimTestNow() - start;
+
+            start = SimTestNow();
+            generation = SpyDirectoryGeneration();
+
+            for (j = 0; j < sets[i]; j++) {
+
+                if (!SpyDirectoryLookup( &TestDirectories[j], generation, &protect )) {
+
+                    SpyDirectoryRemember( &TestDirectories[j], generation, FALSE );
+                }
+            }
+
+            refillTime += SimTestNow() - start;
+
+            for (j = 0; j < sets[i]; j++) {
+
+                hits += SpyDirectoryLookup( &TestDirectories[j], generation, &protect );
+            }
+        }
+
+        printf( "%8u %10.1f %10.1f %10.1f\n",
+                sets[i],
+                (double) forgetTime / rounds,
+                (double) refillTime / rounds / sets[i],
+                100.0 * hits / rounds / sets[i] );
+    }
+}
+
+
+static VOID
+BenchmarkThreads (
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    Lookups from 1 to TEST_THREADS threads at once on a full table, with
+    no writers.  ns/lookup is per thread, so it grows with the threads
+    once they outnumber the processors.
+
+--*/
+{
+    static const ULONG threads[] = { 1, 2, 4, 8 };
+    TEST_WORKER workers[TEST_THREADS];
+    LONG generation;
+    LONGLONG start;
+    LONGLONG elapsed;
+    ULONGLONG lookups;
+    ULONG i;
+    ULONG j;
+
+    TestReset();
+    generation = SpyDirectoryGeneration();
+
+    for (j = 0; j < SPY_DIRECTORY_ENTRIES; j++) {
+
+        SpyDirectoryRemember( &TestDirectories[j], generation, TestVerdict( j ) );
+    }
+
+    printf( "\n%8s %14s %12s\n", "threads", "lookups/s", "ns/lookup" );
+
+    for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+
+        Stop = FALSE;
+        start = SimTestNow();
+
+        for (j = 0; j < threads[i]; j++) {
+
+            memset( &workers[j], 0, sizeof(TEST_WORKER) );
+            workers[j].Seed = 1 + j;
+            pthread_create( &workers[j].Thread, NULL, TestWork, &workers[j] );
+        }
+
+        usleep( Seconds * 1000000 / 4 );
+        Stop = TRUE;
+        lookups = 0;
+
+        for (j = 0; j < threads[i]; j++) {
+
+            pthread_join( workers[j].Thread, NULL );
+            lookups += workers[j].Lookups;
+            CHECK( workers[j].Wrong == 0 );
+        }
+
+        elapsed = SimTestNow() - start;
+
+        printf( "%8u %14.0f %12.1f\n",
+                threads[i],
+                lookups * 1e9 / elapsed,
+                (double) elapsed * threads[i] / lookups );
+    }
+}
+
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+{
+    BenchmarkLookups( Seconds );
+    BenchmarkForget( Seconds );
+    BenchmarkThreads( Seconds );
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    TestMakePool();
+
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestRemember();
+    TestForget();
+    TestModel();
+    TestConcurrent();
+
+    return SimTestFinish( "mspyDirectoryTest" );
+}
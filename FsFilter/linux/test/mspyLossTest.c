@@ -0,0 +1,580 @@
+/*++
+
+Module Name:
+
+    mspyLossTest.c
+
+Abstract:
+
+    Stress tests the loss accounting, ../filter/mspyLoss.c, through the
+    driver: records are lost to a small fixed quota and to record
+    allocations made to fail, and the books must balance exactly.  Every
+    write made is either delivered or inside a gap record, each gap
+    record's reasons add up to its Count and its range is exactly the
+    numbers skipped before it, no queue's sequence jumps without a gap
+    record, and what the gap records say was lost, by reason and by
+    major function, is what the driver's per-processor counters say.
+
+    The last test runs producers on eight processors, and so eight log
+    queues, at once with a consumer reading all the while.
+
+    With -b [seconds] it runs that stress with 1 to 8 producers and
+    reports the writes a second, the share lost and the gap records it
+    took to report them.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+
+#define TEST_PRODUCERS          8
+
+//
+//  What the log held.  The consumer thread alone updates it until the
+//  producers are done.
+//
+
+typedef struct _TEST_BOOKS {
+
+    ULONGLONG Delivered;
+    ULONGLONG GapRecords;
+    ULONGLONG Reason[LOSS_REASONS];
+    ULONG BadGaps;
+
+} TEST_BOOKS, *PTEST_BOOKS;
+
+static TEST_BOOKS Books;
+
+static volatile ULONGLONG Produced;
+
+typedef struct _TEST_PRODUCER {
+
+    pthread_t Thread;
+    ULONG Index;
+    ULONG Writes;
+    LONGLONG Until;
+    ULONGLONG Made;
+
+} TEST_PRODUCER, *PTEST_PRODUCER;
+
+typedef struct _TEST_CONSUMER {
+
+    pthread_t Thread;
+    PSIM_TEST_READER Reader;
+    volatile BOOLEAN Stop;
+
+} TEST_CONSUMER, *PTEST_CONSUMER;
+
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    PTEST_BOOKS books = Context;
+    PRECORD_GAP gap;
+    ULONG reasons = 0;
+    ULONG i;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP )) {
+
+        gap = (PRECORD_GAP) LogRecord->Name;
+
+        for (i = 0; i < LOSS_REASONS; i++) {
+
+            books->Reason[i] += gap->Reason[i];
+            reasons += gap->Reason[i];
+        }
+
+        if (reasons != gap->Count ||
+            gap->LastSequence - gap->FirstSequence + 1 != gap->Count ||
+            gap->LastSequence + 1 != LogRecord->SequenceNumber) {
+
+            books->BadGaps += 1;
+        }
+
+        books->GapRecords += 1;
+
+    } else if (!FlagOn( LogRecord->RecordType, RECORD_TYPE_FLAG_PRIORITY ) &&
+               LogRecord->Data.CallbackMajorId == IRP_MJ_WRITE) {
+
+        books->Delivered += 1;
+    }
+}
+
+
+static BOOLEAN
+TestStart (
+    __in ULONG Quota,
+    __out PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver with a fixed quota, coalescing and sampling off so
+    each write is one record, and connects.
+
+--*/
+{
+    memset( &Books, 0, sizeof(Books) );
+    Produced = 0;
+
+    SimTestSetDword( "MaxRecords", Quota );
+    SimTestSetDword( "RecordQuotaFloor", Quota );
+    SimTestSetDword( "RecordQuotaCeiling", Quota );
+    SimTestSetDword( "WriteCoalesceLimit", 1 );
+    SimTestSetDword( "ProcessRecordBudget", 0 );
+
+    if (!SimTestLoad()) {
+
+        return FALSE;
+    }
+
+    if (!SimTestConnect( Reader, 0, TestTakeRecord, &Books )) {
+
+        SimTestUnload( NULL );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static PFILE_OBJECT
+TestOpen (
+    __in ULONG Index
+    )
+{
+    CHAR name[64];
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    snprintf( name, sizeof(name), "\\protected\\loss%u.dat", Index );
+
+    return SimTestCreate( name, FILE_GENERIC_WRITE, FILE_OVERWRITE_IF );
+}
+
+
+static ULONG
+TestProduce (
+    __in PFILE_OBJECT FileObject,
+    __in ULONG Writes
+    )
+{
+    static const UCHAR data[16];
+    ULONG made = 0;
+    ULONG i;
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+
+    for (i = 0; i < Writes; i++) {
+
+        if (FanSimWrite( FileObject, 0, data, sizeof(data), NULL ) == STATUS_SUCCESS) {
+
+            made += 1;
+        }
+    }
+
+    __atomic_add_fetch( &Produced, made, __ATOMIC_RELAXED );
+
+    return made;
+}
+
+
+static VOID
+TestReconcile (
+    __inout PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Stops the failures, gets the pending gaps out with one more write
+    each round, reads everything and balances the books.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+    ULONGLONG counted[LOSS_REASONS];
+    ULONGLONG writes = 0;
+    ULONGLONG lost = 0;
+    ULONG missing = 0;
+    ULONG rounds;
+    ULONG cpu;
+    ULONG i;
+
+    FanSimFailPoolAllocations( 0 );
+    FanSimFailPoolTag( 0 );
+
+    fileObject = TestOpen( TEST_PRODUCERS );
+
+    SimTestDrain( Reader );
+
+    for (rounds = 0; rounds < 100 && MiniSpyData.GapCount != 0; rounds++) {
+
+        if (fileObject != NULL) {
+
+            TestProduce( fileObject, 1 );
+        }
+
+        SimTestDrain( Reader );
+    }
+
+    CHECK( MiniSpyData.GapCount == 0 );
+
+    if (fileObject != NULL) {
+
+        FanSimSetProcess( SIM_TEST_ALLOWED );
+        FanSimCloseFile( fileObject );
+    }
+
+    SimTestDrain( Reader );
+    SequenceReport( &Reader->Sequence );
+
+    memset( counted, 0, sizeof(counted) );
+
+    for (cpu = 0; cpu < SPY_LOSS_CPUS; cpu++) {
+
+        for (i = 0; i < LOSS_REASONS; i++) {
+
+            counted[i] += MiniSpyData.LossCounters[cpu].Reason[i];
+        }
+
+        writes += MiniSpyData.LossCounters[cpu].Major[IRP_MJ_WRITE];
+    }
+
+    for (i = 0; i < LOSS_REASONS; i++) {
+
+        CHECK( counted[i] == Books.Reason[i] );
+        lost += Books.Reason[i];
+    }
+
+    for (i = 0; i < LOG_QUEUES; i++) {
+
+        missing += Reader->Sequence.Missing[i];
+    }
+
+    CHECK( Produced == Books.Delivered + Reader->Lost );
+    CHECK( lost == Reader->Lost );
+    CHECK( writes == Reader->Lost );
+    CHECK( Books.BadGaps == 0 );
+    CHECK( missing == 0 );
+}
+
+
+//---------------------------------------------------------------------------
+//  Threads
+//---------------------------------------------------------------------------
+
+static PVOID
+TestProducer (
+    __in PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Writes from its own processor, so to its own log queue, either
+    Writes times or until Until.
+
+--*/
+{
+    PTEST_PRODUCER producer = Parameter;
+    PFILE_OBJECT fileObject;
+
+    FanSimSetProcessor( producer->Index );
+    fileObject = TestOpen( producer->Index );
+
+    if (fileObject == NULL) {
+
+        return NULL;
+    }
+
+    if (producer->Until != 0) {
+
+        while (SimTestNow() < producer->Until) {
+
+            producer->Made += TestProduce( fileObject, 256 );
+        }
+
+    } else {
+
+        producer->Made = TestProduce( fileObject, producer->Writes );
+    }
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    FanSimCloseFile( fileObject );
+
+    return NULL;
+}
+
+
+static PVOID
+TestConsumer (
+    __in PVOID Parameter
+    )
+{
+    PTEST_CONSUMER consumer = Parameter;
+
+    while (!consumer->Stop) {
+
+        if (!SimTestRead( consumer->Reader )) {
+
+            usleep( 100 );
+        }
+    }
+
+    return NULL;
+}
+
+
+static VOID
+TestRun (
+    __inout PSIM_TEST_READER Reader,
+    __in ULONG Producers,
+    __in ULONG Writes,
+    __in LONGLONG Until
+    )
+/*++
+
+Routine Description:
+
+    Runs Producers producer threads against one consumer thread.
+
+--*/
+{
+    TEST_PRODUCER producers[TEST_PRODUCERS];
+    TEST_CONSUMER consumer;
+    ULONG i;
+
+    memset( producers, 0, sizeof(producers) );
+    memset( &consumer, 0, sizeof(consumer) );
+
+    consumer.Reader = Reader;
+    pthread_create( &consumer.Thread, NULL, TestConsumer, &consumer );
+
+    for (i = 0; i < Producers; i++) {
+
+        producers[i].Index = i;
+        producers[i].Writes = Writes;
+        producers[i].Until = Until;
+        pthread_create( &producers[i].Thread, NULL, TestProducer, &producers[i] );
+    }
+
+    for (i = 0; i < Producers; i++) {
+
+        pthread_join( producers[i].Thread, NULL );
+    }
+
+    consumer.Stop = TRUE;
+    pthread_join( consumer.Thread, NULL );
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestQuota (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A producer that outruns a quota of 64 between reads loses the rest
+    of each burst, all of it over quota.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    PFILE_OBJECT fileObject;
+    ULONG i;
+
+    if (!TestStart( 64, &reader )) {
+
+        return;
+    }
+
+    fileObject = TestOpen( 0 );
+
+    if (fileObject != NULL) {
+
+        for (i = 0; i < 20; i++) {
+
+            TestProduce( fileObject, 250 );
+            SimTestDrain( &reader );
+        }
+
+        FanSimSetProcess( SIM_TEST_ALLOWED );
+        FanSimCloseFile( fileObject );
+    }
+
+    TestReconcile( &reader );
+
+    CHECK( Books.Reason[LOSS_OVER_QUOTA] >= 20 * (250 - 64) );
+    CHECK( Books.Reason[LOSS_OUT_OF_MEMORY] == 0 );
+
+    SimTestUnload( &reader );
+}
+
+
+static VOID
+TestMemory (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Every third record allocation that misses the lookaside lists fails,
+    and those records are lost for want of memory.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    PFILE_OBJECT fileObject;
+    ULONG i;
+
+    if (!TestStart( 100000, &reader )) {
+
+        return;
+    }
+
+    fileObject = TestOpen( 0 );
+
+    if (fileObject != NULL) {
+
+        FanSimFailPoolTag( SPY_TAG );
+        FanSimFailPoolAllocations( 3 );
+
+        for (i = 0; i < 20; i++) {
+
+            TestProduce( fileObject, 1000 );
+            SimTestDrain( &reader );
+        }
+
+        FanSimSetProcess( SIM_TEST_ALLOWED );
+        FanSimCloseFile( fileObject );
+    }
+
+    TestReconcile( &reader );
+
+    CHECK( Books.Reason[LOSS_OUT_OF_MEMORY] != 0 );
+    CHECK( Books.Reason[LOSS_OVER_QUOTA] == 0 );
+
+    SimTestUnload( &reader );
+}
+
+
+static VOID
+TestStress (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Eight producers on eight processors against a consumer reading all
+    the while, losing records both over quota and for want of memory.
+
+--*/
+{
+    SIM_TEST_READER reader;
+
+    if (!TestStart( 256, &reader )) {
+
+        return;
+    }
+
+    FanSimFailPoolTag( SPY_TAG );
+    FanSimFailPoolAllocations( 5 );
+
+    TestRun( &reader, TEST_PRODUCERS, 20000, 0 );
+
+    TestReconcile( &reader );
+
+    CHECK( Produced >= TEST_PRODUCERS * 20000 );
+    CHECK( Books.Reason[LOSS_OVER_QUOTA] != 0 );
+    CHECK( Books.Reason[LOSS_OUT_OF_MEMORY] != 0 );
+
+    SimTestUnload( &reader );
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+{
+    SIM_TEST_READER reader;
+    LONGLONG start;
+    LONGLONG elapsed;
+    ULONG producers;
+
+    printf( "%9s %12s %12s %8s %10s %9s\n",
+            "producers", "writes/s", "delivered", "lost", "gaps", "balanced" );
+
+    for (producers = 1; producers <= TEST_PRODUCERS; producers *= 2) {
+
+        if (!TestStart( 256, &reader )) {
+
+            return 1;
+        }
+
+        FanSimFailPoolTag( SPY_TAG );
+        FanSimFailPoolAllocations( 50 );
+
+        start = SimTestNow();
+        TestRun( &reader, producers, 0, start + (LONGLONG) Seconds * 1000000000 );
+        elapsed = SimTestNow() - start;
+
+        TestReconcile( &reader );
+
+        printf( "%9u %12.0f %12llu %7.2f%% %10llu %9s\n",
+                producers,
+                Produced * 1e9 / elapsed,
+                (unsigned long long) Books.Delivered,
+                Produced != 0 ? 100.0 * reader.Lost / Produced : 0.0,
+                (unsigned long long) Books.GapRecords,
+                Produced == Books.Delivered + reader.Lost ? "yes" : "NO" );
+
+        SimTestUnload( &reader );
+    }
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestQuota();
+    TestMemory();
+    TestStress();
+
+    return SimTestFinish( "mspyLossTest" );
+}
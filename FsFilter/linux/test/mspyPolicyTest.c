@@ -0,0 +1,2047 @@
+/*++
+
+Module Name:
+
+    mspyPolicyTest.c
+
+Abstract:
+
+    Tests the matching in ../filter/Policy.c against the simplest code
+    that could do the same.
+
+    The allowed processes: random lists of "*name" expressions, and of
+    expressions with wildcards of their own, are compiled with
+    PolicyAddProcess, and PolicyMatchProcess must answer for every image
+    exactly as the loop it replaced, FsRtlIsNameInExpression over each
+    entry, does.  The names come from a small alphabet, so suffixes of
+    one another, case variants and near misses are common, and the
+    images end in the names, in their variants or in nothing.  The
+    shim's FsRtlIsNameInExpression is itself checked against a plain
+    matcher of '*' and '?' first, so the loop is a fair reference.
+
+    With -b [seconds] it times PolicyMatchProcess and the loop over 10 to
+    10000 expressions, for an image that matches none and for one that
+    matches the first expression added.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+#include "Policy.h"
+
+#define TEST_LISTS              500
+#define TEST_IMAGES             200
+#define TEST_MAX_ENTRIES        24
+#define TEST_MAX_NAME           12
+#define TEST_MAX_IMAGE          400
+
+#define TEST_EXTENSION_SETS     2000
+
+#define TEST_RULE_SETS          2000
+#define TEST_RULE_SUBJECTS      200
+#define TEST_RULE_SIDS          3
+
+#define TEST_FIND_STRING        5
+#define TEST_FIND_SUBSTRING     3
+
+//
+//  The characters names are made of.  Few enough that random names
+//  often end in one another.
+//
+
+static const char TestAlphabet[] = "aAbB.e\\x";
+
+//
+//  The characters of the exhaustive search: an ASCII letter in both
+//  cases, U+0131, which upcases to 'I', U+00E9 and U+00C9, which upcase
+//  to each other, and NUL.
+//
+
+static const WCHAR TestFindAlphabet[] = { L'i', L'I', 0x0131, 0x00E9, 0x00C9, UNICODE_NULL };
+
+#define TEST_FIND_CHARS         (sizeof(TestFindAlphabet) / sizeof(TestFindAlphabet[0]))
+
+static ULONGLONG TestSeed = 88172645463325252ULL;
+
+
+static ULONG
+TestRandom (
+    __in ULONG Range
+    )
+{
+    TestSeed ^= TestSeed << 13;
+    TestSeed ^= TestSeed >> 7;
+    TestSeed ^= TestSeed << 17;
+
+    return (ULONG) (TestSeed % Range);
+}
+
+
+static ULONG
+TestWiden (
+    __out PWCHAR Wide,
+    __in PCSTR Narrow
+    )
+/*++
+
+Routine Description:
+
+    Copies an ASCII string into a WCHAR one.  The driver is built with
+    2-byte wchar_t, which the C library's wide routines do not know.
+
+--*/
+{
+    ULONG length;
+
+    for (length = 0; Narrow[length] != '\0'; length++) {
+
+        Wide[length] = (WCHAR) Narrow[length];
+    }
+
+    return length;
+}
+
+
+static PFF_LIST_CONTEXT
+TestListEntry (
+    __in CONST WCHAR *Item,
+    __in ULONG Length,
+    __in PFF_LIST_CONTEXT Head
+    )
+/*++
+
+Routine Description:
+
+    Allocates a list entry with its buffer after it, as fsFilter.c does.
+
+--*/
+{
+    PFF_LIST_CONTEXT entry = calloc( 1, sizeof(FF_LIST_CONTEXT) + (Length + 1) * sizeof(WCHAR) );
+
+    entry->head = Head;
+    entry->item.Buffer = (PWCHAR)(entry + 1);
+    entry->item.Length = (USHORT)(Length * sizeof(WCHAR));
+    entry->item.MaximumLength = entry->item.Length + sizeof(WCHAR);
+    memcpy( entry->item.Buffer, Item, Length * sizeof(WCHAR) );
+
+    return entry;
+}
+
+
+static VOID
+TestFreeList (
+    __in PFF_LIST_CONTEXT List
+    )
+{
+    PFF_LIST_CONTEXT next;
+
+    while (List != NULL) {
+
+        next = List->head;
+        free( List );
+        List = next;
+    }
+}
+
+
+static ULONG
+TestName (
+    __out_ecount(TEST_MAX_NAME) PWCHAR Name
+    )
+{
+    ULONG length = 1 + TestRandom( TEST_MAX_NAME );
+    ULONG i;
+
+    for (i = 0; i < length; i++) {
+
+        Name[i] = TestAlphabet[TestRandom( sizeof(TestAlphabet) - 1 )];
+    }
+
+    return length;
+}
+
+
+static ULONG
+TestExpression (
+    __out_ecount(TEST_MAX_NAME + 1) PWCHAR Expression
+    )
+/*++
+
+Routine Description:
+
+    Makes an expression as the registry list holds them: mostly "*" and a
+    plain name, which the table hashes, otherwise a name with wildcards
+    of its own, or without the leading "*", which it leaves to
+    FsRtlIsNameInExpression.
+
+--*/
+{
+    static const WCHAR wildcards[] = { L'*', L'?', DOS_STAR, DOS_QM, DOS_DOT };
+    ULONG length;
+    ULONG kind = TestRandom( 100 );
+    ULONG i;
+
+    if (kind < 5) {
+
+        return TestName( Expression );
+    }
+
+    if (kind == 5) {
+
+        Expression[0] = L'*';
+        return 1;
+    }
+
+    Expression[0] = L'*';
+    length = 1 + TestName( Expression + 1 );
+
+    if (kind < 15) {
+
+        for (i = 1 + TestRandom( 2 ); i > 0; i--) {
+
+            Expression[TestRandom( length )] = wildcards[TestRandom( sizeof(wildcards) / sizeof(wildcards[0]) )];
+        }
+    }
+
+    return length;
+}
+
+
+static ULONG
+TestImage (
+    __in PFF_LIST_CONTEXT List,
+    __out_ecount(TEST_MAX_IMAGE) PWCHAR Image
+    )
+/*++
+
+Routine Description:
+
+    Makes an image path ending in one of the list's names, or in one
+    with a character changed, its case flipped or its first character
+    dropped, or in a name of its own.  One in twenty is longer than
+    FF_PROCESS_MAX_SUFFIX.
+
+--*/
+{
+    PFF_LIST_CONTEXT entry = List;
+    ULONG length = 0;
+    ULONG prefix;
+    ULONG nameLength;
+    ULONG i;
+    WCHAR c;
+
+    prefix = (TestRandom( 20 ) == 0) ? FF_PROCESS_MAX_SUFFIX + TestRandom( 40 ) : TestRandom( 30 );
+
+    for (i = 0; i < prefix; i++) {
+
+        Image[length++] = TestAlphabet[TestRandom( sizeof(TestAlphabet) - 1 )];
+    }
+
+    for (i = TestRandom( TEST_MAX_ENTRIES ); i > 0 && entry != NULL && entry->head != NULL; i--) {
+
+        entry = entry->head;
+    }
+
+    if (entry == NULL || TestRandom( 4 ) == 0) {
+
+        return length + TestName( Image + length );
+    }
+
+    nameLength = entry->item.Length / sizeof(WCHAR);
+
+    if (entry->item.Buffer[0] == L'*') {
+
+        memcpy( Image + length, entry->item.Buffer + 1, (nameLength - 1) * sizeof(WCHAR) );
+        nameLength--;
+
+    } else {
+
+        memcpy( Image + length, entry->item.Buffer, nameLength * sizeof(WCHAR) );
+    }
+
+    switch (nameLength != 0 ? TestRandom( 5 ) : 4) {
+
+    case 0:
+        i = TestRandom( nameLength );
+        Image[length + i] = TestAlphabet[TestRandom( sizeof(TestAlphabet) - 1 )];
+        break;
+
+    case 1:
+        i = TestRandom( nameLength );
+        c = Image[length + i];
+        Image[length + i] = (c >= L'a' && c <= L'z') ? c - 32 : (c >= L'A' && c <= L'Z') ? c + 32 : c;
+        break;
+
+    case 2:
+        memmove( Image + length, Image + length + 1, (nameLength - 1) * sizeof(WCHAR) );
+        nameLength--;
+        break;
+
+    default:
+        break;
+    }
+
+    return length + nameLength;
+}
+
+
+static BOOLEAN
+TestGlob (
+    __in CONST WCHAR *Expression,
+    __in ULONG ExpressionLength,
+    __in CONST WCHAR *Name,
+    __in ULONG NameLength
+    )
+/*++
+
+Routine Description:
+
+    Matches '*' and '?' the obvious way, by trying every split.
+
+--*/
+{
+    ULONG skip;
+
+    if (ExpressionLength == 0) {
+
+        return (BOOLEAN) (NameLength == 0);
+    }
+
+    if (Expression[0] == L'*') {
+
+        for (skip = 0; skip <= NameLength; skip++) {
+
+            if (TestGlob( Expression + 1, ExpressionLength - 1, Name + skip, NameLength - skip )) {
+
+                return TRUE;
+            }
+        }
+
+        return FALSE;
+    }
+
+    return (BOOLEAN) (NameLength > 0 &&
+                      (Expression[0] == L'?' || Expression[0] == Name[0]) &&
+                      TestGlob( Expression + 1, ExpressionLength - 1, Name + 1, NameLength - 1 ));
+}
+
+
+static BOOLEAN
+TestMatchLoop (
+    __in PFF_LIST_CONTEXT List,
+    __in PUNICODE_STRING Image
+    )
+/*++
+
+Routine Description:
+
+    The check PolicyMatchProcess replaced: every expression in turn.
+
+--*/
+{
+    for (; List != NULL; List = List->head) {
+
+        if (FsRtlIsNameInExpression( &List->item, Image, FALSE, NULL )) {
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+static BOOLEAN
+TestFindLoop (
+    __in PUNICODE_STRING String,
+    __in PUNICODE_STRING SubString
+    )
+/*++
+
+Routine Description:
+
+    RtlFindSubString as it was: _wcsnicmp at every position.
+
+--*/
+{
+    USHORT index;
+
+    for (index = 0; index + SubString->Length / 2 <= String->Length / 2; index++) {
+
+        if (_wcsnicmp( &String->Buffer[index], SubString->Buffer, SubString->Length / 2 ) == 0) {
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+static ULONG
+TestFindString (
+    __in ULONG Number,
+    __in ULONG Length,
+    __out_ecount(Length) PWCHAR String
+    )
+/*++
+
+Routine Description:
+
+    The Number'th string of Length characters of TestFindAlphabet.
+
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+
+        String[i] = TestFindAlphabet[Number % TEST_FIND_CHARS];
+        Number /= TEST_FIND_CHARS;
+    }
+
+    return Length;
+}
+
+
+static ULONG
+TestExtension (
+    __out_ecount(FF_EXTENSION_CHARS) PWCHAR Extension
+    )
+/*++
+
+Routine Description:
+
+    A random extension: mostly letters and digits, in either case, one in
+    eight of CJK characters a multiple of 0x400 apart.
+
+--*/
+{
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    ULONG length = 1 + TestRandom( TestRandom( 4 ) == 0 ? FF_EXTENSION_CHARS : 4 );
+    BOOLEAN wide = (BOOLEAN) (TestRandom( 8 ) == 0);
+    ULONG i;
+
+    for (i = 0; i < length; i++) {
+
+        Extension[i] = wide ? (WCHAR) (0x4E00 + 0x400 * TestRandom( 16 ) + TestRandom( 2 )) :
+                       (WCHAR) letters[TestRandom( sizeof(letters) - 1 )];
+    }
+
+    return length;
+}
+
+
+static BOOLEAN
+TestExtensionScan (
+    __in PFF_EXTENSION_TABLE Extensions,
+    __in PUNICODE_STRING Extension
+    )
+/*++
+
+Routine Description:
+
+    PolicyMatchExtension without the hash: every extension in turn.
+
+--*/
+{
+    USHORT length = Extension->Length / sizeof(WCHAR);
+    ULONG i;
+    USHORT j;
+
+    for (i = 0; i < Extensions->count; i++) {
+
+        if (Extensions->extensions[i].length != length) {
+
+            continue;
+        }
+
+        for (j = 0; j < length; j++) {
+
+            if (Extensions->extensions[i].name[j] != RtlUpcaseUnicodeChar( Extension->Buffer[j] )) {
+
+                break;
+            }
+        }
+
+        if (j == length) {
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+static ULONG
+TestSlotsUsed (
+    __in PFF_EXTENSION_TABLE Extensions
+    )
+{
+    ULONG used = 0;
+    ULONG i;
+
+    for (i = 0; i < FF_EXTENSION_SLOTS; i++) {
+
+        used += (Extensions->slots[i] != 0);
+    }
+
+    return used;
+}
+
+
+static NTSTATUS
+TestSetExtensions (
+    __out PFF_EXTENSION_TABLE Extensions,
+    __in CONST WCHAR *List,
+    __in ULONG Length
+    )
+{
+    UNICODE_STRING list;
+
+    list.Buffer = (PWCH) List;
+    list.Length = list.MaximumLength = (USHORT) (Length * sizeof(WCHAR));
+
+    return PolicySetExtensions( Extensions, &list );
+}
+
+
+static BOOLEAN
+TestMatchExtension (
+    __in PFF_EXTENSION_TABLE Extensions,
+    __in PCSTR Extension
+    )
+{
+    WCHAR buffer[64];
+    UNICODE_STRING extension;
+
+    extension.Buffer = buffer;
+    extension.Length = extension.MaximumLength = (USHORT) (TestWiden( buffer, Extension ) * sizeof(WCHAR));
+
+    return PolicyMatchExtension( Extensions, &extension );
+}
+
+
+//
+//  An operation for the rules, and what is known of its process.  Members
+//  has bit n set when the process is in TestRuleSids[n]; with Unknown set
+//  its token cannot be had.
+//
+
+typedef struct _TEST_SUBJECT {
+
+    FF_RULE_SUBJECT Subject;
+
+    UNICODE_STRING Name;
+    UNICODE_STRING Extension;
+    UNICODE_STRING Image;
+    BOOLEAN HasExtension;
+    BOOLEAN HasImage;
+
+    ULONG Members;
+    BOOLEAN Unknown;
+
+    ULONG ImageCalls;
+    BOOLEAN ImageNeeded;
+
+    WCHAR Buffer[3][128];
+
+} TEST_SUBJECT, *PTEST_SUBJECT;
+
+static const ULONG TestRuleSids[TEST_RULE_SIDS] = { 1001, 1002, 544 };
+
+static const PCSTR TestRulePaths[] = { "\\docs\\", "\\DOCS\\", "report", "\\tmp\\" };
+static const PCSTR TestRuleExtensions[] = { "txt", "TXT", "doc", "tar.gz" };
+static const PCSTR TestRuleProcesses[] = { "\\a.exe", "B.EXE", "app\\b.exe", "x" };
+
+static const PCSTR TestSubjectFolders[] = { "\\docs", "\\Docs", "\\tmp", "\\x", "\\report", "\\app" };
+static const PCSTR TestSubjectExtensions[] = { "txt", "Txt", "doc", "gz", "tar.gz", "" };
+static const PCSTR TestSubjectImages[] = { "\\Program Files\\a.exe", "\\app\\b.exe", "\\APP\\B.exe", "\\x", "b.exe", NULL };
+
+#define TEST_COUNT(Array)       (sizeof(Array) / sizeof((Array)[0]))
+
+
+static USHORT
+TestAddString (
+    __inout PPOLICY_RULES Rules,
+    __in PCSTR String
+    )
+{
+    USHORT offset = (USHORT) Rules->StringsLength;
+    ULONG length = TestWiden( (PWCHAR) &Rules->Strings[offset], String );
+
+    ((PWCHAR) &Rules->Strings[offset])[length] = UNICODE_NULL;
+    Rules->StringsLength += (length + 1) * sizeof(WCHAR);
+
+    return offset;
+}
+
+
+static USHORT
+TestAddSid (
+    __inout PPOLICY_RULES Rules,
+    __in ULONG Rid
+    )
+/*++
+
+Routine Description:
+
+    Adds S-1-5-21-Rid, or S-1-5-32-Rid for the builtin groups, aligned as
+    a SID must be.
+
+--*/
+{
+    PISID sid;
+    USHORT offset;
+
+    Rules->StringsLength = ROUND_TO_SIZE( Rules->StringsLength, sizeof(ULONG) );
+    offset = (USHORT) Rules->StringsLength;
+    sid = (PISID) &Rules->Strings[offset];
+
+    memset( sid, 0, RtlLengthRequiredSid( 2 ) );
+    sid->Revision = SID_REVISION;
+    sid->SubAuthorityCount = 2;
+    sid->IdentifierAuthority.Value[5] = 5;
+    sid->SubAuthority[0] = (Rid < 1000) ? 32 : 21;
+    sid->SubAuthority[1] = Rid;
+
+    Rules->StringsLength += RtlLengthRequiredSid( 2 );
+
+    return offset;
+}
+
+
+static ULONG
+TestSidIndex (
+    __in PVOID Sid
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < TEST_RULE_SIDS && ((PISID) Sid)->SubAuthority[1] != TestRuleSids[i]; i++) {
+    }
+
+    return i;
+}
+
+
+static PUNICODE_STRING
+TestSubjectImage (
+    __inout PFF_RULE_SUBJECT Subject
+    )
+{
+    PTEST_SUBJECT subject = Subject->context;
+
+    subject->ImageCalls++;
+
+    return subject->HasImage ? &subject->Image : NULL;
+}
+
+
+static USHORT
+TestSubjectMember (
+    __inout PFF_RULE_SUBJECT Subject,
+    __in PVOID Sid
+    )
+{
+    PTEST_SUBJECT subject = Subject->context;
+
+    if (subject->Unknown) {
+
+        return FF_RULE_UNKNOWN;
+    }
+
+    return (subject->Members & (1 << TestSidIndex( Sid ))) ? FF_RULE_MEMBER : FF_RULE_NOT_MEMBER;
+}
+
+
+static VOID
+TestRandomSubject (
+    __out PTEST_SUBJECT Subject
+    )
+{
+    PCSTR extension = TestSubjectExtensions[TestRandom( TEST_COUNT(TestSubjectExtensions) )];
+    PCSTR image = TestSubjectImages[TestRandom( TEST_COUNT(TestSubjectImages) )];
+    ULONG length;
+    ULONG i;
+
+    memset( Subject, 0, sizeof(TEST_SUBJECT) );
+
+    length = TestWiden( Subject->Buffer[0], "\\Device\\HarddiskVolume1" );
+
+    for (i = TestRandom( 4 ); i > 0; i--) {
+
+        length += TestWiden( Subject->Buffer[0] + length,
+                             TestSubjectFolders[TestRandom( TEST_COUNT(TestSubjectFolders) )] );
+    }
+
+    length += TestWiden( Subject->Buffer[0] + length, "\\file" );
+
+    if (extension[0] != '\0') {
+
+        length += TestWiden( Subject->Buffer[0] + length, "." );
+        length += TestWiden( Subject->Buffer[0] + length, extension );
+
+        Subject->Extension.Buffer = Subject->Buffer[1];
+        Subject->Extension.Length = (USHORT) (TestWiden( Subject->Buffer[1], extension ) * sizeof(WCHAR));
+        Subject->HasExtension = TRUE;
+    }
+
+    Subject->Name.Buffer = Subject->Buffer[0];
+    Subject->Name.Length = (USHORT) (length * sizeof(WCHAR));
+
+    if (image != NULL) {
+
+        Subject->Image.Buffer = Subject->Buffer[2];
+        Subject->Image.Length = (USHORT) (TestWiden( Subject->Buffer[2], image ) * sizeof(WCHAR));
+        Subject->HasImage = TRUE;
+    }
+
+    Subject->Members = TestRandom( 1 << TEST_RULE_SIDS );
+    Subject->Unknown = (BOOLEAN) (TestRandom( 8 ) == 0);
+
+    Subject->Subject.operation = 1 << TestRandom( RULE_OPS );
+    Subject->Subject.name = &Subject->Name;
+    Subject->Subject.extension = Subject->HasExtension ? &Subject->Extension : NULL;
+    Subject->Subject.image = TestSubjectImage;
+    Subject->Subject.member = TestSubjectMember;
+    Subject->Subject.context = Subject;
+}
+
+
+static VOID
+TestRandomRules (
+    __out PPOLICY_RULES Rules
+    )
+/*++
+
+Routine Description:
+
+    Up to RULE_MAX rules, each with any of the predicates, drawn from
+    strings and SIDs laid out once at the start of Strings.
+
+--*/
+{
+    USHORT paths[TEST_COUNT(TestRulePaths)];
+    USHORT extensions[TEST_COUNT(TestRuleExtensions)];
+    USHORT processes[TEST_COUNT(TestRuleProcesses)];
+    USHORT sids[TEST_RULE_SIDS];
+    PPOLICY_RULE rule;
+    ULONG i;
+
+    memset( Rules, 0, FIELD_OFFSET(POLICY_RULES, Strings) );
+
+    for (i = 0; i < TEST_COUNT(paths); i++) {
+
+        paths[i] = TestAddString( Rules, TestRulePaths[i] );
+    }
+
+    for (i = 0; i < TEST_COUNT(extensions); i++) {
+
+        extensions[i] = TestAddString( Rules, TestRuleExtensions[i] );
+    }
+
+    for (i = 0; i < TEST_COUNT(processes); i++) {
+
+        processes[i] = TestAddString( Rules, TestRuleProcesses[i] );
+    }
+
+    for (i = 0; i < TEST_RULE_SIDS; i++) {
+
+        sids[i] = TestAddSid( Rules, TestRuleSids[i] );
+    }
+
+    Rules->Count = TestRandom( RULE_MAX + 1 );
+
+    for (i = 0; i < Rules->Count; i++) {
+
+        rule = &Rules->Rules[i];
+
+        rule->Verdict = TestRandom( 2 ) ? RULE_ALLOW : RULE_DENY;
+        rule->Operations = (USHORT) TestRandom( RULE_OP_ALL + 1 );
+        rule->Path = TestRandom( 3 ) ? RULE_ANY : paths[TestRandom( TEST_COUNT(paths) )];
+        rule->Extension = TestRandom( 3 ) ? RULE_ANY : extensions[TestRandom( TEST_COUNT(extensions) )];
+        rule->Process = TestRandom( 3 ) ? RULE_ANY : processes[TestRandom( TEST_COUNT(processes) )];
+        rule->User = TestRandom( 4 ) ? RULE_ANY : sids[TestRandom( TEST_RULE_SIDS )];
+    }
+}
+
+
+static PUNICODE_STRING
+TestRuleString (
+    __in PPOLICY_RULES Rules,
+    __in USHORT Offset,
+    __out PUNICODE_STRING String
+    )
+{
+    String->Buffer = (PWCHAR) &Rules->Strings[Offset];
+
+    for (String->Length = 0; String->Buffer[String->Length / sizeof(WCHAR)] != UNICODE_NULL; ) {
+
+        String->Length += sizeof(WCHAR);
+    }
+
+    String->MaximumLength = String->Length;
+
+    return String;
+}
+
+
+static BOOLEAN
+TestSameName (
+    __in CONST WCHAR *First,
+    __in CONST WCHAR *Second,
+    __in ULONG Length
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+
+        if (RtlUpcaseUnicodeChar( First[i] ) != RtlUpcaseUnicodeChar( Second[i] )) {
+
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+static USHORT
+TestInterpret (
+    __in PPOLICY_RULES Rules,
+    __inout PTEST_SUBJECT Subject
+    )
+/*++
+
+Routine Description:
+
+    Decides an operation from POLICY_RULES itself, trying every rule in
+    order and every predicate of each, as miniSpy.h describes them.
+    Sets ImageNeeded if some rule needed the image name to decide.
+
+--*/
+{
+    PPOLICY_RULE rule;
+    UNICODE_STRING string;
+    ULONG i;
+
+    for (i = 0; i < Rules->Count; i++) {
+
+        rule = &Rules->Rules[i];
+
+        if (!(rule->Operations & Subject->Subject.operation)) {
+
+            continue;
+        }
+
+        if (rule->Path != RULE_ANY &&
+            !TestFindLoop( &Subject->Name, TestRuleString( Rules, rule->Path, &string ) )) {
+
+            continue;
+        }
+
+        if (rule->Extension != RULE_ANY) {
+
+            TestRuleString( Rules, rule->Extension, &string );
+
+            if (!Subject->HasExtension ||
+                Subject->Extension.Length != string.Length ||
+                !TestSameName( Subject->Extension.Buffer, string.Buffer, string.Length / sizeof(WCHAR) )) {
+
+                continue;
+            }
+        }
+
+        if (rule->Process != RULE_ANY) {
+
+            TestRuleString( Rules, rule->Process, &string );
+            Subject->ImageNeeded = TRUE;
+
+            if (!Subject->HasImage ||
+                Subject->Image.Length < string.Length ||
+                !TestSameName( Subject->Image.Buffer + (Subject->Image.Length - string.Length) / sizeof(WCHAR),
+                               string.Buffer,
+                               string.Length / sizeof(WCHAR) )) {
+
+                continue;
+            }
+        }
+
+        if (rule->User != RULE_ANY) {
+
+            if (Subject->Unknown) {
+
+                return RULE_NONE;
+            }
+
+            if (!(Subject->Members & (1 << TestSidIndex( &Rules->Strings[rule->User] )))) {
+
+                continue;
+            }
+        }
+
+        return rule->Verdict;
+    }
+
+    return RULE_NONE;
+}
+
+
+static VOID
+TestCompile (
+    __in PFF_LIST_CONTEXT List,
+    __out PFF_PROCESS_TABLE Processes
+    )
+{
+    PolicyClearProcesses( Processes );
+
+    for (; List != NULL; List = List->head) {
+
+        PolicyAddProcess( Processes, List );
+    }
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestReference (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    The shim's FsRtlIsNameInExpression against TestGlob, for expressions
+    of names, '*' and '?'.
+
+--*/
+{
+    WCHAR expression[TEST_MAX_NAME + 2];
+    WCHAR name[TEST_MAX_NAME * 2];
+    UNICODE_STRING expressionString;
+    UNICODE_STRING nameString;
+    ULONG expressionLength;
+    ULONG nameLength;
+    ULONG round;
+    ULONG i;
+
+    for (round = 0; round < 50000; round++) {
+
+        expressionLength = TestName( expression );
+
+        for (i = TestRandom( 3 ); i > 0; i--) {
+
+            expression[TestRandom( expressionLength )] = TestRandom( 2 ) ? L'*' : L'?';
+        }
+
+        nameLength = TestName( name );
+        nameLength += TestName( name + nameLength );
+
+        expressionString.Buffer = expression;
+        expressionString.Length = expressionString.MaximumLength = (USHORT) (expressionLength * sizeof(WCHAR));
+        nameString.Buffer = name;
+        nameString.Length = nameString.MaximumLength = (USHORT) (nameLength * sizeof(WCHAR));
+
+        CHECK( FsRtlIsNameInExpression( &expressionString, &nameString, FALSE, NULL ) ==
+               TestGlob( expression, expressionLength, name, nameLength ) );
+    }
+}
+
+
+static VOID
+TestProcesses (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Random lists compiled into a table must match each image as the loop
+    over them does.  Counts the matches too, so a generator that never
+    matched would not pass unnoticed.
+
+--*/
+{
+    static FF_PROCESS_TABLE processes;
+    WCHAR expression[TEST_MAX_NAME + 1];
+    WCHAR image[TEST_MAX_IMAGE];
+    UNICODE_STRING imageString;
+    PFF_LIST_CONTEXT list;
+    ULONG matched = 0;
+    ULONG checked = 0;
+    ULONG entries;
+    ULONG length;
+    ULONG round;
+    ULONG i;
+
+    for (round = 0; round < TEST_LISTS; round++) {
+
+        list = NULL;
+
+        for (entries = TestRandom( TEST_MAX_ENTRIES + 1 ); entries > 0; entries--) {
+
+            length = TestExpression( expression );
+            list = TestListEntry( expression, length, list );
+        }
+
+        TestCompile( list, &processes );
+
+        for (i = 0; i < TEST_IMAGES; i++) {
+
+            imageString.Buffer = image;
+            imageString.Length = imageString.MaximumLength = (USHORT) (TestImage( list, image ) * sizeof(WCHAR));
+
+            matched += TestMatchLoop( list, &imageString );
+            checked++;
+
+            if (PolicyMatchProcess( &processes, &imageString ) != TestMatchLoop( list, &imageString )) {
+
+                CHECK( !"PolicyMatchProcess differs from the loop" );
+                break;
+            }
+        }
+
+        TestFreeList( list );
+    }
+
+    CHECK( matched > checked / 4 && matched < checked * 3 / 4 );
+}
+
+
+static VOID
+TestProcessEdges (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    The cases a random list may miss: an empty table, an image shorter
+    than the name, a name as long as FF_PROCESS_MAX_SUFFIX and one
+    longer, "*" alone and an image equal to a name.
+
+--*/
+{
+    static FF_PROCESS_TABLE processes;
+    static WCHAR item[FF_PROCESS_MAX_SUFFIX + 3];
+    static WCHAR image[FF_PROCESS_MAX_SUFFIX + 10];
+    UNICODE_STRING imageString;
+    PFF_LIST_CONTEXT list;
+    ULONG i;
+    ULONG n;
+
+    imageString.Buffer = image;
+
+    PolicyClearProcesses( &processes );
+    image[0] = L'a';
+    imageString.Length = imageString.MaximumLength = sizeof(WCHAR);
+    CHECK( !PolicyMatchProcess( &processes, &imageString ) );
+    imageString.Length = 0;
+    CHECK( !PolicyMatchProcess( &processes, &imageString ) );
+
+    list = TestListEntry( L"*\\a.exe", 7, NULL );
+    TestCompile( list, &processes );
+
+    memcpy( image, L"a.exe", 5 * sizeof(WCHAR) );
+    imageString.Length = 5 * sizeof(WCHAR);
+    CHECK( !PolicyMatchProcess( &processes, &imageString ) );
+
+    memcpy( image, L"\\a.exe", 6 * sizeof(WCHAR) );
+    imageString.Length = 6 * sizeof(WCHAR);
+    CHECK( PolicyMatchProcess( &processes, &imageString ) );
+
+    image[1] = L'A';
+    CHECK( !PolicyMatchProcess( &processes, &imageString ) );
+    TestFreeList( list );
+
+    for (i = FF_PROCESS_MAX_SUFFIX; i <= FF_PROCESS_MAX_SUFFIX + 1; i++) {
+
+        item[0] = L'*';
+        for (n = 1; n <= i; n++) {
+
+            item[n] = L'x';
+        }
+
+        list = TestListEntry( item, i + 1, NULL );
+        TestCompile( list, &processes );
+
+        for (n = 0; n < i + 5; n++) {
+
+            image[n] = L'x';
+        }
+
+        imageString.Length = (USHORT) ((i + 5) * sizeof(WCHAR));
+        CHECK( PolicyMatchProcess( &processes, &imageString ) );
+
+        imageString.Length = (USHORT) ((i - 1) * sizeof(WCHAR));
+        CHECK( !PolicyMatchProcess( &processes, &imageString ) );
+
+        image[i + 4] = L'y';
+        imageString.Length = (USHORT) ((i + 5) * sizeof(WCHAR));
+        CHECK( !PolicyMatchProcess( &processes, &imageString ) );
+        TestFreeList( list );
+    }
+
+    list = TestListEntry( L"*", 1, NULL );
+    TestCompile( list, &processes );
+    imageString.Length = 0;
+    CHECK( PolicyMatchProcess( &processes, &imageString ) );
+    TestFreeList( list );
+
+    PolicyClearProcesses( &processes );
+    imageString.Length = sizeof(WCHAR);
+    CHECK( !PolicyMatchProcess( &processes, &imageString ) );
+}
+
+
+static VOID
+TestFindExhaustive (
+    VOID
+    )
+{
+    WCHAR string[TEST_FIND_STRING];
+    WCHAR subString[TEST_FIND_SUBSTRING];
+    UNICODE_STRING stringString = { 0, sizeof(string), string };
+    UNICODE_STRING subStringString = { 0, sizeof(subString), subString };
+    ULONG differences = 0;
+    ULONG found = 0;
+    BOOLEAN expected;
+    ULONG strings;
+    ULONG subStrings;
+    ULONG length;
+    ULONG subLength;
+    ULONG i;
+    ULONG j;
+
+    for (length = 0, strings = 1; length <= TEST_FIND_STRING; length++, strings *= TEST_FIND_CHARS) {
+
+        for (i = 0; i < strings; i++) {
+
+            stringString.Length = (USHORT) (TestFindString( i, length, string ) * sizeof(WCHAR));
+
+            for (subLength = 0, subStrings = 1;
+                 subLength <= TEST_FIND_SUBSTRING;
+                 subLength++, subStrings *= TEST_FIND_CHARS) {
+
+                for (j = 0; j < subStrings; j++) {
+
+                    subStringString.Length = (USHORT) (TestFindString( j, subLength, subString ) * sizeof(WCHAR));
+
+                    expected = TestFindLoop( &stringString, &subStringString );
+                    found += expected;
+
+                    if (RtlFindSubString( &stringString, &subStringString ) != expected &&
+                        differences++ < 4) {
+
+                        fprintf( stderr, "length %u string %u, length %u substring %u\n", length, i, subLength, j );
+                    }
+                }
+            }
+        }
+    }
+
+    CHECK( differences == 0 );
+    CHECK( found != 0 );
+}
+
+
+static VOID
+TestFindRandom (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Names of up to TEST_MAX_IMAGE characters, and substrings taken from
+    them with their case flipped or a character changed, or of their own.
+    The last check is a name of 32767 characters, the most a
+    UNICODE_STRING holds, that ends in the substring.
+
+--*/
+{
+    static WCHAR string[32767];
+    WCHAR subString[TEST_MAX_NAME];
+    UNICODE_STRING stringString = { 0, sizeof(string), string };
+    UNICODE_STRING subStringString = { 0, sizeof(subString), subString };
+    ULONG found = 0;
+    ULONG length;
+    ULONG subLength;
+    ULONG start;
+    ULONG round;
+    ULONG i;
+
+    for (round = 0; round < 200000; round++) {
+
+        length = TestRandom( TEST_MAX_IMAGE );
+
+        for (i = 0; i < length; i++) {
+
+            string[i] = TestRandom( 8 ) == 0 ? TestFindAlphabet[TestRandom( TEST_FIND_CHARS - 1 )] :
+                        TestAlphabet[TestRandom( sizeof(TestAlphabet) - 1 )];
+        }
+
+        subLength = TestRandom( TEST_MAX_NAME );
+
+        if (subLength <= length && TestRandom( 4 ) != 0) {
+
+            start = TestRandom( length - subLength + 1 );
+
+            for (i = 0; i < subLength; i++) {
+
+                subString[i] = string[start + i];
+
+                if (TestRandom( 3 ) == 0) {
+
+                    subString[i] = (subString[i] >= L'a' && subString[i] <= L'z') ? subString[i] - 32 :
+                                   (subString[i] >= L'A' && subString[i] <= L'Z') ? subString[i] + 32 :
+                                   subString[i];
+                }
+            }
+
+            if (subLength != 0 && TestRandom( 4 ) == 0) {
+
+                subString[TestRandom( subLength )] = TestAlphabet[TestRandom( sizeof(TestAlphabet) - 1 )];
+            }
+
+        } else {
+
+            TestName( subString );
+        }
+
+        stringString.Length = (USHORT) (length * sizeof(WCHAR));
+        subStringString.Length = (USHORT) (subLength * sizeof(WCHAR));
+
+        found += TestFindLoop( &stringString, &subStringString );
+
+        if (RtlFindSubString( &stringString, &subStringString ) != TestFindLoop( &stringString, &subStringString )) {
+
+            CHECK( !"RtlFindSubString differs from the loop" );
+            break;
+        }
+    }
+
+    CHECK( found > round / 4 && found < round * 3 / 4 );
+
+    for (i = 0; i < sizeof(string) / sizeof(string[0]); i++) {
+
+        string[i] = L'a';
+    }
+
+    memcpy( subString, L"\\B", 2 * sizeof(WCHAR) );
+    subStringString.Length = 2 * sizeof(WCHAR);
+    stringString.Length = sizeof(string);
+    CHECK( !RtlFindSubString( &stringString, &subStringString ) );
+
+    string[32765] = L'\\';
+    string[32766] = L'b';
+    CHECK( RtlFindSubString( &stringString, &subStringString ) );
+
+    stringString.Length -= sizeof(WCHAR);
+    CHECK( !RtlFindSubString( &stringString, &subStringString ) );
+}
+
+
+static VOID
+TestExtensionList (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Parsing: dots, blank lines, CR LF, trailing spaces, NULs between the
+    entries and repeats in another case.
+
+--*/
+{
+    static const WCHAR list[] = L".txt\r\nDOC\n\n  \r\n.Txt\0bak \n.\n.tar.gz";
+    static FF_EXTENSION_TABLE extensions;
+
+    CHECK( TestSetExtensions( &extensions, list, sizeof(list) / sizeof(WCHAR) - 1 ) == STATUS_SUCCESS );
+    CHECK( extensions.count == 4 );
+    CHECK( TestSlotsUsed( &extensions ) == 4 );
+
+    CHECK( TestMatchExtension( &extensions, "txt" ) );
+    CHECK( TestMatchExtension( &extensions, "TXT" ) );
+    CHECK( TestMatchExtension( &extensions, "Doc" ) );
+    CHECK( TestMatchExtension( &extensions, "bak" ) );
+    CHECK( TestMatchExtension( &extensions, "tar.gz" ) );
+    CHECK( !TestMatchExtension( &extensions, "gz" ) );
+    CHECK( !TestMatchExtension( &extensions, "tx" ) );
+    CHECK( !TestMatchExtension( &extensions, "txtx" ) );
+    CHECK( !TestMatchExtension( &extensions, "bak " ) );
+    CHECK( !TestMatchExtension( &extensions, "" ) );
+
+    CHECK( TestSetExtensions( &extensions, L"\n\n", 2 ) == STATUS_SUCCESS );
+    CHECK( extensions.count == 0 );
+    CHECK( !TestMatchExtension( &extensions, "txt" ) );
+}
+
+
+static VOID
+TestExtensionSets (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Random sets, up to full, must each get a seed, fill exactly as many
+    slots as they have extensions, and answer as TestExtensionScan does
+    for their own extensions in another case and for random others.
+
+--*/
+{
+    static FF_EXTENSION_TABLE extensions;
+    WCHAR list[FF_EXTENSION_MAX * (FF_EXTENSION_CHARS + 1)];
+    WCHAR probe[FF_EXTENSION_CHARS + 1];
+    UNICODE_STRING probeString;
+    ULONG length;
+    ULONG count;
+    ULONG round;
+    ULONG found = 0;
+    ULONG maxSeed = 0;
+    ULONG i;
+    ULONG j;
+
+    probeString.Buffer = probe;
+
+    for (round = 0; round < TEST_EXTENSION_SETS; round++) {
+
+        count = (round % 2 == 0) ? FF_EXTENSION_MAX : TestRandom( FF_EXTENSION_MAX + 1 );
+        length = 0;
+
+        for (i = 0; i < count; i++) {
+
+            length += TestExtension( list + length );
+            list[length++] = L'\n';
+        }
+
+        if (TestSetExtensions( &extensions, list, length ) != STATUS_SUCCESS) {
+
+            CHECK( !"no seed for a set of extensions" );
+            continue;
+        }
+
+        CHECK( TestSlotsUsed( &extensions ) == extensions.count );
+
+        if (extensions.seed > maxSeed) {
+
+            maxSeed = extensions.seed;
+        }
+
+        for (i = 0; i < extensions.count; i++) {
+
+            for (j = 0; j < extensions.extensions[i].length; j++) {
+
+                probe[j] = extensions.extensions[i].name[j];
+                probe[j] += (probe[j] >= L'A' && probe[j] <= L'Z' && TestRandom( 2 )) ? 32 : 0;
+            }
+
+            probeString.Length = (USHORT) (j * sizeof(WCHAR));
+            CHECK( PolicyMatchExtension( &extensions, &probeString ) );
+        }
+
+        for (i = 0; i < 64; i++) {
+
+            probeString.Length = (USHORT) (TestExtension( probe ) * sizeof(WCHAR));
+            found += TestExtensionScan( &extensions, &probeString );
+
+            if (PolicyMatchExtension( &extensions, &probeString ) != TestExtensionScan( &extensions, &probeString )) {
+
+                CHECK( !"PolicyMatchExtension differs from the scan" );
+                break;
+            }
+        }
+    }
+
+    CHECK( found != 0 );
+
+    //
+    //  A full set shares no slot under a given seed about one time in
+    //  seven, so a seed past a few hundred would mean the slots are not
+    //  as independent of the seed as they should be.
+    //
+
+    CHECK( maxSeed < 256 );
+}
+
+
+static VOID
+TestExtensionLimits (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    FF_EXTENSION_MAX extensions and FF_EXTENSION_CHARS characters fit,
+    one more of either does not and empties the table, and repeats do
+    not count against the limit.  "!" and U+0421, whose characters are
+    0x400 apart, must get a seed as any other pair does.
+
+--*/
+{
+    static FF_EXTENSION_TABLE extensions;
+    WCHAR list[(FF_EXTENSION_MAX + 2) * 8];
+    CHAR narrow[16];
+    ULONG length = 0;
+    ULONG i;
+
+    for (i = 0; i < FF_EXTENSION_MAX; i++) {
+
+        snprintf( narrow, sizeof(narrow), "e%u\n", i );
+        length += TestWiden( list + length, narrow );
+    }
+
+    CHECK( TestSetExtensions( &extensions, list, length ) == STATUS_SUCCESS );
+    CHECK( extensions.count == FF_EXTENSION_MAX );
+    CHECK( TestSlotsUsed( &extensions ) == FF_EXTENSION_MAX );
+    CHECK( TestMatchExtension( &extensions, "E63" ) );
+
+    length += TestWiden( list + length, "E0\n.e1\n" );
+    CHECK( TestSetExtensions( &extensions, list, length ) == STATUS_SUCCESS );
+    CHECK( extensions.count == FF_EXTENSION_MAX );
+
+    length += TestWiden( list + length, "e64\n" );
+    CHECK( TestSetExtensions( &extensions, list, length ) == STATUS_INVALID_PARAMETER );
+    CHECK( extensions.count == 0 );
+    CHECK( TestSlotsUsed( &extensions ) == 0 );
+    CHECK( !TestMatchExtension( &extensions, "e0" ) );
+
+    length = TestWiden( list, "txt\n0123456789abcdef" );
+    CHECK( TestSetExtensions( &extensions, list, length ) == STATUS_SUCCESS );
+    CHECK( TestMatchExtension( &extensions, "0123456789ABCDEF" ) );
+    CHECK( !TestMatchExtension( &extensions, "0123456789ABCDEFG" ) );
+
+    length = TestWiden( list, "txt\n0123456789abcdefg" );
+    CHECK( TestSetExtensions( &extensions, list, length ) == STATUS_INVALID_PARAMETER );
+    CHECK( !TestMatchExtension( &extensions, "txt" ) );
+
+    list[0] = L'!';
+    list[1] = L'\n';
+    list[2] = 0x0421;
+    CHECK( TestSetExtensions( &extensions, list, 3 ) == STATUS_SUCCESS );
+    CHECK( extensions.count == 2 );
+    CHECK( TestMatchExtension( &extensions, "!" ) );
+}
+
+
+static VOID
+TestRules (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Random rules compiled by PolicySetRules must decide random operations
+    as TestInterpret does, asking for the image name at most once and
+    exactly when the interpreter needed it.
+
+--*/
+{
+    static POLICY_RULES source;
+    static FF_RULE_TABLE rules;
+    TEST_SUBJECT subject;
+    ULONG verdicts[3] = { 0 };
+    USHORT expected;
+    USHORT verdict;
+    ULONG round;
+    ULONG i;
+
+    for (round = 0; round < TEST_RULE_SETS; round++) {
+
+        TestRandomRules( &source );
+
+        CHECK( PolicySetRules( &rules, &source ) == STATUS_SUCCESS );
+        CHECK( rules.count == source.Count );
+
+        for (i = 0; i < TEST_RULE_SUBJECTS; i++) {
+
+            TestRandomSubject( &subject );
+
+            expected = TestInterpret( &source, &subject );
+            verdict = PolicyEvaluateRules( &rules, &subject.Subject );
+            verdicts[expected]++;
+
+            if (verdict != expected ||
+                subject.ImageCalls > 1 ||
+                (subject.ImageCalls != 0) != subject.ImageNeeded) {
+
+                CHECK( !"PolicyEvaluateRules differs from the interpreter" );
+                break;
+            }
+        }
+    }
+
+    CHECK( verdicts[RULE_NONE] > TEST_RULE_SETS && verdicts[RULE_ALLOW] > TEST_RULE_SETS && verdicts[RULE_DENY] > TEST_RULE_SETS );
+}
+
+
+static USHORT
+TestBaseRules (
+    __out PPOLICY_RULES Rules
+    )
+/*++
+
+Routine Description:
+
+    One valid rule, denying writes under \docs\ to S-1-5-21-1001, for
+    TestRuleLimits to spoil.  Returns the offset of its SID, which is the
+    last thing in Strings.
+
+--*/
+{
+    memset( Rules, 0, FIELD_OFFSET(POLICY_RULES, Strings) );
+
+    Rules->Count = 1;
+    Rules->Rules[0].Verdict = RULE_DENY;
+    Rules->Rules[0].Operations = RULE_OP_WRITE;
+    Rules->Rules[0].Path = TestAddString( Rules, "\\docs\\" );
+    Rules->Rules[0].Extension = RULE_ANY;
+    Rules->Rules[0].Process = RULE_ANY;
+    Rules->Rules[0].User = TestAddSid( Rules, 1001 );
+
+    return Rules->Rules[0].User;
+}
+
+
+static VOID
+TestRuleLimits (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Each way of spoiling a valid rule must be refused and leave no rules
+    in force.
+
+--*/
+{
+    static POLICY_RULES source;
+    static FF_RULE_TABLE rules;
+    TEST_SUBJECT subject;
+    USHORT sid;
+    ULONG spoil;
+    NTSTATUS status;
+
+    TestRandomSubject( &subject );
+    subject.Name.Length = (USHORT) (TestWiden( subject.Buffer[0], "\\Device\\HarddiskVolume1\\Docs\\a.txt" ) * sizeof(WCHAR));
+    subject.Subject.operation = RULE_OP_WRITE;
+    subject.Members = 1;
+    subject.Unknown = FALSE;
+
+    TestBaseRules( &source );
+    CHECK( PolicySetRules( &rules, &source ) == STATUS_SUCCESS );
+    CHECK( PolicyEvaluateRules( &rules, &subject.Subject ) == RULE_DENY );
+
+    subject.Unknown = TRUE;
+    CHECK( PolicyEvaluateRules( &rules, &subject.Subject ) == RULE_NONE );
+    subject.Unknown = FALSE;
+
+    for (spoil = 0; spoil < 13; spoil++) {
+
+        sid = TestBaseRules( &source );
+
+        switch (spoil) {
+
+        case 0:  source.Count = RULE_MAX + 1; break;
+        case 1:  source.StringsLength = RULE_MAX_STRINGS + 1; break;
+        case 2:  source.Rules[0].Verdict = RULE_NONE; break;
+        case 3:  source.Rules[0].Verdict = RULE_DENY + 1; break;
+        case 4:  source.Rules[0].Operations = RULE_OP_ALL + 1; break;
+        case 5:  source.Rules[0].Path = 1; break;
+        case 6:  source.Rules[0].Path = (USHORT) source.StringsLength; break;
+        case 7:  source.Rules[0].Extension = TestAddString( &source, "" ); break;
+        case 8:  source.StringsLength = source.Rules[0].Process = TestAddString( &source, "a.exe" );
+                 source.StringsLength += 5 * sizeof(WCHAR); break;
+        case 9:  source.Rules[0].User = sid + 2; break;
+        case 10: source.StringsLength = sid + 4; break;
+        case 11: ((PISID) &source.Strings[sid])->SubAuthorityCount = 3; break;
+        case 12: ((PISID) &source.Strings[sid])->Revision = SID_REVISION + 1; break;
+        }
+
+        status = PolicySetRules( &rules, &source );
+
+        if (status != STATUS_INVALID_PARAMETER) {
+
+            fprintf( stderr, "spoiled rules %u accepted\n", spoil );
+        }
+
+        CHECK( status == STATUS_INVALID_PARAMETER );
+        CHECK( rules.count == 0 );
+        CHECK( PolicyEvaluateRules( &rules, &subject.Subject ) == RULE_NONE );
+    }
+
+    //
+    //  RULE_MAX rules, all of one operation, are a full table.
+    //
+
+    TestBaseRules( &source );
+
+    for (spoil = 1; spoil < RULE_MAX; spoil++) {
+
+        source.Rules[spoil] = source.Rules[0];
+        source.Rules[spoil].Verdict = RULE_ALLOW;
+    }
+
+    source.Count = RULE_MAX;
+    CHECK( PolicySetRules( &rules, &source ) == STATUS_SUCCESS );
+    CHECK( rules.operationCount[2] == RULE_MAX );
+    CHECK( PolicyEvaluateRules( &rules, &subject.Subject ) == RULE_DENY );
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+static double
+BenchmarkMatch (
+    __in PFF_PROCESS_TABLE Processes,
+    __in PFF_LIST_CONTEXT List,
+    __in PUNICODE_STRING Image,
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    ns per check of Image, against the table or, with Processes NULL,
+    the loop over List.
+
+--*/
+{
+    LONGLONG start = SimTestNow();
+    LONGLONG elapsed;
+    ULONGLONG checks = 0;
+    ULONG matched = 0;
+    ULONG i;
+
+    do {
+
+        for (i = 0; i < 64; i++) {
+
+            matched += (Processes != NULL) ? PolicyMatchProcess( Processes, Image ) : TestMatchLoop( List, Image );
+        }
+
+        checks += 64;
+        elapsed = SimTestNow() - start;
+
+    } while (elapsed < (LONGLONG) Seconds * 1000000000 / 8);
+
+    CHECK( matched == 0 || matched == checks );
+
+    return (double) elapsed / checks;
+}
+
+
+static VOID
+BenchmarkProcesses (
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    PolicyMatchProcess and the loop it replaced over lists of 10 to 10000
+    "*\\Program Files\\App<n>\\app<n>.exe" expressions, as the registry
+    list holds them.  "miss" is an image under none of them, "hit" the
+    image of the first one added, which the loop reaches last.
+
+--*/
+{
+    static const ULONG counts[] = { 10, 100, 1000, 10000 };
+    static FF_PROCESS_TABLE processes;
+    CHAR narrow[64];
+    WCHAR item[64];
+    WCHAR image[128];
+    UNICODE_STRING imageString;
+    PFF_LIST_CONTEXT list;
+    ULONG length;
+    ULONG i;
+    ULONG n;
+
+    imageString.Buffer = image;
+
+    printf( "%8s %12s %12s %12s %12s\n", "entries", "miss table", "miss loop", "hit table", "hit loop" );
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+
+        list = NULL;
+
+        for (n = 0; n < counts[i]; n++) {
+
+            snprintf( narrow, sizeof(narrow), "*\\Program Files\\App%u\\app%u.exe", n, n );
+            length = TestWiden( item, narrow );
+            list = TestListEntry( item, length, list );
+        }
+
+        TestCompile( list, &processes );
+
+        printf( "%8u", counts[i] );
+
+        length = TestWiden( image, "\\Device\\HarddiskVolume1\\Windows\\System32\\svchost.exe" );
+        imageString.Length = imageString.MaximumLength = (USHORT) (length * sizeof(WCHAR));
+        printf( " %12.1f", BenchmarkMatch( &processes, list, &imageString, Seconds ) );
+        printf( " %12.1f", BenchmarkMatch( NULL, list, &imageString, Seconds ) );
+
+        length = TestWiden( image, "\\Device\\HarddiskVolume1\\Program Files\\App0\\app0.exe" );
+        imageString.Length = imageString.MaximumLength = (USHORT) (length * sizeof(WCHAR));
+        printf( " %12.1f", BenchmarkMatch( &processes, list, &imageString, Seconds ) );
+        printf( " %12.1f\n", BenchmarkMatch( NULL, list, &imageString, Seconds ) );
+
+        TestFreeList( list );
+    }
+}
+
+
+static double
+BenchmarkFindOne (
+    __in PUNICODE_STRING String,
+    __in PUNICODE_STRING SubString,
+    __in BOOLEAN Loop,
+    __in ULONG Seconds
+    )
+{
+    LONGLONG start = SimTestNow();
+    LONGLONG elapsed;
+    ULONGLONG calls = 0;
+    ULONG found = 0;
+    ULONG i;
+
+    do {
+
+        for (i = 0; i < 64; i++) {
+
+            found += Loop ? TestFindLoop( String, SubString ) : RtlFindSubString( String, SubString );
+        }
+
+        calls += 64;
+        elapsed = SimTestNow() - start;
+
+    } while (elapsed < (LONGLONG) Seconds * 1000000000 / 8);
+
+    CHECK( found == 0 || found == calls );
+
+    return (double) elapsed / calls;
+}
+
+
+static VOID
+BenchmarkFind (
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    RtlFindSubString and the loop it replaced, looking for "\\protected\\"
+    in a path of the given length that does not hold it, and in one that
+    ends in it with its case changed, so both search the whole name.
+
+--*/
+{
+    static const ULONG lengths[] = { 16, 64, 256, 1024 };
+    static WCHAR string[1024 + 16];
+    WCHAR subString[16];
+    UNICODE_STRING stringString = { 0, sizeof(string), string };
+    UNICODE_STRING subStringString = { 0, sizeof(subString), subString };
+    ULONG i;
+    ULONG j;
+
+    subStringString.Length = (USHORT) (TestWiden( subString, "\\protected\\" ) * sizeof(WCHAR));
+
+    printf( "\n%8s %12s %12s %12s %12s\n", "length", "miss find", "miss loop", "hit find", "hit loop" );
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+
+        for (j = 0; j < lengths[i]; j++) {
+
+            string[j] = "\\Users\\Report"[j % 14];
+        }
+
+        stringString.Length = (USHORT) (lengths[i] * sizeof(WCHAR));
+
+        printf( "%8u", lengths[i] );
+        printf( " %12.1f", BenchmarkFindOne( &stringString, &subStringString, FALSE, Seconds ) );
+        printf( " %12.1f", BenchmarkFindOne( &stringString, &subStringString, TRUE, Seconds ) );
+
+        TestWiden( string + lengths[i] - 11, "\\PROTECTED\\" );
+
+        printf( " %12.1f", BenchmarkFindOne( &stringString, &subStringString, FALSE, Seconds ) );
+        printf( " %12.1f\n", BenchmarkFindOne( &stringString, &subStringString, TRUE, Seconds ) );
+    }
+}
+
+
+static double
+BenchmarkExtensionOne (
+    __in PFF_EXTENSION_TABLE Extensions,
+    __in PUNICODE_STRING Extension,
+    __in BOOLEAN Scan,
+    __in ULONG Seconds
+    )
+{
+    LONGLONG start = SimTestNow();
+    LONGLONG elapsed;
+    ULONGLONG calls = 0;
+    ULONG found = 0;
+    ULONG i;
+
+    do {
+
+        for (i = 0; i < 64; i++) {
+
+            found += Scan ? TestExtensionScan( Extensions, Extension ) : PolicyMatchExtension( Extensions, Extension );
+        }
+
+        calls += 64;
+        elapsed = SimTestNow() - start;
+
+    } while (elapsed < (LONGLONG) Seconds * 1000000000 / 8);
+
+    CHECK( found == 0 || found == calls );
+
+    return (double) elapsed / calls;
+}
+
+
+static VOID
+BenchmarkExtensions (
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    PolicyMatchExtension and a scan of the set, for an extension the set
+    does not hold and for the last one in it, which the scan reaches
+    last, and the average time PolicySetExtensions takes over many
+    random sets of that size, making the list included, with the seed it
+    reaches on average.
+
+--*/
+{
+    static const ULONG counts[] = { 1, 8, 64 };
+    static FF_EXTENSION_TABLE extensions;
+    WCHAR list[FF_EXTENSION_MAX * (FF_EXTENSION_CHARS + 1)];
+    WCHAR probe[FF_EXTENSION_CHARS];
+    UNICODE_STRING probeString;
+    CHAR narrow[16];
+    LONGLONG start;
+    double setTime;
+    ULONGLONG seeds;
+    ULONG length;
+    ULONG sets;
+    ULONG i;
+    ULONG j;
+
+    probeString.Buffer = probe;
+
+    printf( "\n%8s %12s %12s %12s %12s %12s %8s\n",
+            "exts", "miss hash", "miss scan", "hit hash", "hit scan", "set", "seed" );
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+
+        seeds = 0;
+        start = SimTestNow();
+
+        for (sets = 0; SimTestNow() - start < (LONGLONG) Seconds * 1000000000 / 8; sets++) {
+
+            length = 0;
+
+            for (j = 0; j < counts[i]; j++) {
+
+                length += TestExtension( list + length );
+                list[length++] = L'\n';
+            }
+
+            CHECK( TestSetExtensions( &extensions, list, length ) == STATUS_SUCCESS );
+            seeds += extensions.seed;
+        }
+
+        setTime = (double) (SimTestNow() - start) / sets;
+
+        printf( "%8u", counts[i] );
+
+        length = 0;
+
+        for (j = 0; j < counts[i]; j++) {
+
+            snprintf( narrow, sizeof(narrow), "ext%u\n", j );
+            length += TestWiden( list + length, narrow );
+        }
+
+        CHECK( TestSetExtensions( &extensions, list, length ) == STATUS_SUCCESS );
+
+        probeString.Length = (USHORT) (TestWiden( probe, "report" ) * sizeof(WCHAR));
+        printf( " %12.1f", BenchmarkExtensionOne( &extensions, &probeString, FALSE, Seconds ) );
+        printf( " %12.1f", BenchmarkExtensionOne( &extensions, &probeString, TRUE, Seconds ) );
+
+        snprintf( narrow, sizeof(narrow), "EXT%u", counts[i] - 1 );
+        probeString.Length = (USHORT) (TestWiden( probe, narrow ) * sizeof(WCHAR));
+        printf( " %12.1f", BenchmarkExtensionOne( &extensions, &probeString, FALSE, Seconds ) );
+        printf( " %12.1f", BenchmarkExtensionOne( &extensions, &probeString, TRUE, Seconds ) );
+
+        printf( " %12.1f %8.1f\n", setTime, (double) seeds / sets );
+    }
+}
+
+
+static double
+BenchmarkRulesOne (
+    __in PFF_RULE_TABLE Rules,
+    __in PPOLICY_RULES Source,
+    __inout PTEST_SUBJECT Subject,
+    __in BOOLEAN Interpret,
+    __in ULONG Seconds
+    )
+{
+    LONGLONG start = SimTestNow();
+    LONGLONG elapsed;
+    ULONGLONG calls = 0;
+    ULONG denied = 0;
+    ULONG i;
+
+    do {
+
+        for (i = 0; i < 64; i++) {
+
+            denied += (Interpret ? TestInterpret( Source, Subject ) :
+                                   PolicyEvaluateRules( Rules, &Subject->Subject )) == RULE_DENY;
+        }
+
+        calls += 64;
+        elapsed = SimTestNow() - start;
+
+    } while (elapsed < (LONGLONG) Seconds * 1000000000 / 8);
+
+    CHECK( denied == 0 || denied == calls );
+
+    return (double) elapsed / calls;
+}
+
+
+static VOID
+BenchmarkRules (
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    PolicyEvaluateRules and TestInterpret with 1 to RULE_MAX rules, each
+    denying writes under a folder of its own, for a write under none of
+    them, one under the last rule's, which the interpreter reaches last,
+    and a delete, which no rule covers.
+
+--*/
+{
+    static const ULONG counts[] = { 1, 8, 64 };
+    static POLICY_RULES source;
+    static FF_RULE_TABLE rules;
+    TEST_SUBJECT subject;
+    CHAR narrow[64];
+    ULONG i;
+    ULONG j;
+
+    printf( "\n%8s %12s %12s %12s %12s %12s %12s\n",
+            "rules", "miss table", "miss interp", "hit table", "hit interp", "other table", "other interp" );
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+
+        memset( &source, 0, FIELD_OFFSET(POLICY_RULES, Strings) );
+        source.Count = counts[i];
+
+        for (j = 0; j < counts[i]; j++) {
+
+            snprintf( narrow, sizeof(narrow), "\\docs%u\\", j );
+            source.Rules[j].Verdict = RULE_DENY;
+            source.Rules[j].Operations = RULE_OP_WRITE | RULE_OP_RENAME;
+            source.Rules[j].Path = TestAddString( &source, narrow );
+            source.Rules[j].Extension = RULE_ANY;
+            source.Rules[j].Process = RULE_ANY;
+            source.Rules[j].User = RULE_ANY;
+        }
+
+        CHECK( PolicySetRules( &rules, &source ) == STATUS_SUCCESS );
+
+        TestRandomSubject( &subject );
+        subject.Subject.operation = RULE_OP_WRITE;
+        subject.Name.Length = (USHORT) (TestWiden( subject.Buffer[0],
+                                                   "\\Device\\HarddiskVolume1\\Users\\Public\\report.txt" ) *
+                                        sizeof(WCHAR));
+
+        printf( "%8u", counts[i] );
+        printf( " %12.1f", BenchmarkRulesOne( &rules, &source, &subject, FALSE, Seconds ) );
+        printf( " %12.1f", BenchmarkRulesOne( &rules, &source, &subject, TRUE, Seconds ) );
+
+        snprintf( narrow, sizeof(narrow), "\\Device\\HarddiskVolume1\\docs%u\\report.txt", counts[i] - 1 );
+        subject.Name.Length = (USHORT) (TestWiden( subject.Buffer[0], narrow ) * sizeof(WCHAR));
+
+        printf( " %12.1f", BenchmarkRulesOne( &rules, &source, &subject, FALSE, Seconds ) );
+        printf( " %12.1f", BenchmarkRulesOne( &rules, &source, &subject, TRUE, Seconds ) );
+
+        subject.Subject.operation = RULE_OP_DELETE;
+
+        printf( " %12.1f", BenchmarkRulesOne( &rules, &source, &subject, FALSE, Seconds ) );
+        printf( " %12.1f\n", BenchmarkRulesOne( &rules, &source, &subject, TRUE, Seconds ) );
+    }
+}
+
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+{
+    BenchmarkProcesses( Seconds );
+    BenchmarkFind( Seconds );
+    BenchmarkExtensions( Seconds );
+    BenchmarkRules( Seconds );
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestReference();
+    TestProcesses();
+    TestProcessEdges();
+    TestFindExhaustive();
+    TestFindRandom();
+    TestExtensionList();
+    TestExtensionSets();
+    TestExtensionLimits();
+    TestRules();
+    TestRuleLimits();
+
+    return SimTestFinish( "mspyPolicyTest" );
+}
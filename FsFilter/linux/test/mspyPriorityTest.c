@@ -0,0 +1,658 @@
+/*++
+
+Module Name:
+
+    mspyPriorityTest.c
+
+Abstract:
+
+    Tests the high priority lane, ../filter/mspyPriority.c, through the
+    driver: denials logged while a flood of audit records has used up the
+    record quota still reach the reader, ahead of every audit record and
+    numbered from their own sequence; the reserve takes as many as it
+    holds and is given back once they are read; and a denial that finds
+    neither reserve nor quota is accounted for in the audit lane like any
+    other lost record.
+
+    With -b [seconds] it floods the log from 0 to 4 producer threads
+    while a consumer thread reads all the while and a prober thread is
+    denied once a millisecond, and prints the latency of each lane, from
+    a record's OriginatingTime to its reaching the consumer, and what
+    each lane lost.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+
+#define TEST_QUOTA              500
+#define TEST_FLOODERS           4
+
+//
+//  Latencies, in 100 ns units as OriginatingTime is, go in a histogram
+//  whose buckets split each power of two in four, as fanLoad's do.
+//
+
+#define TEST_BUCKETS            (4 + 40 * 4)
+
+typedef struct _TEST_LANE {
+
+    ULONGLONG Delivered;
+    ULONGLONG Histogram[TEST_BUCKETS];
+    ULONGLONG Longest;
+
+} TEST_LANE, *PTEST_LANE;
+
+//
+//  What the consumer saw.  Order checks only hold while one batch is
+//  read at a time with nothing being logged.
+//
+
+typedef struct _TEST_BOOKS {
+
+    TEST_LANE Audit;
+    TEST_LANE Denial;
+
+    ULONG NextPriority;
+    ULONG PriorityOutOfOrder;
+    ULONG PriorityBehindAudit;
+
+    BOOLEAN Timed;
+
+} TEST_BOOKS, *PTEST_BOOKS;
+
+static TEST_BOOKS Books;
+
+static PFILE_OBJECT Flood;
+
+static volatile ULONGLONG Produced;
+static volatile ULONGLONG Denied;
+
+
+static ULONG
+TestBucket (
+    __in ULONGLONG Time
+    )
+{
+    ULONG high;
+
+    if (Time < 4) {
+
+        return (ULONG) Time;
+    }
+
+    high = 63 - __builtin_clzll( Time );
+
+    if (high >= 42) {
+
+        return TEST_BUCKETS - 1;
+    }
+
+    return 4 + (high - 2) * 4 + (ULONG)((Time >> (high - 2)) & 3);
+}
+
+
+static double
+TestPercentile (
+    __in PTEST_LANE Lane,
+    __in ULONG PerMille
+    )
+/*++
+
+Routine Description:
+
+    The latency under which PerMille thousandths of the lane's records
+    arrived, the top of the bucket it falls in, in microseconds.
+
+--*/
+{
+    ULONGLONG rank = (Lane->Delivered * PerMille + 999) / 1000;
+    ULONGLONG seen = 0;
+    ULONGLONG top;
+    ULONG high;
+    ULONG b;
+
+    if (Lane->Delivered == 0) {
+
+        return 0.0;
+    }
+
+    for (b = 0; b < TEST_BUCKETS - 1; b++) {
+
+        seen += Lane->Histogram[b];
+
+        if (seen >= rank) {
+
+            if (b < 4) {
+
+                top = b;
+
+            } else {
+
+                high = (b - 4) / 4 + 2;
+                top = (ULONGLONG)(5 + (b - 4) % 4) << (high - 2);
+            }
+
+            return min( top, Lane->Longest ) / 10.0;
+        }
+    }
+
+    return Lane->Longest / 10.0;
+}
+
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    PTEST_BOOKS books = Context;
+    PTEST_LANE lane;
+    LARGE_INTEGER now;
+    ULONGLONG latency;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP )) {
+
+        return;
+    }
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_FLAG_PRIORITY )) {
+
+        if (LogRecord->SequenceNumber != books->NextPriority) {
+
+            books->PriorityOutOfOrder += 1;
+        }
+
+        books->NextPriority = LogRecord->SequenceNumber + 1;
+
+        if (books->Audit.Delivered != 0 && !books->Timed) {
+
+            books->PriorityBehindAudit += 1;
+        }
+
+        lane = &books->Denial;
+
+    } else if (LogRecord->Data.CallbackMajorId == IRP_MJ_WRITE) {
+
+        lane = &books->Audit;
+
+    } else {
+
+        return;
+    }
+
+    lane->Delivered += 1;
+
+    if (books->Timed) {
+
+        KeQuerySystemTime( &now );
+        latency = (ULONGLONG) max( now.QuadPart - LogRecord->Data.OriginatingTime.QuadPart, 0 );
+        lane->Histogram[TestBucket( latency )] += 1;
+        lane->Longest = max( lane->Longest, latency );
+    }
+}
+
+
+static BOOLEAN
+TestStart (
+    __in ULONG PriorityRecords,
+    __out PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver with a fixed quota and a reserve of PriorityRecords,
+    coalescing and sampling off so each write is one record, connects
+    and opens the file the flood writes.
+
+--*/
+{
+    memset( &Books, 0, sizeof(Books) );
+    Books.NextPriority = 1;
+    Produced = 0;
+    Denied = 0;
+
+    SimTestSetDword( "MaxRecords", TEST_QUOTA );
+    SimTestSetDword( "RecordQuotaFloor", TEST_QUOTA );
+    SimTestSetDword( "RecordQuotaCeiling", TEST_QUOTA );
+    SimTestSetDword( "PriorityRecords", PriorityRecords );
+    SimTestSetDword( "WriteCoalesceLimit", 1 );
+    SimTestSetDword( "ProcessRecordBudget", 0 );
+
+    if (!SimTestLoad()) {
+
+        return FALSE;
+    }
+
+    if (!SimTestConnect( Reader, 0, TestTakeRecord, &Books )) {
+
+        SimTestUnload( NULL );
+        return FALSE;
+    }
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    Flood = SimTestCreate( "\\protected\\flood.dat", FILE_GENERIC_WRITE, FILE_OVERWRITE_IF );
+
+    if (Flood == NULL) {
+
+        SimTestUnload( Reader );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static VOID
+TestStop (
+    __inout PSIM_TEST_READER Reader
+    )
+{
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    FanSimCloseFile( Flood );
+    Flood = NULL;
+
+    SimTestUnload( Reader );
+}
+
+
+static VOID
+TestWrite (
+    __in PFILE_OBJECT FileObject,
+    __in ULONG Writes
+    )
+{
+    static const UCHAR data[16];
+    ULONG made = 0;
+    ULONG i;
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+
+    for (i = 0; i < Writes; i++) {
+
+        if (FanSimWrite( FileObject, 0, data, sizeof(data), NULL ) == STATUS_SUCCESS) {
+
+            made += 1;
+        }
+    }
+
+    __atomic_add_fetch( &Produced, made, __ATOMIC_RELAXED );
+}
+
+
+static VOID
+TestDeny (
+    __in ULONG Denials
+    )
+/*++
+
+Routine Description:
+
+    Has the denied process try to overwrite a protected file, which the
+    policy refuses.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+    NTSTATUS status;
+    ULONG i;
+
+    FanSimSetProcess( SIM_TEST_DENIED );
+
+    for (i = 0; i < Denials; i++) {
+
+        status = FanSimCreateFile( "\\protected\\flood.dat",
+                                   FILE_GENERIC_WRITE,
+                                   FILE_OVERWRITE_IF,
+                                   0,
+                                   &fileObject,
+                                   NULL );
+        CHECK( status == STATUS_ACCESS_DENIED );
+
+        if (NT_SUCCESS( status )) {
+
+            FanSimCloseFile( fileObject );
+        }
+    }
+
+    __atomic_add_fetch( &Denied, Denials, __ATOMIC_RELAXED );
+}
+
+
+static ULONGLONG
+TestLostCreates (
+    VOID
+    )
+{
+    ULONGLONG lost = 0;
+    ULONG cpu;
+
+    for (cpu = 0; cpu < SPY_LOSS_CPUS; cpu++) {
+
+        lost += MiniSpyData.LossCounters[cpu].Major[IRP_MJ_CREATE];
+    }
+
+    return lost;
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestAhead (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A flood fills the quota three times over before anything is read;
+    denials logged after it still all arrive, in the first batch, ahead
+    of every audit record and numbered 1, 2, 3...
+
+--*/
+{
+    SIM_TEST_READER reader;
+
+    if (!TestStart( 64, &reader )) {
+
+        return;
+    }
+
+    TestWrite( Flood, 3 * TEST_QUOTA );
+    TestDeny( 16 );
+
+    CHECK( SimTestRead( &reader ) );
+    CHECK( Books.Denial.Delivered == 16 );
+
+    SimTestDrain( &reader );
+    TestWrite( Flood, 1 );
+    SimTestDrain( &reader );
+
+    CHECK( Books.Denial.Delivered == 16 );
+    CHECK( Books.PriorityOutOfOrder == 0 );
+    CHECK( Books.PriorityBehindAudit == 0 );
+    CHECK( reader.Lost >= 2 * TEST_QUOTA );
+    CHECK( Produced == Books.Audit.Delivered + reader.Lost );
+    CHECK( TestLostCreates() == 0 );
+
+    TestStop( &reader );
+}
+
+
+static VOID
+TestReserve (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    With a reserve of 8 and the quota full, 8 of 20 denials are logged
+    and the other 12 are lost, and said to be; once the 8 are read the
+    reserve takes 8 more.
+
+--*/
+{
+    SIM_TEST_READER reader;
+
+    if (!TestStart( 8, &reader )) {
+
+        return;
+    }
+
+    TestWrite( Flood, TEST_QUOTA );
+    TestDeny( 20 );
+
+    SimTestDrain( &reader );
+    CHECK( Books.Denial.Delivered == 8 );
+
+    TestWrite( Flood, TEST_QUOTA );
+    TestDeny( 8 );
+
+    SimTestDrain( &reader );
+    TestWrite( Flood, 1 );
+    SimTestDrain( &reader );
+
+    CHECK( Books.Denial.Delivered == 16 );
+    CHECK( Books.PriorityOutOfOrder == 0 );
+    CHECK( TestLostCreates() == 12 );
+    CHECK( Produced + Denied == Books.Audit.Delivered + Books.Denial.Delivered + reader.Lost );
+
+    TestStop( &reader );
+}
+
+
+static VOID
+TestNoReserve (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Without a reserve denials come out of the quota, but still travel
+    the priority lane.
+
+--*/
+{
+    SIM_TEST_READER reader;
+
+    if (!TestStart( 0, &reader )) {
+
+        return;
+    }
+
+    TestWrite( Flood, TEST_QUOTA / 2 );
+    TestDeny( 10 );
+
+    CHECK( SimTestRead( &reader ) );
+    SimTestDrain( &reader );
+
+    CHECK( Books.Denial.Delivered == 10 );
+    CHECK( Books.PriorityOutOfOrder == 0 );
+    CHECK( Books.PriorityBehindAudit == 0 );
+    CHECK( Books.Audit.Delivered == TEST_QUOTA / 2 );
+
+    TestStop( &reader );
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+typedef struct _TEST_RUN {
+
+    PSIM_TEST_READER Reader;
+    LONGLONG Until;
+    volatile BOOLEAN Stop;
+
+} TEST_RUN, *PTEST_RUN;
+
+
+static PVOID
+TestFlooder (
+    __in PVOID Parameter
+    )
+{
+    PTEST_RUN run = Parameter;
+    PFILE_OBJECT fileObject;
+    CHAR name[64];
+    static LONG next;
+
+    FanSimSetProcessor( (ULONG) __atomic_fetch_add( &next, 1, __ATOMIC_RELAXED ) % SPY_LOSS_CPUS );
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    snprintf( name, sizeof(name), "\\protected\\flood%p.dat", (PVOID) &fileObject );
+
+    fileObject = SimTestCreate( name, FILE_GENERIC_WRITE, FILE_OVERWRITE_IF );
+
+    if (fileObject == NULL) {
+
+        return NULL;
+    }
+
+    while (SimTestNow() < run->Until) {
+
+        TestWrite( fileObject, 64 );
+    }
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    FanSimCloseFile( fileObject );
+
+    return NULL;
+}
+
+
+static PVOID
+TestProber (
+    __in PVOID Parameter
+    )
+{
+    PTEST_RUN run = Parameter;
+
+    while (SimTestNow() < run->Until) {
+
+        TestDeny( 1 );
+        usleep( 1000 );
+    }
+
+    return NULL;
+}
+
+
+static PVOID
+TestConsumer (
+    __in PVOID Parameter
+    )
+{
+    PTEST_RUN run = Parameter;
+
+    while (!run->Stop) {
+
+        if (!SimTestRead( run->Reader )) {
+
+            usleep( 100 );
+        }
+    }
+
+    return NULL;
+}
+
+
+static VOID
+TestPrintLane (
+    __in ULONG Flooders,
+    __in PCSTR Name,
+    __in PTEST_LANE Lane,
+    __in ULONGLONG Made,
+    __in ULONGLONG Lost
+    )
+{
+    printf( "%8u %-7s %10llu %8.2f%% %9.1f %9.1f %10.1f\n",
+            Flooders,
+            Name,
+            (unsigned long long) Made,
+            Made != 0 ? 100.0 * Lost / Made : 0.0,
+            TestPercentile( Lane, 500 ),
+            TestPercentile( Lane, 990 ),
+            Lane->Longest / 10.0 );
+}
+
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+{
+    pthread_t flooders[TEST_FLOODERS];
+    pthread_t prober;
+    pthread_t consumer;
+    SIM_TEST_READER reader;
+    TEST_RUN run;
+    ULONGLONG lostCreates;
+    ULONG count;
+    ULONG i;
+
+    printf( "%8s %-7s %10s %9s %9s %9s %10s\n",
+            "flooders", "lane", "records", "lost", "p50 us", "p99 us", "max us" );
+
+    for (count = 0; count <= TEST_FLOODERS; count = count != 0 ? count * 2 : 1) {
+
+        if (!TestStart( 64, &reader )) {
+
+            return 1;
+        }
+
+        Books.Timed = TRUE;
+
+        memset( &run, 0, sizeof(run) );
+        run.Reader = &reader;
+        run.Until = SimTestNow() + (LONGLONG) Seconds * 1000000000;
+
+        pthread_create( &consumer, NULL, TestConsumer, &run );
+        pthread_create( &prober, NULL, TestProber, &run );
+
+        for (i = 0; i < count; i++) {
+
+            pthread_create( &flooders[i], NULL, TestFlooder, &run );
+        }
+
+        for (i = 0; i < count; i++) {
+
+            pthread_join( flooders[i], NULL );
+        }
+
+        pthread_join( prober, NULL );
+        run.Stop = TRUE;
+        pthread_join( consumer, NULL );
+
+        SimTestDrain( &reader );
+        TestWrite( Flood, 1 );
+        SimTestDrain( &reader );
+
+        lostCreates = TestLostCreates();
+
+        TestPrintLane( count, "denial", &Books.Denial, Denied, lostCreates );
+        TestPrintLane( count, "audit", &Books.Audit, Produced, reader.Lost - lostCreates );
+
+        CHECK( Books.PriorityOutOfOrder == 0 );
+        CHECK( Produced + Denied == Books.Audit.Delivered + Books.Denial.Delivered + reader.Lost );
+
+        TestStop( &reader );
+    }
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestAhead();
+    TestReserve();
+    TestNoReserve();
+
+    return SimTestFinish( "mspyPriorityTest" );
+}
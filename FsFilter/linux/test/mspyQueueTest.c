@@ -0,0 +1,663 @@
+/*++
+
+Module Name:
+
+    mspyQueueTest.c
+
+Abstract:
+
+    Tests the per-processor log queues, ../filter/mspyLib.c, through the
+    driver, and minispy's merge of them, ../user/mspyMerge.c: each
+    record is queued and numbered by the processor that logged it, modulo
+    LOG_QUEUES, every queue numbering from 1 without a hole; merged, the
+    records of many writers on many processors come out once each and in
+    time order; the merge holds a record back for the skew window it is
+    given and no longer, and never holds more than MERGE_MAX_PENDING.
+
+    With -b [seconds] it runs 1 to 64 writer threads, each on its own
+    processor, against a consumer thread reading and merging all the
+    while, and again with every writer on processor 0, as every record
+    once went through one queue and one counter.  It prints the writes a
+    second, in all and per writer, the records merged a second, the share
+    lost and the most records the merge held.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+#include "mspyMerge.h"
+
+#define TEST_QUOTA              4096
+#define TEST_WRITERS            64
+
+//
+//  What the consumer saw, and what came out of the merge.
+//
+
+typedef struct _TEST_BOOKS {
+
+    LOG_MERGE Merge;
+    BOOLEAN Merging;
+
+    ULONGLONG Delivered;
+    ULONGLONG PerQueue[LOG_QUEUES];
+    ULONG FirstSequence[LOG_QUEUES];
+
+    ULONGLONG Merged;
+    ULONGLONG OutOfOrder;
+    ULONG MostPending;
+    LONGLONG Previous;
+    ULONG PreviousSequence[LOG_QUEUES];
+
+} TEST_BOOKS, *PTEST_BOOKS;
+
+static TEST_BOOKS Books;
+
+static volatile ULONGLONG Produced;
+
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    PTEST_BOOKS books = Context;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_FLAG_PRIORITY ) ||
+        LogRecord->Processor >= LOG_QUEUES) {
+
+        return;
+    }
+
+    if (books->FirstSequence[LogRecord->Processor] == 0) {
+
+        books->FirstSequence[LogRecord->Processor] = LogRecord->SequenceNumber;
+    }
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP ) ||
+        LogRecord->Data.CallbackMajorId != IRP_MJ_WRITE) {
+
+        return;
+    }
+
+    books->Delivered += 1;
+    books->PerQueue[LogRecord->Processor] += 1;
+
+    if (books->Merging) {
+
+        CHECK( MergeInsert( &books->Merge, LogRecord ) );
+        books->MostPending = max( books->MostPending, books->Merge.Count );
+    }
+}
+
+
+static VOID
+TestRelease (
+    __inout PTEST_BOOKS Books,
+    __in BOOLEAN Flush
+    )
+/*++
+
+Routine Description:
+
+    Takes what is due out of the merge, counting records that come out
+    older than one before them, or behind a later one of their own
+    queue.
+
+--*/
+{
+    PLOG_RECORD logRecord;
+    ULONG queue;
+
+    while ((logRecord = MergeRemove( &Books->Merge, Flush )) != NULL) {
+
+        queue = logRecord->Processor;
+
+        if (logRecord->Data.OriginatingTime.QuadPart < Books->Previous ||
+            (Books->PreviousSequence[queue] != 0 &&
+             (LONG)(logRecord->SequenceNumber - Books->PreviousSequence[queue]) <= 0)) {
+
+            Books->OutOfOrder += 1;
+        }
+
+        Books->Previous = max( Books->Previous, logRecord->Data.OriginatingTime.QuadPart );
+        Books->PreviousSequence[queue] = logRecord->SequenceNumber;
+        Books->Merged += 1;
+
+        free( logRecord );
+    }
+}
+
+
+static BOOLEAN
+TestStart (
+    __in ULONG Quota,
+    __in BOOLEAN Merging,
+    __in ULONG Window,
+    __out PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver with a fixed quota, coalescing and sampling off so
+    each write is one record, and connects.
+
+--*/
+{
+    memset( &Books, 0, sizeof(Books) );
+    Books.Merging = Merging;
+    MergeInitialize( &Books.Merge, Window );
+    Produced = 0;
+
+    SimTestSetDword( "MaxRecords", Quota );
+    SimTestSetDword( "RecordQuotaFloor", Quota );
+    SimTestSetDword( "RecordQuotaCeiling", Quota );
+    SimTestSetDword( "WriteCoalesceLimit", 1 );
+    SimTestSetDword( "ProcessRecordBudget", 0 );
+
+    if (!SimTestLoad()) {
+
+        return FALSE;
+    }
+
+    if (!SimTestConnect( Reader, 0, TestTakeRecord, &Books )) {
+
+        SimTestUnload( NULL );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static VOID
+TestStop (
+    __inout PSIM_TEST_READER Reader
+    )
+{
+    TestRelease( &Books, TRUE );
+    MergeCleanup( &Books.Merge );
+
+    SimTestUnload( Reader );
+}
+
+
+static PFILE_OBJECT
+TestOpen (
+    __in ULONG Index
+    )
+{
+    CHAR name[64];
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    snprintf( name, sizeof(name), "\\protected\\queue%u.dat", Index );
+
+    return SimTestCreate( name, FILE_GENERIC_WRITE, FILE_OVERWRITE_IF );
+}
+
+
+static VOID
+TestWrite (
+    __in PFILE_OBJECT FileObject,
+    __in ULONG Writes
+    )
+{
+    static const UCHAR data[16];
+    ULONG made = 0;
+    ULONG i;
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+
+    for (i = 0; i < Writes; i++) {
+
+        if (FanSimWrite( FileObject, 0, data, sizeof(data), NULL ) == STATUS_SUCCESS) {
+
+            made += 1;
+        }
+    }
+
+    __atomic_add_fetch( &Produced, made, __ATOMIC_RELAXED );
+}
+
+
+static PLOG_RECORD
+TestRecord (
+    __out PLOG_RECORD LogRecord,
+    __in ULONG Queue,
+    __in ULONG Sequence,
+    __in LONGLONG Time
+    )
+{
+    memset( LogRecord, 0, sizeof(*LogRecord) );
+    LogRecord->Length = sizeof(*LogRecord);
+    LogRecord->RecordType = RECORD_TYPE_NORMAL;
+    LogRecord->Processor = Queue;
+    LogRecord->SequenceNumber = Sequence;
+    LogRecord->Data.OriginatingTime.QuadPart = Time;
+    LogRecord->Data.CallbackMajorId = IRP_MJ_WRITE;
+
+    return LogRecord;
+}
+
+
+//---------------------------------------------------------------------------
+//  Threads
+//---------------------------------------------------------------------------
+
+typedef struct _TEST_RUN {
+
+    PSIM_TEST_READER Reader;
+    ULONG Writes;
+    LONGLONG Until;
+    BOOLEAN OneQueue;
+    volatile BOOLEAN Stop;
+
+} TEST_RUN, *PTEST_RUN;
+
+typedef struct _TEST_WRITER {
+
+    pthread_t Thread;
+    PTEST_RUN Run;
+    ULONG Index;
+
+} TEST_WRITER, *PTEST_WRITER;
+
+
+static PVOID
+TestWriter (
+    __in PVOID Parameter
+    )
+{
+    PTEST_WRITER writer = Parameter;
+    PTEST_RUN run = writer->Run;
+    PFILE_OBJECT fileObject;
+
+    FanSimSetProcessor( run->OneQueue ? 0 : writer->Index );
+    fileObject = TestOpen( writer->Index );
+
+    if (fileObject == NULL) {
+
+        return NULL;
+    }
+
+    if (run->Until != 0) {
+
+        while (SimTestNow() < run->Until) {
+
+            TestWrite( fileObject, 64 );
+        }
+
+    } else {
+
+        TestWrite( fileObject, run->Writes );
+    }
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    FanSimCloseFile( fileObject );
+
+    return NULL;
+}
+
+
+static PVOID
+TestConsumer (
+    __in PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Reads as minispy's log thread does: what comes in goes into the
+    merge, and when the log is empty the merge is told the time so it
+    lets go of what is due.
+
+--*/
+{
+    PTEST_RUN run = Parameter;
+    LARGE_INTEGER now;
+
+    while (!run->Stop) {
+
+        if (!SimTestRead( run->Reader )) {
+
+            KeQuerySystemTime( &now );
+            MergeAdvance( &Books.Merge, now.QuadPart );
+            usleep( 100 );
+        }
+
+        TestRelease( &Books, FALSE );
+    }
+
+    return NULL;
+}
+
+
+static VOID
+TestRun (
+    __inout PTEST_RUN Run,
+    __in ULONG Writers
+    )
+{
+    TEST_WRITER writers[TEST_WRITERS];
+    pthread_t consumer;
+    ULONG i;
+
+    pthread_create( &consumer, NULL, TestConsumer, Run );
+
+    for (i = 0; i < Writers; i++) {
+
+        writers[i].Run = Run;
+        writers[i].Index = i;
+        pthread_create( &writers[i].Thread, NULL, TestWriter, &writers[i] );
+    }
+
+    for (i = 0; i < Writers; i++) {
+
+        pthread_join( writers[i].Thread, NULL );
+    }
+
+    Run->Stop = TRUE;
+    pthread_join( consumer, NULL );
+
+    SimTestDrain( Run->Reader );
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestQueues (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Processor p writes p + 1 times, for p past LOG_QUEUES so queues are
+    shared; each queue gets the writes of its processors and numbers
+    them from 1.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    PFILE_OBJECT fileObject;
+    ULONGLONG expected[LOG_QUEUES];
+    ULONG missing = 0;
+    ULONG p;
+    ULONG q;
+
+    if (!TestStart( TEST_QUOTA, FALSE, 0, &reader )) {
+
+        return;
+    }
+
+    memset( expected, 0, sizeof(expected) );
+
+    for (p = 0; p < LOG_QUEUES + 8; p++) {
+
+        FanSimSetProcessor( p );
+        fileObject = TestOpen( p );
+
+        if (fileObject != NULL) {
+
+            TestWrite( fileObject, p + 1 );
+            expected[p % LOG_QUEUES] += p + 1;
+
+            FanSimSetProcess( SIM_TEST_ALLOWED );
+            FanSimCloseFile( fileObject );
+        }
+
+        SimTestDrain( &reader );
+    }
+
+    FanSimSetProcessor( 0 );
+
+    for (q = 0; q < LOG_QUEUES; q++) {
+
+        CHECK( Books.PerQueue[q] == expected[q] );
+        CHECK( Books.FirstSequence[q] == 1 );
+        missing += reader.Sequence.Missing[q];
+    }
+
+    CHECK( missing == 0 );
+    CHECK( reader.Lost == 0 );
+    CHECK( Books.Delivered == Produced );
+
+    TestStop( &reader );
+}
+
+
+static VOID
+TestMerged (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Sixteen writers on sixteen processors against a consumer merging as
+    it reads.  The quota holds every write, however far the consumer
+    falls behind, and the window is wide enough for any skew the test can
+    make, so everything comes out once and in order.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    TEST_RUN run;
+    ULONG missing = 0;
+    ULONG used = 0;
+    ULONG q;
+
+    if (!TestStart( 16 * 2000, TRUE, 60 * 1000, &reader )) {
+
+        return;
+    }
+
+    memset( &run, 0, sizeof(run) );
+    run.Reader = &reader;
+    run.Writes = 2000;
+
+    TestRun( &run, 16 );
+    TestRelease( &Books, TRUE );
+
+    for (q = 0; q < LOG_QUEUES; q++) {
+
+        missing += reader.Sequence.Missing[q];
+        used += Books.PerQueue[q] != 0;
+    }
+
+    CHECK( Produced == 16 * 2000 );
+    CHECK( Produced == Books.Delivered );
+    CHECK( reader.Lost == 0 );
+    CHECK( Books.Merged == Books.Delivered );
+    CHECK( Books.OutOfOrder == 0 );
+    CHECK( missing == 0 );
+    CHECK( used == 16 );
+
+    TestStop( &reader );
+}
+
+
+static VOID
+TestWindow (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Queue 1's records arrive 40 ms after queue 0's of the same time.  A
+    50 ms window puts them back in order; a 10 ms window lets queue 0's
+    records go before queue 1's arrive, holding none back longer.  The
+    merge never holds more than MERGE_MAX_PENDING, and the sequence it
+    acknowledges stops short of what it still holds.
+
+--*/
+{
+    static const ULONG windows[] = { 50, 10 };
+    LOG_RECORD logRecord;
+    ULONG sequence[LOG_QUEUES];
+    LONGLONG base = 1000000000;
+    ULONG w;
+    ULONG i;
+
+    for (w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+
+        memset( &Books, 0, sizeof(Books) );
+        MergeInitialize( &Books.Merge, windows[w] );
+
+        //
+        //  One millisecond a record; each millisecond a record arrives
+        //  from each queue, queue 1's 40 ms older.
+        //
+
+        for (i = 0; i < 100; i++) {
+
+            MergeInsert( &Books.Merge, TestRecord( &logRecord, 0, i + 1, base + i * 10000 ) );
+            MergeInsert( &Books.Merge, TestRecord( &logRecord, 1, i + 1, base + ((LONGLONG) i - 40) * 10000 ) );
+            TestRelease( &Books, FALSE );
+        }
+
+        TestRelease( &Books, TRUE );
+
+        CHECK( Books.Merged == 200 );
+
+        if (windows[w] == 50) {
+
+            CHECK( Books.OutOfOrder == 0 );
+
+        } else {
+
+            CHECK( Books.OutOfOrder != 0 );
+        }
+
+        MergeCleanup( &Books.Merge );
+    }
+
+    //
+    //  A clock that never moves: the merge still lets go past
+    //  MERGE_MAX_PENDING records.
+    //
+
+    memset( &Books, 0, sizeof(Books) );
+    MergeInitialize( &Books.Merge, MERGE_DEFAULT_WINDOW );
+
+    for (i = 0; i < MERGE_MAX_PENDING + 10; i++) {
+
+        MergeInsert( &Books.Merge, TestRecord( &logRecord, i % 2, i / 2 + 1, base ) );
+    }
+
+    TestRelease( &Books, FALSE );
+
+    CHECK( Books.Merged == 10 );
+    CHECK( Books.Merge.Count == MERGE_MAX_PENDING );
+
+    for (i = 0; i < LOG_QUEUES; i++) {
+
+        sequence[i] = (MERGE_MAX_PENDING + 10) / 2;
+    }
+
+    MergeOldest( &Books.Merge, sequence );
+
+    CHECK( sequence[0] == 10 );
+    CHECK( sequence[1] == 0 );
+    CHECK( sequence[2] == (MERGE_MAX_PENDING + 10) / 2 );
+
+    TestRelease( &Books, TRUE );
+    MergeCleanup( &Books.Merge );
+
+    CHECK( Books.Merged == MERGE_MAX_PENDING + 10 );
+    CHECK( Books.OutOfOrder == 0 );
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+{
+    SIM_TEST_READER reader;
+    TEST_RUN run;
+    LONGLONG start;
+    double elapsed;
+    ULONG writers;
+    ULONG mode;
+
+    printf( "%-9s %7s %12s %12s %12s %7s %9s %7s\n",
+            "queues", "writers", "writes/s", "per writer", "merged/s", "lost", "pending", "late" );
+
+    for (mode = 0; mode < 2; mode++) {
+
+        for (writers = 1; writers <= TEST_WRITERS; writers *= 2) {
+
+            if (!TestStart( TEST_QUOTA, TRUE, MERGE_DEFAULT_WINDOW, &reader )) {
+
+                return 1;
+            }
+
+            memset( &run, 0, sizeof(run) );
+            run.Reader = &reader;
+            run.OneQueue = (BOOLEAN)(mode != 0);
+
+            start = SimTestNow();
+            run.Until = start + (LONGLONG) Seconds * 1000000000;
+
+            TestRun( &run, writers );
+            TestRelease( &Books, TRUE );
+
+            elapsed = (SimTestNow() - start) / 1e9;
+
+            printf( "%-9s %7u %12.0f %12.0f %12.0f %6.2f%% %9u %7llu\n",
+                    mode == 0 ? "per-cpu" : "one",
+                    writers,
+                    Produced / elapsed,
+                    Produced / elapsed / writers,
+                    Books.Merged / elapsed,
+                    Produced != 0 ? 100.0 * reader.Lost / Produced : 0.0,
+                    Books.MostPending,
+                    (unsigned long long) Books.OutOfOrder );
+
+            CHECK( Produced == Books.Delivered + reader.Lost );
+
+            TestStop( &reader );
+        }
+    }
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestQueues();
+    TestMerged();
+    TestWindow();
+
+    return SimTestFinish( "mspyQueueTest" );
+}
@@ -0,0 +1,570 @@
+/*++
+
+Module Name:
+
+    mspyQuotaTest.c
+
+Abstract:
+
+    Tests the record quota controller, ../filter/mspyQuota.c, through the
+    driver: SetMiniSpyRecordQuota is checked and honored, the quota grows
+    while records fill it, shrinks once the backlog goes stale, drops to
+    the floor under memory pressure and never leaves [floor, ceiling].
+    Through all of it every record produced is either delivered or
+    counted in a gap record.
+
+    With -b [seconds] it plays bursty producer and consumer traces, a
+    producer thread writing and a consumer thread reading each at the
+    rate the trace's current phase sets, against a fixed quota of 500,
+    the old static default, and against the controller.  It prints each
+    run's curve, a row every SPY_QUOTA_INTERVAL, of the quota, the
+    records held, the pool in use and the records lost so far, and then
+    a row per run with the totals.  Seconds stretches the traces.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+
+#define TEST_FLOOR              100
+#define TEST_CEILING            8192
+#define TEST_TICK               250
+
+static PFILE_OBJECT Handle;
+
+static volatile ULONGLONG Produced;
+static volatile ULONGLONG Delivered;
+
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    UNREFERENCED_PARAMETER( Context );
+
+    if (!FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP | RECORD_TYPE_FLAG_PRIORITY ) &&
+        LogRecord->Data.CallbackMajorId == IRP_MJ_WRITE) {
+
+        Delivered += 1;
+    }
+}
+
+
+static BOOLEAN
+TestStart (
+    __in ULONG Floor,
+    __in ULONG Ceiling,
+    __in ULONG Quota,
+    __out PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver with the given quota and bounds, coalescing and
+    sampling off so each write is one record, connects and opens the
+    file the producer writes.
+
+--*/
+{
+    Produced = 0;
+    Delivered = 0;
+
+    SimTestSetDword( "MaxRecords", Quota );
+    SimTestSetDword( "RecordQuotaFloor", Floor );
+    SimTestSetDword( "RecordQuotaCeiling", Ceiling );
+    SimTestSetDword( "WriteCoalesceLimit", 1 );
+    SimTestSetDword( "ProcessRecordBudget", 0 );
+
+    if (!SimTestLoad()) {
+
+        return FALSE;
+    }
+
+    if (!SimTestConnect( Reader, 0, TestTakeRecord, NULL )) {
+
+        SimTestUnload( NULL );
+        return FALSE;
+    }
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    Handle = SimTestCreate( "\\protected\\quota.dat", FILE_GENERIC_WRITE, FILE_OVERWRITE_IF );
+
+    if (Handle == NULL) {
+
+        SimTestUnload( Reader );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static VOID
+TestStop (
+    __inout PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Reads what is left and checks that every record produced was either
+    delivered or lost in a gap, then unloads.
+
+--*/
+{
+    FanSimSetLowMemory( FALSE );
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    FanSimCloseFile( Handle );
+    Handle = NULL;
+
+    SimTestDrain( Reader );
+
+    CHECK( Produced == Delivered + Reader->Lost );
+
+    SimTestUnload( Reader );
+}
+
+
+static VOID
+TestProduce (
+    __in ULONG Writes
+    )
+{
+    static const UCHAR data[16];
+    ULONG i;
+
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+
+    for (i = 0; i < Writes; i++) {
+
+        CHECK( FanSimWrite( Handle, 0, data, sizeof(data), NULL ) == STATUS_SUCCESS );
+    }
+
+    Produced += Writes;
+}
+
+
+static LONG
+TestSetQuota (
+    __inout PSIM_TEST_READER Reader,
+    __in LONG Floor,
+    __in LONG Ceiling
+    )
+/*++
+
+Routine Description:
+
+    Sends SetMiniSpyRecordQuota as minispy's /q does.
+
+Return Value:
+
+    The reply's Reserved: 0 if the bounds were taken, -1 if not.
+
+--*/
+{
+    UCHAR message[FIELD_OFFSET(COMMAND_MESSAGE, Data) + sizeof(RECORD_QUOTA)];
+    PCOMMAND_MESSAGE command = (PCOMMAND_MESSAGE) message;
+    PRECORD_QUOTA quota = (PRECORD_QUOTA) command->Data;
+    PVOID reply[256 / sizeof(PVOID)];
+    ULONG returned = 0;
+
+    memset( message, 0, sizeof(message) );
+    command->Command = SetMiniSpyRecordQuota;
+    quota->Floor = Floor;
+    quota->Ceiling = Ceiling;
+
+    FanSimSetProcess( SIM_TEST_CONSUMER );
+
+    CHECK( FanSimSendMessage( Reader->Port,
+                              command,
+                              sizeof(message),
+                              reply,
+                              sizeof(reply),
+                              &returned ) == STATUS_SUCCESS );
+
+    return (LONG) ((PLOG_RECORD) reply)->Reserved;
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestCommand (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Bad bounds are refused and leave the quota alone.  Equal bounds fix
+    the quota, which then holds with the controller stopped, and a
+    producer that outruns it loses exactly what did not fit.
+
+--*/
+{
+    SIM_TEST_READER reader;
+
+    if (!TestStart( TEST_FLOOR, TEST_CEILING, 500, &reader )) {
+
+        return;
+    }
+
+    CHECK( TestSetQuota( &reader, 0, 10 ) == -1 );
+    CHECK( TestSetQuota( &reader, 50, 40 ) == -1 );
+    CHECK( MiniSpyData.QuotaFloor == TEST_FLOOR );
+    CHECK( MiniSpyData.QuotaCeiling == TEST_CEILING );
+
+    CHECK( TestSetQuota( &reader, 300, 300 ) == 0 );
+    CHECK( MiniSpyData.MaxRecordsToAllocate == 300 );
+
+    TestProduce( 1000 );
+    CHECK( MiniSpyData.RecordsAllocated == 300 );
+
+    usleep( 3 * TEST_TICK * 1000 );
+    CHECK( MiniSpyData.MaxRecordsToAllocate == 300 );
+
+    SimTestDrain( &reader );
+    CHECK( Delivered == 300 );
+    CHECK( reader.Lost == 700 );
+
+    CHECK( TestSetQuota( &reader, TEST_FLOOR, 4000 ) == 0 );
+    CHECK( MiniSpyData.QuotaCeiling == 4000 );
+
+    TestStop( &reader );
+}
+
+
+static VOID
+TestControl (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    With nobody reading, records pile up to the quota and the controller
+    grows it a quarter a tick, up to the ceiling.  Once the oldest record
+    is more than two seconds old it gives up and shrinks it.  Memory
+    pressure drops it to the floor at the next tick.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    LONG quota;
+    LONG peak = 0;
+    BOOLEAN bounded = TRUE;
+    LONGLONG start;
+    ULONG i;
+
+    if (!TestStart( TEST_FLOOR, 4000, 500, &reader )) {
+
+        return;
+    }
+
+    //
+    //  Keep the quota full for a second.
+    //
+
+    start = SimTestNow();
+
+    do {
+
+        TestProduce( 500 );
+        usleep( 10000 );
+
+        quota = MiniSpyData.MaxRecordsToAllocate;
+        bounded = bounded && quota >= TEST_FLOOR && quota <= 4000;
+        peak = max( peak, quota );
+
+    } while (SimTestNow() - start < 1100 * 1000000LL);
+
+    CHECK( peak >= 500 * 5 / 4 * 5 / 4 * 5 / 4 );
+
+    //
+    //  Then let the backlog go stale.
+    //
+
+    for (i = 0; i < 12 && MiniSpyData.MaxRecordsToAllocate >= peak; i++) {
+
+        usleep( TEST_TICK * 1000 );
+
+        quota = MiniSpyData.MaxRecordsToAllocate;
+        bounded = bounded && quota >= TEST_FLOOR && quota <= 4000;
+    }
+
+    CHECK( MiniSpyData.MaxRecordsToAllocate < peak );
+
+    FanSimSetLowMemory( TRUE );
+    usleep( 2 * TEST_TICK * 1000 );
+    CHECK( MiniSpyData.MaxRecordsToAllocate == TEST_FLOOR );
+
+    CHECK( bounded );
+
+    TestStop( &reader );
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+//
+//  A trace is a run of phases, each with the rates, in records a second,
+//  the producer writes and the consumer reads at.
+//
+
+#define TEST_PHASES             6
+
+typedef struct _TEST_PHASE {
+
+    ULONG Milliseconds;
+    ULONG Produce;
+    ULONG Consume;
+
+} TEST_PHASE;
+
+typedef struct _TEST_TRACE {
+
+    PCSTR Name;
+    TEST_PHASE Phases[TEST_PHASES];
+
+} TEST_TRACE, *PTEST_TRACE;
+
+static const TEST_TRACE Traces[] = {
+
+    { "bursty",  { { 1000, 2000, 20000 }, { 250, 60000, 20000 },
+                   { 1000, 2000, 20000 }, { 250, 60000, 20000 },
+                   { 1000, 2000, 20000 } } },
+
+    { "slow",    { { 2000, 10000, 4000 }, { 2000, 0, 4000 } } },
+
+    { "stall",   { { 1000, 5000, 20000 }, { 3000, 5000, 0 },
+                   { 2000, 5000, 20000 } } },
+};
+
+typedef struct _TEST_RUN {
+
+    const TEST_TRACE *Trace;
+    ULONG Stretch;
+    LONGLONG Start;
+    PSIM_TEST_READER Reader;
+
+} TEST_RUN, *PTEST_RUN;
+
+
+static const TEST_PHASE *
+TestPhase (
+    __in PTEST_RUN Run,
+    __in LONGLONG Now
+    )
+/*++
+
+Routine Description:
+
+    The phase of the trace at Now, or NULL once it is over.
+
+--*/
+{
+    LONGLONG elapsed = (Now - Run->Start) / 1000000;
+    ULONG i;
+
+    for (i = 0; i < TEST_PHASES && Run->Trace->Phases[i].Milliseconds != 0; i++) {
+
+        elapsed -= (LONGLONG) Run->Trace->Phases[i].Milliseconds * Run->Stretch;
+
+        if (elapsed < 0) {
+
+            return &Run->Trace->Phases[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static PVOID
+TestProducer (
+    __in PVOID Parameter
+    )
+{
+    PTEST_RUN run = Parameter;
+    const TEST_PHASE *phase;
+    LONGLONG last = run->Start;
+    LONGLONG now;
+    double allowance = 0;
+
+    while ((phase = TestPhase( run, now = SimTestNow() )) != NULL) {
+
+        allowance = min( allowance + phase->Produce * (now - last) / 1e9, phase->Produce / 100.0 + 1 );
+        last = now;
+
+        if (allowance >= 1) {
+
+            TestProduce( (ULONG) allowance );
+            allowance -= (ULONG) allowance;
+
+        } else {
+
+            usleep( 1000 );
+        }
+    }
+
+    return NULL;
+}
+
+
+static PVOID
+TestConsumer (
+    __in PVOID Parameter
+    )
+{
+    PTEST_RUN run = Parameter;
+    const TEST_PHASE *phase;
+    LONGLONG last = run->Start;
+    LONGLONG now;
+    double allowance = 0;
+    ULONGLONG before;
+
+    while ((phase = TestPhase( run, now = SimTestNow() )) != NULL) {
+
+        allowance = min( allowance + phase->Consume * (now - last) / 1e9, phase->Consume / 100.0 + 1 );
+        last = now;
+
+        before = run->Reader->Records;
+
+        if (allowance < 1 || !SimTestRead( run->Reader )) {
+
+            usleep( 1000 );
+        }
+
+        allowance -= run->Reader->Records - before;
+    }
+
+    return NULL;
+}
+
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+{
+    static const struct {
+        PCSTR Name;
+        ULONG Floor;
+        ULONG Ceiling;
+    } policies[] = {
+        { "fixed", 500, 500 },
+        { "adaptive", TEST_FLOOR, TEST_CEILING },
+    };
+    FAN_SIM_POOL_STATISTICS pool;
+    SIM_TEST_READER reader;
+    TEST_RUN run;
+    pthread_t producer;
+    pthread_t consumer;
+    ULONGLONG produced;
+    ULONGLONG delivered;
+    double poolSum;
+    SIZE_T poolPeak;
+    ULONG samples;
+    ULONG trace;
+    ULONG policy;
+
+    for (trace = 0; trace < sizeof(Traces) / sizeof(Traces[0]); trace++) {
+
+        for (policy = 0; policy < sizeof(policies) / sizeof(policies[0]); policy++) {
+
+            if (!TestStart( policies[policy].Floor, policies[policy].Ceiling, 500, &reader )) {
+
+                return 1;
+            }
+
+            printf( "%s, %s quota\n", Traces[trace].Name, policies[policy].Name );
+            printf( "%8s %10s %10s %8s %8s %10s %10s\n",
+                    "ms", "produced/s", "consumed/s", "quota", "held", "pool KB", "lost" );
+
+            run.Trace = &Traces[trace];
+            run.Stretch = max( Seconds, 1 );
+            run.Reader = &reader;
+            run.Start = SimTestNow();
+
+            pthread_create( &producer, NULL, TestProducer, &run );
+            pthread_create( &consumer, NULL, TestConsumer, &run );
+
+            produced = 0;
+            delivered = 0;
+            poolSum = 0;
+            poolPeak = 0;
+            samples = 0;
+
+            while (TestPhase( &run, SimTestNow() ) != NULL) {
+
+                usleep( TEST_TICK * 1000 );
+                FanSimPoolStatistics( &pool );
+
+                printf( "%8lld %10.0f %10.0f %8d %8d %10.0f %10llu\n",
+                        (long long) ((SimTestNow() - run.Start) / 1000000),
+                        (Produced - produced) * 1000.0 / TEST_TICK,
+                        (Delivered - delivered) * 1000.0 / TEST_TICK,
+                        (int) MiniSpyData.MaxRecordsToAllocate,
+                        (int) MiniSpyData.RecordsAllocated,
+                        pool.BytesInUse / 1024.0,
+                        (unsigned long long) reader.Lost );
+
+                produced = Produced;
+                delivered = Delivered;
+                poolSum += pool.BytesInUse;
+                poolPeak = max( poolPeak, pool.BytesInUse );
+                samples += 1;
+            }
+
+            pthread_join( producer, NULL );
+            pthread_join( consumer, NULL );
+
+            TestStop( &reader );
+
+            printf( "%s, %s quota: %llu produced, %.2f%% lost, pool %.0f KB mean, %.0f KB peak\n\n",
+                    Traces[trace].Name,
+                    policies[policy].Name,
+                    (unsigned long long) Produced,
+                    Produced != 0 ? 100.0 * reader.Lost / Produced : 0.0,
+                    samples != 0 ? poolSum / samples / 1024 : 0.0,
+                    poolPeak / 1024.0 );
+        }
+    }
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestCommand();
+    TestControl();
+
+    return SimTestFinish( "mspyQuotaTest" );
+}
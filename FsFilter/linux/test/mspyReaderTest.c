@@ -0,0 +1,779 @@
+/*++
+
+Module Name:
+
+    mspyReaderTest.c
+
+Abstract:
+
+    Tests the readers of the log, ../filter/mspyReader.c, through the
+    driver: every connected reader is sent every record once, numbered in
+    sequences of its own with no hole a gap record does not account for;
+    a record is freed once the last reader has it; when the quota runs out
+    the reader furthest behind gives up its own oldest records, and only
+    that reader loses them, while a lone reader loses the new record
+    instead; and with writers, fast readers and slow ones all running at
+    once, each reader's records and losses add up to what was written, on
+    every queue.
+
+    With -b [seconds] it runs eight writers flat out against one to four
+    readers that keep up as best they can, then the writers paced against
+    the same, then paced against one reader that keeps up and one to
+    three that stall.  It prints the writes a second, the records the
+    readers that keep up were sent a second and the share each kind of
+    reader lost.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+
+#define TEST_QUOTA              4096
+#define TEST_WRITERS            8
+
+//
+//  What one reader was sent: the writes and the numbers lost on each
+//  queue, the losses by reason, and what broke its sequences.  Next is
+//  the number the reader's next record on the queue should carry.
+//
+
+typedef struct _TEST_VIEW {
+
+    ULONGLONG Delivered[LOG_QUEUES];
+    ULONGLONG Lost[LOG_QUEUES];
+    ULONGLONG Reason[LOSS_REASONS];
+
+    ULONG Next[LOG_QUEUES];
+    ULONG Holes;
+    ULONG Repeats;
+
+} TEST_VIEW, *PTEST_VIEW;
+
+typedef struct _TEST_SUBSCRIBER {
+
+    SIM_TEST_READER Reader;
+    TEST_VIEW View;
+
+    //
+    //  How long the reader's thread sleeps between reads, in
+    //  microseconds, 0 for one that keeps up.
+    //
+
+    ULONG Pause;
+    pthread_t Thread;
+
+} TEST_SUBSCRIBER, *PTEST_SUBSCRIBER;
+
+static ULONGLONG Produced[LOG_QUEUES];
+
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    PTEST_VIEW view = Context;
+    ULONG queue = LogRecord->Processor;
+    PRECORD_GAP gap;
+    ULONG first = LogRecord->SequenceNumber;
+    ULONG i;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_FLAG_PRIORITY ) || queue >= LOG_QUEUES) {
+
+        return;
+    }
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP )) {
+
+        gap = (PRECORD_GAP) LogRecord->Name;
+        first = gap->FirstSequence;
+
+        view->Lost[queue] += gap->Count;
+
+        for (i = 0; i < LOSS_REASONS; i++) {
+
+            view->Reason[i] += gap->Reason[i];
+        }
+
+        if (LogRecord->SequenceNumber != gap->LastSequence + 1 ||
+            gap->LastSequence - gap->FirstSequence + 1 != gap->Count) {
+
+            view->Holes += 1;
+        }
+
+    } else if (LogRecord->Data.CallbackMajorId == IRP_MJ_WRITE) {
+
+        view->Delivered[queue] += 1;
+    }
+
+    if (view->Next[queue] == 0) {
+
+        view->Next[queue] = 1;
+    }
+
+    if ((LONG)(first - view->Next[queue]) < 0) {
+
+        view->Repeats += 1;
+
+    } else if (first != view->Next[queue]) {
+
+        view->Holes += 1;
+    }
+
+    view->Next[queue] = LogRecord->SequenceNumber + 1;
+}
+
+
+static BOOLEAN
+TestStart (
+    __in ULONG Quota,
+    __inout_ecount(Count) PTEST_SUBSCRIBER Subscribers,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver with a fixed quota, coalescing and sampling off so
+    each write is one record, and connects Count readers.
+
+--*/
+{
+    ULONG i;
+
+    memset( Produced, 0, sizeof(Produced) );
+
+    SimTestSetDword( "MaxRecords", Quota );
+    SimTestSetDword( "RecordQuotaFloor", Quota );
+    SimTestSetDword( "RecordQuotaCeiling", Quota );
+    SimTestSetDword( "WriteCoalesceLimit", 1 );
+    SimTestSetDword( "ProcessRecordBudget", 0 );
+
+    if (!SimTestLoad()) {
+
+        return FALSE;
+    }
+
+    for (i = 0; i < Count; i++) {
+
+        memset( &Subscribers[i].View, 0, sizeof(Subscribers[i].View) );
+
+        if (!SimTestConnect( &Subscribers[i].Reader, 0, TestTakeRecord, &Subscribers[i].View )) {
+
+            while (i-- > 0) {
+
+                SimTestDisconnect( &Subscribers[i].Reader );
+            }
+
+            SimTestUnload( NULL );
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+static VOID
+TestStop (
+    __inout_ecount(Count) PTEST_SUBSCRIBER Subscribers,
+    __in ULONG Count
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+
+        SimTestDisconnect( &Subscribers[i].Reader );
+    }
+
+    SimTestUnload( NULL );
+}
+
+
+static VOID
+TestWrite (
+    __in ULONG Processor,
+    __in ULONG Writes
+    )
+/*++
+
+Routine Description:
+
+    Writes Writes times to a file of the processor's own, from that
+    processor, so each lands on the processor's queue.
+
+--*/
+{
+    static const UCHAR data[16];
+    PFILE_OBJECT fileObject;
+    CHAR name[64];
+    ULONGLONG made = 0;
+    ULONG i;
+
+    FanSimSetProcessor( Processor );
+    FanSimSetProcess( SIM_TEST_ALLOWED );
+    snprintf( name, sizeof(name), "\\protected\\reader%u.dat", Processor );
+
+    fileObject = SimTestCreate( name, FILE_GENERIC_WRITE, FILE_OVERWRITE_IF );
+
+    if (fileObject == NULL) {
+
+        return;
+    }
+
+    for (i = 0; i < Writes; i++) {
+
+        if (FanSimWrite( fileObject, 0, data, sizeof(data), NULL ) == STATUS_SUCCESS) {
+
+            made += 1;
+        }
+    }
+
+    FanSimCloseFile( fileObject );
+
+    __atomic_add_fetch( &Produced[Processor % LOG_QUEUES], made, __ATOMIC_RELAXED );
+}
+
+
+static ULONGLONG
+TestTotal (
+    __in_ecount(LOG_QUEUES) const ULONGLONG *Counts
+    )
+{
+    ULONGLONG total = 0;
+    ULONG i;
+
+    for (i = 0; i < LOG_QUEUES; i++) {
+
+        total += Counts[i];
+    }
+
+    return total;
+}
+
+
+static VOID
+TestBalance (
+    __in PTEST_SUBSCRIBER Subscriber
+    )
+/*++
+
+Routine Description:
+
+    Checks a drained reader's books: on every queue the writes it was sent
+    and the numbers it lost add up to the writes made, and its sequences
+    have neither holes nor repeats.
+
+--*/
+{
+    PTEST_VIEW view = &Subscriber->View;
+    ULONG mismatched = 0;
+    ULONG i;
+
+    for (i = 0; i < LOG_QUEUES; i++) {
+
+        if (view->Delivered[i] + view->Lost[i] != Produced[i]) {
+
+            mismatched += 1;
+        }
+    }
+
+    CHECK( mismatched == 0 );
+    CHECK( view->Holes == 0 );
+    CHECK( view->Repeats == 0 );
+    CHECK( Subscriber->Reader.Lost == TestTotal( view->Lost ) );
+}
+
+
+static BOOLEAN
+TestQueued (
+    VOID
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < LOG_QUEUES; i++) {
+
+        if (!IsListEmpty( &MiniSpyData.LogQueues[i].List )) {
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+//---------------------------------------------------------------------------
+//  Threads
+//---------------------------------------------------------------------------
+
+//
+//  A run's writers make Writes writes each, or write until Until.  Burst,
+//  if not 0, is how many they make a millisecond, so that readers which
+//  keep up can.
+//
+
+typedef struct _TEST_RUN {
+
+    ULONG Writes;
+    ULONG Burst;
+    LONGLONG Until;
+    volatile BOOLEAN Stop;
+
+} TEST_RUN, *PTEST_RUN;
+
+typedef struct _TEST_WRITER {
+
+    pthread_t Thread;
+    PTEST_RUN Run;
+    ULONG Processor;
+
+} TEST_WRITER, *PTEST_WRITER;
+
+typedef struct _TEST_READING {
+
+    PTEST_RUN Run;
+    PTEST_SUBSCRIBER Subscriber;
+
+} TEST_READING, *PTEST_READING;
+
+
+static PVOID
+TestWriter (
+    __in PVOID Parameter
+    )
+{
+    PTEST_WRITER writer = Parameter;
+    PTEST_RUN run = writer->Run;
+    ULONG burst = run->Burst != 0 ? run->Burst : 256;
+    ULONG made = 0;
+
+    while (run->Until != 0 ? SimTestNow() < run->Until : made < run->Writes) {
+
+        if (run->Until == 0) {
+
+            burst = min( burst, run->Writes - made );
+        }
+
+        TestWrite( writer->Processor, burst );
+        made += burst;
+
+        if (run->Burst != 0) {
+
+            usleep( 1000 );
+        }
+    }
+
+    return NULL;
+}
+
+
+static PVOID
+TestConsumer (
+    __in PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Reads for one reader until told to stop: all the while if it keeps
+    up, else one batch each time it wakes.
+
+--*/
+{
+    PTEST_READING reading = Parameter;
+    PTEST_SUBSCRIBER subscriber = reading->Subscriber;
+
+    while (!reading->Run->Stop) {
+
+        if (subscriber->Pause != 0) {
+
+            usleep( subscriber->Pause );
+            SimTestRead( &subscriber->Reader );
+
+        } else if (!SimTestRead( &subscriber->Reader )) {
+
+            usleep( 100 );
+        }
+    }
+
+    return NULL;
+}
+
+
+static VOID
+TestRun (
+    __inout PTEST_RUN Run,
+    __in ULONG Writers,
+    __inout_ecount(Count) PTEST_SUBSCRIBER Subscribers,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Runs Writers writers, each on its own processor, against a thread
+    for each reader, then drains every reader.
+
+--*/
+{
+    TEST_WRITER writers[TEST_WRITERS];
+    TEST_READING readings[SPY_MAX_READERS];
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+
+        readings[i].Run = Run;
+        readings[i].Subscriber = &Subscribers[i];
+        pthread_create( &Subscribers[i].Thread, NULL, TestConsumer, &readings[i] );
+    }
+
+    for (i = 0; i < Writers; i++) {
+
+        writers[i].Run = Run;
+        writers[i].Processor = i;
+        pthread_create( &writers[i].Thread, NULL, TestWriter, &writers[i] );
+    }
+
+    for (i = 0; i < Writers; i++) {
+
+        pthread_join( writers[i].Thread, NULL );
+    }
+
+    Run->Stop = TRUE;
+
+    for (i = 0; i < Count; i++) {
+
+        pthread_join( Subscribers[i].Thread, NULL );
+        SimTestDrain( &Subscribers[i].Reader );
+    }
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestShared (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Three readers, four processors.  Every reader is sent every write,
+    numbered from 1 on each queue, and the records stay queued until the
+    last reader has been sent them.
+
+--*/
+{
+    TEST_SUBSCRIBER subscribers[3];
+    ULONG i;
+
+    memset( subscribers, 0, sizeof(subscribers) );
+
+    if (!TestStart( 8192, subscribers, 3 )) {
+
+        return;
+    }
+
+    for (i = 0; i < 4; i++) {
+
+        TestWrite( i, 500 );
+    }
+
+    CHECK( TestTotal( Produced ) == 2000 );
+
+    for (i = 0; i < 3; i++) {
+
+        CHECK( TestQueued() );
+
+        SimTestDrain( &subscribers[i].Reader );
+
+        CHECK( TestTotal( subscribers[i].View.Delivered ) == 2000 );
+        CHECK( subscribers[i].View.Next[0] == 501 );
+        CHECK( subscribers[i].View.Next[3] == 501 );
+        CHECK( subscribers[i].Reader.Lost == 0 );
+        TestBalance( &subscribers[i] );
+    }
+
+    CHECK( !TestQueued() );
+    CHECK( MiniSpyData.RecordsAllocated == 0 );
+
+    TestStop( subscribers, 3 );
+}
+
+
+static VOID
+TestLagging (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    One reader keeps up and one reads nothing until the end, ten times
+    the quota later.  The one that kept up was sent every write; the
+    other lost what it could not hold, to LOSS_LAGGING alone, and was
+    sent the rest.
+
+--*/
+{
+    TEST_SUBSCRIBER subscribers[2];
+    PTEST_VIEW fast = &subscribers[0].View;
+    PTEST_VIEW slow = &subscribers[1].View;
+    ULONG i;
+
+    memset( subscribers, 0, sizeof(subscribers) );
+
+    if (!TestStart( 1024, subscribers, 2 )) {
+
+        return;
+    }
+
+    for (i = 0; i < 40; i++) {
+
+        TestWrite( 0, 256 );
+        SimTestDrain( &subscribers[0].Reader );
+    }
+
+    SimTestDrain( &subscribers[1].Reader );
+
+    CHECK( Produced[0] == 40 * 256 );
+
+    CHECK( fast->Delivered[0] == Produced[0] );
+    CHECK( TestTotal( fast->Lost ) == 0 );
+
+    CHECK( slow->Lost[0] >= Produced[0] - 1024 );
+    CHECK( slow->Reason[LOSS_LAGGING] == slow->Lost[0] );
+    CHECK( slow->Delivered[0] != 0 );
+
+    for (i = 0; i < 2; i++) {
+
+        TestBalance( &subscribers[i] );
+    }
+
+    TestStop( subscribers, 2 );
+}
+
+
+static VOID
+TestAlone (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A lone reader that falls behind is not made to give anything up: the
+    new records are lost instead, over quota, and it is sent the oldest.
+
+--*/
+{
+    TEST_SUBSCRIBER subscriber;
+
+    memset( &subscriber, 0, sizeof(subscriber) );
+
+    if (!TestStart( 1024, &subscriber, 1 )) {
+
+        return;
+    }
+
+    TestWrite( 0, 4096 );
+    SimTestDrain( &subscriber.Reader );
+
+    CHECK( subscriber.View.Delivered[0] != 0 );
+    CHECK( subscriber.View.Delivered[0] <= 1024 );
+    CHECK( subscriber.View.Reason[LOSS_OVER_QUOTA] == subscriber.View.Lost[0] );
+    CHECK( subscriber.View.Reason[LOSS_LAGGING] == 0 );
+    TestBalance( &subscriber );
+
+    TestStop( &subscriber, 1 );
+}
+
+
+static VOID
+TestMixed (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Eight writers, paced so a reader can keep up, against two readers
+    that do, one that reads every couple of milliseconds and one that
+    reads every fifty, falling a quota behind in between.  Every reader's
+    books balance on every queue; the one that stalls lags, and the
+    readers that keep up lose nothing to it.  They can still lose a
+    record over quota, when room is made from records they have yet to
+    read, if the machine is too busy for them to keep up.
+
+--*/
+{
+    TEST_SUBSCRIBER subscribers[SPY_MAX_READERS];
+    TEST_RUN run;
+    ULONGLONG produced;
+    ULONG i;
+
+    memset( subscribers, 0, sizeof(subscribers) );
+
+    subscribers[2].Pause = 2000;
+    subscribers[3].Pause = 50000;
+
+    if (!TestStart( TEST_QUOTA, subscribers, SPY_MAX_READERS )) {
+
+        return;
+    }
+
+    memset( &run, 0, sizeof(run) );
+    run.Writes = 4000;
+    run.Burst = 16;
+
+    TestRun( &run, TEST_WRITERS, subscribers, SPY_MAX_READERS );
+
+    produced = TestTotal( Produced );
+
+    CHECK( produced == TEST_WRITERS * 4000 );
+
+    for (i = 0; i < SPY_MAX_READERS; i++) {
+
+        TestBalance( &subscribers[i] );
+    }
+
+    CHECK( subscribers[3].View.Reason[LOSS_LAGGING] != 0 );
+
+    for (i = 0; i < 2; i++) {
+
+        CHECK( subscribers[i].View.Reason[LOSS_LAGGING] == 0 );
+        CHECK( TestTotal( subscribers[i].View.Lost ) < TestTotal( subscribers[3].View.Lost ) );
+    }
+
+    TestStop( subscribers, SPY_MAX_READERS );
+
+    CHECK( MiniSpyData.RecordsAllocated == 0 );
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+{
+    TEST_SUBSCRIBER subscribers[SPY_MAX_READERS];
+    TEST_RUN run;
+    LONGLONG start;
+    ULONGLONG produced;
+    ULONGLONG fast;
+    ULONGLONG fastLost;
+    ULONGLONG slowLost;
+    double elapsed;
+    ULONG readers;
+    ULONG slow;
+    ULONG mode;
+    ULONG i;
+
+    printf( "%-7s %8s %5s %12s %12s %9s %9s\n",
+            "writers", "readers", "slow", "writes/s", "sent/s", "fast lost", "slow lost" );
+
+    //
+    //  Flat out, readers that keep up as best they can; then paced, the
+    //  same; then paced, one that keeps up and the rest stalling.
+    //
+
+    for (mode = 0; mode < 3; mode++) {
+
+        for (readers = mode == 2 ? 2 : 1; readers <= SPY_MAX_READERS; readers++) {
+
+            memset( subscribers, 0, sizeof(subscribers) );
+            slow = mode == 2 ? readers - 1 : 0;
+
+            for (i = 1; i <= slow; i++) {
+
+                subscribers[i].Pause = 50000;
+            }
+
+            if (!TestStart( TEST_QUOTA, subscribers, readers )) {
+
+                return 1;
+            }
+
+            memset( &run, 0, sizeof(run) );
+            run.Burst = mode != 0 ? 16 : 0;
+            start = SimTestNow();
+            run.Until = start + (LONGLONG) Seconds * 1000000000;
+
+            TestRun( &run, TEST_WRITERS, subscribers, readers );
+
+            elapsed = (SimTestNow() - start) / 1e9;
+            produced = TestTotal( Produced );
+            fast = 0;
+            fastLost = 0;
+            slowLost = 0;
+
+            for (i = 0; i < readers; i++) {
+
+                TestBalance( &subscribers[i] );
+
+                if (subscribers[i].Pause == 0) {
+
+                    fast += TestTotal( subscribers[i].View.Delivered );
+                    fastLost += TestTotal( subscribers[i].View.Lost );
+
+                } else {
+
+                    slowLost += TestTotal( subscribers[i].View.Lost );
+                }
+            }
+
+            printf( "%-7s %8u %5u %12.0f %12.0f %8.2f%% %8.2f%%\n",
+                    mode != 0 ? "paced" : "flat",
+                    readers,
+                    slow,
+                    produced / elapsed,
+                    fast / elapsed,
+                    produced != 0 ? 100.0 * fastLost / produced / (readers - slow) : 0.0,
+                    produced != 0 && slow != 0 ? 100.0 * slowLost / produced / slow : 0.0 );
+
+            TestStop( subscribers, readers );
+        }
+    }
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestShared();
+    TestLagging();
+    TestAlone();
+    TestMixed();
+
+    return SimTestFinish( "mspyReaderTest" );
+}
@@ -0,0 +1,612 @@
+/*++
+
+Module Name:
+
+    mspySampleTest.c
+
+Abstract:
+
+    Tests the per-process sampler, ../filter/mspySample.c: its
+    heavy-hitter table and the controller that throttles a process once
+    it is over ProcessRecordBudget.
+
+    Many processes running the allowed image write in the protected
+    folder, each through a handle of its own, and the log is read back
+    and tallied per process.  Whatever the mix, every write must be
+    accounted for exactly once: either its record arrived, or a summary
+    record counted it as suppressed.  On top of that a heavy process is
+    throttled to its budget and sample rate, processes under budget never
+    are, however much the table churns, and a throttled process that is
+    evicted from the table is reported there and then.
+
+    With -b [seconds] it times SpySampleOperation itself, called
+    directly, with the operations spread over more and more processes,
+    and then writes through the whole driver with one heavy process
+    among light ones, with sampling off and on.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+
+//
+//  The writers are TEST_PROCESSES processes numbered from
+//  TEST_FIRST_PROCESS, all running the allowed image.  The last one ends
+//  windows.
+//
+
+#define TEST_FIRST_PROCESS      1000
+#define TEST_PROCESSES          256
+#define TEST_ROLLER             (TEST_PROCESSES - 1)
+
+#define TEST_WINDOW             200
+
+static PFILE_OBJECT Handles[TEST_PROCESSES];
+
+//
+//  What the log held, per writer.
+//
+
+typedef struct _TEST_TALLY {
+
+    ULONGLONG Writes[TEST_PROCESSES];
+    ULONGLONG Logged[TEST_PROCESSES];
+    ULONGLONG Suppressed[TEST_PROCESSES];
+    ULONGLONG Counted[TEST_PROCESSES];
+    ULONG Summaries[TEST_PROCESSES];
+    ULONG Strays;
+
+} TEST_TALLY, *PTEST_TALLY;
+
+static TEST_TALLY Tally;
+
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    PTEST_TALLY tally = Context;
+    ULONG process = (ULONG) LogRecord->Data.ProcessId - TEST_FIRST_PROCESS;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP | RECORD_TYPE_FLAG_PRIORITY )) {
+
+        return;
+    }
+
+    if (process >= TEST_PROCESSES) {
+
+        tally->Strays += 1;
+        return;
+    }
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_SUMMARY )) {
+
+        tally->Summaries[process] += 1;
+        tally->Suppressed[process] += LogRecord->Data.Aggregate.Suppressed;
+        tally->Counted[process] += LogRecord->Data.Aggregate.Count;
+
+    } else if (LogRecord->Data.CallbackMajorId == IRP_MJ_WRITE) {
+
+        tally->Logged[process] += 1;
+    }
+}
+
+
+static BOOLEAN
+TestStart (
+    __in ULONG Budget,
+    __in ULONG Rate,
+    __in ULONG Window,
+    __out PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver with the given sampler settings, coalescing off so
+    that each write logged is one record, and connects.
+
+--*/
+{
+    static BOOLEAN added;
+    ULONG i;
+
+    if (!added) {
+
+        for (i = 0; i < TEST_PROCESSES; i++) {
+
+            FanSimAddProcess( TEST_FIRST_PROCESS + i, "\\Program Files\\App\\a.exe", "S-1-5-21-1-1001" );
+        }
+
+        added = TRUE;
+    }
+
+    memset( &Tally, 0, sizeof(Tally) );
+
+    SimTestSetDword( "MaxRecords", 65536 );
+    SimTestSetDword( "WriteCoalesceLimit", 1 );
+    SimTestSetDword( "ProcessRecordBudget", Budget );
+    SimTestSetDword( "ProcessSampleRate", Rate );
+    SimTestSetDword( "ProcessSampleWindow", Window );
+
+    if (!SimTestLoad()) {
+
+        return FALSE;
+    }
+
+    if (!SimTestConnect( Reader, 0, TestTakeRecord, &Tally )) {
+
+        SimTestUnload( NULL );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static VOID
+TestStop (
+    __inout PSIM_TEST_READER Reader
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < TEST_PROCESSES; i++) {
+
+        if (Handles[i] != NULL) {
+
+            FanSimSetProcess( TEST_FIRST_PROCESS + i );
+            FanSimCloseFile( Handles[i] );
+            Handles[i] = NULL;
+        }
+    }
+
+    SimTestUnload( Reader );
+}
+
+
+static VOID
+TestWrite (
+    __in ULONG Process
+    )
+/*++
+
+Routine Description:
+
+    One write by the given writer, on its own handle, which is opened the
+    first time.  Opening is not counted against the budget; only what is
+    logged is.
+
+--*/
+{
+    static const UCHAR data[16];
+    CHAR name[64];
+
+    FanSimSetProcess( TEST_FIRST_PROCESS + Process );
+
+    if (Handles[Process] == NULL) {
+
+        snprintf( name, sizeof(name), "\\protected\\s%u.dat", Process );
+        Handles[Process] = SimTestCreate( name, FILE_GENERIC_WRITE, FILE_OVERWRITE_IF );
+
+        if (Handles[Process] == NULL) {
+
+            return;
+        }
+    }
+
+    CHECK( FanSimWrite( Handles[Process], 0, data, sizeof(data), NULL ) == STATUS_SUCCESS );
+    Tally.Writes[Process] += 1;
+}
+
+
+static VOID
+TestRoll (
+    __inout PSIM_TEST_READER Reader,
+    __in ULONG Window
+    )
+/*++
+
+Routine Description:
+
+    Waits out the window and has the roller write, which starts the next
+    one and sends up the summaries of the last.
+
+--*/
+{
+    SimTestDrain( Reader );
+    usleep( (Window + 50) * 1000 );
+    TestWrite( TEST_ROLLER );
+    SimTestDrain( Reader );
+}
+
+
+static VOID
+TestAccounted (
+    __in PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Every write was either logged or counted as suppressed by a summary,
+    and nothing was lost.
+
+--*/
+{
+    ULONG i;
+    BOOLEAN exact = TRUE;
+
+    for (i = 0; i < TEST_PROCESSES; i++) {
+
+        exact = exact && Tally.Writes[i] == Tally.Logged[i] + Tally.Suppressed[i];
+    }
+
+    CHECK( exact );
+    CHECK( Tally.Strays == 0 );
+    CHECK( Reader->Lost == 0 );
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestBudget (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    One process writes 1000 times in a window with a budget of 100.  Its
+    first 100 writes are logged and, past that, one in every
+    ProcessSampleRate, or none at a rate of 0.  The window's summary
+    counts all 1000.
+
+--*/
+{
+    static const ULONG rates[] = { 10, 0 };
+    SIM_TEST_READER reader;
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+
+        if (!TestStart( 100, rates[i], TEST_WINDOW, &reader )) {
+
+            continue;
+        }
+
+        for (j = 0; j < 1000; j++) {
+
+            TestWrite( 0 );
+        }
+
+        SimTestDrain( &reader );
+        CHECK( Tally.Summaries[0] == 0 );
+
+        TestRoll( &reader, TEST_WINDOW );
+
+        CHECK( Tally.Logged[0] == 100 + (rates[i] != 0 ? 900 / rates[i] : 0) );
+        CHECK( Tally.Summaries[0] == 1 );
+        CHECK( Tally.Counted[0] == 1000 );
+        CHECK( Tally.Summaries[TEST_ROLLER] == 0 );
+
+        TestAccounted( &reader );
+        TestStop( &reader );
+    }
+}
+
+
+static VOID
+TestLight (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Twenty processes under budget write among a heavy one.  Only the
+    heavy one is throttled.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    BOOLEAN untouched = TRUE;
+    ULONG i;
+
+    if (!TestStart( 100, 0, TEST_WINDOW, &reader )) {
+
+        return;
+    }
+
+    for (i = 0; i < 1000; i++) {
+
+        TestWrite( 0 );
+        TestWrite( 0 );
+        TestWrite( 0 );
+        TestWrite( 1 + i % 20 );
+    }
+
+    TestRoll( &reader, TEST_WINDOW );
+
+    for (i = 1; i <= 20; i++) {
+
+        untouched = untouched &&
+                    Tally.Logged[i] == 50 &&
+                    Tally.Summaries[i] == 0;
+    }
+
+    CHECK( untouched );
+    CHECK( Tally.Logged[0] == 100 );
+    CHECK( Tally.Suppressed[0] == 2900 );
+
+    TestAccounted( &reader );
+    TestStop( &reader );
+}
+
+
+static VOID
+TestChurn (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A heavy process writes among 64 light ones taking turns, twice as
+    many as the table has counters, so the light ones keep evicting each
+    other.  The heavy one's counter is never the smallest and stays, so it
+    is caught; a light one is never in the table long enough to be over
+    budget, so it is never throttled on a count it inherited, although
+    each makes more writes than the budget.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    BOOLEAN untouched = TRUE;
+    ULONG i;
+
+    if (!TestStart( 100, 0, TEST_WINDOW, &reader )) {
+
+        return;
+    }
+
+    for (i = 0; i < 64 * 200; i++) {
+
+        TestWrite( 0 );
+        TestWrite( 1 + i % 64 );
+
+        if (i % 1024 == 0) {
+
+            SimTestDrain( &reader );
+        }
+    }
+
+    TestRoll( &reader, TEST_WINDOW );
+
+    for (i = 1; i <= 64; i++) {
+
+        untouched = untouched &&
+                    Tally.Logged[i] == 200 &&
+                    Tally.Suppressed[i] == 0;
+    }
+
+    CHECK( untouched );
+    CHECK( Tally.Logged[0] == 100 );
+    CHECK( Tally.Summaries[0] == 1 );
+
+    TestAccounted( &reader );
+    TestStop( &reader );
+}
+
+
+static VOID
+TestEviction (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A throttled process whose counter is taken over is reported at once,
+    not at the end of the window, and its next writes are counted from
+    scratch.
+
+--*/
+{
+    SIM_TEST_READER reader;
+    ULONG i;
+    ULONG j;
+
+    if (!TestStart( 100, 0, TEST_WINDOW * 10, &reader )) {
+
+        return;
+    }
+
+    //
+    //  Process 0 ends up with the smallest counter of a full table...
+    //
+
+    for (i = 0; i < 150; i++) {
+
+        TestWrite( 0 );
+    }
+
+    for (i = 1; i < SPY_SAMPLE_ENTRIES; i++) {
+
+        for (j = 0; j < 200; j++) {
+
+            TestWrite( i );
+        }
+    }
+
+    SimTestDrain( &reader );
+    CHECK( Tally.Summaries[0] == 0 );
+
+    //
+    //  ...and the next process takes it over.
+    //
+
+    TestWrite( SPY_SAMPLE_ENTRIES );
+    SimTestDrain( &reader );
+
+    CHECK( Tally.Summaries[0] == 1 );
+    CHECK( Tally.Counted[0] == 150 );
+    CHECK( Tally.Suppressed[0] == 50 );
+
+    TestRoll( &reader, TEST_WINDOW * 10 );
+    TestAccounted( &reader );
+    TestStop( &reader );
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    First SpySampleOperation alone, with the operations spread evenly
+    over 1 to 256 processes, so the table from a lookup that hits to one
+    that evicts on every call.  Switching the thread's process is part of
+    each call, so the "off" row, with no budget, is what that costs.
+
+    Then writes through the driver, half of them by one heavy process and
+    the rest spread over 63 light ones, with sampling off and on, and the
+    share of writes that became records.
+
+--*/
+{
+    static const ULONG processes[] = { 1, 8, 32, 64, 256 };
+    SIM_TEST_READER reader;
+    ULONGLONG calls;
+    ULONGLONG logged;
+    ULONGLONG written;
+    LONGLONG start;
+    LONGLONG elapsed;
+    ULONG budget;
+    ULONG i;
+    ULONG j;
+
+    printf( "%-10s %9s %12s %10s %9s\n", "sketch", "processes", "calls/s", "ns/call", "logged" );
+
+    for (budget = 0; budget <= 1; budget++) {
+
+        for (i = 0; i < sizeof(processes) / sizeof(processes[0]); i++) {
+
+            if (!TestStart( budget != 0 ? 100 : 0, 16, 1000, &reader )) {
+
+                return 1;
+            }
+
+            calls = 0;
+            logged = 0;
+            start = SimTestNow();
+
+            do {
+
+                for (j = 0; j < 4096; j++) {
+
+                    FanSimSetProcess( TEST_FIRST_PROCESS + (j % processes[i]) );
+                    logged += SpySampleOperation();
+                }
+
+                calls += 4096;
+                elapsed = SimTestNow() - start;
+
+            } while (elapsed < (LONGLONG) Seconds * 1000000000);
+
+            printf( "%-10s %9u %12.0f %10.1f %8.1f%%\n",
+                    budget != 0 ? "on" : "off",
+                    processes[i],
+                    calls * 1e9 / elapsed,
+                    (double) elapsed / calls,
+                    100.0 * logged / calls );
+
+            SimTestDrain( &reader );
+            TestStop( &reader );
+        }
+    }
+
+    printf( "\n%-10s %12s %10s %9s\n", "driver", "writes/s", "ns/write", "logged" );
+
+    for (budget = 0; budget <= 1; budget++) {
+
+        if (!TestStart( budget != 0 ? 100 : 0, 16, 1000, &reader )) {
+
+            return 1;
+        }
+
+        start = SimTestNow();
+
+        do {
+
+            for (j = 0; j < 1024; j++) {
+
+                TestWrite( (j & 1) != 0 ? 0 : 1 + (j / 2) % 63 );
+            }
+
+            SimTestDrain( &reader );
+            elapsed = SimTestNow() - start;
+
+        } while (elapsed < (LONGLONG) Seconds * 1000000000);
+
+        written = 0;
+        logged = 0;
+
+        for (i = 0; i < TEST_PROCESSES; i++) {
+
+            written += Tally.Writes[i];
+            logged += Tally.Logged[i];
+        }
+
+        printf( "%-10s %12.0f %10.1f %8.1f%%\n",
+                budget != 0 ? "on" : "off",
+                written * 1e9 / elapsed,
+                (double) elapsed / written,
+                100.0 * logged / written );
+
+        TestStop( &reader );
+    }
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestBudget();
+    TestLight();
+    TestChurn();
+    TestEviction();
+
+    return SimTestFinish( "mspySampleTest" );
+}
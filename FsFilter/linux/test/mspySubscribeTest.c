@@ -0,0 +1,1104 @@
+/*++
+
+Module Name:
+
+    mspySubscribeTest.c
+
+Abstract:
+
+    Tests reader subscriptions, ../filter/mspySubscribe.c, through the
+    driver.  Random subscriptions, built from operation masks, access
+    types, path prefixes and process names chosen to sit on the edges of
+    the matching rules (case, trailing backslashes, prefixes of a
+    component, image names with and without their folder), are compiled
+    by SetMiniSpySubscription for two readers while a third reads with
+    none.  The same operations are then run each round, and what each
+    reader receives must be exactly what a reference model of the
+    SUBSCRIPTION rules in miniSpy.h says it wants.  Malformed
+    subscriptions must be refused and leave the one in force alone.
+
+    With -b [seconds] it times SpySubscribeOperation and
+    SpySubscribeMatch, the checks every operation pays before its record
+    is allocated, per event for subscriptions of growing size, and then
+    writes through the driver with subscriptions that take or turn away
+    every write.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "simTest.h"
+#include "mspyKern.h"
+
+#define TEST_READERS            3
+#define TEST_ROUNDS             150
+#define TEST_MAX_STRINGS        (SUBSCRIBE_MAX_STRINGS / 2)
+
+#define TEST_OTHER_PROCESS      400
+
+#define V                       FAN_SIM_VOLUME_NAME
+
+static const PCSTR TestDirectories[] = {
+    "\\protected\\a",
+    "\\protected\\ab",
+    "\\protected\\a\\deep",
+    "\\protected\\b",
+};
+
+#define TEST_DIRECTORIES        (sizeof(TestDirectories) / sizeof(TestDirectories[0]))
+
+static const struct {
+    ULONG ProcessId;
+    PCSTR ImageName;
+} TestProcesses[] = {
+    { SIM_TEST_ALLOWED,     V "\\Program Files\\App\\a.exe" },
+    { TEST_OTHER_PROCESS,   V "\\Tools\\a.exe" },
+};
+
+#define TEST_PROCESSES          (sizeof(TestProcesses) / sizeof(TestProcesses[0]))
+
+static const UCHAR TestAccessTypes[] = { 'W', 'R', 'd', 'D' };
+
+#define TEST_ACCESS_TYPES       (sizeof(TestAccessTypes) / sizeof(TestAccessTypes[0]))
+
+#define TEST_EVENTS             (TEST_DIRECTORIES * TEST_PROCESSES * TEST_ACCESS_TYPES)
+
+static const PCSTR TestPrefixPool[] = {
+    V "\\protected\\a",
+    V "\\PROTECTED\\A\\",
+    V "\\protected\\a\\deep",
+    V "\\protected\\ab",
+    V "\\protected",
+    V "\\protected\\b\\none",
+    V "\\public",
+    "\\protected\\a",
+};
+
+static const PCSTR TestProcessPool[] = {
+    "a.exe",
+    "A.EXE",
+    V "\\Tools\\a.exe",
+    V "\\tools\\A.EXE",
+    "\\Tools\\a.exe",
+    "b.exe",
+    "minispy.exe",
+};
+
+//
+//  A subscription as the test builds it, before it is packed into a
+//  SUBSCRIPTION.
+//
+
+typedef struct _TEST_SUBSCRIPTION {
+
+    ULONG Operations[SUBSCRIBE_OPERATION_WORDS];
+    ULONG Dispositions;
+    ULONG PrefixCount;
+    ULONG ProcessCount;
+    PCSTR Prefixes[TEST_MAX_STRINGS];
+    PCSTR Processes[TEST_MAX_STRINGS];
+    BOOLEAN Everything;
+
+} TEST_SUBSCRIPTION, *PTEST_SUBSCRIPTION;
+
+//
+//  One operation of a round: what the record of it will say, and which
+//  readers got it.
+//
+
+typedef struct _TEST_EVENT {
+
+    UCHAR MajorFunction;
+    UCHAR AccessType;
+    CHAR Path[160];
+    PCSTR ImageName;
+    ULONG Received[TEST_READERS];
+
+} TEST_EVENT, *PTEST_EVENT;
+
+typedef struct _TEST_ROUND {
+
+    TEST_EVENT Events[TEST_EVENTS];
+    ULONG FirstFile;
+    ULONG Strays;
+
+} TEST_ROUND, *PTEST_ROUND;
+
+typedef struct _TEST_TAKER {
+
+    PTEST_ROUND Round;
+    ULONG Reader;
+
+} TEST_TAKER, *PTEST_TAKER;
+
+static TEST_ROUND Round;
+static ULONG NextFile;
+static ULONG Seed = 1;
+
+
+static ULONG
+TestRandom (
+    __in ULONG Range
+    )
+{
+    Seed = Seed * 1103515245 + 12345;
+
+    return (Seed >> 8) % Range;
+}
+
+
+//---------------------------------------------------------------------------
+//  The reference model
+//---------------------------------------------------------------------------
+
+static ULONG
+TestDispositionBit (
+    __in UCHAR AccessType
+    )
+{
+    switch (AccessType) {
+
+        case 'D':   return SUBSCRIBE_DISPOSITION_DELETE;
+        case 'd':   return SUBSCRIBE_DISPOSITION_DELETE_PENDING;
+        case 'R':   return SUBSCRIBE_DISPOSITION_RENAME;
+        case 'W':   return SUBSCRIBE_DISPOSITION_WRITE;
+        default:    return SUBSCRIBE_DISPOSITION_OTHER;
+    }
+}
+
+
+static BOOLEAN
+TestModelWants (
+    __in PTEST_SUBSCRIPTION Subscription,
+    __in PTEST_EVENT Event
+    )
+/*++
+
+Routine Description:
+
+    Decides from the rules as miniSpy.h states them, and nothing the
+    driver compiles, whether a subscription wants a record.
+
+--*/
+{
+    PCSTR component;
+    size_t length;
+    BOOLEAN wanted;
+    ULONG i;
+
+    if (Subscription->Everything) {
+
+        return TRUE;
+    }
+
+    if ((Subscription->Operations[Event->MajorFunction / 32] & (1UL << (Event->MajorFunction % 32))) == 0 ||
+        (Subscription->Dispositions & TestDispositionBit( Event->AccessType )) == 0) {
+
+        return FALSE;
+    }
+
+    wanted = (BOOLEAN)(Subscription->PrefixCount == 0);
+
+    for (i = 0; i < Subscription->PrefixCount && !wanted; i++) {
+
+        length = strlen( Subscription->Prefixes[i] );
+
+        wanted = (BOOLEAN)(strncasecmp( Event->Path, Subscription->Prefixes[i], length ) == 0 &&
+                           (Event->Path[length] == '\0' ||
+                            Event->Path[length] == '\\' ||
+                            Subscription->Prefixes[i][length - 1] == '\\'));
+    }
+
+    if (!wanted || Subscription->ProcessCount == 0) {
+
+        return wanted;
+    }
+
+    component = strrchr( Event->ImageName, '\\' ) + 1;
+
+    for (i = 0; i < Subscription->ProcessCount; i++) {
+
+        if (strchr( Subscription->Processes[i], '\\' ) == NULL ?
+                strcasecmp( component, Subscription->Processes[i] ) == 0 :
+                strcasecmp( Event->ImageName, Subscription->Processes[i] ) == 0) {
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+//---------------------------------------------------------------------------
+//  Subscribing
+//---------------------------------------------------------------------------
+
+static ULONG
+TestPack (
+    __in PTEST_SUBSCRIPTION Subscription,
+    __out PCOMMAND_MESSAGE Command,
+    __in ULONG Size
+    )
+/*++
+
+Routine Description:
+
+    Packs a subscription behind a SetMiniSpySubscription command.
+
+Return Value:
+
+    The length of the command.
+
+--*/
+{
+    PSUBSCRIPTION subscription = (PSUBSCRIPTION) Command->Data;
+    PWCHAR next = subscription->Strings;
+    PCSTR string;
+    ULONG i;
+
+    memset( Command, 0, Size );
+    Command->Command = SetMiniSpySubscription;
+
+    memcpy( subscription->Operations, Subscription->Operations, sizeof(subscription->Operations) );
+    subscription->Dispositions = Subscription->Dispositions;
+    subscription->PrefixCount = (USHORT) Subscription->PrefixCount;
+    subscription->ProcessCount = (USHORT) Subscription->ProcessCount;
+
+    for (i = 0; i < Subscription->PrefixCount + Subscription->ProcessCount; i++) {
+
+        string = i < Subscription->PrefixCount ?
+                    Subscription->Prefixes[i] :
+                    Subscription->Processes[i - Subscription->PrefixCount];
+
+        do {
+
+            *next++ = (WCHAR)(UCHAR) *string;
+
+        } while (*string++ != '\0');
+    }
+
+    return (ULONG)((PUCHAR) next - (PUCHAR) Command);
+}
+
+
+static NTSTATUS
+TestSend (
+    __in PSIM_TEST_READER Reader,
+    __in PCOMMAND_MESSAGE Command,
+    __in ULONG Length,
+    __out PBOOLEAN Accepted
+    )
+/*++
+
+Routine Description:
+
+    Sends a SetMiniSpySubscription command and checks the reply.
+
+--*/
+{
+    PLOG_RECORD reply = Reader->Buffer;
+    ULONG returned = 0;
+    NTSTATUS status;
+
+    FanSimSetProcess( SIM_TEST_CONSUMER );
+
+    status = FanSimSendMessage( Reader->Port,
+                                Command,
+                                Length,
+                                Reader->Buffer,
+                                SIM_TEST_LOG_SIZE,
+                                &returned );
+
+    *Accepted = FALSE;
+
+    if (NT_SUCCESS( status )) {
+
+        CHECK( returned == reply->Length && returned > sizeof(LOG_RECORD) );
+        CHECK( reply->Name[0] != 0 );
+        *Accepted = (BOOLEAN)(reply->Reserved == 0);
+    }
+
+    return status;
+}
+
+
+static BOOLEAN
+TestSubscribe (
+    __in PSIM_TEST_READER Reader,
+    __in PTEST_SUBSCRIPTION Subscription
+    )
+{
+    static ULONG buffer[SUBSCRIBE_MAX_LENGTH / sizeof(ULONG)];
+    BOOLEAN accepted;
+    ULONG length;
+
+    length = TestPack( Subscription, (PCOMMAND_MESSAGE) buffer, sizeof(buffer) );
+
+    CHECK( TestSend( Reader, (PCOMMAND_MESSAGE) buffer, length, &accepted ) == STATUS_SUCCESS );
+
+    return accepted;
+}
+
+
+static VOID
+TestEverything (
+    __out PTEST_SUBSCRIPTION Subscription
+    )
+/*++
+
+Routine Description:
+
+    Every operation and access type and no strings, which the driver
+    takes as no subscription at all.
+
+--*/
+{
+    memset( Subscription, 0, sizeof(*Subscription) );
+    memset( Subscription->Operations, 0xff, sizeof(Subscription->Operations) );
+    Subscription->Dispositions = SUBSCRIBE_DISPOSITION_ALL;
+    Subscription->Everything = TRUE;
+}
+
+
+static VOID
+TestRandomSubscription (
+    __out PTEST_SUBSCRIPTION Subscription
+    )
+{
+    ULONG i;
+
+    memset( Subscription, 0, sizeof(*Subscription) );
+
+    if (TestRandom( 8 ) == 0) {
+
+        TestEverything( Subscription );
+        return;
+    }
+
+    for (i = 0; i < SUBSCRIBE_OPERATION_WORDS; i++) {
+
+        Subscription->Operations[i] = TestRandom( 0x10000 ) << 16 | TestRandom( 0x10000 );
+    }
+
+    //
+    //  The three operations the events are made of each go in or out
+    //  with even odds.
+    //
+
+    Subscription->Operations[0] &= ~((1UL << IRP_MJ_CREATE) | (1UL << IRP_MJ_WRITE) | (1UL << IRP_MJ_SET_INFORMATION));
+    Subscription->Operations[0] |= TestRandom( 2 ) << IRP_MJ_CREATE |
+                                   TestRandom( 2 ) << IRP_MJ_WRITE |
+                                   TestRandom( 2 ) << IRP_MJ_SET_INFORMATION;
+
+    Subscription->Dispositions = TestRandom( SUBSCRIBE_DISPOSITION_ALL + 1 );
+
+    Subscription->PrefixCount = TestRandom( 3 ) == 0 ? 0 : TestRandom( 4 );
+    Subscription->ProcessCount = TestRandom( 2 ) == 0 ? 0 : TestRandom( 3 );
+
+    for (i = 0; i < Subscription->PrefixCount; i++) {
+
+        Subscription->Prefixes[i] = TestPrefixPool[TestRandom( sizeof(TestPrefixPool) / sizeof(TestPrefixPool[0]) )];
+    }
+
+    for (i = 0; i < Subscription->ProcessCount; i++) {
+
+        Subscription->Processes[i] = TestProcessPool[TestRandom( sizeof(TestProcessPool) / sizeof(TestProcessPool[0]) )];
+    }
+}
+
+
+//---------------------------------------------------------------------------
+//  The events
+//---------------------------------------------------------------------------
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+/*++
+
+Routine Description:
+
+    Finds the event a record is of from the number in its file name,
+    which comes first in the record's names, ended by a newline.
+
+--*/
+{
+    PTEST_TAKER taker = Context;
+    PWCHAR name = LogRecord->Name;
+    PWCHAR last = NULL;
+    ULONG file = 0;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP | RECORD_TYPE_FLAG_PRIORITY )) {
+
+        return;
+    }
+
+    for (; *name != 0 && *name != '\n'; name++) {
+
+        if (*name == '\\') {
+
+            last = name + 1;
+        }
+    }
+
+    if (last == NULL || *last != 'e') {
+
+        taker->Round->Strays += 1;
+        return;
+    }
+
+    for (last++; *last >= '0' && *last <= '9'; last++) {
+
+        file = file * 10 + (*last - '0');
+    }
+
+    if (file < taker->Round->FirstFile || file >= taker->Round->FirstFile + TEST_EVENTS) {
+
+        taker->Round->Strays += 1;
+        return;
+    }
+
+    taker->Round->Events[file - taker->Round->FirstFile].Received[taker->Reader] += 1;
+}
+
+
+static VOID
+TestRunEvents (
+    __inout PTEST_ROUND Round
+    )
+/*++
+
+Routine Description:
+
+    Runs each access type in each directory from each process, on a file
+    of its own, so each makes exactly one record.
+
+--*/
+{
+    PTEST_EVENT event;
+    PFILE_OBJECT fileObject;
+    CHAR name[128];
+    ULONG options;
+    ULONG d;
+    ULONG p;
+    ULONG a;
+    ULONG file;
+
+    memset( Round, 0, sizeof(*Round) );
+    Round->FirstFile = NextFile;
+
+    for (d = 0; d < TEST_DIRECTORIES; d++) {
+
+        for (p = 0; p < TEST_PROCESSES; p++) {
+
+            for (a = 0; a < TEST_ACCESS_TYPES; a++) {
+
+                file = NextFile++;
+                event = &Round->Events[file - Round->FirstFile];
+
+                snprintf( name, sizeof(name), "%s\\e%u.dat", TestDirectories[d], file );
+                snprintf( event->Path, sizeof(event->Path), "%s%s", V, name );
+                event->ImageName = TestProcesses[p].ImageName;
+                event->AccessType = TestAccessTypes[a];
+
+                FanSimSetProcess( TestProcesses[p].ProcessId );
+
+                options = event->AccessType == 'D' ? FILE_DELETE_ON_CLOSE : 0;
+
+                if (!NT_SUCCESS( FanSimCreateFile( name,
+                                                   FILE_GENERIC_WRITE | DELETE,
+                                                   FILE_OVERWRITE_IF,
+                                                   options,
+                                                   &fileObject,
+                                                   NULL ) )) {
+
+                    Failures++;
+                    fprintf( stderr, "opening %s failed\n", name );
+                    continue;
+                }
+
+                switch (event->AccessType) {
+
+                    case 'W':
+                        event->MajorFunction = IRP_MJ_WRITE;
+                        CHECK( FanSimWrite( fileObject, 0, "data", 4, NULL ) == STATUS_SUCCESS );
+                        break;
+
+                    case 'R':
+                        event->MajorFunction = IRP_MJ_SET_INFORMATION;
+                        snprintf( name, sizeof(name), "%s\\r%u.dat", TestDirectories[d], file );
+                        CHECK( FanSimRename( fileObject, name, TRUE ) == STATUS_SUCCESS );
+                        break;
+
+                    case 'd':
+                        event->MajorFunction = IRP_MJ_SET_INFORMATION;
+                        CHECK( FanSimDelete( fileObject ) == STATUS_SUCCESS );
+                        break;
+
+                    case 'D':
+                        event->MajorFunction = IRP_MJ_CREATE;
+                        break;
+                }
+
+                FanSimCloseFile( fileObject );
+            }
+        }
+    }
+}
+
+
+static VOID
+TestCompare (
+    __in PTEST_ROUND Round,
+    __in_ecount(TEST_READERS) PTEST_SUBSCRIPTION Subscriptions,
+    __in ULONG RoundNumber
+    )
+{
+    PTEST_EVENT event;
+    ULONG expected;
+    ULONG e;
+    ULONG r;
+
+    CHECK( Round->Strays == 0 );
+
+    for (e = 0; e < TEST_EVENTS; e++) {
+
+        event = &Round->Events[e];
+
+        for (r = 0; r < TEST_READERS; r++) {
+
+            expected = TestModelWants( &Subscriptions[r], event );
+
+            if (event->Received[r] != expected) {
+
+                Failures++;
+                fprintf( stderr,
+                         "round %u reader %u: %c %s by %s received %u times, wanted %u\n",
+                         RoundNumber, r, event->AccessType, event->Path, event->ImageName,
+                         event->Received[r], expected );
+            }
+        }
+    }
+}
+
+
+//---------------------------------------------------------------------------
+//  Tests
+//---------------------------------------------------------------------------
+
+static BOOLEAN
+TestStart (
+    __out_ecount(TEST_READERS) PSIM_TEST_READER Readers,
+    __out_ecount(TEST_READERS) PTEST_TAKER Takers
+    )
+{
+    static BOOLEAN prepared;
+    PFILE_OBJECT fileObject;
+    ULONG r;
+    ULONG d;
+
+    SimTestSetDword( "WriteCoalesceLimit", 1 );
+    SimTestSetDword( "ProcessRecordBudget", 0 );
+
+    if (!SimTestLoad()) {
+
+        return FALSE;
+    }
+
+    if (!prepared) {
+
+        FanSimAddProcess( TEST_OTHER_PROCESS, "\\Tools\\a.exe", "S-1-5-21-1-1003" );
+        FanSimSetProcess( SIM_TEST_ALLOWED );
+
+        for (d = 0; d < TEST_DIRECTORIES; d++) {
+
+            if (NT_SUCCESS( FanSimCreateFile( TestDirectories[d], FILE_LIST_DIRECTORY, FILE_CREATE,
+                                              FILE_DIRECTORY_FILE, &fileObject, NULL ) )) {
+
+                FanSimCloseFile( fileObject );
+            }
+        }
+
+        prepared = TRUE;
+    }
+
+    for (r = 0; r < TEST_READERS; r++) {
+
+        Takers[r].Round = &Round;
+        Takers[r].Reader = r;
+
+        if (!SimTestConnect( &Readers[r], 0, TestTakeRecord, &Takers[r] )) {
+
+            while (r-- > 0) {
+
+                SimTestDisconnect( &Readers[r] );
+            }
+
+            SimTestUnload( NULL );
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+static VOID
+TestStop (
+    __inout_ecount(TEST_READERS) PSIM_TEST_READER Readers
+    )
+{
+    ULONG r;
+
+    for (r = 1; r < TEST_READERS; r++) {
+
+        SimTestDisconnect( &Readers[r] );
+    }
+
+    SimTestUnload( &Readers[0] );
+}
+
+
+static VOID
+TestDrainAll (
+    __inout_ecount(TEST_READERS) PSIM_TEST_READER Readers
+    )
+{
+    ULONG r;
+
+    for (r = 0; r < TEST_READERS; r++) {
+
+        SimTestDrain( &Readers[r] );
+        CHECK( Readers[r].Lost == 0 );
+    }
+}
+
+
+static VOID
+TestAgreement (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Reader 0 never subscribes and must get every event; readers 1 and 2
+    get a new random subscription each round, replacing the last one.
+
+--*/
+{
+    SIM_TEST_READER readers[TEST_READERS];
+    TEST_TAKER takers[TEST_READERS];
+    TEST_SUBSCRIPTION subscriptions[TEST_READERS];
+    ULONG round;
+    ULONG r;
+
+    if (!TestStart( readers, takers )) {
+
+        return;
+    }
+
+    TestEverything( &subscriptions[0] );
+
+    for (round = 0; round < TEST_ROUNDS; round++) {
+
+        for (r = 1; r < TEST_READERS; r++) {
+
+            TestRandomSubscription( &subscriptions[r] );
+            CHECK( TestSubscribe( &readers[r], &subscriptions[r] ) );
+        }
+
+        TestRunEvents( &Round );
+        TestDrainAll( readers );
+        TestCompare( &Round, subscriptions, round );
+    }
+
+    TestStop( readers );
+}
+
+
+static VOID
+TestRefused (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Malformed subscriptions are refused and the one in force, writes
+    only, stays in force.
+
+--*/
+{
+    static ULONG buffer[2 * SUBSCRIBE_MAX_LENGTH / sizeof(ULONG)];
+    PCOMMAND_MESSAGE command = (PCOMMAND_MESSAGE) buffer;
+    PSUBSCRIPTION packed = (PSUBSCRIPTION) command->Data;
+    SIM_TEST_READER readers[TEST_READERS];
+    TEST_TAKER takers[TEST_READERS];
+    TEST_SUBSCRIPTION subscriptions[TEST_READERS];
+    TEST_SUBSCRIPTION bad;
+    BOOLEAN accepted;
+    ULONG length;
+    ULONG i;
+
+    if (!TestStart( readers, takers )) {
+
+        return;
+    }
+
+    TestEverything( &subscriptions[0] );
+    TestEverything( &subscriptions[2] );
+    memset( &subscriptions[1], 0, sizeof(subscriptions[1]) );
+
+    SubscribeOperation( &subscriptions[1], IRP_MJ_WRITE );
+    subscriptions[1].Dispositions = SUBSCRIBE_DISPOSITION_WRITE;
+    subscriptions[1].PrefixCount = 1;
+    subscriptions[1].Prefixes[0] = V "\\protected";
+
+    CHECK( TestSubscribe( &readers[1], &subscriptions[1] ) );
+
+    //
+    //  A disposition bit that does not exist.
+    //
+
+    bad = subscriptions[1];
+    bad.Dispositions |= SUBSCRIBE_DISPOSITION_ALL + 1;
+    CHECK( !TestSubscribe( &readers[1], &bad ) );
+
+    //
+    //  More strings than SUBSCRIBE_MAX_STRINGS.
+    //
+
+    length = TestPack( &subscriptions[1], command, sizeof(buffer) );
+    packed->ProcessCount = SUBSCRIBE_MAX_STRINGS;
+    CHECK( TestSend( &readers[1], command, length, &accepted ) == STATUS_SUCCESS && !accepted );
+
+    //
+    //  A string that runs off the end, and an empty one.
+    //
+
+    length = TestPack( &subscriptions[1], command, sizeof(buffer) );
+    CHECK( TestSend( &readers[1], command, length - sizeof(WCHAR), &accepted ) == STATUS_SUCCESS && !accepted );
+
+    length = TestPack( &subscriptions[1], command, sizeof(buffer) );
+    packed->Strings[0] = 0;
+    CHECK( TestSend( &readers[1], command, length, &accepted ) == STATUS_SUCCESS && !accepted );
+
+    //
+    //  Too long altogether, whatever it holds.
+    //
+
+    length = TestPack( &subscriptions[1], command, sizeof(buffer) );
+
+    for (i = length / sizeof(WCHAR); i < sizeof(buffer) / sizeof(WCHAR); i++) {
+
+        ((PWCHAR) buffer)[i] = 'x';
+    }
+
+    CHECK( TestSend( &readers[1], command, FIELD_OFFSET(COMMAND_MESSAGE, Data) + SUBSCRIBE_MAX_LENGTH + sizeof(WCHAR), &accepted ) ==
+           STATUS_INVALID_PARAMETER );
+
+    //
+    //  None of that changed what reader 1 gets.
+    //
+
+    TestRunEvents( &Round );
+    TestDrainAll( readers );
+    TestCompare( &Round, subscriptions, 0 );
+
+    //
+    //  Subscribing to everything drops the subscription.
+    //
+
+    CHECK( TestSubscribe( &readers[1], &subscriptions[0] ) );
+    CHECK( MiniSpyData.SubscribedReaders == 0 );
+
+    TestStop( readers );
+}
+
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+static VOID
+TestWiden (
+    __out PUNICODE_STRING String,
+    __out_ecount(Size) PWCHAR Buffer,
+    __in ULONG Size,
+    __in PCSTR Text
+    )
+{
+    ULONG i;
+
+    for (i = 0; Text[i] != '\0' && i < Size - 1; i++) {
+
+        Buffer[i] = (WCHAR)(UCHAR) Text[i];
+    }
+
+    Buffer[i] = 0;
+
+    String->Buffer = Buffer;
+    String->Length = (USHORT)(i * sizeof(WCHAR));
+    String->MaximumLength = (USHORT)((i + 1) * sizeof(WCHAR));
+}
+
+
+static double
+TestTimeEvaluation (
+    __in PFLT_CALLBACK_DATA Data,
+    __in PUNICODE_STRING Name,
+    __in PSPY_IDENTITY Identity,
+    __in LONGLONG Duration,
+    __out PULONG Readers
+    )
+/*++
+
+Routine Description:
+
+    Runs the checks an operation goes through before its record is
+    allocated, for Duration ns.
+
+Return Value:
+
+    ns an event.
+
+--*/
+{
+    ULONGLONG events = 0;
+    LONGLONG start = SimTestNow();
+    LONGLONG now;
+    ULONG readers = 0;
+    ULONG i;
+
+    do {
+
+        for (i = 0; i < 4096; i++) {
+
+            readers = SpySubscribeOperation( Data );
+
+            if (readers != 0) {
+
+                readers = SpySubscribeMatch( Name, Identity, readers );
+            }
+        }
+
+        events += 4096;
+        now = SimTestNow();
+
+    } while (now - start < Duration);
+
+    *Readers = readers;
+
+    return (double)(now - start) / events;
+}
+
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+{
+    static const struct {
+        PCSTR Name;
+        ULONG Prefixes;
+        ULONG Processes;
+        BOOLEAN Hit;
+    } cases[] = {
+        { "operations", 0, 0, TRUE },
+        { "1 prefix", 1, 0, TRUE },
+        { "8 prefixes miss", 8, 0, FALSE },
+        { "8 prefixes hit", 8, 0, TRUE },
+        { "32+32 miss", 32, 32, FALSE },
+        { "32+32 hit", 32, 32, TRUE },
+    };
+    static CHAR strings[TEST_MAX_STRINGS * 2][96];
+    static WCHAR nameBuffer[128];
+    static WCHAR imageBuffer[128];
+    SIM_TEST_READER readers[TEST_READERS];
+    TEST_TAKER takers[TEST_READERS];
+    TEST_SUBSCRIPTION subscription;
+    FLT_IO_PARAMETER_BLOCK iopb;
+    FLT_CALLBACK_DATA data;
+    UNICODE_STRING name;
+    UNICODE_STRING image;
+    SPY_IDENTITY identity;
+    PFILE_OBJECT fileObject;
+    LONGLONG duration = (LONGLONG) Seconds * 1000000000 / 8;
+    LONGLONG start;
+    double elapsed;
+    double cost;
+    ULONG wanted;
+    ULONG c;
+    ULONG i;
+    ULONG r;
+
+    if (!TestStart( readers, takers )) {
+
+        return 1;
+    }
+
+    memset( &iopb, 0, sizeof(iopb) );
+    memset( &data, 0, sizeof(data) );
+    memset( &identity, 0, sizeof(identity) );
+    iopb.MajorFunction = IRP_MJ_WRITE;
+    data.Iopb = &iopb;
+
+    TestWiden( &name, nameBuffer, 128, V "\\protected\\b\\reports\\2024\\q3\\summary.docx" );
+    TestWiden( &image, imageBuffer, 128, V "\\Program Files\\App\\a.exe" );
+    identity.ProcessImageName = &image;
+
+    for (i = 0; i < TEST_MAX_STRINGS; i++) {
+
+        snprintf( strings[i], sizeof(strings[i]), V "\\protected\\%c%u", 'a' + i % 26, i );
+        snprintf( strings[TEST_MAX_STRINGS + i], sizeof(strings[i]), "tool%u.exe", i );
+    }
+
+    printf( "%-18s %9s %7s\n", "subscription", "ns/event", "wanted" );
+
+    //
+    //  Nobody subscribed: the checks return at once.
+    //
+
+    cost = TestTimeEvaluation( &data, &name, &identity, duration, &wanted );
+    printf( "%-18s %9.1f %7s\n", "none", cost, wanted != 0 ? "yes" : "no" );
+
+    //
+    //  Reader 1 subscribes; the other two want everything, which costs
+    //  nothing to check, so the time is that of reader 1's subscription.
+    //
+
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+
+        memset( &subscription, 0, sizeof(subscription) );
+        SubscribeOperation( &subscription, IRP_MJ_WRITE );
+        subscription.Dispositions = SUBSCRIBE_DISPOSITION_WRITE;
+        subscription.PrefixCount = cases[c].Prefixes;
+        subscription.ProcessCount = cases[c].Processes;
+
+        for (i = 0; i < cases[c].Prefixes; i++) {
+
+            subscription.Prefixes[i] = strings[i];
+        }
+
+        for (i = 0; i < cases[c].Processes; i++) {
+
+            subscription.Processes[i] = strings[TEST_MAX_STRINGS + i];
+        }
+
+        //
+        //  A hit is on the last string looked at.
+        //
+
+        if (cases[c].Hit && cases[c].Processes != 0) {
+
+            subscription.Prefixes[cases[c].Prefixes - 1] = V "\\protected\\b";
+            subscription.Processes[cases[c].Processes - 1] = "a.exe";
+
+        } else if (cases[c].Hit && cases[c].Prefixes != 0) {
+
+            subscription.Prefixes[cases[c].Prefixes - 1] = V "\\protected\\b";
+        }
+
+        CHECK( TestSubscribe( &readers[1], &subscription ) );
+
+        cost = TestTimeEvaluation( &data, &name, &identity, duration, &wanted );
+        wanted &= (ULONG) MiniSpyData.SubscribedReaders;
+
+        printf( "%-18s %9.1f %7s\n", cases[c].Name, cost, wanted != 0 ? "yes" : "no" );
+        CHECK( (wanted != 0) == cases[c].Hit );
+    }
+
+    TestStop( readers );
+
+    //
+    //  Through the driver: writes a second with one reader taking every
+    //  write, and with it turning every write away by its prefix, so no
+    //  record is ever allocated for them.
+    //
+
+    printf( "\n%-18s %12s %10s\n", "driver", "writes/s", "records" );
+
+    for (c = 0; c < 3; c++) {
+
+        if (!TestStart( readers, takers )) {
+
+            return 1;
+        }
+
+        for (r = 0; r < TEST_READERS; r++) {
+
+            memset( &subscription, 0, sizeof(subscription) );
+            SubscribeOperation( &subscription, IRP_MJ_WRITE );
+            subscription.Dispositions = SUBSCRIBE_DISPOSITION_WRITE;
+            subscription.PrefixCount = 1;
+            subscription.Prefixes[0] = c == 2 ? V "\\protected\\a" : V "\\protected\\b";
+
+            if (c != 0) {
+
+                CHECK( TestSubscribe( &readers[r], &subscription ) );
+            }
+        }
+
+        FanSimSetProcess( SIM_TEST_ALLOWED );
+        fileObject = SimTestCreate( "\\protected\\b\\bench.dat", FILE_GENERIC_WRITE, FILE_OVERWRITE_IF );
+
+        start = SimTestNow();
+
+        for (i = 0; fileObject != NULL && SimTestNow() - start < duration * 2; i++) {
+
+            FanSimSetProcess( SIM_TEST_ALLOWED );
+            FanSimWrite( fileObject, 0, "data", 4, NULL );
+
+            if (i % 256 == 255) {
+
+                TestDrainAll( readers );
+            }
+        }
+
+        elapsed = (SimTestNow() - start) / 1e9;
+        TestDrainAll( readers );
+
+        printf( "%-18s %12.0f %10llu\n",
+                c == 0 ? "none" : c == 1 ? "taken" : "turned away",
+                i / elapsed,
+                (unsigned long long) readers[0].Records );
+
+        if (fileObject != NULL) {
+
+            FanSimSetProcess( SIM_TEST_ALLOWED );
+            FanSimCloseFile( fileObject );
+        }
+
+        TestStop( readers );
+    }
+
+    return Failures != 0;
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 1 );
+    }
+
+    TestAgreement();
+    TestRefused();
+
+    return SimTestFinish( "mspySubscribeTest" );
+}
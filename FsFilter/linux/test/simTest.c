@@ -0,0 +1,437 @@
+/*++
+
+Module Name:
+
+    simTest.c
+
+Abstract:
+
+    What the tests in this directory share: the volume, loading and
+    unloading the driver, and reading its log.  See simTest.h.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "simTest.h"
+
+ULONG Failures;
+
+static BOOLEAN VolumePrepared;
+
+
+//---------------------------------------------------------------------------
+//  The driver
+//---------------------------------------------------------------------------
+
+VOID
+SimTestSetDword (
+    __in PCSTR ValueName,
+    __in ULONG Value
+    )
+/*++
+
+Routine Description:
+
+    Sets a value under the driver's service key, which it reads on its
+    next load.
+
+--*/
+{
+    FanSimSetRegistryDword( SIM_TEST_SERVICE_KEY, ValueName, Value );
+}
+
+
+static VOID
+SimTestPrepareVolume (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Adds the processes and lays out the volume, once, before the driver
+    first loads: a protected folder and a public one.  Both outlive the
+    driver, so a test may load it again with other settings.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+
+    FanSimAddProcess( SIM_TEST_ALLOWED, "\\Program Files\\App\\a.exe", "S-1-5-21-1-1001" );
+    FanSimAddProcess( SIM_TEST_DENIED, "\\Windows\\b.exe", "S-1-5-21-1-1002" );
+    FanSimAddProcess( SIM_TEST_CONSUMER, "\\Windows\\minispy.exe", "S-1-5-21-1-500" );
+
+    FanSimSetProcess( FAN_SIM_SYSTEM_PROCESS );
+
+    if (NT_SUCCESS( FanSimCreateFile( "\\protected", FILE_LIST_DIRECTORY, FILE_CREATE,
+                                      FILE_DIRECTORY_FILE, &fileObject, NULL ) )) {
+
+        FanSimCloseFile( fileObject );
+    }
+
+    if (NT_SUCCESS( FanSimCreateFile( "\\public", FILE_LIST_DIRECTORY, FILE_CREATE,
+                                      FILE_DIRECTORY_FILE, &fileObject, NULL ) )) {
+
+        FanSimCloseFile( fileObject );
+    }
+
+    FanSimSetRegistryString( SIM_TEST_SERVICE_KEY,
+                             "ProtectedDir",
+                             FAN_SIM_VOLUME_NAME "\\protected\\" );
+    FanSimSetRegistryString( SIM_TEST_SERVICE_KEY, "OpenProccess", "a.exe" );
+
+    VolumePrepared = TRUE;
+}
+
+
+BOOLEAN
+SimTestLoad (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Loads the driver as the system process with the registry values set
+    so far.
+
+Return Value:
+
+    FALSE, counted as a failure, if DriverEntry failed.
+
+--*/
+{
+    NTSTATUS status;
+
+    if (!VolumePrepared) {
+
+        SimTestPrepareVolume();
+    }
+
+    FanSimSetProcess( FAN_SIM_SYSTEM_PROCESS );
+
+    status = FanSimLoad( DriverEntry, SIM_TEST_SERVICE_KEY );
+
+    if (!NT_SUCCESS( status )) {
+
+        Failures++;
+        fprintf( stderr, "loading the driver: %08x\n", (unsigned) status );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+VOID
+SimTestUnload (
+    __in_opt PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Disconnects Reader, if given, and unloads the driver.  The thread is
+    left running as the system process.
+
+--*/
+{
+    if (Reader != NULL) {
+
+        SimTestDisconnect( Reader );
+    }
+
+    FanSimSetProcess( FAN_SIM_SYSTEM_PROCESS );
+    CHECK( FanSimUnload() == STATUS_SUCCESS );
+}
+
+
+//---------------------------------------------------------------------------
+//  The log
+//---------------------------------------------------------------------------
+
+static VOID
+SimTestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    PSIM_TEST_READER reader = Context;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP )) {
+
+        reader->Lost += ((PRECORD_GAP) LogRecord->Name)->Count;
+    }
+
+    if (reader->Routine != NULL) {
+
+        reader->Routine( reader->Context, LogRecord );
+    }
+}
+
+
+BOOLEAN
+SimTestConnect (
+    __out PSIM_TEST_READER Reader,
+    __in ULONG SubscriberId,
+    __in_opt PREPLAY_RECORD_ROUTINE Routine,
+    __in_opt PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Connects to the driver's port as the consumer process.
+
+Arguments:
+
+    Reader - receives the connection
+    SubscriberId - for MINISPY_CONNECT, 0 for a consumer that is not
+        kept across connections
+    Routine - called with each record read, gap records included
+    Context - passed to Routine
+
+Return Value:
+
+    FALSE, counted as a failure, if the driver refused the connection.
+
+--*/
+{
+    MINISPY_CONNECT connect;
+    NTSTATUS status;
+
+    memset( Reader, 0, sizeof(*Reader) );
+    SequenceReset( &Reader->Sequence );
+
+    Reader->Routine = Routine;
+    Reader->Context = Context;
+    Reader->Buffer = aligned_alloc( sizeof(PVOID), SIM_TEST_LOG_SIZE );
+
+    connect.SubscriberId = SubscriberId;
+
+    FanSimSetProcess( SIM_TEST_CONSUMER );
+
+    status = FanSimConnect( "\\MiniSpyPort", &connect, sizeof(connect), &Reader->Port );
+
+    if (!NT_SUCCESS( status ) || Reader->Buffer == NULL) {
+
+        Failures++;
+        fprintf( stderr, "connecting to the driver: %08x\n", (unsigned) status );
+        free( Reader->Buffer );
+        Reader->Buffer = NULL;
+        Reader->Port = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+BOOLEAN
+SimTestRead (
+    __inout PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Reads one batch as minispy's log thread does: AckMiniSpyLog for what
+    was read before, which returns the next batch, walked with
+    ReplayBatch.  The batch read is acknowledged by the next call, so a
+    reader that disconnects after this has not acknowledged it.
+
+    The thread is left running as the consumer process.
+
+Return Value:
+
+    TRUE if a batch came back.
+
+--*/
+{
+    UCHAR message[FIELD_OFFSET(COMMAND_MESSAGE, Data) + sizeof(MINISPY_ACK)];
+    PCOMMAND_MESSAGE command = (PCOMMAND_MESSAGE) message;
+    ULONG returned = 0;
+    ULONG used;
+    NTSTATUS status;
+
+    if (Reader->Port == NULL) {
+
+        return FALSE;
+    }
+
+    FanSimSetProcess( SIM_TEST_CONSUMER );
+
+    memset( message, 0, sizeof(message) );
+    command->Command = AckMiniSpyLog;
+    memcpy( ((PMINISPY_ACK) command->Data)->Sequence,
+            Reader->Sequence.Received,
+            sizeof(Reader->Sequence.Received) );
+
+    status = FanSimSendMessage( Reader->Port,
+                                command,
+                                sizeof(message),
+                                Reader->Buffer,
+                                SIM_TEST_LOG_SIZE,
+                                &returned );
+
+    if (status == STATUS_NO_MORE_ENTRIES || (NT_SUCCESS( status ) && returned == 0)) {
+
+        return FALSE;
+    }
+
+    if (!NT_SUCCESS( status )) {
+
+        Failures++;
+        fprintf( stderr, "reading the log: %08x\n", (unsigned) status );
+        return FALSE;
+    }
+
+    Reader->Batches += 1;
+    Reader->Records += ReplayBatch( &Reader->Sequence,
+                                    Reader->Buffer,
+                                    returned,
+                                    SimTestTakeRecord,
+                                    Reader,
+                                    &used );
+
+    CHECK( used == returned );
+
+    return TRUE;
+}
+
+
+ULONG
+SimTestDrain (
+    __inout PSIM_TEST_READER Reader
+    )
+/*++
+
+Routine Description:
+
+    Reads until the log comes back empty, then acknowledges the last
+    batch.  Records the coalescer still holds stay there.
+
+Return Value:
+
+    The number of batches read.
+
+--*/
+{
+    ULONG batches = 0;
+
+    while (SimTestRead( Reader )) {
+
+        batches += 1;
+    }
+
+    return batches;
+}
+
+
+VOID
+SimTestDisconnect (
+    __inout PSIM_TEST_READER Reader
+    )
+{
+    if (Reader->Port != NULL) {
+
+        FanSimSetProcess( SIM_TEST_CONSUMER );
+        FanSimDisconnect( Reader->Port );
+        Reader->Port = NULL;
+    }
+
+    free( Reader->Buffer );
+    Reader->Buffer = NULL;
+}
+
+
+//---------------------------------------------------------------------------
+//  Odds and ends
+//---------------------------------------------------------------------------
+
+PFILE_OBJECT
+SimTestCreate (
+    __in PCSTR FileName,
+    __in ACCESS_MASK DesiredAccess,
+    __in ULONG CreateDisposition
+    )
+/*++
+
+Routine Description:
+
+    Opens or creates FileName as the thread's process.
+
+Return Value:
+
+    The file object, or NULL, counted as a failure, if the open failed.
+
+--*/
+{
+    PFILE_OBJECT fileObject = NULL;
+    NTSTATUS status;
+
+    status = FanSimCreateFile( FileName, DesiredAccess, CreateDisposition, 0, &fileObject, NULL );
+
+    if (!NT_SUCCESS( status )) {
+
+        Failures++;
+        fprintf( stderr, "opening %s: %08x\n", FileName, (unsigned) status );
+        return NULL;
+    }
+
+    return fileObject;
+}
+
+
+LONGLONG
+SimTestNow (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    The monotonic clock, in nanoseconds.
+
+--*/
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (LONGLONG) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+int
+SimTestFinish (
+    __in PCSTR Name
+    )
+/*++
+
+Routine Description:
+
+    Reports how the checks went.
+
+Return Value:
+
+    The test's exit code.
+
+--*/
+{
+    if (Failures != 0) {
+
+        printf( "%s: %u checks failed\n", Name, Failures );
+        return 1;
+    }
+
+    printf( "%s: passed\n", Name );
+    return 0;
+}
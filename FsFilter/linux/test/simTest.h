@@ -0,0 +1,141 @@
+/*++
+
+Module Name:
+
+    simTest.h
+
+Abstract:
+
+    Header file which contains the structures, constants and function
+    prototypes shared by the tests in this directory.
+
+    Each test builds the driver from its own sources against fanShim.c,
+    as fanSim does, and drives one part of it: the coalescer, the quota,
+    the lanes and so on.  simTest.c holds what they all need around that:
+    laying out the volume, loading the driver with a given set of
+    registry values, and reading the log back the way minispy does,
+    through ../user/mspyReplay.c, so every batch is checked for sequence
+    gaps on the way.
+
+    A test runs its checks and prints "<name>: passed" or how many
+    failed.  Run with -b [seconds] it runs its benchmark instead and
+    prints a table, as mspyBatchTest does.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+#ifndef __SIMTEST_H__
+#define __SIMTEST_H__
+
+#include <stdio.h>
+
+#include "fanSim.h"
+#include "mspyReplay.h"
+
+DRIVER_INITIALIZE DriverEntry;
+
+#define SIM_TEST_SERVICE_KEY    "\\Registry\\Machine\\System\\CurrentControlSet\\Services\\fsFilter"
+
+//
+//  The processes.  Only the first one's image is allowed into the
+//  protected folder; the consumer reads the log.
+//
+
+#define SIM_TEST_ALLOWED        100
+#define SIM_TEST_DENIED         200
+#define SIM_TEST_CONSUMER       300
+
+#define SIM_TEST_LOG_SIZE       (64 * 1024)
+
+extern ULONG Failures;
+
+#define CHECK(Condition)                                                \
+    ((Condition) ? (void) 0 :                                           \
+     (void) (Failures++, fprintf( stderr, "%s:%d: %s\n",                \
+                                  __FILE__, __LINE__, #Condition )))
+
+//
+//  A connection to the driver's port.  Records counts the records
+//  ReplayBatch handed to Routine, gap records included, and Lost the
+//  sequence numbers the gap records accounted for.
+//
+
+typedef struct _SIM_TEST_READER {
+
+    PFLT_PORT Port;
+    PVOID Buffer;
+
+    LOG_SEQUENCE Sequence;
+
+    PREPLAY_RECORD_ROUTINE Routine;
+    PVOID Context;
+
+    ULONGLONG Records;
+    ULONGLONG Lost;
+    ULONGLONG Batches;
+
+} SIM_TEST_READER, *PSIM_TEST_READER;
+
+//
+//  Function prototypes
+//
+
+VOID
+SimTestSetDword (
+    __in PCSTR ValueName,
+    __in ULONG Value
+    );
+
+BOOLEAN
+SimTestLoad (
+    VOID
+    );
+
+BOOLEAN
+SimTestConnect (
+    __out PSIM_TEST_READER Reader,
+    __in ULONG SubscriberId,
+    __in_opt PREPLAY_RECORD_ROUTINE Routine,
+    __in_opt PVOID Context
+    );
+
+BOOLEAN
+SimTestRead (
+    __inout PSIM_TEST_READER Reader
+    );
+
+ULONG
+SimTestDrain (
+    __inout PSIM_TEST_READER Reader
+    );
+
+VOID
+SimTestDisconnect (
+    __inout PSIM_TEST_READER Reader
+    );
+
+VOID
+SimTestUnload (
+    __in_opt PSIM_TEST_READER Reader
+    );
+
+PFILE_OBJECT
+SimTestCreate (
+    __in PCSTR FileName,
+    __in ACCESS_MASK DesiredAccess,
+    __in ULONG CreateDisposition
+    );
+
+LONGLONG
+SimTestNow (
+    VOID
+    );
+
+int
+SimTestFinish (
+    __in PCSTR Name
+    );
+
+#endif //__SIMTEST_H__
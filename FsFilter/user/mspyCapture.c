@@ -0,0 +1,474 @@
+/*++
+
+Module Name:
+
+    mspyCapture.c
+
+Abstract:
+
+    This module captures the batches of records minispy receives, byte
+    for byte and timed, and plays a capture back through the same path
+    the live batches take: the sequence checks, the merge, the screen or
+    file output and the summaries.  A consumer that fell behind under
+    some burst of traffic can so be run again on that very traffic, as
+    often as needed and under a profiler.
+
+    A capture is played back at the pace it was taken, some number of
+    times faster, or as fast as the consumer can go.  Playback only
+    waits between batches, so at full speed what is measured is the
+    consumer alone.
+
+    The file itself is written and read by mspyReplay.c, which builds
+    without Win32; what is here is the lock, the performance counter and
+    the pacing.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <DriverSpecs.h>
+__user_code
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include "mspyLog.h"
+#include "mspyMerge.h"
+#include "mspyCapture.h"
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+VOID
+CaptureClose (
+    __inout PLOG_CAPTURE Capture
+    )
+/*++
+
+Routine Description:
+
+    Closes the capture file and says what it holds.  The lock must be
+    held.
+
+Arguments:
+
+    Capture - the capture
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Capture->File == NULL) {
+
+        return;
+    }
+
+    fclose( Capture->File );
+    Capture->File = NULL;
+
+    printf( "    Captured %I64u batches, %I64u bytes\n", Capture->Batches, Capture->Bytes );
+}
+
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+BOOLEAN
+CaptureInitialize (
+    __out PLOG_CAPTURE Capture
+    )
+/*++
+
+Routine Description:
+
+    Sets up a capture that is not capturing.
+
+Arguments:
+
+    Capture - the capture to set up
+
+Return Value:
+
+    TRUE.
+
+--*/
+{
+    ZeroMemory( Capture, sizeof( LOG_CAPTURE ) );
+
+    InitializeCriticalSection( &Capture->Lock );
+
+    return TRUE;
+}
+
+VOID
+CaptureCleanup (
+    __inout PLOG_CAPTURE Capture
+    )
+/*++
+
+Routine Description:
+
+    Stops capturing and frees what the capture holds.
+
+Arguments:
+
+    Capture - the capture
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CaptureStop( Capture );
+    DeleteCriticalSection( &Capture->Lock );
+}
+
+DWORD
+CaptureStart (
+    __inout PLOG_CAPTURE Capture,
+    __in PCWSTR FileName
+    )
+/*++
+
+Routine Description:
+
+    Starts capturing to a new file, replacing any file of that name, and
+    stopping first if already capturing.
+
+Arguments:
+
+    Capture - the capture
+    FileName - the capture file
+
+Return Value:
+
+    ERROR_SUCCESS or the error that kept the file from being created.
+
+--*/
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER started;
+    FILE *file;
+
+    file = _wfopen( FileName, L"wb" );
+
+    if (file == NULL) {
+
+        return _doserrno;
+    }
+
+    QueryPerformanceFrequency( &frequency );
+    GetSystemTimeAsFileTime( (FILETIME *)&started );
+
+    if (!CaptureWriteHeader( file, frequency.QuadPart, started.QuadPart ) ||
+        fflush( file ) != 0) {
+
+        fclose( file );
+        return ERROR_WRITE_FAULT;
+    }
+
+    EnterCriticalSection( &Capture->Lock );
+
+    CaptureClose( Capture );
+
+    Capture->File = file;
+    Capture->Batches = 0;
+    Capture->Bytes = 0;
+
+    LeaveCriticalSection( &Capture->Lock );
+
+    return ERROR_SUCCESS;
+}
+
+VOID
+CaptureStop (
+    __inout PLOG_CAPTURE Capture
+    )
+/*++
+
+Routine Description:
+
+    Stops capturing.
+
+Arguments:
+
+    Capture - the capture
+
+Return Value:
+
+    None.
+
+--*/
+{
+    EnterCriticalSection( &Capture->Lock );
+    CaptureClose( Capture );
+    LeaveCriticalSection( &Capture->Lock );
+}
+
+VOID
+CaptureBatch (
+    __inout PLOG_CAPTURE Capture,
+    __in_bcount(Length) PCHAR Buffer,
+    __in DWORD Length
+    )
+/*++
+
+Routine Description:
+
+    Appends a batch to the capture file if capturing.  The capture stops
+    if the file cannot be written.  Each batch is flushed as it is
+    written, so a capture cut short by a crash keeps all but the last.
+
+Arguments:
+
+    Capture - the capture
+    Buffer - the batch, as GetMiniSpyLog returned it
+    Length - its size in bytes
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LARGE_INTEGER ticks;
+
+    //
+    //  Not capturing is the common case; the file is only read here to
+    //  save taking the lock for nothing.
+    //
+
+    if (Capture->File == NULL) {
+
+        return;
+    }
+
+    QueryPerformanceCounter( &ticks );
+
+    EnterCriticalSection( &Capture->Lock );
+
+    if (Capture->File != NULL) {
+
+        if (CaptureWriteBatch( Capture->File, ticks.QuadPart, Buffer, Length ) &&
+            fflush( Capture->File ) == 0) {
+
+            Capture->Batches++;
+            Capture->Bytes += Length;
+
+        } else {
+
+            printf( "Capture stopped: error %d\n", errno );
+            CaptureClose( Capture );
+        }
+    }
+
+    LeaveCriticalSection( &Capture->Lock );
+}
+
+int
+CaptureReplay (
+    __in int argc,
+    __in_ecount(argc) char *argv[]
+    )
+/*++
+
+Routine Description:
+
+    Plays back a capture made with /z:
+
+        <file>              the capture
+        speed:<n>           n times as fast as it was captured, 1 if not
+                            given
+        fast                as fast as it can go
+        out:<file>          writes the records to <file> as /f does
+                            instead of to the screen
+        quiet               writes the records nowhere
+
+    and then says how long it took.
+
+Arguments:
+
+    argc - the number of arguments
+    argv - the arguments, the capture file first
+
+Return Value:
+
+    0, or 1 if the arguments are wrong.
+
+--*/
+{
+    LOG_CONTEXT context;
+    LOG_MERGE merge;
+    CAPTURE_FILE_HEADER fileHeader;
+    CAPTURE_BATCH_HEADER header;
+    PCHAR buffer;
+    FILE *file;
+    ULONG speed = 1;
+    BOOLEAN quiet = FALSE;
+    PCHAR outName = NULL;
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER started;
+    LARGE_INTEGER now;
+    LONGLONG firstTicks = 0;
+    LONGLONG due;
+    ULONGLONG batches = 0;
+    double seconds;
+    int i;
+
+    if (argc < 1) {
+
+        goto CaptureReplay_Usage;
+    }
+
+    for (i = 1; i < argc; i++) {
+
+        if (!_strnicmp( argv[i], "speed:", 6 )) {
+
+            speed = (ULONG)atol( &argv[i][6] );
+
+            if (speed == 0) {
+
+                goto CaptureReplay_Usage;
+            }
+
+        } else if (!_stricmp( argv[i], "fast" )) {
+
+            speed = 0;
+
+        } else if (!_strnicmp( argv[i], "out:", 4 )) {
+
+            outName = &argv[i][4];
+
+        } else if (!_stricmp( argv[i], "quiet" )) {
+
+            quiet = TRUE;
+
+        } else {
+
+            goto CaptureReplay_Usage;
+        }
+    }
+
+    file = fopen( argv[0], "rb" );
+
+    if (file == NULL) {
+
+        printf( "Could not open %s: error %d\n", argv[0], errno );
+        return 0;
+    }
+
+    if (!CaptureReadHeader( file, &fileHeader )) {
+
+        printf( "%s is not a minispy capture\n", argv[0] );
+        fclose( file );
+        return 0;
+    }
+
+    //
+    //  The batches go through the log thread's own path, with nothing
+    //  kept but what the arguments ask for.
+    //
+
+    ZeroMemory( &context, sizeof( context ) );
+    context.LogToScreen = (BOOLEAN)(!quiet && outName == NULL);
+    context.MergeWindow = MERGE_DEFAULT_WINDOW;
+
+    if (outName != NULL && !quiet) {
+
+        context.OutputFile = fopen( outName, "w" );
+
+        if (context.OutputFile == NULL) {
+
+            printf( "Could not open %s\n", outName );
+            fclose( file );
+            return 0;
+        }
+
+        context.LogToFile = TRUE;
+    }
+
+    buffer = HeapAlloc( GetProcessHeap(), 0, BUFFER_SIZE );
+
+    if (buffer == NULL) {
+
+        printf( "Out of memory\n" );
+        goto CaptureReplay_Cleanup;
+    }
+
+    MergeInitialize( &merge, context.MergeWindow );
+
+    QueryPerformanceFrequency( &frequency );
+    QueryPerformanceCounter( &started );
+
+    while (CaptureReadBatch( file, &header, buffer, BUFFER_SIZE )) {
+
+        if (batches == 0) {
+
+            firstTicks = header.Ticks.QuadPart;
+        }
+
+        //
+        //  Wait for the batch's time, as far into the replay as it was
+        //  into the capture, divided by the speed.
+        //
+
+        if (speed != 0) {
+
+            due = started.QuadPart +
+                  (LONGLONG)((double)(header.Ticks.QuadPart - firstTicks) /
+                             (double)fileHeader.Frequency.QuadPart /
+                             speed *
+                             (double)frequency.QuadPart);
+
+            QueryPerformanceCounter( &now );
+
+            if (now.QuadPart < due) {
+
+                Sleep( (DWORD)((due - now.QuadPart) * 1000 / frequency.QuadPart) );
+            }
+        }
+
+        LogProcessBatch( &context, &merge, buffer, header.Length );
+        batches++;
+    }
+
+    LogFlushMerge( &context, &merge );
+    MergeCleanup( &merge );
+    SequenceReport( &context.Sequence );
+
+    QueryPerformanceCounter( &now );
+    seconds = (double)(now.QuadPart - started.QuadPart) / (double)frequency.QuadPart;
+
+    printf( "Replayed %I64u batches, %ld records in %.3f s, %.0f records/s\n",
+            batches,
+            context.RecordsReceived,
+            seconds,
+            (seconds > 0) ? (double)context.RecordsReceived / seconds : 0.0 );
+
+    HeapFree( GetProcessHeap(), 0, buffer );
+
+CaptureReplay_Cleanup:
+
+    if (context.OutputFile != NULL) {
+
+        fclose( context.OutputFile );
+    }
+
+    fclose( file );
+    return 0;
+
+CaptureReplay_Usage:
+    printf( "Usage: minispy /v <file> [speed:<n>|fast] [out:<file>] [quiet]\n"
+            "    plays back a capture made with /z, at the pace it was taken, <n> times faster or as fast as it can go\n" );
+    return 1;
+}
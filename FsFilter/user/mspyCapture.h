@@ -0,0 +1,82 @@
+/*++
+
+Module Name:
+
+    mspyCapture.h
+
+Abstract:
+
+    This module contains the structures and prototypes of the batch
+    capture behind /z and its replay behind /v.  See mspyCapture.c, and
+    mspyReplay.h for the capture file.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYCAPTURE_H__
+#define __MSPYCAPTURE_H__
+
+#include "mspyLog.h"
+#include "mspyReplay.h"
+
+typedef struct _LOG_CAPTURE {
+
+    //
+    //  The log thread appends while the command prompt starts and stops
+    //  the capture.
+    //
+
+    CRITICAL_SECTION Lock;
+
+    //
+    //  The capture file, NULL while not capturing.
+    //
+
+    FILE *File;
+
+    ULONGLONG Batches;
+    ULONGLONG Bytes;
+
+} LOG_CAPTURE, *PLOG_CAPTURE;
+
+//
+//  Function prototypes
+//
+
+BOOLEAN
+CaptureInitialize (
+    __out PLOG_CAPTURE Capture
+    );
+
+VOID
+CaptureCleanup (
+    __inout PLOG_CAPTURE Capture
+    );
+
+DWORD
+CaptureStart (
+    __inout PLOG_CAPTURE Capture,
+    __in PCWSTR FileName
+    );
+
+VOID
+CaptureStop (
+    __inout PLOG_CAPTURE Capture
+    );
+
+VOID
+CaptureBatch (
+    __inout PLOG_CAPTURE Capture,
+    __in_bcount(Length) PCHAR Buffer,
+    __in DWORD Length
+    );
+
+int
+CaptureReplay (
+    __in int argc,
+    __in_ecount(argc) char *argv[]
+    );
+
+#endif //__MSPYCAPTURE_H__
@@ -0,0 +1,841 @@
+/*++
+
+Module Name:
+
+    mspyFile.c
+
+Abstract:
+
+    This module holds the file, clock and memory services of the log
+    writer and the query, on Win32 and on POSIX systems, so that the
+    writer, its index and the query can be built and measured on either.
+
+    A segment is written through the cache from aligned memory on both:
+    FILE_FLAG_NO_BUFFERING and FILE_FLAG_WRITE_THROUGH on Windows, and
+    O_DIRECT and O_DSYNC elsewhere.  O_DIRECT is dropped on file systems
+    that refuse it, which only leaves the writes going through the cache
+    on their way to disk.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mspyFile.h"
+
+#ifdef _WIN32
+#include <strsafe.h>
+
+#define LogFileNameCompare          _strnicmp
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+//  File names are case sensitive here.
+//
+
+#define LogFileNameCompare          strncmp
+#endif
+
+//
+//  Segment blocks are written from memory aligned to a page, which is a
+//  multiple of any sector size.
+//
+
+#define LOG_FILE_ALIGN              4096
+
+//
+//  Seconds from 1601, where system times start, to 1970.
+//
+
+#define LOG_CLOCK_EPOCH             11644473600ULL
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+BOOLEAN
+LogFilePath (
+    __out_ecount(LOG_FILE_PATH) PSTR Path,
+    __in PCSTR Directory,
+    __in PCSTR Prefix,
+    __in ULONG Number,
+    __in PCSTR Suffix
+    )
+/*++
+
+Routine Description:
+
+    Builds the name of a log file, Prefix followed by Number in eight
+    decimal digits and Suffix.
+
+Arguments:
+
+    Path - receives the name
+    Directory - where the file is
+    Prefix - what the file name starts with
+    Number - the number of the file
+    Suffix - what the file name ends with
+
+Return Value:
+
+    FALSE if the name does not fit in LOG_FILE_PATH characters.
+
+--*/
+{
+#ifdef _WIN32
+    return (BOOLEAN)SUCCEEDED( StringCchPrintfA( Path, LOG_FILE_PATH, "%s\\%s%08lu%s",
+                                                 Directory, Prefix, Number, Suffix ) );
+#else
+    int length = snprintf( Path, LOG_FILE_PATH, "%s/%s%08lu%s",
+                           Directory, Prefix, (unsigned long)Number, Suffix );
+
+    return (BOOLEAN)(length >= 0 && length < LOG_FILE_PATH);
+#endif
+}
+
+static
+BOOLEAN
+LogFileNumber (
+    __in PCSTR Name,
+    __in PCSTR Prefix,
+    __in PCSTR Suffix,
+    __out PULONG Number
+    )
+/*++
+
+Routine Description:
+
+    Reads the number out of the name of a log file.
+
+Arguments:
+
+    Name - the file name, without its directory
+    Prefix - what the file name should start with
+    Suffix - what the file name should end with
+    Number - receives the number
+
+Return Value:
+
+    FALSE if the name is not Prefix, a number and Suffix.
+
+--*/
+{
+    size_t prefixLength = strlen( Prefix );
+    size_t suffixLength = strlen( Suffix );
+    size_t length = strlen( Name );
+    char *end;
+
+    if (length <= prefixLength + suffixLength ||
+        LogFileNameCompare( Name, Prefix, prefixLength ) != 0 ||
+        LogFileNameCompare( Name + length - suffixLength, Suffix, suffixLength ) != 0 ||
+        Name[prefixLength] < '0' || Name[prefixLength] > '9') {
+
+        return FALSE;
+    }
+
+    *Number = (ULONG)strtoul( Name + prefixLength, &end, 10 );
+
+    return (BOOLEAN)(end == Name + length - suffixLength);
+}
+
+static
+int
+__cdecl
+LogFileCompareNumbers (
+    __in const void *First,
+    __in const void *Second
+    )
+/*++
+
+Routine Description:
+
+    Orders file numbers for qsort.
+
+Arguments:
+
+    First - a file number
+    Second - the one to compare it with
+
+Return Value:
+
+    Less than, equal to or greater than 0 as First is lower than, equal to
+    or higher than Second.
+
+--*/
+{
+    ULONG first = *(const ULONG *)First;
+    ULONG second = *(const ULONG *)Second;
+
+    return (first < second) ? -1 : (first > second);
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+ULONG
+LogFileOpen (
+    __in PCSTR Directory,
+    __in PCSTR Prefix,
+    __in ULONG Number,
+    __in PCSTR Suffix,
+    __in LOG_FILE_MODE Mode,
+    __in ULONGLONG Size,
+    __out LOG_FILE *File
+    )
+/*++
+
+Routine Description:
+
+    Opens a log file.  A segment must not exist yet; it is created and
+    preallocated to Size bytes, which read as zeroes until written.
+
+Arguments:
+
+    Directory - where the file is
+    Prefix - what the file name starts with
+    Number - the number of the file
+    Suffix - what the file name ends with
+    Mode - what the file is opened for
+    Size - the size of a segment, ignored otherwise
+    File - receives the open file, LOG_NO_FILE on failure
+
+Return Value:
+
+    ERROR_SUCCESS or the error that stopped it.
+
+--*/
+{
+    CHAR path[LOG_FILE_PATH];
+    ULONG result = ERROR_SUCCESS;
+#ifdef _WIN32
+    LARGE_INTEGER offset;
+#else
+    int flags;
+#endif
+
+    *File = LOG_NO_FILE;
+
+    if (!LogFilePath( path, Directory, Prefix, Number, Suffix )) {
+
+        return LOG_FILE_NAME_TOO_LONG;
+    }
+
+#ifdef _WIN32
+
+    switch (Mode) {
+
+        case LogFileModeSegment:
+            *File = CreateFileA( path,
+                                 GENERIC_WRITE,
+                                 FILE_SHARE_READ,
+                                 NULL,
+                                 CREATE_NEW,
+                                 FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH,
+                                 NULL );
+            break;
+
+        case LogFileModeIndex:
+            *File = CreateFileA( path,
+                                 GENERIC_WRITE,
+                                 FILE_SHARE_READ,
+                                 NULL,
+                                 CREATE_ALWAYS,
+                                 FILE_ATTRIBUTE_NORMAL,
+                                 NULL );
+            break;
+
+        default:
+
+            //
+            //  The writer may still have the file open.
+            //
+
+            *File = CreateFileA( path,
+                                 GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL,
+                                 OPEN_EXISTING,
+                                 FILE_FLAG_SEQUENTIAL_SCAN,
+                                 NULL );
+            break;
+    }
+
+    if (*File == INVALID_HANDLE_VALUE) {
+
+        return GetLastError();
+    }
+
+    if (Mode == LogFileModeSegment) {
+
+        offset.QuadPart = (LONGLONG)Size;
+
+        if (!SetFilePointerEx( *File, offset, NULL, FILE_BEGIN ) ||
+            !SetEndOfFile( *File )) {
+
+            result = GetLastError();
+            CloseHandle( *File );
+            DeleteFileA( path );
+            *File = INVALID_HANDLE_VALUE;
+            return result;
+        }
+
+        offset.QuadPart = 0;
+        SetFilePointerEx( *File, offset, NULL, FILE_BEGIN );
+    }
+
+#else
+
+    switch (Mode) {
+
+        case LogFileModeSegment:
+            flags = O_WRONLY | O_CREAT | O_EXCL | O_DSYNC;
+
+#ifdef O_DIRECT
+            *File = open( path, flags | O_DIRECT, 0644 );
+
+            if (*File < 0 && errno == EINVAL) {
+
+                unlink( path );
+                *File = open( path, flags, 0644 );
+            }
+#else
+            *File = open( path, flags, 0644 );
+#endif
+            break;
+
+        case LogFileModeIndex:
+            *File = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+            break;
+
+        default:
+            *File = open( path, O_RDONLY );
+            break;
+    }
+
+    if (*File < 0) {
+
+        *File = LOG_NO_FILE;
+        return errno;
+    }
+
+    if (Mode == LogFileModeSegment) {
+
+        result = posix_fallocate( *File, 0, (off_t)Size );
+
+        if (result != 0) {
+
+            close( *File );
+            unlink( path );
+            *File = LOG_NO_FILE;
+            return result;
+        }
+    }
+
+#endif
+
+    return result;
+}
+
+VOID
+LogFileClose (
+    __in LOG_FILE File
+    )
+/*++
+
+Routine Description:
+
+    Closes a log file.
+
+Arguments:
+
+    File - the file
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    CloseHandle( File );
+#else
+    close( File );
+#endif
+}
+
+ULONG
+LogFileWrite (
+    __in LOG_FILE File,
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Writes to a log file where the last write ended.  It has returned
+    once the bytes are on disk if the file is a segment.
+
+Arguments:
+
+    File - the file
+    Buffer - the bytes to write
+    Length - how many there are
+
+Return Value:
+
+    ERROR_SUCCESS or the error that stopped it.
+
+--*/
+{
+#ifdef _WIN32
+    DWORD written;
+
+    if (!WriteFile( File, Buffer, Length, &written, NULL )) {
+
+        return GetLastError();
+    }
+
+    return (written == Length) ? ERROR_SUCCESS : ERROR_DISK_FULL;
+#else
+    CONST UCHAR *next = Buffer;
+    ssize_t written;
+
+    while (Length != 0) {
+
+        written = write( File, next, Length );
+
+        if (written < 0) {
+
+            if (errno == EINTR) {
+
+                continue;
+            }
+
+            return errno;
+        }
+
+        if (written == 0) {
+
+            return ENOSPC;
+        }
+
+        next += written;
+        Length -= (ULONG)written;
+    }
+
+    return ERROR_SUCCESS;
+#endif
+}
+
+ULONG
+LogFileRead (
+    __in LOG_FILE File,
+    __in ULONGLONG Offset,
+    __out_bcount(Length) PVOID Buffer,
+    __in ULONG Length,
+    __out PULONG BytesRead
+    )
+/*++
+
+Routine Description:
+
+    Reads from a log file at the given offset.  Reading at or past the
+    end of the file reads nothing.
+
+Arguments:
+
+    File - the file
+    Offset - where to read from
+    Buffer - receives the bytes
+    Length - how many to read
+    BytesRead - receives how many were read
+
+Return Value:
+
+    ERROR_SUCCESS or the error that stopped it.
+
+--*/
+{
+#ifdef _WIN32
+    OVERLAPPED overlapped;
+    DWORD bytesRead;
+
+    ZeroMemory( &overlapped, sizeof( overlapped ) );
+    overlapped.Offset = (DWORD)Offset;
+    overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+
+    *BytesRead = 0;
+
+    if (!ReadFile( File, Buffer, Length, &bytesRead, &overlapped )) {
+
+        return (GetLastError() == ERROR_HANDLE_EOF) ? ERROR_SUCCESS : GetLastError();
+    }
+
+    *BytesRead = bytesRead;
+
+    return ERROR_SUCCESS;
+#else
+    ssize_t bytesRead;
+
+    *BytesRead = 0;
+
+    while (*BytesRead < Length) {
+
+        bytesRead = pread( File,
+                           (PUCHAR)Buffer + *BytesRead,
+                           Length - *BytesRead,
+                           (off_t)(Offset + *BytesRead) );
+
+        if (bytesRead < 0) {
+
+            if (errno == EINTR) {
+
+                continue;
+            }
+
+            return errno;
+        }
+
+        if (bytesRead == 0) {
+
+            break;
+        }
+
+        *BytesRead += (ULONG)bytesRead;
+    }
+
+    return ERROR_SUCCESS;
+#endif
+}
+
+VOID
+LogFileTrim (
+    __in LOG_FILE File,
+    __in ULONGLONG Length
+    )
+/*++
+
+Routine Description:
+
+    Cuts a segment down to what was written to it, giving back the space
+    preallocated past that.
+
+Arguments:
+
+    File - the segment
+    Length - the bytes to keep
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    LARGE_INTEGER end;
+
+    end.QuadPart = (LONGLONG)Length;
+
+    if (SetFilePointerEx( File, end, NULL, FILE_BEGIN )) {
+
+        SetEndOfFile( File );
+    }
+#else
+    if (ftruncate( File, (off_t)Length ) != 0) {
+
+        return;
+    }
+#endif
+}
+
+ULONG
+LogFileList (
+    __in PCSTR Directory,
+    __in PCSTR Prefix,
+    __in PCSTR Suffix,
+    __deref_out PULONG *Numbers
+    )
+/*++
+
+Routine Description:
+
+    Finds the numbers of the log files named Prefix, a number and Suffix
+    in a directory.
+
+Arguments:
+
+    Directory - where to look
+    Prefix - what the file names start with
+    Suffix - what the file names end with
+    Numbers - receives the numbers from lowest to highest, to be freed
+        with free, or NULL if there are none
+
+Return Value:
+
+    How many there are.
+
+--*/
+{
+    PULONG newNumbers;
+    ULONG count = 0;
+    ULONG capacity = 0;
+    ULONG number;
+#ifdef _WIN32
+    WIN32_FIND_DATAA findData;
+    CHAR pattern[LOG_FILE_PATH];
+    HANDLE find;
+#else
+    struct dirent *entry;
+    DIR *find;
+#endif
+    PCSTR name;
+
+    *Numbers = NULL;
+
+#ifdef _WIN32
+    if (FAILED( StringCchPrintfA( pattern, LOG_FILE_PATH, "%s\\%s*%s", Directory, Prefix, Suffix ) )) {
+
+        return 0;
+    }
+
+    find = FindFirstFileA( pattern, &findData );
+
+    if (find == INVALID_HANDLE_VALUE) {
+
+        return 0;
+    }
+
+    do {
+
+        name = findData.cFileName;
+#else
+    find = opendir( Directory );
+
+    if (find == NULL) {
+
+        return 0;
+    }
+
+    while ((entry = readdir( find )) != NULL) {
+
+        name = entry->d_name;
+#endif
+
+        if (!LogFileNumber( name, Prefix, Suffix, &number )) {
+
+            continue;
+        }
+
+        if (count == capacity) {
+
+            newNumbers = realloc( *Numbers, (capacity + 64) * sizeof( ULONG ) );
+
+            if (newNumbers == NULL) {
+
+                break;
+            }
+
+            *Numbers = newNumbers;
+            capacity += 64;
+        }
+
+        (*Numbers)[count++] = number;
+
+#ifdef _WIN32
+    } while (FindNextFileA( find, &findData ));
+
+    FindClose( find );
+#else
+    }
+
+    closedir( find );
+#endif
+
+    if (count != 0) {
+
+        qsort( *Numbers, count, sizeof( ULONG ), LogFileCompareNumbers );
+    }
+
+    return count;
+}
+
+PVOID
+LogFileAllocate (
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Allocates zeroed memory that segment blocks can be written from.
+
+Arguments:
+
+    Length - how many bytes
+
+Return Value:
+
+    The memory, or NULL if there was none.
+
+--*/
+{
+#ifdef _WIN32
+    return VirtualAlloc( NULL, Length, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE );
+#else
+    PVOID buffer;
+
+    if (posix_memalign( &buffer, LOG_FILE_ALIGN, Length ) != 0) {
+
+        return NULL;
+    }
+
+    memset( buffer, 0, Length );
+
+    return buffer;
+#endif
+}
+
+VOID
+LogFileFree (
+    __in PVOID Buffer
+    )
+/*++
+
+Routine Description:
+
+    Frees memory from LogFileAllocate.
+
+Arguments:
+
+    Buffer - the memory
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    VirtualFree( Buffer, 0, MEM_RELEASE );
+#else
+    free( Buffer );
+#endif
+}
+
+ULONG
+LogClockMilliseconds (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Reads a clock that counts milliseconds and wraps, like GetTickCount.
+    Only differences between its readings mean anything.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The count.
+
+--*/
+{
+#ifdef _WIN32
+    return GetTickCount();
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (ULONG)((ULONGLONG)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+#endif
+}
+
+ULONGLONG
+LogClockMicroseconds (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Reads a clock that counts microseconds, for timing commits.  Only
+    differences between its readings mean anything.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The count.
+
+--*/
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    QueryPerformanceFrequency( &frequency );
+    QueryPerformanceCounter( &counter );
+
+    return (ULONGLONG)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+           (ULONGLONG)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (ULONGLONG)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+VOID
+LogClockSystemTime (
+    __out PLARGE_INTEGER Time
+    )
+/*++
+
+Routine Description:
+
+    Reads the time of day as a system time, in 100 nanosecond units since
+    1601 in UTC, the unit of OriginatingTime.
+
+Arguments:
+
+    Time - receives the time
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    GetSystemTimeAsFileTime( (FILETIME *)Time );
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+
+    Time->QuadPart = (LONGLONG)(((ULONGLONG)now.tv_sec + LOG_CLOCK_EPOCH) * 10000000 + now.tv_nsec / 100);
+#endif
+}
@@ -0,0 +1,150 @@
+/*++
+
+Module Name:
+
+    mspyFile.h
+
+Abstract:
+
+    This module contains the few file, clock and lock services the log
+    writer and the query need, so that they build wherever mspyTypes.h
+    does.  See mspyFile.c.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYFILE_H__
+#define __MSPYFILE_H__
+
+#include "mspyTypes.h"
+
+#ifdef _WIN32
+
+typedef HANDLE LOG_FILE;
+#define LOG_NO_FILE                 INVALID_HANDLE_VALUE
+
+typedef CRITICAL_SECTION LOG_LOCK;
+#define LogLockInitialize(Lock)     InitializeCriticalSection( Lock )
+#define LogLockDelete(Lock)         DeleteCriticalSection( Lock )
+#define LogLockAcquire(Lock)        EnterCriticalSection( Lock )
+#define LogLockRelease(Lock)        LeaveCriticalSection( Lock )
+
+#define LOG_FILE_PATH               MAX_PATH
+#define LOG_FILE_NAME_TOO_LONG      ERROR_FILENAME_EXCED_RANGE
+
+#else
+
+#include <errno.h>
+#include <pthread.h>
+
+typedef int LOG_FILE;
+#define LOG_NO_FILE                 (-1)
+
+typedef pthread_mutex_t LOG_LOCK;
+#define LogLockInitialize(Lock)     pthread_mutex_init( (Lock), NULL )
+#define LogLockDelete(Lock)         pthread_mutex_destroy( Lock )
+#define LogLockAcquire(Lock)        pthread_mutex_lock( Lock )
+#define LogLockRelease(Lock)        pthread_mutex_unlock( Lock )
+
+#define LOG_FILE_PATH               1024
+#define LOG_FILE_NAME_TOO_LONG      ENAMETOOLONG
+
+#define ERROR_SUCCESS               0
+
+#endif // _WIN32
+
+//
+//  How a log file is opened.  A segment is created new, preallocated to
+//  its full size and written through the cache, so every write must be
+//  a multiple of LOG_WRITER_ALIGN from aligned memory, see
+//  LogFileAllocate.  An index is created or emptied and its writes are
+//  cached.  Either may be read while it is being written.
+//
+
+typedef enum _LOG_FILE_MODE {
+
+    LogFileModeSegment,
+    LogFileModeIndex,
+    LogFileModeRead
+
+} LOG_FILE_MODE;
+
+//
+//  Function prototypes.  Errors are Win32 error codes on Windows and
+//  errno values elsewhere, ERROR_SUCCESS for none.
+//
+
+ULONG
+LogFileOpen (
+    __in PCSTR Directory,
+    __in PCSTR Prefix,
+    __in ULONG Number,
+    __in PCSTR Suffix,
+    __in LOG_FILE_MODE Mode,
+    __in ULONGLONG Size,
+    __out LOG_FILE *File
+    );
+
+VOID
+LogFileClose (
+    __in LOG_FILE File
+    );
+
+ULONG
+LogFileWrite (
+    __in LOG_FILE File,
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length
+    );
+
+ULONG
+LogFileRead (
+    __in LOG_FILE File,
+    __in ULONGLONG Offset,
+    __out_bcount(Length) PVOID Buffer,
+    __in ULONG Length,
+    __out PULONG BytesRead
+    );
+
+VOID
+LogFileTrim (
+    __in LOG_FILE File,
+    __in ULONGLONG Length
+    );
+
+ULONG
+LogFileList (
+    __in PCSTR Directory,
+    __in PCSTR Prefix,
+    __in PCSTR Suffix,
+    __deref_out PULONG *Numbers
+    );
+
+PVOID
+LogFileAllocate (
+    __in ULONG Length
+    );
+
+VOID
+LogFileFree (
+    __in PVOID Buffer
+    );
+
+ULONG
+LogClockMilliseconds (
+    VOID
+    );
+
+ULONGLONG
+LogClockMicroseconds (
+    VOID
+    );
+
+VOID
+LogClockSystemTime (
+    __out PLARGE_INTEGER Time
+    );
+
+#endif //__MSPYFILE_H__
@@ -0,0 +1,531 @@
+/*++
+
+Module Name:
+
+    mspyIndex.c
+
+Abstract:
+
+    This module builds the index the log writer keeps beside each
+    segment.  Every block written gets one entry with the time range of
+    its records and two Bloom filters, one over the file names and the
+    directories above them and one over the processes.  A query reads the
+    index and only the blocks whose entries may hold what it looks for.
+
+    Keys are hashed with 64 bit FNV-1a over the upcased characters; the
+    two halves of the hash give the LOG_BLOOM_HASHES bit positions.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <string.h>
+#include <wctype.h>
+#include "mspyIndex.h"
+#include "mspyWriter.h"
+
+#define LOG_HASH_BASIS      0xCBF29CE484222325ULL
+#define LOG_HASH_PRIME      0x00000100000001B3ULL
+
+//
+//  Process ids are hashed from a different basis so an id never collides
+//  with an image name by construction.
+//
+
+#define LOG_HASH_ID_BASIS   0x84222325CBF29CE4ULL
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+ULONGLONG
+LogHashId (
+    __in FILE_ID Id
+    )
+/*++
+
+Routine Description:
+
+    Hashes a process id.
+
+Arguments:
+
+    Id - the process id
+
+Return Value:
+
+    The hash.
+
+--*/
+{
+    ULONGLONG hash = LOG_HASH_ID_BASIS;
+    ULONG i;
+
+    for (i = 0; i < sizeof( FILE_ID ); i++) {
+
+        hash = (hash ^ (UCHAR)(Id >> (i * 8))) * LOG_HASH_PRIME;
+    }
+
+    return hash;
+}
+
+static
+VOID
+LogBloomAdd (
+    __inout_bcount(Bits / 8) PUCHAR Bloom,
+    __in ULONG Bits,
+    __in ULONGLONG Hash
+    )
+/*++
+
+Routine Description:
+
+    Sets the bits of a key in a filter.
+
+Arguments:
+
+    Bloom - the filter
+    Bits - its size in bits
+    Hash - the hash of the key
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG first = (ULONG)Hash;
+    ULONG step = (ULONG)(Hash >> 32) | 1;
+    ULONG bit;
+    ULONG i;
+
+    for (i = 0; i < LOG_BLOOM_HASHES; i++) {
+
+        bit = (first + i * step) % Bits;
+        Bloom[bit / 8] |= (UCHAR)(1 << (bit % 8));
+    }
+}
+
+static
+BOOLEAN
+LogBloomTest (
+    __in_bcount(Bits / 8) CONST UCHAR *Bloom,
+    __in ULONG Bits,
+    __in ULONGLONG Hash
+    )
+/*++
+
+Routine Description:
+
+    Checks the bits of a key in a filter.
+
+Arguments:
+
+    Bloom - the filter
+    Bits - its size in bits
+    Hash - the hash of the key
+
+Return Value:
+
+    FALSE if the key was certainly not added.
+
+--*/
+{
+    ULONG first = (ULONG)Hash;
+    ULONG step = (ULONG)(Hash >> 32) | 1;
+    ULONG bit;
+    ULONG i;
+
+    for (i = 0; i < LOG_BLOOM_HASHES; i++) {
+
+        bit = (first + i * step) % Bits;
+
+        if (!FlagOn( Bloom[bit / 8], 1 << (bit % 8) )) {
+
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static
+CONST WCHAR *
+LogNextLine (
+    __in CONST WCHAR *Line,
+    __in CONST WCHAR *End,
+    __out PULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Finds the end of the '\n' terminated line starting at Line.
+
+Arguments:
+
+    Line - where the line starts
+    End - the end of the record
+    Length - receives the length of the line in characters
+
+Return Value:
+
+    Where the next line starts, or End if there is none.
+
+--*/
+{
+    CONST WCHAR *next = Line;
+
+    while (next < End && *next != L'\n' && *next != UNICODE_NULL) {
+
+        next++;
+    }
+
+    *Length = (ULONG)(next - Line);
+
+    if (next >= End || *next == UNICODE_NULL) {
+
+        return End;
+    }
+
+    return next + 1;
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+LogRecordNames (
+    __in PLOG_RECORD LogRecord,
+    __out PLOG_RECORD_NAMES Names
+    )
+/*++
+
+Routine Description:
+
+    Picks the file name, the process image name and the user out of a
+    record.  A summary record names only a process, a gap record
+    nothing.
+
+Arguments:
+
+    LogRecord - the record, whose Length has been checked
+    Names - receives the views
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CONST WCHAR *end = (CONST WCHAR *)Add2Ptr( LogRecord, LogRecord->Length );
+    CONST WCHAR *line = LogRecord->Name;
+    CONST WCHAR *image;
+    CONST WCHAR *next;
+    ULONG length;
+
+    memset( Names, 0, sizeof( LOG_RECORD_NAMES ) );
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP )) {
+
+        return;
+    }
+
+    if (!FlagOn( LogRecord->RecordType, RECORD_TYPE_SUMMARY )) {
+
+        Names->Path = line;
+        line = LogNextLine( line, end, &Names->PathLength );
+    }
+
+    next = LogNextLine( line, end, &length );
+
+    //
+    //  The padding after the image leads the user's line.
+    //
+
+    while (next < end && *next == L' ') {
+
+        next++;
+    }
+
+    Names->User = next;
+    LogNextLine( next, end, &Names->UserLength );
+
+    image = line + length;
+
+    while (image > line && image[-1] != L'\\') {
+
+        image--;
+    }
+
+    Names->Image = image;
+    Names->ImageLength = length - (ULONG)(image - line);
+}
+
+VOID
+LogIndexStart (
+    __out PLOG_INDEX_ENTRY Entry
+    )
+/*++
+
+Routine Description:
+
+    Empties an entry for the next block.
+
+Arguments:
+
+    Entry - the entry
+
+Return Value:
+
+    None.
+
+--*/
+{
+    memset( Entry, 0, sizeof( LOG_INDEX_ENTRY ) );
+    Entry->FirstTime.QuadPart = MAXLONGLONG;
+}
+
+VOID
+LogIndexAddRecords (
+    __inout PLOG_INDEX_ENTRY Entry,
+    __in_bcount(Length) CONST VOID *Records,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Adds a batch of records to the entry of the block they go in.
+
+Arguments:
+
+    Entry - the entry
+    Records - the LOG_RECORD structures, one after another, already
+        checked by the log thread
+    Length - their size in bytes
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PLOG_RECORD logRecord = (PLOG_RECORD)Records;
+    PLOG_RECORD end = (PLOG_RECORD)Add2Ptr( Records, Length );
+    LOG_RECORD_NAMES names;
+    ULONG i;
+
+    for (; logRecord < end; logRecord = (PLOG_RECORD)Add2Ptr( logRecord, logRecord->Length )) {
+
+        Entry->Records++;
+
+        LogRecordNames( logRecord, &names );
+
+        if (FlagOn( logRecord->RecordType, RECORD_TYPE_GAP )) {
+
+            continue;
+        }
+
+        if (logRecord->Data.OriginatingTime.QuadPart < Entry->FirstTime.QuadPart) {
+
+            Entry->FirstTime = logRecord->Data.OriginatingTime;
+        }
+
+        if (logRecord->Data.OriginatingTime.QuadPart > Entry->LastTime.QuadPart) {
+
+            Entry->LastTime = logRecord->Data.OriginatingTime;
+        }
+
+        //
+        //  The file name itself and every directory above it, so a query
+        //  for a directory finds everything under it.
+        //
+
+        if (names.PathLength != 0) {
+
+            LogBloomAdd( Entry->PathBloom,
+                         LOG_BLOOM_PATH_BITS,
+                         LogHashName( names.Path, names.PathLength ) );
+
+            for (i = 1; i < names.PathLength; i++) {
+
+                if (names.Path[i] == L'\\') {
+
+                    LogBloomAdd( Entry->PathBloom,
+                                 LOG_BLOOM_PATH_BITS,
+                                 LogHashName( names.Path, i ) );
+                }
+            }
+        }
+
+        if (names.ImageLength != 0) {
+
+            LogBloomAdd( Entry->ProcessBloom,
+                         LOG_BLOOM_PROCESS_BITS,
+                         LogHashName( names.Image, names.ImageLength ) );
+        }
+
+        LogBloomAdd( Entry->ProcessBloom,
+                     LOG_BLOOM_PROCESS_BITS,
+                     LogHashId( logRecord->Data.ProcessId ) );
+    }
+}
+
+VOID
+LogIndexFinish (
+    __inout PLOG_INDEX_ENTRY Entry,
+    __in ULONGLONG Block,
+    __in ULONGLONG Offset,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Completes the entry of a block that has been written.
+
+Arguments:
+
+    Entry - the entry
+    Block - the number of the block
+    Offset - where it was written in its segment
+    Length - how long it is, padding included
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Entry->FirstTime.QuadPart > Entry->LastTime.QuadPart) {
+
+        Entry->FirstTime.QuadPart = 0;
+        Entry->LastTime.QuadPart = 0;
+    }
+
+    Entry->Signature = LOG_INDEX_SIGNATURE;
+    Entry->Block = Block;
+    Entry->Offset = Offset;
+    Entry->Length = Length;
+    Entry->Checksum = LogWriterChecksum( &Entry->Block,
+                                         sizeof( LOG_INDEX_ENTRY ) - FIELD_OFFSET( LOG_INDEX_ENTRY, Block ) );
+}
+
+BOOLEAN
+LogIndexValid (
+    __in PLOG_INDEX_ENTRY Entry
+    )
+/*++
+
+Routine Description:
+
+    Checks an entry read back from an index.
+
+Arguments:
+
+    Entry - the entry
+
+Return Value:
+
+    TRUE if the entry was written whole.
+
+--*/
+{
+    return (BOOLEAN)(Entry->Signature == LOG_INDEX_SIGNATURE &&
+                     Entry->Checksum == LogWriterChecksum( &Entry->Block,
+                                                           sizeof( LOG_INDEX_ENTRY ) - FIELD_OFFSET( LOG_INDEX_ENTRY, Block ) ));
+}
+
+ULONGLONG
+LogHashName (
+    __in_ecount(Length) CONST WCHAR *Key,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Hashes a name, ignoring case.
+
+Arguments:
+
+    Key - the name
+    Length - its length in characters
+
+Return Value:
+
+    The hash.
+
+--*/
+{
+    ULONGLONG hash = LOG_HASH_BASIS;
+
+    while (Length-- != 0) {
+
+        hash = (hash ^ (USHORT)towupper( *Key++ )) * LOG_HASH_PRIME;
+    }
+
+    return hash;
+}
+
+BOOLEAN
+LogBloomMayContain (
+    __in_bcount(Bits / 8) CONST UCHAR *Bloom,
+    __in ULONG Bits,
+    __in_ecount(Length) CONST WCHAR *Key,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Tells whether a name may have been added to a filter.
+
+Arguments:
+
+    Bloom - the filter
+    Bits - its size in bits
+    Key - the name, in any case
+    Length - its length in characters
+
+Return Value:
+
+    FALSE if the name was certainly not added.
+
+--*/
+{
+    return LogBloomTest( Bloom, Bits, LogHashName( Key, Length ) );
+}
+
+BOOLEAN
+LogBloomMayContainId (
+    __in_bcount(Bits / 8) CONST UCHAR *Bloom,
+    __in ULONG Bits,
+    __in FILE_ID Id
+    )
+/*++
+
+Routine Description:
+
+    Tells whether a process id may have been added to a filter.
+
+Arguments:
+
+    Bloom - the filter
+    Bits - its size in bits
+    Id - the process id
+
+Return Value:
+
+    FALSE if the id was certainly not added.
+
+--*/
+{
+    return LogBloomTest( Bloom, Bits, LogHashId( Id ) );
+}
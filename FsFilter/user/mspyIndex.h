@@ -0,0 +1,160 @@
+/*++
+
+Module Name:
+
+    mspyIndex.h
+
+Abstract:
+
+    This module contains the structures and prototypes of the index the
+    log writer keeps beside each segment, and of the query that uses it.
+    See mspyIndex.c, mspySearch.c and mspyQuery.c.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYINDEX_H__
+#define __MSPYINDEX_H__
+
+#include "mspyTypes.h"
+#include "miniSpy.h"
+
+//
+//  Each segment "minispy-NNNNNNNN.log" has an index of the same name
+//  ending in LOG_INDEX_SUFFIX, holding one LOG_INDEX_ENTRY per block in
+//  the order the blocks were written.
+//
+
+#define LOG_INDEX_SUFFIX            ".idx"
+#define LOG_INDEX_SIGNATURE         'XISM'
+
+//
+//  Sizes of the Bloom filters, in bits, and how many bits each key sets.
+//  A 1 MB block holds a few thousand records; the path filter is sized
+//  for that many distinct keys at a few percent false positives.
+//
+
+#define LOG_BLOOM_PATH_BITS         32768
+#define LOG_BLOOM_PROCESS_BITS      2048
+#define LOG_BLOOM_HASHES            3
+
+typedef struct _LOG_INDEX_ENTRY {
+
+    ULONG Signature;
+
+    //
+    //  CRC-32 of the entry from Block on.  The index is written after the
+    //  block it describes and is not written through, so after a crash it
+    //  can end early or in a torn entry; the query then reads the rest of
+    //  the segment block by block.
+    //
+
+    ULONG Checksum;
+
+    ULONGLONG Block;
+    ULONGLONG Offset;           //  Of the block in its segment
+    ULONG Length;               //  Of the block, padding included
+    ULONG Records;
+
+    //
+    //  Earliest and latest OriginatingTime of the records in the block.
+    //
+
+    LARGE_INTEGER FirstTime;
+    LARGE_INTEGER LastTime;
+
+    //
+    //  The path filter holds every file name in the block and every
+    //  directory above it.  The process filter holds the image name and
+    //  process id of every record.  Both are case insensitive.
+    //
+
+    UCHAR PathBloom[LOG_BLOOM_PATH_BITS / 8];
+    UCHAR ProcessBloom[LOG_BLOOM_PROCESS_BITS / 8];
+
+} LOG_INDEX_ENTRY, *PLOG_INDEX_ENTRY;
+
+//
+//  The fields of a record's name the index, the query and the sketches
+//  look at.  The views point into the record and are not NULL
+//  terminated.
+//
+
+typedef struct _LOG_RECORD_NAMES {
+
+    CONST WCHAR *Path;
+    ULONG PathLength;           //  In characters
+
+    CONST WCHAR *Image;         //  Last component of the process image
+    ULONG ImageLength;
+
+    CONST WCHAR *User;
+    ULONG UserLength;
+
+} LOG_RECORD_NAMES, *PLOG_RECORD_NAMES;
+
+//
+//  Function prototypes
+//
+
+VOID
+LogIndexStart (
+    __out PLOG_INDEX_ENTRY Entry
+    );
+
+VOID
+LogIndexAddRecords (
+    __inout PLOG_INDEX_ENTRY Entry,
+    __in_bcount(Length) CONST VOID *Records,
+    __in ULONG Length
+    );
+
+VOID
+LogIndexFinish (
+    __inout PLOG_INDEX_ENTRY Entry,
+    __in ULONGLONG Block,
+    __in ULONGLONG Offset,
+    __in ULONG Length
+    );
+
+BOOLEAN
+LogIndexValid (
+    __in PLOG_INDEX_ENTRY Entry
+    );
+
+VOID
+LogRecordNames (
+    __in PLOG_RECORD LogRecord,
+    __out PLOG_RECORD_NAMES Names
+    );
+
+ULONGLONG
+LogHashName (
+    __in_ecount(Length) CONST WCHAR *Key,
+    __in ULONG Length
+    );
+
+BOOLEAN
+LogBloomMayContain (
+    __in_bcount(Bits / 8) CONST UCHAR *Bloom,
+    __in ULONG Bits,
+    __in_ecount(Length) CONST WCHAR *Key,
+    __in ULONG Length
+    );
+
+BOOLEAN
+LogBloomMayContainId (
+    __in_bcount(Bits / 8) CONST UCHAR *Bloom,
+    __in ULONG Bits,
+    __in FILE_ID Id
+    );
+
+int
+LogQuery (
+    __in int argc,
+    __in_ecount(argc) char *argv[]
+    );
+
+#endif //__MSPYINDEX_H__
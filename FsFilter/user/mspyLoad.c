@@ -0,0 +1,626 @@
+/*++
+
+Module Name:
+
+    mspyLoad.c
+
+Abstract:
+
+    This module runs a synthetic workload of creates, writes, renames and
+    deletes in a directory and reports how long each kind of operation
+    took and how fast the filter's records came in meanwhile.  Run in a
+    protected folder and out of one, or with the filter attached and
+    detached, it gives the filter's cost per operation for a given mix.
+
+    Each thread works on files of its own, named after the thread, so
+    the threads only meet in the directory and in the filter.  Every
+    operation is timed on its own with the performance counter.  The
+    report gives the count, the rate and the 50th, 99th and 99.9th
+    percentiles of each kind of operation, in the same form from one run
+    to the next so runs of different versions can be set side by side.
+
+    The files are deleted at the end; the deletes of the office and
+    build workloads are timed like any other.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <DriverSpecs.h>
+__user_code
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include <strsafe.h>
+#include "mspyLoad.h"
+
+static const PCHAR LoadMixNames[LoadMixes] = { "office", "build", "churn" };
+
+static const PCHAR LoadOperationNames[LoadOperations] = { "create", "write", "rename", "delete" };
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+ULONG
+LoadBucket (
+    __in ULONGLONG Ticks
+    )
+/*++
+
+Routine Description:
+
+    Works out the histogram bucket of a time.  Times under 4 ticks have a
+    bucket each; above that each power of two is split in four.  Times of
+    2^25 ticks or more all go in the last bucket.
+
+Arguments:
+
+    Ticks - the time
+
+Return Value:
+
+    The bucket.
+
+--*/
+{
+    ULONG high;
+
+    if (Ticks < 4) {
+
+        return (ULONG)Ticks;
+    }
+
+    if ((Ticks >> 25) != 0) {
+
+        return LOAD_BUCKETS - 1;
+    }
+
+    _BitScanReverse( &high, (ULONG)Ticks );
+
+    return 4 + (high - 2) * 4 + (ULONG)((Ticks >> (high - 2)) & 3);
+}
+
+
+static
+ULONGLONG
+LoadPercentile (
+    __in_ecount(LOAD_BUCKETS) PULONGLONG Histogram,
+    __in ULONGLONG Count,
+    __in ULONG PerMille,
+    __in ULONGLONG Longest
+    )
+/*++
+
+Routine Description:
+
+    Finds the time under which PerMille thousandths of the operations
+    took.
+
+Arguments:
+
+    Histogram - the summed histogram of an operation
+    Count - the operations in Histogram, not 0
+    PerMille - the percentile, in thousandths
+    Longest - the longest time, which bounds the last bucket
+
+Return Value:
+
+    The top of the bucket the percentile falls in, in ticks.
+
+--*/
+{
+    ULONGLONG rank = (Count * PerMille + 999) / 1000;
+    ULONGLONG seen = 0;
+    ULONG high;
+    ULONG b;
+
+    for (b = 0; b < LOAD_BUCKETS - 1; b++) {
+
+        seen += Histogram[b];
+
+        if (seen >= rank) {
+
+            if (b < 4) {
+
+                return b;
+            }
+
+            high = (b - 4) / 4 + 2;
+
+            return min( (ULONGLONG)(5 + (b - 4) % 4) << (high - 2), Longest );
+        }
+    }
+
+    return Longest;
+}
+
+
+static
+VOID
+LoadCount (
+    __inout PLOAD_THREAD Thread,
+    __in LOAD_OPERATION Operation,
+    __in LONGLONG Start,
+    __in BOOL Succeeded
+    )
+/*++
+
+Routine Description:
+
+    Counts an operation that started at Start and has just ended.
+
+Arguments:
+
+    Thread - the thread that ran it
+    Operation - what it was
+    Start - the performance counter when it started
+    Succeeded - whether it did
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LARGE_INTEGER now;
+    ULONGLONG elapsed;
+
+    QueryPerformanceCounter( &now );
+
+    if (!Succeeded) {
+
+        Thread->Failed[Operation]++;
+        return;
+    }
+
+    elapsed = (ULONGLONG)(now.QuadPart - Start);
+
+    Thread->Count[Operation]++;
+    Thread->Histogram[Operation][LoadBucket( elapsed )]++;
+
+    if (elapsed > Thread->Longest[Operation]) {
+
+        Thread->Longest[Operation] = elapsed;
+    }
+}
+
+
+static
+BOOL
+LoadCreateFile (
+    __inout PLOAD_THREAD Thread,
+    __in PCWSTR Name,
+    __in DWORD Disposition,
+    __in_bcount(Size) PUCHAR Buffer,
+    __in ULONG Size
+    )
+/*++
+
+Routine Description:
+
+    Opens or creates a file, timed as a create, writes Size bytes to it
+    in LOAD_WRITE_SIZE pieces, each timed as a write, and closes it.
+
+Arguments:
+
+    Thread - the thread doing it
+    Name - the file
+    Disposition - OPEN_ALWAYS or CREATE_ALWAYS
+    Buffer - what to write, at least LOAD_WRITE_SIZE bytes
+    Size - how much to write
+
+Return Value:
+
+    TRUE if the file could be created.
+
+--*/
+{
+    LARGE_INTEGER start;
+    HANDLE file;
+    ULONG written;
+    DWORD length;
+    BOOL succeeded;
+
+    QueryPerformanceCounter( &start );
+
+    file = CreateFileW( Name,
+                        GENERIC_WRITE,
+                        FILE_SHARE_READ,
+                        NULL,
+                        Disposition,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL );
+
+    LoadCount( Thread, LoadCreate, start.QuadPart, (file != INVALID_HANDLE_VALUE) );
+
+    if (file == INVALID_HANDLE_VALUE) {
+
+        return FALSE;
+    }
+
+    for (written = 0; written < Size; written += length) {
+
+        length = min( Size - written, LOAD_WRITE_SIZE );
+
+        QueryPerformanceCounter( &start );
+
+        succeeded = WriteFile( file, Buffer, length, &length, NULL );
+
+        LoadCount( Thread, LoadWrite, start.QuadPart, succeeded );
+
+        if (!succeeded || length == 0) {
+
+            break;
+        }
+    }
+
+    CloseHandle( file );
+    return TRUE;
+}
+
+
+static
+DWORD
+WINAPI
+LoadThread (
+    __in LPVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Runs the workload for one thread.
+
+Arguments:
+
+    Parameter - the LOAD_THREAD
+
+Return Value:
+
+    0.
+
+--*/
+{
+    PLOAD_THREAD thread = (PLOAD_THREAD)Parameter;
+    PLOAD_SETTINGS settings = thread->Settings;
+    UCHAR buffer[LOAD_WRITE_SIZE];
+    WCHAR name[MAX_PATH];
+    WCHAR other[MAX_PATH];
+    LARGE_INTEGER start;
+    BOOL succeeded;
+    ULONG i;
+
+    FillMemory( buffer, sizeof( buffer ), 'y' );
+
+    for (i = 0; i < settings->Files; i++) {
+
+        StringCchPrintfW( name, MAX_PATH, L"%s\\mspyload-%lu-%lu.dat", settings->Directory, thread->Index, i );
+        StringCchPrintfW( other, MAX_PATH, L"%s\\mspyload-%lu-%lu.tmp", settings->Directory, thread->Index, i );
+
+        switch (settings->Mix) {
+
+        case LoadMixOffice:
+
+            if (LoadCreateFile( thread, name, OPEN_ALWAYS, buffer, settings->Size ) &&
+                LoadCreateFile( thread, other, CREATE_ALWAYS, buffer, settings->Size )) {
+
+                QueryPerformanceCounter( &start );
+                succeeded = MoveFileExW( other, name, MOVEFILE_REPLACE_EXISTING );
+                LoadCount( thread, LoadRename, start.QuadPart, succeeded );
+
+                if (!succeeded) {
+
+                    DeleteFileW( other );
+                }
+            }
+            break;
+
+        case LoadMixBuild:
+
+            LoadCreateFile( thread, name, CREATE_ALWAYS, buffer, settings->Size );
+            break;
+
+        case LoadMixChurn:
+
+            if (LoadCreateFile( thread, name, CREATE_ALWAYS, buffer, min( settings->Size, LOAD_WRITE_SIZE ) )) {
+
+                QueryPerformanceCounter( &start );
+                succeeded = MoveFileExW( name, other, MOVEFILE_REPLACE_EXISTING );
+                LoadCount( thread, LoadRename, start.QuadPart, succeeded );
+
+                QueryPerformanceCounter( &start );
+                succeeded = DeleteFileW( succeeded ? other : name );
+                LoadCount( thread, LoadDelete, start.QuadPart, succeeded );
+            }
+            break;
+        }
+    }
+
+    //
+    //  Clean up after the office and build workloads; churn has deleted
+    //  its files already.
+    //
+
+    if (settings->Mix != LoadMixChurn) {
+
+        for (i = 0; i < settings->Files; i++) {
+
+            StringCchPrintfW( name, MAX_PATH, L"%s\\mspyload-%lu-%lu.dat", settings->Directory, thread->Index, i );
+
+            QueryPerformanceCounter( &start );
+            succeeded = DeleteFileW( name );
+            LoadCount( thread, LoadDelete, start.QuadPart, succeeded );
+        }
+    }
+
+    return 0;
+}
+
+
+static
+VOID
+LoadReport (
+    __in PLOAD_SETTINGS Settings,
+    __in_ecount(Settings->Threads) PLOAD_THREAD Threads,
+    __in ULONGLONG Elapsed,
+    __in ULONGLONG Frequency,
+    __in LONG Records
+    )
+/*++
+
+Routine Description:
+
+    Prints what the threads counted.
+
+Arguments:
+
+    Settings - the workload
+    Threads - the threads that ran it
+    Elapsed - how long the run took, in ticks
+    Frequency - of the performance counter
+    Records - how many records came in during the run
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONGLONG histogram[LOAD_BUCKETS];
+    ULONGLONG count;
+    ULONGLONG longest;
+    ULONG failed;
+    double seconds = (double)Elapsed / (double)Frequency;
+    double usPerTick = 1000000.0 / (double)Frequency;
+    ULONG op;
+    ULONG t;
+    ULONG b;
+
+    printf( "    Workload %s, %lu files of %lu KB on each of %lu threads, %.3f s\n",
+            LoadMixNames[Settings->Mix],
+            Settings->Files,
+            Settings->Size / 1024,
+            Settings->Threads,
+            seconds );
+
+    printf( "    operation      count      ops/s   p50 us   p99 us p99.9 us  max us  failed\n" );
+
+    for (op = 0; op < LoadOperations; op++) {
+
+        ZeroMemory( histogram, sizeof( histogram ) );
+        count = 0;
+        longest = 0;
+        failed = 0;
+
+        for (t = 0; t < Settings->Threads; t++) {
+
+            count += Threads[t].Count[op];
+            failed += Threads[t].Failed[op];
+            longest = max( longest, Threads[t].Longest[op] );
+
+            for (b = 0; b < LOAD_BUCKETS; b++) {
+
+                histogram[b] += Threads[t].Histogram[op][b];
+            }
+        }
+
+        if (count == 0 && failed == 0) {
+
+            continue;
+        }
+
+        if (count == 0) {
+
+            printf( "    %-9s %10I64u %10s %8s %8s %8s %7s %7lu\n",
+                    LoadOperationNames[op], count, "-", "-", "-", "-", "-", failed );
+            continue;
+        }
+
+        printf( "    %-9s %10I64u %10.0f %8.1f %8.1f %8.1f %7.0f %7lu\n",
+                LoadOperationNames[op],
+                count,
+                (double)count / seconds,
+                (double)LoadPercentile( histogram, count, 500, longest ) * usPerTick,
+                (double)LoadPercentile( histogram, count, 990, longest ) * usPerTick,
+                (double)LoadPercentile( histogram, count, 999, longest ) * usPerTick,
+                (double)longest * usPerTick,
+                failed );
+    }
+
+    printf( "    records   %10ld %10.0f\n", Records, (double)Records / seconds );
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+BOOLEAN
+LoadRun (
+    __in int argc,
+    __in_ecount(argc) char *argv[],
+    __in PLOG_CONTEXT Context
+    )
+/*++
+
+Routine Description:
+
+    Runs a /y workload from terms:
+
+        <directory>                 where to make the files, first
+        office, build or churn      the workload, office if not given
+        files:<n>                   files per thread, 1000 if not given
+        threads:<n>                 threads, 1 if not given
+        size:<KB>                   size of each file, 64 KB if not given
+
+    and prints the report.  The records counted are those the log thread
+    took in while the workload ran; the filter sends records at its own
+    pace, so the rate is only meaningful for runs of some seconds.
+
+Arguments:
+
+    argc - the number of terms
+    argv - the terms
+    Context - the log context, for the record count
+
+Return Value:
+
+    FALSE if the terms are not valid.
+
+--*/
+{
+    LOAD_SETTINGS settings;
+    PLOAD_THREAD threads;
+    HANDLE handles[LOAD_MAX_THREADS];
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    LONG records;
+    ULONG started;
+    ULONG t;
+    int i;
+    int j;
+
+    if (argc < 1) {
+
+        return FALSE;
+    }
+
+    ZeroMemory( &settings, sizeof( settings ) );
+
+    if (FAILED( StringCchPrintfW( settings.Directory, MAX_PATH, L"%S", argv[0] ) )) {
+
+        return FALSE;
+    }
+
+    settings.Mix = LoadMixOffice;
+    settings.Files = 1000;
+    settings.Threads = 1;
+    settings.Size = 64 * 1024;
+
+    for (i = 1; i < argc; i++) {
+
+        if (!_strnicmp( argv[i], "files:", 6 )) {
+
+            settings.Files = (ULONG)atol( &argv[i][6] );
+
+        } else if (!_strnicmp( argv[i], "threads:", 8 )) {
+
+            settings.Threads = (ULONG)atol( &argv[i][8] );
+
+            if (settings.Threads == 0 || settings.Threads > LOAD_MAX_THREADS) {
+
+                return FALSE;
+            }
+
+        } else if (!_strnicmp( argv[i], "size:", 5 )) {
+
+            settings.Size = (ULONG)atol( &argv[i][5] ) * 1024;
+
+        } else {
+
+            for (j = 0; j < LoadMixes; j++) {
+
+                if (!_stricmp( argv[i], LoadMixNames[j] )) {
+
+                    break;
+                }
+            }
+
+            if (j == LoadMixes) {
+
+                return FALSE;
+            }
+
+            settings.Mix = (LOAD_MIX)j;
+        }
+    }
+
+    if (!CreateDirectoryW( settings.Directory, NULL ) &&
+        GetLastError() != ERROR_ALREADY_EXISTS) {
+
+        printf( "    Could not create %S: %lu\n", settings.Directory, GetLastError() );
+        return TRUE;
+    }
+
+    threads = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY, settings.Threads * sizeof( LOAD_THREAD ) );
+
+    if (threads == NULL) {
+
+        printf( "    Out of memory\n" );
+        return TRUE;
+    }
+
+    QueryPerformanceFrequency( &frequency );
+    QueryPerformanceCounter( &start );
+    records = Context->RecordsReceived;
+
+    for (started = 0; started < settings.Threads; started++) {
+
+        threads[started].Settings = &settings;
+        threads[started].Index = started;
+
+        handles[started] = CreateThread( NULL, 0, LoadThread, &threads[started], 0, NULL );
+
+        if (handles[started] == NULL) {
+
+            break;
+        }
+    }
+
+    if (started > 0) {
+
+        WaitForMultipleObjects( started, handles, TRUE, INFINITE );
+    }
+
+    QueryPerformanceCounter( &end );
+    records = Context->RecordsReceived - records;
+
+    for (t = 0; t < started; t++) {
+
+        CloseHandle( handles[t] );
+    }
+
+    if (started < settings.Threads) {
+
+        printf( "    Only %lu of %lu threads could be started\n", started, settings.Threads );
+        settings.Threads = started;
+    }
+
+    if (started > 0) {
+
+        LoadReport( &settings,
+                    threads,
+                    (ULONGLONG)(end.QuadPart - start.QuadPart),
+                    (ULONGLONG)frequency.QuadPart,
+                    records );
+    }
+
+    HeapFree( GetProcessHeap(), 0, threads );
+    return TRUE;
+}
@@ -0,0 +1,94 @@
+/*++
+
+Module Name:
+
+    mspyLoad.h
+
+Abstract:
+
+    This module contains the structures and prototypes of the workload
+    generator behind /y, which drives file operations through the filter
+    and reports what they cost.  See mspyLoad.c.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYLOAD_H__
+#define __MSPYLOAD_H__
+
+#include "mspyLog.h"
+
+//
+//  The workloads.  Office saves a document the way Office does: opens
+//  it with OPEN_ALWAYS and rewrites it, then writes a temporary copy and
+//  renames it over the document.  Build writes new files in 4 KB pieces,
+//  as a compiler writes objects.  Churn creates small files, renames and
+//  deletes them, as a mass cleanup does.
+//
+
+typedef enum _LOAD_MIX {
+
+    LoadMixOffice = 0,
+    LoadMixBuild,
+    LoadMixChurn,
+    LoadMixes
+
+} LOAD_MIX;
+
+typedef enum _LOAD_OPERATION {
+
+    LoadCreate = 0,
+    LoadWrite,
+    LoadRename,
+    LoadDelete,
+    LoadOperations
+
+} LOAD_OPERATION;
+
+#define LOAD_MAX_THREADS        MAXIMUM_WAIT_OBJECTS
+#define LOAD_WRITE_SIZE         4096
+
+//
+//  Times are kept in histograms of performance counter ticks, four
+//  buckets to each power of two.
+//
+
+#define LOAD_BUCKETS            96
+
+typedef struct _LOAD_SETTINGS {
+
+    WCHAR Directory[MAX_PATH];
+
+    LOAD_MIX Mix;
+    ULONG Files;                //  Per thread
+    ULONG Threads;
+    ULONG Size;                 //  Of each file, in bytes
+
+} LOAD_SETTINGS, *PLOAD_SETTINGS;
+
+typedef struct _LOAD_THREAD {
+
+    PLOAD_SETTINGS Settings;
+    ULONG Index;
+
+    ULONGLONG Count[LoadOperations];
+    ULONG Failed[LoadOperations];
+    ULONGLONG Longest[LoadOperations];
+    ULONG Histogram[LoadOperations][LOAD_BUCKETS];
+
+} LOAD_THREAD, *PLOAD_THREAD;
+
+//
+//  Function prototypes
+//
+
+BOOLEAN
+LoadRun (
+    __in int argc,
+    __in_ecount(argc) char *argv[],
+    __in PLOG_CONTEXT Context
+    );
+
+#endif //__MSPYLOAD_H__
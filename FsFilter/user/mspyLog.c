@@ -27,6 +27,15 @@ __user_code
 //#include <psapi.h>
 #include "mspyLog.h"
 
+#ifdef __DLL_EXPORT__
+#include "mspyBatch.h"
+#else
+#include "mspyMerge.h"
+#include "mspyWriter.h"
+#include "mspySketch.h"
+#include "mspyCapture.h"
+#endif
+
 #pragma comment(lib, "psapi.lib")
 
 #define TIME_BUFFER_LENGTH 30
@@ -220,6 +229,420 @@ Return Value:
     return returnLength;
 }
 
+#ifndef __DLL_EXPORT__
+
+static
+VOID
+DumpRecord (
+    __in PLOG_CONTEXT Context,
+    __inout PLOG_RECORD LogRecord
+    )
+/*++
+
+Routine Description:
+
+    Writes one log record to the screen and/or the log file.
+
+Arguments:
+
+    Context - the logging state
+    LogRecord - the record to write
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_DATA pRecordData = &LogRecord->Data;
+
+    //
+    //  See if a reparse point entry
+    //
+
+    if (FlagOn(LogRecord->RecordType,RECORD_TYPE_FILETAG)) {
+
+        if (!TranslateFileTag( LogRecord )){
+
+            //
+            // If this is a reparse point that can't be interpreted, move on.
+            //
+
+            return;
+        }
+    }
+
+    //
+    //  A process summary is not a file operation, report it on its own.
+    //
+
+    if (FlagOn(LogRecord->RecordType,RECORD_TYPE_SUMMARY)) {
+
+        if (Context->LogToScreen) {
+
+            SummaryDump( LogRecord->SequenceNumber,
+                         LogRecord->Name,
+                         pRecordData,
+                         NULL );
+        }
+
+        if (Context->LogToFile) {
+
+            SummaryDump( LogRecord->SequenceNumber,
+                         LogRecord->Name,
+                         pRecordData,
+                         Context->OutputFile );
+        }
+
+        return;
+    }
+
+    //
+    //  So is a report of records the filter could not deliver.
+    //
+
+    if (FlagOn(LogRecord->RecordType,RECORD_TYPE_GAP)) {
+
+        if (Context->LogToScreen) {
+
+            GapDump( LogRecord->SequenceNumber,
+                     LogRecord->Processor,
+                     (PRECORD_GAP)LogRecord->Name,
+                     NULL );
+        }
+
+        if (Context->LogToFile) {
+
+            GapDump( LogRecord->SequenceNumber,
+                     LogRecord->Processor,
+                     (PRECORD_GAP)LogRecord->Name,
+                     Context->OutputFile );
+        }
+
+        return;
+    }
+
+    if (Context->LogToScreen) {
+
+        ScreenDump( LogRecord->SequenceNumber,
+                    LogRecord->Name,
+                    pRecordData );
+    }
+
+    if (Context->LogToFile) {
+
+        FileDump( LogRecord->SequenceNumber,
+                  LogRecord->Name,
+                  pRecordData,
+                  Context->OutputFile );
+    }
+
+    if (pRecordData->Reserved[0] == 'A') {
+
+        if (Context->LogToScreen) {
+
+            printf( "A:  %08X Access denied (%c)\n",
+                    LogRecord->SequenceNumber,
+                    pRecordData->Reserved[1] );
+        }
+
+        if (Context->LogToFile) {
+
+            fprintf( Context->OutputFile,
+                     "A:\t0x%08X\tAccess denied\t%c\n",
+                     LogRecord->SequenceNumber,
+                     pRecordData->Reserved[1] );
+        }
+    }
+
+    if (pRecordData->Reserved[0] == 'B' || pRecordData->Reserved[0] == 'b') {
+
+        if (Context->LogToScreen) {
+
+            BurstDump( LogRecord->SequenceNumber,
+                       pRecordData,
+                       NULL );
+        }
+
+        if (Context->LogToFile) {
+
+            BurstDump( LogRecord->SequenceNumber,
+                       pRecordData,
+                       Context->OutputFile );
+        }
+    }
+}
+
+static
+VOID
+DrainMerge (
+    __in PLOG_CONTEXT Context,
+    __inout PLOG_MERGE Merge,
+    __in BOOLEAN Flush
+    )
+/*++
+
+Routine Description:
+
+    Writes out every record the merge has finished holding back.
+
+Arguments:
+
+    Context - the logging state
+    Merge - the merge
+    Flush - TRUE to write out everything it holds
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PLOG_RECORD pLogRecord;
+
+    while ((pLogRecord = MergeRemove( Merge, Flush )) != NULL) {
+
+        DumpRecord( Context, pLogRecord );
+        free( pLogRecord );
+    }
+}
+
+static
+VOID
+WriteRecords (
+    __in PLOG_CONTEXT Context,
+    __in_bcount_opt(Length) PCHAR Records,
+    __in ULONG Length,
+    __in ULONG RecordCount
+    )
+/*++
+
+Routine Description:
+
+    Hands a batch of records to the log writer, or with no records lets
+    it commit what is due.  Says so if the writer stops on an error.
+
+Arguments:
+
+    Context - the logging state
+    Records - the records, one after another
+    Length - their size in bytes
+    RecordCount - how many there are
+
+Return Value:
+
+    None.
+
+--*/
+{
+    BOOLEAN running;
+
+    if (Context->Writer == NULL) {
+
+        return;
+    }
+
+    if (Length == 0) {
+
+        running = LogWriterTick( Context->Writer, FALSE );
+
+    } else {
+
+        running = LogWriterAppend( Context->Writer, Records, Length, RecordCount );
+    }
+
+    if (!running) {
+
+        printf( "Log writer stopped: error %lu\n", Context->Writer->LastError );
+    }
+}
+
+static
+DWORD
+PrepareRequest (
+    __in PLOG_CONTEXT Context,
+    __in PLOG_MERGE Merge,
+    __out PCOMMAND_MESSAGE CommandMessage
+    )
+/*++
+
+Routine Description:
+
+    Fills in the request for the next batch of records.  A consumer that
+    acknowledges records first makes sure what it has written out reached
+    the log file, then acknowledges every record it has received except
+    those the merge is still holding back and those the log writer has
+    not committed yet.
+
+Arguments:
+
+    Context - the logging state
+    Merge - the merge
+    CommandMessage - the request, with room for a MINISPY_ACK
+
+Return Value:
+
+    The size of the request in bytes.
+
+--*/
+{
+    PMINISPY_ACK ack;
+
+    if (Context->SubscriberId == 0) {
+
+        CommandMessage->Command = GetMiniSpyLog;
+        return sizeof( COMMAND_MESSAGE );
+    }
+
+    if (Context->LogToFile) {
+
+        fflush( Context->OutputFile );
+    }
+
+    if (Context->Writer == NULL || !LogWriterPending( Context->Writer )) {
+
+        CopyMemory( Context->Committed, Context->Sequence.Received, sizeof( Context->Committed ) );
+    }
+
+    ack = (PMINISPY_ACK)CommandMessage->Data;
+    CopyMemory( ack->Sequence, Context->Committed, sizeof( ack->Sequence ) );
+    MergeOldest( Merge, ack->Sequence );
+
+    CommandMessage->Command = AckMiniSpyLog;
+    CommandMessage->Reserved = sizeof( MINISPY_ACK );
+
+    return FIELD_OFFSET( COMMAND_MESSAGE, Data ) + sizeof( MINISPY_ACK );
+}
+
+typedef struct _LOG_BATCH_STATE {
+
+    PLOG_CONTEXT Context;
+    PLOG_MERGE Merge;
+
+} LOG_BATCH_STATE, *PLOG_BATCH_STATE;
+
+static
+VOID
+TakeRecord (
+    __in PVOID State,
+    __in PLOG_RECORD LogRecord
+    )
+/*++
+
+Routine Description:
+
+    Takes in one record of a batch that checked out: adds it to the
+    summaries, and prints it or hands it to the merge.
+
+Arguments:
+
+    State - the LOG_BATCH_STATE of the batch
+    LogRecord - the record
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PLOG_BATCH_STATE state = (PLOG_BATCH_STATE)State;
+
+    if (state->Context->Sketch != NULL) {
+
+        SketchAddRecord( state->Context->Sketch, LogRecord );
+    }
+
+    //
+    //  Priority records are printed as soon as they arrive, the
+    //  rest wait in the merge for any older records still queued
+    //  on other processors.
+    //
+
+    if (state->Context->MergeWindow == 0 ||
+        FlagOn(LogRecord->RecordType,RECORD_TYPE_FLAG_PRIORITY) ||
+        !MergeInsert( state->Merge, LogRecord )) {
+
+        DumpRecord( state->Context, LogRecord );
+    }
+}
+
+VOID
+LogProcessBatch (
+    __inout PLOG_CONTEXT Context,
+    __inout PLOG_MERGE Merge,
+    __in_bcount(Length) PCHAR Buffer,
+    __in DWORD Length
+    )
+/*++
+
+Routine Description:
+
+    Takes in a batch of records as GetMiniSpyLog returned it: checks and
+    counts each record, prints it or hands it to the merge, and hands
+    the batch to the log writer.  The log thread calls it for every
+    batch from the filter and /v for every batch of a capture.
+
+Arguments:
+
+    Context - the logging state
+    Merge - the merge
+    Buffer - the batch
+    Length - its size in bytes
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LOG_BATCH_STATE state;
+    ULONG records;
+    ULONG used;
+
+    state.Context = Context;
+    state.Merge = Merge;
+
+    records = ReplayBatch( &Context->Sequence, Buffer, Length, TakeRecord, &state, &used );
+
+    DrainMerge( Context, Merge, (BOOLEAN)(Context->MergeWindow == 0) );
+
+    //
+    //  The writer keeps the records that checked out just as they
+    //  came.
+    //
+
+    WriteRecords( Context, Buffer, used, records );
+
+    InterlockedExchangeAdd( &Context->RecordsReceived, (LONG)records );
+}
+
+VOID
+LogFlushMerge (
+    __inout PLOG_CONTEXT Context,
+    __inout PLOG_MERGE Merge
+    )
+/*++
+
+Routine Description:
+
+    Writes out every record the merge still holds.
+
+Arguments:
+
+    Context - the logging state
+    Merge - the merge
+
+Return Value:
+
+    None.
+
+--*/
+{
+    DrainMerge( Context, Merge, TRUE );
+}
+
+#endif
+
 DWORD
 WINAPI
 RetrieveLogRecords(
@@ -287,6 +710,10 @@ Return Value:
             if (hResult != HRESULT_FROM_WIN32( ERROR_NO_MORE_ITEMS )) {
 
                 printf( "UNEXPECTED ERROR received: %x\n", hResult );
+
+            } else {
+
+                SequenceReport( &context->Sequence );
             }
 
             Sleep( POLL_INTERVAL );
@@ -295,6 +722,17 @@ Return Value:
         return 0;
     }
 
+    //
+    //  Hand the whole reply to the batch callback in one call before
+    //  walking it record by record for the screen, file and per-record
+    //  callback.
+    //
+
+    if (MspyBatchCallbackRegistered()) {
+
+        MspyDispatchBatch( buffer, bytesReturned );
+    }
+
     //
     //  Buffer is filled with a series of LOG_RECORD structures, one
     //  right after another.  Each LOG_RECORD says how long it is, so
@@ -337,6 +775,8 @@ Return Value:
 
         pRecordData = &pLogRecord->Data;
 
+        SequenceCheck( &context->Sequence, pLogRecord );
+
         //
         //  See if a reparse point entry
         //
@@ -345,13 +785,65 @@ Return Value:
 
             if (!TranslateFileTag( pLogRecord )){
 
-                //
-                // If this is a reparse point that can't be interpreted, move on.
-                //
+                //
+                // If this is a reparse point that can't be interpreted, move on.
+                //
+
+                pLogRecord = (PLOG_RECORD)Add2Ptr(pLogRecord,pLogRecord->Length);
+                continue;
+            }
+        }
+
+        //
+        //  A process summary is not a file operation, report it on its own.
+        //
+
+        if (FlagOn(pLogRecord->RecordType,RECORD_TYPE_SUMMARY)) {
+
+            if (context->LogToScreen) {
+
+                SummaryDump( pLogRecord->SequenceNumber,
+                             pLogRecord->Name,
+                             pRecordData,
+                             NULL );
+            }
+
+            if (context->LogToFile) {
+
+                SummaryDump( pLogRecord->SequenceNumber,
+                             pLogRecord->Name,
+                             pRecordData,
+                             context->OutputFile );
+            }
+
+            pLogRecord = (PLOG_RECORD)Add2Ptr(pLogRecord,pLogRecord->Length);
+            continue;
+        }
+
+        //
+        //  So is a report of records the filter could not deliver.
+        //
+
+        if (FlagOn(pLogRecord->RecordType,RECORD_TYPE_GAP)) {
+
+            if (context->LogToScreen) {
+
+                GapDump( pLogRecord->SequenceNumber,
+                         pLogRecord->Processor,
+                         (PRECORD_GAP)pLogRecord->Name,
+                         NULL );
+            }
+
+            if (context->LogToFile) {
 
-                pLogRecord = (PLOG_RECORD)Add2Ptr(pLogRecord,pLogRecord->Length);
-                continue;
+                GapDump( pLogRecord->SequenceNumber,
+                         pLogRecord->Processor,
+                         (PRECORD_GAP)pLogRecord->Name,
+                         context->OutputFile );
             }
+
+            pLogRecord = (PLOG_RECORD)Add2Ptr(pLogRecord,pLogRecord->Length);
+            continue;
         }
 
         if (context->LogToScreen) {
@@ -369,6 +861,41 @@ Return Value:
                         context->OutputFile );
         }
 
+        if (pRecordData->Reserved[0] == 'A') {
+
+            if (context->LogToScreen) {
+
+                printf( "A:  %08X Access denied (%c)\n",
+                        pLogRecord->SequenceNumber,
+                        pRecordData->Reserved[1] );
+            }
+
+            if (context->LogToFile) {
+
+                fprintf( context->OutputFile,
+                         "A:\t0x%08X\tAccess denied\t%c\n",
+                         pLogRecord->SequenceNumber,
+                         pRecordData->Reserved[1] );
+            }
+        }
+
+        if (pRecordData->Reserved[0] == 'B' || pRecordData->Reserved[0] == 'b') {
+
+            if (context->LogToScreen) {
+
+                BurstDump( pLogRecord->SequenceNumber,
+                           pRecordData,
+                           NULL );
+            }
+
+            if (context->LogToFile) {
+
+                BurstDump( pLogRecord->SequenceNumber,
+                           pRecordData,
+                           context->OutputFile );
+            }
+        }
+
         __try{
             if(g_RetrieveLogRecordsCallback)
             {
@@ -417,43 +944,6 @@ Return Value:
             g_RetrieveLogRecordsCallback = NULL;
         }
 
-        //
-        //  The RecordType could also designate that we are out of memory
-        //  or hit our program defined memory limit, so check for these
-        //  cases.
-        //
-
-        if (FlagOn(pLogRecord->RecordType,RECORD_TYPE_FLAG_OUT_OF_MEMORY)) {
-
-            if (context->LogToScreen) {
-
-                printf( "M:  %08X System Out of Memory\n",
-                        pLogRecord->SequenceNumber );
-            }
-
-            if (context->LogToFile) {
-
-                fprintf( context->OutputFile,
-                            "M:\t0x%08X\tSystem Out of Memory\n",
-                            pLogRecord->SequenceNumber );
-            }
-
-        } else if (FlagOn(pLogRecord->RecordType,RECORD_TYPE_FLAG_EXCEED_MEMORY_ALLOWANCE)) {
-
-            if (context->LogToScreen) {
-
-                printf( "M:  %08X Exceeded Mamimum Allowed Memory Buffers\n",
-                        pLogRecord->SequenceNumber );
-            }
-
-            if (context->LogToFile) {
-
-                fprintf( context->OutputFile,
-                            "M:\t0x%08X\tExceeded Mamimum Allowed Memory Buffers\n",
-                            pLogRecord->SequenceNumber );
-            }
-        }
-
         //
         // Move to next LOG_RECORD
         //
@@ -476,16 +966,19 @@ Return Value:
 {
     PLOG_CONTEXT context = (PLOG_CONTEXT)lpParameter;
     DWORD bytesReturned = 0;
-    DWORD used;
     PVOID alignedBuffer[BUFFER_SIZE/sizeof( PVOID )];
     PCHAR buffer = (PCHAR) alignedBuffer;
     HRESULT hResult;
-    PLOG_RECORD pLogRecord;
-    PRECORD_DATA pRecordData;
-    COMMAND_MESSAGE commandMessage;
+    PVOID alignedMessage[(FIELD_OFFSET( COMMAND_MESSAGE, Data ) + sizeof( MINISPY_ACK ) + sizeof( PVOID ) - 1) / sizeof( PVOID )];
+    PCOMMAND_MESSAGE commandMessage = (PCOMMAND_MESSAGE) alignedMessage;
+    DWORD commandSize;
+    LOG_MERGE merge;
+    LARGE_INTEGER now;
 
     //printf("Log: Starting up\n");
 
+    MergeInitialize( &merge, context->MergeWindow );
+
 #pragma warning(push)
 #pragma warning(disable:4127) // conditional expression is constant
 
@@ -503,14 +996,20 @@ Return Value:
         }
 
         //
-        //  Request log data from MiniSpy.
+        //  The window can be changed from the command prompt at any time.
+        //
+
+        MergeSetWindow( &merge, context->MergeWindow );
+
+        //
+        //  Request log data from MiniSpy, acknowledging the last batch.
         //
 
-        commandMessage.Command = GetMiniSpyLog;
+        commandSize = PrepareRequest( context, &merge, commandMessage );
 
         hResult = FilterSendMessage( context->Port,
-                                     &commandMessage,
-                                     sizeof( COMMAND_MESSAGE ),
+                                     commandMessage,
+                                     commandSize,
                                      buffer,
                                      sizeof(alignedBuffer),
                                      &bytesReturned );
@@ -519,6 +1018,7 @@ Return Value:
 
             if (HRESULT_FROM_WIN32( ERROR_INVALID_HANDLE ) == hResult) {
 
+                DrainMerge( context, &merge, TRUE );
                 printf( "The kernel component of minispy has unloaded. Exiting\n" );
                 ExitProcess( 0 );
             } else {
@@ -526,140 +1026,69 @@ Return Value:
                 if (hResult != HRESULT_FROM_WIN32( ERROR_NO_MORE_ITEMS )) {
 
                     printf( "UNEXPECTED ERROR received: %x\n", hResult );
-                }
 
-                Sleep( POLL_INTERVAL );
-            }
-
-            continue;
-        }
-
-        //
-        //  Buffer is filled with a series of LOG_RECORD structures, one
-        //  right after another.  Each LOG_RECORD says how long it is, so
-        //  we know where the next LOG_RECORD begins.
-        //
-
-        pLogRecord = (PLOG_RECORD) buffer;
-        used = 0;
-
-        //
-        //  Logic to write record to screen and/or file
-        //
-
-        for (;;) {
-
-            if (used+FIELD_OFFSET(LOG_RECORD,Name) > bytesReturned) {
-
-                break;
-            }
-
-            if (pLogRecord->Length < (sizeof(LOG_RECORD)+sizeof(WCHAR))) {
-
-                printf( "UNEXPECTED LOG_RECORD->Length: length=%d expected>=%d\n",
-                        pLogRecord->Length,
-                        (sizeof(LOG_RECORD)+sizeof(WCHAR)));
-
-                break;
-            }
-
-            used += pLogRecord->Length;
-
-            if (used > bytesReturned) {
-
-                printf( "UNEXPECTED LOG_RECORD size: used=%d bytesReturned=%d\n",
-                        used,
-                        bytesReturned);
-
-                break;
-            }
-
-            pRecordData = &pLogRecord->Data;
-
-            //
-            //  See if a reparse point entry
-            //
-
-            if (FlagOn(pLogRecord->RecordType,RECORD_TYPE_FILETAG)) {
-
-                if (!TranslateFileTag( pLogRecord )){
+                } else {
 
                     //
-                    // If this is a reparse point that can't be interpreted, move on.
+                    //  Nothing older than now can still be on its way,
+                    //  so let the merge catch up with the clock.
                     //
 
-                    pLogRecord = (PLOG_RECORD)Add2Ptr(pLogRecord,pLogRecord->Length);
-                    continue;
-                }
-            }
-
-            if (context->LogToScreen) {
+                    GetSystemTimeAsFileTime( (FILETIME *)&now );
+                    MergeAdvance( &merge, now.QuadPart );
+                    DrainMerge( context, &merge, FALSE );
 
-                ScreenDump( pLogRecord->SequenceNumber,
-                            pLogRecord->Name,
-                            pRecordData );
-            }
+                    WriteRecords( context, NULL, 0, 0 );
 
-            if (context->LogToFile) {
+                    SequenceReport( &context->Sequence );
+                }
 
-                FileDump( pLogRecord->SequenceNumber,
-                          pLogRecord->Name,
-                          pRecordData,
-                          context->OutputFile );
+                Sleep( POLL_INTERVAL );
             }
 
-            //
-            //  The RecordType could also designate that we are out of memory
-            //  or hit our program defined memory limit, so check for these
-            //  cases.
-            //
-
-            if (FlagOn(pLogRecord->RecordType,RECORD_TYPE_FLAG_OUT_OF_MEMORY)) {
-
-                if (context->LogToScreen) {
+            continue;
+        }
 
-                    printf( "M:  %08X System Out of Memory\n",
-                            pLogRecord->SequenceNumber );
-                }
+        if (context->Capture != NULL && bytesReturned != 0) {
 
-                if (context->LogToFile) {
+            CaptureBatch( context->Capture, buffer, bytesReturned );
+        }
 
-                    fprintf( context->OutputFile,
-                             "M:\t0x%08X\tSystem Out of Memory\n",
-                             pLogRecord->SequenceNumber );
-                }
+        LogProcessBatch( context, &merge, buffer, bytesReturned );
 
-            } else if (FlagOn(pLogRecord->RecordType,RECORD_TYPE_FLAG_EXCEED_MEMORY_ALLOWANCE)) {
+        //
+        //  If we didn't get any data, pause for 1/2 second
+        //
 
-                if (context->LogToScreen) {
+        if (bytesReturned == 0) {
 
-                    printf( "M:  %08X Exceeded Mamimum Allowed Memory Buffers\n",
-                            pLogRecord->SequenceNumber );
-                }
+            Sleep( POLL_INTERVAL );
+        }
+    }
 
-                if (context->LogToFile) {
+    DrainMerge( context, &merge, TRUE );
+    MergeCleanup( &merge );
 
-                    fprintf( context->OutputFile,
-                             "M:\t0x%08X\tExceeded Mamimum Allowed Memory Buffers\n",
-                             pLogRecord->SequenceNumber );
-                }
-            }
+    if (context->Writer != NULL) {
 
-            //
-            // Move to next LOG_RECORD
-            //
+        LogWriterTick( context->Writer, TRUE );
+    }
 
-            pLogRecord = (PLOG_RECORD)Add2Ptr(pLogRecord,pLogRecord->Length);
-        }
+    //
+    //  Acknowledge what was written out on the way down, so the next run
+    //  does not get it again.
+    //
 
-        //
-        //  If we didn't get any data, pause for 1/2 second
-        //
+    if (context->SubscriberId != 0) {
 
-        if (bytesReturned == 0) {
+        commandSize = PrepareRequest( context, &merge, commandMessage );
 
-            Sleep( POLL_INTERVAL );
-        }
+        FilterSendMessage( context->Port,
+                           commandMessage,
+                           commandSize,
+                           NULL,
+                           0,
+                           &bytesReturned );
     }
 
     printf( "Log: Shutting down\n" );
@@ -1229,6 +1658,224 @@ BOOL ReadLine(char *buff, int size, FILE *fp)
   return TRUE;
 }
 
+VOID
+PrintAggregate (
+    __in PRECORD_DATA RecordData,
+    __in_opt FILE *File
+    )
+/*++
+Routine Description:
+
+    Prints the summary of a coalesced record: how many operations it
+    stands for, the bytes and offset range they covered and the time of
+    the last one.
+
+Arguments:
+
+    RecordData - the record to print, Aggregate.Count must be non-zero
+    File - the file to print to, or NULL for the screen
+
+Return Value:
+
+    None.
+
+--*/
+{
+    FILETIME localTime;
+    SYSTEMTIME systemTime;
+    CHAR time[TIME_BUFFER_LENGTH];
+
+    FileTimeToLocalFileTime( (FILETIME *)&(RecordData->CompletionTime),
+                             &localTime );
+    FileTimeToSystemTime( &localTime,
+                          &systemTime );
+
+    if (!FormatSystemTime( &systemTime, time, TIME_BUFFER_LENGTH )) {
+
+        strcpy_s( time, TIME_BUFFER_LENGTH, TIME_ERROR );
+    }
+
+    fprintf( (File != NULL) ? File : stdout,
+             "\tx%lu %I64d bytes [%I64d-%I64d) last %s",
+             RecordData->Aggregate.Count,
+             RecordData->Aggregate.TotalBytes,
+             RecordData->Aggregate.StartOffset,
+             RecordData->Aggregate.EndOffset,
+             time );
+}
+
+VOID
+SummaryDump (
+    __in ULONG SequenceNumber,
+    __in WCHAR CONST *Name,
+    __in PRECORD_DATA RecordData,
+    __in_opt FILE *File
+    )
+/*++
+Routine Description:
+
+    Prints a process summary record: the process that went over its
+    record budget, how many operations it issued in the window and how
+    many of them were not logged.
+
+Arguments:
+
+    SequenceNumber - the sequence number for this log record
+    Name - the process image name
+    RecordData - the summary record to print
+    File - the file to print to, or NULL for the screen
+
+Return Value:
+
+    None.
+
+--*/
+{
+    WCHAR image[MAX_PATH];
+    size_t llen = MAX_PATH;
+
+    image[0] = UNICODE_NULL;
+    DumpNameCxtLine( (WCHAR *)Name, image, &llen );
+
+    if (File == NULL) {
+
+        printf( "S:  %08X Process %I64d %S: %lu operations, %lu not logged\n",
+                SequenceNumber,
+                RecordData->ProcessId,
+                image,
+                RecordData->Aggregate.Count,
+                RecordData->Aggregate.Suppressed );
+
+    } else {
+
+        fprintf( File,
+                 "S:\t0x%08X\tProcess %I64d\t%S\t%lu operations\t%lu not logged\n",
+                 SequenceNumber,
+                 RecordData->ProcessId,
+                 image,
+                 RecordData->Aggregate.Count,
+                 RecordData->Aggregate.Suppressed );
+    }
+}
+
+VOID
+BurstDump (
+    __in ULONG SequenceNumber,
+    __in PRECORD_DATA RecordData,
+    __in_opt FILE *File
+    )
+/*++
+Routine Description:
+
+    Prints what a burst alert adds to the operation record it comes
+    with: the kind of operation that went over its threshold, how many
+    there were in the window and whether the process is now blocked.
+
+Arguments:
+
+    SequenceNumber - the sequence number for this log record
+    RecordData - the alert record to print
+    File - the file to print to, or NULL for the screen
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PCSTR kind;
+
+    switch (RecordData->Reserved[1]) {
+
+        case 'R':
+            kind = "renames";
+            break;
+
+        case 'D':
+            kind = "deletes";
+            break;
+
+        default:
+            kind = "overwrites";
+            break;
+    }
+
+    if (File == NULL) {
+
+        printf( "B:  %08X Burst of %lu %s by process %I64d%s\n",
+                SequenceNumber,
+                RecordData->Aggregate.Count,
+                kind,
+                RecordData->ProcessId,
+                (RecordData->Reserved[0] == 'b') ? ", now blocked" : "" );
+
+    } else {
+
+        fprintf( File,
+                 "B:\t0x%08X\tBurst\t%lu %s\tProcess %I64d%s\n",
+                 SequenceNumber,
+                 RecordData->Aggregate.Count,
+                 kind,
+                 RecordData->ProcessId,
+                 (RecordData->Reserved[0] == 'b') ? "\tblocked" : "" );
+    }
+}
+
+VOID
+GapDump (
+    __in ULONG SequenceNumber,
+    __in ULONG Processor,
+    __in PRECORD_GAP Gap,
+    __in_opt FILE *File
+    )
+/*++
+Routine Description:
+
+    Prints a gap record: the range of sequence numbers the filter could
+    not deliver from one of its queues and why.
+
+Arguments:
+
+    SequenceNumber - the sequence number for this log record
+    Processor - the queue the gap and the lost range belong to
+    Gap - the gap to print
+    File - the file to print to, or NULL for the screen
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (File == NULL) {
+
+        printf( "G:  %08X Queue %lu lost %lu of %08X-%08X: memory %lu, quota %lu, discarded %lu, lagging %lu\n",
+                SequenceNumber,
+                Processor,
+                Gap->Count,
+                Gap->FirstSequence,
+                Gap->LastSequence,
+                Gap->Reason[LOSS_OUT_OF_MEMORY],
+                Gap->Reason[LOSS_OVER_QUOTA],
+                Gap->Reason[LOSS_DISCARDED],
+                Gap->Reason[LOSS_LAGGING] );
+
+    } else {
+
+        fprintf( File,
+                 "G:\t0x%08X\tQueue %lu\tLost %lu\t0x%08X-0x%08X\tmemory %lu\tquota %lu\tdiscarded %lu\tlagging %lu\n",
+                 SequenceNumber,
+                 Processor,
+                 Gap->Count,
+                 Gap->FirstSequence,
+                 Gap->LastSequence,
+                 Gap->Reason[LOSS_OUT_OF_MEMORY],
+                 Gap->Reason[LOSS_OVER_QUOTA],
+                 Gap->Reason[LOSS_DISCARDED],
+                 Gap->Reason[LOSS_LAGGING] );
+    }
+}
+
 VOID
 FileDump (
     __in ULONG SequenceNumber,
@@ -1390,6 +2037,13 @@ Return Value:
     //fprintf( File, "\t0x%p", RecordData->Arg5 );
     //fprintf( File, "\t0x%08I64x", RecordData->Arg6.QuadPart );
 
+    if (RecordData->Aggregate.Count != 0 &&
+        RecordData->Reserved[0] != 'B' &&
+        RecordData->Reserved[0] != 'b') {
+
+        PrintAggregate( RecordData, File );
+    }
+
     if(Name == NULL) return ;
 
     llen = MAX_PATH;
@@ -1560,6 +2214,13 @@ Return Value:
             // RecordData->Arg5,
             // RecordData->Arg6.QuadPart );
 
+    if (RecordData->Aggregate.Count != 0 &&
+        RecordData->Reserved[0] != 'B' &&
+        RecordData->Reserved[0] != 'b') {
+
+        PrintAggregate( RecordData, NULL );
+    }
+
     printf( "\t%S", Name );
     printf( "\n" );
 }
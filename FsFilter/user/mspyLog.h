@@ -28,8 +28,14 @@ Environment:
 #include <stdio.h>
 #include <fltUser.h>
 #include "minispy.h"
+#include "mspyReplay.h"
 
-#define BUFFER_SIZE     4096
+//
+//  Must hold at least one record of MAX_RECORD_SIZE bytes, or the filter
+//  could never hand over its largest records.
+//
+
+#define BUFFER_SIZE     (2 * MAX_RECORD_SIZE)
 
 extern HANDLE gport;
 
@@ -53,6 +59,58 @@ typedef struct _LOG_CONTEXT {
     BOOLEAN CleaningUp;
     HANDLE  ShutDown;
 
+    //
+    //  Sequence continuity check and what has been received on each
+    //  queue, see mspyReplay.c.
+    //
+
+    LOG_SEQUENCE Sequence;
+
+    //
+    //  How long in milliseconds records are held to print them in time
+    //  order across the queues, see mspyMerge.c.  0 prints them as they
+    //  arrive.
+    //
+
+    ULONG MergeWindow;
+
+    //
+    //  The SubscriberId connected with, 0 if records are not acknowledged.
+    //  See MINISPY_CONNECT.
+    //
+
+    ULONG SubscriberId;
+
+    //
+    //  The log writer, see mspyWriter.c, NULL where there is none.  What
+    //  it has taken is only acknowledged once it is on disk: Committed
+    //  is Sequence.Received as of the last time the writer had nothing
+    //  pending.
+    //
+
+    struct _LOG_WRITER *Writer;
+    ULONG Committed[ACK_LANES];
+
+    //
+    //  The running summaries behind /t and /c, see mspySketch.c, NULL
+    //  where there are none.
+    //
+
+    struct _LOG_SKETCH *Sketch;
+
+    //
+    //  How many records have been received, for the rate /y reports.
+    //
+
+    __volatile LONG RecordsReceived;
+
+    //
+    //  Where the batches are captured for /v, see mspyCapture.c, NULL
+    //  where they cannot be.
+    //
+
+    struct _LOG_CAPTURE *Capture;
+
 } LOG_CONTEXT, *PLOG_CONTEXT;
 
 //
@@ -70,6 +128,22 @@ RetrieveLogRecords(
     __in LPVOID lpParameter
     );
 
+struct _LOG_MERGE;
+
+VOID
+LogProcessBatch (
+    __inout PLOG_CONTEXT Context,
+    __inout struct _LOG_MERGE *Merge,
+    __in_bcount(Length) PCHAR Buffer,
+    __in DWORD Length
+    );
+
+VOID
+LogFlushMerge (
+    __inout PLOG_CONTEXT Context,
+    __inout struct _LOG_MERGE *Merge
+    );
+
 VOID
 FileDump (
     __in ULONG SequenceNumber,
@@ -85,11 +159,47 @@ ScreenDump(
     __in PRECORD_DATA RecordData
     );
 
+VOID
+SummaryDump (
+    __in ULONG SequenceNumber,
+    __in WCHAR CONST *Name,
+    __in PRECORD_DATA RecordData,
+    __in_opt FILE *File
+    );
+
+VOID
+BurstDump (
+    __in ULONG SequenceNumber,
+    __in PRECORD_DATA RecordData,
+    __in_opt FILE *File
+    );
+
+VOID
+GapDump (
+    __in ULONG SequenceNumber,
+    __in ULONG Processor,
+    __in PRECORD_GAP Gap,
+    __in_opt FILE *File
+    );
+
+VOID
+PrintAggregate (
+    __in PRECORD_DATA RecordData,
+    __in_opt FILE *File
+    );
+
 BOOLEAN
 TranslateFileTag(
     __in PLOG_RECORD logRecord
     );    
 
+ULONG
+FormatSystemTime(
+    __in SYSTEMTIME *SystemTime,
+    __out_bcount(BufferLength) CHAR *Buffer,
+    __in ULONG BufferLength
+    );
+
 //
 //  Values set for the Flags field in a RECORD_DATA structure.
 //  These flags come from the FLT_CALLBACK_DATA structure.
@@ -0,0 +1,392 @@
+/*++
+
+Module Name:
+
+    mspyMerge.c
+
+Abstract:
+
+    This module puts the records of the filter's processor queues back in
+    time order.
+
+    Each queue is sent up in its own sequence order, and the queues are
+    interleaved one record at a time, so records arrive roughly but not
+    exactly in time order.  A record's OriginatingTime is taken when its
+    operation starts while it is queued when the operation completes, so
+    even a single queue is not strictly ordered by time.
+
+    The merge therefore keeps every record it is given in a heap ordered
+    by (OriginatingTime, Processor, SequenceNumber) and only releases a
+    record once the newest time seen, from any queue or from the clock
+    when the filter has nothing to send, is more than Window past it.  Any
+    record that turns up within Window of the records already released
+    comes out in order; one that is later than that comes out as soon as
+    it arrives.
+
+    Nothing here depends on Win32, so a capture can be merged wherever
+    mspyReplay.c builds.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "mspyMerge.h"
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+BOOLEAN
+MergeBefore (
+    __in PLOG_RECORD First,
+    __in PLOG_RECORD Second
+    )
+/*++
+
+Routine Description:
+
+    Orders two records by (OriginatingTime, Processor, SequenceNumber).
+
+Arguments:
+
+    First - the record that may come first
+    Second - the record to compare it with
+
+Return Value:
+
+    TRUE if First comes before Second.
+
+--*/
+{
+    if (First->Data.OriginatingTime.QuadPart != Second->Data.OriginatingTime.QuadPart) {
+
+        return (BOOLEAN)(First->Data.OriginatingTime.QuadPart < Second->Data.OriginatingTime.QuadPart);
+    }
+
+    if (First->Processor != Second->Processor) {
+
+        return (BOOLEAN)(First->Processor < Second->Processor);
+    }
+
+    return (BOOLEAN)((LONG)(First->SequenceNumber - Second->SequenceNumber) < 0);
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+VOID
+MergeInitialize (
+    __out PLOG_MERGE Merge,
+    __in ULONG Window
+    )
+/*++
+
+Routine Description:
+
+    Sets up an empty merge.
+
+Arguments:
+
+    Merge - the merge to set up
+    Window - the skew to tolerate between queues, in milliseconds
+
+Return Value:
+
+    None.
+
+--*/
+{
+    memset( Merge, 0, sizeof( LOG_MERGE ) );
+    MergeSetWindow( Merge, Window );
+}
+
+VOID
+MergeCleanup (
+    __inout PLOG_MERGE Merge
+    )
+/*++
+
+Routine Description:
+
+    Frees every pending record.  Call MergeRemove with Flush set first to
+    get them out.
+
+Arguments:
+
+    Merge - the merge to clean up
+
+Return Value:
+
+    None.
+
+--*/
+{
+    while (Merge->Count != 0) {
+
+        free( Merge->Heap[--Merge->Count] );
+    }
+
+    free( Merge->Heap );
+    Merge->Heap = NULL;
+    Merge->Capacity = 0;
+}
+
+VOID
+MergeSetWindow (
+    __inout PLOG_MERGE Merge,
+    __in ULONG Window
+    )
+/*++
+
+Routine Description:
+
+    Changes the skew the merge tolerates.
+
+Arguments:
+
+    Merge - the merge
+    Window - the skew to tolerate between queues, in milliseconds
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Merge->Window = (LONGLONG)Window * 10000;
+}
+
+BOOLEAN
+MergeInsert (
+    __inout PLOG_MERGE Merge,
+    __in PLOG_RECORD LogRecord
+    )
+/*++
+
+Routine Description:
+
+    Adds a copy of a record to the merge.
+
+Arguments:
+
+    Merge - the merge
+    LogRecord - the record, which the caller keeps
+
+Return Value:
+
+    FALSE if there was no memory for the copy, in which case the caller
+    should print the record itself.
+
+--*/
+{
+    PLOG_RECORD *newHeap;
+    PLOG_RECORD copy;
+    PLOG_RECORD parent;
+    ULONG child;
+
+    if (Merge->Count == Merge->Capacity) {
+
+        newHeap = realloc( Merge->Heap,
+                           (Merge->Capacity + 256) * sizeof( PLOG_RECORD ) );
+
+        if (newHeap == NULL) {
+
+            return FALSE;
+        }
+
+        Merge->Heap = newHeap;
+        Merge->Capacity += 256;
+    }
+
+    copy = malloc( LogRecord->Length );
+
+    if (copy == NULL) {
+
+        return FALSE;
+    }
+
+    memcpy( copy, LogRecord, LogRecord->Length );
+
+    if (copy->Data.OriginatingTime.QuadPart > Merge->Newest) {
+
+        Merge->Newest = copy->Data.OriginatingTime.QuadPart;
+    }
+
+    //
+    //  Sift the new record up from the bottom of the heap.
+    //
+
+    child = Merge->Count++;
+
+    while (child > 0) {
+
+        parent = Merge->Heap[(child - 1) / 2];
+
+        if (!MergeBefore( copy, parent )) {
+
+            break;
+        }
+
+        Merge->Heap[child] = parent;
+        child = (child - 1) / 2;
+    }
+
+    Merge->Heap[child] = copy;
+
+    return TRUE;
+}
+
+VOID
+MergeAdvance (
+    __inout PLOG_MERGE Merge,
+    __in LONGLONG Now
+    )
+/*++
+
+Routine Description:
+
+    Tells the merge the current time when the filter has nothing to send,
+    so records are not held back waiting for newer ones.
+
+Arguments:
+
+    Merge - the merge
+    Now - the current system time
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Now > Merge->Newest) {
+
+        Merge->Newest = Now;
+    }
+}
+
+PLOG_RECORD
+MergeRemove (
+    __inout PLOG_MERGE Merge,
+    __in BOOLEAN Flush
+    )
+/*++
+
+Routine Description:
+
+    Takes the oldest pending record out of the merge if it is due.
+
+Arguments:
+
+    Merge - the merge
+    Flush - TRUE to take the oldest record whether or not it is due
+
+Return Value:
+
+    The record, which the caller frees with free(), or NULL if no record
+    is due.
+
+--*/
+{
+    PLOG_RECORD oldest;
+    PLOG_RECORD last;
+    ULONG parent;
+    ULONG child;
+
+    if (Merge->Count == 0) {
+
+        return NULL;
+    }
+
+    oldest = Merge->Heap[0];
+
+    if (!Flush &&
+        Merge->Count <= MERGE_MAX_PENDING &&
+        oldest->Data.OriginatingTime.QuadPart > Merge->Newest - Merge->Window) {
+
+        return NULL;
+    }
+
+    //
+    //  Move the last record to the top and sift it down.
+    //
+
+    last = Merge->Heap[--Merge->Count];
+    parent = 0;
+
+    for (;;) {
+
+        child = parent * 2 + 1;
+
+        if (child >= Merge->Count) {
+
+            break;
+        }
+
+        if (child + 1 < Merge->Count &&
+            MergeBefore( Merge->Heap[child + 1], Merge->Heap[child] )) {
+
+            child++;
+        }
+
+        if (!MergeBefore( Merge->Heap[child], last )) {
+
+            break;
+        }
+
+        Merge->Heap[parent] = Merge->Heap[child];
+        parent = child;
+    }
+
+    if (Merge->Count != 0) {
+
+        Merge->Heap[parent] = last;
+    }
+
+    return oldest;
+}
+
+VOID
+MergeOldest (
+    __in PLOG_MERGE Merge,
+    __inout_ecount(LOG_QUEUES) PULONG Sequence
+    )
+/*++
+
+Routine Description:
+
+    Lowers each queue's entry in Sequence to just before the oldest of
+    that queue's records still pending, so a consumer acknowledging
+    records does not acknowledge any it has not written out yet.
+
+Arguments:
+
+    Merge - the merge
+    Sequence - the last sequence number received on each queue
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PLOG_RECORD pending;
+    ULONG i;
+
+    for (i = 0; i < Merge->Count; i++) {
+
+        pending = Merge->Heap[i];
+
+        if (pending->Processor < LOG_QUEUES &&
+            (LONG)(pending->SequenceNumber - 1 - Sequence[pending->Processor]) < 0) {
+
+            Sequence[pending->Processor] = pending->SequenceNumber - 1;
+        }
+    }
+}
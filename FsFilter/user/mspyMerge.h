@@ -0,0 +1,103 @@
+/*++
+
+Module Name:
+
+    mspyMerge.h
+
+Abstract:
+
+    This module contains the structures and prototypes for putting the
+    records of the filter's processor queues back in time order.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYMERGE_H__
+#define __MSPYMERGE_H__
+
+#include "mspyTypes.h"
+#include "miniSpy.h"
+
+//
+//  How long, in milliseconds, a record is held back by default waiting
+//  for older records from other queues.
+//
+
+#define MERGE_DEFAULT_WINDOW    250
+
+//
+//  Past this many pending records the oldest is released whatever its
+//  age, so a stuck clock cannot make the merge grow without bound.
+//
+
+#define MERGE_MAX_PENDING       65536
+
+typedef struct _LOG_MERGE {
+
+    //
+    //  Skew tolerated between queues and the newest OriginatingTime seen,
+    //  both in 100ns units.
+    //
+
+    LONGLONG Window;
+    LONGLONG Newest;
+
+    //
+    //  Copies of the pending records, a binary heap ordered by
+    //  (OriginatingTime, Processor, SequenceNumber).
+    //
+
+    ULONG Count;
+    ULONG Capacity;
+    PLOG_RECORD *Heap;
+
+} LOG_MERGE, *PLOG_MERGE;
+
+//
+//  Function prototypes
+//
+
+VOID
+MergeInitialize (
+    __out PLOG_MERGE Merge,
+    __in ULONG Window
+    );
+
+VOID
+MergeCleanup (
+    __inout PLOG_MERGE Merge
+    );
+
+VOID
+MergeSetWindow (
+    __inout PLOG_MERGE Merge,
+    __in ULONG Window
+    );
+
+BOOLEAN
+MergeInsert (
+    __inout PLOG_MERGE Merge,
+    __in PLOG_RECORD LogRecord
+    );
+
+VOID
+MergeAdvance (
+    __inout PLOG_MERGE Merge,
+    __in LONGLONG Now
+    );
+
+PLOG_RECORD
+MergeRemove (
+    __inout PLOG_MERGE Merge,
+    __in BOOLEAN Flush
+    );
+
+VOID
+MergeOldest (
+    __in PLOG_MERGE Merge,
+    __inout_ecount(LOG_QUEUES) PULONG Sequence
+    );
+
+#endif //__MSPYMERGE_H__
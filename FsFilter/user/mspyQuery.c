@@ -0,0 +1,251 @@
+/*++
+
+Module Name:
+
+    mspyQuery.c
+
+Abstract:
+
+    This module is the /i command, which answers questions about the
+    records the log writer kept, such as which processes touched a file
+    or directory in a given time, without reading the whole log.  It
+    reads the query from the command line, runs it with mspySearch.c and
+    prints the records that match in the same format as the /f log file.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <DriverSpecs.h>
+__user_code
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include "mspyLog.h"
+#include "mspySearch.h"
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+BOOLEAN
+QueryParseTime (
+    __in PCSTR Text,
+    __out PLARGE_INTEGER Time
+    )
+/*++
+
+Routine Description:
+
+    Reads a local time given as YYYY-MM-DD, optionally followed by
+    Thh:mm or Thh:mm:ss.
+
+Arguments:
+
+    Text - the time
+    Time - receives it as a system time
+
+Return Value:
+
+    FALSE if it is not a time.
+
+--*/
+{
+    SYSTEMTIME systemTime;
+    FILETIME localTime;
+    int year, month, day;
+    int hour = 0, minute = 0, second = 0;
+
+    if (sscanf( Text, "%d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &minute, &second ) < 3) {
+
+        return FALSE;
+    }
+
+    ZeroMemory( &systemTime, sizeof( systemTime ) );
+    systemTime.wYear = (WORD)year;
+    systemTime.wMonth = (WORD)month;
+    systemTime.wDay = (WORD)day;
+    systemTime.wHour = (WORD)hour;
+    systemTime.wMinute = (WORD)minute;
+    systemTime.wSecond = (WORD)second;
+
+    return (BOOLEAN)(SystemTimeToFileTime( &systemTime, &localTime ) &&
+                     LocalFileTimeToFileTime( &localTime, (FILETIME *)Time ));
+}
+
+static
+VOID
+QueryPrint (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+/*++
+
+Routine Description:
+
+    Prints a record that matched.
+
+Arguments:
+
+    Context - unused
+    LogRecord - the record
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UNREFERENCED_PARAMETER( Context );
+
+    FileDump( LogRecord->SequenceNumber, LogRecord->Name, &LogRecord->Data, stdout );
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+int
+LogQuery (
+    __in int argc,
+    __in_ecount(argc) char *argv[]
+    )
+/*++
+
+Routine Description:
+
+    Runs a query over the log written by /w and prints the records that
+    match in the same format as the /f log file, followed by what it
+    took.
+
+        <dir>               where the segments are
+        path:<name>         a file name, or a directory to match
+                            everything under it
+        proc:<image>        a process image name
+        pid:<id>            a process id
+        from:<time>         records from this local time on, given as
+        to:<time>           YYYY-MM-DD[Thh:mm[:ss]]
+        scan                reads every block instead of using the
+                            indexes
+
+Arguments:
+
+    argc - the number of arguments
+    argv - the arguments, the directory first
+
+Return Value:
+
+    0, or 1 if the arguments are wrong.
+
+--*/
+{
+    LOG_SEARCH query;
+    ULONG segments;
+    DWORD started;
+    int i;
+
+    if (!LogSearchInitialize( &query )) {
+
+        printf( "Not enough memory to read the log\n" );
+        return 0;
+    }
+
+    query.Match = QueryPrint;
+
+    if (argc < 1) {
+
+        goto LogQuery_Usage;
+    }
+
+    for (i = 1; i < argc; i++) {
+
+        if (!_strnicmp( argv[i], "path:", 5 )) {
+
+            query.PathLength = MultiByteToWideChar( CP_ACP, MB_ERR_INVALID_CHARS, argv[i] + 5, -1, query.Path, LOG_FILE_PATH );
+
+            if (query.PathLength == 0) {
+
+                goto LogQuery_Usage;
+            }
+
+            query.PathLength--;
+
+            while (query.PathLength > 1 && query.Path[query.PathLength - 1] == L'\\') {
+
+                query.PathLength--;
+            }
+
+        } else if (!_strnicmp( argv[i], "proc:", 5 )) {
+
+            query.ImageLength = MultiByteToWideChar( CP_ACP, MB_ERR_INVALID_CHARS, argv[i] + 5, -1, query.Image, LOG_FILE_PATH );
+
+            if (query.ImageLength == 0) {
+
+                goto LogQuery_Usage;
+            }
+
+            query.ImageLength--;
+
+        } else if (!_strnicmp( argv[i], "pid:", 4 )) {
+
+            query.ByProcessId = TRUE;
+            query.ProcessId = _atoi64( argv[i] + 4 );
+
+        } else if (!_strnicmp( argv[i], "from:", 5 )) {
+
+            if (!QueryParseTime( argv[i] + 5, &query.From )) {
+
+                goto LogQuery_Usage;
+            }
+
+        } else if (!_strnicmp( argv[i], "to:", 3 )) {
+
+            if (!QueryParseTime( argv[i] + 3, &query.To )) {
+
+                goto LogQuery_Usage;
+            }
+
+        } else if (!_stricmp( argv[i], "scan" )) {
+
+            query.Scan = TRUE;
+
+        } else {
+
+            goto LogQuery_Usage;
+        }
+    }
+
+    started = GetTickCount();
+
+    segments = LogSearchDirectory( &query, argv[0] );
+
+    if (segments == 0) {
+
+        printf( "No log segments in %s\n", argv[0] );
+
+    } else {
+
+        printf( "%I64u of %I64u records matched in %lu ms: %I64u blocks (%I64u KB) read, %I64u skipped by the index\n",
+                query.RecordsMatched,
+                query.RecordsRead,
+                GetTickCount() - started,
+                query.BlocksRead,
+                query.BytesRead / 1024,
+                query.BlocksSkipped );
+    }
+
+    LogSearchCleanup( &query );
+
+    return 0;
+
+LogQuery_Usage:
+    LogSearchCleanup( &query );
+    printf( "Usage: minispy /i <dir> [path:<name>] [proc:<image>] [pid:<id>] [from:<time>] [to:<time>] [scan]\n"
+            "    searches the log written by /w in <dir>; times are local, YYYY-MM-DD[Thh:mm[:ss]]\n" );
+    return 1;
+}
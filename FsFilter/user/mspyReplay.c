@@ -0,0 +1,445 @@
+/*++
+
+Module Name:
+
+    mspyReplay.c
+
+Abstract:
+
+    This module writes and reads capture files, and walks a batch of
+    records as the log thread does: each record is checked for length
+    and for its place in its queue's sequence, the lane it is to be
+    acknowledged on is brought up to date, and it is handed on.
+
+    The log thread walks the batches it gets from the filter through
+    here, and /v the batches of a capture, so a capture played back is
+    consumed exactly as it was live.  Nothing here depends on Win32; the
+    capture's lock, the performance counter and the pacing of a playback
+    are left to mspyCapture.c.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <string.h>
+#include "mspyReplay.h"
+
+//---------------------------------------------------------------------------
+//                    Capture files
+//---------------------------------------------------------------------------
+
+BOOLEAN
+CaptureWriteHeader (
+    __in FILE *File,
+    __in LONGLONG Frequency,
+    __in LONGLONG Started
+    )
+/*++
+
+Routine Description:
+
+    Starts a capture file.
+
+Arguments:
+
+    File - the capture file, opened for binary writing
+    Frequency - of the counter the batches will be timed with
+    Started - the system time, in 100ns units since 1601
+
+Return Value:
+
+    FALSE if the header could not be written.
+
+--*/
+{
+    CAPTURE_FILE_HEADER header;
+
+    memset( &header, 0, sizeof( header ) );
+
+    header.Signature = CAPTURE_FILE_SIGNATURE;
+    header.Version = CAPTURE_VERSION;
+    header.Frequency.QuadPart = Frequency;
+    header.Started.QuadPart = Started;
+
+    return (BOOLEAN)(fwrite( &header, sizeof( header ), 1, File ) == 1);
+}
+
+BOOLEAN
+CaptureWriteBatch (
+    __in FILE *File,
+    __in LONGLONG Ticks,
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Appends a batch to a capture file.
+
+Arguments:
+
+    File - the capture file
+    Ticks - the counter when the batch came back from the filter
+    Buffer - the batch, as GetMiniSpyLog returned it
+    Length - its size in bytes
+
+Return Value:
+
+    FALSE if the batch could not be written.
+
+--*/
+{
+    CAPTURE_BATCH_HEADER header;
+
+    memset( &header, 0, sizeof( header ) );
+
+    header.Signature = CAPTURE_BATCH_SIGNATURE;
+    header.Length = Length;
+    header.Ticks.QuadPart = Ticks;
+
+    return (BOOLEAN)(fwrite( &header, sizeof( header ), 1, File ) == 1 &&
+                     (Length == 0 || fwrite( Buffer, Length, 1, File ) == 1));
+}
+
+BOOLEAN
+CaptureReadHeader (
+    __in FILE *File,
+    __out PCAPTURE_FILE_HEADER Header
+    )
+/*++
+
+Routine Description:
+
+    Reads and checks the header of a capture file.
+
+Arguments:
+
+    File - the capture file, opened for binary reading
+    Header - receives the header
+
+Return Value:
+
+    FALSE if the file is not a capture this version can read.
+
+--*/
+{
+    return (BOOLEAN)(fread( Header, sizeof( CAPTURE_FILE_HEADER ), 1, File ) == 1 &&
+                     Header->Signature == CAPTURE_FILE_SIGNATURE &&
+                     Header->Version == CAPTURE_VERSION &&
+                     Header->Frequency.QuadPart != 0);
+}
+
+BOOLEAN
+CaptureReadBatch (
+    __in FILE *File,
+    __out PCAPTURE_BATCH_HEADER Header,
+    __out_bcount(BufferLength) PVOID Buffer,
+    __in ULONG BufferLength
+    )
+/*++
+
+Routine Description:
+
+    Reads the next batch of a capture file.
+
+Arguments:
+
+    File - the capture file, past its header
+    Header - receives the batch's header
+    Buffer - receives the batch, which should be pointer aligned
+    BufferLength - its size, at least BUFFER_SIZE
+
+Return Value:
+
+    FALSE at the end of the capture, or at a batch that is cut short or
+    is not one.
+
+--*/
+{
+    return (BOOLEAN)(fread( Header, sizeof( CAPTURE_BATCH_HEADER ), 1, File ) == 1 &&
+                     Header->Signature == CAPTURE_BATCH_SIGNATURE &&
+                     Header->Length <= BufferLength &&
+                     (Header->Length == 0 || fread( Buffer, Header->Length, 1, File ) == 1));
+}
+
+//---------------------------------------------------------------------------
+//                    Sequence checks
+//---------------------------------------------------------------------------
+
+VOID
+SequenceReset (
+    __out PLOG_SEQUENCE Sequence
+    )
+/*++
+
+Routine Description:
+
+    Starts the checks over, as for a new connection to the filter.
+
+Arguments:
+
+    Sequence - the checks
+
+Return Value:
+
+    None.
+
+--*/
+{
+    memset( Sequence, 0, sizeof( LOG_SEQUENCE ) );
+}
+
+VOID
+SequenceCheck (
+    __inout PLOG_SEQUENCE Sequence,
+    __in PLOG_RECORD LogRecord
+    )
+/*++
+Routine Description:
+
+    Checks that no record went missing without a word.  Each filter queue
+    numbers and sends its records in order, and a gap record stands for
+    exactly the run of numbers just before its own, so a queue's sequence
+    may only jump on a gap record, and only by the gap's Count.  Any other
+    jump adds to that queue's Missing count, as does a gap record whose
+    range does not match the numbers actually skipped.
+
+    Priority records are numbered separately and never leave gaps, so
+    any jump there is reported straight away.
+
+Arguments:
+
+    Sequence - the checks
+    LogRecord - the record just received
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG sequence = LogRecord->SequenceNumber;
+    ULONG queue = LogRecord->Processor;
+    ULONG expected;
+    PRECORD_GAP gap;
+
+    if (FlagOn(LogRecord->RecordType,RECORD_TYPE_FLAG_PRIORITY)) {
+
+        if (Sequence->NextPrioritySequence != 0 &&
+            (LONG)(sequence - Sequence->NextPrioritySequence) > 0) {
+
+            printf( "Sequence check: %lu priority records missing before %08lX\n",
+                    (unsigned long)(sequence - Sequence->NextPrioritySequence),
+                    (unsigned long)sequence );
+        }
+
+        Sequence->NextPrioritySequence = sequence + 1;
+        return;
+    }
+
+    if (queue >= LOG_QUEUES) {
+
+        printf( "Sequence check: %08lX comes from unknown queue %lu\n",
+                (unsigned long)sequence,
+                (unsigned long)queue );
+        return;
+    }
+
+    expected = Sequence->NextSequence[queue];
+    Sequence->NextSequence[queue] = sequence + 1;
+
+    if (expected != 0 && (LONG)(sequence - expected) < 0) {
+
+        //
+        //  The filter was restarted, start over.
+        //
+
+        memset( Sequence->Missing, 0, sizeof( Sequence->Missing ) );
+        memset( Sequence->MissingReported, 0, sizeof( Sequence->MissingReported ) );
+        memset( Sequence->NextSequence, 0, sizeof( Sequence->NextSequence ) );
+        Sequence->NextSequence[queue] = sequence + 1;
+        return;
+    }
+
+    if (!FlagOn(LogRecord->RecordType,RECORD_TYPE_GAP)) {
+
+        if (expected != 0) {
+
+            Sequence->Missing[queue] += sequence - expected;
+        }
+
+        return;
+    }
+
+    gap = (PRECORD_GAP)LogRecord->Name;
+
+    if (gap->Count == 0 ||
+        gap->LastSequence - gap->FirstSequence + 1 != gap->Count ||
+        gap->LastSequence + 1 != sequence ||
+        (expected != 0 && gap->FirstSequence != expected)) {
+
+        printf( "Sequence check: %08lX reports %lu lost on queue %lu as %08lX-%08lX but %lu were skipped\n",
+                (unsigned long)sequence,
+                (unsigned long)gap->Count,
+                (unsigned long)queue,
+                (unsigned long)gap->FirstSequence,
+                (unsigned long)gap->LastSequence,
+                (unsigned long)(expected != 0 ? sequence - expected : gap->Count) );
+
+        if (expected != 0 && sequence - expected > gap->Count) {
+
+            Sequence->Missing[queue] += sequence - expected - gap->Count;
+        }
+    }
+}
+
+VOID
+SequenceReport (
+    __inout PLOG_SEQUENCE Sequence
+    )
+/*++
+Routine Description:
+
+    Called when the filter has nothing more to send.  Reports the sequence
+    numbers each queue skipped without a gap record to account for them,
+    once per new total.
+
+Arguments:
+
+    Sequence - the checks
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG queue;
+
+    for (queue = 0; queue < LOG_QUEUES; queue++) {
+
+        if (Sequence->Missing[queue] == Sequence->MissingReported[queue]) {
+
+            continue;
+        }
+
+        Sequence->MissingReported[queue] = Sequence->Missing[queue];
+
+        if (Sequence->Missing[queue] != 0) {
+
+            printf( "Sequence check: %lu records missing on queue %lu before %08lX with no gap record\n",
+                    (unsigned long)Sequence->Missing[queue],
+                    (unsigned long)queue,
+                    (unsigned long)Sequence->NextSequence[queue] );
+        }
+    }
+}
+
+//---------------------------------------------------------------------------
+//                    Batches
+//---------------------------------------------------------------------------
+
+ULONG
+ReplayBatch (
+    __inout PLOG_SEQUENCE Sequence,
+    __in_bcount(Length) PVOID Buffer,
+    __in ULONG Length,
+    __in PREPLAY_RECORD_ROUTINE Routine,
+    __in_opt PVOID Context,
+    __out PULONG Used
+    )
+/*++
+
+Routine Description:
+
+    Walks a batch of records as GetMiniSpyLog returned it, checking each
+    record's length and sequence number, noting it as received on its
+    lane and handing it to Routine.  The walk stops at the first record
+    that does not fit.
+
+Arguments:
+
+    Sequence - the checks
+    Buffer - the batch
+    Length - its size in bytes
+    Routine - called for each record
+    Context - passed to Routine
+    Used - receives the bytes of the records handed on, which are the
+        ones worth keeping
+
+Return Value:
+
+    The number of records handed on.
+
+--*/
+{
+    PLOG_RECORD pLogRecord;
+    ULONG used;
+    ULONG records;
+
+    //
+    //  Buffer is filled with a series of LOG_RECORD structures, one
+    //  right after another.  Each LOG_RECORD says how long it is, so
+    //  we know where the next LOG_RECORD begins.
+    //
+
+    pLogRecord = (PLOG_RECORD) Buffer;
+    used = 0;
+    records = 0;
+
+    for (;;) {
+
+        if (used+FIELD_OFFSET(LOG_RECORD,Name) > Length) {
+
+            break;
+        }
+
+        if (pLogRecord->Length < (sizeof(LOG_RECORD)+sizeof(WCHAR))) {
+
+            printf( "UNEXPECTED LOG_RECORD->Length: length=%lu expected>=%lu\n",
+                    (unsigned long)pLogRecord->Length,
+                    (unsigned long)(sizeof(LOG_RECORD)+sizeof(WCHAR)));
+
+            break;
+        }
+
+        if (used + pLogRecord->Length > Length) {
+
+            printf( "UNEXPECTED LOG_RECORD size: used=%lu bytesReturned=%lu\n",
+                    (unsigned long)(used + pLogRecord->Length),
+                    (unsigned long)Length);
+
+            break;
+        }
+
+        used += pLogRecord->Length;
+
+        SequenceCheck( Sequence, pLogRecord );
+        records++;
+
+        if (FlagOn(pLogRecord->RecordType,RECORD_TYPE_FLAG_PRIORITY)) {
+
+            Sequence->Received[LOG_QUEUES] = pLogRecord->SequenceNumber;
+
+        } else if (pLogRecord->Processor < LOG_QUEUES) {
+
+            Sequence->Received[pLogRecord->Processor] = pLogRecord->SequenceNumber;
+        }
+
+        Routine( Context, pLogRecord );
+
+        //
+        // Move to next LOG_RECORD
+        //
+
+        pLogRecord = (PLOG_RECORD)Add2Ptr(pLogRecord,pLogRecord->Length);
+    }
+
+    *Used = used;
+
+    return records;
+}
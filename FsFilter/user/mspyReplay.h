@@ -0,0 +1,154 @@
+/*++
+
+Module Name:
+
+    mspyReplay.h
+
+Abstract:
+
+    This module contains the structures and prototypes of the part of the
+    log consumer that only looks at bytes: the capture file behind /z and
+    /v, and the walk the log thread and /v take through each batch, with
+    its sequence checks.  See mspyReplay.c.
+
+    Like mspyDecode.h it needs nothing from Win32, so a capture can be
+    written, read and played back wherever mspyTypes.h builds.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYREPLAY_H__
+#define __MSPYREPLAY_H__
+
+#include <stdio.h>
+#include "mspyTypes.h"
+#include "miniSpy.h"
+
+//
+//  A capture file is a CAPTURE_FILE_HEADER followed by one
+//  CAPTURE_BATCH_HEADER per batch, each followed by Length bytes of
+//  LOG_RECORD structures just as GetMiniSpyLog returned them.  A file cut
+//  short by a crash ends at the first incomplete batch.
+//
+
+#define CAPTURE_FILE_SIGNATURE      'FCSM'
+#define CAPTURE_BATCH_SIGNATURE     'BCSM'
+#define CAPTURE_VERSION             1
+
+typedef struct _CAPTURE_FILE_HEADER {
+
+    ULONG Signature;
+    ULONG Version;
+
+    //
+    //  Of the performance counter the batches are timed with, and the
+    //  system time the capture started.
+    //
+
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Started;
+
+} CAPTURE_FILE_HEADER, *PCAPTURE_FILE_HEADER;
+
+typedef struct _CAPTURE_BATCH_HEADER {
+
+    ULONG Signature;
+    ULONG Length;
+
+    //
+    //  The performance counter when the batch came back from the filter.
+    //
+
+    LARGE_INTEGER Ticks;
+
+} CAPTURE_BATCH_HEADER, *PCAPTURE_BATCH_HEADER;
+
+//
+//  The sequence continuity check, see SequenceCheck.  Each filter queue
+//  numbers its records separately; NextSequence is 0 until the first
+//  record from that queue arrives.  Received is the last sequence number
+//  taken from each queue and, in the last entry, from the priority lane,
+//  which is what is acknowledged.  See MINISPY_CONNECT.
+//
+
+typedef struct _LOG_SEQUENCE {
+
+    ULONG NextSequence[LOG_QUEUES];
+    ULONG Missing[LOG_QUEUES];
+    ULONG MissingReported[LOG_QUEUES];
+
+    ULONG NextPrioritySequence;
+
+    ULONG Received[ACK_LANES];
+
+} LOG_SEQUENCE, *PLOG_SEQUENCE;
+
+//
+//  Called by ReplayBatch for each record that checked out, in the order
+//  they came.
+//
+
+typedef VOID (*PREPLAY_RECORD_ROUTINE)( PVOID Context, PLOG_RECORD LogRecord );
+
+//
+//  Function prototypes
+//
+
+BOOLEAN
+CaptureWriteHeader (
+    __in FILE *File,
+    __in LONGLONG Frequency,
+    __in LONGLONG Started
+    );
+
+BOOLEAN
+CaptureWriteBatch (
+    __in FILE *File,
+    __in LONGLONG Ticks,
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length
+    );
+
+BOOLEAN
+CaptureReadHeader (
+    __in FILE *File,
+    __out PCAPTURE_FILE_HEADER Header
+    );
+
+BOOLEAN
+CaptureReadBatch (
+    __in FILE *File,
+    __out PCAPTURE_BATCH_HEADER Header,
+    __out_bcount(BufferLength) PVOID Buffer,
+    __in ULONG BufferLength
+    );
+
+VOID
+SequenceReset (
+    __out PLOG_SEQUENCE Sequence
+    );
+
+VOID
+SequenceCheck (
+    __inout PLOG_SEQUENCE Sequence,
+    __in PLOG_RECORD LogRecord
+    );
+
+VOID
+SequenceReport (
+    __inout PLOG_SEQUENCE Sequence
+    );
+
+ULONG
+ReplayBatch (
+    __inout PLOG_SEQUENCE Sequence,
+    __in_bcount(Length) PVOID Buffer,
+    __in ULONG Length,
+    __in PREPLAY_RECORD_ROUTINE Routine,
+    __in_opt PVOID Context,
+    __out PULONG Used
+    );
+
+#endif //__MSPYREPLAY_H__
@@ -0,0 +1,592 @@
+/*++
+
+Module Name:
+
+    mspyRules.c
+
+Abstract:
+
+    This module compiles a policy rule file into the POLICY_RULES the
+    filter takes with SetMiniSpyRules.  A rule file has one rule to a
+    line:
+
+        <allow|deny> <operations> [path:<text>] [ext:<extension>]
+                                  [proc:<image>] [user:<account or SID>]
+
+    where <operations> is all, or some of read, create, write, rename,
+    delete and info separated by commas.  A value with spaces is put in
+    double quotes.  Everything after a # is a comment.  For instance
+
+        # Finance: only Excel run by Accountants may write, all may
+        # read, nobody may rename.
+        deny  rename        path:D:\Finance\
+        allow create,write  path:D:\Finance\ proc:\excel.exe user:CORP\Accountants
+        deny  create,write  path:D:\Finance\
+        allow read          path:D:\Finance\
+
+    The first rule that applies to an operation decides it, so the order
+    of the lines matters.
+
+    Everything that costs a lookup is done here, once: a path starting
+    with a drive letter is turned into the device name the filter sees,
+    and an account is looked up and sent as its binary SID.  The filter
+    is left with string compares and SID compares, which it tries
+    cheapest first.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <DriverSpecs.h>
+__user_code
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include <sddl.h>
+#include "mspyRules.h"
+
+static const PCHAR RulesOperationNames[RULE_OPS] = { "read", "create", "write", "rename", "delete", "info" };
+
+//
+//  What a rule file is being compiled into, and where in it we are, for
+//  the messages.
+//
+
+typedef struct _RULES_COMPILER {
+
+    PPOLICY_RULES Rules;
+    PCSTR FileName;
+    ULONG Line;
+
+} RULES_COMPILER, *PRULES_COMPILER;
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+BOOLEAN
+RulesNextToken (
+    __inout PCHAR *Cursor,
+    __out_ecount(TokenSize) PCHAR Token,
+    __in ULONG TokenSize
+    )
+/*++
+
+Routine Description:
+
+    Takes the next white space separated token off a line, dropping the
+    double quotes around any part of it.  A # outside quotes ends the
+    line.
+
+Arguments:
+
+    Cursor - where to start, moved past the token
+    Token - receives the token
+    TokenSize - its size in characters
+
+Return Value:
+
+    FALSE if there is no token left or it does not fit.
+
+--*/
+{
+    PCHAR cursor = *Cursor;
+    ULONG length = 0;
+    BOOLEAN quoted = FALSE;
+
+    while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r' || *cursor == '\n') {
+
+        cursor++;
+    }
+
+    if (*cursor == '\0' || *cursor == '#') {
+
+        return FALSE;
+    }
+
+    while (*cursor != '\0' &&
+           (quoted || (*cursor != ' ' && *cursor != '\t' && *cursor != '\r' &&
+                       *cursor != '\n' && *cursor != '#'))) {
+
+        if (*cursor == '"') {
+
+            quoted = (BOOLEAN)!quoted;
+
+        } else {
+
+            if (length + 1 >= TokenSize) {
+
+                return FALSE;
+            }
+
+            Token[length++] = *cursor;
+        }
+
+        cursor++;
+    }
+
+    Token[length] = '\0';
+    *Cursor = cursor;
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+RulesAddBytes (
+    __inout PRULES_COMPILER Compiler,
+    __in_bcount(Length) PVOID Bytes,
+    __in ULONG Length,
+    __in ULONG Alignment,
+    __out PUSHORT Offset
+    )
+/*++
+
+Routine Description:
+
+    Appends a string or SID to the rules' strings.
+
+Arguments:
+
+    Compiler - the compiler
+    Bytes - what to append
+    Length - its size in bytes
+    Alignment - what its offset must be a multiple of
+    Offset - receives its offset
+
+Return Value:
+
+    FALSE if the strings are full.
+
+--*/
+{
+    PPOLICY_RULES rules = Compiler->Rules;
+    ULONG offset = (rules->StringsLength + Alignment - 1) & ~(Alignment - 1);
+
+    if (offset + Length > RULE_MAX_STRINGS) {
+
+        printf( "%s(%lu): the rules take more than %d bytes of strings\n",
+                Compiler->FileName,
+                Compiler->Line,
+                RULE_MAX_STRINGS );
+        return FALSE;
+    }
+
+    CopyMemory( &rules->Strings[offset], Bytes, Length );
+    rules->StringsLength = offset + Length;
+    *Offset = (USHORT)offset;
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+RulesAddString (
+    __inout PRULES_COMPILER Compiler,
+    __in PCSTR Text,
+    __out PUSHORT Offset
+    )
+{
+    WCHAR string[MAX_PATH];
+    int length;
+
+    length = MultiByteToWideChar( CP_ACP, MB_ERR_INVALID_CHARS, Text, -1, string, MAX_PATH );
+
+    if (length <= 1) {
+
+        printf( "%s(%lu): \"%s\" is empty, too long or not valid\n",
+                Compiler->FileName,
+                Compiler->Line,
+                Text );
+        return FALSE;
+    }
+
+    return RulesAddBytes( Compiler, string, length * sizeof( WCHAR ), sizeof( WCHAR ), Offset );
+}
+
+static
+BOOLEAN
+RulesAddPath (
+    __inout PRULES_COMPILER Compiler,
+    __in PCSTR Path,
+    __out PUSHORT Offset
+    )
+/*++
+
+Routine Description:
+
+    Appends a path, with a leading drive letter replaced by the device
+    name the filter's normalized names start with.  Other paths are
+    matched as they are, anywhere in the name, like the protected
+    folders.
+
+Arguments:
+
+    Compiler - the compiler
+    Path - the path
+    Offset - receives its offset
+
+Return Value:
+
+    FALSE if the drive is unknown or the strings are full.
+
+--*/
+{
+    CHAR drive[3];
+    CHAR device[MAX_PATH * 2];
+
+    if (Path[0] == '\0' || Path[1] != ':') {
+
+        return RulesAddString( Compiler, Path, Offset );
+    }
+
+    drive[0] = Path[0];
+    drive[1] = ':';
+    drive[2] = '\0';
+
+    if (QueryDosDeviceA( drive, device, MAX_PATH ) == 0) {
+
+        printf( "%s(%lu): drive %s is not known, error %lu\n",
+                Compiler->FileName,
+                Compiler->Line,
+                drive,
+                GetLastError() );
+        return FALSE;
+    }
+
+    if (strlen( device ) + strlen( &Path[2] ) >= sizeof( device )) {
+
+        printf( "%s(%lu): %s is too long\n", Compiler->FileName, Compiler->Line, Path );
+        return FALSE;
+    }
+
+    strcat( device, &Path[2] );
+
+    return RulesAddString( Compiler, device, Offset );
+}
+
+static
+BOOLEAN
+RulesAddUser (
+    __inout PRULES_COMPILER Compiler,
+    __in PCSTR Account,
+    __out PUSHORT Offset
+    )
+/*++
+
+Routine Description:
+
+    Appends the binary SID of an account name, or of a SID in string
+    form.
+
+Arguments:
+
+    Compiler - the compiler
+    Account - the account, or the SID as S-1-...
+    Offset - receives the offset of the SID
+
+Return Value:
+
+    FALSE if the account is unknown or the strings are full.
+
+--*/
+{
+    UCHAR sid[SECURITY_MAX_SID_SIZE];
+    DWORD sidSize = sizeof( sid );
+    CHAR domain[MAX_PATH];
+    DWORD domainSize = MAX_PATH;
+    SID_NAME_USE use;
+    PSID converted;
+    BOOLEAN added;
+
+    if (!_strnicmp( Account, "S-", 2 )) {
+
+        if (!ConvertStringSidToSidA( Account, &converted )) {
+
+            printf( "%s(%lu): %s is not a SID, error %lu\n",
+                    Compiler->FileName,
+                    Compiler->Line,
+                    Account,
+                    GetLastError() );
+            return FALSE;
+        }
+
+        added = RulesAddBytes( Compiler, converted, GetLengthSid( converted ), sizeof( ULONG ), Offset );
+        LocalFree( converted );
+
+        return added;
+    }
+
+    if (!LookupAccountNameA( NULL, Account, sid, &sidSize, domain, &domainSize, &use )) {
+
+        printf( "%s(%lu): account %s is not known, error %lu\n",
+                Compiler->FileName,
+                Compiler->Line,
+                Account,
+                GetLastError() );
+        return FALSE;
+    }
+
+    return RulesAddBytes( Compiler, sid, GetLengthSid( sid ), sizeof( ULONG ), Offset );
+}
+
+static
+BOOLEAN
+RulesParseOperations (
+    __in PRULES_COMPILER Compiler,
+    __in PCHAR Text,
+    __out PUSHORT Operations
+    )
+{
+    PCHAR name;
+    PCHAR next;
+    ULONG operation;
+
+    *Operations = 0;
+
+    if (!_stricmp( Text, "all" )) {
+
+        *Operations = RULE_OP_ALL;
+        return TRUE;
+    }
+
+    for (name = Text; name != NULL; name = next) {
+
+        next = strchr( name, ',' );
+
+        if (next != NULL) {
+
+            *next++ = '\0';
+        }
+
+        for (operation = 0; operation < RULE_OPS; operation++) {
+
+            if (!_stricmp( name, RulesOperationNames[operation] )) {
+
+                *Operations |= (USHORT)(1 << operation);
+                break;
+            }
+        }
+
+        if (operation == RULE_OPS) {
+
+            printf( "%s(%lu): %s is not an operation\n", Compiler->FileName, Compiler->Line, name );
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+RulesParseLine (
+    __inout PRULES_COMPILER Compiler,
+    __in PCHAR Line
+    )
+/*++
+
+Routine Description:
+
+    Compiles one line of a rule file, which may hold a rule or nothing.
+
+Arguments:
+
+    Compiler - the compiler
+    Line - the line
+
+Return Value:
+
+    FALSE if the line is not valid.
+
+--*/
+{
+    PPOLICY_RULES rules = Compiler->Rules;
+    PPOLICY_RULE rule;
+    CHAR token[RULES_MAX_LINE];
+    PCHAR value;
+    PUSHORT predicate;
+
+    if (!RulesNextToken( &Line, token, sizeof( token ) )) {
+
+        return TRUE;
+    }
+
+    if (rules->Count == RULE_MAX) {
+
+        printf( "%s(%lu): there are more than %d rules\n", Compiler->FileName, Compiler->Line, RULE_MAX );
+        return FALSE;
+    }
+
+    rule = &rules->Rules[rules->Count];
+    rule->Path = RULE_ANY;
+    rule->Extension = RULE_ANY;
+    rule->Process = RULE_ANY;
+    rule->User = RULE_ANY;
+
+    if (!_stricmp( token, "allow" )) {
+
+        rule->Verdict = RULE_ALLOW;
+
+    } else if (!_stricmp( token, "deny" )) {
+
+        rule->Verdict = RULE_DENY;
+
+    } else {
+
+        printf( "%s(%lu): a rule starts with allow or deny, not %s\n",
+                Compiler->FileName,
+                Compiler->Line,
+                token );
+        return FALSE;
+    }
+
+    if (!RulesNextToken( &Line, token, sizeof( token ) )) {
+
+        printf( "%s(%lu): the operations are missing\n", Compiler->FileName, Compiler->Line );
+        return FALSE;
+    }
+
+    if (!RulesParseOperations( Compiler, token, &rule->Operations )) {
+
+        return FALSE;
+    }
+
+    while (RulesNextToken( &Line, token, sizeof( token ) )) {
+
+        value = strchr( token, ':' );
+
+        if (value == NULL) {
+
+            printf( "%s(%lu): %s is not <name>:<value>\n", Compiler->FileName, Compiler->Line, token );
+            return FALSE;
+        }
+
+        *value++ = '\0';
+
+        if (!_stricmp( token, "path" )) {
+
+            predicate = &rule->Path;
+
+        } else if (!_stricmp( token, "ext" )) {
+
+            predicate = &rule->Extension;
+
+            if (*value == '.') {
+
+                value++;
+            }
+
+        } else if (!_stricmp( token, "proc" )) {
+
+            predicate = &rule->Process;
+
+        } else if (!_stricmp( token, "user" )) {
+
+            predicate = &rule->User;
+
+        } else {
+
+            printf( "%s(%lu): %s is not path, ext, proc or user\n", Compiler->FileName, Compiler->Line, token );
+            return FALSE;
+        }
+
+        if (*predicate != RULE_ANY) {
+
+            printf( "%s(%lu): %s is given twice\n", Compiler->FileName, Compiler->Line, token );
+            return FALSE;
+        }
+
+        if (predicate == &rule->Path) {
+
+            if (!RulesAddPath( Compiler, value, predicate )) {
+
+                return FALSE;
+            }
+
+        } else if (predicate == &rule->User) {
+
+            if (!RulesAddUser( Compiler, value, predicate )) {
+
+                return FALSE;
+            }
+
+        } else if (!RulesAddString( Compiler, value, predicate )) {
+
+            return FALSE;
+        }
+    }
+
+    rules->Count++;
+
+    return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+BOOLEAN
+RulesCompile (
+    __in PCSTR FileName,
+    __out PPOLICY_RULES Rules
+    )
+/*++
+
+Routine Description:
+
+    Compiles a rule file, saying what is wrong with it if anything.
+
+Arguments:
+
+    FileName - the rule file
+    Rules - receives the rules
+
+Return Value:
+
+    TRUE if the whole file compiled.
+
+--*/
+{
+    RULES_COMPILER compiler;
+    CHAR line[RULES_MAX_LINE];
+    FILE *file;
+    BOOLEAN compiled = TRUE;
+
+    ZeroMemory( Rules, sizeof( POLICY_RULES ) );
+
+    compiler.Rules = Rules;
+    compiler.FileName = FileName;
+    compiler.Line = 0;
+
+    file = fopen( FileName, "r" );
+
+    if (file == NULL) {
+
+        printf( "Could not open %s\n", FileName );
+        return FALSE;
+    }
+
+    while (compiled && fgets( line, sizeof( line ), file ) != NULL) {
+
+        compiler.Line++;
+        compiled = RulesParseLine( &compiler, line );
+    }
+
+    fclose( file );
+
+    if (compiled) {
+
+        printf( "    Compiled %lu rules, %lu bytes of strings, from %s\n",
+                Rules->Count,
+                Rules->StringsLength,
+                FileName );
+    }
+
+    return compiled;
+}
@@ -0,0 +1,39 @@
+/*++
+
+Module Name:
+
+    mspyRules.h
+
+Abstract:
+
+    This module contains the prototypes of the policy rule compiler
+    behind /o, which turns a rule file into the POLICY_RULES the filter
+    takes with SetMiniSpyRules.  See mspyRules.c.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYRULES_H__
+#define __MSPYRULES_H__
+
+#include "minispy.h"
+
+//
+//  The longest line of a rule file.
+//
+
+#define RULES_MAX_LINE          1024
+
+//
+//  Function prototypes
+//
+
+BOOLEAN
+RulesCompile (
+    __in PCSTR FileName,
+    __out PPOLICY_RULES Rules
+    );
+
+#endif //__MSPYRULES_H__
@@ -0,0 +1,502 @@
+/*++
+
+Module Name:
+
+    mspySearch.c
+
+Abstract:
+
+    This module finds the records the log writer kept that match a
+    query, such as which processes touched a file or directory in a given
+    time, without reading the whole log.
+
+    Each segment's index is read first.  A block is only read when its
+    entry's time range overlaps the query and its Bloom filters may hold
+    the path and the process asked for; its records are then checked one
+    by one.  Blocks the index does not cover, because the writer stopped
+    before writing their entries, are read one after another until the
+    end of the segment.
+
+    The search can also ignore the indexes and read every block, to check
+    them and to see what they save.
+
+    Nothing here depends on Win32, so a log can be searched, and the
+    search measured, wherever mspyFile.c builds.  The /i command of
+    mspyQuery.c reads its arguments and prints what this finds.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+#include "mspySearch.h"
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+BOOLEAN
+SearchSameName (
+    __in_ecount(Length) CONST WCHAR *First,
+    __in_ecount(Length) CONST WCHAR *Second,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Compares two names without regard to case, as the index hashes them.
+
+Arguments:
+
+    First - a name
+    Second - the name to compare it with
+    Length - how many characters to compare
+
+Return Value:
+
+    TRUE if they are the same.
+
+--*/
+{
+    while (Length-- != 0) {
+
+        if (*First != *Second && towupper( *First ) != towupper( *Second )) {
+
+            return FALSE;
+        }
+
+        First++;
+        Second++;
+    }
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+SearchEntryMatches (
+    __in PLOG_SEARCH Search,
+    __in PLOG_INDEX_ENTRY Entry
+    )
+/*++
+
+Routine Description:
+
+    Tells whether a block may hold records that match, from its index
+    entry alone.
+
+Arguments:
+
+    Search - the search
+    Entry - the block's entry
+
+Return Value:
+
+    FALSE if the block certainly holds none.
+
+--*/
+{
+    if (Entry->LastTime.QuadPart < Search->From.QuadPart ||
+        Entry->FirstTime.QuadPart > Search->To.QuadPart) {
+
+        return FALSE;
+    }
+
+    if (Search->PathLength != 0 &&
+        !LogBloomMayContain( Entry->PathBloom, LOG_BLOOM_PATH_BITS, Search->Path, Search->PathLength )) {
+
+        return FALSE;
+    }
+
+    if (Search->ImageLength != 0 &&
+        !LogBloomMayContain( Entry->ProcessBloom, LOG_BLOOM_PROCESS_BITS, Search->Image, Search->ImageLength )) {
+
+        return FALSE;
+    }
+
+    if (Search->ByProcessId &&
+        !LogBloomMayContainId( Entry->ProcessBloom, LOG_BLOOM_PROCESS_BITS, Search->ProcessId )) {
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+SearchRecordMatches (
+    __in PLOG_SEARCH Search,
+    __in PLOG_RECORD LogRecord
+    )
+/*++
+
+Routine Description:
+
+    Tells whether a record matches.  Only records of file operations do.
+
+Arguments:
+
+    Search - the search
+    LogRecord - the record
+
+Return Value:
+
+    TRUE if it matches.
+
+--*/
+{
+    LOG_RECORD_NAMES names;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP | RECORD_TYPE_SUMMARY )) {
+
+        return FALSE;
+    }
+
+    if (LogRecord->Data.OriginatingTime.QuadPart < Search->From.QuadPart ||
+        LogRecord->Data.OriginatingTime.QuadPart > Search->To.QuadPart) {
+
+        return FALSE;
+    }
+
+    if (Search->ByProcessId && LogRecord->Data.ProcessId != Search->ProcessId) {
+
+        return FALSE;
+    }
+
+    LogRecordNames( LogRecord, &names );
+
+    //
+    //  The path matches itself and anything under it.
+    //
+
+    if (Search->PathLength != 0 &&
+        (names.PathLength < Search->PathLength ||
+         !SearchSameName( names.Path, Search->Path, Search->PathLength ) ||
+         (names.PathLength > Search->PathLength && names.Path[Search->PathLength] != L'\\'))) {
+
+        return FALSE;
+    }
+
+    if (Search->ImageLength != 0 &&
+        (names.ImageLength != Search->ImageLength ||
+         !SearchSameName( names.Image, Search->Image, Search->ImageLength ))) {
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+SearchReadBlock (
+    __inout PLOG_SEARCH Search,
+    __in LOG_FILE Segment,
+    __in ULONGLONG Offset,
+    __out PULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Reads the block at Offset into Search->Block and checks it.
+
+Arguments:
+
+    Search - the search
+    Segment - the segment
+    Offset - where the block starts
+    Length - receives its length, padding included
+
+Return Value:
+
+    FALSE if there is no whole block there, which is the end of the
+    segment.
+
+--*/
+{
+    PLOG_BLOCK_HEADER header = (PLOG_BLOCK_HEADER)Search->Block;
+    ULONG bytesRead;
+    ULONG firstRead;
+    ULONG length;
+
+    if (LogFileRead( Segment, Offset, Search->Block, LOG_WRITER_ALIGN, &bytesRead ) != ERROR_SUCCESS ||
+        bytesRead < sizeof( LOG_BLOCK_HEADER ) ||
+        header->Signature != LOG_BLOCK_SIGNATURE ||
+        header->Length > LOG_WRITER_BUFFER - sizeof( LOG_BLOCK_HEADER )) {
+
+        return FALSE;
+    }
+
+    length = ROUND_TO_SIZE( sizeof( LOG_BLOCK_HEADER ) + header->Length, LOG_WRITER_ALIGN );
+
+    if (length > bytesRead) {
+
+        firstRead = bytesRead;
+
+        if (LogFileRead( Segment,
+                         Offset + firstRead,
+                         Search->Block + firstRead,
+                         length - firstRead,
+                         &bytesRead ) != ERROR_SUCCESS ||
+            bytesRead != length - firstRead) {
+
+            return FALSE;
+        }
+    }
+
+    if (header->Checksum != LogWriterChecksum( header + 1, header->Length )) {
+
+        return FALSE;
+    }
+
+    Search->BlocksRead++;
+    Search->BytesRead += length;
+    *Length = length;
+
+    return TRUE;
+}
+
+static
+VOID
+SearchBlock (
+    __inout PLOG_SEARCH Search
+    )
+/*++
+
+Routine Description:
+
+    Hands the records in Search->Block that match to Search->Match.
+
+Arguments:
+
+    Search - the search
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PLOG_BLOCK_HEADER header = (PLOG_BLOCK_HEADER)Search->Block;
+    PLOG_RECORD logRecord = (PLOG_RECORD)(header + 1);
+    PUCHAR end = (PUCHAR)(header + 1) + header->Length;
+
+    while ((PUCHAR)logRecord + sizeof( LOG_RECORD ) <= end &&
+           logRecord->Length >= sizeof( LOG_RECORD ) &&
+           (PUCHAR)logRecord + logRecord->Length <= end) {
+
+        Search->RecordsRead++;
+
+        if (SearchRecordMatches( Search, logRecord )) {
+
+            Search->RecordsMatched++;
+
+            if (Search->Match != NULL) {
+
+                Search->Match( Search->MatchContext, logRecord );
+            }
+        }
+
+        logRecord = (PLOG_RECORD)Add2Ptr( logRecord, logRecord->Length );
+    }
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+BOOLEAN
+LogSearchInitialize (
+    __out PLOG_SEARCH Search
+    )
+/*++
+
+Routine Description:
+
+    Sets up a search that matches every record, for the caller to narrow
+    down.
+
+Arguments:
+
+    Search - the search to set up
+
+Return Value:
+
+    FALSE if there was no memory to read blocks into.
+
+--*/
+{
+    memset( Search, 0, sizeof( LOG_SEARCH ) );
+    Search->To.QuadPart = MAXLONGLONG;
+
+    Search->Block = LogFileAllocate( LOG_WRITER_BUFFER );
+
+    return (BOOLEAN)(Search->Block != NULL);
+}
+
+VOID
+LogSearchCleanup (
+    __inout PLOG_SEARCH Search
+    )
+/*++
+
+Routine Description:
+
+    Frees what a search holds.
+
+Arguments:
+
+    Search - the search
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Search->Block != NULL) {
+
+        LogFileFree( Search->Block );
+        Search->Block = NULL;
+    }
+}
+
+VOID
+LogSearchSegment (
+    __inout PLOG_SEARCH Search,
+    __in PCSTR Directory,
+    __in ULONG Number
+    )
+/*++
+
+Routine Description:
+
+    Runs the search over one segment: the blocks its index covers first,
+    then whatever follows them.
+
+Arguments:
+
+    Search - the search
+    Directory - where the segments are
+    Number - the segment's number
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LOG_INDEX_ENTRY entry;
+    LOG_FILE segment;
+    LOG_FILE index = LOG_NO_FILE;
+    ULONGLONG offset = 0;
+    ULONGLONG indexOffset = 0;
+    ULONG length;
+    ULONG bytesRead;
+
+    if (LogFileOpen( Directory,
+                     LOG_SEGMENT_PREFIX,
+                     Number,
+                     LOG_SEGMENT_SUFFIX,
+                     LogFileModeRead,
+                     0,
+                     &segment ) != ERROR_SUCCESS) {
+
+        return;
+    }
+
+    if (!Search->Scan) {
+
+        LogFileOpen( Directory,
+                     LOG_SEGMENT_PREFIX,
+                     Number,
+                     LOG_INDEX_SUFFIX,
+                     LogFileModeRead,
+                     0,
+                     &index );
+    }
+
+    if (index != LOG_NO_FILE) {
+
+        while (LogFileRead( index, indexOffset, &entry, sizeof( entry ), &bytesRead ) == ERROR_SUCCESS &&
+               bytesRead == sizeof( entry ) &&
+               LogIndexValid( &entry ) &&
+               entry.Offset == offset) {
+
+            if (SearchEntryMatches( Search, &entry )) {
+
+                if (!SearchReadBlock( Search, segment, offset, &length ) ||
+                    length != entry.Length) {
+
+                    break;
+                }
+
+                SearchBlock( Search );
+
+            } else {
+
+                Search->BlocksSkipped++;
+            }
+
+            offset += entry.Length;
+            indexOffset += sizeof( entry );
+        }
+
+        LogFileClose( index );
+    }
+
+    while (SearchReadBlock( Search, segment, offset, &length )) {
+
+        SearchBlock( Search );
+        offset += length;
+    }
+
+    LogFileClose( segment );
+}
+
+ULONG
+LogSearchDirectory (
+    __inout PLOG_SEARCH Search,
+    __in PCSTR Directory
+    )
+/*++
+
+Routine Description:
+
+    Runs the search over every segment in a directory, in the order they
+    were written.
+
+Arguments:
+
+    Search - the search
+    Directory - where the segments are
+
+Return Value:
+
+    How many segments there were.
+
+--*/
+{
+    PULONG numbers;
+    ULONG count;
+    ULONG number;
+
+    count = LogFileList( Directory, LOG_SEGMENT_PREFIX, LOG_SEGMENT_SUFFIX, &numbers );
+
+    for (number = 0; number < count; number++) {
+
+        LogSearchSegment( Search, Directory, numbers[number] );
+    }
+
+    free( numbers );
+
+    return count;
+}
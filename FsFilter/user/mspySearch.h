@@ -0,0 +1,103 @@
+/*++
+
+Module Name:
+
+    mspySearch.h
+
+Abstract:
+
+    This module contains the structure and prototypes of the search that
+    answers queries over the log the writer kept, using the index beside
+    each segment.  See mspySearch.c.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYSEARCH_H__
+#define __MSPYSEARCH_H__
+
+#include "mspyTypes.h"
+#include "miniSpy.h"
+#include "mspyFile.h"
+#include "mspyWriter.h"
+
+//
+//  Called with each record that matches, in the order they were written.
+//
+
+typedef VOID
+(*PLOG_SEARCH_MATCH) (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    );
+
+typedef struct _LOG_SEARCH {
+
+    //
+    //  What to look for.  A record matches when it is in the time range
+    //  and matches every name given; an empty name matches anything.
+    //  Names are compared without regard to case, and a path matches
+    //  itself and everything under it.
+    //
+
+    WCHAR Path[LOG_FILE_PATH];
+    ULONG PathLength;
+
+    WCHAR Image[LOG_FILE_PATH];
+    ULONG ImageLength;
+
+    BOOLEAN ByProcessId;
+    FILE_ID ProcessId;
+
+    LARGE_INTEGER From;
+    LARGE_INTEGER To;
+
+    //
+    //  TRUE to read every block whatever the index says.
+    //
+
+    BOOLEAN Scan;
+
+    PLOG_SEARCH_MATCH Match;
+    PVOID MatchContext;
+
+    PUCHAR Block;
+
+    ULONGLONG BlocksRead;
+    ULONGLONG BlocksSkipped;
+    ULONGLONG BytesRead;
+    ULONGLONG RecordsRead;
+    ULONGLONG RecordsMatched;
+
+} LOG_SEARCH, *PLOG_SEARCH;
+
+//
+//  Function prototypes
+//
+
+BOOLEAN
+LogSearchInitialize (
+    __out PLOG_SEARCH Search
+    );
+
+VOID
+LogSearchCleanup (
+    __inout PLOG_SEARCH Search
+    );
+
+ULONG
+LogSearchDirectory (
+    __inout PLOG_SEARCH Search,
+    __in PCSTR Directory
+    );
+
+VOID
+LogSearchSegment (
+    __inout PLOG_SEARCH Search,
+    __in PCSTR Directory,
+    __in ULONG Number
+    );
+
+#endif //__MSPYSEARCH_H__
@@ -0,0 +1,1082 @@
+/*++
+
+Module Name:
+
+    mspySketch.c
+
+Abstract:
+
+    This module keeps running summaries of the records minispy receives,
+    so it can say at any time which processes, users or files were the
+    busiest over the last minutes or hours, and how many distinct ones
+    there were, without keeping the records themselves.
+
+    Records are summarised in buckets, one per minute for the last hour
+    and one per hour for the last day; a bucket is emptied when its
+    minute or hour comes round again.  In each bucket, for each key (the
+    process image, the user and the file name) and each access type:
+
+      - a Space-Saving summary keeps the keys seen most often, which
+        gives the candidates for a top list,
+      - a Count-Min sketch counts every key, which gives the counts of
+        the candidates over any run of buckets,
+      - a HyperLogLog sketch counts the distinct keys; the registers of
+        several buckets combine by taking the largest.
+
+    Every sketch is of fixed size, so the summaries cost the same however
+    many records arrive.
+
+    Nothing here depends on Win32, so the sketches can be checked against
+    exact counts, and timed, wherever mspyFile.c builds.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "mspyIndex.h"
+#include "mspySketch.h"
+
+#define SKETCH_MINUTE           (60 * 10000000LL)
+#define SKETCH_HOUR             (60 * SKETCH_MINUTE)
+
+#define SKETCH_GOLDEN           0x9E3779B97F4A7C15ULL
+
+typedef struct _SKETCH_CANDIDATE {
+
+    ULONGLONG Key;
+    ULONGLONG Estimate;
+    CONST WCHAR *Name;
+    UCHAR Disposition;
+
+} SKETCH_CANDIDATE, *PSKETCH_CANDIDATE;
+
+static PCSTR SketchKeyNames[SketchKeys] = { "processes", "users", "files" };
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+ULONGLONG
+SketchMix (
+    __in ULONGLONG Hash
+    )
+/*++
+
+Routine Description:
+
+    Spreads the bits of a hash, so that every bit of the result depends
+    on every bit of the name.  The sketches take their indexes from
+    different bits.
+
+Arguments:
+
+    Hash - the hash
+
+Return Value:
+
+    The mixed hash.
+
+--*/
+{
+    Hash ^= Hash >> 33;
+    Hash *= 0xFF51AFD7ED558CCDULL;
+    Hash ^= Hash >> 33;
+    Hash *= 0xC4CEB9FE1A85EC53ULL;
+    Hash ^= Hash >> 33;
+
+    return Hash;
+}
+
+static
+ULONGLONG
+SketchHash (
+    __in ULONGLONG NameHash,
+    __in ULONG Disposition
+    )
+/*++
+
+Routine Description:
+
+    Combines the hash of a name with an access type.
+
+Arguments:
+
+    NameHash - the hash of the name
+    Disposition - the access type, an index into SKETCH_DISPOSITION_CHARS
+
+Return Value:
+
+    The hash of the two.
+
+--*/
+{
+    return SketchMix( NameHash + (Disposition + 1) * SKETCH_GOLDEN );
+}
+
+static
+ULONG
+SketchDisposition (
+    __in CHAR Disposition
+    )
+/*++
+
+Routine Description:
+
+    Finds the index of an access type in SKETCH_DISPOSITION_CHARS.
+
+Arguments:
+
+    Disposition - the access type
+
+Return Value:
+
+    The index, 0 for any other.
+
+--*/
+{
+    PCSTR found;
+
+    if (Disposition == '\0') {
+
+        return 0;
+    }
+
+    found = strchr( SKETCH_DISPOSITION_CHARS, Disposition );
+
+    return (found == NULL) ? 0 : (ULONG)(found - SKETCH_DISPOSITION_CHARS);
+}
+
+static
+ULONG
+SketchCountMin (
+    __in PSKETCH_SUMMARY Summary,
+    __in ULONGLONG Hash
+    )
+/*++
+
+Routine Description:
+
+    Estimates how many times a key was counted.  The estimate is never
+    low.
+
+Arguments:
+
+    Summary - the summary of one key in one bucket
+    Hash - the key, see SketchHash
+
+Return Value:
+
+    The estimate.
+
+--*/
+{
+    ULONG first = (ULONG)Hash;
+    ULONG step = (ULONG)(Hash >> 32) | 1;
+    ULONG estimate = Summary->CountMin[0][first % SKETCH_CM_WIDTH];
+    ULONG row;
+
+    for (row = 1; row < SKETCH_CM_DEPTH; row++) {
+
+        if (Summary->CountMin[row][(first + row * step) % SKETCH_CM_WIDTH] < estimate) {
+
+            estimate = Summary->CountMin[row][(first + row * step) % SKETCH_CM_WIDTH];
+        }
+    }
+
+    return estimate;
+}
+
+static
+VOID
+SketchAddKey (
+    __inout PSKETCH_SUMMARY Summary,
+    __in_ecount(Length) CONST WCHAR *Name,
+    __in ULONG Length,
+    __in ULONG Disposition
+    )
+/*++
+
+Routine Description:
+
+    Counts one occurrence of a key.
+
+Arguments:
+
+    Summary - the summary of that key in the current bucket
+    Name - the key's name
+    Length - its length in characters
+    Disposition - the access type, an index into SKETCH_DISPOSITION_CHARS
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONGLONG nameHash = LogHashName( Name, Length );
+    ULONGLONG hash = SketchHash( nameHash, Disposition );
+    ULONGLONG distinct = SketchMix( nameHash );
+    PSKETCH_ENTRY entry = NULL;
+    ULONG first = (ULONG)hash;
+    ULONG step = (ULONG)(hash >> 32) | 1;
+    ULONG register_;
+    UCHAR rank;
+    ULONG i;
+
+    for (i = 0; i < SKETCH_CM_DEPTH; i++) {
+
+        Summary->CountMin[i][(first + i * step) % SKETCH_CM_WIDTH]++;
+    }
+
+    //
+    //  The top bits pick the register, the position of the first one bit
+    //  in the rest is the rank.
+    //
+
+    register_ = (ULONG)(distinct >> (64 - SKETCH_HLL_BITS));
+    distinct <<= SKETCH_HLL_BITS;
+
+    for (rank = 1; rank <= 64 - SKETCH_HLL_BITS && (LONGLONG)distinct >= 0; rank++) {
+
+        distinct <<= 1;
+    }
+
+    if (rank > Summary->Distinct[Disposition][register_]) {
+
+        Summary->Distinct[Disposition][register_] = rank;
+    }
+
+    //
+    //  Space-Saving: a key that is not kept takes the place of the least
+    //  counted one and inherits its count.
+    //
+
+    for (i = 0; i < Summary->Entries; i++) {
+
+        if (Summary->Top[i].Hash == hash) {
+
+            Summary->Top[i].Count++;
+            return;
+        }
+
+        if (entry == NULL || Summary->Top[i].Count < entry->Count) {
+
+            entry = &Summary->Top[i];
+        }
+    }
+
+    if (Summary->Entries < SKETCH_TOP) {
+
+        entry = &Summary->Top[Summary->Entries++];
+        entry->Count = 0;
+    }
+
+    entry->Hash = hash;
+    entry->NameHash = nameHash;
+    entry->Count++;
+    entry->Disposition = (UCHAR)Disposition;
+
+    //
+    //  Long names keep their end, which says the most.
+    //
+
+    if (Length >= SKETCH_KEY_LENGTH) {
+
+        Name += Length - (SKETCH_KEY_LENGTH - 4);
+        Length = SKETCH_KEY_LENGTH - 4;
+        entry->Name[0] = entry->Name[1] = entry->Name[2] = L'.';
+        memcpy( entry->Name + 3, Name, Length * sizeof( WCHAR ) );
+        entry->Name[Length + 3] = UNICODE_NULL;
+
+    } else {
+
+        memcpy( entry->Name, Name, Length * sizeof( WCHAR ) );
+        entry->Name[Length] = UNICODE_NULL;
+    }
+}
+
+static
+PSKETCH_BUCKET
+SketchBucket (
+    __inout PLOG_SKETCH Sketch,
+    __in ULONG Slot,
+    __in LONGLONG Period
+    )
+/*++
+
+Routine Description:
+
+    Finds the bucket of a minute or hour, emptying it if it still holds
+    an older one.
+
+Arguments:
+
+    Sketch - the sketches, with the lock held
+    Slot - the bucket
+    Period - the minute or hour it is for
+
+Return Value:
+
+    The bucket, or NULL if it already holds a later period.
+
+--*/
+{
+    PSKETCH_BUCKET bucket = &Sketch->Buckets[Slot];
+
+    if (bucket->Period == Period) {
+
+        return bucket;
+    }
+
+    if (bucket->Period > Period) {
+
+        return NULL;
+    }
+
+    memset( bucket, 0, sizeof( SKETCH_BUCKET ) );
+    bucket->Period = Period;
+
+    return bucket;
+}
+
+static
+ULONG
+SketchSelect (
+    __in PLOG_SKETCH Sketch,
+    __in ULONG Minutes,
+    __out_ecount(SKETCH_MINUTES) PSKETCH_BUCKET *Selected
+    )
+/*++
+
+Routine Description:
+
+    Finds the buckets that cover the last Minutes minutes: minute buckets
+    up to an hour, hour buckets beyond that, rounded up to whole hours.
+
+Arguments:
+
+    Sketch - the sketches, with the lock held
+    Minutes - how far back to go
+    Selected - receives the buckets
+
+Return Value:
+
+    How many buckets were selected.
+
+--*/
+{
+    LARGE_INTEGER now;
+    LONGLONG period;
+    ULONG first;
+    ULONG count;
+    ULONG length;
+    ULONG selected = 0;
+    ULONG i;
+
+    LogClockSystemTime( &now );
+
+    if (Minutes <= SKETCH_MINUTES) {
+
+        first = 0;
+        count = SKETCH_MINUTES;
+        length = Minutes;
+        period = now.QuadPart / SKETCH_MINUTE;
+
+    } else {
+
+        first = SKETCH_MINUTES;
+        count = SKETCH_HOURS;
+        length = (Minutes < SKETCH_HOURS * 60) ? (Minutes + 59) / 60 : SKETCH_HOURS;
+        period = now.QuadPart / SKETCH_HOUR;
+    }
+
+    for (i = first; i < first + count; i++) {
+
+        if (Sketch->Buckets[i].Period > period - (LONGLONG)length &&
+            Sketch->Buckets[i].Period <= period) {
+
+            Selected[selected++] = &Sketch->Buckets[i];
+        }
+    }
+
+    return selected;
+}
+
+static
+ULONG
+SketchLength (
+    __in_ecount(SKETCH_KEY_LENGTH) CONST WCHAR *Name
+    )
+/*++
+
+Routine Description:
+
+    Counts the characters of a name kept in an entry.
+
+Arguments:
+
+    Name - the name, NULL terminated
+
+Return Value:
+
+    Its length in characters.
+
+--*/
+{
+    ULONG length = 0;
+
+    while (length < SKETCH_KEY_LENGTH && Name[length] != UNICODE_NULL) {
+
+        length++;
+    }
+
+    return length;
+}
+
+static
+VOID
+SketchPrintName (
+    __in_ecount(SKETCH_KEY_LENGTH) CONST WCHAR *Name
+    )
+/*++
+
+Routine Description:
+
+    Prints a name kept in an entry.  Where WCHAR is not the C library's
+    wide character, characters beyond ASCII print as '?'.
+
+Arguments:
+
+    Name - the name, NULL terminated
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    printf( "%S", Name );
+#else
+    ULONG length = SketchLength( Name );
+    ULONG i;
+
+    for (i = 0; i < length; i++) {
+
+        putchar( (Name[i] < 0x80) ? (int)Name[i] : '?' );
+    }
+#endif
+}
+
+static
+int
+__cdecl
+SketchCompareKeys (
+    __in const void *First,
+    __in const void *Second
+    )
+/*++
+
+Routine Description:
+
+    Orders candidates by key for qsort.
+
+Arguments:
+
+    First - a candidate
+    Second - the one to compare it with
+
+Return Value:
+
+    Less than, equal to or greater than 0.
+
+--*/
+{
+    ULONGLONG first = ((const SKETCH_CANDIDATE *)First)->Key;
+    ULONGLONG second = ((const SKETCH_CANDIDATE *)Second)->Key;
+
+    return (first < second) ? -1 : (first > second);
+}
+
+static
+int
+__cdecl
+SketchCompareEstimates (
+    __in const void *First,
+    __in const void *Second
+    )
+/*++
+
+Routine Description:
+
+    Orders candidates by estimate, highest first, for qsort.
+
+Arguments:
+
+    First - a candidate
+    Second - the one to compare it with
+
+Return Value:
+
+    Less than, equal to or greater than 0.
+
+--*/
+{
+    ULONGLONG first = ((const SKETCH_CANDIDATE *)First)->Estimate;
+    ULONGLONG second = ((const SKETCH_CANDIDATE *)Second)->Estimate;
+
+    return (first > second) ? -1 : (first < second);
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+BOOLEAN
+SketchInitialize (
+    __out PLOG_SKETCH Sketch
+    )
+/*++
+
+Routine Description:
+
+    Sets up empty sketches.
+
+Arguments:
+
+    Sketch - the sketches
+
+Return Value:
+
+    FALSE if there was no memory for them.
+
+--*/
+{
+    ULONG i;
+
+    Sketch->Buckets = calloc( SKETCH_BUCKETS, sizeof( SKETCH_BUCKET ) );
+    Sketch->Candidates = malloc( SKETCH_MINUTES * SKETCH_TOP * sizeof( SKETCH_CANDIDATE ) );
+
+    if (Sketch->Buckets == NULL || Sketch->Candidates == NULL) {
+
+        free( Sketch->Buckets );
+        free( Sketch->Candidates );
+        Sketch->Buckets = NULL;
+        return FALSE;
+    }
+
+    for (i = 0; i < SKETCH_BUCKETS; i++) {
+
+        Sketch->Buckets[i].Period = -1;
+    }
+
+    LogLockInitialize( &Sketch->Lock );
+
+    return TRUE;
+}
+
+VOID
+SketchCleanup (
+    __inout PLOG_SKETCH Sketch
+    )
+/*++
+
+Routine Description:
+
+    Frees the sketches.
+
+Arguments:
+
+    Sketch - the sketches
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Sketch->Buckets == NULL) {
+
+        return;
+    }
+
+    LogLockDelete( &Sketch->Lock );
+    free( Sketch->Buckets );
+    free( Sketch->Candidates );
+    Sketch->Buckets = NULL;
+    Sketch->Candidates = NULL;
+}
+
+VOID
+SketchAddRecord (
+    __inout PLOG_SKETCH Sketch,
+    __in PLOG_RECORD LogRecord
+    )
+/*++
+
+Routine Description:
+
+    Counts a record in the buckets of its minute and its hour.  Only
+    records of file operations are counted.
+
+Arguments:
+
+    Sketch - the sketches
+    LogRecord - the record, whose Length has been checked
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LOG_RECORD_NAMES names;
+    PSKETCH_BUCKET buckets[2];
+    LONGLONG minute;
+    LONGLONG hour;
+    ULONG disposition;
+    ULONG i;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_GAP | RECORD_TYPE_SUMMARY )) {
+
+        return;
+    }
+
+    LogRecordNames( LogRecord, &names );
+    disposition = SketchDisposition( LogRecord->Data.Reserved[0] );
+
+    minute = LogRecord->Data.OriginatingTime.QuadPart / SKETCH_MINUTE;
+    hour = LogRecord->Data.OriginatingTime.QuadPart / SKETCH_HOUR;
+
+    LogLockAcquire( &Sketch->Lock );
+
+    buckets[0] = SketchBucket( Sketch, (ULONG)(minute % SKETCH_MINUTES), minute );
+    buckets[1] = SketchBucket( Sketch, SKETCH_MINUTES + (ULONG)(hour % SKETCH_HOURS), hour );
+
+    for (i = 0; i < 2; i++) {
+
+        if (buckets[i] == NULL) {
+
+            continue;
+        }
+
+        buckets[i]->Dispositions[disposition]++;
+
+        if (names.ImageLength != 0) {
+
+            SketchAddKey( &buckets[i]->Keys[SketchKeyProcess], names.Image, names.ImageLength, disposition );
+        }
+
+        if (names.UserLength != 0) {
+
+            SketchAddKey( &buckets[i]->Keys[SketchKeyUser], names.User, names.UserLength, disposition );
+        }
+
+        if (names.PathLength != 0) {
+
+            SketchAddKey( &buckets[i]->Keys[SketchKeyPath], names.Path, names.PathLength, disposition );
+        }
+    }
+
+    LogLockRelease( &Sketch->Lock );
+}
+
+ULONG
+SketchTop (
+    __in PLOG_SKETCH Sketch,
+    __in SKETCH_KEY Key,
+    __in CHAR Disposition,
+    __in ULONG Minutes,
+    __in ULONG Count,
+    __out_ecount(Count) PSKETCH_COUNT Top
+    )
+/*++
+
+Routine Description:
+
+    Finds the keys seen most often over the last Minutes minutes, with
+    an estimate of how often.  The candidates are the keys any of the
+    buckets kept; their counts are summed from the Count-Min sketches of
+    every bucket, so a key that was busy only part of the time still
+    counts in full.
+
+Arguments:
+
+    Sketch - the sketches
+    Key - what to count by
+    Disposition - only count this access type, 0 for all of them
+    Minutes - how far back to go
+    Count - how many keys to find
+    Top - receives them, the busiest first
+
+Return Value:
+
+    How many keys were found, at most Count.
+
+--*/
+{
+    PSKETCH_BUCKET selected[SKETCH_MINUTES];
+    PSKETCH_CANDIDATE candidates = Sketch->Candidates;
+    PSKETCH_ENTRY entry;
+    ULONG bucketCount;
+    ULONG candidateCount = 0;
+    ULONG disposition = SketchDisposition( Disposition );
+    ULONG unique;
+    ULONG b;
+    ULONG c;
+    ULONG i;
+    ULONG d;
+
+    LogLockAcquire( &Sketch->Lock );
+
+    bucketCount = SketchSelect( Sketch, Minutes, selected );
+
+    //
+    //  Gather the candidates.  Without an access type a name is one
+    //  candidate whatever it was used for.
+    //
+
+    for (b = 0; b < bucketCount; b++) {
+
+        for (i = 0; i < selected[b]->Keys[Key].Entries; i++) {
+
+            entry = &selected[b]->Keys[Key].Top[i];
+
+            if (Disposition != 0 && entry->Disposition != disposition) {
+
+                continue;
+            }
+
+            candidates[candidateCount].Key = (Disposition != 0) ? entry->Hash : entry->NameHash;
+            candidates[candidateCount].Name = entry->Name;
+            candidates[candidateCount].Disposition = entry->Disposition;
+            candidateCount++;
+        }
+    }
+
+    qsort( candidates, candidateCount, sizeof( SKETCH_CANDIDATE ), SketchCompareKeys );
+
+    for (c = 0, unique = 0; c < candidateCount; c++) {
+
+        if (unique == 0 || candidates[c].Key != candidates[unique - 1].Key) {
+
+            candidates[unique++] = candidates[c];
+        }
+    }
+
+    for (c = 0; c < unique; c++) {
+
+        candidates[c].Estimate = 0;
+
+        for (b = 0; b < bucketCount; b++) {
+
+            if (Disposition != 0) {
+
+                candidates[c].Estimate += SketchCountMin( &selected[b]->Keys[Key], candidates[c].Key );
+
+            } else {
+
+                for (d = 0; d < SKETCH_DISPOSITIONS; d++) {
+
+                    candidates[c].Estimate += SketchCountMin( &selected[b]->Keys[Key],
+                                                              SketchHash( candidates[c].Key, d ) );
+                }
+            }
+        }
+    }
+
+    qsort( candidates, unique, sizeof( SKETCH_CANDIDATE ), SketchCompareEstimates );
+
+    //
+    //  The names point into the buckets, so they are copied before the
+    //  lock is let go.
+    //
+
+    for (c = 0; c < unique && c < Count; c++) {
+
+        Top[c].Estimate = candidates[c].Estimate;
+        memcpy( Top[c].Name, candidates[c].Name, SketchLength( candidates[c].Name ) * sizeof( WCHAR ) );
+        Top[c].Name[SketchLength( candidates[c].Name )] = UNICODE_NULL;
+    }
+
+    LogLockRelease( &Sketch->Lock );
+
+    return c;
+}
+
+double
+SketchDistinct (
+    __in PLOG_SKETCH Sketch,
+    __in SKETCH_KEY Key,
+    __in CHAR Disposition,
+    __in ULONG Minutes
+    )
+/*++
+
+Routine Description:
+
+    Estimates how many distinct keys were seen over the last Minutes
+    minutes.
+
+Arguments:
+
+    Sketch - the sketches
+    Key - what to count
+    Disposition - only count this access type, 0 for all of them
+    Minutes - how far back to go
+
+Return Value:
+
+    The estimate.
+
+--*/
+{
+    PSKETCH_BUCKET selected[SKETCH_MINUTES];
+    UCHAR registers[SKETCH_HLL_REGISTERS];
+    ULONG bucketCount;
+    ULONG disposition = SketchDisposition( Disposition );
+    ULONG zeroes = 0;
+    double sum = 0;
+    double estimate;
+    ULONG b;
+    ULONG d;
+    ULONG r;
+
+    memset( registers, 0, sizeof( registers ) );
+
+    LogLockAcquire( &Sketch->Lock );
+
+    bucketCount = SketchSelect( Sketch, Minutes, selected );
+
+    for (b = 0; b < bucketCount; b++) {
+
+        for (d = 0; d < SKETCH_DISPOSITIONS; d++) {
+
+            if (Disposition != 0 && d != disposition) {
+
+                continue;
+            }
+
+            for (r = 0; r < SKETCH_HLL_REGISTERS; r++) {
+
+                if (selected[b]->Keys[Key].Distinct[d][r] > registers[r]) {
+
+                    registers[r] = selected[b]->Keys[Key].Distinct[d][r];
+                }
+            }
+        }
+    }
+
+    LogLockRelease( &Sketch->Lock );
+
+    for (r = 0; r < SKETCH_HLL_REGISTERS; r++) {
+
+        sum += ldexp( 1.0, -(int)registers[r] );
+
+        if (registers[r] == 0) {
+
+            zeroes++;
+        }
+    }
+
+    estimate = (0.7213 / (1.0 + 1.079 / SKETCH_HLL_REGISTERS)) *
+               SKETCH_HLL_REGISTERS * SKETCH_HLL_REGISTERS / sum;
+
+    //
+    //  Few keys leave many registers empty; counting those is closer.
+    //
+
+    if (estimate <= 2.5 * SKETCH_HLL_REGISTERS && zeroes != 0) {
+
+        estimate = SKETCH_HLL_REGISTERS * log( (double)SKETCH_HLL_REGISTERS / zeroes );
+    }
+
+    return estimate;
+}
+
+VOID
+SketchDispositions (
+    __in PLOG_SKETCH Sketch,
+    __in ULONG Minutes,
+    __out_ecount(SKETCH_DISPOSITIONS) PULONGLONG Counts
+    )
+/*++
+
+Routine Description:
+
+    Counts the records of each access type seen over the last Minutes
+    minutes.  These are exact counts.
+
+Arguments:
+
+    Sketch - the sketches
+    Minutes - how far back to go
+    Counts - receives the counts, in the order of
+        SKETCH_DISPOSITION_CHARS
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSKETCH_BUCKET selected[SKETCH_MINUTES];
+    ULONG bucketCount;
+    ULONG b;
+    ULONG d;
+
+    memset( Counts, 0, SKETCH_DISPOSITIONS * sizeof( ULONGLONG ) );
+
+    LogLockAcquire( &Sketch->Lock );
+
+    bucketCount = SketchSelect( Sketch, Minutes, selected );
+
+    for (b = 0; b < bucketCount; b++) {
+
+        for (d = 0; d < SKETCH_DISPOSITIONS; d++) {
+
+            Counts[d] += selected[b]->Dispositions[d];
+        }
+    }
+
+    LogLockRelease( &Sketch->Lock );
+}
+
+VOID
+SketchReportTop (
+    __in PLOG_SKETCH Sketch,
+    __in SKETCH_KEY Key,
+    __in CHAR Disposition,
+    __in ULONG Minutes,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Prints the keys seen most often over the last Minutes minutes, with
+    an estimate of how often.  See SketchTop.
+
+Arguments:
+
+    Sketch - the sketches
+    Key - what to count by
+    Disposition - only count this access type, 0 for all of them
+    Minutes - how far back to go
+    Count - how many keys to print
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSKETCH_COUNT top;
+    ULONG found;
+    ULONG c;
+
+    top = malloc( Count * sizeof( SKETCH_COUNT ) );
+
+    if (top == NULL) {
+
+        printf( "    Not enough memory for the report\n" );
+        return;
+    }
+
+    found = SketchTop( Sketch, Key, Disposition, Minutes, Count, top );
+
+    printf( "    Top %s over the last %lu minutes%s%c%s:\n",
+            SketchKeyNames[Key],
+            (unsigned long)Minutes,
+            (Disposition != 0) ? " (access " : "",
+            (Disposition != 0) ? Disposition : ' ',
+            (Disposition != 0) ? ")" : "" );
+
+    for (c = 0; c < found; c++) {
+
+        printf( "    %10llu  ", (unsigned long long)top[c].Estimate );
+        SketchPrintName( top[c].Name );
+        printf( "\n" );
+    }
+
+    free( top );
+}
+
+VOID
+SketchReportDistinct (
+    __in PLOG_SKETCH Sketch,
+    __in SKETCH_KEY Key,
+    __in CHAR Disposition,
+    __in ULONG Minutes
+    )
+/*++
+
+Routine Description:
+
+    Prints an estimate of how many distinct keys were seen over the last
+    Minutes minutes.
+
+Arguments:
+
+    Sketch - the sketches
+    Key - what to count
+    Disposition - only count this access type, 0 for all of them
+    Minutes - how far back to go
+
+Return Value:
+
+    None.
+
+--*/
+{
+    printf( "    About %.0f distinct %s over the last %lu minutes%s%c%s\n",
+            SketchDistinct( Sketch, Key, Disposition, Minutes ),
+            SketchKeyNames[Key],
+            (unsigned long)Minutes,
+            (Disposition != 0) ? " (access " : "",
+            (Disposition != 0) ? Disposition : ' ',
+            (Disposition != 0) ? ")" : "" );
+}
+
+VOID
+SketchReportDispositions (
+    __in PLOG_SKETCH Sketch,
+    __in ULONG Minutes
+    )
+/*++
+
+Routine Description:
+
+    Prints how many records of each access type were seen over the last
+    Minutes minutes.  These are exact counts.
+
+Arguments:
+
+    Sketch - the sketches
+    Minutes - how far back to go
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONGLONG counts[SKETCH_DISPOSITIONS];
+    ULONG d;
+
+    SketchDispositions( Sketch, Minutes, counts );
+
+    printf( "    Records by access type over the last %lu minutes:\n", (unsigned long)Minutes );
+
+    for (d = 0; d < SKETCH_DISPOSITIONS; d++) {
+
+        printf( "    %10llu  %c\n", (unsigned long long)counts[d], SKETCH_DISPOSITION_CHARS[d] );
+    }
+}
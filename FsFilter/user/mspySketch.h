@@ -0,0 +1,215 @@
+/*++
+
+Module Name:
+
+    mspySketch.h
+
+Abstract:
+
+    This module contains the structures and prototypes of the sketches
+    minispy keeps over the records it receives, to report the busiest
+    processes, users and files and how many distinct ones there were over
+    the last minutes or hours.  See mspySketch.c.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYSKETCH_H__
+#define __MSPYSKETCH_H__
+
+#include "mspyTypes.h"
+#include "miniSpy.h"
+#include "mspyFile.h"
+
+//
+//  Records are summarised by the minute for the last SKETCH_MINUTES
+//  minutes and by the hour for the last SKETCH_HOURS hours.
+//
+
+#define SKETCH_MINUTES          60
+#define SKETCH_HOURS            24
+#define SKETCH_BUCKETS          (SKETCH_MINUTES + SKETCH_HOURS)
+
+//
+//  What records are counted by.  Each key is counted separately for
+//  every access type, see SKETCH_DISPOSITION_CHARS.
+//
+
+typedef enum _SKETCH_KEY {
+
+    SketchKeyProcess = 0,
+    SketchKeyUser,
+    SketchKeyPath,
+    SketchKeys
+
+} SKETCH_KEY;
+
+//
+//  Access types, as in RECORD_DATA Reserved[0]; '-' stands for any
+//  other.
+//
+
+#define SKETCH_DISPOSITION_CHARS    "-DdRWA"
+#define SKETCH_DISPOSITIONS         6
+
+//
+//  Space-Saving keeps the SKETCH_TOP most frequent keys of each bucket,
+//  with the last SKETCH_KEY_LENGTH - 1 characters of their names for
+//  display.  Count-Min gives the count of any key to within a small
+//  error and HyperLogLog the number of distinct keys to within about 3%.
+//
+
+#define SKETCH_TOP              128
+#define SKETCH_KEY_LENGTH       64
+
+#define SKETCH_CM_DEPTH         4
+#define SKETCH_CM_WIDTH         1024
+
+#define SKETCH_HLL_BITS         10
+#define SKETCH_HLL_REGISTERS    (1 << SKETCH_HLL_BITS)
+
+typedef struct _SKETCH_ENTRY {
+
+    //
+    //  Hash is of the name and the access type together, NameHash of the
+    //  name alone.
+    //
+
+    ULONGLONG Hash;
+    ULONGLONG NameHash;
+    ULONG Count;
+    UCHAR Disposition;
+
+    WCHAR Name[SKETCH_KEY_LENGTH];
+
+} SKETCH_ENTRY, *PSKETCH_ENTRY;
+
+typedef struct _SKETCH_SUMMARY {
+
+    ULONG Entries;
+    SKETCH_ENTRY Top[SKETCH_TOP];
+
+    ULONG CountMin[SKETCH_CM_DEPTH][SKETCH_CM_WIDTH];
+
+    UCHAR Distinct[SKETCH_DISPOSITIONS][SKETCH_HLL_REGISTERS];
+
+} SKETCH_SUMMARY, *PSKETCH_SUMMARY;
+
+typedef struct _SKETCH_BUCKET {
+
+    //
+    //  The minute or hour the bucket holds, counted from 1601, or -1.
+    //
+
+    LONGLONG Period;
+
+    ULONG Dispositions[SKETCH_DISPOSITIONS];
+
+    SKETCH_SUMMARY Keys[SketchKeys];
+
+} SKETCH_BUCKET, *PSKETCH_BUCKET;
+
+//
+//  A key SketchTop found, with an estimate of how often it was seen.
+//
+
+typedef struct _SKETCH_COUNT {
+
+    ULONGLONG Estimate;
+    WCHAR Name[SKETCH_KEY_LENGTH];
+
+} SKETCH_COUNT, *PSKETCH_COUNT;
+
+typedef struct _LOG_SKETCH {
+
+    //
+    //  The log thread adds records while the command prompt reports.
+    //
+
+    LOG_LOCK Lock;
+
+    //
+    //  SKETCH_MINUTES minute buckets, then SKETCH_HOURS hour buckets.
+    //
+
+    PSKETCH_BUCKET Buckets;
+
+    //
+    //  Room for the keys every minute bucket kept, for SketchTop.
+    //
+
+    struct _SKETCH_CANDIDATE *Candidates;
+
+} LOG_SKETCH, *PLOG_SKETCH;
+
+//
+//  Function prototypes
+//
+
+BOOLEAN
+SketchInitialize (
+    __out PLOG_SKETCH Sketch
+    );
+
+VOID
+SketchCleanup (
+    __inout PLOG_SKETCH Sketch
+    );
+
+VOID
+SketchAddRecord (
+    __inout PLOG_SKETCH Sketch,
+    __in PLOG_RECORD LogRecord
+    );
+
+ULONG
+SketchTop (
+    __in PLOG_SKETCH Sketch,
+    __in SKETCH_KEY Key,
+    __in CHAR Disposition,
+    __in ULONG Minutes,
+    __in ULONG Count,
+    __out_ecount(Count) PSKETCH_COUNT Top
+    );
+
+double
+SketchDistinct (
+    __in PLOG_SKETCH Sketch,
+    __in SKETCH_KEY Key,
+    __in CHAR Disposition,
+    __in ULONG Minutes
+    );
+
+VOID
+SketchDispositions (
+    __in PLOG_SKETCH Sketch,
+    __in ULONG Minutes,
+    __out_ecount(SKETCH_DISPOSITIONS) PULONGLONG Counts
+    );
+
+VOID
+SketchReportTop (
+    __in PLOG_SKETCH Sketch,
+    __in SKETCH_KEY Key,
+    __in CHAR Disposition,
+    __in ULONG Minutes,
+    __in ULONG Count
+    );
+
+VOID
+SketchReportDistinct (
+    __in PLOG_SKETCH Sketch,
+    __in SKETCH_KEY Key,
+    __in CHAR Disposition,
+    __in ULONG Minutes
+    );
+
+VOID
+SketchReportDispositions (
+    __in PLOG_SKETCH Sketch,
+    __in ULONG Minutes
+    );
+
+#endif //__MSPYSKETCH_H__
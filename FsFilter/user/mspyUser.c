@@ -28,6 +28,15 @@ __user_code
 #include <assert.h>
 #include "mspyLog.h"
 #include <strsafe.h>
+#ifndef __DLL_EXPORT__
+#include "mspyMerge.h"
+#include "mspyWriter.h"
+#include "mspyIndex.h"
+#include "mspySketch.h"
+#include "mspyLoad.h"
+#include "mspyCapture.h"
+#include "mspyRules.h"
+#endif
 
 #define SUCCESS              0
 #define USAGE_ERROR          1
@@ -149,23 +158,6 @@ Return Value:
                 pLogRecord->Name,
                 pRecordData );
 
-    //
-    //  The RecordType could also designate that we are out of memory
-    //  or hit our program defined memory limit, so check for these
-    //  cases.
-    //
-
-    if (FlagOn(pLogRecord->RecordType,RECORD_TYPE_FLAG_OUT_OF_MEMORY)) {
-
-            printf( "M:  %08X System Out of Memory\n",
-                    pLogRecord->SequenceNumber );
-
-    } else if (FlagOn(pLogRecord->RecordType,RECORD_TYPE_FLAG_EXCEED_MEMORY_ALLOWANCE)) {
-
-            printf( "M:  %08X Exceeded Mamimum Allowed Memory Buffers\n",
-                    pLogRecord->SequenceNumber );
-    }
-
     pLogRecord = HeapAlloc(GetProcessHeap(), 0, *lpbytesReturned);
     RtlCopyMemory(pLogRecord, alignedBuffer, *lpbytesReturned);
     *ppLogRecord = pLogRecord;
@@ -292,769 +284,1857 @@ setOpenProcess(WCHAR* proc)
 	return NULL;
 }
 
-VOID
-DisplayError (
-   __in DWORD Code
-   )
+PVOID
+setRecordQuota(LONG floor, LONG ceiling)
+{
+    PLOG_RECORD pLogRecord = NULL;
 
-/*++
+    PCOMMAND_MESSAGE pcommandMessage;
 
-Routine Description:
+    PRECORD_QUOTA quota;
 
-   This routine will display an error message based off of the Win32 error
-   code that is passed in. This allows the user to see an understandable
-   error message instead of just the code.
+    DWORD bytesReturned = 0;
 
-Arguments:
+    pcommandMessage = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + sizeof(RECORD_QUOTA), sizeof(PVOID)));
 
-   Code - The error code to be translated.
+    pcommandMessage->Command = SetMiniSpyRecordQuota;
+    pcommandMessage->Reserved = ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + sizeof(RECORD_QUOTA), sizeof(PVOID));
 
-Return Value:
+    quota = (PRECORD_QUOTA)&pcommandMessage->Data[0];
+    quota->Floor = floor;
+    quota->Ceiling = ceiling;
 
-   None.
+    if (RetrieveCmd(pcommandMessage, &pLogRecord, &bytesReturned) == 0) {
 
---*/
+        if(pLogRecord->Reserved == 0)
 
-{
-    __nullterminated WCHAR buffer[MAX_PATH] = { 0 }; 
-    DWORD count;
-    HMODULE module = NULL;
-    HRESULT status;
+            printf("Set record quota successful!\n");
 
-    count = FormatMessage (FORMAT_MESSAGE_FROM_SYSTEM,
-                           NULL,
-                           Code,
-                           0,
-                           buffer,
-                           sizeof(buffer) / sizeof(WCHAR),
-                           NULL);
+        HeapFree(GetProcessHeap(), 0, pLogRecord);
 
+    } else {
 
-    if (count == 0) {
+        printf("Set record quota failed, the ceiling must not be below the floor.\n");
+    }
 
-        count = GetSystemDirectory( buffer,
-                                    sizeof(buffer) / sizeof( WCHAR ) );
+    HeapFree(GetProcessHeap(), 0, pcommandMessage);
+	return NULL;
+}
 
-        if (count==0 || count > sizeof(buffer) / sizeof( WCHAR )) {
+PVOID
+setBurst(LONG renames, LONG deletes, LONG writes, LONG window, LONG block)
+{
+    PLOG_RECORD pLogRecord = NULL;
 
-            //
-            //  In practice we expect buffer to be large enough to hold the 
-            //  system directory path. 
-            //
+    PCOMMAND_MESSAGE pcommandMessage;
 
-            printf("    Could not translate error: %d\n", Code);
-            return;
-        }
+    PBURST_SETTINGS settings;
 
+    DWORD bytesReturned = 0;
 
-        status = StringCchCat( buffer,
-                               sizeof(buffer) / sizeof( WCHAR ),
-                               L"\\fltlib.dll" );
+    pcommandMessage = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + sizeof(BURST_SETTINGS), sizeof(PVOID)));
 
-        if (status != S_OK) {
+    pcommandMessage->Command = SetMiniSpyBurst;
+    pcommandMessage->Reserved = ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + sizeof(BURST_SETTINGS), sizeof(PVOID));
 
-            printf("    Could not translate error: %d\n", Code);
-            return;
-        }
+    settings = (PBURST_SETTINGS)&pcommandMessage->Data[0];
+    settings->Threshold[BURST_RENAME] = renames;
+    settings->Threshold[BURST_DELETE] = deletes;
+    settings->Threshold[BURST_WRITE] = writes;
+    settings->Window = window;
+    settings->Block = block;
 
-        module = LoadLibraryExW( buffer, NULL, LOAD_LIBRARY_AS_DATAFILE );
+    if (RetrieveCmd(pcommandMessage, &pLogRecord, &bytesReturned) == 0) {
 
-        //
-        //  Translate the Win32 error code into a useful message.
-        //
+        if(pLogRecord->Reserved == 0)
 
-        count = FormatMessage (FORMAT_MESSAGE_FROM_HMODULE,
-                               module,
-                               Code,
-                               0,
-                               buffer,
-                               sizeof(buffer) / sizeof(WCHAR),
-                               NULL);
+            printf("Burst alerts at %S\n", pLogRecord->Name);
 
-        if (module != NULL) {
+        else
 
-            FreeLibrary( module );
-        }
+            printf("Set burst thresholds failed, still %S\n", pLogRecord->Name);
 
-        //
-        //  If we still couldn't resolve the message, generate a string
-        //
+        HeapFree(GetProcessHeap(), 0, pLogRecord);
 
-        if (count == 0) {
+    } else {
 
-            printf("    Could not translate error: %d\n", Code);
-            return;
-        }
+        printf("Set burst thresholds failed.\n");
     }
 
-    //
-    //  Display the translated error.
-    //
-
-    printf("    %ws\n", buffer);
+    HeapFree(GetProcessHeap(), 0, pcommandMessage);
+	return NULL;
 }
 
+PVOID
+getLossStats()
+{
+    PLOG_RECORD pLogRecord = NULL;
 
-//
-//  Main uses a loop which has an assignment in the while 
-//  conditional statement. Suppress the compiler's warning.
-//
+    PCOMMAND_MESSAGE pcommandMessage;
 
-#pragma warning(push)
-#pragma warning(disable:4706) // assignment within conditional expression
+    DWORD bytesReturned = 0;
 
-#ifndef __DLL_EXPORT__
+    pcommandMessage = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + sizeof(UNICODE_NULL), sizeof(PVOID)));
 
-int _cdecl
-main (
-    __in int argc,
-    __in_ecount(argc) char *argv[]
-    )
-/*++
+    pcommandMessage->Command = GetMiniSpyLossStats;
+    pcommandMessage->Reserved = ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + sizeof(UNICODE_NULL), sizeof(PVOID));
 
-Routine Description:
+    if (RetrieveCmd(pcommandMessage, &pLogRecord, &bytesReturned) == 0) {
 
-    Main routine for minispy
+        printf("Records not delivered: %S\n", pLogRecord->Name);
 
-Arguments:
+        HeapFree(GetProcessHeap(), 0, pLogRecord);
+    }
 
-Return Value:
+    HeapFree(GetProcessHeap(), 0, pcommandMessage);
+	return NULL;
+}
 
---*/
+PVOID
+setExtensions(LONG mode, WCHAR* extensions)
 {
-    HRESULT hResult = S_OK;
-    DWORD result;
-    ULONG threadId;
-    HANDLE thread = NULL;
-    LOG_CONTEXT context;
-    CHAR inputChar;
+    PLOG_RECORD pLogRecord = NULL;
 
-    //
-    //  Initialize handle in case of error
-    //
+    PCOMMAND_MESSAGE pcommandMessage;
 
-    context.ShutDown = NULL;
+    PEXTENSION_SETTINGS settings;
 
-    //
-    //  Open the port that is used to talk to
-    //  MiniSpy.
-    //
+    DWORD size;
 
-    printf( "Connecting to filter's port...\n" );
+    DWORD bytesReturned = 0;
 
-    hResult = FilterConnectCommunicationPort( MINISPY_PORT_NAME,
-                                              0,
-                                              NULL,
-                                              0,
-                                              NULL,
-                                              &gport );
+    size = ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + FIELD_OFFSET(EXTENSION_SETTINGS, Extensions) + wcslen(extensions)*2 + sizeof(UNICODE_NULL), sizeof(PVOID));
 
-    if (IS_ERROR( hResult )) {
+    if (size - sizeof(COMMAND_MESSAGE) - FIELD_OFFSET(EXTENSION_SETTINGS, Extensions) > EXTENSION_MAX_LENGTH) {
 
-        printf( "Could not connect to filter: 0x%08x\n", hResult );
-        DisplayError( hResult );
-        goto Main_Exit;
+        printf("Set protected extensions failed, the list is too long.\n");
+        return NULL;
     }
 
-    //
-    // Initialize the fields of the LOG_CONTEXT
-    //
+    pcommandMessage = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size);
 
-    context.Port = gport;
-    context.ShutDown = CreateSemaphore( NULL,
-                                        0,
-                                        1,
-                                        L"MiniSpy shut down" );
-    context.CleaningUp = FALSE;
-    context.LogToFile = FALSE;
-    context.LogToScreen = FALSE;        //don't start logging yet
-    context.NextLogToScreen = TRUE;
-    context.OutputFile = NULL;
+    pcommandMessage->Command = SetMiniSpyExtensions;
+    pcommandMessage->Reserved = size;
 
-    if (context.ShutDown == NULL) {
+    settings = (PEXTENSION_SETTINGS)&pcommandMessage->Data[0];
+    settings->Mode = mode;
 
-        result = GetLastError();
-        printf( "Could not create semaphore: %d\n", result );
-        DisplayError( result );
-        goto Main_Exit;
-    }
+    RtlCopyMemory(
+    settings->Extensions,
+    extensions,
+    wcslen(extensions)*2
+    );
 
-    //
-    // Check the valid parameters for startup
-    //
+    if (RetrieveCmd(pcommandMessage, &pLogRecord, &bytesReturned) == 0) {
 
-    if (argc > 1) {
+        if(pLogRecord->Reserved == 0)
 
-        if (InterpretCommand( argc - 1, &(argv[1]), &context ) == USAGE_ERROR) {
+            printf("Protected extensions: %S\n", pLogRecord->Name);
 
-            goto Main_Exit;
-        }
-    }
+        else
 
-    //
-    // Create the thread to read the log records that are gathered
-    // by MiniSpy.sys.
-    //
-    printf( "Creating logging thread...\n" );
-    thread = CreateThread( NULL,
-                           0,
-                           RetrieveLogRecords,
-                           (LPVOID)&context,
-                           0,
-                           &threadId);
+            printf("Set protected extensions failed, still %S\n", pLogRecord->Name);
 
-    if (!thread) {
+        HeapFree(GetProcessHeap(), 0, pLogRecord);
 
-        result = GetLastError();
-        printf( "Could not create logging thread: %d\n", result );
-        DisplayError( result );
-        goto Main_Exit;
+    } else {
+
+        printf("Set protected extensions failed.\n");
     }
 
-    //
-    // Check to see what devices we are attached to from
-    // previous runs of this program.
-    //
+    HeapFree(GetProcessHeap(), 0, pcommandMessage);
+	return NULL;
+}
 
-    ListDevices();
+PVOID
+setRules(PPOLICY_RULES rules)
+{
+    PLOG_RECORD pLogRecord = NULL;
 
-    //
-    //  Process commands from the user
-    //
+    PCOMMAND_MESSAGE pcommandMessage;
 
-    printf( "\nHit [Enter] to begin command mode...\n\n" );
-    fflush( stdout );
+    DWORD bytesReturned = 0;
 
-    //
-    //  set screen logging state
-    //
+    pcommandMessage = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + sizeof(POLICY_RULES), sizeof(PVOID)));
 
-    context.LogToScreen = context.NextLogToScreen;
+    pcommandMessage->Command = SetMiniSpyRules;
+    pcommandMessage->Reserved = ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + sizeof(POLICY_RULES), sizeof(PVOID));
 
-    while (inputChar = (CHAR)getchar()) {
+    RtlCopyMemory(
+    &pcommandMessage->Data[0],
+    rules,
+    sizeof(POLICY_RULES)
+    );
 
-        CHAR *parms[NUM_PARAMS];
-        CHAR commandLine[CMDLINE_SIZE+1];
-        INT parmCount, count;
-        DWORD returnValue = SUCCESS;
-        BOOL newParm;
-        CHAR ch;
+    if (RetrieveCmd(pcommandMessage, &pLogRecord, &bytesReturned) == 0) {
 
-        if (inputChar == '\n') {
+        if(pLogRecord->Reserved == 0)
 
-            //
-            // Start command interpreter.  First we must turn off logging
-            // to screen if we are.  Also, remember the state of logging
-            // to the screen, so that we can reinstate that when command
-            // interpreter is finished.
-            //
+            printf("Policy rules: %S\n", pLogRecord->Name);
 
-            context.NextLogToScreen = context.LogToScreen;
-            context.LogToScreen = FALSE;
+        else
 
-            while (returnValue != EXIT_INTERPRETER) {
+            printf("Set policy rules failed, still %S\n", pLogRecord->Name);
 
-                //
-                // Print prompt
-                //
-                printf( ">" );
+        HeapFree(GetProcessHeap(), 0, pLogRecord);
 
-                //
-                // Read in next line, keeping track of the number of parameters
-                // as we go.
-                //
+    } else {
 
-                parmCount = 0;
-                newParm = TRUE;
-                for ( count = 0;
-                      (count < CMDLINE_SIZE) && ((ch = (CHAR)getchar()) != '\n');
-                      count++)
-                {
-                    commandLine[count] = ch;
+        printf("Set policy rules failed.\n");
+    }
 
-                    if (newParm && (ch != ' ')) {
+    HeapFree(GetProcessHeap(), 0, pcommandMessage);
+	return NULL;
+}
 
-                        parms[parmCount++] = &commandLine[count];
-                    }
+PVOID
+setSubscription(PSUBSCRIPTION subscription, ULONG length)
+{
+    PLOG_RECORD pLogRecord = NULL;
 
-                    if (parmCount >= NUM_PARAMS) {
+    PCOMMAND_MESSAGE pcommandMessage;
 
-                        break;
-                    }
+    DWORD bytesReturned = 0;
 
-                    //
-                    //  Always insert NULL's for spaces
-                    //
+    pcommandMessage = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + length, sizeof(PVOID)));
 
-                    if (ch == ' ') {
+    pcommandMessage->Command = SetMiniSpySubscription;
+    pcommandMessage->Reserved = ROUND_TO_SIZE( sizeof(COMMAND_MESSAGE) + length, sizeof(PVOID));
 
-                        newParm = TRUE;
-                        commandLine[count] = 0;
+    RtlCopyMemory(
+    &pcommandMessage->Data[0],
+    subscription,
+    length
+    );
 
-                    } else {
+    if (RetrieveCmd(pcommandMessage, &pLogRecord, &bytesReturned) == 0) {
 
-                        newParm = FALSE;
-                    }
-                }
+        printf("Subscribed to %S\n", pLogRecord->Name);
 
-                commandLine[count] = '\0';
+        HeapFree(GetProcessHeap(), 0, pLogRecord);
 
-                if (parmCount == 0) {
+    } else {
 
-                    continue;
-                }
+        printf("Subscription failed, the filter did not accept it.\n");
+    }
 
-                //
-                // We've got our parameter count and parameter list, so
-                // send it off to be interpreted.
-                //
+    HeapFree(GetProcessHeap(), 0, pcommandMessage);
+	return NULL;
+}
 
-                returnValue = InterpretCommand( parmCount, parms, &context );
+//
+//  Operation names accepted by /u op:<name>.
+//
 
-                if (returnValue == EXIT_PROGRAM) {
+typedef struct _SUBSCRIBE_OPERATION_NAME {
+    PCHAR Name;
+    UCHAR MajorId;
+} SUBSCRIBE_OPERATION_NAME;
+
+static const SUBSCRIBE_OPERATION_NAME SubscribeOperationNames[] = {
+    { "create",     IRP_MJ_CREATE },
+    { "close",      IRP_MJ_CLOSE },
+    { "read",       IRP_MJ_READ },
+    { "write",      IRP_MJ_WRITE },
+    { "queryinfo",  IRP_MJ_QUERY_INFORMATION },
+    { "setinfo",    IRP_MJ_SET_INFORMATION },
+    { "dirctl",     IRP_MJ_DIRECTORY_CONTROL },
+    { "fsctl",      IRP_MJ_FILE_SYSTEM_CONTROL },
+    { "cleanup",    IRP_MJ_CLEANUP },
+    { "setsec",     IRP_MJ_SET_SECURITY }
+};
 
-                    // Time to stop the program
-                    goto Main_Cleanup;
+DWORD
+BuildSubscription (
+    __in int argc,
+    __in_ecount(argc) char *argv[],
+    __deref_out PSUBSCRIPTION *Subscription,
+    __out PULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Builds a SUBSCRIPTION from /u terms:
+
+        op:<name or number>   an operation, all of them if none is given
+        disp:<DdRW->          access types, '-' for none, all if not given
+        path:<prefix>         a normalized path prefix
+        proc:<image name>     a process image name
+
+Arguments:
+
+    argc - the number of terms
+    argv - the terms
+    Subscription - receives the subscription, free it with HeapFree
+    Length - receives its size in bytes
+
+Return Value:
+
+    SUCCESS or USAGE_ERROR.
+
+--*/
+{
+    PSUBSCRIPTION subscription;
+    BOOLEAN operations = FALSE;
+    BOOLEAN dispositions = FALSE;
+    ULONG strings = 0;
+    ULONG length;
+    PWCHAR next;
+    PCHAR value;
+    int pass;
+    int i;
+    int j;
+
+    //
+    //  Work out how much room the strings need.
+    //
+
+    length = FIELD_OFFSET( SUBSCRIPTION, Strings );
+
+    for (i = 0; i < argc; i++) {
+
+        if (!_strnicmp( argv[i], "path:", 5 ) || !_strnicmp( argv[i], "proc:", 5 )) {
+
+            if (argv[i][5] == '\0') {
+
+                return USAGE_ERROR;
+            }
+
+            length += (ULONG)(strlen( argv[i] + 5 ) + 1) * sizeof( WCHAR );
+            strings++;
+        }
+    }
+
+    if (strings > SUBSCRIBE_MAX_STRINGS || length > SUBSCRIBE_MAX_LENGTH) {
+
+        return USAGE_ERROR;
+    }
+
+    subscription = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY, length );
+
+    if (subscription == NULL) {
+
+        return USAGE_ERROR;
+    }
+
+    for (i = 0; i < argc; i++) {
+
+        value = strchr( argv[i], ':' );
+
+        if (value == NULL) {
+
+            goto BuildSubscription_Usage;
+        }
+
+        value++;
+
+        if (!_strnicmp( argv[i], "op:", 3 )) {
+
+            for (j = 0; j < sizeof( SubscribeOperationNames ) / sizeof( SubscribeOperationNames[0] ); j++) {
+
+                if (!_stricmp( value, SubscribeOperationNames[j].Name )) {
+
+                    break;
                 }
             }
 
-            //
-            // Set LogToScreen appropriately based on any commands seen
-            //
+            if (j < sizeof( SubscribeOperationNames ) / sizeof( SubscribeOperationNames[0] )) {
 
-            context.LogToScreen = context.NextLogToScreen;
+                SubscribeOperation( subscription, SubscribeOperationNames[j].MajorId );
 
-            if (context.LogToScreen) {
+            } else if (value[0] >= '0' && value[0] <= '9') {
 
-                printf( "Should be logging to screen...\n" );
+                SubscribeOperation( subscription, strtoul( value, NULL, 0 ) );
+
+            } else {
+
+                goto BuildSubscription_Usage;
             }
+
+            operations = TRUE;
+
+        } else if (!_strnicmp( argv[i], "disp:", 5 )) {
+
+            for (; *value != '\0'; value++) {
+
+                switch (*value) {
+
+                    case 'D': subscription->Dispositions |= SUBSCRIBE_DISPOSITION_DELETE; break;
+                    case 'd': subscription->Dispositions |= SUBSCRIBE_DISPOSITION_DELETE_PENDING; break;
+                    case 'R': subscription->Dispositions |= SUBSCRIBE_DISPOSITION_RENAME; break;
+                    case 'W': subscription->Dispositions |= SUBSCRIBE_DISPOSITION_WRITE; break;
+                    case '-': subscription->Dispositions |= SUBSCRIBE_DISPOSITION_OTHER; break;
+                    default: goto BuildSubscription_Usage;
+                }
+            }
+
+            dispositions = TRUE;
+
+        } else if (_strnicmp( argv[i], "path:", 5 ) && _strnicmp( argv[i], "proc:", 5 )) {
+
+            goto BuildSubscription_Usage;
         }
     }
 
-Main_Cleanup:
+    if (!operations) {
 
-    //
-    // Clean up the threads, then fall through to Main_Exit
-    //
+        FillMemory( subscription->Operations, sizeof( subscription->Operations ), 0xFF );
+    }
 
-    printf( "Cleaning up...\n" );
+    if (!dispositions) {
 
-    //
-    // Set the Cleaning up flag to TRUE to notify other threads
-    // that we are cleaning up
-    //
-    context.CleaningUp = TRUE;
+        subscription->Dispositions = SUBSCRIBE_DISPOSITION_ALL;
+    }
 
     //
-    // Wait for everyone to shut down
+    //  The prefixes go first, then the processes.
     //
 
-    WaitForSingleObject( context.ShutDown, INFINITE );
+    next = subscription->Strings;
 
-    if (context.LogToFile) {
+    for (pass = 0; pass < 2; pass++) {
 
-        fclose( context.OutputFile );
-    }
+        for (i = 0; i < argc; i++) {
 
-Main_Exit:
+            if (_strnicmp( argv[i], (pass == 0) ? "path:" : "proc:", 5 )) {
 
-    //
-    // Clean up the data that is always around and exit
-    //
+                continue;
+            }
 
-    if(context.ShutDown) {
+            MultiByteToWideChar( CP_ACP,
+                                 0,
+                                 argv[i] + 5,
+                                 -1,
+                                 next,
+                                 (int)strlen( argv[i] + 5 ) + 1 );
 
-        CloseHandle( context.ShutDown );
-    }
+            next += wcslen( next ) + 1;
 
-    if (thread) {
+            if (pass == 0) {
 
-        CloseHandle( thread );
-    }
+                subscription->PrefixCount++;
 
-    if (INVALID_HANDLE_VALUE != gport) {
-        CloseHandle( gport );
+            } else {
+
+                subscription->ProcessCount++;
+            }
+        }
     }
-    return 0;
-}
 
-#endif  //__DLL_EXPORT__
+    *Subscription = subscription;
+    *Length = length;
+    return SUCCESS;
 
-#pragma warning(pop)
+BuildSubscription_Usage:
 
+    HeapFree( GetProcessHeap(), 0, subscription );
+    return USAGE_ERROR;
+}
+
+#ifndef __DLL_EXPORT__
 DWORD
-InterpretCommand (
+ReportSketch (
     __in int argc,
     __in_ecount(argc) char *argv[],
-    __in PLOG_CONTEXT Context
+    __in PLOG_SKETCH Sketch,
+    __in BOOLEAN Distinct
     )
 /*++
 
 Routine Description:
 
-    Process options from the user
+    Prints a /t or /c report from terms:
+
+        proc, user, path or disp   what to report on
+        disp:<c>                   only records of access type <c>
+        last:<minutes>             how far back to go, 60 if not given
+        top:<n>                    how many to list, 10 if not given
 
 Arguments:
 
+    argc - the number of terms
+    argv - the terms
+    Sketch - the sketches
+    Distinct - TRUE for /c, how many distinct keys there were, FALSE for
+        /t, the busiest ones
+
 Return Value:
 
+    SUCCESS or USAGE_ERROR.
+
 --*/
 {
-    LONG parmIndex;
-    PCHAR parm;
-    HRESULT hResult;
-    DWORD returnValue = SUCCESS;
-    WCHAR buffer[BUFFER_SIZE/2];
-    DWORD bufferLength;
-    PWCHAR instanceString;
-    WCHAR instanceName[INSTANCE_NAME_MAX_CHARS + 1];
+    static const PCHAR keyNames[SketchKeys] = { "proc", "user", "path" };
+    SKETCH_KEY key = SketchKeys;
+    BOOLEAN dispositions = FALSE;
+    CHAR disposition = 0;
+    ULONG minutes = SKETCH_MINUTES;
+    ULONG count = 10;
+    int i;
+    int j;
 
-    //
-    // Interpret the command line parameters
-    //
-    for (parmIndex = 0; parmIndex < argc; parmIndex++) {
+    for (i = 0; i < argc; i++) {
 
-        parm = argv[parmIndex];
+        if (!_strnicmp( argv[i], "disp:", 5 )) {
 
-        if (parm[0] == '/') {
+            disposition = argv[i][5];
 
-            //
-            // Have the beginning of a switch
-            //
+            if (disposition == 0 ||
+                argv[i][6] != 0 ||
+                strchr( SKETCH_DISPOSITION_CHARS, disposition ) == NULL) {
 
-            switch (parm[1]) {
+                return USAGE_ERROR;
+            }
 
-            case 'a':
-            case 'A':
+        } else if (!_strnicmp( argv[i], "last:", 5 )) {
 
-                //
-                // Attach to the specified drive letter
-                //
+            minutes = (ULONG)atol( &argv[i][5] );
 
-                parmIndex++;
+            if (minutes == 0 || minutes > SKETCH_HOURS * 60) {
 
-                if (parmIndex >= argc) {
+                return USAGE_ERROR;
+            }
 
-                    //
-                    // Not enough parameters
-                    //
+        } else if (!_strnicmp( argv[i], "top:", 4 )) {
 
-                    goto InterpretCommand_Usage;
-                }
+            count = (ULONG)atol( &argv[i][4] );
 
-                parm = argv[parmIndex];
+        } else if (!_stricmp( argv[i], "disp" ) && !Distinct) {
 
-                printf( "    Attaching to %s... ", parm );
+            dispositions = TRUE;
 
-                bufferLength = MultiByteToWideChar( CP_ACP,
-                                                    MB_ERR_INVALID_CHARS,
-                                                    parm,
-                                                    -1,
-                                                    (LPWSTR)buffer,
-                                                    BUFFER_SIZE/sizeof( WCHAR ) );
+        } else {
 
-                if (bufferLength == 0) {
+            for (j = 0; j < SketchKeys; j++) {
 
-                    //
-                    //  We do not expect the user to provide a parm that
-                    //  causes buffer to overflow. 
-                    //
+                if (!_stricmp( argv[i], keyNames[j] )) {
 
-                    goto InterpretCommand_Usage;
+                    break;
                 }
+            }
 
-                hResult = FilterAttach( MINISPY_NAME,
-                                        (PWSTR)buffer,
-                                        NULL, // instance name
-                                        sizeof( instanceName ),
-                                        instanceName );
+            if (j == SketchKeys) {
+
+                return USAGE_ERROR;
+            }
+
+            key = (SKETCH_KEY)j;
+        }
+    }
+
+    if (dispositions) {
+
+        SketchReportDispositions( Sketch, minutes );
+
+    } else if (key == SketchKeys) {
+
+        return USAGE_ERROR;
+
+    } else if (Distinct) {
+
+        SketchReportDistinct( Sketch, key, disposition, minutes );
+
+    } else {
+
+        SketchReportTop( Sketch, key, disposition, minutes, count );
+    }
+
+    return SUCCESS;
+}
+#endif
+
+
+VOID
+DisplayError (
+   __in DWORD Code
+   )
+
+/*++
+
+Routine Description:
+
+   This routine will display an error message based off of the Win32 error
+   code that is passed in. This allows the user to see an understandable
+   error message instead of just the code.
+
+Arguments:
+
+   Code - The error code to be translated.
+
+Return Value:
+
+   None.
+
+--*/
+
+{
+    __nullterminated WCHAR buffer[MAX_PATH] = { 0 }; 
+    DWORD count;
+    HMODULE module = NULL;
+    HRESULT status;
+
+    count = FormatMessage (FORMAT_MESSAGE_FROM_SYSTEM,
+                           NULL,
+                           Code,
+                           0,
+                           buffer,
+                           sizeof(buffer) / sizeof(WCHAR),
+                           NULL);
+
+
+    if (count == 0) {
+
+        count = GetSystemDirectory( buffer,
+                                    sizeof(buffer) / sizeof( WCHAR ) );
+
+        if (count==0 || count > sizeof(buffer) / sizeof( WCHAR )) {
+
+            //
+            //  In practice we expect buffer to be large enough to hold the 
+            //  system directory path. 
+            //
+
+            printf("    Could not translate error: %d\n", Code);
+            return;
+        }
+
+
+        status = StringCchCat( buffer,
+                               sizeof(buffer) / sizeof( WCHAR ),
+                               L"\\fltlib.dll" );
+
+        if (status != S_OK) {
+
+            printf("    Could not translate error: %d\n", Code);
+            return;
+        }
+
+        module = LoadLibraryExW( buffer, NULL, LOAD_LIBRARY_AS_DATAFILE );
+
+        //
+        //  Translate the Win32 error code into a useful message.
+        //
+
+        count = FormatMessage (FORMAT_MESSAGE_FROM_HMODULE,
+                               module,
+                               Code,
+                               0,
+                               buffer,
+                               sizeof(buffer) / sizeof(WCHAR),
+                               NULL);
+
+        if (module != NULL) {
+
+            FreeLibrary( module );
+        }
+
+        //
+        //  If we still couldn't resolve the message, generate a string
+        //
+
+        if (count == 0) {
+
+            printf("    Could not translate error: %d\n", Code);
+            return;
+        }
+    }
+
+    //
+    //  Display the translated error.
+    //
+
+    printf("    %ws\n", buffer);
+}
+
+
+//
+//  Main uses a loop which has an assignment in the while 
+//  conditional statement. Suppress the compiler's warning.
+//
+
+#pragma warning(push)
+#pragma warning(disable:4706) // assignment within conditional expression
+
+#ifndef __DLL_EXPORT__
+
+int _cdecl
+main (
+    __in int argc,
+    __in_ecount(argc) char *argv[]
+    )
+/*++
+
+Routine Description:
+
+    Main routine for minispy
+
+Arguments:
+
+Return Value:
+
+--*/
+{
+    HRESULT hResult = S_OK;
+    DWORD result;
+    ULONG threadId;
+    HANDLE thread = NULL;
+    LOG_CONTEXT context;
+    LOG_WRITER writer;
+    LOG_SKETCH sketch;
+    LOG_CAPTURE capture;
+    MINISPY_CONNECT connect;
+    CHAR inputChar;
+    int i;
+
+    //
+    //  Initialize handle in case of error
+    //
+
+    context.ShutDown = NULL;
+    context.Writer = NULL;
+    context.Sketch = NULL;
+    context.Capture = NULL;
+
+    //
+    //  Searching the log kept by /w needs no filter.
+    //
+
+    if (argc > 1 &&
+        argv[1][0] == '/' &&
+        (argv[1][1] == 'i' || argv[1][1] == 'I') &&
+        argv[1][2] == '\0') {
+
+        return LogQuery( argc - 2, &argv[2] );
+    }
+
+    //
+    //  Neither does playing back a capture made with /z.
+    //
+
+    if (argc > 1 &&
+        argv[1][0] == '/' &&
+        (argv[1][1] == 'v' || argv[1][1] == 'V') &&
+        argv[1][2] == '\0') {
+
+        return CaptureReplay( argc - 2, &argv[2] );
+    }
+
+    //
+    //  The subscriber, if any, is fixed when the port is opened, so look
+    //  for /r before anything else.
+    //
+
+    connect.SubscriberId = 0;
+
+    for (i = 1; i + 1 < argc; i++) {
+
+        if (argv[i][0] == '/' &&
+            (argv[i][1] == 'r' || argv[i][1] == 'R') &&
+            argv[i][2] == '\0') {
+
+            connect.SubscriberId = (ULONG)atol( argv[i + 1] );
+        }
+    }
+
+    //
+    //  Open the port that is used to talk to
+    //  MiniSpy.
+    //
+
+    printf( "Connecting to filter's port...\n" );
+
+    hResult = FilterConnectCommunicationPort( MINISPY_PORT_NAME,
+                                              0,
+                                              &connect,
+                                              sizeof( connect ),
+                                              NULL,
+                                              &gport );
+
+    if (IS_ERROR( hResult )) {
+
+        printf( "Could not connect to filter: 0x%08x\n", hResult );
+        DisplayError( hResult );
+        goto Main_Exit;
+    }
+
+    //
+    // Initialize the fields of the LOG_CONTEXT
+    //
+
+    context.Port = gport;
+    context.ShutDown = CreateSemaphore( NULL,
+                                        0,
+                                        1,
+                                        L"MiniSpy shut down" );
+    context.CleaningUp = FALSE;
+    context.LogToFile = FALSE;
+    context.LogToScreen = FALSE;        //don't start logging yet
+    context.NextLogToScreen = TRUE;
+    context.OutputFile = NULL;
+    SequenceReset( &context.Sequence );
+    context.MergeWindow = MERGE_DEFAULT_WINDOW;
+    context.SubscriberId = connect.SubscriberId;
+    ZeroMemory( context.Committed, sizeof( context.Committed ) );
+    context.Writer = LogWriterInitialize( &writer ) ? &writer : NULL;
+    context.Sketch = SketchInitialize( &sketch ) ? &sketch : NULL;
+    context.RecordsReceived = 0;
+    context.Capture = CaptureInitialize( &capture ) ? &capture : NULL;
+
+    if (context.ShutDown == NULL) {
+
+        result = GetLastError();
+        printf( "Could not create semaphore: %d\n", result );
+        DisplayError( result );
+        goto Main_Exit;
+    }
+
+    //
+    // Check the valid parameters for startup
+    //
+
+    if (argc > 1) {
+
+        if (InterpretCommand( argc - 1, &(argv[1]), &context ) == USAGE_ERROR) {
+
+            goto Main_Exit;
+        }
+    }
+
+    //
+    // Create the thread to read the log records that are gathered
+    // by MiniSpy.sys.
+    //
+    printf( "Creating logging thread...\n" );
+    thread = CreateThread( NULL,
+                           0,
+                           RetrieveLogRecords,
+                           (LPVOID)&context,
+                           0,
+                           &threadId);
+
+    if (!thread) {
+
+        result = GetLastError();
+        printf( "Could not create logging thread: %d\n", result );
+        DisplayError( result );
+        goto Main_Exit;
+    }
+
+    //
+    // Check to see what devices we are attached to from
+    // previous runs of this program.
+    //
+
+    ListDevices();
+
+    //
+    //  Process commands from the user
+    //
+
+    printf( "\nHit [Enter] to begin command mode...\n\n" );
+    fflush( stdout );
+
+    //
+    //  set screen logging state
+    //
+
+    context.LogToScreen = context.NextLogToScreen;
+
+    while (inputChar = (CHAR)getchar()) {
+
+        CHAR *parms[NUM_PARAMS];
+        CHAR commandLine[CMDLINE_SIZE+1];
+        INT parmCount, count;
+        DWORD returnValue = SUCCESS;
+        BOOL newParm;
+        CHAR ch;
+
+        if (inputChar == '\n') {
+
+            //
+            // Start command interpreter.  First we must turn off logging
+            // to screen if we are.  Also, remember the state of logging
+            // to the screen, so that we can reinstate that when command
+            // interpreter is finished.
+            //
+
+            context.NextLogToScreen = context.LogToScreen;
+            context.LogToScreen = FALSE;
+
+            while (returnValue != EXIT_INTERPRETER) {
+
+                //
+                // Print prompt
+                //
+                printf( ">" );
+
+                //
+                // Read in next line, keeping track of the number of parameters
+                // as we go.
+                //
+
+                parmCount = 0;
+                newParm = TRUE;
+                for ( count = 0;
+                      (count < CMDLINE_SIZE) && ((ch = (CHAR)getchar()) != '\n');
+                      count++)
+                {
+                    commandLine[count] = ch;
+
+                    if (newParm && (ch != ' ')) {
+
+                        parms[parmCount++] = &commandLine[count];
+                    }
+
+                    if (parmCount >= NUM_PARAMS) {
+
+                        break;
+                    }
+
+                    //
+                    //  Always insert NULL's for spaces
+                    //
+
+                    if (ch == ' ') {
+
+                        newParm = TRUE;
+                        commandLine[count] = 0;
+
+                    } else {
+
+                        newParm = FALSE;
+                    }
+                }
+
+                commandLine[count] = '\0';
+
+                if (parmCount == 0) {
+
+                    continue;
+                }
+
+                //
+                // We've got our parameter count and parameter list, so
+                // send it off to be interpreted.
+                //
+
+                returnValue = InterpretCommand( parmCount, parms, &context );
+
+                if (returnValue == EXIT_PROGRAM) {
+
+                    // Time to stop the program
+                    goto Main_Cleanup;
+                }
+            }
+
+            //
+            // Set LogToScreen appropriately based on any commands seen
+            //
+
+            context.LogToScreen = context.NextLogToScreen;
+
+            if (context.LogToScreen) {
+
+                printf( "Should be logging to screen...\n" );
+            }
+        }
+    }
+
+Main_Cleanup:
+
+    //
+    // Clean up the threads, then fall through to Main_Exit
+    //
+
+    printf( "Cleaning up...\n" );
+
+    //
+    // Set the Cleaning up flag to TRUE to notify other threads
+    // that we are cleaning up
+    //
+    context.CleaningUp = TRUE;
+
+    //
+    // Wait for everyone to shut down
+    //
+
+    WaitForSingleObject( context.ShutDown, INFINITE );
+
+    if (context.LogToFile) {
+
+        fclose( context.OutputFile );
+    }
+
+Main_Exit:
+
+    //
+    // Clean up the data that is always around and exit
+    //
+
+    if(context.ShutDown) {
+
+        CloseHandle( context.ShutDown );
+    }
+
+    if (context.Writer != NULL) {
+
+        LogWriterCleanup( context.Writer );
+    }
+
+    if (context.Sketch != NULL) {
+
+        SketchCleanup( context.Sketch );
+    }
+
+    if (context.Capture != NULL) {
+
+        CaptureCleanup( context.Capture );
+    }
+
+    if (thread) {
+
+        CloseHandle( thread );
+    }
+
+    if (INVALID_HANDLE_VALUE != gport) {
+        CloseHandle( gport );
+    }
+    return 0;
+}
+
+#endif  //__DLL_EXPORT__
+
+#pragma warning(pop)
+
+DWORD
+InterpretCommand (
+    __in int argc,
+    __in_ecount(argc) char *argv[],
+    __in PLOG_CONTEXT Context
+    )
+/*++
+
+Routine Description:
+
+    Process options from the user
+
+Arguments:
+
+Return Value:
+
+--*/
+{
+    LONG parmIndex;
+    PCHAR parm;
+    HRESULT hResult;
+    DWORD returnValue = SUCCESS;
+    WCHAR buffer[BUFFER_SIZE/2];
+    DWORD bufferLength;
+    PWCHAR instanceString;
+    WCHAR instanceName[INSTANCE_NAME_MAX_CHARS + 1];
+
+    //
+    // Interpret the command line parameters
+    //
+    for (parmIndex = 0; parmIndex < argc; parmIndex++) {
+
+        parm = argv[parmIndex];
+
+        if (parm[0] == '/') {
+
+            //
+            // Have the beginning of a switch
+            //
+
+            switch (parm[1]) {
+
+            case 'a':
+            case 'A':
+
+                //
+                // Attach to the specified drive letter
+                //
+
+                parmIndex++;
+
+                if (parmIndex >= argc) {
+
+                    //
+                    // Not enough parameters
+                    //
+
+                    goto InterpretCommand_Usage;
+                }
+
+                parm = argv[parmIndex];
+
+                printf( "    Attaching to %s... ", parm );
+
+                bufferLength = MultiByteToWideChar( CP_ACP,
+                                                    MB_ERR_INVALID_CHARS,
+                                                    parm,
+                                                    -1,
+                                                    (LPWSTR)buffer,
+                                                    BUFFER_SIZE/sizeof( WCHAR ) );
+
+                if (bufferLength == 0) {
+
+                    //
+                    //  We do not expect the user to provide a parm that
+                    //  causes buffer to overflow. 
+                    //
+
+                    goto InterpretCommand_Usage;
+                }
+
+                hResult = FilterAttach( MINISPY_NAME,
+                                        (PWSTR)buffer,
+                                        NULL, // instance name
+                                        sizeof( instanceName ),
+                                        instanceName );
+
+                if (SUCCEEDED( hResult )) {
+
+                    printf( "    Instance name: %S\n", instanceName );
+
+                } else {
+
+                    printf( "\n    Could not attach to device: 0x%08x\n", hResult );
+                    DisplayError( hResult );
+                    returnValue = SUCCESS;
+                }
+
+                break;
+
+            case 'd':
+            case 'D':
+
+                //
+                // Detach to the specified drive letter
+                //
+
+                parmIndex++;
+
+                if (parmIndex >= argc) {
+
+                    //
+                    // Not enough parameters
+                    //
+
+                    goto InterpretCommand_Usage;
+                }
+
+                parm = argv[parmIndex];
+
+                printf( "    Detaching from %s\n", parm );
+                bufferLength = MultiByteToWideChar( CP_ACP,
+                                                    MB_ERR_INVALID_CHARS,
+                                                    parm,
+                                                    -1,
+                                                    (LPWSTR)buffer,
+                                                    BUFFER_SIZE/sizeof( WCHAR ) );
+
+                if (bufferLength == 0) {
+
+                    //
+                    //  We do not expect the user to provide a parm that
+                    //  causes buffer to overflow.
+                    //
+
+                    goto InterpretCommand_Usage; 
+                }
+
+                //
+                //  Get the next argument to see if it is an InstanceId
+                //
+
+                parmIndex++;
+
+                if (parmIndex >= argc) {
+
+                    instanceString = NULL;
+
+                } else {
+
+                    if (argv[parmIndex][0] == '/') {
+
+                        //
+                        //  This is just the next command, so don't
+                        //  internet it as the InstanceId.
+                        //
+
+                        instanceString = NULL;
+                        parmIndex--;
+
+                    } else {
+
+                        parm = argv[parmIndex];
+                        bufferLength = MultiByteToWideChar( CP_ACP,
+                                                            MB_ERR_INVALID_CHARS,
+                                                            parm,
+                                                            -1,
+                                                            (LPWSTR)instanceName,
+                                                            sizeof( instanceName )/sizeof( WCHAR ) );
+
+                        if (bufferLength == 0) {
+
+                            //
+                            //  We do not expect the user to provide a parm that
+                            //  causes buffer to overflow.
+                            //
+
+                            goto InterpretCommand_Usage;
+                        }
+
+                        instanceString = instanceName;
+                    }
+                }
+
+                //
+                //  Detach from the volume and instance specified.
+                //
+
+                hResult = FilterDetach( MINISPY_NAME,
+                                        (PWSTR)buffer,
+                                        instanceString );
+
+                if (IS_ERROR( hResult )) {
+
+                    printf( "    Could not detach from device: 0x%08x\n", hResult );
+                    DisplayError( hResult );
+                    returnValue = SUCCESS;
+                }
+                break;
+
+            case 'l':
+            case 'L':
+
+                //
+                // List all devices that are currently being monitored
+                //
+
+                ListDevices();
+                break;
+
+            case 'n':
+            case 'N':
+
+                //
+                // Output logging results to screen, save new value to
+                // instate when command interpreter is exited.
+                //
+                if (Context->NextLogToScreen) {
+
+                    printf( "    Turning off logging to screen\n" );
+
+                } else {
+
+                    printf( "    Turning on logging to screen\n" );
+                }
+
+                Context->NextLogToScreen = !Context->NextLogToScreen;
+                break;
+
+            case 'f':
+            case 'F':
+
+                //
+                // Output logging results to file
+                //
+
+                if (Context->LogToFile) {
+
+                    printf( "    Stop logging to file \n" );
+                    Context->LogToFile = FALSE;
+                    assert( Context->OutputFile );
+                    fclose( Context->OutputFile );
+                    Context->OutputFile = NULL;
+
+                } else {
+
+                    parmIndex++;
+
+                    if (parmIndex >= argc) {
+
+                        //
+                        // Not enough parameters
+                        //
+
+                        goto InterpretCommand_Usage;
+                    }
+
+                    parm = argv[parmIndex];
+                    printf( "    Log to file %s\n", parm );
+                    Context->OutputFile = fopen( parm, "w" );
+                    assert( Context->OutputFile );
+                    Context->LogToFile = TRUE;
+                }
+                break;
+            
+            case 's':
+            case 'S':
+                {
+                    CHAR dir[MAX_PATH];
+                    ULONG len;
+                    //
+                    //  set Protection folder.
+                    //
+                    parmIndex++;
+
+                    if (parmIndex >= argc) {
+
+                        //
+                        // Not enough parameters
+                        //
+
+                        goto InterpretCommand_Usage;
+                    }
+
+                    parm = dir; 
+                    len = MAX_PATH;
+                    for( parmIndex; parmIndex < argc; parmIndex++)
+                    {
+                        strncpy_s(parm, len, argv[parmIndex], strlen(argv[parmIndex]));
+                        parm += strlen(parm);
+                        len -= strlen(parm);
+                        if(argc > parmIndex+1){
+                            strncpy_s(parm, len, " ", 1);
+                            parm++;
+                        }
+                    }
+
+                    *parm = '\0';
+                    parm = dir;            
+
+                    printf( " Setting Protection floder: %s\n", parm );
+
+                    bufferLength = MultiByteToWideChar( CP_ACP,
+                                                        MB_ERR_INVALID_CHARS,
+                                                        parm,
+                                                        -1,
+                                                        (LPWSTR)buffer,
+                                                        BUFFER_SIZE/sizeof( WCHAR ) );
+
+                    if (bufferLength == 0) {
+
+                        //
+                        //  We do not expect the user to provide a parm that
+                        //  causes buffer to overflow.
+                        //
+
+                        goto InterpretCommand_Usage; 
+                    }
+
+                    setProtectionFolder(buffer);
+                }
+                break;
+
+            case 'g':
+            case 'G':
+                //
+                //  get Protection folder.
+                //    
+                getProtectionFolder();
+                
+                break;
+
+            case 'e':
+            case 'E':
+                {
+                    //
+                    //  set Protection folder.
+                    //
+                    parmIndex++;
+
+                    if (parmIndex >= argc) {
+
+                        //
+                        // Not enough parameters
+                        //
+
+                        goto InterpretCommand_Usage;
+                    }
+
+                    parm = argv[parmIndex];
+
+                    printf( " Setting Proccess Name: %s to accesss then protction floder.\n ", parm );
+
+                    bufferLength = MultiByteToWideChar( CP_ACP,
+                                                        MB_ERR_INVALID_CHARS,
+                                                        parm,
+                                                        -1,
+                                                        (LPWSTR)buffer,
+                                                        BUFFER_SIZE/sizeof( WCHAR ) );
+
+                    if (bufferLength == 0) {
+
+                        //
+                        //  We do not expect the user to provide a parm that
+                        //  causes buffer to overflow.
+                        //
+
+                        goto InterpretCommand_Usage; 
+                    }
+
+                    setOpenProcess(buffer);
+                }
+
+                break;
+
+            case 'q':
+            case 'Q':
+                {
+                    LONG floor;
+                    LONG ceiling;
+
+                    //
+                    //  set the record quota bounds.
+                    //
+
+                    if (parmIndex + 2 >= argc) {
+
+                        //
+                        // Not enough parameters
+                        //
+
+                        goto InterpretCommand_Usage;
+                    }
+
+                    floor = atol( argv[++parmIndex] );
+                    ceiling = atol( argv[++parmIndex] );
+
+                    if (floor <= 0 || ceiling < floor) {
+
+                        goto InterpretCommand_Usage;
+                    }
+
+                    printf( " Setting record quota: %d to %d records\n", floor, ceiling );
+
+                    setRecordQuota(floor, ceiling);
+                }
+                break;
+
+            case 'b':
+            case 'B':
+                {
+                    LONG thresholds[3];
+                    LONG window = 10000;
+                    LONG block = 0;
+                    int j;
+
+                    //
+                    //  set the burst thresholds: renames, deletes and
+                    //  overwrites per window, then optionally the window
+                    //  and "block".
+                    //
+
+                    if (parmIndex + 3 >= argc) {
+
+                        //
+                        // Not enough parameters
+                        //
+
+                        goto InterpretCommand_Usage;
+                    }
+
+                    for (j = 0; j < 3; j++) {
+
+                        thresholds[j] = atol( argv[++parmIndex] );
+
+                        if (thresholds[j] < 0) {
+
+                            goto InterpretCommand_Usage;
+                        }
+                    }
+
+                    if (parmIndex + 1 < argc && argv[parmIndex + 1][0] != '/' &&
+                        _stricmp( argv[parmIndex + 1], "block" )) {
+
+                        window = atol( argv[++parmIndex] );
+                    }
+
+                    if (parmIndex + 1 < argc && !_stricmp( argv[parmIndex + 1], "block" )) {
+
+                        block = 1;
+                        parmIndex++;
+                    }
+
+                    if (window <= 0) {
+
+                        goto InterpretCommand_Usage;
+                    }
+
+                    setBurst( thresholds[0], thresholds[1], thresholds[2], window, block );
+                }
+                break;
+
+            case 'k':
+            case 'K':
+
+                //
+                //  set how long records are held to print them in time
+                //  order.
+                //
+
+                if (parmIndex + 1 >= argc) {
+
+                    //
+                    // Not enough parameters
+                    //
+
+                    goto InterpretCommand_Usage;
+                }
+
+                Context->MergeWindow = (ULONG)atol( argv[++parmIndex] );
+
+                printf( " Holding records for %lu ms to print them in order\n",
+                        Context->MergeWindow );
+
+                break;
+
+#ifndef __DLL_EXPORT__
+            case 'w':
+            case 'W':
+                {
+                    ULONG settings[3] = { LOG_WRITER_DEFAULT_SEGMENT, LOG_WRITER_DEFAULT_COMMIT, 0 };
+                    ULONG count;
+                    DWORD result;
+
+                    //
+                    //  write the records to segment files, or stop.
+                    //
+
+                    if (Context->Writer == NULL) {
+
+                        printf( "    The log writer is not available\n" );
+                        break;
+                    }
+
+                    if (parmIndex + 1 >= argc || argv[parmIndex + 1][0] == '/') {
+
+                        printf( "    Stop writing the log\n" );
+                        LogWriterStop( Context->Writer );
+                        LogWriterReport( Context->Writer );
+                        break;
+                    }
 
-                if (SUCCEEDED( hResult )) {
+                    parm = argv[++parmIndex];
 
-                    printf( "    Instance name: %S\n", instanceName );
+                    for (count = 0;
+                         count < 3 && parmIndex + 1 < argc && argv[parmIndex + 1][0] != '/';
+                         count++) {
 
-                } else {
+                        settings[count] = (ULONG)atol( argv[++parmIndex] );
+                    }
 
-                    printf( "\n    Could not attach to device: 0x%08x\n", hResult );
-                    DisplayError( hResult );
-                    returnValue = SUCCESS;
-                }
+                    result = LogWriterStart( Context->Writer,
+                                             parm,
+                                             settings[0],
+                                             settings[1],
+                                             settings[2] * 60 * 1000 );
 
-                break;
+                    if (result != ERROR_SUCCESS) {
 
-            case 'd':
-            case 'D':
+                        printf( "    Could not write the log to %s\n", parm );
+                        DisplayError( result );
 
-                //
-                // Detach to the specified drive letter
-                //
+                    } else {
 
-                parmIndex++;
+                        printf( "    Writing the log to %s in %lu MB segments, committed every %lu ms\n",
+                                parm,
+                                settings[0],
+                                settings[1] );
+                    }
+                }
+                break;
 
-                if (parmIndex >= argc) {
+            case 't':
+            case 'T':
+            case 'c':
+            case 'C':
+                {
+                    int terms;
 
                     //
-                    // Not enough parameters
+                    //  report the busiest keys, or how many distinct ones
+                    //  there were, from the terms up to the next switch.
                     //
 
-                    goto InterpretCommand_Usage;
-                }
+                    terms = 0;
 
-                parm = argv[parmIndex];
+                    while (parmIndex + 1 + terms < argc &&
+                           argv[parmIndex + 1 + terms][0] != '/') {
 
-                printf( "    Detaching from %s\n", parm );
-                bufferLength = MultiByteToWideChar( CP_ACP,
-                                                    MB_ERR_INVALID_CHARS,
-                                                    parm,
-                                                    -1,
-                                                    (LPWSTR)buffer,
-                                                    BUFFER_SIZE/sizeof( WCHAR ) );
+                        terms++;
+                    }
 
-                if (bufferLength == 0) {
+                    if (Context->Sketch == NULL) {
 
-                    //
-                    //  We do not expect the user to provide a parm that
-                    //  causes buffer to overflow.
-                    //
+                        printf( "    The record summaries are not available\n" );
 
-                    goto InterpretCommand_Usage; 
+                    } else if (ReportSketch( terms,
+                                             &argv[parmIndex + 1],
+                                             Context->Sketch,
+                                             (BOOLEAN)(parm[1] == 'c' || parm[1] == 'C') ) != SUCCESS) {
+
+                        goto InterpretCommand_Usage;
+                    }
+
+                    parmIndex += terms;
                 }
+                break;
 
-                //
-                //  Get the next argument to see if it is an InstanceId
-                //
+            case 'z':
+            case 'Z':
+                {
+                    WCHAR fileName[MAX_PATH];
+                    DWORD result;
 
-                parmIndex++;
+                    //
+                    //  capture the batches from the filter to a file for
+                    //  /v, or stop.
+                    //
 
-                if (parmIndex >= argc) {
+                    if (Context->Capture == NULL) {
 
-                    instanceString = NULL;
+                        printf( "    Capturing is not available\n" );
+                        break;
+                    }
 
-                } else {
+                    if (parmIndex + 1 >= argc || argv[parmIndex + 1][0] == '/') {
 
-                    if (argv[parmIndex][0] == '/') {
+                        printf( "    Stop capturing\n" );
+                        CaptureStop( Context->Capture );
+                        break;
+                    }
 
-                        //
-                        //  This is just the next command, so don't
-                        //  internet it as the InstanceId.
-                        //
+                    parm = argv[++parmIndex];
 
-                        instanceString = NULL;
-                        parmIndex--;
+                    if (MultiByteToWideChar( CP_ACP,
+                                             MB_ERR_INVALID_CHARS,
+                                             parm,
+                                             -1,
+                                             fileName,
+                                             MAX_PATH ) == 0) {
 
-                    } else {
+                        goto InterpretCommand_Usage;
+                    }
 
-                        parm = argv[parmIndex];
-                        bufferLength = MultiByteToWideChar( CP_ACP,
-                                                            MB_ERR_INVALID_CHARS,
-                                                            parm,
-                                                            -1,
-                                                            (LPWSTR)instanceName,
-                                                            sizeof( instanceName )/sizeof( WCHAR ) );
+                    result = CaptureStart( Context->Capture, fileName );
 
-                        if (bufferLength == 0) {
+                    if (result != ERROR_SUCCESS) {
 
-                            //
-                            //  We do not expect the user to provide a parm that
-                            //  causes buffer to overflow.
-                            //
+                        printf( "    Could not capture to %s\n", parm );
+                        DisplayError( result );
 
-                            goto InterpretCommand_Usage;
-                        }
+                    } else {
 
-                        instanceString = instanceName;
+                        printf( "    Capturing to %s\n", parm );
                     }
                 }
+                break;
 
-                //
-                //  Detach from the volume and instance specified.
-                //
+            case 'y':
+            case 'Y':
+                {
+                    int terms;
 
-                hResult = FilterDetach( MINISPY_NAME,
-                                        (PWSTR)buffer,
-                                        instanceString );
+                    //
+                    //  run a workload through the filter and report what
+                    //  each kind of operation cost.
+                    //
 
-                if (IS_ERROR( hResult )) {
+                    terms = 0;
 
-                    printf( "    Could not detach from device: 0x%08x\n", hResult );
-                    DisplayError( hResult );
-                    returnValue = SUCCESS;
+                    while (parmIndex + 1 + terms < argc &&
+                           argv[parmIndex + 1 + terms][0] != '/') {
+
+                        terms++;
+                    }
+
+                    if (!LoadRun( terms, &argv[parmIndex + 1], Context )) {
+
+                        goto InterpretCommand_Usage;
+                    }
+
+                    parmIndex += terms;
                 }
                 break;
 
-            case 'l':
-            case 'L':
+            case 'o':
+            case 'O':
+                {
+                    PPOLICY_RULES rules;
 
-                //
-                // List all devices that are currently being monitored
-                //
+                    //
+                    //  compile a rule file and hand the rules to the
+                    //  filter, or clear them.
+                    //
 
-                ListDevices();
-                break;
+                    rules = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof( POLICY_RULES ) );
 
-            case 'n':
-            case 'N':
+                    if (rules == NULL) {
 
-                //
-                // Output logging results to screen, save new value to
-                // instate when command interpreter is exited.
-                //
-                if (Context->NextLogToScreen) {
+                        printf( "    Out of memory\n" );
+                        break;
+                    }
 
-                    printf( "    Turning off logging to screen\n" );
+                    if (parmIndex + 1 >= argc || argv[parmIndex + 1][0] == '/') {
 
-                } else {
+                        printf( "    Clearing the policy rules\n" );
+                        setRules( rules );
 
-                    printf( "    Turning on logging to screen\n" );
-                }
+                    } else if (RulesCompile( argv[++parmIndex], rules )) {
 
-                Context->NextLogToScreen = !Context->NextLogToScreen;
+                        setRules( rules );
+                    }
+
+                    HeapFree( GetProcessHeap(), 0, rules );
+                }
                 break;
 
-            case 'f':
-            case 'F':
+#endif
+            case 'r':
+            case 'R':
 
                 //
-                // Output logging results to file
+                //  acknowledge records as subscriber <id>.  main connects
+                //  with it before any switch is interpreted, so here it
+                //  only has to be skipped.
                 //
 
-                if (Context->LogToFile) {
-
-                    printf( "    Stop logging to file \n" );
-                    Context->LogToFile = FALSE;
-                    assert( Context->OutputFile );
-                    fclose( Context->OutputFile );
-                    Context->OutputFile = NULL;
+                if (parmIndex + 1 >= argc) {
 
-                } else {
+                    //
+                    // Not enough parameters
+                    //
 
-                    parmIndex++;
+                    goto InterpretCommand_Usage;
+                }
 
-                    if (parmIndex >= argc) {
+                if ((ULONG)atol( argv[++parmIndex] ) != Context->SubscriberId) {
 
-                        //
-                        // Not enough parameters
-                        //
+                    printf( " The subscriber can only be chosen on the command line\n" );
 
-                        goto InterpretCommand_Usage;
-                    }
+                } else {
 
-                    parm = argv[parmIndex];
-                    printf( "    Log to file %s\n", parm );
-                    Context->OutputFile = fopen( parm, "w" );
-                    assert( Context->OutputFile );
-                    Context->LogToFile = TRUE;
+                    printf( " Acknowledging records as subscriber %lu\n",
+                            Context->SubscriberId );
                 }
+
                 break;
-            
-            case 's':
-            case 'S':
+
+            case 'u':
+            case 'U':
                 {
-                    CHAR dir[MAX_PATH];
-                    ULONG len;
+                    PSUBSCRIPTION subscription;
+                    ULONG subscriptionLength;
+                    int terms;
+
                     //
-                    //  set Protection folder.
+                    //  subscribe to the records up to the next switch.
                     //
-                    parmIndex++;
-
-                    if (parmIndex >= argc) {
 
-                        //
-                        // Not enough parameters
-                        //
+                    terms = 0;
 
-                        goto InterpretCommand_Usage;
-                    }
+                    while (parmIndex + 1 + terms < argc &&
+                           argv[parmIndex + 1 + terms][0] != '/') {
 
-                    parm = dir; 
-                    len = MAX_PATH;
-                    for( parmIndex; parmIndex < argc; parmIndex++)
-                    {
-                        strncpy_s(parm, len, argv[parmIndex], strlen(argv[parmIndex]));
-                        parm += strlen(parm);
-                        len -= strlen(parm);
-                        if(argc > parmIndex+1){
-                            strncpy_s(parm, len, " ", 1);
-                            parm++;
-                        }
+                        terms++;
                     }
 
-                    *parm = '\0';
-                    parm = dir;            
-
-                    printf( " Setting Protection floder: %s\n", parm );
-
-                    bufferLength = MultiByteToWideChar( CP_ACP,
-                                                        MB_ERR_INVALID_CHARS,
-                                                        parm,
-                                                        -1,
-                                                        (LPWSTR)buffer,
-                                                        BUFFER_SIZE/sizeof( WCHAR ) );
+                    if (BuildSubscription( terms,
+                                           &argv[parmIndex + 1],
+                                           &subscription,
+                                           &subscriptionLength ) != SUCCESS) {
 
-                    if (bufferLength == 0) {
+                        goto InterpretCommand_Usage;
+                    }
 
-                        //
-                        //  We do not expect the user to provide a parm that
-                        //  causes buffer to overflow.
-                        //
+                    parmIndex += terms;
 
-                        goto InterpretCommand_Usage; 
-                    }
+                    setSubscription(subscription, subscriptionLength);
 
-                    setProtectionFolder(buffer);
+                    HeapFree( GetProcessHeap(), 0, subscription );
                 }
                 break;
 
-            case 'g':
-            case 'G':
+            case 'x':
+            case 'X':
                 //
-                //  get Protection folder.
-                //    
-                getProtectionFolder();
-                
+                //  show how many records the filter lost and why.
+                //
+                getLossStats();
+
                 break;
 
-            case 'e':
-            case 'E':
+            case 'm':
+            case 'M':
                 {
                     //
-                    //  set Protection folder.
+                    //  protect by extension, within the protected folders
+                    //  (and), besides them (or), or not at all (off).
                     //
-                    parmIndex++;
 
-                    if (parmIndex >= argc) {
+                    WCHAR extensions[EXTENSION_MAX * (EXTENSION_MAX_CHARS + 2) + 1];
+                    ULONG used = 0;
+                    LONG mode;
+                    int length;
 
-                        //
-                        // Not enough parameters
-                        //
+                    if (parmIndex + 1 >= argc) {
 
                         goto InterpretCommand_Usage;
                     }
 
-                    parm = argv[parmIndex];
+                    parm = argv[++parmIndex];
 
-                    printf( " Setting Proccess Name: %s to accesss then protction floder.\n ", parm );
+                    if (!_stricmp( parm, "and" )) {
 
-                    bufferLength = MultiByteToWideChar( CP_ACP,
-                                                        MB_ERR_INVALID_CHARS,
-                                                        parm,
-                                                        -1,
-                                                        (LPWSTR)buffer,
-                                                        BUFFER_SIZE/sizeof( WCHAR ) );
+                        mode = EXTENSION_AND;
 
-                    if (bufferLength == 0) {
+                    } else if (!_stricmp( parm, "or" )) {
+
+                        mode = EXTENSION_OR;
+
+                    } else if (!_stricmp( parm, "off" )) {
+
+                        mode = EXTENSION_OFF;
+
+                    } else {
+
+                        goto InterpretCommand_Usage;
+                    }
+
+                    while (parmIndex + 1 < argc && argv[parmIndex + 1][0] != '/') {
+
+                        parm = argv[++parmIndex];
+
+                        length = MultiByteToWideChar( CP_ACP,
+                                                      MB_ERR_INVALID_CHARS,
+                                                      parm,
+                                                      -1,
+                                                      &extensions[used],
+                                                      (int)(sizeof( extensions )/sizeof( WCHAR ) - used - 1) );
+
+                        if (length == 0) {
+
+                            goto InterpretCommand_Usage;
+                        }
 
                         //
-                        //  We do not expect the user to provide a parm that
-                        //  causes buffer to overflow.
+                        //  One to a line, the terminator becoming the
+                        //  newline.
                         //
 
-                        goto InterpretCommand_Usage; 
+                        used += length;
+                        extensions[used - 1] = L'\n';
                     }
 
-                    setOpenProcess(buffer);
-                }
+                    extensions[used] = UNICODE_NULL;
 
+                    setExtensions( mode, extensions );
+                }
                 break;
 
             default:
@@ -1110,7 +2190,22 @@ InterpretCommand_Usage:
            "    [/f [<file name>]] turns on and off logging to the specified file\n"
            "    [/e <proccess>] set proccess to access the protection folder.\n"
            "    [/g] get the protection floder. \n"
-           "    [/s <dirname>] set protection floder"
+           "    [/s <dirname>] set protection floder\n"
+           "    [/q <floor> <ceiling>] bounds the number of records the filter may buffer\n"
+           "    [/x] shows how many records the filter could not deliver and why\n"
+           "    [/m <and|or|off> [<ext> ...]] protects files of these extensions in the protected folders (and) or anywhere as well (or), off leaves the folders alone to decide\n"
+           "    [/o [<rule file>]] sets the policy rules, which decide before the protected folders, /o alone clears them; see mspyRules.c for the format\n"
+           "    [/u [op:<name>] [disp:<DdRW->] [path:<prefix>] [proc:<image>] ...] only logs matching operations, /u alone logs all\n"
+           "    [/b <renames> <deletes> <overwrites> [<window ms>] [block]] alerts on a process making that many changes to protected folders in the window, 0 turns a kind off, block also denies it any more\n"
+           "    [/k <ms>] holds records up to <ms> to print them in time order, 0 prints them as they arrive\n"
+           "    [/w [<dir> [<segment MB> [<commit ms> [<rotate minutes>]]]]] writes the records to log segments in <dir>, /w alone stops\n"
+           "    [/t <proc|user|path|disp> [disp:<-DdRWA>] [last:<minutes>] [top:<n>]] lists the busiest keys, up to a day back\n"
+           "    [/c <proc|user|path> [disp:<-DdRWA>] [last:<minutes>]] estimates how many distinct keys there were\n"
+           "    [/y <dir> [office|build|churn] [files:<n>] [threads:<n>] [size:<KB>]] runs a workload in <dir> and reports what each operation cost\n"
+           "    [/i <dir> ...] searches the log written by /w, given first on the command line, /i alone for details\n"
+           "    [/z [<file>]] captures the batches from the filter to <file>, /z alone stops\n"
+           "    [/v <file> ...] plays back a capture made with /z, given first on the command line, /v alone for details\n"
+           "    [/r <id>] acknowledges records as subscriber <id>, a later run with the same <id> resumes where this one stopped\n"
            "  If you are in command mode:\n"
            "    [enter] will enter command mode\n"
            "    [go] will exit command mode\n"
@@ -0,0 +1,726 @@
+/*++
+
+Module Name:
+
+    mspyWriter.c
+
+Abstract:
+
+    This module writes the records minispy receives to a log on disk, as
+    the LOG_RECORD structures the filter sent rather than as text, so
+    that nothing is lost in formatting and a crash loses as little as
+    possible.
+
+    The log is a series of segment files in one directory, each with an
+    index beside it, see mspyIndex.c.  Each segment
+    is preallocated to its full size when it is opened and written
+    through the cache, in blocks padded to a sector multiple, so a
+    completed write is on disk and no write has to extend the file.
+    Records are gathered into a block and committed together once the
+    oldest of them has waited CommitInterval milliseconds or the block is
+    full: the cost of going to disk is shared by every record received
+    in that time, and no record waits longer than that for it.
+
+    Each block carries the CRC-32 of its records, so a block that was
+    only partly written when the system went down is recognised as the
+    end of the log.  A segment is closed and trimmed to what was written
+    once the next block does not fit or it has been open RotateInterval
+    milliseconds, and the next one is opened.
+
+    The files, clocks and lock come from mspyFile.c, so the writer runs,
+    and can be measured, on Windows and on POSIX systems alike.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mspyWriter.h"
+
+//
+//  CRC-32 (IEEE 802.3, reflected), filled in on first use.
+//
+
+static ULONG LogCrcTable[256];
+
+//---------------------------------------------------------------------------
+//                    Internal routines
+//---------------------------------------------------------------------------
+
+static
+ULONG
+LogWriterNextSegment (
+    __in PCSTR Directory
+    )
+/*++
+
+Routine Description:
+
+    Finds the number to give the first segment of a run: one past the
+    highest numbered segment already in the directory.
+
+Arguments:
+
+    Directory - where the segments go
+
+Return Value:
+
+    The segment number.
+
+--*/
+{
+    PULONG numbers;
+    ULONG count;
+    ULONG next = 0;
+
+    count = LogFileList( Directory, LOG_SEGMENT_PREFIX, LOG_SEGMENT_SUFFIX, &numbers );
+
+    if (count != 0) {
+
+        next = numbers[count - 1] + 1;
+    }
+
+    free( numbers );
+
+    return next;
+}
+
+static
+VOID
+LogWriterCloseSegment (
+    __inout PLOG_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    Closes the current segment, giving back the space preallocated past
+    the last block.
+
+Arguments:
+
+    Writer - the writer, with its lock held
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Writer->Segment == LOG_NO_FILE) {
+
+        return;
+    }
+
+    LogFileTrim( Writer->Segment, Writer->SegmentUsed );
+    LogFileClose( Writer->Segment );
+    Writer->Segment = LOG_NO_FILE;
+
+    if (Writer->Index != LOG_NO_FILE) {
+
+        LogFileClose( Writer->Index );
+        Writer->Index = LOG_NO_FILE;
+    }
+}
+
+static
+ULONG
+LogWriterOpenSegment (
+    __inout PLOG_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    Creates the next segment and preallocates it, and creates its index.
+    The index is only an aid to queries, so the segment is written
+    without it if it cannot be created.
+
+Arguments:
+
+    Writer - the writer, with its lock held and no segment open
+
+Return Value:
+
+    ERROR_SUCCESS or the error that stopped it.
+
+--*/
+{
+    LOG_FILE segment;
+    ULONG result;
+
+    result = LogFileOpen( Writer->Directory,
+                          LOG_SEGMENT_PREFIX,
+                          Writer->SegmentNumber,
+                          LOG_SEGMENT_SUFFIX,
+                          LogFileModeSegment,
+                          Writer->SegmentSize,
+                          &segment );
+
+    if (result != ERROR_SUCCESS) {
+
+        return result;
+    }
+
+    LogFileOpen( Writer->Directory,
+                 LOG_SEGMENT_PREFIX,
+                 Writer->SegmentNumber,
+                 LOG_INDEX_SUFFIX,
+                 LogFileModeIndex,
+                 0,
+                 &Writer->Index );
+
+    Writer->Segment = segment;
+    Writer->SegmentUsed = 0;
+    Writer->SegmentOpened = LogClockMilliseconds();
+    Writer->SegmentNumber++;
+    Writer->Segments++;
+
+    return ERROR_SUCCESS;
+}
+
+static
+BOOLEAN
+LogWriterCommit (
+    __inout PLOG_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    Writes the block being filled, moving on to the next segment first if
+    the block does not fit or the segment is due to be closed.  When the
+    write fails the writer stops and keeps the error in LastError.
+
+Arguments:
+
+    Writer - the writer, with its lock held and a segment open
+
+Return Value:
+
+    FALSE if the writer stopped.
+
+--*/
+{
+    PLOG_BLOCK_HEADER header = (PLOG_BLOCK_HEADER)Writer->Buffer;
+    ULONGLONG start;
+    ULONGLONG took;
+    ULONG length;
+
+    if (Writer->Pending == 0) {
+
+        return TRUE;
+    }
+
+    length = sizeof( LOG_BLOCK_HEADER ) + Writer->Pending;
+    memset( Writer->Buffer + length, 0, ROUND_TO_SIZE( length, LOG_WRITER_ALIGN ) - length );
+    length = ROUND_TO_SIZE( length, LOG_WRITER_ALIGN );
+
+    if (Writer->SegmentUsed + length > Writer->SegmentSize ||
+        (Writer->RotateInterval != 0 &&
+         LogClockMilliseconds() - Writer->SegmentOpened >= Writer->RotateInterval)) {
+
+        LogWriterCloseSegment( Writer );
+        Writer->LastError = LogWriterOpenSegment( Writer );
+
+        if (Writer->LastError != ERROR_SUCCESS) {
+
+            Writer->Pending = 0;
+            Writer->PendingRecords = 0;
+            return FALSE;
+        }
+    }
+
+    header->Signature = LOG_BLOCK_SIGNATURE;
+    header->Length = Writer->Pending;
+    header->Records = Writer->PendingRecords;
+    header->Checksum = LogWriterChecksum( header + 1, Writer->Pending );
+    header->Block = Writer->NextBlock;
+    LogClockSystemTime( &header->Time );
+
+    start = LogClockMicroseconds();
+
+    Writer->LastError = LogFileWrite( Writer->Segment, Writer->Buffer, length );
+
+    if (Writer->LastError != ERROR_SUCCESS) {
+
+        Writer->Pending = 0;
+        Writer->PendingRecords = 0;
+        LogWriterCloseSegment( Writer );
+        return FALSE;
+    }
+
+    took = LogClockMicroseconds() - start;
+
+    //
+    //  The index entry goes out after its block, so it never describes a
+    //  block that is not there.
+    //
+
+    if (Writer->Index != LOG_NO_FILE) {
+
+        LogIndexFinish( &Writer->Entry, Writer->NextBlock, Writer->SegmentUsed, length );
+
+        if (LogFileWrite( Writer->Index, &Writer->Entry, sizeof( LOG_INDEX_ENTRY ) ) != ERROR_SUCCESS) {
+
+            LogFileClose( Writer->Index );
+            Writer->Index = LOG_NO_FILE;
+        }
+    }
+
+    Writer->CommitTime += took;
+
+    if (took > Writer->CommitTimeMax) {
+
+        Writer->CommitTimeMax = took;
+    }
+
+    Writer->SegmentUsed += length;
+    Writer->BytesWritten += length;
+    Writer->RecordsWritten += Writer->PendingRecords;
+    Writer->Commits++;
+    Writer->NextBlock++;
+
+    Writer->Pending = 0;
+    Writer->PendingRecords = 0;
+
+    return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//                    Routines
+//---------------------------------------------------------------------------
+
+BOOLEAN
+LogWriterInitialize (
+    __out PLOG_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    Sets up a stopped writer.
+
+Arguments:
+
+    Writer - the writer to set up
+
+Return Value:
+
+    FALSE if there was no memory for the block buffer.
+
+--*/
+{
+    memset( Writer, 0, sizeof( LOG_WRITER ) );
+    Writer->Segment = LOG_NO_FILE;
+    Writer->Index = LOG_NO_FILE;
+
+    //
+    //  Unbuffered writes must come from sector aligned memory.
+    //
+
+    Writer->Buffer = LogFileAllocate( LOG_WRITER_BUFFER );
+
+    if (Writer->Buffer == NULL) {
+
+        return FALSE;
+    }
+
+    LogLockInitialize( &Writer->Lock );
+
+    return TRUE;
+}
+
+VOID
+LogWriterCleanup (
+    __inout PLOG_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    Stops the writer and frees what it holds.
+
+Arguments:
+
+    Writer - the writer
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Writer->Buffer == NULL) {
+
+        return;
+    }
+
+    LogWriterStop( Writer );
+
+    LogLockDelete( &Writer->Lock );
+    LogFileFree( Writer->Buffer );
+    Writer->Buffer = NULL;
+}
+
+ULONG
+LogWriterStart (
+    __inout PLOG_WRITER Writer,
+    __in PCSTR Directory,
+    __in ULONG SegmentSize,
+    __in ULONG CommitInterval,
+    __in ULONG RotateInterval
+    )
+/*++
+
+Routine Description:
+
+    Starts writing to a new segment in Directory, stopping first if the
+    writer is already running.
+
+Arguments:
+
+    Writer - the writer
+    Directory - where the segments go
+    SegmentSize - the size of a segment in MB
+    CommitInterval - how long in milliseconds a record may wait to be
+        committed, 0 to commit every batch as it arrives
+    RotateInterval - how long in milliseconds a segment is written to
+        before the next one is opened, 0 to only move on when it is full
+
+Return Value:
+
+    ERROR_SUCCESS or the error that stopped it.
+
+--*/
+{
+    ULONG result;
+
+    LogWriterStop( Writer );
+
+    LogLockAcquire( &Writer->Lock );
+
+    if (strlen( Directory ) >= LOG_FILE_PATH) {
+
+        LogLockRelease( &Writer->Lock );
+        return LOG_FILE_NAME_TOO_LONG;
+    }
+
+    strcpy( Writer->Directory, Directory );
+
+    Writer->SegmentSize = ROUND_TO_SIZE( (ULONGLONG)SegmentSize * 1024 * 1024, LOG_WRITER_ALIGN );
+
+    if (Writer->SegmentSize < LOG_WRITER_MIN_SEGMENT) {
+
+        Writer->SegmentSize = LOG_WRITER_MIN_SEGMENT;
+    }
+
+    Writer->CommitInterval = CommitInterval;
+    Writer->RotateInterval = RotateInterval;
+    Writer->SegmentNumber = LogWriterNextSegment( Directory );
+
+    Writer->Pending = 0;
+    Writer->PendingRecords = 0;
+    Writer->NextBlock = 0;
+
+    Writer->Started = LogClockMilliseconds();
+    Writer->BytesWritten = 0;
+    Writer->RecordsWritten = 0;
+    Writer->Commits = 0;
+    Writer->Segments = 0;
+    Writer->CommitTime = 0;
+    Writer->CommitTimeMax = 0;
+
+    result = LogWriterOpenSegment( Writer );
+    Writer->LastError = result;
+
+    LogLockRelease( &Writer->Lock );
+
+    return result;
+}
+
+VOID
+LogWriterStop (
+    __inout PLOG_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    Commits what is pending and closes the current segment.
+
+Arguments:
+
+    Writer - the writer
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LogLockAcquire( &Writer->Lock );
+
+    if (Writer->Segment != LOG_NO_FILE) {
+
+        LogWriterCommit( Writer );
+        LogWriterCloseSegment( Writer );
+    }
+
+    LogLockRelease( &Writer->Lock );
+}
+
+BOOLEAN
+LogWriterAppend (
+    __inout PLOG_WRITER Writer,
+    __in_bcount(Length) CONST VOID *Records,
+    __in ULONG Length,
+    __in ULONG RecordCount
+    )
+/*++
+
+Routine Description:
+
+    Adds a batch of records to the block being filled, committing the
+    block first if the batch does not fit and afterwards if it is due.
+    Nothing is done while the writer is stopped.
+
+Arguments:
+
+    Writer - the writer
+    Records - the LOG_RECORD structures, one after another
+    Length - their size in bytes, at most BUFFER_SIZE
+    RecordCount - how many there are
+
+Return Value:
+
+    FALSE if the writer stopped on an error, see LastError.
+
+--*/
+{
+    BOOLEAN running = TRUE;
+
+    LogLockAcquire( &Writer->Lock );
+
+    if (Writer->Segment == LOG_NO_FILE || Length == 0) {
+
+        LogLockRelease( &Writer->Lock );
+        return TRUE;
+    }
+
+    if (sizeof( LOG_BLOCK_HEADER ) + Writer->Pending + Length > LOG_WRITER_BUFFER) {
+
+        running = LogWriterCommit( Writer );
+    }
+
+    if (running) {
+
+        if (Writer->Pending == 0) {
+
+            Writer->PendingSince = LogClockMilliseconds();
+            LogIndexStart( &Writer->Entry );
+        }
+
+        memcpy( Writer->Buffer + sizeof( LOG_BLOCK_HEADER ) + Writer->Pending,
+                Records,
+                Length );
+
+        LogIndexAddRecords( &Writer->Entry, Records, Length );
+
+        Writer->Pending += Length;
+        Writer->PendingRecords += RecordCount;
+
+        if (LogClockMilliseconds() - Writer->PendingSince >= Writer->CommitInterval) {
+
+            running = LogWriterCommit( Writer );
+        }
+    }
+
+    LogLockRelease( &Writer->Lock );
+
+    return running;
+}
+
+BOOLEAN
+LogWriterTick (
+    __inout PLOG_WRITER Writer,
+    __in BOOLEAN Force
+    )
+/*++
+
+Routine Description:
+
+    Commits the block being filled if it is due, for when no records are
+    arriving to trigger it.
+
+Arguments:
+
+    Writer - the writer
+    Force - TRUE to commit the block whether or not it is due
+
+Return Value:
+
+    FALSE if the writer stopped on an error, see LastError.
+
+--*/
+{
+    BOOLEAN running = TRUE;
+
+    LogLockAcquire( &Writer->Lock );
+
+    if (Writer->Segment != LOG_NO_FILE &&
+        Writer->Pending != 0 &&
+        (Force || LogClockMilliseconds() - Writer->PendingSince >= Writer->CommitInterval)) {
+
+        running = LogWriterCommit( Writer );
+    }
+
+    LogLockRelease( &Writer->Lock );
+
+    return running;
+}
+
+BOOLEAN
+LogWriterPending (
+    __in PLOG_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    Tells whether records were appended that are not on disk yet.
+
+Arguments:
+
+    Writer - the writer
+
+Return Value:
+
+    TRUE if some records are waiting to be committed.
+
+--*/
+{
+    BOOLEAN pending;
+
+    LogLockAcquire( &Writer->Lock );
+    pending = (BOOLEAN)(Writer->Pending != 0);
+    LogLockRelease( &Writer->Lock );
+
+    return pending;
+}
+
+VOID
+LogWriterReport (
+    __in PLOG_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    Prints how much the writer wrote since it was started and what its
+    commits cost.
+
+Arguments:
+
+    Writer - the writer
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG elapsed;
+
+    LogLockAcquire( &Writer->Lock );
+
+    elapsed = LogClockMilliseconds() - Writer->Started;
+
+    printf( "    %llu records in %lu blocks and %lu segments, %llu KB",
+            (unsigned long long)Writer->RecordsWritten,
+            (unsigned long)Writer->Commits,
+            (unsigned long)Writer->Segments,
+            (unsigned long long)(Writer->BytesWritten / 1024) );
+
+    if (elapsed != 0) {
+
+        printf( " (%llu KB/s)", (unsigned long long)(Writer->BytesWritten * 1000 / 1024 / elapsed) );
+    }
+
+    printf( "\n" );
+
+    if (Writer->Commits != 0) {
+
+        printf( "    commit takes %llu us on average, %llu us at most\n",
+                (unsigned long long)(Writer->CommitTime / Writer->Commits),
+                (unsigned long long)Writer->CommitTimeMax );
+    }
+
+    if (Writer->LastError != ERROR_SUCCESS) {
+
+        printf( "    stopped on error %lu\n", (unsigned long)Writer->LastError );
+    }
+
+    LogLockRelease( &Writer->Lock );
+}
+
+ULONG
+LogWriterChecksum (
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Computes the CRC-32 of a buffer.
+
+Arguments:
+
+    Buffer - the bytes to check
+    Length - how many there are
+
+Return Value:
+
+    The CRC-32.
+
+--*/
+{
+    CONST UCHAR *next = Buffer;
+    ULONG crc;
+    ULONG i;
+    ULONG bit;
+
+    //
+    //  Building the table twice at once does no harm, so it is not
+    //  locked.  Entry 1 is filled in last and says the table is ready.
+    //
+
+    if (LogCrcTable[1] == 0) {
+
+        for (i = 255; i != 0; i--) {
+
+            crc = i;
+
+            for (bit = 0; bit < 8; bit++) {
+
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+            }
+
+            LogCrcTable[i] = crc;
+        }
+    }
+
+    crc = 0xFFFFFFFF;
+
+    while (Length-- != 0) {
+
+        crc = LogCrcTable[(crc ^ *next++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,212 @@
+/*++
+
+Module Name:
+
+    mspyWriter.h
+
+Abstract:
+
+    This module contains the structures and prototypes of the segmented
+    log writer, which keeps the records minispy receives on disk exactly
+    as the filter sent them.  See mspyWriter.c.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYWRITER_H__
+#define __MSPYWRITER_H__
+
+#include "mspyTypes.h"
+#include "miniSpy.h"
+#include "mspyFile.h"
+#include "mspyIndex.h"
+
+//
+//  Blocks start on, and are padded to, this boundary so every write the
+//  writer makes is sector aligned.  The block buffer holds the largest
+//  block the writer makes.
+//
+
+#define LOG_WRITER_ALIGN            4096
+#define LOG_WRITER_BUFFER           (1024 * 1024)
+
+//
+//  Defaults for /w.  Segments are never smaller than
+//  LOG_WRITER_MIN_SEGMENT, so any block fits in an empty one.
+//
+
+#define LOG_WRITER_DEFAULT_SEGMENT  64          //  MB
+#define LOG_WRITER_DEFAULT_COMMIT   100         //  ms
+#define LOG_WRITER_MIN_SEGMENT      (4 * LOG_WRITER_BUFFER)
+
+//
+//  Segment files are named LOG_SEGMENT_PREFIX followed by their number
+//  in eight decimal digits and LOG_SEGMENT_SUFFIX.  Numbers only go up,
+//  across runs as well.
+//
+
+#define LOG_SEGMENT_PREFIX          "minispy-"
+#define LOG_SEGMENT_SUFFIX          ".log"
+
+//
+//  Every block starts with this header, followed by Length bytes of
+//  LOG_RECORD structures just as GetMiniSpyLog returned them, followed
+//  by zeroes up to the next LOG_WRITER_ALIGN boundary.
+//
+//  A segment is preallocated and its unused tail reads as zeroes, so a
+//  reader walks the blocks until it finds one whose Signature or
+//  Checksum is wrong: that is where the log ends, whether the segment
+//  was closed normally or the writer stopped in the middle of a block.
+//
+
+#define LOG_BLOCK_SIGNATURE         'BLSM'
+
+typedef struct _LOG_BLOCK_HEADER {
+
+    ULONG Signature;
+
+    //
+    //  Bytes of records after the header, how many records they hold and
+    //  their CRC-32, see LogWriterChecksum.
+    //
+
+    ULONG Length;
+    ULONG Records;
+    ULONG Checksum;
+
+    //
+    //  Blocks are numbered from 0 across all the segments of one run, so
+    //  a missing segment shows.  Time is when the block was committed.
+    //
+
+    ULONGLONG Block;
+    LARGE_INTEGER Time;
+
+} LOG_BLOCK_HEADER, *PLOG_BLOCK_HEADER;
+
+typedef struct _LOG_WRITER {
+
+    //
+    //  The log thread appends while the command prompt starts and stops
+    //  the writer.
+    //
+
+    LOG_LOCK Lock;
+
+    //
+    //  The segment being written, LOG_NO_FILE when the writer is
+    //  stopped, and where the next block goes in it.  Index is the
+    //  segment's index, LOG_NO_FILE if it could not be created.
+    //
+
+    LOG_FILE Segment;
+    LOG_FILE Index;
+    ULONG SegmentNumber;
+    ULONGLONG SegmentSize;
+    ULONGLONG SegmentUsed;
+    ULONG SegmentOpened;
+
+    CHAR Directory[LOG_FILE_PATH];
+
+    //
+    //  Records are committed once the oldest of them has waited
+    //  CommitInterval milliseconds or the block is full.  A segment is
+    //  closed once it is full or RotateInterval milliseconds old, 0 for
+    //  never.
+    //
+
+    ULONG CommitInterval;
+    ULONG RotateInterval;
+
+    //
+    //  The block being filled: a LOG_BLOCK_HEADER and Pending bytes of
+    //  records received since PendingSince.
+    //
+
+    PUCHAR Buffer;
+    ULONG Pending;
+    ULONG PendingRecords;
+    ULONG PendingSince;
+
+    LOG_INDEX_ENTRY Entry;
+
+    ULONGLONG NextBlock;
+
+    //
+    //  Since the writer was started.  CommitTime is the time spent in
+    //  commits, in microseconds.
+    //
+
+    ULONG Started;
+    ULONGLONG BytesWritten;
+    ULONGLONG RecordsWritten;
+    ULONG Commits;
+    ULONG Segments;
+    ULONGLONG CommitTime;
+    ULONGLONG CommitTimeMax;
+
+    ULONG LastError;
+
+} LOG_WRITER, *PLOG_WRITER;
+
+//
+//  Function prototypes
+//
+
+BOOLEAN
+LogWriterInitialize (
+    __out PLOG_WRITER Writer
+    );
+
+VOID
+LogWriterCleanup (
+    __inout PLOG_WRITER Writer
+    );
+
+ULONG
+LogWriterStart (
+    __inout PLOG_WRITER Writer,
+    __in PCSTR Directory,
+    __in ULONG SegmentSize,
+    __in ULONG CommitInterval,
+    __in ULONG RotateInterval
+    );
+
+VOID
+LogWriterStop (
+    __inout PLOG_WRITER Writer
+    );
+
+BOOLEAN
+LogWriterAppend (
+    __inout PLOG_WRITER Writer,
+    __in_bcount(Length) CONST VOID *Records,
+    __in ULONG Length,
+    __in ULONG RecordCount
+    );
+
+BOOLEAN
+LogWriterTick (
+    __inout PLOG_WRITER Writer,
+    __in BOOLEAN Force
+    );
+
+BOOLEAN
+LogWriterPending (
+    __in PLOG_WRITER Writer
+    );
+
+VOID
+LogWriterReport (
+    __in PLOG_WRITER Writer
+    );
+
+ULONG
+LogWriterChecksum (
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length
+    );
+
+#endif //__MSPYWRITER_H__
@@ -89,6 +89,14 @@ mainprocess()
     context.LogToScreen = FALSE;        //don't start logging yet
     context.NextLogToScreen = TRUE;
     context.OutputFile = NULL;
+    SequenceReset( &context.Sequence );
+    context.MergeWindow = 0;
+    context.SubscriberId = 0;
+    context.Writer = NULL;
+    context.Sketch = NULL;
+    context.RecordsReceived = 0;
+    context.Capture = NULL;
+    ZeroMemory( context.Committed, sizeof( context.Committed ) );
     context.LogToScreen = context.NextLogToScreen;
 
     context.CleaningUp = FALSE;  
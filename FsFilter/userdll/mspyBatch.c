@@ -0,0 +1,340 @@
+/*++
+
+Module Name:
+
+    mspyBatch.c
+
+Abstract:
+
+    This module implements the batch oriented record interface exported by
+    MINISPY.DLL: a push callback that receives one decoded batch per poll,
+    and a pull interface (GetRecordBatch / ReleaseRecordBatch) for callers
+    that prefer to poll on their own schedule.
+
+    The batches are decoded by mspyDecode.c; this module fetches the
+    records from the filter and lends the decoder the Win32 routines it
+    needs.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <DriverSpecs.h>
+__user_code
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <windows.h>
+#include "mspyLog.h"
+#include "mspyBatch.h"
+
+#ifdef __DLL_EXPORT__
+
+//
+//  Batch push callback state.
+//
+
+RetrieveLogBatchCallback g_RetrieveLogBatchCallback = NULL;
+PVOID g_RetrieveLogBatchContext = NULL;
+ULONG g_RetrieveLogBatchFields = MSPY_FIELD_ALL;
+MSPY_ENCODING g_RetrieveLogBatchEncoding = MspyEncodingUtf8;
+
+//
+//  The batch handed to the push callback is reused across polls so its
+//  buffers are only ever grown, never reallocated per call.
+//
+
+MSPY_BATCH g_DispatchBatch;
+
+
+static ULONG
+MspyFormatTime (
+    __in CONST LARGE_INTEGER *Time,
+    __out_bcount(BufferLength) CHAR *Buffer,
+    __in ULONG BufferLength
+    )
+/*++
+
+Routine Description:
+
+    Formats a record time as the screen dump does, in local time.
+
+Return Value:
+
+    The length of the string returned in Buffer.
+
+--*/
+{
+    FILETIME localTime;
+    SYSTEMTIME systemTime;
+
+    FileTimeToLocalFileTime( (FILETIME *) Time, &localTime );
+    FileTimeToSystemTime( &localTime, &systemTime );
+
+    return FormatSystemTime( &systemTime, Buffer, BufferLength );
+}
+
+static ULONG
+MspyNarrow (
+    __in_ecount(Count) CONST WCHAR *Source,
+    __in ULONG Count,
+    __out_bcount(DestLength) PUCHAR Dest,
+    __in ULONG DestLength
+    )
+/*++
+
+Routine Description:
+
+    Converts to the ANSI code page for MspyEncodingAnsi.
+
+Return Value:
+
+    Number of bytes written.
+
+--*/
+{
+    return (ULONG) WideCharToMultiByte( CP_ACP,
+                                        0,
+                                        Source,
+                                        (int) Count,
+                                        (LPSTR) Dest,
+                                        (int) DestLength,
+                                        NULL,
+                                        NULL );
+}
+
+//
+//  What the decoder needs of Win32.
+//
+
+static CONST MSPY_DECODE_HOOKS MspyWin32Hooks = {
+
+    TranslateFileTag,
+    MspyFormatTime,
+    MspyNarrow
+};
+
+BOOLEAN
+MspyBatchCallbackRegistered (
+    VOID
+    )
+{
+    return (BOOLEAN) (g_RetrieveLogBatchCallback != NULL);
+}
+
+HRESULT
+MspyDispatchBatch (
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Decodes one GetMiniSpyLog reply and hands it to the registered batch
+    callback with a single call.  As with the per-record callback, a
+    callback that faults is unregistered.
+
+Arguments:
+
+    Buffer - the raw records.
+    Length - number of valid bytes in Buffer.
+
+Return Value:
+
+    The callback's result, S_FALSE if no callback is registered or the
+    batch is empty, or a decode error.
+
+--*/
+{
+    RetrieveLogBatchCallback callback = g_RetrieveLogBatchCallback;
+    HRESULT hResult;
+
+    if (callback == NULL) {
+
+        return S_FALSE;
+    }
+
+    if (!MspyDecodeBatch( Buffer,
+                          Length,
+                          g_RetrieveLogBatchFields,
+                          g_RetrieveLogBatchEncoding,
+                          &MspyWin32Hooks,
+                          &g_DispatchBatch )) {
+
+        return E_OUTOFMEMORY;
+    }
+
+    if (g_DispatchBatch.Count == 0) {
+
+        return S_FALSE;
+    }
+
+    __try {
+
+        hResult = (*callback)( &g_DispatchBatch, g_RetrieveLogBatchContext );
+
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+
+        g_RetrieveLogBatchCallback = NULL;
+        hResult = E_FAIL;
+    }
+
+    return hResult;
+}
+
+HRESULT
+SetGetRecBatchCb (
+    __in_opt RetrieveLogBatchCallback Callback,
+    __in_opt PVOID Context,
+    __in ULONG Fields,
+    __in MSPY_ENCODING Encoding
+    )
+/*++
+
+Routine Description:
+
+    Registers (or, with a NULL Callback, removes) the batch callback that
+    GetRecords calls once per poll.  It is called in addition to any
+    per-record callback registered with SetGetRecCb.
+
+Arguments:
+
+    Callback - the callback.
+    Context - passed back to the callback unchanged.
+    Fields - MSPY_FIELD_* mask of the strings to decode.
+    Encoding - encoding of the decoded strings.
+
+Return Value:
+
+    S_OK, or E_INVALIDARG for an unknown encoding.
+
+--*/
+{
+    if (Encoding > MspyEncodingAnsi) {
+
+        return E_INVALIDARG;
+    }
+
+    g_RetrieveLogBatchCallback = NULL;
+    g_RetrieveLogBatchContext = Context;
+    g_RetrieveLogBatchFields = Fields;
+    g_RetrieveLogBatchEncoding = Encoding;
+    g_RetrieveLogBatchCallback = Callback;
+
+    if (Callback == NULL) {
+
+        MspyResetBatch( &g_DispatchBatch );
+    }
+
+    return S_OK;
+}
+
+HRESULT
+GetRecordBatch (
+    __in ULONG Fields,
+    __in MSPY_ENCODING Encoding,
+    __deref_out PMSPY_BATCH *Batch
+    )
+/*++
+
+Routine Description:
+
+    Pull interface: fetches whatever records the filter currently has
+    buffered and returns them as one batch.  The batch must be released
+    with ReleaseRecordBatch.  Callers should use either this or GetRecords,
+    not both, since each drains the same queue.
+
+Arguments:
+
+    Fields - MSPY_FIELD_* mask of the strings to decode.
+    Encoding - encoding of the decoded strings.
+    Batch - receives the batch.  It is empty when nothing was pending.
+
+Return Value:
+
+    S_OK, or the error from the filter or decoder.
+
+--*/
+{
+    PVOID alignedBuffer[BUFFER_SIZE/sizeof( PVOID )];
+    COMMAND_MESSAGE commandMessage;
+    DWORD bytesReturned = 0;
+    PMSPY_BATCH batch;
+    HRESULT hResult;
+
+    *Batch = NULL;
+
+    if (Encoding > MspyEncodingAnsi) {
+
+        return E_INVALIDARG;
+    }
+
+    batch = calloc( 1, sizeof(MSPY_BATCH) );
+
+    if (batch == NULL) {
+
+        return E_OUTOFMEMORY;
+    }
+
+    commandMessage.Command = GetMiniSpyLog;
+    commandMessage.Reserved = 0;
+
+    hResult = FilterSendMessage( gport,
+                                 &commandMessage,
+                                 sizeof( COMMAND_MESSAGE ),
+                                 alignedBuffer,
+                                 sizeof(alignedBuffer),
+                                 &bytesReturned );
+
+    if (hResult == HRESULT_FROM_WIN32( ERROR_NO_MORE_ITEMS )) {
+
+        bytesReturned = 0;
+        hResult = S_OK;
+    }
+
+    if (!IS_ERROR( hResult )) {
+
+        batch->Fields = Fields;
+        batch->Encoding = Encoding;
+
+        if (!MspyDecodeBatch( alignedBuffer, bytesReturned, Fields, Encoding, &MspyWin32Hooks, batch )) {
+
+            hResult = E_OUTOFMEMORY;
+        }
+    }
+
+    if (IS_ERROR( hResult )) {
+
+        ReleaseRecordBatch( batch );
+        return hResult;
+    }
+
+    *Batch = batch;
+    return S_OK;
+}
+
+VOID
+ReleaseRecordBatch (
+    __in_opt PMSPY_BATCH Batch
+    )
+/*++
+
+Routine Description:
+
+    Releases a batch returned by GetRecordBatch and every view in it.
+
+--*/
+{
+    if (Batch == NULL) {
+
+        return;
+    }
+
+    MspyResetBatch( Batch );
+    free( Batch );
+}
+
+#endif // __DLL_EXPORT__
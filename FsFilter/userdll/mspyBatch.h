@@ -0,0 +1,68 @@
+/*++
+
+Module Name:
+
+    mspyBatch.h
+
+Abstract:
+
+    This module contains the structures and prototypes for the batch
+    oriented record interface exported by MINISPY.DLL.
+
+    The batches themselves, and how a reply is decoded into one, are in
+    mspyDecode.h, which does not need Win32.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYBATCH_H__
+#define __MSPYBATCH_H__
+
+#include "mspyDecode.h"
+
+//
+//  Batch callback.  The batch and every view in it are only valid for the
+//  duration of the call.
+//
+
+typedef HRESULT (*RetrieveLogBatchCallback)(CONST MSPY_BATCH *Batch, PVOID Context);
+
+//
+//  Function prototypes
+//
+
+HRESULT
+MspyDispatchBatch (
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length
+    );
+
+BOOLEAN
+MspyBatchCallbackRegistered (
+    VOID
+    );
+
+HRESULT
+SetGetRecBatchCb (
+    __in_opt RetrieveLogBatchCallback Callback,
+    __in_opt PVOID Context,
+    __in ULONG Fields,
+    __in MSPY_ENCODING Encoding
+    );
+
+HRESULT
+GetRecordBatch (
+    __in ULONG Fields,
+    __in MSPY_ENCODING Encoding,
+    __deref_out PMSPY_BATCH *Batch
+    );
+
+VOID
+ReleaseRecordBatch (
+    __in_opt PMSPY_BATCH Batch
+    );
+
+#endif //__MSPYBATCH_H__
+
@@ -0,0 +1,490 @@
+/*++
+
+Module Name:
+
+    mspyDecode.c
+
+Abstract:
+
+    This module decodes a buffer of packed LOG_RECORDs into a batch, see
+    mspyDecode.h.
+
+    Decoding a batch costs one copy of the raw reply plus, for the narrow
+    encodings, one pass of transcoding into a single arena that is sized
+    up front.  No per-record or per-field buffers are allocated.
+
+    Nothing here depends on Win32; mspyBatch.c supplies the hooks for
+    what does.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "mspyDecode.h"
+
+//
+//  Number of NULL terminated strings a single record can put in the arena.
+//
+
+#define MSPY_STRINGS_PER_RECORD 4
+
+
+static BOOLEAN
+MspyReserve (
+    __inout PUCHAR *Buffer,
+    __inout PULONG Size,
+    __in ULONG Needed
+    )
+/*++
+
+Routine Description:
+
+    Grows a decoder owned buffer to at least Needed bytes.  The old contents
+    are not preserved.
+
+Return Value:
+
+    TRUE if the buffer is large enough, FALSE on allocation failure.
+
+--*/
+{
+    PUCHAR newBuffer;
+
+    if (*Size >= Needed) {
+
+        return TRUE;
+    }
+
+    newBuffer = malloc( Needed );
+
+    if (newBuffer == NULL) {
+
+        return FALSE;
+    }
+
+    free( *Buffer );
+    *Buffer = newBuffer;
+    *Size = Needed;
+
+    return TRUE;
+}
+
+static ULONG
+MspyUtf16ToUtf8 (
+    __in_ecount(Count) CONST WCHAR *Source,
+    __in ULONG Count,
+    __out PUCHAR Dest
+    )
+/*++
+
+Routine Description:
+
+    Portable UTF-16 to UTF-8 conversion.  The caller guarantees Dest has
+    room for 3 bytes per source code unit; an unpaired surrogate is encoded
+    as U+FFFD.
+
+Return Value:
+
+    Number of bytes written, not including the terminating NULL which is
+    always appended.
+
+--*/
+{
+    PUCHAR out = Dest;
+    ULONG i;
+    ULONG c;
+
+    for (i = 0; i < Count; i++) {
+
+        c = Source[i];
+
+        if (c < 0x80) {
+
+            *out++ = (UCHAR) c;
+            continue;
+        }
+
+        if (c < 0x800) {
+
+            *out++ = (UCHAR) (0xC0 | (c >> 6));
+            *out++ = (UCHAR) (0x80 | (c & 0x3F));
+            continue;
+        }
+
+        if (c >= 0xD800 && c <= 0xDBFF &&
+            i + 1 < Count &&
+            Source[i+1] >= 0xDC00 && Source[i+1] <= 0xDFFF) {
+
+            c = 0x10000 + ((c - 0xD800) << 10) + (Source[i+1] - 0xDC00);
+            i++;
+
+            *out++ = (UCHAR) (0xF0 | (c >> 18));
+            *out++ = (UCHAR) (0x80 | ((c >> 12) & 0x3F));
+            *out++ = (UCHAR) (0x80 | ((c >> 6) & 0x3F));
+            *out++ = (UCHAR) (0x80 | (c & 0x3F));
+            continue;
+        }
+
+        if (c >= 0xD800 && c <= 0xDFFF) {
+
+            c = 0xFFFD;
+        }
+
+        *out++ = (UCHAR) (0xE0 | (c >> 12));
+        *out++ = (UCHAR) (0x80 | ((c >> 6) & 0x3F));
+        *out++ = (UCHAR) (0x80 | (c & 0x3F));
+    }
+
+    *out = '\0';
+
+    return (ULONG) (out - Dest);
+}
+
+static VOID
+MspyEmitString (
+    __inout PMSPY_BATCH Batch,
+    __in_opt CONST MSPY_DECODE_HOOKS *Hooks,
+    __in_ecount(Count) CONST WCHAR *Source,
+    __in ULONG Count,
+    __out PMSPY_STRING_VIEW View
+    )
+/*++
+
+Routine Description:
+
+    Produces a view of Count UTF-16 code units in the batch encoding.
+    UTF-16 views borrow the source, the others are transcoded into the
+    arena, which MspyDecodeBatch has sized for the worst case.
+
+--*/
+{
+    PUCHAR dest;
+    ULONG length;
+
+    if (Batch->Encoding == MspyEncodingUtf16) {
+
+        View->Buffer = Source;
+        View->Length = Count * sizeof(WCHAR);
+        return;
+    }
+
+    dest = Batch->Arena + Batch->ArenaUsed;
+
+    if (Batch->Encoding == MspyEncodingAnsi &&
+        Hooks != NULL && Hooks->Narrow != NULL) {
+
+        length = 0;
+
+        if (Count > 0) {
+
+            length = Hooks->Narrow( Source, Count, dest, Count * 3 );
+        }
+
+        dest[length] = '\0';
+
+    } else {
+
+        length = MspyUtf16ToUtf8( Source, Count, dest );
+    }
+
+    View->Buffer = dest;
+    View->Length = length;
+    Batch->ArenaUsed += length + 1;
+}
+
+static CONST WCHAR *
+MspyNextLine (
+    __in CONST WCHAR *Line,
+    __in CONST WCHAR *End,
+    __out PULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Finds the end of the '\n' terminated line starting at Line.  The
+    driver pads every line to pointer alignment with spaces, so the
+    padding in front of the following line is skipped here.
+
+Return Value:
+
+    Start of the next line, or End if there is none.
+
+--*/
+{
+    CONST WCHAR *ptr = Line;
+
+    while (ptr < End && *ptr != L'\n' && *ptr != UNICODE_NULL) {
+
+        ptr++;
+    }
+
+    *Count = (ULONG) (ptr - Line);
+
+    if (ptr >= End || *ptr == UNICODE_NULL) {
+
+        return End;
+    }
+
+    ptr++;
+
+    while (ptr < End && *ptr == L' ') {
+
+        ptr++;
+    }
+
+    return ptr;
+}
+
+VOID
+MspyResetBatch (
+    __inout PMSPY_BATCH Batch
+    )
+/*++
+
+Routine Description:
+
+    Frees the buffers owned by a batch and returns it to its empty state.
+
+--*/
+{
+    free( Batch->Records );
+    free( Batch->Raw );
+    free( Batch->Arena );
+
+    memset( Batch, 0, sizeof(MSPY_BATCH) );
+}
+
+BOOLEAN
+MspyDecodeBatch (
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length,
+    __in ULONG Fields,
+    __in MSPY_ENCODING Encoding,
+    __in_opt CONST MSPY_DECODE_HOOKS *Hooks,
+    __inout PMSPY_BATCH Batch
+    )
+/*++
+
+Routine Description:
+
+    Decodes a buffer of packed LOG_RECORDs, as returned by GetMiniSpyLog,
+    into Batch.  Any records previously held by Batch are discarded; its
+    buffers are reused when they are large enough.
+
+Arguments:
+
+    Buffer - the raw records.
+    Length - number of valid bytes in Buffer.
+    Fields - MSPY_FIELD_* mask of the strings to decode.
+    Encoding - encoding of the decoded strings.
+    Hooks - what the system provides, see MSPY_DECODE_HOOKS.
+    Batch - receives the decoded records.
+
+Return Value:
+
+    FALSE if the batch buffers could not be grown.  A malformed record
+    ends the batch early, exactly as the screen and file dump stop at it.
+
+--*/
+{
+    PLOG_RECORD pLogRecord;
+    PMSPY_BATCH_RECORD record;
+    CONST WCHAR *line;
+    CONST WCHAR *end;
+    ULONG maxRecords;
+    ULONG arenaNeeded;
+    ULONG used;
+    ULONG count;
+    CHAR time[MSPY_TIME_LENGTH];
+    ULONG timeLength;
+    ULONG index;
+
+    Batch->Count = 0;
+    Batch->Fields = Fields;
+    Batch->Encoding = Encoding;
+    Batch->ArenaUsed = 0;
+
+    if (Length < FIELD_OFFSET(LOG_RECORD, Name)) {
+
+        return TRUE;
+    }
+
+    //
+    //  Size everything for the worst case up front so that no view handed
+    //  out below is invalidated by a later reallocation.
+    //
+
+    maxRecords = Length / (sizeof(LOG_RECORD) + sizeof(WCHAR)) + 1;
+
+    arenaNeeded = 0;
+
+    if (Encoding != MspyEncodingUtf16) {
+
+        arenaNeeded += (Length / sizeof(WCHAR)) * 3 +
+                       maxRecords * MSPY_STRINGS_PER_RECORD;
+    }
+
+    if (FlagOn( Fields, MSPY_FIELD_TIME_STRING )) {
+
+        arenaNeeded += maxRecords * MSPY_TIME_LENGTH * sizeof(WCHAR);
+    }
+
+    if (!MspyReserve( (PUCHAR *) &Batch->Records,
+                      &Batch->Capacity,
+                      maxRecords * sizeof(MSPY_BATCH_RECORD) ) ||
+        !MspyReserve( &Batch->Raw, &Batch->RawSize, Length ) ||
+        !MspyReserve( &Batch->Arena, &Batch->ArenaSize, arenaNeeded + 1 )) {
+
+        return FALSE;
+    }
+
+    //
+    //  The views borrow from our own copy of the reply, never from the
+    //  caller's buffer, so the caller may reuse it immediately.  The copy
+    //  is also what TranslateFileTag rewrites in place.
+    //
+
+    memcpy( Batch->Raw, Buffer, Length );
+
+    pLogRecord = (PLOG_RECORD) Batch->Raw;
+    used = 0;
+
+    for (;;) {
+
+        if (used + FIELD_OFFSET(LOG_RECORD, Name) > Length) {
+
+            break;
+        }
+
+        if (pLogRecord->Length < (sizeof(LOG_RECORD) + sizeof(WCHAR)) ||
+            used + pLogRecord->Length > Length) {
+
+            break;
+        }
+
+        used += pLogRecord->Length;
+
+        if (FlagOn( pLogRecord->RecordType, RECORD_TYPE_FILETAG ) &&
+            (Hooks == NULL || Hooks->TranslateFileTag == NULL ||
+             !Hooks->TranslateFileTag( pLogRecord ))) {
+
+            pLogRecord = (PLOG_RECORD) Add2Ptr( pLogRecord, pLogRecord->Length );
+            continue;
+        }
+
+        record = &Batch->Records[Batch->Count];
+        memset( record, 0, sizeof(MSPY_BATCH_RECORD) );
+
+        record->SequenceNumber = pLogRecord->SequenceNumber;
+        record->Processor = pLogRecord->Processor;
+        record->RecordType = pLogRecord->RecordType;
+        record->OriginatingTime = pLogRecord->Data.OriginatingTime;
+        record->ProcessId = pLogRecord->Data.ProcessId;
+        record->CallbackMajorId = pLogRecord->Data.CallbackMajorId;
+        record->CallbackMinorId = pLogRecord->Data.CallbackMinorId;
+        record->AccessType = (CHAR) pLogRecord->Data.Reserved[0];
+        record->DeniedAccess = (record->AccessType == 'A') ? (CHAR) pLogRecord->Data.Reserved[1] : 0;
+
+        if (FlagOn( pLogRecord->RecordType, RECORD_TYPE_GAP )) {
+
+            record->Gap = (CONST RECORD_GAP *) pLogRecord->Name;
+            Batch->Count++;
+
+            pLogRecord = (PLOG_RECORD) Add2Ptr( pLogRecord, pLogRecord->Length );
+            continue;
+        }
+
+        //
+        //  Name holds "file\n" "process\n" "user\n", in that order.  Only
+        //  walk as far as the last field that was asked for.
+        //
+
+        line = pLogRecord->Name;
+        end = (CONST WCHAR *) Add2Ptr( pLogRecord, pLogRecord->Length );
+
+        if (FlagOn( Fields, MSPY_FIELD_FILE_NAME | MSPY_FIELD_PROCESS | MSPY_FIELD_USER )) {
+
+            CONST WCHAR *next = MspyNextLine( line, end, &count );
+
+            if (FlagOn( Fields, MSPY_FIELD_FILE_NAME )) {
+
+                MspyEmitString( Batch, Hooks, line, count, &record->FileName );
+            }
+
+            line = next;
+        }
+
+        if (FlagOn( Fields, MSPY_FIELD_PROCESS | MSPY_FIELD_USER )) {
+
+            CONST WCHAR *next = MspyNextLine( line, end, &count );
+
+            if (FlagOn( Fields, MSPY_FIELD_PROCESS )) {
+
+                MspyEmitString( Batch, Hooks, line, count, &record->Process );
+            }
+
+            line = next;
+        }
+
+        if (FlagOn( Fields, MSPY_FIELD_USER )) {
+
+            MspyNextLine( line, end, &count );
+            MspyEmitString( Batch, Hooks, line, count, &record->User );
+        }
+
+        if (FlagOn( Fields, MSPY_FIELD_TIME_STRING ) &&
+            Hooks != NULL && Hooks->FormatTime != NULL) {
+
+            timeLength = Hooks->FormatTime( &pLogRecord->Data.OriginatingTime,
+                                            time,
+                                            MSPY_TIME_LENGTH );
+
+            if (timeLength >= MSPY_TIME_LENGTH) {
+
+                timeLength = MSPY_TIME_LENGTH - 1;
+            }
+
+            if (Encoding == MspyEncodingUtf16) {
+
+                //
+                //  The time is the one string that does not exist in the
+                //  raw record, so widen it into the arena.  It is only
+                //  digits and separators.
+                //
+
+                PWCHAR dest = (PWCHAR) (Batch->Arena + Batch->ArenaUsed);
+
+                for (index = 0; index < timeLength; index++) {
+
+                    dest[index] = (UCHAR) time[index];
+                }
+
+                record->Time.Buffer = dest;
+                record->Time.Length = timeLength * sizeof(WCHAR);
+                Batch->ArenaUsed += timeLength * sizeof(WCHAR);
+
+            } else {
+
+                PUCHAR dest = Batch->Arena + Batch->ArenaUsed;
+
+                memcpy( dest, time, timeLength );
+                dest[timeLength] = '\0';
+
+                record->Time.Buffer = dest;
+                record->Time.Length = timeLength;
+                Batch->ArenaUsed += timeLength + 1;
+            }
+        }
+
+        Batch->Count++;
+
+        pLogRecord = (PLOG_RECORD) Add2Ptr( pLogRecord, pLogRecord->Length );
+    }
+
+    return TRUE;
+}
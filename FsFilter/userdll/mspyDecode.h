@@ -0,0 +1,198 @@
+/*++
+
+Module Name:
+
+    mspyDecode.h
+
+Abstract:
+
+    This module contains the structures and prototypes for decoding a
+    buffer of packed LOG_RECORDs into a batch, see mspyBatch.h.
+
+    A batch is the decoded form of one GetMiniSpyLog reply.  Every record
+    in the batch is a compact MSPY_BATCH_RECORD whose string fields are
+    views (pointer and byte length) rather than fixed size copies.  The
+    views either borrow from the batch's copy of the reply (UTF-16) or
+    point into a decode arena owned by the batch (UTF-8 / ANSI), so the
+    whole batch is released as a single unit.
+
+    The decoder only looks at the bytes it is handed and calls nothing
+    from Win32.  What does need the system, narrowing to the ANSI code
+    page, formatting the time and following mount point tags, it asks of
+    an MSPY_DECODE_HOOKS, so it builds and runs wherever mspyTypes.h
+    does, fed from a captured or synthetic record buffer just as well as
+    from the filter's communication port.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __MSPYDECODE_H__
+#define __MSPYDECODE_H__
+
+#include "mspyTypes.h"
+#include "miniSpy.h"
+
+//
+//  Encoding of the string views in a batch.
+//
+//  MspyEncodingUtf16 does no transcoding at all: the views point into the
+//  raw record buffer and are not NULL terminated.  The other encodings
+//  write NULL terminated strings into the batch arena.
+//
+
+typedef enum _MSPY_ENCODING {
+
+    MspyEncodingUtf16 = 0,
+    MspyEncodingUtf8,
+    MspyEncodingAnsi
+
+} MSPY_ENCODING;
+
+//
+//  Fields the caller wants decoded.  Fields that are not requested are
+//  returned as empty views and cost nothing to skip.
+//
+
+#define MSPY_FIELD_FILE_NAME        0x00000001
+#define MSPY_FIELD_PROCESS          0x00000002
+#define MSPY_FIELD_USER             0x00000004
+#define MSPY_FIELD_TIME_STRING      0x00000008
+
+#define MSPY_FIELD_ALL              (MSPY_FIELD_FILE_NAME | \
+                                     MSPY_FIELD_PROCESS |   \
+                                     MSPY_FIELD_USER |      \
+                                     MSPY_FIELD_TIME_STRING)
+
+//
+//  Room a formatted time may take, terminating NULL included.
+//
+
+#define MSPY_TIME_LENGTH            30
+
+typedef struct _MSPY_STRING_VIEW {
+
+    CONST VOID *Buffer;
+
+    //
+    //  Length in bytes, not including any terminating NULL.
+    //
+
+    ULONG Length;
+
+} MSPY_STRING_VIEW, *PMSPY_STRING_VIEW;
+
+typedef struct _MSPY_BATCH_RECORD {
+
+    ULONG SequenceNumber;
+    ULONG RecordType;
+
+    //
+    //  The filter queue the record came from.  SequenceNumber counts
+    //  within that queue.
+    //
+
+    ULONG Processor;
+
+    LARGE_INTEGER OriginatingTime;
+    FILE_ID ProcessId;
+
+    UCHAR CallbackMajorId;
+    UCHAR CallbackMinorId;
+    CHAR AccessType;            //  'D', 'd', 'R', 'W', 'A' (denied) or 0
+    CHAR DeniedAccess;          //  For 'A': 'D', 'R', 'W', 'C' or 'S'
+
+    MSPY_STRING_VIEW FileName;
+    MSPY_STRING_VIEW Process;
+    MSPY_STRING_VIEW User;
+    MSPY_STRING_VIEW Time;
+
+    //
+    //  For a RECORD_TYPE_GAP record, the lost range in the raw reply; the
+    //  string views are empty.  NULL for any other record.
+    //
+
+    CONST RECORD_GAP *Gap;
+
+} MSPY_BATCH_RECORD, *PMSPY_BATCH_RECORD;
+
+typedef struct _MSPY_BATCH {
+
+    //
+    //  Decoded records, valid until the batch is released or reused.
+    //
+
+    ULONG Count;
+    PMSPY_BATCH_RECORD Records;
+
+    ULONG Fields;
+    MSPY_ENCODING Encoding;
+
+    //
+    //  Private to the decoder.  Capacity is the size in bytes of Records,
+    //  Raw holds the reply the UTF-16 views borrow from and Arena holds
+    //  transcoded strings.
+    //
+
+    ULONG Capacity;
+
+    PUCHAR Raw;
+    ULONG RawSize;
+
+    PUCHAR Arena;
+    ULONG ArenaSize;
+    ULONG ArenaUsed;
+
+} MSPY_BATCH, *PMSPY_BATCH;
+
+//
+//  What the decoder asks of the system.  Any of them may be NULL:
+//
+//  TranslateFileTag - moves the substitute name of a RECORD_TYPE_FILETAG
+//                     record to where the name goes.  FALSE, or no hook,
+//                     drops the record, as the screen dump does.
+//  FormatTime       - formats a record's OriginatingTime into at most
+//                     MSPY_TIME_LENGTH characters and returns how many it
+//                     wrote.  With no hook the time view is empty.
+//  Narrow           - converts Count UTF-16 code units to the ANSI code
+//                     page into Dest, which has room for 3 bytes each,
+//                     and returns the bytes written.  With no hook
+//                     MspyEncodingAnsi decodes as UTF-8.
+//
+
+typedef struct _MSPY_DECODE_HOOKS {
+
+    BOOLEAN (*TranslateFileTag)( PLOG_RECORD LogRecord );
+
+    ULONG (*FormatTime)( CONST LARGE_INTEGER *Time,
+                         CHAR *Buffer,
+                         ULONG BufferLength );
+
+    ULONG (*Narrow)( CONST WCHAR *Source,
+                     ULONG Count,
+                     PUCHAR Dest,
+                     ULONG DestLength );
+
+} MSPY_DECODE_HOOKS, *PMSPY_DECODE_HOOKS;
+
+//
+//  Function prototypes
+//
+
+BOOLEAN
+MspyDecodeBatch (
+    __in_bcount(Length) CONST VOID *Buffer,
+    __in ULONG Length,
+    __in ULONG Fields,
+    __in MSPY_ENCODING Encoding,
+    __in_opt CONST MSPY_DECODE_HOOKS *Hooks,
+    __inout PMSPY_BATCH Batch
+    );
+
+VOID
+MspyResetBatch (
+    __inout PMSPY_BATCH Batch
+    );
+
+#endif //__MSPYDECODE_H__
@@ -0,0 +1 @@
+../user/mspyReplay.c
\ No newline at end of file
@@ -0,0 +1 @@
+../user/mspyReplay.h
\ No newline at end of file
@@ -0,0 +1,711 @@
+/*++
+
+Module Name:
+
+    mspyBatchTest.c
+
+Abstract:
+
+    Tests mspyDecode.c against record buffers laid out as the filter lays
+    them out, without the filter: a fake record source packs LOG_RECORDs
+    the way SpySetRecordName and SpyBuildGapRecord do, and each test
+    decodes them and checks the batch.
+
+    With -b the fake source is decoded in a loop instead, to time the
+    decoder.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mspyDecode.h"
+
+#define TEST_BUFFER_SIZE    (2 * MAX_RECORD_SIZE)
+
+static ULONG Failures;
+
+#define CHECK(Condition)                                                \
+    ((Condition) ? (void) 0 :                                           \
+     (void) (Failures++, fprintf( stderr, "%s:%d: %s\n",                \
+                                  __FILE__, __LINE__, #Condition )))
+
+//
+//  The fake record source.
+//
+
+typedef struct _FAKE_SOURCE {
+
+    PUCHAR Buffer;
+    ULONG Size;
+    ULONG Used;
+    ULONG Sequence;
+
+} FAKE_SOURCE, *PFAKE_SOURCE;
+
+
+static VOID
+FakeStart (
+    __out PFAKE_SOURCE Source,
+    __out_bcount(Size) PVOID Buffer,
+    __in ULONG Size
+    )
+{
+    Source->Buffer = Buffer;
+    Source->Size = Size;
+    Source->Used = 0;
+    Source->Sequence = 0;
+
+    memset( Buffer, 0xCC, Size );
+}
+
+static PLOG_RECORD
+FakeRecord (
+    __inout PFAKE_SOURCE Source,
+    __in ULONG RecordType,
+    __in UCHAR MajorId,
+    __in CHAR AccessType
+    )
+/*++
+
+Routine Description:
+
+    Starts a record with no name at the end of the buffer.
+
+Return Value:
+
+    The record, or NULL if the buffer is full.
+
+--*/
+{
+    PLOG_RECORD logRecord;
+
+    if (Source->Used + MAX_LOG_RECORD_LENGTH > Source->Size) {
+
+        return NULL;
+    }
+
+    logRecord = (PLOG_RECORD) (Source->Buffer + Source->Used);
+    memset( logRecord, 0, sizeof(LOG_RECORD) );
+
+    logRecord->Length = sizeof(LOG_RECORD);
+    logRecord->SequenceNumber = Source->Sequence++;
+    logRecord->RecordType = RecordType;
+    logRecord->Processor = logRecord->SequenceNumber % LOG_QUEUES;
+    logRecord->Data.OriginatingTime.QuadPart = 132000000000000000LL + logRecord->SequenceNumber;
+    logRecord->Data.ProcessId = 4000 + logRecord->SequenceNumber % 7;
+    logRecord->Data.CallbackMajorId = MajorId;
+    logRecord->Data.Reserved[0] = (UCHAR) AccessType;
+    logRecord->Data.Reserved[1] = (AccessType == 'A') ? 'W' : 0;
+
+    return logRecord;
+}
+
+static VOID
+FakeName (
+    __inout PLOG_RECORD LogRecord,
+    __in_ecount(Count) CONST WCHAR *Name,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Appends one line to a record's name as SpySetRecordName does: the
+    name, a '\n', spaces up to pointer alignment and a NULL just past
+    the record.
+
+--*/
+{
+    PWCHAR copy = (PWCHAR) Add2Ptr( LogRecord, LogRecord->Length );
+    ULONG length = Count * sizeof(WCHAR) + sizeof(WCHAR);
+    ULONG rounded = ROUND_TO_SIZE( length, sizeof(PVOID) );
+    ULONG index;
+
+    memcpy( copy, Name, Count * sizeof(WCHAR) );
+    copy[Count] = L'\n';
+
+    for (index = length / sizeof(WCHAR); index < rounded / sizeof(WCHAR); index++) {
+
+        copy[index] = L' ';
+    }
+
+    copy[rounded / sizeof(WCHAR)] = UNICODE_NULL;
+    LogRecord->Length += rounded;
+}
+
+static VOID
+FakeNameA (
+    __inout PLOG_RECORD LogRecord,
+    __in CONST CHAR *Name
+    )
+{
+    WCHAR wide[MAX_RECORD_SIZE / sizeof(WCHAR)];
+    ULONG count;
+
+    for (count = 0; Name[count] != '\0'; count++) {
+
+        wide[count] = (UCHAR) Name[count];
+    }
+
+    FakeName( LogRecord, wide, count );
+}
+
+static VOID
+FakeEnd (
+    __inout PFAKE_SOURCE Source,
+    __inout PLOG_RECORD LogRecord
+    )
+/*++
+
+Routine Description:
+
+    Finishes a record, giving one with no name an empty one as
+    SpyGetLog does.
+
+--*/
+{
+    if (LogRecord->Length == sizeof(LOG_RECORD)) {
+
+        LogRecord->Name[0] = UNICODE_NULL;
+        LogRecord->Length += ROUND_TO_SIZE( sizeof(UNICODE_NULL), sizeof(PVOID) );
+    }
+
+    Source->Used += LogRecord->Length;
+}
+
+static BOOLEAN
+FakeOperation (
+    __inout PFAKE_SOURCE Source,
+    __in CONST CHAR *File,
+    __in CONST CHAR *Process,
+    __in_opt CONST CHAR *User
+    )
+{
+    PLOG_RECORD logRecord = FakeRecord( Source, RECORD_TYPE_NORMAL, 4, 'W' );
+
+    if (logRecord == NULL) {
+
+        return FALSE;
+    }
+
+    FakeNameA( logRecord, File );
+    FakeNameA( logRecord, Process );
+
+    if (User != NULL) {
+
+        FakeNameA( logRecord, User );
+    }
+
+    FakeEnd( Source, logRecord );
+    return TRUE;
+}
+
+static VOID
+FakeGap (
+    __inout PFAKE_SOURCE Source,
+    __in ULONG First,
+    __in ULONG Last
+    )
+{
+    PLOG_RECORD logRecord = FakeRecord( Source, RECORD_TYPE_GAP, 0, 0 );
+    PRECORD_GAP gap = (PRECORD_GAP) logRecord->Name;
+
+    memset( gap, 0, sizeof(RECORD_GAP) );
+    gap->FirstSequence = First;
+    gap->LastSequence = Last;
+    gap->Count = Last - First + 1;
+    gap->Reason[LOSS_OVER_QUOTA] = gap->Count;
+
+    logRecord->Length += ROUND_TO_SIZE( sizeof(RECORD_GAP), sizeof(PVOID) );
+    Source->Used += logRecord->Length;
+}
+
+static BOOLEAN
+ViewIs (
+    __in CONST MSPY_STRING_VIEW *View,
+    __in CONST CHAR *Expected
+    )
+{
+    return (BOOLEAN) (View->Length == strlen( Expected ) &&
+                      memcmp( View->Buffer, Expected, View->Length ) == 0 &&
+                      ((CONST CHAR *) View->Buffer)[View->Length] == '\0');
+}
+
+static BOOLEAN
+WideViewIs (
+    __in CONST MSPY_STRING_VIEW *View,
+    __in CONST CHAR *Expected
+    )
+{
+    CONST WCHAR *buffer = View->Buffer;
+    ULONG index;
+
+    if (View->Length != strlen( Expected ) * sizeof(WCHAR)) {
+
+        return FALSE;
+    }
+
+    for (index = 0; Expected[index] != '\0'; index++) {
+
+        if (buffer[index] != (UCHAR) Expected[index]) {
+
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//
+//  Hooks standing in for the Win32 ones.
+//
+
+static ULONG
+TestFormatTime (
+    __in CONST LARGE_INTEGER *Time,
+    __out_bcount(BufferLength) CHAR *Buffer,
+    __in ULONG BufferLength
+    )
+{
+    return (ULONG) snprintf( Buffer, BufferLength, "t%u", (unsigned) (Time->QuadPart % 1000) );
+}
+
+static BOOLEAN
+TestTranslateFileTag (
+    __inout PLOG_RECORD LogRecord
+    )
+{
+    LogRecord->Name[0] = L'M';
+    LogRecord->Name[1] = L'\n';
+    LogRecord->Name[2] = UNICODE_NULL;
+    return TRUE;
+}
+
+static ULONG
+TestNarrow (
+    __in_ecount(Count) CONST WCHAR *Source,
+    __in ULONG Count,
+    __out_bcount(DestLength) PUCHAR Dest,
+    __in ULONG DestLength
+    )
+{
+    ULONG index;
+
+    for (index = 0; index < Count && index < DestLength; index++) {
+
+        Dest[index] = (Source[index] < 0x100) ? (UCHAR) Source[index] : '?';
+    }
+
+    return index;
+}
+
+static CONST MSPY_DECODE_HOOKS TestHooks = {
+
+    TestTranslateFileTag,
+    TestFormatTime,
+    TestNarrow
+};
+
+
+static VOID
+TestFields (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Every field in every encoding, and fields not asked for left empty.
+
+--*/
+{
+    PVOID buffer[TEST_BUFFER_SIZE / sizeof(PVOID)];
+    FAKE_SOURCE source;
+    MSPY_BATCH batch;
+    PMSPY_BATCH_RECORD record;
+
+    memset( &batch, 0, sizeof(batch) );
+
+    FakeStart( &source, buffer, sizeof(buffer) );
+    FakeOperation( &source, "\\Device\\HarddiskVolume2\\docs\\a.txt", "\\Windows\\notepad.exe", "S-1-5-21-1" );
+    FakeOperation( &source, "\\Device\\HarddiskVolume2\\b", "x.exe", NULL );
+
+    CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_ALL, MspyEncodingUtf8, &TestHooks, &batch ) );
+    CHECK( batch.Count == 2 );
+
+    record = &batch.Records[0];
+    CHECK( record->SequenceNumber == 0 );
+    CHECK( record->CallbackMajorId == 4 );
+    CHECK( record->AccessType == 'W' );
+    CHECK( record->DeniedAccess == 0 );
+    CHECK( record->ProcessId == 4000 );
+    CHECK( record->Gap == NULL );
+    CHECK( ViewIs( &record->FileName, "\\Device\\HarddiskVolume2\\docs\\a.txt" ) );
+    CHECK( ViewIs( &record->Process, "\\Windows\\notepad.exe" ) );
+    CHECK( ViewIs( &record->User, "S-1-5-21-1" ) );
+    CHECK( ViewIs( &record->Time, "t0" ) );
+
+    record = &batch.Records[1];
+    CHECK( record->SequenceNumber == 1 );
+    CHECK( ViewIs( &record->FileName, "\\Device\\HarddiskVolume2\\b" ) );
+    CHECK( ViewIs( &record->Process, "x.exe" ) );
+    CHECK( record->User.Length == 0 );
+    CHECK( ViewIs( &record->Time, "t1" ) );
+
+    //
+    //  UTF-16 views borrow from the batch's copy, never from the caller's
+    //  buffer, which may be reused at once.
+    //
+
+    CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_ALL, MspyEncodingUtf16, &TestHooks, &batch ) );
+    memset( buffer, 0, sizeof(buffer) );
+
+    CHECK( batch.Count == 2 );
+    CHECK( WideViewIs( &batch.Records[0].FileName, "\\Device\\HarddiskVolume2\\docs\\a.txt" ) );
+    CHECK( WideViewIs( &batch.Records[0].User, "S-1-5-21-1" ) );
+    CHECK( WideViewIs( &batch.Records[1].Time, "t1" ) );
+    CHECK( (PUCHAR) batch.Records[0].FileName.Buffer >= batch.Raw &&
+           (PUCHAR) batch.Records[0].FileName.Buffer < batch.Raw + batch.RawSize );
+
+    //
+    //  Only the process: no file name or user, and no time without the
+    //  field, hooks or not.
+    //
+
+    FakeStart( &source, buffer, sizeof(buffer) );
+    FakeOperation( &source, "\\f", "p.exe", "S-1-1-0" );
+
+    CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_PROCESS, MspyEncodingUtf8, &TestHooks, &batch ) );
+    CHECK( batch.Count == 1 );
+    CHECK( batch.Records[0].FileName.Length == 0 && batch.Records[0].FileName.Buffer == NULL );
+    CHECK( ViewIs( &batch.Records[0].Process, "p.exe" ) );
+    CHECK( batch.Records[0].User.Length == 0 );
+    CHECK( batch.Records[0].Time.Length == 0 );
+
+    CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_ALL, MspyEncodingUtf8, NULL, &batch ) );
+    CHECK( batch.Count == 1 );
+    CHECK( ViewIs( &batch.Records[0].User, "S-1-1-0" ) );
+    CHECK( batch.Records[0].Time.Length == 0 );
+
+    MspyResetBatch( &batch );
+}
+
+static VOID
+TestTranscoding (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    UTF-8 of two, three and four byte characters and an unpaired
+    surrogate, and ANSI with and without a Narrow hook.
+
+--*/
+{
+    static CONST WCHAR name[] = { L'a', 0x00E9, 0x20AC, 0xD83D, 0xDE00, 0xD800, L'z' };
+    static CONST CHAR utf8[] = "a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80\xEF\xBF\xBDz";
+    PVOID buffer[TEST_BUFFER_SIZE / sizeof(PVOID)];
+    FAKE_SOURCE source;
+    MSPY_BATCH batch;
+    PLOG_RECORD logRecord;
+
+    memset( &batch, 0, sizeof(batch) );
+
+    FakeStart( &source, buffer, sizeof(buffer) );
+    logRecord = FakeRecord( &source, RECORD_TYPE_NORMAL, 0, 'D' );
+    FakeName( logRecord, name, sizeof(name) / sizeof(WCHAR) );
+    FakeEnd( &source, logRecord );
+
+    CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_FILE_NAME, MspyEncodingUtf8, NULL, &batch ) );
+    CHECK( batch.Count == 1 );
+    CHECK( ViewIs( &batch.Records[0].FileName, utf8 ) );
+
+    CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_FILE_NAME, MspyEncodingAnsi, NULL, &batch ) );
+    CHECK( ViewIs( &batch.Records[0].FileName, utf8 ) );
+
+    CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_FILE_NAME, MspyEncodingAnsi, &TestHooks, &batch ) );
+    CHECK( ViewIs( &batch.Records[0].FileName, "a\xE9" "????" "z" ) );
+
+    MspyResetBatch( &batch );
+}
+
+static VOID
+TestSpecialRecords (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Gap records, denials, records with no name, and file tag records,
+    dropped without a hook.
+
+--*/
+{
+    PVOID buffer[TEST_BUFFER_SIZE / sizeof(PVOID)];
+    FAKE_SOURCE source;
+    MSPY_BATCH batch;
+    PLOG_RECORD logRecord;
+
+    memset( &batch, 0, sizeof(batch) );
+
+    FakeStart( &source, buffer, sizeof(buffer) );
+
+    FakeGap( &source, 10, 19 );
+
+    logRecord = FakeRecord( &source, RECORD_TYPE_NORMAL | RECORD_TYPE_FLAG_PRIORITY, 0, 'A' );
+    FakeNameA( logRecord, "\\denied" );
+    FakeEnd( &source, logRecord );
+
+    logRecord = FakeRecord( &source, RECORD_TYPE_NORMAL, 0x12, 0 );
+    FakeEnd( &source, logRecord );
+
+    logRecord = FakeRecord( &source, RECORD_TYPE_FILETAG, 0, 0 );
+    FakeNameA( logRecord, "reparse" );
+    FakeEnd( &source, logRecord );
+
+    CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_ALL, MspyEncodingUtf8, NULL, &batch ) );
+    CHECK( batch.Count == 3 );
+
+    CHECK( batch.Records[0].Gap != NULL );
+    CHECK( batch.Records[0].Gap->FirstSequence == 10 );
+    CHECK( batch.Records[0].Gap->Count == 10 );
+    CHECK( batch.Records[0].Gap->Reason[LOSS_OVER_QUOTA] == 10 );
+    CHECK( batch.Records[0].FileName.Length == 0 );
+
+    CHECK( batch.Records[1].AccessType == 'A' );
+    CHECK( batch.Records[1].DeniedAccess == 'W' );
+    CHECK( FlagOn( batch.Records[1].RecordType, RECORD_TYPE_FLAG_PRIORITY ) );
+    CHECK( ViewIs( &batch.Records[1].FileName, "\\denied" ) );
+
+    CHECK( batch.Records[2].CallbackMajorId == 0x12 );
+    CHECK( ViewIs( &batch.Records[2].FileName, "" ) );
+    CHECK( ViewIs( &batch.Records[2].Process, "" ) );
+
+    CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_ALL, MspyEncodingUtf8, &TestHooks, &batch ) );
+    CHECK( batch.Count == 4 );
+    CHECK( batch.Records[3].SequenceNumber == 3 );
+    CHECK( ViewIs( &batch.Records[3].FileName, "M" ) );
+
+    MspyResetBatch( &batch );
+}
+
+static VOID
+TestMalformed (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A record cut short or with a length that cannot be ends the batch
+    at the records before it, and an empty reply gives an empty batch.
+
+--*/
+{
+    PVOID buffer[TEST_BUFFER_SIZE / sizeof(PVOID)];
+    FAKE_SOURCE source;
+    MSPY_BATCH batch;
+    PLOG_RECORD second;
+    ULONG first;
+
+    memset( &batch, 0, sizeof(batch) );
+
+    FakeStart( &source, buffer, sizeof(buffer) );
+    FakeOperation( &source, "\\one", "p.exe", NULL );
+    first = source.Used;
+    second = (PLOG_RECORD) Add2Ptr( buffer, first );
+    FakeOperation( &source, "\\two", "p.exe", NULL );
+
+    CHECK( MspyDecodeBatch( buffer, source.Used - 1, MSPY_FIELD_ALL, MspyEncodingUtf8, NULL, &batch ) );
+    CHECK( batch.Count == 1 );
+
+    second->Length = sizeof(LOG_RECORD);
+    CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_ALL, MspyEncodingUtf8, NULL, &batch ) );
+    CHECK( batch.Count == 1 );
+
+    CHECK( MspyDecodeBatch( buffer, 0, MSPY_FIELD_ALL, MspyEncodingUtf8, NULL, &batch ) );
+    CHECK( batch.Count == 0 );
+
+    MspyResetBatch( &batch );
+}
+
+static ULONG
+FakeFill (
+    __out PFAKE_SOURCE Source,
+    __out_bcount(Size) PVOID Buffer,
+    __in ULONG Size,
+    __in ULONG Sequence
+    )
+/*++
+
+Routine Description:
+
+    Fills a buffer with operations on file names of varying length, as
+    a busy reply would be.
+
+Return Value:
+
+    The number of records.
+
+--*/
+{
+    CHAR file[128];
+    ULONG count = 0;
+
+    FakeStart( Source, Buffer, Size );
+    Source->Sequence = Sequence;
+
+    for (;;) {
+
+        snprintf( file, sizeof(file),
+                  "\\Device\\HarddiskVolume2\\Users\\me\\work\\%0*u.dat",
+                  (int) (1 + Source->Sequence % 40), Source->Sequence );
+
+        if (!FakeOperation( Source, file, "\\Windows\\System32\\svchost.exe", "S-1-5-18" )) {
+
+            return count;
+        }
+
+        count++;
+    }
+}
+
+static VOID
+TestFull (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Full replies decoded one after another into the same batch, as the
+    push callback's batch is reused.
+
+--*/
+{
+    PVOID buffer[TEST_BUFFER_SIZE / sizeof(PVOID)];
+    FAKE_SOURCE source;
+    MSPY_BATCH batch;
+    ULONG round;
+    ULONG count;
+    ULONG index;
+    BOOLEAN inOrder;
+
+    memset( &batch, 0, sizeof(batch) );
+
+    for (round = 0; round < 4; round++) {
+
+        count = FakeFill( &source, buffer, sizeof(buffer), round * 1000 );
+
+        CHECK( count > 0 );
+        CHECK( MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_ALL,
+                                (round & 1) ? MspyEncodingUtf16 : MspyEncodingUtf8,
+                                &TestHooks, &batch ) );
+        CHECK( batch.Count == count );
+        CHECK( batch.ArenaUsed <= batch.ArenaSize );
+
+        inOrder = TRUE;
+
+        for (index = 0; index < batch.Count; index++) {
+
+            inOrder = inOrder &&
+                      batch.Records[index].SequenceNumber == round * 1000 + index &&
+                      batch.Records[index].Process.Length != 0;
+        }
+
+        CHECK( inOrder );
+    }
+
+    MspyResetBatch( &batch );
+}
+
+static int
+Benchmark (
+    __in ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    Decodes one full fake reply over and over and prints the rate.
+
+--*/
+{
+    PVOID buffer[TEST_BUFFER_SIZE / sizeof(PVOID)];
+    FAKE_SOURCE source;
+    MSPY_BATCH batch;
+    ULONG count;
+    ULONGLONG records;
+    MSPY_ENCODING encoding;
+    struct timespec start;
+    struct timespec now;
+    double elapsed;
+
+    memset( &batch, 0, sizeof(batch) );
+    count = FakeFill( &source, buffer, sizeof(buffer), 0 );
+
+    for (encoding = MspyEncodingUtf16; encoding <= MspyEncodingUtf8; encoding++) {
+
+        records = 0;
+        clock_gettime( CLOCK_MONOTONIC, &start );
+
+        do {
+
+            ULONG round;
+
+            for (round = 0; round < 1000; round++) {
+
+                MspyDecodeBatch( buffer, source.Used, MSPY_FIELD_ALL, encoding, &TestHooks, &batch );
+                records += batch.Count;
+            }
+
+            clock_gettime( CLOCK_MONOTONIC, &now );
+            elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+        } while (elapsed < Seconds);
+
+        printf( "%s: %u records a reply, %.0f records/s, %.1f ns a record\n",
+                encoding == MspyEncodingUtf16 ? "utf-16" : "utf-8",
+                count,
+                records / elapsed,
+                elapsed * 1e9 / records );
+    }
+
+    MspyResetBatch( &batch );
+    return 0;
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 2 );
+    }
+
+    TestFields();
+    TestTranscoding();
+    TestSpecialRecords();
+    TestMalformed();
+    TestFull();
+
+    if (Failures != 0) {
+
+        printf( "mspyBatchTest: %u checks failed\n", Failures );
+        return 1;
+    }
+
+    printf( "mspyBatchTest: passed\n" );
+    return 0;
+}
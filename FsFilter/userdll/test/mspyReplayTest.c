@@ -0,0 +1,770 @@
+/*++
+
+Module Name:
+
+    mspyReplayTest.c
+
+Abstract:
+
+    Tests the capture and replay of mspyReplay.c and mspyMerge.c the way
+    minispy uses them, without the filter.  A fake record source packs
+    batches of LOG_RECORDs as the filter's queues send them; the batches
+    are captured to a file, the file is replayed through the log thread's
+    walk and merge, and the decoded records are compared with those of
+    the batches that went in.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mspyDecode.h"
+#include "mspyReplay.h"
+#include "mspyMerge.h"
+
+#define TEST_BATCHES        16
+#define TEST_BATCH_RECORDS  24
+#define TEST_QUEUES         4
+#define TEST_BUFFER_SIZE    (2 * MAX_RECORD_SIZE)
+
+//
+//  The records of a queue are stamped up to TEST_SKEW out of time order,
+//  well within the merge window of 1 ms.
+//
+
+#define TEST_MERGE_WINDOW   1
+#define TEST_SKEW           4000
+
+static ULONG Failures;
+
+#define CHECK(Condition)                                                \
+    ((Condition) ? (void) 0 :                                           \
+     (void) (Failures++, fprintf( stderr, "%s:%d: %s\n",                \
+                                  __FILE__, __LINE__, #Condition )))
+
+//
+//  The fake record source.  Each queue numbers its records on its own,
+//  from 1, as the filter does.
+//
+
+typedef struct _FAKE_SOURCE {
+
+    PUCHAR Buffer;
+    ULONG Size;
+    ULONG Used;
+
+    ULONG Records;
+    ULONG Sequence[TEST_QUEUES];
+    ULONG PrioritySequence;
+
+} FAKE_SOURCE, *PFAKE_SOURCE;
+
+typedef struct _TEST_BATCH {
+
+    PVOID Buffer[TEST_BUFFER_SIZE / sizeof(PVOID)];
+    ULONG Length;
+    LONGLONG Ticks;
+
+} TEST_BATCH, *PTEST_BATCH;
+
+//
+//  What comes out of the replay: the records in the order the merge
+//  releases them.
+//
+
+typedef struct _TEST_OUTPUT {
+
+    PLOG_MERGE Merge;
+
+    ULONG Count;
+    ULONG Priority;
+    LONGLONG LastTime;
+    BOOLEAN InOrder;
+
+} TEST_OUTPUT, *PTEST_OUTPUT;
+
+
+static VOID
+FakeStart (
+    __out PFAKE_SOURCE Source
+    )
+{
+    memset( Source, 0, sizeof(FAKE_SOURCE) );
+}
+
+static VOID
+FakeBatch (
+    __inout PFAKE_SOURCE Source,
+    __out_bcount(Size) PVOID Buffer,
+    __in ULONG Size
+    )
+{
+    Source->Buffer = Buffer;
+    Source->Size = Size;
+    Source->Used = 0;
+
+    memset( Buffer, 0xCC, Size );
+}
+
+static PLOG_RECORD
+FakeRecord (
+    __inout PFAKE_SOURCE Source,
+    __in ULONG RecordType,
+    __in ULONG Queue
+    )
+/*++
+
+Routine Description:
+
+    Starts a record with no name at the end of the batch, numbered and
+    stamped as the filter numbers and stamps the records of Queue.
+
+--*/
+{
+    PLOG_RECORD logRecord;
+    ULONG record;
+
+    if (Source->Used + MAX_LOG_RECORD_LENGTH > Source->Size) {
+
+        return NULL;
+    }
+
+    logRecord = (PLOG_RECORD) (Source->Buffer + Source->Used);
+    memset( logRecord, 0, sizeof(LOG_RECORD) );
+
+    record = Source->Records++;
+
+    logRecord->Length = sizeof(LOG_RECORD);
+    logRecord->RecordType = RecordType;
+    logRecord->Processor = Queue;
+
+    if (FlagOn( RecordType, RECORD_TYPE_FLAG_PRIORITY )) {
+
+        logRecord->SequenceNumber = ++Source->PrioritySequence;
+
+    } else {
+
+        logRecord->SequenceNumber = ++Source->Sequence[Queue];
+    }
+
+    logRecord->Data.OriginatingTime.QuadPart = 132000000000000000LL +
+                                               record * 1000LL -
+                                               (record * 7919 % TEST_SKEW);
+    logRecord->Data.ProcessId = 4000 + record % 7;
+    logRecord->Data.CallbackMajorId = (UCHAR) (record % 28);
+    logRecord->Data.Reserved[0] = 'W';
+
+    return logRecord;
+}
+
+static VOID
+FakeNameA (
+    __inout PLOG_RECORD LogRecord,
+    __in CONST CHAR *Name
+    )
+/*++
+
+Routine Description:
+
+    Appends one line to a record's name as SpySetRecordName does.
+
+--*/
+{
+    PWCHAR copy = (PWCHAR) Add2Ptr( LogRecord, LogRecord->Length );
+    ULONG count = (ULONG) strlen( Name );
+    ULONG length = count * sizeof(WCHAR) + sizeof(WCHAR);
+    ULONG rounded = ROUND_TO_SIZE( length, sizeof(PVOID) );
+    ULONG index;
+
+    for (index = 0; index < count; index++) {
+
+        copy[index] = (UCHAR) Name[index];
+    }
+
+    copy[count] = L'\n';
+
+    for (index = length / sizeof(WCHAR); index < rounded / sizeof(WCHAR); index++) {
+
+        copy[index] = L' ';
+    }
+
+    copy[rounded / sizeof(WCHAR)] = UNICODE_NULL;
+    LogRecord->Length += rounded;
+}
+
+static VOID
+FakeEnd (
+    __inout PFAKE_SOURCE Source,
+    __inout PLOG_RECORD LogRecord
+    )
+{
+    if (LogRecord->Length == sizeof(LOG_RECORD)) {
+
+        LogRecord->Name[0] = UNICODE_NULL;
+        LogRecord->Length += ROUND_TO_SIZE( sizeof(UNICODE_NULL), sizeof(PVOID) );
+    }
+
+    Source->Used += LogRecord->Length;
+}
+
+static VOID
+FakeOperation (
+    __inout PFAKE_SOURCE Source,
+    __in ULONG RecordType,
+    __in ULONG Queue
+    )
+{
+    PLOG_RECORD logRecord = FakeRecord( Source, RecordType, Queue );
+    CHAR name[64];
+
+    CHECK( logRecord != NULL );
+
+    if (logRecord == NULL) {
+
+        return;
+    }
+
+    snprintf( name, sizeof(name), "\\Device\\HarddiskVolume1\\f%u.txt", Source->Records );
+
+    FakeNameA( logRecord, name );
+    FakeNameA( logRecord, "\\Device\\HarddiskVolume1\\Windows\\notepad.exe" );
+    FakeNameA( logRecord, "S-1-5-21-1-1001" );
+    FakeEnd( Source, logRecord );
+}
+
+static PRECORD_GAP
+FakeGap (
+    __inout PFAKE_SOURCE Source,
+    __in ULONG Queue,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Loses Count records of Queue and sends the gap record that stands for
+    them, as SpyBuildGapRecord does.
+
+--*/
+{
+    PLOG_RECORD logRecord;
+    PRECORD_GAP gap;
+
+    Source->Sequence[Queue] += Count;
+
+    logRecord = FakeRecord( Source, RECORD_TYPE_GAP, Queue );
+    gap = (PRECORD_GAP) logRecord->Name;
+
+    memset( gap, 0, sizeof(RECORD_GAP) );
+    gap->LastSequence = logRecord->SequenceNumber - 1;
+    gap->FirstSequence = logRecord->SequenceNumber - Count;
+    gap->Count = Count;
+    gap->Reason[LOSS_OVER_QUOTA] = Count;
+
+    logRecord->Length += ROUND_TO_SIZE( sizeof(RECORD_GAP), sizeof(PVOID) );
+    Source->Used += logRecord->Length;
+
+    return gap;
+}
+
+static VOID
+FakeBatches (
+    __out_ecount(TEST_BATCHES) PTEST_BATCH Batches
+    )
+/*++
+
+Routine Description:
+
+    The batches of a run: the queues interleaved a record at a time, a
+    priority record now and then and, in one batch, a gap.
+
+--*/
+{
+    FAKE_SOURCE source;
+    ULONG batch;
+    ULONG index;
+
+    FakeStart( &source );
+
+    for (batch = 0; batch < TEST_BATCHES; batch++) {
+
+        FakeBatch( &source, Batches[batch].Buffer, TEST_BUFFER_SIZE );
+
+        for (index = 0; index < TEST_BATCH_RECORDS; index++) {
+
+            if (index == 5) {
+
+                FakeOperation( &source, RECORD_TYPE_NORMAL | RECORD_TYPE_FLAG_PRIORITY, 0 );
+
+            } else if (batch == 7 && index == 11) {
+
+                FakeGap( &source, 3, 9 );
+
+            } else {
+
+                FakeOperation( &source, RECORD_TYPE_NORMAL, index % TEST_QUEUES );
+            }
+        }
+
+        Batches[batch].Length = source.Used;
+        Batches[batch].Ticks = 1000000LL + batch * 2500LL;
+    }
+}
+
+//---------------------------------------------------------------------------
+//  Replay
+//---------------------------------------------------------------------------
+
+static VOID
+TestRelease (
+    __inout PTEST_OUTPUT Output,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    if (!FlagOn( LogRecord->RecordType, RECORD_TYPE_FLAG_PRIORITY )) {
+
+        if (LogRecord->Data.OriginatingTime.QuadPart < Output->LastTime) {
+
+            Output->InOrder = FALSE;
+        }
+
+        Output->LastTime = LogRecord->Data.OriginatingTime.QuadPart;
+
+    } else {
+
+        Output->Priority++;
+    }
+
+    Output->Count++;
+}
+
+static VOID
+TestTakeRecord (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+/*++
+
+Routine Description:
+
+    Takes in a record as minispy's TakeRecord does: priority records go
+    straight out, the rest through the merge.
+
+--*/
+{
+    PTEST_OUTPUT output = Context;
+
+    if (FlagOn( LogRecord->RecordType, RECORD_TYPE_FLAG_PRIORITY ) ||
+        !MergeInsert( output->Merge, LogRecord )) {
+
+        TestRelease( output, LogRecord );
+    }
+}
+
+static VOID
+TestDrain (
+    __inout PTEST_OUTPUT Output,
+    __in BOOLEAN Flush
+    )
+{
+    PLOG_RECORD logRecord;
+
+    while ((logRecord = MergeRemove( Output->Merge, Flush )) != NULL) {
+
+        TestRelease( Output, logRecord );
+        free( logRecord );
+    }
+}
+
+static BOOLEAN
+ViewsEqual (
+    __in CONST MSPY_STRING_VIEW *Left,
+    __in CONST MSPY_STRING_VIEW *Right
+    )
+{
+    return (BOOLEAN) (Left->Length == Right->Length &&
+                      (Left->Length == 0 || memcmp( Left->Buffer, Right->Buffer, Left->Length ) == 0));
+}
+
+static BOOLEAN
+RecordsEqual (
+    __in PMSPY_BATCH_RECORD Left,
+    __in PMSPY_BATCH_RECORD Right
+    )
+{
+    return (BOOLEAN) (Left->SequenceNumber == Right->SequenceNumber &&
+                      Left->RecordType == Right->RecordType &&
+                      Left->Processor == Right->Processor &&
+                      Left->OriginatingTime.QuadPart == Right->OriginatingTime.QuadPart &&
+                      Left->ProcessId == Right->ProcessId &&
+                      Left->CallbackMajorId == Right->CallbackMajorId &&
+                      Left->AccessType == Right->AccessType &&
+                      ViewsEqual( &Left->FileName, &Right->FileName ) &&
+                      ViewsEqual( &Left->Process, &Right->Process ) &&
+                      ViewsEqual( &Left->User, &Right->User ) &&
+                      (Left->Gap == NULL) == (Right->Gap == NULL) &&
+                      (Left->Gap == NULL || memcmp( Left->Gap, Right->Gap, sizeof(RECORD_GAP) ) == 0));
+}
+
+static FILE *
+TestCapture (
+    __in_ecount(Count) PTEST_BATCH Batches,
+    __in ULONG Count
+    )
+{
+    FILE *file = tmpfile();
+    ULONG batch;
+
+    CHECK( file != NULL );
+
+    if (file == NULL) {
+
+        return NULL;
+    }
+
+    CHECK( CaptureWriteHeader( file, 10000000, 132000000000000000LL ) );
+
+    for (batch = 0; batch < Count; batch++) {
+
+        CHECK( CaptureWriteBatch( file, Batches[batch].Ticks, Batches[batch].Buffer, Batches[batch].Length ) );
+    }
+
+    //
+    //  An empty reply, as the log thread captures when the filter has
+    //  nothing to send.
+    //
+
+    CHECK( CaptureWriteBatch( file, Batches[Count - 1].Ticks + 1, NULL, 0 ) );
+
+    CHECK( fflush( file ) == 0 );
+    rewind( file );
+
+    return file;
+}
+
+
+static VOID
+TestRoundTrip (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Capture, replay, and every record decodes as it did going in, is
+    acknowledged on its lane, passes the sequence checks and comes out
+    of the merge in time order.
+
+--*/
+{
+    static TEST_BATCH batches[TEST_BATCHES];
+    static PVOID replayed[TEST_BUFFER_SIZE / sizeof(PVOID)];
+    CAPTURE_FILE_HEADER fileHeader;
+    CAPTURE_BATCH_HEADER header;
+    LOG_SEQUENCE sequence;
+    LOG_MERGE merge;
+    TEST_OUTPUT output;
+    MSPY_BATCH original;
+    MSPY_BATCH replay;
+    FILE *file;
+    ULONG batch = 0;
+    ULONG records = 0;
+    ULONG index;
+    ULONG used;
+    ULONG queue;
+
+    FakeBatches( batches );
+    file = TestCapture( batches, TEST_BATCHES );
+
+    if (file == NULL) {
+
+        return;
+    }
+
+    memset( &original, 0, sizeof(original) );
+    memset( &replay, 0, sizeof(replay) );
+    memset( &output, 0, sizeof(output) );
+
+    SequenceReset( &sequence );
+    MergeInitialize( &merge, TEST_MERGE_WINDOW );
+    output.Merge = &merge;
+    output.InOrder = TRUE;
+
+    CHECK( CaptureReadHeader( file, &fileHeader ) );
+    CHECK( fileHeader.Frequency.QuadPart == 10000000 );
+    CHECK( fileHeader.Started.QuadPart == 132000000000000000LL );
+
+    while (CaptureReadBatch( file, &header, replayed, sizeof(replayed) )) {
+
+        if (header.Length == 0) {
+
+            CHECK( batch == TEST_BATCHES );
+            batch++;
+            continue;
+        }
+
+        CHECK( batch < TEST_BATCHES );
+
+        if (batch >= TEST_BATCHES) {
+
+            break;
+        }
+
+        CHECK( header.Length == batches[batch].Length );
+        CHECK( header.Ticks.QuadPart == batches[batch].Ticks );
+        CHECK( memcmp( replayed, batches[batch].Buffer, header.Length ) == 0 );
+
+        records += ReplayBatch( &sequence, replayed, header.Length, TestTakeRecord, &output, &used );
+        CHECK( used == header.Length );
+
+        TestDrain( &output, FALSE );
+
+        CHECK( MspyDecodeBatch( batches[batch].Buffer, batches[batch].Length,
+                                MSPY_FIELD_ALL, MspyEncodingUtf16, NULL, &original ) );
+        CHECK( MspyDecodeBatch( replayed, header.Length,
+                                MSPY_FIELD_ALL, MspyEncodingUtf16, NULL, &replay ) );
+        CHECK( original.Count == TEST_BATCH_RECORDS );
+        CHECK( replay.Count == original.Count );
+
+        for (index = 0; index < original.Count && index < replay.Count; index++) {
+
+            CHECK( RecordsEqual( &original.Records[index], &replay.Records[index] ) );
+        }
+
+        batch++;
+    }
+
+    CHECK( batch == TEST_BATCHES + 1 );
+    CHECK( records == TEST_BATCHES * TEST_BATCH_RECORDS );
+
+    TestDrain( &output, TRUE );
+
+    CHECK( output.Count == records );
+    CHECK( output.Priority == TEST_BATCHES );
+    CHECK( output.InOrder );
+    CHECK( merge.Count == 0 );
+
+    //
+    //  The gap accounted for the numbers it skipped, and each lane is to
+    //  be acknowledged up to its last record.
+    //
+
+    for (queue = 0; queue < LOG_QUEUES; queue++) {
+
+        CHECK( sequence.Missing[queue] == 0 );
+    }
+
+    CHECK( sequence.Received[0] == sequence.NextSequence[0] - 1 );
+    CHECK( sequence.Received[3] == sequence.NextSequence[3] - 1 );
+    CHECK( sequence.Received[3] == sequence.Received[2] + 9 );
+    CHECK( sequence.Received[4] == 0 );
+    CHECK( sequence.Received[LOG_QUEUES] == TEST_BATCHES );
+    CHECK( sequence.NextPrioritySequence == TEST_BATCHES + 1 );
+
+    MergeCleanup( &merge );
+    MspyResetBatch( &original );
+    MspyResetBatch( &replay );
+    fclose( file );
+}
+
+
+static VOID
+TestTruncated (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A capture cut short in the middle of a batch, as by a crash, plays
+    back up to the last whole batch; a file that is not a capture does
+    not play at all.
+
+--*/
+{
+    static TEST_BATCH batches[TEST_BATCHES];
+    static UCHAR bytes[TEST_BATCHES * TEST_BUFFER_SIZE];
+    static PVOID replayed[TEST_BUFFER_SIZE / sizeof(PVOID)];
+    CAPTURE_FILE_HEADER fileHeader;
+    CAPTURE_BATCH_HEADER header;
+    FILE *file;
+    FILE *cut;
+    size_t length;
+    ULONG batch;
+
+    FakeBatches( batches );
+    file = TestCapture( batches, 3 );
+
+    if (file == NULL) {
+
+        return;
+    }
+
+    length = fread( bytes, 1, sizeof(bytes), file );
+    fclose( file );
+
+    CHECK( length == sizeof(CAPTURE_FILE_HEADER) +
+                     3 * sizeof(CAPTURE_BATCH_HEADER) + sizeof(CAPTURE_BATCH_HEADER) +
+                     batches[0].Length + batches[1].Length + batches[2].Length );
+
+    cut = tmpfile();
+    CHECK( cut != NULL );
+
+    if (cut == NULL) {
+
+        return;
+    }
+
+    CHECK( fwrite( bytes, length - sizeof(CAPTURE_BATCH_HEADER) - 100, 1, cut ) == 1 );
+    rewind( cut );
+
+    CHECK( CaptureReadHeader( cut, &fileHeader ) );
+
+    for (batch = 0; CaptureReadBatch( cut, &header, replayed, sizeof(replayed) ); batch++) {
+
+        CHECK( header.Length == batches[batch].Length );
+    }
+
+    CHECK( batch == 2 );
+
+    //
+    //  A batch longer than the buffer is not read.
+    //
+
+    fseek( cut, sizeof(CAPTURE_FILE_HEADER), SEEK_SET );
+    CHECK( !CaptureReadBatch( cut, &header, replayed, batches[0].Length - 1 ) );
+
+    rewind( cut );
+    bytes[0] ^= 0xFF;
+    CHECK( fwrite( bytes, sizeof(CAPTURE_FILE_HEADER), 1, cut ) == 1 );
+    rewind( cut );
+    CHECK( !CaptureReadHeader( cut, &fileHeader ) );
+
+    fclose( cut );
+}
+
+
+static VOID
+TestSequence (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Numbers skipped with no gap record are counted as missing, a gap
+    record that does not match the numbers skipped counts the rest, and
+    a record that does not fit stops the walk short of it.  The checks
+    print what they find, as they do in minispy.
+
+--*/
+{
+    static PVOID buffer[TEST_BUFFER_SIZE / sizeof(PVOID)];
+    static TEST_BATCH batches[TEST_BATCHES];
+    FAKE_SOURCE source;
+    LOG_SEQUENCE sequence;
+    LOG_MERGE merge;
+    TEST_OUTPUT output;
+    PLOG_RECORD first;
+    PLOG_RECORD logRecord;
+    PRECORD_GAP gap;
+    ULONG used;
+    ULONG records;
+
+    memset( &output, 0, sizeof(output) );
+    MergeInitialize( &merge, 0 );
+    output.Merge = &merge;
+
+    FakeStart( &source );
+    FakeBatch( &source, buffer, sizeof(buffer) );
+
+    FakeOperation( &source, RECORD_TYPE_NORMAL, 1 );
+    source.Sequence[1] += 4;
+    FakeOperation( &source, RECORD_TYPE_NORMAL, 1 );
+
+    FakeOperation( &source, RECORD_TYPE_NORMAL, 2 );
+    gap = FakeGap( &source, 2, 6 );
+    gap->FirstSequence += 2;
+    gap->Count -= 2;
+
+    SequenceReset( &sequence );
+    records = ReplayBatch( &sequence, buffer, source.Used, TestTakeRecord, &output, &used );
+    TestDrain( &output, TRUE );
+
+    CHECK( records == 4 );
+    CHECK( used == source.Used );
+    CHECK( output.Count == 4 );
+    CHECK( sequence.Missing[1] == 4 );
+    CHECK( sequence.Missing[2] == 2 );
+    CHECK( sequence.Received[1] == 6 );
+    CHECK( sequence.Received[2] == 8 );
+
+    //
+    //  A restart of the filter starts the checks over.
+    //
+
+    FakeStart( &source );
+    FakeBatch( &source, buffer, sizeof(buffer) );
+    FakeOperation( &source, RECORD_TYPE_NORMAL, 1 );
+
+    ReplayBatch( &sequence, buffer, source.Used, TestTakeRecord, &output, &used );
+    TestDrain( &output, TRUE );
+
+    CHECK( sequence.Missing[1] == 0 );
+    CHECK( sequence.Missing[2] == 0 );
+    CHECK( sequence.NextSequence[1] == 2 );
+
+    //
+    //  A record running past the end, and one too short to be one.
+    //
+
+    FakeBatches( batches );
+    first = (PLOG_RECORD) Add2Ptr( batches[0].Buffer, 0 );
+    logRecord = (PLOG_RECORD) Add2Ptr( first, first->Length );
+
+    SequenceReset( &sequence );
+    records = ReplayBatch( &sequence, first, first->Length + logRecord->Length - 1, TestTakeRecord, &output, &used );
+    TestDrain( &output, TRUE );
+
+    CHECK( records == 1 );
+    CHECK( used == first->Length );
+
+    logRecord->Length = sizeof(LOG_RECORD);
+
+    SequenceReset( &sequence );
+    records = ReplayBatch( &sequence, first, batches[0].Length, TestTakeRecord, &output, &used );
+    TestDrain( &output, TRUE );
+
+    CHECK( records == 1 );
+    CHECK( used == first->Length );
+
+    MergeCleanup( &merge );
+}
+
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    (void) argc;
+    (void) argv;
+
+    TestRoundTrip();
+    TestTruncated();
+    TestSequence();
+
+    if (Failures != 0) {
+
+        printf( "mspyReplayTest: %u checks failed\n", Failures );
+        return 1;
+    }
+
+    printf( "mspyReplayTest: passed\n" );
+    return 0;
+}
@@ -0,0 +1,805 @@
+/*++
+
+Module Name:
+
+    mspySearchTest.c
+
+Abstract:
+
+    Tests the search of mspySearch.c over a log written by mspyWriter.c,
+    without the filter.  The fake records are a function of their
+    number, so what each query should find is counted by walking the
+    numbers again; the search must find exactly that with the indexes,
+    without them, and with indexes that are damaged, missing or still
+    being written.
+
+    With -b a larger log is written and the same questions are timed
+    with the indexes and with a full scan.  The log goes to a directory
+    made under the current one, or under the directory given after the
+    number of records, and is removed afterwards.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "mspySearch.h"
+
+//
+//  Record i is made by one of TEST_PROCESSES processes, picked by a
+//  hash of i, in directory (i / TEST_RUN) % Directories, so that the
+//  activity moves from one directory to the next over time.  Records
+//  are TEST_TICK apart.
+//
+
+#define TEST_PROCESSES      64
+#define TEST_FILES          64
+#define TEST_RUN            1024
+#define TEST_TICK           1000
+#define TEST_START_TIME     132000000000000000LL
+
+#define TEST_BATCH_RECORDS  64
+#define TEST_BATCH_SIZE     (TEST_BATCH_RECORDS * 512)
+
+static ULONG Failures;
+
+#define CHECK(Condition)                                                \
+    ((Condition) ? (void) 0 :                                           \
+     (void) (Failures++, fprintf( stderr, "%s:%d: %s\n",                \
+                                  __FILE__, __LINE__, #Condition )))
+
+typedef struct _FAKE_RECORD {
+
+    ULONG Directory;
+    ULONG File;
+    ULONG Process;
+
+} FAKE_RECORD, *PFAKE_RECORD;
+
+//
+//  A question for the log, in the terms of the fake records; ~0 for
+//  anything.  Directory and file together are a file, directory alone
+//  everything under it.  Narrow says the index must rule out some
+//  blocks.
+//
+
+typedef struct _TEST_QUESTION {
+
+    PCSTR Name;
+    ULONG Directory;
+    ULONG File;
+    ULONG Process;
+    BOOLEAN ByImage;
+    ULONGLONG First;
+    ULONGLONG Last;
+    BOOLEAN Narrow;
+
+} TEST_QUESTION, *PTEST_QUESTION;
+
+//
+//  What the match routine saw.
+//
+
+typedef struct _TEST_MATCHES {
+
+    ULONGLONG Count;
+    ULONG LastSequence;
+    BOOLEAN InOrder;
+
+} TEST_MATCHES, *PTEST_MATCHES;
+
+#define TEST_ANY            ((ULONG) ~0)
+
+
+static VOID
+FakeRecordOf (
+    __in ULONGLONG Number,
+    __in ULONG Directories,
+    __out PFAKE_RECORD Fake
+    )
+{
+    ULONGLONG hash = (Number + 1) * 0x9E3779B97F4A7C15ULL;
+
+    hash ^= hash >> 29;
+
+    Fake->Directory = (ULONG) ((Number / TEST_RUN) % Directories);
+    Fake->File = (ULONG) ((hash >> 8) % TEST_FILES);
+    Fake->Process = (ULONG) ((hash >> 40) % TEST_PROCESSES);
+}
+
+static ULONG
+FakeAnsiPath (
+    __in ULONG Directory,
+    __in ULONG File,
+    __out_ecount(Size) CHAR *Path,
+    __in ULONG Size
+    )
+{
+    if (File == TEST_ANY) {
+
+        return (ULONG) snprintf( Path, Size, "\\Device\\HarddiskVolume2\\Data\\d%u", Directory );
+    }
+
+    return (ULONG) snprintf( Path, Size, "\\Device\\HarddiskVolume2\\Data\\d%u\\f%u.dat", Directory, File );
+}
+
+static ULONG
+FakeAnsiImage (
+    __in ULONG Process,
+    __out_ecount(Size) CHAR *Image,
+    __in ULONG Size
+    )
+{
+    return (ULONG) snprintf( Image, Size, "Tool%u.exe", Process );
+}
+
+static VOID
+FakeName (
+    __inout PLOG_RECORD LogRecord,
+    __in CONST CHAR *Name
+    )
+/*++
+
+Routine Description:
+
+    Appends one line to a record's name as SpySetRecordName does.
+
+--*/
+{
+    PWCHAR copy = (PWCHAR) Add2Ptr( LogRecord, LogRecord->Length );
+    ULONG count = (ULONG) strlen( Name );
+    ULONG length = count * sizeof(WCHAR) + sizeof(WCHAR);
+    ULONG rounded = ROUND_TO_SIZE( length, sizeof(PVOID) );
+    ULONG index;
+
+    for (index = 0; index < count; index++) {
+
+        copy[index] = (UCHAR) Name[index];
+    }
+
+    copy[count] = L'\n';
+
+    for (index = length / sizeof(WCHAR); index < rounded / sizeof(WCHAR); index++) {
+
+        copy[index] = L' ';
+    }
+
+    copy[rounded / sizeof(WCHAR)] = UNICODE_NULL;
+    LogRecord->Length += rounded;
+}
+
+static ULONG
+FakeBatch (
+    __out_bcount(TEST_BATCH_SIZE) PUCHAR Buffer,
+    __inout PULONGLONG Number,
+    __in ULONG Count,
+    __in ULONG Directories
+    )
+/*++
+
+Routine Description:
+
+    Packs records Number on, as GetMiniSpyLog returns them, and gives
+    their length.  The filter numbers records with 32 bits, and so does
+    this.
+
+--*/
+{
+    PLOG_RECORD logRecord;
+    FAKE_RECORD fake;
+    CHAR text[96];
+    CHAR image[64];
+    ULONG used = 0;
+
+    while (Count-- != 0) {
+
+        FakeRecordOf( *Number, Directories, &fake );
+
+        logRecord = (PLOG_RECORD) (Buffer + used);
+        memset( logRecord, 0, sizeof(LOG_RECORD) );
+
+        logRecord->Length = sizeof(LOG_RECORD);
+        logRecord->SequenceNumber = (ULONG) *Number;
+        logRecord->RecordType = RECORD_TYPE_NORMAL;
+        logRecord->Data.OriginatingTime.QuadPart = TEST_START_TIME + (LONGLONG) *Number * TEST_TICK;
+        logRecord->Data.ProcessId = 1000 + fake.Process;
+        logRecord->Data.Reserved[0] = 'W';
+
+        FakeAnsiPath( fake.Directory, fake.File, text, sizeof(text) );
+        FakeName( logRecord, text );
+        FakeAnsiImage( fake.Process, image, sizeof(image) );
+        snprintf( text, sizeof(text), "\\Program Files\\Tools\\%s", image );
+        FakeName( logRecord, text );
+        FakeName( logRecord, "S-1-5-21-1004336348-1177238915-682003330-512" );
+        logRecord->Length += ROUND_TO_SIZE( sizeof(UNICODE_NULL), sizeof(PVOID) );
+
+        used += logRecord->Length;
+        (*Number)++;
+    }
+
+    return used;
+}
+
+static BOOLEAN
+FakeLog (
+    __inout PLOG_WRITER Writer,
+    __in ULONGLONG Records,
+    __in ULONG Directories
+    )
+{
+    PVOID buffer[TEST_BATCH_SIZE / sizeof(PVOID)];
+    ULONGLONG number = 0;
+    ULONG count;
+    ULONG length;
+
+    while (number < Records) {
+
+        count = (Records - number < TEST_BATCH_RECORDS) ? (ULONG) (Records - number) : TEST_BATCH_RECORDS;
+        length = FakeBatch( (PUCHAR) buffer, &number, count, Directories );
+
+        if (!LogWriterAppend( Writer, buffer, length, count )) {
+
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static VOID
+TestMakeDirectory (
+    __out_ecount(LOG_FILE_PATH) CHAR *Directory,
+    __in CONST CHAR *Parent
+    )
+{
+    if (snprintf( Directory, LOG_FILE_PATH, "%s/mspySearchTest.XXXXXX", Parent ) >= LOG_FILE_PATH ||
+        mkdtemp( Directory ) == NULL) {
+
+        perror( Directory );
+        exit( 2 );
+    }
+}
+
+static VOID
+TestRemoveDirectory (
+    __in CONST CHAR *Directory
+    )
+{
+    CHAR path[LOG_FILE_PATH];
+    struct dirent *entry;
+    DIR *directory = opendir( Directory );
+
+    if (directory == NULL) {
+
+        return;
+    }
+
+    while ((entry = readdir( directory )) != NULL) {
+
+        if (strcmp( entry->d_name, "." ) != 0 && strcmp( entry->d_name, ".." ) != 0) {
+
+            if (snprintf( path, sizeof(path), "%s/%s", Directory, entry->d_name ) < (int) sizeof(path)) {
+
+                unlink( path );
+            }
+        }
+    }
+
+    closedir( directory );
+    rmdir( Directory );
+}
+
+static ULONGLONG
+TestSize (
+    __in CONST CHAR *Directory,
+    __in CONST CHAR *Suffix
+    )
+/*++
+
+Routine Description:
+
+    Adds up the sizes of the files in Directory whose names end in
+    Suffix.
+
+--*/
+{
+    CHAR path[LOG_FILE_PATH];
+    struct dirent *entry;
+    struct stat status;
+    ULONGLONG size = 0;
+    size_t length;
+    DIR *directory = opendir( Directory );
+
+    if (directory == NULL) {
+
+        return 0;
+    }
+
+    while ((entry = readdir( directory )) != NULL) {
+
+        length = strlen( entry->d_name );
+
+        if (length > strlen( Suffix ) &&
+            strcmp( entry->d_name + length - strlen( Suffix ), Suffix ) == 0 &&
+            snprintf( path, sizeof(path), "%s/%s", Directory, entry->d_name ) < (int) sizeof(path) &&
+            stat( path, &status ) == 0) {
+
+            size += (ULONGLONG) status.st_size;
+        }
+    }
+
+    closedir( directory );
+    return size;
+}
+
+static VOID
+TestMatch (
+    __in PVOID Context,
+    __in PLOG_RECORD LogRecord
+    )
+{
+    PTEST_MATCHES matches = Context;
+
+    matches->InOrder = matches->InOrder &&
+                       (matches->Count == 0 || LogRecord->SequenceNumber > matches->LastSequence);
+    matches->LastSequence = LogRecord->SequenceNumber;
+    matches->Count++;
+}
+
+static VOID
+TestAsk (
+    __in PTEST_QUESTION Question,
+    __in BOOLEAN Scan,
+    __in BOOLEAN UpperCase,
+    __out PLOG_SEARCH Search,
+    __out PTEST_MATCHES Matches
+    )
+/*++
+
+Routine Description:
+
+    Sets up a search for a question.  UpperCase asks for the names in
+    upper case, which must find the same records.
+
+--*/
+{
+    CHAR text[LOG_FILE_PATH];
+    ULONG length = 0;
+    ULONG i;
+
+    CHECK( LogSearchInitialize( Search ) );
+
+    memset( Matches, 0, sizeof(TEST_MATCHES) );
+    Matches->InOrder = TRUE;
+
+    Search->Scan = Scan;
+    Search->Match = TestMatch;
+    Search->MatchContext = Matches;
+
+    if (Question->Directory != TEST_ANY) {
+
+        length = FakeAnsiPath( Question->Directory, Question->File, text, sizeof(text) );
+
+        for (i = 0; i < length; i++) {
+
+            Search->Path[i] = (WCHAR) (UpperCase ? toupper( text[i] ) : text[i]);
+        }
+
+        Search->PathLength = length;
+    }
+
+    if (Question->Process != TEST_ANY) {
+
+        if (Question->ByImage) {
+
+            length = FakeAnsiImage( Question->Process, text, sizeof(text) );
+
+            for (i = 0; i < length; i++) {
+
+                Search->Image[i] = (WCHAR) (UpperCase ? toupper( text[i] ) : text[i]);
+            }
+
+            Search->ImageLength = length;
+
+        } else {
+
+            Search->ByProcessId = TRUE;
+            Search->ProcessId = 1000 + Question->Process;
+        }
+    }
+
+    if (Question->First != 0) {
+
+        Search->From.QuadPart = TEST_START_TIME + (LONGLONG) Question->First * TEST_TICK;
+    }
+
+    if (Question->Last != 0) {
+
+        Search->To.QuadPart = TEST_START_TIME + (LONGLONG) Question->Last * TEST_TICK;
+    }
+}
+
+static ULONGLONG
+TestExpected (
+    __in PTEST_QUESTION Question,
+    __in ULONGLONG Records,
+    __in ULONG Directories
+    )
+/*++
+
+Routine Description:
+
+    Counts the records that answer a question by making them again.
+
+--*/
+{
+    FAKE_RECORD fake;
+    ULONGLONG expected = 0;
+    ULONGLONG number;
+    ULONGLONG last = (Question->Last != 0 && Question->Last < Records) ? Question->Last + 1 : Records;
+
+    for (number = Question->First; number < last; number++) {
+
+        FakeRecordOf( number, Directories, &fake );
+
+        if ((Question->Directory == TEST_ANY || fake.Directory == Question->Directory) &&
+            (Question->File == TEST_ANY || fake.File == Question->File) &&
+            (Question->Process == TEST_ANY || fake.Process == Question->Process)) {
+
+            expected++;
+        }
+    }
+
+    return expected;
+}
+
+//---------------------------------------------------------------------------
+//                    Tests
+//---------------------------------------------------------------------------
+
+//
+//  About 36 MB of log; directory n is written from record n * TEST_RUN
+//  on.  Every process writes to every block, so only the index of a
+//  narrow question rules blocks out.
+//
+
+#define TEST_RECORDS        100000
+#define TEST_DIRECTORIES    100
+
+static TEST_QUESTION TestQuestions[] = {
+
+    { "everything",             TEST_ANY, TEST_ANY, TEST_ANY, FALSE, 0, 0, FALSE },
+    { "file",                   17, 5, TEST_ANY, FALSE, 0, 0, TRUE },
+    { "directory",              42, TEST_ANY, TEST_ANY, FALSE, 0, 0, TRUE },
+
+    //
+    //  "d1" is the start of "d10" to "d19", which are not under it.
+    //
+
+    { "directory prefix",       1, TEST_ANY, TEST_ANY, FALSE, 0, 0, TRUE },
+    { "image",                  TEST_ANY, TEST_ANY, 7, TRUE, 0, 0, FALSE },
+    { "process id",             TEST_ANY, TEST_ANY, 63, FALSE, 0, 0, FALSE },
+    { "time",                   TEST_ANY, TEST_ANY, TEST_ANY, FALSE, 30000, 40000, TRUE },
+    { "file in time",           80, 12, TEST_ANY, FALSE, 70000, 95000, TRUE },
+    { "file out of time",       80, 12, TEST_ANY, FALSE, 10000, 20000, TRUE },
+    { "image under directory",  3, TEST_ANY, 20, TRUE, 0, 0, TRUE },
+    { "no such file",           TEST_DIRECTORIES + 5, 1, TEST_ANY, FALSE, 0, 0, TRUE },
+};
+
+static VOID
+TestQuestionsOver (
+    __in CONST CHAR *Directory,
+    __in BOOLEAN Indexed
+    )
+/*++
+
+Routine Description:
+
+    Asks every question with and without the indexes and in either case,
+    and checks the answers against the records made again.  Indexed says
+    whether the indexes are whole, so narrow questions must skip blocks.
+
+--*/
+{
+    LOG_SEARCH search;
+    LOG_SEARCH scan;
+    TEST_MATCHES matches;
+    TEST_MATCHES scanMatches;
+    ULONGLONG expected;
+    ULONG i;
+
+    for (i = 0; i < sizeof(TestQuestions) / sizeof(TestQuestions[0]); i++) {
+
+        expected = TestExpected( &TestQuestions[i], TEST_RECORDS, TEST_DIRECTORIES );
+
+        TestAsk( &TestQuestions[i], FALSE, (BOOLEAN) (i & 1), &search, &matches );
+        CHECK( LogSearchDirectory( &search, Directory ) != 0 );
+
+        TestAsk( &TestQuestions[i], TRUE, FALSE, &scan, &scanMatches );
+        CHECK( LogSearchDirectory( &scan, Directory ) != 0 );
+
+        if (search.RecordsMatched != expected || scan.RecordsMatched != expected) {
+
+            fprintf( stderr, "%s: %llu matched with the index and %llu without, %llu expected\n",
+                     TestQuestions[i].Name,
+                     (unsigned long long) search.RecordsMatched,
+                     (unsigned long long) scan.RecordsMatched,
+                     (unsigned long long) expected );
+        }
+
+        CHECK( search.RecordsMatched == expected );
+        CHECK( scan.RecordsMatched == expected );
+        CHECK( matches.Count == expected && matches.InOrder );
+        CHECK( scanMatches.Count == expected && scanMatches.InOrder );
+
+        CHECK( scan.RecordsRead == TEST_RECORDS );
+        CHECK( scan.BlocksSkipped == 0 );
+        CHECK( search.BlocksRead + search.BlocksSkipped == scan.BlocksRead );
+
+        if (Indexed && TestQuestions[i].Narrow) {
+
+            CHECK( search.BlocksSkipped != 0 );
+        }
+
+        LogSearchCleanup( &search );
+        LogSearchCleanup( &scan );
+    }
+}
+
+static VOID
+TestIndexed (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A log of full blocks over several segments, searched with its
+    indexes whole, then with one index cut off in the middle of an entry
+    and another gone.
+
+--*/
+{
+    CHAR directory[LOG_FILE_PATH];
+    CHAR path[LOG_FILE_PATH];
+    LOG_WRITER writer;
+    struct stat status;
+
+    TestMakeDirectory( directory, "." );
+    CHECK( LogWriterInitialize( &writer ) );
+    CHECK( LogWriterStart( &writer, directory, 4, 60000, 0 ) == ERROR_SUCCESS );
+    CHECK( FakeLog( &writer, TEST_RECORDS, TEST_DIRECTORIES ) );
+    LogWriterStop( &writer );
+
+    CHECK( writer.Segments >= 3 );
+
+    TestQuestionsOver( directory, TRUE );
+
+    CHECK( snprintf( path, sizeof(path), "%s/%s%08u%s",
+                     directory, LOG_SEGMENT_PREFIX, 0, LOG_INDEX_SUFFIX ) < (int) sizeof(path) );
+    CHECK( stat( path, &status ) == 0 &&
+           status.st_size >= 2 * sizeof(LOG_INDEX_ENTRY) &&
+           status.st_size % sizeof(LOG_INDEX_ENTRY) == 0 );
+    CHECK( truncate( path, sizeof(LOG_INDEX_ENTRY) + sizeof(LOG_INDEX_ENTRY) / 2 ) == 0 );
+
+    CHECK( snprintf( path, sizeof(path), "%s/%s%08u%s",
+                     directory, LOG_SEGMENT_PREFIX, 1, LOG_INDEX_SUFFIX ) < (int) sizeof(path) );
+    CHECK( unlink( path ) == 0 );
+
+    TestQuestionsOver( directory, FALSE );
+
+    LogWriterCleanup( &writer );
+    TestRemoveDirectory( directory );
+}
+
+static VOID
+TestWriting (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A log searched while it is written: the committed blocks are found
+    in the preallocated segment, and the block still being filled is
+    not.
+
+--*/
+{
+    CHAR directory[LOG_FILE_PATH];
+    LOG_WRITER writer;
+    LOG_SEARCH search;
+    TEST_MATCHES matches;
+    TEST_QUESTION everything = { "everything", TEST_ANY, TEST_ANY, TEST_ANY, FALSE, 0, 0 };
+    PVOID buffer[TEST_BATCH_SIZE / sizeof(PVOID)];
+    ULONGLONG number = 0;
+    ULONG length;
+
+    TestMakeDirectory( directory, "." );
+    CHECK( LogWriterInitialize( &writer ) );
+    CHECK( LogWriterStart( &writer, directory, 4, 60000, 0 ) == ERROR_SUCCESS );
+
+    length = FakeBatch( (PUCHAR) buffer, &number, TEST_BATCH_RECORDS, TEST_DIRECTORIES );
+    CHECK( LogWriterAppend( &writer, buffer, length, TEST_BATCH_RECORDS ) );
+    CHECK( LogWriterTick( &writer, TRUE ) );
+
+    length = FakeBatch( (PUCHAR) buffer, &number, TEST_BATCH_RECORDS, TEST_DIRECTORIES );
+    CHECK( LogWriterAppend( &writer, buffer, length, TEST_BATCH_RECORDS ) );
+
+    TestAsk( &everything, FALSE, FALSE, &search, &matches );
+    LogSearchDirectory( &search, directory );
+
+    CHECK( search.RecordsMatched == TEST_BATCH_RECORDS );
+    CHECK( matches.InOrder );
+    LogSearchCleanup( &search );
+
+    LogWriterStop( &writer );
+
+    TestAsk( &everything, FALSE, FALSE, &search, &matches );
+    LogSearchDirectory( &search, directory );
+
+    CHECK( search.RecordsMatched == 2 * TEST_BATCH_RECORDS );
+    CHECK( search.BlocksRead == 2 );
+    LogSearchCleanup( &search );
+
+    LogWriterCleanup( &writer );
+    TestRemoveDirectory( directory );
+}
+
+//---------------------------------------------------------------------------
+//                    Benchmark
+//---------------------------------------------------------------------------
+
+static double
+Seconds (
+    __in struct timespec *Start
+    )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (now.tv_sec - Start->tv_sec) + (now.tv_nsec - Start->tv_nsec) / 1e9;
+}
+
+static int
+Benchmark (
+    __in ULONGLONG Records,
+    __in CONST CHAR *Parent
+    )
+/*++
+
+Routine Description:
+
+    Writes a log of Records records, then asks who touched a file
+    between two times, what happened under a directory, and what one
+    process did in an hour's worth of records, each with the indexes
+    and with a full scan.
+
+    A log larger than memory is read from disk by the scan; a smaller
+    one may be read from the page cache, which flatters the scan.
+
+--*/
+{
+    CHAR directory[LOG_FILE_PATH];
+    LOG_WRITER writer;
+    LOG_SEARCH search;
+    TEST_MATCHES matches;
+    TEST_QUESTION questions[3];
+    struct timespec start;
+    double elapsed;
+    ULONG directories = (ULONG) (Records / (TEST_RUN * 2)) + 1;
+    ULONG i;
+    ULONG scan;
+
+    //
+    //  A file in the middle of the log between two times a tenth of the
+    //  log apart; a directory over all time; one process over a hundredth
+    //  of the log.
+    //
+
+    memset( questions, 0, sizeof(questions) );
+
+    questions[0].Name = "file between two times";
+    questions[0].Directory = (ULONG) ((Records / 2 / TEST_RUN) % directories);
+    questions[0].File = 5;
+    questions[0].Process = TEST_ANY;
+    questions[0].First = Records / 2 - Records / 20;
+    questions[0].Last = Records / 2 + Records / 20;
+
+    questions[1].Name = "directory";
+    questions[1].Directory = directories / 3;
+    questions[1].File = TEST_ANY;
+    questions[1].Process = TEST_ANY;
+
+    questions[2].Name = "process over 1%";
+    questions[2].Directory = TEST_ANY;
+    questions[2].File = TEST_ANY;
+    questions[2].Process = 9;
+    questions[2].ByImage = TRUE;
+    questions[2].First = Records / 4;
+    questions[2].Last = Records / 4 + Records / 100;
+
+    TestMakeDirectory( directory, Parent );
+    CHECK( LogWriterInitialize( &writer ) );
+
+    if (LogWriterStart( &writer, directory, 256, 1000, 0 ) != ERROR_SUCCESS) {
+
+        printf( "cannot write to %s: error %u\n", directory, writer.LastError );
+        TestRemoveDirectory( directory );
+        return 1;
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    CHECK( FakeLog( &writer, Records, directories ) );
+    LogWriterStop( &writer );
+    elapsed = Seconds( &start );
+
+    printf( "wrote %llu records in %.1f s: %llu MB of log in %lu segments, %llu MB of index\n",
+            (unsigned long long) writer.RecordsWritten,
+            elapsed,
+            (unsigned long long) (TestSize( directory, LOG_SEGMENT_SUFFIX ) >> 20),
+            (unsigned long) writer.Segments,
+            (unsigned long long) (TestSize( directory, LOG_INDEX_SUFFIX ) >> 20) );
+
+    for (i = 0; i < sizeof(questions) / sizeof(questions[0]); i++) {
+
+        for (scan = 0; scan < 2; scan++) {
+
+            TestAsk( &questions[i], (BOOLEAN) scan, FALSE, &search, &matches );
+
+            clock_gettime( CLOCK_MONOTONIC, &start );
+            LogSearchDirectory( &search, directory );
+            elapsed = Seconds( &start );
+
+            printf( "%-24s %-5s %9.1f ms, %10llu matched, %8llu blocks (%7llu MB) read, %8llu skipped\n",
+                    questions[i].Name,
+                    scan ? "scan" : "index",
+                    elapsed * 1000,
+                    (unsigned long long) search.RecordsMatched,
+                    (unsigned long long) search.BlocksRead,
+                    (unsigned long long) (search.BytesRead >> 20),
+                    (unsigned long long) search.BlocksSkipped );
+
+            LogSearchCleanup( &search );
+        }
+    }
+
+    LogWriterCleanup( &writer );
+    TestRemoveDirectory( directory );
+
+    return (Failures != 0);
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? strtoull( argv[2], NULL, 10 ) : 10000000,
+                          argc > 3 ? argv[3] : "." );
+    }
+
+    TestIndexed();
+    TestWriting();
+
+    if (Failures != 0) {
+
+        printf( "mspySearchTest: %u checks failed\n", Failures );
+        return 1;
+    }
+
+    printf( "mspySearchTest: passed\n" );
+    return 0;
+}
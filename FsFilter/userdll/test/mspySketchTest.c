@@ -0,0 +1,768 @@
+/*++
+
+Module Name:
+
+    mspySketchTest.c
+
+Abstract:
+
+    Tests the sketches of mspySketch.c against exact counts, without the
+    filter.  Records are made with times around the present, as the log
+    thread would add them, and the top lists, the distinct counts and
+    the counts by access type are checked against what was added: the
+    busiest keys must be found, Count-Min estimates must never be low
+    and stay within their error bound, HyperLogLog must be within a few
+    percent, and records must leave the window as their minute or hour
+    comes round again.
+
+    With -b records are added as fast as one thread, and then several,
+    can add them, and the reports are timed.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mspySketch.h"
+
+#define TEST_MINUTE         (60 * 10000000LL)
+
+#define TEST_PATHS          20000
+#define TEST_RECORDS        200000
+#define TEST_THREADS        4
+
+static ULONG Failures;
+
+#define CHECK(Condition)                                                \
+    ((Condition) ? (void) 0 :                                           \
+     (void) (Failures++, fprintf( stderr, "%s:%d: %s\n",                \
+                                  __FILE__, __LINE__, #Condition )))
+
+//
+//  Room for one record with three names of up to a few hundred
+//  characters.
+//
+
+typedef union _TEST_RECORD {
+
+    LOG_RECORD LogRecord;
+    UCHAR Buffer[4096];
+
+} TEST_RECORD, *PTEST_RECORD;
+
+
+static VOID
+FakeName (
+    __inout PLOG_RECORD LogRecord,
+    __in CONST CHAR *Name
+    )
+/*++
+
+Routine Description:
+
+    Appends one line to a record's name as SpySetRecordName does.
+
+--*/
+{
+    PWCHAR copy = (PWCHAR) Add2Ptr( LogRecord, LogRecord->Length );
+    ULONG count = (ULONG) strlen( Name );
+    ULONG length = count * sizeof(WCHAR) + sizeof(WCHAR);
+    ULONG rounded = ROUND_TO_SIZE( length, sizeof(PVOID) );
+    ULONG index;
+
+    for (index = 0; index < count; index++) {
+
+        copy[index] = (UCHAR) Name[index];
+    }
+
+    copy[count] = L'\n';
+
+    for (index = length / sizeof(WCHAR); index < rounded / sizeof(WCHAR); index++) {
+
+        copy[index] = L' ';
+    }
+
+    copy[rounded / sizeof(WCHAR)] = UNICODE_NULL;
+    LogRecord->Length += rounded;
+}
+
+static VOID
+FakeRecord (
+    __out PTEST_RECORD Record,
+    __in LONGLONG Time,
+    __in CHAR Disposition,
+    __in ULONG Path,
+    __in ULONG Process,
+    __in ULONG User
+    )
+/*++
+
+Routine Description:
+
+    Makes a record of a file operation at Time by process Process and
+    user User on file Path.
+
+--*/
+{
+    PLOG_RECORD logRecord = &Record->LogRecord;
+    CHAR text[128];
+
+    memset( logRecord, 0, sizeof(LOG_RECORD) );
+
+    logRecord->Length = sizeof(LOG_RECORD);
+    logRecord->RecordType = RECORD_TYPE_NORMAL;
+    logRecord->Data.OriginatingTime.QuadPart = Time;
+    logRecord->Data.ProcessId = 1000 + Process;
+    logRecord->Data.Reserved[0] = Disposition;
+
+    snprintf( text, sizeof(text), "\\Device\\HarddiskVolume2\\Data\\f%u.dat", Path );
+    FakeName( logRecord, text );
+    snprintf( text, sizeof(text), "\\Program Files\\Tools\\Tool%u.exe", Process );
+    FakeName( logRecord, text );
+    snprintf( text, sizeof(text), "S-1-5-21-1004336348-1177238915-682003330-%u", 1000 + User );
+    FakeName( logRecord, text );
+    logRecord->Length += ROUND_TO_SIZE( sizeof(UNICODE_NULL), sizeof(PVOID) );
+}
+
+static ULONG
+TestNameNumber (
+    __in CONST WCHAR *Name,
+    __in WCHAR Letter
+    )
+/*++
+
+Routine Description:
+
+    Gives the number after the last Letter in a name FakeRecord made,
+    ~0 if there is none.
+
+--*/
+{
+    CONST WCHAR *last = NULL;
+    ULONG number = 0;
+
+    for (; *Name != UNICODE_NULL; Name++) {
+
+        if (*Name == Letter) {
+
+            last = Name;
+        }
+    }
+
+    if (last == NULL || last[1] < L'0' || last[1] > L'9') {
+
+        return (ULONG) ~0;
+    }
+
+    for (last++; *last >= L'0' && *last <= L'9'; last++) {
+
+        number = number * 10 + (*last - L'0');
+    }
+
+    return number;
+}
+
+static ULONG
+TestRandom (
+    __inout PULONGLONG State
+    )
+{
+    *State ^= *State << 13;
+    *State ^= *State >> 7;
+    *State ^= *State << 17;
+
+    return (ULONG) (*State >> 32);
+}
+
+static ULONG
+TestSkewed (
+    __inout PULONGLONG State,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Picks a number below Count, small ones far more often than large
+    ones, as a few files take most of the traffic.
+
+--*/
+{
+    double u = TestRandom( State ) / 4294967296.0;
+
+    return (ULONG) (pow( Count + 1, u ) - 1) % Count;
+}
+
+static LONGLONG
+TestNow (
+    VOID
+    )
+{
+    LARGE_INTEGER now;
+
+    LogClockSystemTime( &now );
+    return now.QuadPart;
+}
+
+//---------------------------------------------------------------------------
+//                    Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestTop (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Adds skewed traffic over the last half hour and checks the top
+    files: the busiest twenty must all be found, no estimate may be
+    below the exact count, nor above it by more than the Count-Min bound
+    summed over the buckets, e / SKETCH_CM_WIDTH of the records for each
+    access type counted.
+
+--*/
+{
+    LOG_SKETCH sketch;
+    TEST_RECORD record;
+    SKETCH_COUNT top[40];
+    PULONG exact = calloc( TEST_PATHS, sizeof(ULONG) );
+    PULONG exactWrites = calloc( TEST_PATHS, sizeof(ULONG) );
+    ULONG order[20];
+    ULONGLONG state = 0x123456789ULL;
+    LONGLONG now = TestNow();
+    ULONG found;
+    ULONG path;
+    ULONG i;
+    ULONG j;
+
+    CHECK( exact != NULL && exactWrites != NULL && SketchInitialize( &sketch ) );
+
+    for (i = 0; i < TEST_RECORDS; i++) {
+
+        path = TestSkewed( &state, TEST_PATHS );
+        exact[path]++;
+
+        if (i % 3 == 1) {
+
+            exactWrites[path]++;
+        }
+
+        FakeRecord( &record, now - (i % 30) * TEST_MINUTE, "RWD"[i % 3], path, i % 50, i % 7 );
+        SketchAddRecord( &sketch, &record.LogRecord );
+    }
+
+    //
+    //  The exact top twenty, by selection.
+    //
+
+    for (i = 0; i < 20; i++) {
+
+        order[i] = (ULONG) ~0;
+
+        for (path = 0; path < TEST_PATHS; path++) {
+
+            for (j = 0; j < i && order[j] != path; j++) {
+            }
+
+            if (j == i && (order[i] == (ULONG) ~0 || exact[path] > exact[order[i]])) {
+
+                order[i] = path;
+            }
+        }
+    }
+
+    found = SketchTop( &sketch, SketchKeyPath, 0, 60, 40, top );
+    CHECK( found == 40 );
+
+    for (i = 0; i < found; i++) {
+
+        path = TestNameNumber( top[i].Name, L'f' );
+        CHECK( path < TEST_PATHS );
+
+        if (path < TEST_PATHS) {
+
+            CHECK( top[i].Estimate >= exact[path] );
+            CHECK( top[i].Estimate <= exact[path] + SKETCH_DISPOSITIONS * TEST_RECORDS * 3 / SKETCH_CM_WIDTH );
+        }
+
+        if (i > 0) {
+
+            CHECK( top[i].Estimate <= top[i - 1].Estimate );
+        }
+    }
+
+    for (i = 0; i < 20; i++) {
+
+        for (j = 0; j < found && TestNameNumber( top[j].Name, L'f' ) != order[i]; j++) {
+        }
+
+        CHECK( j < found );
+    }
+
+    //
+    //  One access type: a third of each file's traffic.
+    //
+
+    found = SketchTop( &sketch, SketchKeyPath, 'W', 60, 5, top );
+    CHECK( found == 5 );
+    CHECK( TestNameNumber( top[0].Name, L'f' ) == order[0] );
+    CHECK( top[0].Estimate >= exactWrites[order[0]] &&
+           top[0].Estimate <= exactWrites[order[0]] + TEST_RECORDS * 3 / SKETCH_CM_WIDTH );
+
+    for (i = 1; i < found; i++) {
+
+        path = TestNameNumber( top[i].Name, L'f' );
+        CHECK( path < TEST_PATHS && top[i].Estimate >= exactWrites[path] );
+    }
+
+    //
+    //  Fifty processes, seven users, evenly.
+    //
+
+    found = SketchTop( &sketch, SketchKeyProcess, 0, 60, 60, top );
+    CHECK( found == 50 );
+    CHECK( top[0].Estimate >= TEST_RECORDS / 50 );
+    CHECK( TestNameNumber( top[0].Name, L'l' ) < 50 );
+
+    found = SketchTop( &sketch, SketchKeyUser, 0, 60, 60, top );
+    CHECK( found == 7 );
+    CHECK( top[6].Estimate >= TEST_RECORDS / 7 );
+
+    SketchCleanup( &sketch );
+    free( exactWrites );
+    free( exact );
+}
+
+static VOID
+TestDistinct (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Checks the distinct counts for a range of sizes.  The standard error
+    of 1024 registers is about 3%; 10% is three times that.
+
+--*/
+{
+    static const ULONG sizes[] = { 1, 10, 100, 1000, 10000, 100000 };
+    LOG_SKETCH sketch;
+    TEST_RECORD record;
+    LONGLONG now = TestNow();
+    double estimate;
+    ULONG s;
+    ULONG i;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+
+        CHECK( SketchInitialize( &sketch ) );
+
+        //
+        //  Every file twice, from two minutes, so that duplicates and the
+        //  merging of buckets are both counted once.
+        //
+
+        for (i = 0; i < 2 * sizes[s]; i++) {
+
+            FakeRecord( &record, now - (i & 1) * TEST_MINUTE, 'R', i / 2, 0, 0 );
+            SketchAddRecord( &sketch, &record.LogRecord );
+        }
+
+        estimate = SketchDistinct( &sketch, SketchKeyPath, 0, 60 );
+        CHECK( fabs( estimate - sizes[s] ) <= 0.1 * sizes[s] + 0.5 );
+
+        estimate = SketchDistinct( &sketch, SketchKeyPath, 0, 600 );
+        CHECK( fabs( estimate - sizes[s] ) <= 0.1 * sizes[s] + 0.5 );
+
+        CHECK( SketchDistinct( &sketch, SketchKeyPath, 'W', 60 ) < 0.5 );
+        CHECK( fabs( SketchDistinct( &sketch, SketchKeyProcess, 0, 60 ) - 1 ) < 0.5 );
+
+        SketchCleanup( &sketch );
+    }
+}
+
+static VOID
+TestWindow (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Checks the exact counts by access type, and that records leave the
+    minute window after an hour and the hour window after a day.
+
+--*/
+{
+    LOG_SKETCH sketch;
+    TEST_RECORD record;
+    ULONGLONG counts[SKETCH_DISPOSITIONS];
+    LONGLONG now = TestNow();
+    ULONG i;
+
+    CHECK( SketchInitialize( &sketch ) );
+
+    //
+    //  Ninety minutes ago, then now: only the hour buckets reach back.
+    //
+
+    for (i = 0; i < 10; i++) {
+
+        FakeRecord( &record, now - 90 * TEST_MINUTE, 'D', i, 0, 0 );
+        SketchAddRecord( &sketch, &record.LogRecord );
+    }
+
+    for (i = 0; i < 6; i++) {
+
+        FakeRecord( &record, now, "-DdRWA"[i], i, 0, 0 );
+        SketchAddRecord( &sketch, &record.LogRecord );
+    }
+
+    FakeRecord( &record, now, 'x', 0, 0, 0 );
+    SketchAddRecord( &sketch, &record.LogRecord );
+
+    SketchDispositions( &sketch, 60, counts );
+    CHECK( counts[0] == 2 && counts[1] == 1 && counts[2] == 1 );
+    CHECK( counts[3] == 1 && counts[4] == 1 && counts[5] == 1 );
+
+    SketchDispositions( &sketch, 180, counts );
+    CHECK( counts[0] == 2 && counts[1] == 11 );
+
+    //
+    //  Records from exactly an hour ago fall in the bucket of this
+    //  minute, which already holds a later one, so the minute window
+    //  does not count them.
+    //
+
+    FakeRecord( &record, now - 60 * TEST_MINUTE, 'R', 0, 0, 0 );
+    SketchAddRecord( &sketch, &record.LogRecord );
+
+    SketchDispositions( &sketch, 60, counts );
+    CHECK( counts[3] == 1 );
+
+    SketchCleanup( &sketch );
+
+    //
+    //  The other way round: the old minute is emptied when the new one
+    //  arrives.  The same for the day.
+    //
+
+    CHECK( SketchInitialize( &sketch ) );
+
+    FakeRecord( &record, now - 60 * TEST_MINUTE, 'W', 0, 0, 0 );
+    SketchAddRecord( &sketch, &record.LogRecord );
+    FakeRecord( &record, now - 24 * 60 * TEST_MINUTE, 'A', 0, 0, 0 );
+    SketchAddRecord( &sketch, &record.LogRecord );
+
+    SketchDispositions( &sketch, 60, counts );
+    CHECK( counts[4] == 0 );
+
+    FakeRecord( &record, now, 'R', 0, 0, 0 );
+    SketchAddRecord( &sketch, &record.LogRecord );
+
+    SketchDispositions( &sketch, 60, counts );
+    CHECK( counts[3] == 1 && counts[4] == 0 );
+
+    SketchDispositions( &sketch, 24 * 60, counts );
+    CHECK( counts[3] == 1 && counts[4] == 1 && counts[5] == 0 );
+
+    SketchCleanup( &sketch );
+}
+
+static VOID
+TestLongName (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Checks that a long name keeps its end.
+
+--*/
+{
+    LOG_SKETCH sketch;
+    TEST_RECORD record;
+    SKETCH_COUNT top[2];
+    CHAR path[300];
+    ULONG length;
+    ULONG i;
+
+    memset( path, 'a', sizeof(path) );
+    memcpy( path, "\\Device\\", 8 );
+    memcpy( path + sizeof(path) - 12, "\\tail42.dat", 12 );
+
+    memset( &record, 0, sizeof(record) );
+    record.LogRecord.Length = sizeof(LOG_RECORD);
+    record.LogRecord.Data.OriginatingTime.QuadPart = TestNow();
+    FakeName( &record.LogRecord, path );
+    FakeName( &record.LogRecord, "\\Tool.exe" );
+    FakeName( &record.LogRecord, "S-1-5-18" );
+
+    CHECK( SketchInitialize( &sketch ) );
+    SketchAddRecord( &sketch, &record.LogRecord );
+
+    CHECK( SketchTop( &sketch, SketchKeyPath, 0, 60, 2, top ) == 1 );
+    CHECK( top[0].Estimate == 1 );
+
+    for (length = 0; top[0].Name[length] != UNICODE_NULL; length++) {
+    }
+
+    CHECK( length == SKETCH_KEY_LENGTH - 1 );
+    CHECK( top[0].Name[0] == L'.' && top[0].Name[2] == L'.' && top[0].Name[3] == L'a' );
+
+    for (i = 0; i < 11; i++) {
+
+        CHECK( top[0].Name[length - 11 + i] == (UCHAR) path[sizeof(path) - 12 + i] );
+    }
+
+    SketchCleanup( &sketch );
+}
+
+typedef struct _TEST_THREAD {
+
+    PLOG_SKETCH Sketch;
+    LONGLONG Now;
+    ULONG Records;
+    ULONG Number;
+
+} TEST_THREAD, *PTEST_THREAD;
+
+static void *
+TestAdder (
+    void *Context
+    )
+{
+    PTEST_THREAD thread = Context;
+    TEST_RECORD record;
+    ULONGLONG state = 0x9E3779B97F4A7C15ULL * (thread->Number + 1);
+    ULONG i;
+
+    for (i = 0; i < thread->Records; i++) {
+
+        FakeRecord( &record,
+                    thread->Now - (i % 30) * TEST_MINUTE,
+                    'W',
+                    TestSkewed( &state, TEST_PATHS ),
+                    thread->Number,
+                    0 );
+
+        SketchAddRecord( thread->Sketch, &record.LogRecord );
+    }
+
+    return NULL;
+}
+
+static VOID
+TestConcurrent (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Adds records from several threads while the main one reports, as the
+    log thread and the command prompt do, and checks nothing was lost.
+
+--*/
+{
+    LOG_SKETCH sketch;
+    TEST_THREAD threads[TEST_THREADS];
+    pthread_t handles[TEST_THREADS];
+    SKETCH_COUNT top[10];
+    ULONGLONG counts[SKETCH_DISPOSITIONS];
+    ULONG i;
+
+    CHECK( SketchInitialize( &sketch ) );
+
+    for (i = 0; i < TEST_THREADS; i++) {
+
+        threads[i].Sketch = &sketch;
+        threads[i].Now = TestNow();
+        threads[i].Records = TEST_RECORDS / TEST_THREADS;
+        threads[i].Number = i;
+        CHECK( pthread_create( &handles[i], NULL, TestAdder, &threads[i] ) == 0 );
+    }
+
+    for (i = 0; i < 20; i++) {
+
+        SketchTop( &sketch, SketchKeyPath, 0, 60, 10, top );
+        SketchDistinct( &sketch, SketchKeyPath, 0, 60 );
+    }
+
+    for (i = 0; i < TEST_THREADS; i++) {
+
+        pthread_join( handles[i], NULL );
+    }
+
+    SketchDispositions( &sketch, 60, counts );
+    CHECK( counts[4] == (TEST_RECORDS / TEST_THREADS) * TEST_THREADS );
+
+    CHECK( SketchTop( &sketch, SketchKeyProcess, 0, 60, 10, top ) == TEST_THREADS );
+
+    for (i = 0; i < TEST_THREADS; i++) {
+
+        CHECK( top[i].Estimate >= TEST_RECORDS / TEST_THREADS );
+    }
+
+    SketchCleanup( &sketch );
+}
+
+//---------------------------------------------------------------------------
+//                    Benchmark
+//---------------------------------------------------------------------------
+
+static double
+Seconds (
+    __in struct timespec *Start
+    )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (now.tv_sec - Start->tv_sec) + (now.tv_nsec - Start->tv_nsec) / 1e9;
+}
+
+static int
+Benchmark (
+    __in ULONG Records
+    )
+/*++
+
+Routine Description:
+
+    Times adding Records records from one thread and from TEST_THREADS,
+    then each report over the hour and over the day.  The records are
+    made beforehand, so only the sketches are timed.
+
+--*/
+{
+    LOG_SKETCH sketch;
+    TEST_THREAD threads[TEST_THREADS];
+    pthread_t handles[TEST_THREADS];
+    SKETCH_COUNT top[20];
+    ULONGLONG counts[SKETCH_DISPOSITIONS];
+    PTEST_RECORD records;
+    ULONGLONG state = 0x123456789ULL;
+    LONGLONG now = TestNow();
+    struct timespec start;
+    double elapsed;
+    ULONG distinct = 0;
+    ULONG i;
+
+    records = malloc( 4096 * sizeof(TEST_RECORD) );
+    CHECK( records != NULL && SketchInitialize( &sketch ) );
+
+    for (i = 0; i < 4096; i++) {
+
+        FakeRecord( &records[i],
+                    now - (i % 60) * TEST_MINUTE,
+                    "RWD"[i % 3],
+                    TestSkewed( &state, 1000000 ),
+                    TestRandom( &state ) % 200,
+                    TestRandom( &state ) % 20 );
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    for (i = 0; i < Records; i++) {
+
+        SketchAddRecord( &sketch, &records[i % 4096].LogRecord );
+    }
+
+    elapsed = Seconds( &start );
+    printf( "1 thread:  %u records in %.2f s, %.0f records/s, %.0f ns each\n",
+            Records, elapsed, Records / elapsed, elapsed * 1e9 / Records );
+
+    SketchCleanup( &sketch );
+    CHECK( SketchInitialize( &sketch ) );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    for (i = 0; i < TEST_THREADS; i++) {
+
+        threads[i].Sketch = &sketch;
+        threads[i].Now = now;
+        threads[i].Records = Records / TEST_THREADS;
+        threads[i].Number = i;
+        pthread_create( &handles[i], NULL, TestAdder, &threads[i] );
+    }
+
+    for (i = 0; i < TEST_THREADS; i++) {
+
+        pthread_join( handles[i], NULL );
+    }
+
+    elapsed = Seconds( &start );
+    printf( "%u threads: %u records in %.2f s, %.0f records/s (records made while adding)\n",
+            TEST_THREADS, Records, elapsed, Records / elapsed );
+
+    SketchCleanup( &sketch );
+    CHECK( SketchInitialize( &sketch ) );
+
+    for (i = 0; i < Records; i++) {
+
+        SketchAddRecord( &sketch, &records[i % 4096].LogRecord );
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    SketchTop( &sketch, SketchKeyPath, 0, 60, 20, top );
+    printf( "top 20 files over the hour:      %8.3f ms\n", Seconds( &start ) * 1000 );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    SketchTop( &sketch, SketchKeyPath, 'W', 24 * 60, 20, top );
+    printf( "top 20 writers over the day:     %8.3f ms\n", Seconds( &start ) * 1000 );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    distinct = (ULONG) SketchDistinct( &sketch, SketchKeyPath, 0, 60 );
+    printf( "distinct files over the hour:    %8.3f ms (about %u)\n", Seconds( &start ) * 1000, distinct );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    SketchDispositions( &sketch, 60, counts );
+    printf( "records by access type:          %8.3f ms\n", Seconds( &start ) * 1000 );
+
+    printf( "sketches take %llu KB whatever the traffic\n",
+            (unsigned long long) (SKETCH_BUCKETS * sizeof(SKETCH_BUCKET) >> 10) );
+
+    SketchCleanup( &sketch );
+    free( records );
+
+    return (Failures != 0);
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) strtoul( argv[2], NULL, 10 ) : 2000000 );
+    }
+
+    TestTop();
+    TestDistinct();
+    TestWindow();
+    TestLongName();
+    TestConcurrent();
+
+    if (Failures != 0) {
+
+        printf( "mspySketchTest: %u checks failed\n", Failures );
+        return 1;
+    }
+
+    printf( "mspySketchTest: passed\n" );
+    return 0;
+}
@@ -0,0 +1,947 @@
+/*++
+
+Module Name:
+
+    mspyWriterTest.c
+
+Abstract:
+
+    Tests the log writer of mspyWriter.c and the index of mspyIndex.c on
+    real files, without the filter.  Batches of fake LOG_RECORDs are
+    appended as the log thread appends them, and the segments are read
+    back block by block the way a reader finds the end of the log: every
+    record must come back in order, every block must check, and a block
+    damaged after the fact must end the log where it is.
+
+    With -b the writer is run flat out at several commit intervals
+    instead, to show what each costs in throughput and per commit.  The
+    segments go to a directory made under the current one, or under the
+    directory given after the seconds.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "mspyWriter.h"
+
+//
+//  A fake record takes under 300 bytes, so TEST_BLOCK_RECORDS of them
+//  and the block header fit in one LOG_WRITER_ALIGN block.
+//
+
+#define TEST_BATCH_RECORDS  16
+#define TEST_BLOCK_RECORDS  8
+#define TEST_BATCH_SIZE     (TEST_BATCH_RECORDS * 512)
+#define TEST_SEGMENT_MB     4
+
+static ULONG Failures;
+
+#define CHECK(Condition)                                                \
+    ((Condition) ? (void) 0 :                                           \
+     (void) (Failures++, fprintf( stderr, "%s:%d: %s\n",                \
+                                  __FILE__, __LINE__, #Condition )))
+
+//
+//  What reading a log back found.  Blocks are numbered from 0 again at
+//  each run, which Runs counts; records carry SequenceNumbers that go
+//  on from one run to the next.
+//
+
+typedef struct _TEST_LOG {
+
+    ULONG Segments;
+    ULONG Runs;
+    ULONGLONG Blocks;
+    ULONGLONG Records;
+    ULONGLONG NextBlock;
+    ULONG NextSequence;
+    BOOLEAN InOrder;
+
+    //
+    //  Index entries that are whole and describe the block at their
+    //  offset, and of those the ones whose path filter holds the first
+    //  record of the block.
+    //
+
+    ULONGLONG Indexed;
+    ULONGLONG Found;
+
+    //
+    //  The size of each segment file and the bytes of blocks in it.
+    //
+
+    ULONGLONG FileSize[64];
+    ULONGLONG Used[64];
+
+} TEST_LOG, *PTEST_LOG;
+
+
+static VOID
+FakeName (
+    __inout PLOG_RECORD LogRecord,
+    __in CONST CHAR *Name
+    )
+/*++
+
+Routine Description:
+
+    Appends one line to a record's name as SpySetRecordName does.
+
+--*/
+{
+    PWCHAR copy = (PWCHAR) Add2Ptr( LogRecord, LogRecord->Length );
+    ULONG count = (ULONG) strlen( Name );
+    ULONG length = count * sizeof(WCHAR) + sizeof(WCHAR);
+    ULONG rounded = ROUND_TO_SIZE( length, sizeof(PVOID) );
+    ULONG index;
+
+    for (index = 0; index < count; index++) {
+
+        copy[index] = (UCHAR) Name[index];
+    }
+
+    copy[count] = L'\n';
+
+    for (index = length / sizeof(WCHAR); index < rounded / sizeof(WCHAR); index++) {
+
+        copy[index] = L' ';
+    }
+
+    copy[rounded / sizeof(WCHAR)] = UNICODE_NULL;
+    LogRecord->Length += rounded;
+}
+
+static VOID
+FakePath (
+    __in ULONG Sequence,
+    __out_ecount(Size) CHAR *Path,
+    __in ULONG Size
+    )
+{
+    snprintf( Path, Size, "\\Device\\HarddiskVolume2\\work\\%u\\%u.dat", Sequence % 13, Sequence );
+}
+
+static ULONG
+FakeBatch (
+    __out_bcount(TEST_BATCH_SIZE) PUCHAR Buffer,
+    __inout PULONG Sequence,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Packs Count records numbered on from Sequence, as GetMiniSpyLog
+    returns them, and gives their length.
+
+--*/
+{
+    PLOG_RECORD logRecord;
+    CHAR path[96];
+    ULONG used = 0;
+
+    while (Count-- != 0) {
+
+        logRecord = (PLOG_RECORD) (Buffer + used);
+        memset( logRecord, 0, sizeof(LOG_RECORD) );
+
+        logRecord->Length = sizeof(LOG_RECORD);
+        logRecord->SequenceNumber = *Sequence;
+        logRecord->RecordType = RECORD_TYPE_NORMAL;
+        logRecord->Data.OriginatingTime.QuadPart = 132000000000000000LL + *Sequence * 1000LL;
+        logRecord->Data.ProcessId = 4000 + *Sequence % 7;
+        logRecord->Data.Reserved[0] = 'W';
+
+        FakePath( *Sequence, path, sizeof(path) );
+        FakeName( logRecord, path );
+        FakeName( logRecord, "\\Windows\\System32\\svchost.exe" );
+        FakeName( logRecord, "S-1-5-18" );
+        logRecord->Length += ROUND_TO_SIZE( sizeof(UNICODE_NULL), sizeof(PVOID) );
+
+        used += logRecord->Length;
+        (*Sequence)++;
+    }
+
+    return used;
+}
+
+static BOOLEAN
+FakeAppend (
+    __inout PLOG_WRITER Writer,
+    __inout PULONG Sequence,
+    __in ULONG Count
+    )
+{
+    PVOID buffer[TEST_BATCH_SIZE / sizeof(PVOID)];
+    ULONG length = FakeBatch( (PUCHAR) buffer, Sequence, Count );
+
+    return LogWriterAppend( Writer, buffer, length, Count );
+}
+
+static VOID
+TestMakeDirectory (
+    __out_ecount(LOG_FILE_PATH) CHAR *Directory,
+    __in CONST CHAR *Parent
+    )
+{
+    if (snprintf( Directory, LOG_FILE_PATH, "%s/mspyWriterTest.XXXXXX", Parent ) >= LOG_FILE_PATH ||
+        mkdtemp( Directory ) == NULL) {
+
+        perror( Directory );
+        exit( 2 );
+    }
+}
+
+static VOID
+TestRemoveDirectory (
+    __in CONST CHAR *Directory
+    )
+{
+    CHAR path[LOG_FILE_PATH];
+    struct dirent *entry;
+    DIR *directory = opendir( Directory );
+
+    if (directory == NULL) {
+
+        return;
+    }
+
+    while ((entry = readdir( directory )) != NULL) {
+
+        if (strcmp( entry->d_name, "." ) != 0 && strcmp( entry->d_name, ".." ) != 0) {
+
+            if (snprintf( path, sizeof(path), "%s/%s", Directory, entry->d_name ) < (int) sizeof(path)) {
+
+                unlink( path );
+            }
+        }
+    }
+
+    closedir( directory );
+    rmdir( Directory );
+}
+
+static VOID
+TestFilePath (
+    __out_ecount(LOG_FILE_PATH) CHAR *Path,
+    __in CONST CHAR *Directory,
+    __in ULONG Number,
+    __in CONST CHAR *Suffix
+    )
+{
+    CHECK( snprintf( Path, LOG_FILE_PATH, "%s/%s%08u%s", Directory, LOG_SEGMENT_PREFIX, Number, Suffix ) < LOG_FILE_PATH );
+}
+
+static ULONGLONG
+TestFileSize (
+    __in CONST CHAR *Path
+    )
+{
+    struct stat status;
+
+    return (stat( Path, &status ) == 0) ? (ULONGLONG) status.st_size : 0;
+}
+
+static VOID
+TestDamage (
+    __in CONST CHAR *Path,
+    __in ULONGLONG Offset
+    )
+/*++
+
+Routine Description:
+
+    Flips the bits of one byte of a file, as a write torn by a crash
+    would leave it.
+
+--*/
+{
+    FILE *file = fopen( Path, "r+b" );
+    int byte;
+
+    CHECK( file != NULL );
+
+    if (file == NULL) {
+
+        return;
+    }
+
+    fseek( file, (long) Offset, SEEK_SET );
+    byte = fgetc( file );
+    fseek( file, (long) Offset, SEEK_SET );
+    fputc( ~byte & 0xFF, file );
+    fclose( file );
+}
+
+static BOOLEAN
+TestReadBlock (
+    __in LOG_FILE Segment,
+    __in ULONGLONG Offset,
+    __out_bcount(LOG_WRITER_BUFFER) PUCHAR Block,
+    __out PULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Reads the block at Offset and checks it as a reader of the log must.
+
+--*/
+{
+    PLOG_BLOCK_HEADER header = (PLOG_BLOCK_HEADER) Block;
+    ULONG bytesRead;
+
+    if (LogFileRead( Segment, Offset, Block, sizeof(LOG_BLOCK_HEADER), &bytesRead ) != ERROR_SUCCESS ||
+        bytesRead != sizeof(LOG_BLOCK_HEADER) ||
+        header->Signature != LOG_BLOCK_SIGNATURE ||
+        header->Length > LOG_WRITER_BUFFER - sizeof(LOG_BLOCK_HEADER)) {
+
+        return FALSE;
+    }
+
+    *Length = ROUND_TO_SIZE( sizeof(LOG_BLOCK_HEADER) + header->Length, LOG_WRITER_ALIGN );
+
+    if (LogFileRead( Segment, Offset, Block, *Length, &bytesRead ) != ERROR_SUCCESS ||
+        bytesRead != *Length) {
+
+        return FALSE;
+    }
+
+    return (BOOLEAN) (header->Checksum == LogWriterChecksum( header + 1, header->Length ));
+}
+
+static VOID
+TestReadIndex (
+    __in CONST CHAR *Directory,
+    __in ULONG Number,
+    __in LOG_FILE Segment,
+    __inout PTEST_LOG Log,
+    __out_bcount(LOG_WRITER_BUFFER) PUCHAR Block
+    )
+/*++
+
+Routine Description:
+
+    Reads a segment's index up to its first bad entry, checking each
+    entry against the block it describes.
+
+--*/
+{
+    PLOG_BLOCK_HEADER header = (PLOG_BLOCK_HEADER) Block;
+    PLOG_RECORD logRecord = (PLOG_RECORD) (header + 1);
+    LOG_RECORD_NAMES names;
+    LOG_INDEX_ENTRY entry;
+    LOG_FILE index;
+    ULONGLONG offset = 0;
+    ULONG bytesRead;
+    ULONG length;
+
+    if (LogFileOpen( Directory, LOG_SEGMENT_PREFIX, Number, LOG_INDEX_SUFFIX,
+                     LogFileModeRead, 0, &index ) != ERROR_SUCCESS) {
+
+        return;
+    }
+
+    while (LogFileRead( index, offset, &entry, sizeof(entry), &bytesRead ) == ERROR_SUCCESS &&
+           bytesRead == sizeof(entry) &&
+           LogIndexValid( &entry )) {
+
+        offset += sizeof(entry);
+
+        if (!TestReadBlock( Segment, entry.Offset, Block, &length ) ||
+            length != entry.Length ||
+            header->Block != entry.Block ||
+            header->Records != entry.Records) {
+
+            continue;
+        }
+
+        Log->Indexed++;
+
+        LogRecordNames( logRecord, &names );
+
+        if (LogBloomMayContain( entry.PathBloom, LOG_BLOOM_PATH_BITS, names.Path, names.PathLength ) &&
+            LogBloomMayContain( entry.ProcessBloom, LOG_BLOOM_PROCESS_BITS, names.Image, names.ImageLength ) &&
+            LogBloomMayContainId( entry.ProcessBloom, LOG_BLOOM_PROCESS_BITS, logRecord->Data.ProcessId ) &&
+            entry.FirstTime.QuadPart == logRecord->Data.OriginatingTime.QuadPart) {
+
+            Log->Found++;
+        }
+    }
+
+    LogFileClose( index );
+}
+
+static VOID
+TestReadLog (
+    __in CONST CHAR *Directory,
+    __in ULONG FirstSequence,
+    __out PTEST_LOG Log
+    )
+/*++
+
+Routine Description:
+
+    Reads every segment in Directory, in order, until its first block
+    that does not check, and every index beside them.
+
+--*/
+{
+    PUCHAR block = LogFileAllocate( LOG_WRITER_BUFFER );
+    PLOG_BLOCK_HEADER header = (PLOG_BLOCK_HEADER) block;
+    PLOG_RECORD logRecord;
+    PUCHAR end;
+    LOG_FILE segment;
+    CHAR path[LOG_FILE_PATH];
+    PULONG numbers;
+    ULONG count;
+    ULONG number;
+    ULONG length;
+    ULONG records;
+    ULONGLONG offset;
+
+    memset( Log, 0, sizeof(TEST_LOG) );
+    Log->NextSequence = FirstSequence;
+    Log->InOrder = TRUE;
+
+    count = LogFileList( Directory, LOG_SEGMENT_PREFIX, LOG_SEGMENT_SUFFIX, &numbers );
+
+    for (number = 0; number < count; number++) {
+
+        if (LogFileOpen( Directory, LOG_SEGMENT_PREFIX, numbers[number], LOG_SEGMENT_SUFFIX,
+                         LogFileModeRead, 0, &segment ) != ERROR_SUCCESS) {
+
+            CHECK( FALSE );
+            continue;
+        }
+
+        if (Log->Segments < sizeof(Log->Used) / sizeof(Log->Used[0])) {
+
+            TestFilePath( path, Directory, numbers[number], LOG_SEGMENT_SUFFIX );
+            Log->FileSize[Log->Segments] = TestFileSize( path );
+        }
+
+        offset = 0;
+
+        while (TestReadBlock( segment, offset, block, &length )) {
+
+            if (header->Block == 0) {
+
+                Log->Runs++;
+                Log->NextBlock = 0;
+            }
+
+            Log->InOrder = Log->InOrder && header->Block == Log->NextBlock;
+            Log->NextBlock = header->Block + 1;
+
+            logRecord = (PLOG_RECORD) (header + 1);
+            end = (PUCHAR) (header + 1) + header->Length;
+            records = 0;
+
+            while ((PUCHAR) logRecord < end) {
+
+                Log->InOrder = Log->InOrder && logRecord->SequenceNumber == Log->NextSequence;
+                Log->NextSequence = logRecord->SequenceNumber + 1;
+                records++;
+
+                logRecord = (PLOG_RECORD) Add2Ptr( logRecord, logRecord->Length );
+            }
+
+            Log->InOrder = Log->InOrder && records == header->Records;
+            Log->Records += records;
+            Log->Blocks++;
+            offset += length;
+        }
+
+        if (Log->Segments < sizeof(Log->Used) / sizeof(Log->Used[0])) {
+
+            Log->Used[Log->Segments] = offset;
+        }
+
+        TestReadIndex( Directory, numbers[number], segment, Log, block );
+
+        LogFileClose( segment );
+        Log->Segments++;
+    }
+
+    free( numbers );
+    LogFileFree( block );
+}
+
+//---------------------------------------------------------------------------
+//                    Tests
+//---------------------------------------------------------------------------
+
+static VOID
+TestRoundTrip (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Every batch committed as it arrives, across several segments: all the
+    records come back in order, each segment is trimmed to its blocks,
+    and every block has a matching index entry.
+
+--*/
+{
+    CHAR directory[LOG_FILE_PATH];
+    LOG_WRITER writer;
+    TEST_LOG log;
+    ULONG sequence = 1;
+    ULONG batch;
+    ULONG segment;
+    BOOLEAN trimmed = TRUE;
+
+    TestMakeDirectory( directory, "." );
+    CHECK( LogWriterInitialize( &writer ) );
+    CHECK( LogWriterStart( &writer, directory, TEST_SEGMENT_MB, 0, 0 ) == ERROR_SUCCESS );
+
+    //
+    //  A 4 KB block per batch, so 1024 of them to a segment.
+    //
+
+    for (batch = 0; batch < 2500; batch++) {
+
+        CHECK( FakeAppend( &writer, &sequence, 1 + batch % TEST_BLOCK_RECORDS ) );
+    }
+
+    CHECK( !LogWriterPending( &writer ) );
+    LogWriterStop( &writer );
+
+    CHECK( writer.Commits == 2500 );
+    CHECK( writer.RecordsWritten == sequence - 1 );
+    CHECK( writer.Segments == 3 );
+
+    TestReadLog( directory, 1, &log );
+
+    CHECK( log.InOrder );
+    CHECK( log.Runs == 1 );
+    CHECK( log.Segments == 3 );
+    CHECK( log.Blocks == 2500 );
+    CHECK( log.Records == sequence - 1 );
+    CHECK( log.Indexed == 2500 );
+    CHECK( log.Found == 2500 );
+
+    for (segment = 0; segment < log.Segments; segment++) {
+
+        trimmed = trimmed && log.FileSize[segment] == log.Used[segment];
+    }
+
+    CHECK( trimmed );
+    CHECK( log.Used[0] == 1024 * LOG_WRITER_ALIGN );
+
+    LogWriterCleanup( &writer );
+    TestRemoveDirectory( directory );
+}
+
+static VOID
+TestGroupCommit (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    With a commit interval, batches wait in the block until it is due,
+    forced or full, and nothing of them is on disk before that.  The
+    segment is preallocated to its full size while it is written.
+
+--*/
+{
+    CHAR directory[LOG_FILE_PATH];
+    CHAR path[LOG_FILE_PATH];
+    LOG_WRITER writer;
+    TEST_LOG log;
+    ULONG sequence = 1;
+    ULONG batch;
+
+    TestMakeDirectory( directory, "." );
+    CHECK( LogWriterInitialize( &writer ) );
+    CHECK( LogWriterStart( &writer, directory, TEST_SEGMENT_MB, 60000, 0 ) == ERROR_SUCCESS );
+
+    TestFilePath( path, directory, 0, LOG_SEGMENT_SUFFIX );
+    CHECK( TestFileSize( path ) == TEST_SEGMENT_MB * 1024 * 1024 );
+
+    for (batch = 0; batch < 5; batch++) {
+
+        CHECK( FakeAppend( &writer, &sequence, TEST_BATCH_RECORDS ) );
+    }
+
+    CHECK( LogWriterPending( &writer ) );
+    CHECK( LogWriterTick( &writer, FALSE ) );
+    CHECK( LogWriterPending( &writer ) );
+    CHECK( writer.Commits == 0 );
+
+    TestReadLog( directory, 1, &log );
+    CHECK( log.Blocks == 0 );
+
+    CHECK( LogWriterTick( &writer, TRUE ) );
+    CHECK( !LogWriterPending( &writer ) );
+    CHECK( writer.Commits == 1 );
+
+    TestReadLog( directory, 1, &log );
+    CHECK( log.InOrder );
+    CHECK( log.Blocks == 1 );
+    CHECK( log.Records == 5 * TEST_BATCH_RECORDS );
+    CHECK( log.Indexed == 1 );
+
+    //
+    //  Over 3 MB of batches fill the block a few times before it is due.
+    //
+
+    for (batch = 0; batch < 700; batch++) {
+
+        CHECK( FakeAppend( &writer, &sequence, TEST_BATCH_RECORDS ) );
+    }
+
+    CHECK( writer.Commits >= 3 );
+    CHECK( LogWriterPending( &writer ) );
+
+    LogWriterStop( &writer );
+
+    TestReadLog( directory, 1, &log );
+    CHECK( log.InOrder );
+    CHECK( log.Segments == 1 );
+    CHECK( log.Records == sequence - 1 );
+    CHECK( log.Blocks == writer.Commits );
+    CHECK( log.Indexed == log.Blocks );
+    CHECK( log.FileSize[0] == writer.SegmentUsed );
+    CHECK( log.FileSize[0] < TEST_SEGMENT_MB * 1024 * 1024 );
+
+    LogWriterCleanup( &writer );
+    TestRemoveDirectory( directory );
+}
+
+static VOID
+TestRotateInterval (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A segment open longer than the rotate interval is closed at the next
+    commit, and block numbers go on in the next one.
+
+--*/
+{
+    CHAR directory[LOG_FILE_PATH];
+    LOG_WRITER writer;
+    TEST_LOG log;
+    ULONG sequence = 1;
+    ULONG round;
+
+    TestMakeDirectory( directory, "." );
+    CHECK( LogWriterInitialize( &writer ) );
+    CHECK( LogWriterStart( &writer, directory, TEST_SEGMENT_MB, 0, 20 ) == ERROR_SUCCESS );
+
+    for (round = 0; round < 3; round++) {
+
+        CHECK( FakeAppend( &writer, &sequence, TEST_BATCH_RECORDS ) );
+        CHECK( FakeAppend( &writer, &sequence, TEST_BATCH_RECORDS ) );
+        usleep( 30 * 1000 );
+    }
+
+    LogWriterStop( &writer );
+
+    TestReadLog( directory, 1, &log );
+
+    CHECK( writer.Segments == 3 );
+    CHECK( log.Segments == 3 );
+    CHECK( log.Runs == 1 );
+    CHECK( log.InOrder );
+    CHECK( log.Blocks == 6 );
+    CHECK( log.Records == 6 * TEST_BATCH_RECORDS );
+
+    LogWriterCleanup( &writer );
+    TestRemoveDirectory( directory );
+}
+
+static VOID
+TestTorn (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A block damaged after it was written ends the log there, though the
+    blocks after it are whole.  A damaged index entry ends the index.
+
+--*/
+{
+    CHAR directory[LOG_FILE_PATH];
+    CHAR path[LOG_FILE_PATH];
+    LOG_WRITER writer;
+    TEST_LOG log;
+    ULONG sequence = 1;
+    ULONG batch;
+
+    TestMakeDirectory( directory, "." );
+    CHECK( LogWriterInitialize( &writer ) );
+    CHECK( LogWriterStart( &writer, directory, TEST_SEGMENT_MB, 0, 0 ) == ERROR_SUCCESS );
+
+    for (batch = 0; batch < 50; batch++) {
+
+        CHECK( FakeAppend( &writer, &sequence, TEST_BLOCK_RECORDS ) );
+    }
+
+    LogWriterStop( &writer );
+
+    TestReadLog( directory, 1, &log );
+    CHECK( log.Blocks == 50 );
+    CHECK( log.Used[0] == 50 * LOG_WRITER_ALIGN );
+
+    //
+    //  One byte of the records of block 30, then of the index entry of
+    //  block 10.
+    //
+
+    TestFilePath( path, directory, 0, LOG_SEGMENT_SUFFIX );
+    TestDamage( path, 30 * LOG_WRITER_ALIGN + sizeof(LOG_BLOCK_HEADER) + 100 );
+
+    TestReadLog( directory, 1, &log );
+    CHECK( log.InOrder );
+    CHECK( log.Blocks == 30 );
+    CHECK( log.Records == 30 * TEST_BLOCK_RECORDS );
+    CHECK( log.Indexed == 49 );
+
+    TestFilePath( path, directory, 0, LOG_INDEX_SUFFIX );
+    TestDamage( path, 10 * sizeof(LOG_INDEX_ENTRY) + FIELD_OFFSET( LOG_INDEX_ENTRY, PathBloom ) + 7 );
+
+    TestReadLog( directory, 1, &log );
+    CHECK( log.Indexed == 10 );
+
+    //
+    //  A header torn off the first block.
+    //
+
+    TestFilePath( path, directory, 0, LOG_SEGMENT_SUFFIX );
+    TestDamage( path, 0 );
+
+    TestReadLog( directory, 1, &log );
+    CHECK( log.Blocks == 0 );
+
+    LogWriterCleanup( &writer );
+    TestRemoveDirectory( directory );
+}
+
+static VOID
+TestRestart (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A new run goes on after the highest numbered segment in the
+    directory, ignoring files that only look like segments.
+
+--*/
+{
+    static CONST CHAR *others[] = {
+        "minispy-00000003.log", "minispy-00000010.log", "MINISPY-00000030.log", "minispy-x.log",
+        "minispy-00000011.idx", "minispy-00000012.log.bak", "minispy-.log",
+        "minispy-12x.log", "other-00000020.log"
+    };
+    CHAR directory[LOG_FILE_PATH];
+    CHAR path[LOG_FILE_PATH];
+    LOG_WRITER writer;
+    TEST_LOG log;
+    PULONG numbers;
+    ULONG sequence = 1;
+    ULONG count;
+    ULONG i;
+    FILE *file;
+
+    TestMakeDirectory( directory, "." );
+
+    for (i = 0; i < sizeof(others) / sizeof(others[0]); i++) {
+
+        CHECK( snprintf( path, sizeof(path), "%s/%s", directory, others[i] ) < (int) sizeof(path) );
+        file = fopen( path, "wb" );
+        CHECK( file != NULL );
+
+        if (file != NULL) {
+
+            fclose( file );
+        }
+    }
+
+    count = LogFileList( directory, LOG_SEGMENT_PREFIX, LOG_SEGMENT_SUFFIX, &numbers );
+
+    CHECK( count == 2 );
+    CHECK( count == 2 && numbers[0] == 3 && numbers[1] == 10 );
+    free( numbers );
+
+    CHECK( LogWriterInitialize( &writer ) );
+    CHECK( LogWriterStart( &writer, directory, TEST_SEGMENT_MB, 0, 0 ) == ERROR_SUCCESS );
+    CHECK( FakeAppend( &writer, &sequence, TEST_BLOCK_RECORDS ) );
+    LogWriterStop( &writer );
+
+    TestFilePath( path, directory, 11, LOG_SEGMENT_SUFFIX );
+    CHECK( TestFileSize( path ) == LOG_WRITER_ALIGN );
+
+    CHECK( LogWriterStart( &writer, directory, TEST_SEGMENT_MB, 0, 0 ) == ERROR_SUCCESS );
+    CHECK( FakeAppend( &writer, &sequence, TEST_BLOCK_RECORDS ) );
+    CHECK( FakeAppend( &writer, &sequence, TEST_BLOCK_RECORDS ) );
+    LogWriterStop( &writer );
+
+    TestFilePath( path, directory, 12, LOG_SEGMENT_SUFFIX );
+    CHECK( TestFileSize( path ) == 2 * LOG_WRITER_ALIGN );
+
+    TestReadLog( directory, 1, &log );
+
+    CHECK( log.Segments == 4 );
+    CHECK( log.Runs == 2 );
+    CHECK( log.InOrder );
+    CHECK( log.Blocks == 3 );
+    CHECK( log.Records == 3 * TEST_BLOCK_RECORDS );
+
+    LogWriterCleanup( &writer );
+    TestRemoveDirectory( directory );
+}
+
+static VOID
+TestFailure (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    A directory that cannot be written to fails the start, and the
+    stopped writer takes batches without writing them.
+
+--*/
+{
+    LOG_WRITER writer;
+    ULONG sequence = 1;
+
+    CHECK( LogWriterInitialize( &writer ) );
+    CHECK( LogWriterStart( &writer, "mspyWriterTest.missing/log", TEST_SEGMENT_MB, 0, 0 ) != ERROR_SUCCESS );
+    CHECK( writer.LastError != ERROR_SUCCESS );
+    CHECK( FakeAppend( &writer, &sequence, TEST_BATCH_RECORDS ) );
+    CHECK( !LogWriterPending( &writer ) );
+    CHECK( writer.RecordsWritten == 0 );
+
+    LogWriterCleanup( &writer );
+}
+
+//---------------------------------------------------------------------------
+//                    Benchmark
+//---------------------------------------------------------------------------
+
+static int
+Benchmark (
+    __in ULONG Seconds,
+    __in CONST CHAR *Parent
+    )
+/*++
+
+Routine Description:
+
+    Appends batches as fast as the writer takes them at each commit
+    interval and prints the rate and what a commit costs.  At 0 every
+    batch goes to disk on its own.
+
+--*/
+{
+    static CONST ULONG intervals[] = { 0, 1, 10, 100 };
+    CHAR directory[LOG_FILE_PATH];
+    LOG_WRITER writer;
+    ULONG sequence = 1;
+    ULONG i;
+    struct timespec start;
+    struct timespec now;
+    double elapsed;
+
+    CHECK( LogWriterInitialize( &writer ) );
+
+    for (i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+
+        TestMakeDirectory( directory, Parent );
+
+        if (LogWriterStart( &writer, directory, 64, intervals[i], 0 ) != ERROR_SUCCESS) {
+
+            printf( "cannot write to %s: error %u\n", directory, writer.LastError );
+            TestRemoveDirectory( directory );
+            break;
+        }
+
+        clock_gettime( CLOCK_MONOTONIC, &start );
+
+        do {
+
+            ULONG round;
+
+            for (round = 0; round < 64; round++) {
+
+                FakeAppend( &writer, &sequence, TEST_BATCH_RECORDS );
+            }
+
+            clock_gettime( CLOCK_MONOTONIC, &now );
+            elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+        } while (elapsed < Seconds);
+
+        LogWriterStop( &writer );
+
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf( "commit every %3u ms: %7.1f MB/s, %9.0f records/s, %7u commits, "
+                "%6llu us a commit on average, %6llu us at most\n",
+                intervals[i],
+                writer.BytesWritten / elapsed / (1024 * 1024),
+                writer.RecordsWritten / elapsed,
+                writer.Commits,
+                writer.Commits != 0 ? (unsigned long long) (writer.CommitTime / writer.Commits) : 0ULL,
+                (unsigned long long) writer.CommitTimeMax );
+
+        TestRemoveDirectory( directory );
+    }
+
+    LogWriterCleanup( &writer );
+    return (Failures != 0);
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    if (argc > 1 && strcmp( argv[1], "-b" ) == 0) {
+
+        return Benchmark( argc > 2 ? (ULONG) atoi( argv[2] ) : 2,
+                          argc > 3 ? argv[3] : "." );
+    }
+
+    TestRoundTrip();
+    TestGroupCommit();
+    TestRotateInterval();
+    TestTorn();
+    TestRestart();
+    TestFailure();
+
+    if (Failures != 0) {
+
+        printf( "mspyWriterTest: %u checks failed\n", Failures );
+        return 1;
+    }
+
+    printf( "mspyWriterTest: passed\n" );
+    return 0;
+}